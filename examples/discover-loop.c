@@ -65,21 +65,15 @@ int main()
 		fprintf(stderr, "Failed to allocated memory\n");
 		return ENOMEM;
 	}
-	c = nvme_create_ctrl(r, NVME_DISC_SUBSYS_NAME, "loop",
-			     NULL, NULL, NULL, NULL);
+	/* stays connected, and is picked up again by the next run */
+	c = nvmf_connect_discovery_ctrl(h, "loop", NULL, NULL, NULL, NULL,
+					&cfg);
 	if (!c) {
-		fprintf(stderr, "Failed to allocate memory\n");
-		return ENOMEM;
-	}
-	ret = nvmf_add_ctrl(h, c, &cfg);
-	if (ret < 0) {
 		fprintf(stderr, "no controller found\n");
 		return errno;
 	}
 
 	ret = nvmf_get_discovery_log(c, &log, 4);
-	nvme_disconnect_ctrl(c);
-	nvme_free_ctrl(c);
 
 	if (ret)
 		fprintf(stderr, "nvmf-discover-log:%x\n", ret);
@@ -20,9 +20,12 @@
 %rename(ns)        nvme_ns;
 
 %{
+#include <ccan/endian/endian.h>
 #include <ccan/list/list.h>
 #include "nvme/tree.h"
 #include "nvme/fabrics.h"
+#include "nvme/ioctl.h"
+#include "nvme/linux.h"
 #include "nvme/private.h"
 #include "nvme/log.h"
 
@@ -176,6 +179,105 @@ static void PyDict_SetItemStringDecRef(PyObject *p, const char *key, PyObject *v
 }
 %}
 
+/*
+ * Buffers allocated by libnvme are handed to Python without copying: a
+ * buffer object owns the allocation and exports it through the buffer
+ * protocol, and is returned wrapped in a memoryview. Views built over it,
+ * e.g. with struct.unpack_from(), ctypes from_buffer() or numpy, keep it
+ * alive, and it is freed together with the last of them.
+ */
+%{
+typedef struct {
+  PyObject_HEAD
+  void *buf;
+  Py_ssize_t len;
+} nvme_buffer_object;
+
+static void nvme_buffer_dealloc(PyObject *self) {
+  free(((nvme_buffer_object *)self)->buf);
+  Py_TYPE(self)->tp_free(self);
+}
+
+static int nvme_buffer_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+  nvme_buffer_object *b = (nvme_buffer_object *)self;
+
+  return PyBuffer_FillInfo(view, self, b->buf, b->len, 0, flags);
+}
+
+static PyBufferProcs nvme_buffer_as_buffer = {
+  .bf_getbuffer = nvme_buffer_getbuffer,
+};
+
+static PyTypeObject nvme_buffer_type = {
+  PyVarObject_HEAD_INIT(NULL, 0)
+  .tp_name = "libnvme.nvme.buffer",
+  .tp_basicsize = sizeof(nvme_buffer_object),
+  .tp_dealloc = nvme_buffer_dealloc,
+  .tp_as_buffer = &nvme_buffer_as_buffer,
+  .tp_flags = Py_TPFLAGS_DEFAULT,
+  .tp_doc = "Memory allocated by libnvme",
+};
+
+/* Takes ownership of @buf, which is freed on failure */
+static PyObject *nvme_buffer_view(void *buf, size_t len) {
+  nvme_buffer_object *b;
+  PyObject *view;
+
+  if (!(nvme_buffer_type.tp_flags & Py_TPFLAGS_READY) &&
+      PyType_Ready(&nvme_buffer_type) < 0) {
+    free(buf);
+    return NULL;
+  }
+  b = PyObject_New(nvme_buffer_object, &nvme_buffer_type);
+  if (!b) {
+    free(buf);
+    return NULL;
+  }
+  b->buf = buf;
+  b->len = len;
+  view = PyMemoryView_FromObject((PyObject *)b);
+  Py_DECREF(b);
+  return view;
+}
+
+/* Sets the Python exception for a failed command, returns NULL */
+static PyObject *nvme_set_cmd_error(int ret) {
+  if (ret < 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
+  PyErr_Format(PyExc_RuntimeError, "Status:0x%04x - %s", ret,
+               nvme_status_to_string(ret, false));
+  return NULL;
+}
+
+static int nvme_ctrl_fd(struct nvme_ctrl *c) {
+  int fd = nvme_ctrl_get_fd(c);
+
+  if (fd < 0)
+    PyErr_SetFromErrno(PyExc_OSError);
+  return fd;
+}
+%}
+
+/*
+ * Writable buffers passed by the caller, e.g. a bytearray, a memoryview
+ * or a numpy array, are filled in place. The buffer is held until the
+ * call returned, so the exporter can't resize or free the memory while
+ * the command writes to it.
+ */
+%typemap(in) (unsigned char *buf, size_t len) (Py_buffer view, int have_view = 0) {
+  if (PyObject_GetBuffer($input, &view,
+                         PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0)
+    SWIG_fail;
+  have_view = 1;
+  $1 = view.buf;
+  $2 = view.len;
+}
+
+%typemap(freearg) (unsigned char *buf, size_t len) {
+  if (have_view$argnum)
+    PyBuffer_Release(&view$argnum);
+}
+
 %typemap(out) struct nvmf_discovery_log * {
   struct nvmf_discovery_log *log = $1;
   int numrec = log? log->numrec : 0, i;
@@ -620,6 +722,132 @@ struct nvme_ns {
     }
     return logp;
   }
+
+  %feature("autodoc", "@return: Discovery Log Page as a memoryview, see disc_log_view.") discovery_log;
+  PyObject *discovery_log(int max_retries = 6) {
+    struct nvmf_discovery_log *logp = NULL;
+    size_t len;
+
+    if (nvmf_get_discovery_log($self, &logp, max_retries) < 0)
+      return PyErr_SetFromErrno(PyExc_OSError);
+    len = sizeof(*logp) + le64_to_cpu(logp->numrec) * sizeof(logp->entries[0]);
+    return nvme_buffer_view(logp, len);
+  }
+
+  %feature("autodoc", "@return: Identify Controller data structure as a memoryview.") identify;
+  PyObject *identify() {
+    void *id;
+    int fd, ret;
+
+    fd = nvme_ctrl_fd($self);
+    if (fd < 0)
+      return NULL;
+    if (posix_memalign(&id, getpagesize(), NVME_IDENTIFY_DATA_SIZE))
+      return PyErr_NoMemory();
+    ret = nvme_identify_ctrl(fd, id);
+    if (ret) {
+      free(id);
+      return nvme_set_cmd_error(ret);
+    }
+    return nvme_buffer_view(id, NVME_IDENTIFY_DATA_SIZE);
+  }
+
+  %feature("autodoc", "Reads the Identify Controller data structure into a writable buffer of at least 4096 bytes.") identify_into;
+  PyObject *identify_into(unsigned char *buf, size_t len) {
+    int fd, ret;
+
+    if (len < NVME_IDENTIFY_DATA_SIZE) {
+      PyErr_SetString(PyExc_ValueError, "buffer too small");
+      return NULL;
+    }
+    fd = nvme_ctrl_fd($self);
+    if (fd < 0)
+      return NULL;
+    ret = nvme_identify_ctrl(fd, (struct nvme_id_ctrl *)buf);
+    if (ret)
+      return nvme_set_cmd_error(ret);
+    Py_RETURN_NONE;
+  }
+
+  %feature("autodoc", "@return: len bytes of log page lid as a memoryview.") get_log;
+  PyObject *get_log(int lid, unsigned int len, unsigned int nsid = NVME_NSID_ALL,
+                    bool rae = false) {
+    struct nvme_get_log_args args = {
+      .args_size = sizeof(args),
+      .timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+      .lid = lid,
+      .len = len,
+      .nsid = nsid,
+      .csi = NVME_CSI_NVM,
+      .lsi = NVME_LOG_LSI_NONE,
+      .lsp = NVME_LOG_LSP_NONE,
+      .uuidx = NVME_UUID_NONE,
+      .rae = rae,
+    };
+    int ret;
+
+    args.fd = nvme_ctrl_fd($self);
+    if (args.fd < 0)
+      return NULL;
+    if (posix_memalign(&args.log, getpagesize(), len ? len : 1))
+      return PyErr_NoMemory();
+    ret = nvme_get_log_page(args.fd, 0, &args);
+    if (ret) {
+      free(args.log);
+      return nvme_set_cmd_error(ret);
+    }
+    return nvme_buffer_view(args.log, len);
+  }
+
+  %feature("autodoc", "Reads log page lid into a writable buffer, filling all of it.") get_log_into;
+  PyObject *get_log_into(int lid, unsigned char *buf, size_t len,
+                         unsigned int nsid = NVME_NSID_ALL, bool rae = false) {
+    struct nvme_get_log_args args = {
+      .args_size = sizeof(args),
+      .timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+      .lid = lid,
+      .log = buf,
+      .len = len,
+      .nsid = nsid,
+      .csi = NVME_CSI_NVM,
+      .lsi = NVME_LOG_LSI_NONE,
+      .lsp = NVME_LOG_LSP_NONE,
+      .uuidx = NVME_UUID_NONE,
+      .rae = rae,
+    };
+    int ret;
+
+    if (len > UINT32_MAX) {
+      PyErr_SetString(PyExc_ValueError, "buffer too large");
+      return NULL;
+    }
+    args.fd = nvme_ctrl_fd($self);
+    if (args.fd < 0)
+      return NULL;
+    ret = nvme_get_log_page(args.fd, 0, &args);
+    if (ret)
+      return nvme_set_cmd_error(ret);
+    Py_RETURN_NONE;
+  }
+
+  %feature("autodoc", "@return: Telemetry log up to data area da as a memoryview.") telemetry;
+  PyObject *telemetry(bool host = false, int da = NVME_TELEMETRY_DA_3) {
+    struct nvme_telemetry_log *log = NULL;
+    size_t size = 0;
+    int fd, ret;
+
+    fd = nvme_ctrl_fd($self);
+    if (fd < 0)
+      return NULL;
+    if (host)
+      ret = nvme_get_new_host_telemetry(fd, &log, da, &size);
+    else
+      ret = nvme_get_ctrl_telemetry(fd, true, &log, da, &size);
+    if (ret)
+      return nvme_set_cmd_error(ret);
+    return nvme_buffer_view(log, size);
+  }
+
   char *__str__() {
     static char tmp[1024];
 
@@ -687,6 +915,54 @@ struct nvme_ns {
   }
 %};
 
+%pythoncode %{
+import struct as _struct
+
+class disc_log_entry_view(object):
+    """Discovery Log Page Entry, decoded from the log buffer on access"""
+    def __init__(self, buf):
+        self._buf = buf
+
+    def _str(self, offset, size):
+        return bytes(self._buf[offset:offset + size]).split(b'\0', 1)[0].rstrip().decode()
+
+    trtype = property(lambda self: self._buf[0])
+    adrfam = property(lambda self: self._buf[1])
+    subtype = property(lambda self: self._buf[2])
+    treq = property(lambda self: self._buf[3])
+    portid = property(lambda self: _struct.unpack_from('<H', self._buf, 4)[0])
+    cntlid = property(lambda self: _struct.unpack_from('<H', self._buf, 6)[0])
+    asqsz = property(lambda self: _struct.unpack_from('<H', self._buf, 8)[0])
+    eflags = property(lambda self: _struct.unpack_from('<H', self._buf, 10)[0])
+    trsvcid = property(lambda self: self._str(32, 32))
+    subnqn = property(lambda self: self._str(256, 256))
+    traddr = property(lambda self: self._str(512, 256))
+    tsas = property(lambda self: self._buf[768:1024])
+
+class disc_log_view(object):
+    """Sequence of the entries of a Discovery Log Page returned by
+    ctrl.discovery_log(), without copying the log"""
+    HEADER_SIZE = 1024
+    ENTRY_SIZE = 1024
+
+    def __init__(self, buf):
+        self._buf = memoryview(buf).cast('B')
+
+    genctr = property(lambda self: _struct.unpack_from('<Q', self._buf, 0)[0])
+    recfmt = property(lambda self: _struct.unpack_from('<H', self._buf, 16)[0])
+
+    def __len__(self):
+        numrec = _struct.unpack_from('<Q', self._buf, 8)[0]
+        return min(numrec, (len(self._buf) - self.HEADER_SIZE) // self.ENTRY_SIZE)
+
+    def __getitem__(self, i):
+        if i < 0:
+            i += len(self)
+        if i < 0 or i >= len(self):
+            raise IndexError('discovery log entry out of range')
+        offset = self.HEADER_SIZE + i * self.ENTRY_SIZE
+        return disc_log_entry_view(self._buf[offset:offset + self.ENTRY_SIZE])
+%}
 
 // We want to swig all the #define and enum from types.h, but none of the structs.
 %{
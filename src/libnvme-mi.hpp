@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+
+#ifndef _LIBNVME_MI_HPP
+#define _LIBNVME_MI_HPP
+
+/*
+ * Header-only C++17 layer over libnvme-mi, see libnvme.hpp: move-only
+ * owners for the MI root, endpoints and controllers, range-based
+ * iteration over them, and the same span and compile time sized log page
+ * calls as for the ioctl interface.
+ */
+
+#include <cerrno>
+#include <cstddef>
+
+#include "libnvme-mi.h"
+#include "nvme/cxx.hpp"
+
+namespace libnvme {
+namespace mi {
+
+using endpoint_range = node_range<nvme_root_t, nvme_mi_ep_t,
+				  nvme_mi_first_endpoint,
+				  nvme_mi_next_endpoint>;
+using ctrl_range = node_range<nvme_mi_ep_t, nvme_mi_ctrl_t,
+			      nvme_mi_first_ctrl, nvme_mi_next_ctrl>;
+
+inline endpoint_range endpoints(nvme_root_t m) noexcept
+{
+	return endpoint_range(m);
+}
+inline ctrl_range ctrls(nvme_mi_ep_t ep) noexcept { return ctrl_range(ep); }
+
+/*
+ * Owner of an MI root, freed with nvme_mi_free_root() together with the
+ * endpoints which are still open.
+ */
+class root : public unique_handle<struct nvme_root, nvme_mi_free_root> {
+public:
+	using unique_handle::unique_handle;
+
+	/* nvme_mi_create_root(), check the result with operator bool */
+	static root create(FILE *fp = nullptr,
+			   int log_level = DEFAULT_LOGLEVEL) noexcept
+	{
+		return root(nvme_mi_create_root(fp, log_level));
+	}
+
+	/* nvme_mi_scan_mctp() */
+	static root scan_mctp() noexcept { return root(nvme_mi_scan_mctp()); }
+
+	endpoint_range endpoints() const noexcept
+	{
+		return endpoint_range(get());
+	}
+};
+
+/* Owner of an endpoint, closed with nvme_mi_close() */
+class endpoint : public unique_handle<struct nvme_mi_ep, nvme_mi_close> {
+public:
+	using unique_handle::unique_handle;
+
+	/* nvme_mi_open_mctp() */
+	static endpoint open_mctp(nvme_root_t m, unsigned int netid,
+				  uint8_t eid) noexcept
+	{
+		return endpoint(nvme_mi_open_mctp(m, netid, eid));
+	}
+
+	ctrl_range ctrls() const noexcept { return ctrl_range(get()); }
+};
+
+/* Owner of a controller, closed with nvme_mi_close_ctrl() */
+class ctrl : public unique_handle<struct nvme_mi_ctrl, nvme_mi_close_ctrl> {
+public:
+	using unique_handle::unique_handle;
+
+	/* nvme_mi_init_ctrl() */
+	static ctrl init(nvme_mi_ep_t ep, __u16 ctrl_id) noexcept
+	{
+		return ctrl(nvme_mi_init_ctrl(ep, ctrl_id));
+	}
+};
+
+/*
+ * Reads @buf.size_bytes() bytes of a log page into @buf with
+ * nvme_mi_admin_get_log(), which splits it to fit the MI message size.
+ */
+template <typename T>
+inline int get_log(nvme_mi_ctrl_t c, enum nvme_cmd_get_log_lid lid,
+		   span<T> buf, __u32 nsid = NVME_NSID_ALL,
+		   bool rae = false) noexcept
+{
+	static_assert(std::is_trivially_copyable_v<T>,
+		      "log pages are read into plain data");
+	struct nvme_get_log_args args = log_args(-1, lid, nsid, rae,
+						 buf.data(), buf.size_bytes());
+
+	if (buf.size_bytes() > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	return nvme_mi_admin_get_log(c, &args);
+}
+
+/* Reads a fixed size log page into @log, see libnvme::get_log<>() */
+template <enum nvme_cmd_get_log_lid Lid>
+inline int get_log(nvme_mi_ctrl_t c, typename log_page_traits<Lid>::type &log,
+		   __u32 nsid = log_page_traits<Lid>::nsid,
+		   bool rae = false) noexcept
+{
+	using type = typename log_page_traits<Lid>::type;
+	struct nvme_get_log_args args = log_args(-1, Lid, nsid, rae, &log,
+						 sizeof(type));
+
+	return nvme_mi_admin_get_log(c, &args);
+}
+
+} /* namespace mi */
+} /* namespace libnvme */
+
+#endif /* _LIBNVME_MI_HPP */
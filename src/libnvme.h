@@ -22,6 +22,13 @@ extern "C" {
 #include "nvme/tree.h"
 #include "nvme/util.h"
 #include "nvme/log.h"
+#include "nvme/uring.h"
+#include "nvme/monitor.h"
+#include "nvme/zns.h"
+#include "nvme/pi.h"
+#include "nvme/progress.h"
+#include "nvme/replay.h"
+#include "nvme/sampler.h"
 
 #ifdef __cplusplus
 }
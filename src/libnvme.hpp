@@ -0,0 +1,189 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+
+#ifndef _LIBNVME_HPP
+#define _LIBNVME_HPP
+
+/*
+ * Header-only C++17 layer over libnvme:
+ *
+ * - move-only owners for the objects the library allocates and the
+ *   caller has to free, see libnvme::root and libnvme::log_buffer
+ * - range-based iteration over the tree, e.g.
+ *	for (nvme_host_t h : libnvme::hosts(r))
+ * - I/O and log page calls taking a libnvme::span over caller memory,
+ *   so no temporary buffer is allocated
+ * - log page fetchers selected by the log identifier at compile time,
+ *   which know the size of the log page, see libnvme::get_log()
+ *
+ * The calls return what the C functions return: 0 on success, the
+ * nvme command status if a response was received, or -1 with errno set.
+ * Nothing throws.
+ */
+
+#include <cerrno>
+#include <cstddef>
+
+#include <endian.h>
+
+#include "libnvme.h"
+#include "nvme/cxx.hpp"
+
+namespace libnvme {
+
+using host_range = node_range<nvme_root_t, nvme_host_t,
+			      nvme_first_host, nvme_next_host>;
+using subsystem_range = node_range<nvme_host_t, nvme_subsystem_t,
+				   nvme_first_subsystem, nvme_next_subsystem>;
+using ctrl_range = node_range<nvme_subsystem_t, nvme_ctrl_t,
+			      nvme_subsystem_first_ctrl,
+			      nvme_subsystem_next_ctrl>;
+using subsystem_ns_range = node_range<nvme_subsystem_t, nvme_ns_t,
+				      nvme_subsystem_first_ns,
+				      nvme_subsystem_next_ns>;
+using ctrl_ns_range = node_range<nvme_ctrl_t, nvme_ns_t,
+				 nvme_ctrl_first_ns, nvme_ctrl_next_ns>;
+using path_range = node_range<nvme_ctrl_t, nvme_path_t,
+			      nvme_ctrl_first_path, nvme_ctrl_next_path>;
+
+inline host_range hosts(nvme_root_t r) noexcept { return host_range(r); }
+inline subsystem_range subsystems(nvme_host_t h) noexcept
+{
+	return subsystem_range(h);
+}
+inline ctrl_range ctrls(nvme_subsystem_t s) noexcept { return ctrl_range(s); }
+inline subsystem_ns_range namespaces(nvme_subsystem_t s) noexcept
+{
+	return subsystem_ns_range(s);
+}
+inline ctrl_ns_range namespaces(nvme_ctrl_t c) noexcept
+{
+	return ctrl_ns_range(c);
+}
+inline path_range paths(nvme_ctrl_t c) noexcept { return path_range(c); }
+
+/*
+ * Owner of a tree, freed with nvme_free_tree(). Converts to nvme_root_t
+ * so it can be passed to the C functions directly.
+ */
+class root : public unique_handle<struct nvme_root, nvme_free_tree> {
+public:
+	using unique_handle::unique_handle;
+
+	/* nvme_scan(), check the result for NULL with operator bool */
+	static root scan(const char *config_file = nullptr) noexcept
+	{
+		return root(nvme_scan(config_file));
+	}
+
+	/* nvme_create_root() */
+	static root create(FILE *fp = nullptr,
+			   int log_level = DEFAULT_LOGLEVEL) noexcept
+	{
+		return root(nvme_create_root(fp, log_level));
+	}
+
+	host_range hosts() const noexcept { return host_range(get()); }
+};
+
+/* nvme_get_ctrl_telemetry() into an owned buffer */
+inline int get_ctrl_telemetry(int fd, bool rae, enum nvme_telemetry_da da,
+			      log_buffer<struct nvme_telemetry_log> &log) noexcept
+{
+	struct nvme_telemetry_log *p = nullptr;
+	std::size_t size = 0;
+	int ret = nvme_get_ctrl_telemetry(fd, rae, &p, da, &size);
+
+	log.reset(ret ? nullptr : p, size);
+	return ret;
+}
+
+/* nvme_get_new_host_telemetry() into an owned buffer */
+inline int get_host_telemetry(int fd, enum nvme_telemetry_da da,
+			      log_buffer<struct nvme_telemetry_log> &log) noexcept
+{
+	struct nvme_telemetry_log *p = nullptr;
+	std::size_t size = 0;
+	int ret = nvme_get_new_host_telemetry(fd, &p, da, &size);
+
+	log.reset(ret ? nullptr : p, size);
+	return ret;
+}
+
+/* nvmf_get_discovery_log() into an owned buffer */
+inline int get_discovery_log(nvme_ctrl_t c, int max_retries,
+			     log_buffer<struct nvmf_discovery_log> &log) noexcept
+{
+	struct nvmf_discovery_log *p = nullptr;
+	int ret = nvmf_get_discovery_log(c, &p, max_retries);
+
+	if (ret) {
+		log.reset();
+		return ret;
+	}
+	log.reset(p, sizeof(*p) +
+		  le64toh(p->numrec) * sizeof(p->entries[0]));
+	return 0;
+}
+
+/*
+ * Reads @buf.size_bytes() bytes of a log page into @buf, split into
+ * transfers of @xfer_len bytes, 0 to derive them from the MDTS.
+ */
+template <typename T>
+inline int get_log(int fd, enum nvme_cmd_get_log_lid lid, span<T> buf,
+		   __u32 nsid = NVME_NSID_ALL, bool rae = false,
+		   __u32 xfer_len = 0) noexcept
+{
+	static_assert(std::is_trivially_copyable_v<T>,
+		      "log pages are read into plain data");
+	struct nvme_get_log_args args = log_args(fd, lid, nsid, rae,
+						 buf.data(), buf.size_bytes());
+
+	if (buf.size_bytes() > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	return nvme_get_log_page(fd, xfer_len, &args);
+}
+
+/*
+ * Reads a fixed size log page into @log in a single command, e.g.
+ *	struct nvme_smart_log smart;
+ *	libnvme::get_log<NVME_LOG_LID_SMART>(fd, smart);
+ */
+template <enum nvme_cmd_get_log_lid Lid>
+inline int get_log(int fd, typename log_page_traits<Lid>::type &log,
+		   __u32 nsid = log_page_traits<Lid>::nsid,
+		   bool rae = false) noexcept
+{
+	using type = typename log_page_traits<Lid>::type;
+	static_assert(sizeof(type) % 4 == 0,
+		      "log pages are transferred in dwords");
+	struct nvme_get_log_args args = log_args(fd, Lid, nsid, rae, &log,
+						 sizeof(type));
+
+	return nvme_get_log(&args);
+}
+
+/* nvme_ns_read() of @buf.size_bytes() bytes at byte @offset */
+template <typename T>
+inline int read(nvme_ns_t n, span<T> buf, off_t offset) noexcept
+{
+	static_assert(!std::is_const_v<T>, "read needs writable memory");
+	return nvme_ns_read(n, buf.data(), offset, buf.size_bytes());
+}
+
+/* nvme_ns_write() of @buf.size_bytes() bytes at byte @offset */
+template <typename T>
+inline int write(nvme_ns_t n, span<T> buf, off_t offset) noexcept
+{
+	return nvme_ns_write(n, const_cast<std::remove_const_t<T> *>(buf.data()),
+			     offset, buf.size_bytes());
+}
+
+} /* namespace libnvme */
+
+#endif /* _LIBNVME_HPP */
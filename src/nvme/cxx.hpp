@@ -0,0 +1,280 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+
+#ifndef _LIBNVME_CXX_HPP
+#define _LIBNVME_CXX_HPP
+
+/*
+ * Parts of the C++ layer shared by libnvme.hpp and libnvme-mi.hpp, which
+ * only depend on the NVMe data structures. Include one of those instead.
+ */
+
+#include <cstddef>
+#include <cstdlib>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+
+#include "types.h"
+#include "api-types.h"
+
+namespace libnvme {
+
+/*
+ * Contiguous memory owned by someone else, the subset of C++20 std::span
+ * used by these calls. Converts from arrays and from containers with
+ * data() and size(), such as std::vector and std::array.
+ */
+template <typename T>
+class span {
+public:
+	using element_type = T;
+	using iterator = T *;
+
+	constexpr span() noexcept : data_(nullptr), size_(0) {}
+	constexpr span(T *data, std::size_t size) noexcept
+		: data_(data), size_(size) {}
+	template <std::size_t N>
+	constexpr span(T (&arr)[N]) noexcept : data_(arr), size_(N) {}
+	template <typename C, typename = std::enable_if_t<
+		std::is_convertible_v<decltype(std::data(std::declval<C &>())),
+				      T *>>>
+	constexpr span(C &c) noexcept
+		: data_(std::data(c)), size_(std::size(c)) {}
+
+	constexpr T *data() const noexcept { return data_; }
+	constexpr std::size_t size() const noexcept { return size_; }
+	constexpr std::size_t size_bytes() const noexcept
+	{
+		return size_ * sizeof(T);
+	}
+	constexpr bool empty() const noexcept { return !size_; }
+	constexpr T &operator[](std::size_t i) const noexcept
+	{
+		return data_[i];
+	}
+	constexpr iterator begin() const noexcept { return data_; }
+	constexpr iterator end() const noexcept { return data_ + size_; }
+
+	constexpr span subspan(std::size_t offset,
+			       std::size_t count) const noexcept
+	{
+		return span(data_ + offset, count);
+	}
+
+private:
+	T *data_;
+	std::size_t size_;
+};
+
+/*
+ * Move-only owner of a pointer freed with @Free, like std::unique_ptr
+ * with a function deleter but without storing the deleter.
+ */
+template <typename T, void (*Free)(T *)>
+class unique_handle {
+public:
+	constexpr unique_handle() noexcept : p_(nullptr) {}
+	explicit unique_handle(T *p) noexcept : p_(p) {}
+	unique_handle(const unique_handle &) = delete;
+	unique_handle &operator=(const unique_handle &) = delete;
+	unique_handle(unique_handle &&o) noexcept : p_(o.release()) {}
+	unique_handle &operator=(unique_handle &&o) noexcept
+	{
+		reset(o.release());
+		return *this;
+	}
+	~unique_handle() { reset(); }
+
+	T *get() const noexcept { return p_; }
+	operator T *() const noexcept { return p_; }
+	explicit operator bool() const noexcept { return p_ != nullptr; }
+
+	T *release() noexcept { return std::exchange(p_, nullptr); }
+	void reset(T *p = nullptr) noexcept
+	{
+		T *old = std::exchange(p_, p);
+
+		if (old)
+			Free(old);
+	}
+
+private:
+	T *p_;
+};
+
+/*
+ * Iterator and range over the children of a tree node, walked with the
+ * nvme_*_first_*() and nvme_*_next_*() functions. The current node must
+ * not be freed while iterating.
+ */
+template <typename P, typename N, N (*First)(P), N (*Next)(P, N)>
+class node_range {
+public:
+	class iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = N;
+		using difference_type = std::ptrdiff_t;
+		using pointer = const N *;
+		using reference = const N &;
+
+		iterator(P parent, N node) noexcept
+			: parent_(parent), node_(node) {}
+
+		reference operator*() const noexcept { return node_; }
+		pointer operator->() const noexcept { return &node_; }
+		iterator &operator++() noexcept
+		{
+			node_ = Next(parent_, node_);
+			return *this;
+		}
+		iterator operator++(int) noexcept
+		{
+			iterator old = *this;
+
+			++*this;
+			return old;
+		}
+		bool operator==(const iterator &o) const noexcept
+		{
+			return node_ == o.node_;
+		}
+		bool operator!=(const iterator &o) const noexcept
+		{
+			return node_ != o.node_;
+		}
+
+	private:
+		P parent_;
+		N node_;
+	};
+
+	explicit node_range(P parent) noexcept : parent_(parent) {}
+
+	iterator begin() const noexcept
+	{
+		return iterator(parent_, parent_ ? First(parent_) : nullptr);
+	}
+	iterator end() const noexcept { return iterator(parent_, nullptr); }
+
+private:
+	P parent_;
+};
+
+namespace detail {
+inline void free_mem(void *p) noexcept
+{
+	std::free(p);
+}
+} /* namespace detail */
+
+/*
+ * Owner of a log page or other data the library allocated with malloc(),
+ * e.g. by nvme_get_ctrl_telemetry() or nvmf_get_discovery_log(), together
+ * with its size.
+ */
+template <typename T>
+class log_buffer {
+public:
+	log_buffer() noexcept = default;
+	log_buffer(T *p, std::size_t size) noexcept : mem_(p), size_(size) {}
+	log_buffer(log_buffer &&o) noexcept
+		: mem_(std::move(o.mem_)), size_(std::exchange(o.size_, 0)) {}
+	log_buffer &operator=(log_buffer &&o) noexcept
+	{
+		mem_ = std::move(o.mem_);
+		size_ = std::exchange(o.size_, 0);
+		return *this;
+	}
+
+	T *get() const noexcept { return static_cast<T *>(mem_.get()); }
+	T *operator->() const noexcept { return get(); }
+	explicit operator bool() const noexcept { return mem_.get(); }
+	std::size_t size() const noexcept { return size_; }
+	span<const std::byte> bytes() const noexcept
+	{
+		return span<const std::byte>(
+			static_cast<const std::byte *>(mem_.get()), size_);
+	}
+
+	void reset(T *p = nullptr, std::size_t size = 0) noexcept
+	{
+		mem_.reset(p);
+		size_ = p ? size : 0;
+	}
+	T *release() noexcept
+	{
+		size_ = 0;
+		return static_cast<T *>(mem_.release());
+	}
+
+private:
+	unique_handle<void, detail::free_mem> mem_;
+	std::size_t size_ = 0;
+};
+
+/* Log page arguments with the defaults of nvme_get_nsid_log() */
+inline struct nvme_get_log_args log_args(int fd, enum nvme_cmd_get_log_lid lid,
+					 __u32 nsid, bool rae, void *log,
+					 __u32 len) noexcept
+{
+	struct nvme_get_log_args args = {};
+
+	args.log = log;
+	args.args_size = sizeof(args);
+	args.fd = fd;
+	/* a timeout of 0 is the default one, NVME_DEFAULT_IOCTL_TIMEOUT */
+	args.lid = lid;
+	args.len = len;
+	args.nsid = nsid;
+	args.csi = NVME_CSI_NVM;
+	args.lsi = NVME_LOG_LSI_NONE;
+	args.lsp = NVME_LOG_LSP_NONE;
+	args.uuidx = NVME_UUID_NONE;
+	args.rae = rae;
+	return args;
+}
+
+/*
+ * Data structure of the fixed size log pages, used by get_log<>() to
+ * size the transfer at compile time. @nsid is the namespace to read the
+ * log page for by default.
+ */
+template <enum nvme_cmd_get_log_lid Lid>
+struct log_page_traits;
+
+#define LIBNVME_LOG_PAGE(lid, t, ns)					\
+	template <>							\
+	struct log_page_traits<lid> {					\
+		using type = t;						\
+		static constexpr __u32 nsid = ns;			\
+	}
+
+LIBNVME_LOG_PAGE(NVME_LOG_LID_SUPPORTED_LOG_PAGES,
+		 struct nvme_supported_log_pages, NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_SMART, struct nvme_smart_log, NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_FW_SLOT, struct nvme_firmware_slot,
+		 NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_CHANGED_NS, struct nvme_ns_list,
+		 NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_CMD_EFFECTS, struct nvme_cmd_effects_log,
+		 NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_DEVICE_SELF_TEST, struct nvme_self_test_log,
+		 NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_FID_SUPPORTED_EFFECTS,
+		 struct nvme_fid_supported_effects_log, NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_MI_CMD_SUPPORTED_EFFECTS,
+		 struct nvme_mi_cmd_supported_effects_log, NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_RESERVATION, struct nvme_resv_notification_log,
+		 NVME_NSID_ALL);
+LIBNVME_LOG_PAGE(NVME_LOG_LID_SANITIZE, struct nvme_sanitize_log_page,
+		 NVME_NSID_ALL);
+
+#undef LIBNVME_LOG_PAGE
+
+} /* namespace libnvme */
+
+#endif /* _LIBNVME_CXX_HPP */
@@ -38,6 +38,12 @@
 #include "log.h"
 #include "private.h"
 
+/* keep-alive timeout of persistent discovery controllers */
+#define NVMF_DEF_DISC_TMO	30
+
+/* concurrent connects of nvmf_connect_disc_log() unless told otherwise */
+#define NVMF_DEFAULT_CONNECT_PARALLEL	16
+
 #define NVMF_HOSTID_SIZE	37
 #define UUID_SIZE		37  /* 1b4e28ba-2fa1-11d2-883f-0016d3cca427 + \0 */
 
@@ -591,12 +597,12 @@ out_close:
 	return ret;
 }
 
-int nvmf_add_ctrl(nvme_host_t h, nvme_ctrl_t c,
-		  const struct nvme_fabrics_config *cfg)
+/* Everything up to the write to /dev/nvme-fabrics, which may run in parallel */
+static int nvmf_prepare_ctrl(nvme_host_t h, nvme_ctrl_t c,
+			     const struct nvme_fabrics_config *cfg,
+			     char **argstr)
 {
 	nvme_subsystem_t s;
-	char *argstr;
-	int ret;
 
 	/* highest prio have configs from command line */
 	cfg = merge_config(c, cfg);
@@ -636,9 +642,19 @@ int nvmf_add_ctrl(nvme_host_t h, nvme_ctrl_t c,
 			return -1;
 		}
 		free(traddr);
+		nvme_ctrl_reindex(c);
 	}
 
-	ret = build_options(h, c, &argstr);
+	return build_options(h, c, argstr);
+}
+
+int nvmf_add_ctrl(nvme_host_t h, nvme_ctrl_t c,
+		  const struct nvme_fabrics_config *cfg)
+{
+	char *argstr;
+	int ret;
+
+	ret = nvmf_prepare_ctrl(h, c, cfg, &argstr);
 	if (ret)
 		return ret;
 
@@ -653,15 +669,15 @@ int nvmf_add_ctrl(nvme_host_t h, nvme_ctrl_t c,
 	return nvme_init_ctrl(h, c, ret);
 }
 
-nvme_ctrl_t nvmf_connect_disc_entry(nvme_host_t h,
-				    struct nvmf_disc_log_entry *e,
-				    const struct nvme_fabrics_config *cfg,
-				    bool *discover)
+/* Creates the unconnected controller for a discovery log entry */
+static nvme_ctrl_t nvmf_create_disc_ctrl(nvme_host_t h,
+					 struct nvmf_disc_log_entry *e,
+					 const struct nvme_fabrics_config *cfg,
+					 bool *discover)
 {
 	const char *transport;
 	char *traddr = NULL, *trsvcid = NULL;
 	nvme_ctrl_t c;
-	int ret;
 
 	switch (e->trtype) {
 	case NVMF_TRTYPE_RDMA:
@@ -754,6 +770,21 @@ nvme_ctrl_t nvmf_connect_disc_entry(nvme_host_t h,
 	     e->treq & NVMF_TREQ_NOT_REQUIRED))
 		c->cfg.tls = true;
 
+	return c;
+}
+
+nvme_ctrl_t nvmf_connect_disc_entry(nvme_host_t h,
+				    struct nvmf_disc_log_entry *e,
+				    const struct nvme_fabrics_config *cfg,
+				    bool *discover)
+{
+	nvme_ctrl_t c;
+	int ret;
+
+	c = nvmf_create_disc_ctrl(h, e, cfg, discover);
+	if (!c)
+		return NULL;
+
 	ret = nvmf_add_ctrl(h, c, cfg);
 	if (!ret)
 		return c;
@@ -772,6 +803,249 @@ nvme_ctrl_t nvmf_connect_disc_entry(nvme_host_t h,
 	return NULL;
 }
 
+static nvme_ctrl_t nvmf_lookup_discovery_ctrl(nvme_host_t h,
+					      const char *transport,
+					      const char *traddr,
+					      const char *host_traddr,
+					      const char *host_iface,
+					      const char *trsvcid)
+{
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	const char *state;
+
+	/* each discovery controller has a subsystem of its own */
+	nvme_for_each_subsystem(h, s) {
+		if (!s->subsysnqn ||
+		    strcmp(s->subsysnqn, NVME_DISC_SUBSYS_NAME))
+			continue;
+
+		c = NULL;
+		while ((c = __nvme_lookup_ctrl(s, transport, traddr,
+					       host_traddr, host_iface,
+					       trsvcid, c))) {
+			if (!c->name)
+				continue;
+			state = nvme_ctrl_get_state(c);
+			if (state && !strcmp(state, "live"))
+				return c;
+		}
+	}
+	return NULL;
+}
+
+nvme_ctrl_t nvmf_connect_discovery_ctrl(nvme_host_t h, const char *transport,
+					const char *traddr,
+					const char *host_traddr,
+					const char *host_iface,
+					const char *trsvcid,
+					const struct nvme_fabrics_config *cfg)
+{
+	struct nvme_fabrics_config dcfg;
+	nvme_ctrl_t c;
+	int err;
+
+	c = nvmf_lookup_discovery_ctrl(h, transport, traddr, host_traddr,
+				       host_iface, trsvcid);
+	if (c) {
+		nvme_msg(h->r, LOG_DEBUG, "%s: reusing discovery controller\n",
+			 c->name);
+		return c;
+	}
+
+	c = nvme_create_ctrl(h->r, NVME_DISC_SUBSYS_NAME, transport, traddr,
+			     host_traddr, host_iface, trsvcid);
+	if (!c)
+		return NULL;
+
+	if (cfg)
+		dcfg = *cfg;
+	else
+		nvmf_default_config(&dcfg);
+	/* the kernel only keeps discovery controllers with keep-alive */
+	if (!dcfg.keep_alive_tmo)
+		dcfg.keep_alive_tmo = NVMF_DEF_DISC_TMO;
+
+	nvme_ctrl_set_discovery_ctrl(c, true);
+	nvme_ctrl_set_persistent(c, true);
+	if (nvmf_add_ctrl(h, c, &dcfg)) {
+		err = errno;
+		nvme_free_ctrl(c);
+		errno = err;
+		return NULL;
+	}
+	return c;
+}
+
+struct nvmf_connect_work {
+	nvme_root_t r;
+	char **argstr;
+	int *ret;
+};
+
+static void nvmf_connect_one(unsigned int i, void *arg)
+{
+	struct nvmf_connect_work *w = arg;
+
+	if (w->argstr[i])
+		w->ret[i] = __nvmf_add_ctrl(w->r, w->argstr[i]);
+}
+
+int nvmf_resolve_hostnames(nvme_root_t r, const char * const *hostnames,
+			   unsigned int nr, unsigned int max_parallel)
+{
+	if (!r || (nr && !hostnames)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return nvme_resolve_hostnames(r, hostnames, nr, max_parallel);
+}
+
+int nvmf_resolve_ctrls(nvme_root_t r, unsigned int max_parallel)
+{
+	const char **hostnames = NULL, **tmp;
+	unsigned int nr = 0, alloc = 0;
+	nvme_host_t h;
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	int ret;
+
+	if (!r) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ctrl(s, c) {
+				if (c->name || !traddr_is_hostname(r, c))
+					continue;
+				if (nr == alloc) {
+					alloc = alloc ? alloc * 2 : 16;
+					tmp = realloc(hostnames,
+						      alloc * sizeof(*tmp));
+					if (!tmp) {
+						free(hostnames);
+						errno = ENOMEM;
+						return -1;
+					}
+					hostnames = tmp;
+				}
+				hostnames[nr++] = c->traddr;
+			}
+		}
+	}
+
+	ret = nvme_resolve_hostnames(r, hostnames, nr, max_parallel);
+	free(hostnames);
+	return ret;
+}
+
+int nvmf_connect_disc_log(nvme_host_t h, struct nvmf_discovery_log *log,
+			  const struct nvme_fabrics_config *cfg,
+			  unsigned int max_parallel,
+			  struct nvmf_connect_result *results, bool *discover)
+{
+	struct nvmf_connect_work w = { .r = h->r };
+	const char **hostnames;
+	__u64 i, numrec;
+	int connected = 0, nr_hostnames = 0;
+	nvme_ctrl_t c;
+
+	if (!log || !results) {
+		errno = EINVAL;
+		return -1;
+	}
+	numrec = le64_to_cpu(log->numrec);
+	if (!numrec)
+		return 0;
+
+	w.argstr = calloc(numrec, sizeof(*w.argstr));
+	w.ret = calloc(numrec, sizeof(*w.ret));
+	hostnames = calloc(numrec, sizeof(*hostnames));
+	if (!w.argstr || !w.ret || !hostnames) {
+		free(w.argstr);
+		free(w.ret);
+		free(hostnames);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* the tree is only modified from this thread */
+	for (i = 0; i < numrec; i++) {
+		results[i].c = NULL;
+		results[i].err = 0;
+
+		c = nvmf_create_disc_ctrl(h, &log->entries[i], cfg, discover);
+		if (!c) {
+			results[i].err = errno;
+			continue;
+		}
+		results[i].c = c;
+		if (traddr_is_hostname(h->r, c))
+			hostnames[nr_hostnames++] = c->traddr;
+	}
+
+	/* so that a slow DNS server does not delay each entry in turn */
+	nvme_resolve_hostnames(h->r, hostnames, nr_hostnames, max_parallel);
+	free(hostnames);
+
+	for (i = 0; i < numrec; i++) {
+		c = results[i].c;
+		if (!c)
+			continue;
+		if (nvmf_prepare_ctrl(h, c, cfg, &w.argstr[i])) {
+			results[i].err = errno;
+			nvme_free_ctrl(c);
+			results[i].c = NULL;
+		}
+	}
+
+	nvme_run_parallel(max_parallel ? max_parallel :
+			  NVMF_DEFAULT_CONNECT_PARALLEL,
+			  numrec, nvmf_connect_one, &w);
+
+	for (i = 0; i < numrec; i++) {
+		c = results[i].c;
+		if (!c)
+			continue;
+
+		free(w.argstr[i]);
+		if (w.ret[i] == -ENVME_CONNECT_INVAL && c->cfg.disable_sqflow) {
+			/* disable_sqflow is unrecognized option on older kernels */
+			nvme_msg(h->r, LOG_INFO, "failed to connect controller, "
+				 "retry with disabling SQ flow control\n");
+			c->cfg.disable_sqflow = false;
+			if (nvmf_add_ctrl(h, c, cfg)) {
+				results[i].err = errno;
+				goto free_ctrl;
+			}
+			connected++;
+			continue;
+		}
+		if (w.ret[i] < 0) {
+			results[i].err = -w.ret[i];
+			goto free_ctrl;
+		}
+
+		nvme_msg(h->r, LOG_INFO, "nvme%d: ctrl connected\n", w.ret[i]);
+		if (nvme_init_ctrl(h, c, w.ret[i])) {
+			results[i].err = errno;
+			goto free_ctrl;
+		}
+		connected++;
+		continue;
+
+free_ctrl:
+		nvme_free_ctrl(c);
+		results[i].c = NULL;
+	}
+
+	free(w.argstr);
+	free(w.ret);
+	return connected;
+}
+
 static int nvme_discovery_log(int fd, __u32 len, struct nvmf_discovery_log *log, bool rae)
 {
 	struct nvme_get_log_args args = {
@@ -878,6 +1152,142 @@ out_free_log:
 	return ret;
 }
 
+int nvmf_get_discovery_log_cached(nvme_ctrl_t c,
+				  struct nvmf_discovery_log **logp,
+				  struct nvmf_discovery_log **prevp,
+				  int max_retries)
+{
+	nvme_root_t r = c->s && c->s->h ? c->s->h->r : NULL;
+	struct nvmf_discovery_log hdr, *log;
+	const char *name = nvme_ctrl_get_name(c);
+
+	if (prevp)
+		*prevp = NULL;
+
+	if (c->disc_log) {
+		/* clears a pending discovery log change event as well */
+		if (nvme_discovery_log(nvme_ctrl_get_fd(c), sizeof(hdr),
+				       &hdr, false))
+			return -1;
+		if (hdr.genctr == c->disc_log->genctr &&
+		    hdr.numrec == c->disc_log->numrec) {
+			nvme_msg(r, LOG_DEBUG, "%s: discovery log unchanged "
+				 "(genctr %" PRIu64 ")\n",
+				 name, le64_to_cpu(hdr.genctr));
+			*logp = c->disc_log;
+			return 0;
+		}
+	}
+
+	if (nvmf_get_discovery_log(c, &log, max_retries))
+		return -1;
+
+	if (prevp)
+		*prevp = c->disc_log;
+	else
+		free(c->disc_log);
+	c->disc_log = log;
+	*logp = log;
+	return 1;
+}
+
+/* entries are considered identical if they describe the same port */
+static int nvmf_disc_entry_cmp(const void *a, const void *b)
+{
+	const struct nvmf_disc_log_entry *e1 = *(const void **)a;
+	const struct nvmf_disc_log_entry *e2 = *(const void **)b;
+	int ret;
+
+	if (e1->trtype != e2->trtype)
+		return e1->trtype - e2->trtype;
+	if (e1->adrfam != e2->adrfam)
+		return e1->adrfam - e2->adrfam;
+	if (e1->subtype != e2->subtype)
+		return e1->subtype - e2->subtype;
+	if (e1->portid != e2->portid)
+		return le16_to_cpu(e1->portid) - le16_to_cpu(e2->portid);
+	ret = memcmp(e1->trsvcid, e2->trsvcid, sizeof(e1->trsvcid));
+	if (ret)
+		return ret;
+	ret = memcmp(e1->traddr, e2->traddr, sizeof(e1->traddr));
+	if (ret)
+		return ret;
+	return memcmp(e1->subnqn, e2->subnqn, sizeof(e1->subnqn));
+}
+
+static int nvmf_index_cmp(const void *a, const void *b)
+{
+	const __u64 *i1 = a, *i2 = b;
+
+	return *i1 < *i2 ? -1 : *i1 > *i2;
+}
+
+static const struct nvmf_disc_log_entry **
+nvmf_sort_disc_entries(const struct nvmf_discovery_log *log, __u64 nr)
+{
+	const struct nvmf_disc_log_entry **sorted;
+	__u64 i;
+
+	sorted = calloc(nr ? nr : 1, sizeof(*sorted));
+	if (!sorted)
+		return NULL;
+	for (i = 0; i < nr; i++)
+		sorted[i] = &log->entries[i];
+	qsort(sorted, nr, sizeof(*sorted), nvmf_disc_entry_cmp);
+	return sorted;
+}
+
+int nvmf_diff_discovery_log(const struct nvmf_discovery_log *prev,
+			    const struct nvmf_discovery_log *cur,
+			    __u64 *added, __u64 *nr_added,
+			    __u64 *removed, __u64 *nr_removed)
+{
+	const struct nvmf_disc_log_entry **p = NULL, **n = NULL;
+	__u64 nr_prev = prev ? le64_to_cpu(prev->numrec) : 0;
+	__u64 nr_cur = cur ? le64_to_cpu(cur->numrec) : 0;
+	__u64 i = 0, j = 0;
+	int ret;
+
+	*nr_added = 0;
+	*nr_removed = 0;
+
+	/* merge both logs sorted by port, unmatched entries are the delta */
+	p = nvmf_sort_disc_entries(prev, nr_prev);
+	n = nvmf_sort_disc_entries(cur, nr_cur);
+	if (!p || !n) {
+		free(p);
+		free(n);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	while (i < nr_prev || j < nr_cur) {
+		if (i == nr_prev)
+			ret = 1;
+		else if (j == nr_cur)
+			ret = -1;
+		else
+			ret = nvmf_disc_entry_cmp(&p[i], &n[j]);
+
+		if (ret < 0) {
+			removed[(*nr_removed)++] = p[i++] - prev->entries;
+		} else if (ret > 0) {
+			added[(*nr_added)++] = n[j++] - cur->entries;
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+	/* report in log page order */
+	qsort(added, *nr_added, sizeof(*added), nvmf_index_cmp);
+	qsort(removed, *nr_removed, sizeof(*removed), nvmf_index_cmp);
+
+	free(p);
+	free(n);
+	return 0;
+}
+
 #define PATH_UUID_IBM	"/proc/device-tree/ibm,partition-uuid"
 
 static int uuid_from_device_tree(char *system_uuid)
@@ -204,6 +204,55 @@ int nvmf_add_ctrl(nvme_host_t h, nvme_ctrl_t c,
 int nvmf_get_discovery_log(nvme_ctrl_t c, struct nvmf_discovery_log **logp,
 			   int max_retries);
 
+/**
+ * nvmf_get_discovery_log_cached() - Return the discovery log page if changed
+ * @c:			Discover controller to use
+ * @logp:		Pointer to the current log page, owned by @c
+ * @prevp:		If not NULL, receives the previously cached log page
+ *			when a new one was fetched, which the caller has to
+ *			free, or NULL
+ * @max_retries:	Maximum number of attempts when the log page changes
+ *			while it is being fetched
+ *
+ * Keeps the last log page fetched from @c. If there is one, only the log
+ * page header is read, and the full log page is fetched with
+ * nvmf_get_discovery_log() only when its generation counter or number of
+ * records differ from the cached one. Use nvmf_diff_discovery_log() with
+ * @prevp and @logp to find out what has changed.
+ *
+ * The log page returned in @logp remains valid until the next call, or
+ * until @c is disconnected or freed.
+ *
+ * Return: 0 if the log page did not change, 1 if a new one was fetched;
+ * on failure -1 is returned and errno is set
+ */
+int nvmf_get_discovery_log_cached(nvme_ctrl_t c,
+				  struct nvmf_discovery_log **logp,
+				  struct nvmf_discovery_log **prevp,
+				  int max_retries);
+
+/**
+ * nvmf_diff_discovery_log() - Compare two generations of a discovery log
+ * @prev:		Previous log page, or NULL
+ * @cur:		Current log page, or NULL
+ * @added:		Array of at least @cur->numrec entries receiving the
+ *			indexes of entries only present in @cur
+ * @nr_added:		Number of indexes stored in @added
+ * @removed:		Array of at least @prev->numrec entries receiving the
+ *			indexes of entries only present in @prev
+ * @nr_removed:		Number of indexes stored in @removed
+ *
+ * Entries are considered identical if transport type, address family,
+ * subsystem type, port ID, transport service ID, transport address and
+ * subsystem NQN match. Indexes are reported in log page order.
+ *
+ * Return: 0 on success; on failure -1 is returned and errno is set
+ */
+int nvmf_diff_discovery_log(const struct nvmf_discovery_log *prev,
+			    const struct nvmf_discovery_log *cur,
+			    __u64 *added, __u64 *nr_added,
+			    __u64 *removed, __u64 *nr_removed);
+
 /**
  * nvmf_hostnqn_generate() - Generate a machine specific host nqn
  * Returns: An nvm namespace qualified name string based on the machine
@@ -240,6 +289,108 @@ nvme_ctrl_t nvmf_connect_disc_entry(nvme_host_t h,
 	struct nvmf_disc_log_entry *e,
 	const struct nvme_fabrics_config *defcfg, bool *discover);
 
+/**
+ * nvmf_connect_discovery_ctrl() - Connect or reuse a discovery controller
+ * @h:		Host to which the controller should be connected
+ * @transport:	Transport type
+ * @traddr:	Transport address
+ * @host_traddr: Host transport address, or NULL
+ * @host_iface:	Host interface name, or NULL
+ * @trsvcid:	Transport service ID, or NULL
+ * @defcfg:	Default configuration for a new controller, or NULL
+ *
+ * Returns a live discovery controller of @h in the tree which matches
+ * the transport parameters, so repeated discovery log page retrievals
+ * and registrations do not have to set up a new fabrics connection
+ * each time. If there is none, a new persistent discovery controller is
+ * connected, with a keep-alive timeout of 30 seconds unless @defcfg
+ * specifies one. It is inserted into the tree and remains connected
+ * until nvme_disconnect_ctrl() is called, so later calls, also from
+ * other processes after a rescan, reuse it.
+ *
+ * Return: Discovery controller, or NULL with errno set on failure.
+ */
+nvme_ctrl_t nvmf_connect_discovery_ctrl(nvme_host_t h, const char *transport,
+					const char *traddr,
+					const char *host_traddr,
+					const char *host_iface,
+					const char *trsvcid,
+					const struct nvme_fabrics_config *defcfg);
+
+/**
+ * struct nvmf_connect_result - Outcome of connecting a discovery log entry
+ * @c:		Connected controller, or NULL
+ * @err:	0 on success, otherwise the errno value describing why the
+ *		entry was not connected; EAGAIN for entries referring to the
+ *		discovery controller they were retrieved from
+ */
+struct nvmf_connect_result {
+	nvme_ctrl_t c;
+	int err;
+};
+
+/**
+ * nvmf_connect_disc_log() - Connect all entries of a discovery log page
+ * @h:		Host to which the controllers should be connected
+ * @log:	Discovery log page, as returned by nvmf_get_discovery_log()
+ * @defcfg:	Default configuration to be used for the new controllers
+ * @max_parallel: Maximum number of connects in flight, or 0 for a default
+ *		of 16
+ * @results:	Array of @log->numrec entries receiving the result for each
+ *		log page entry
+ * @discover:	Set to 'true' if any new controller is a discovery controller
+ *
+ * Works like calling nvmf_connect_disc_entry() for each entry, but
+ * issues the connect requests concurrently, as each one blocks until the
+ * kernel has finished connecting to the controller. Transport addresses
+ * given as hostnames are resolved concurrently beforehand, see
+ * nvmf_resolve_hostnames(). The tree is only modified by the calling
+ * thread.
+ *
+ * Return: Number of connected controllers, or -1 with errno set if no
+ * entry could be attempted.
+ */
+int nvmf_connect_disc_log(nvme_host_t h, struct nvmf_discovery_log *log,
+			  const struct nvme_fabrics_config *defcfg,
+			  unsigned int max_parallel,
+			  struct nvmf_connect_result *results, bool *discover);
+
+/**
+ * nvmf_resolve_hostnames() - Resolve transport address hostnames concurrently
+ * @r:		&nvme_root_t object caching the addresses
+ * @hostnames:	Array of @nr hostnames, NULL entries are skipped
+ * @nr:		Number of entries in @hostnames
+ * @max_parallel: Maximum number of lookups in flight, or 0 for a default
+ *		of 16
+ *
+ * Resolves the hostnames which are not cached by @r yet at the same time
+ * and caches the results, see nvme_root_set_resolver_ttl(). Creating or
+ * connecting controllers with these hostnames as transport address then
+ * does not wait for a lookup each. Does nothing if caching is disabled.
+ *
+ * Return: Number of hostnames which were resolved, or -1 with errno set
+ * on failure.
+ */
+int nvmf_resolve_hostnames(nvme_root_t r, const char * const *hostnames,
+			   unsigned int nr, unsigned int max_parallel);
+
+/**
+ * nvmf_resolve_ctrls() - Resolve the hostnames of unconnected controllers
+ * @r:		&nvme_root_t object
+ * @max_parallel: Maximum number of lookups in flight, or 0 for a default
+ *		of 16
+ *
+ * Calls nvmf_resolve_hostnames() for the transport addresses of all
+ * controllers in @r which are not connected and have a hostname as
+ * transport address, e.g. after reading a configuration file and before
+ * connecting its controllers with nvmf_add_ctrl().
+ * nvmf_connect_disc_log() does the same for the discovery log entries.
+ *
+ * Return: Number of hostnames which were resolved, or -1 with errno set
+ * on failure.
+ */
+int nvmf_resolve_ctrls(nvme_root_t r, unsigned int max_parallel);
+
 /**
  * nvmf_is_registration_supported - check whether registration can be performed.
  * @c:	Controller instance
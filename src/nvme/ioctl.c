@@ -8,10 +8,12 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/ioctl.h>
@@ -21,7 +23,15 @@
 #include <ccan/endian/endian.h>
 
 #include "ioctl.h"
+#include "uring.h"
 #include "util.h"
+#include "private.h"
+
+/* commands kept in flight by the batched passthrough submission */
+#define NVME_PASSTHRU_BATCH_DEPTH	64
+
+/* idle rings kept for the next batched passthrough submissions */
+#define NVME_PASSTHRU_BATCH_RINGS	4
 
 static int nvme_verify_chr(int fd)
 {
@@ -75,11 +85,280 @@ int nvme_get_nsid(int fd, __u32 *nsid)
 	return -1 * (errno != 0);
 }
 
+/* latency history of one opcode, in log2-sized microsecond buckets */
+#define NVME_CMD_LAT_BUCKETS	32
+
+struct nvme_cmd_lat {
+	__u64 count;
+	__u64 errors;
+	__u64 bytes;
+	__u64 sum_us;
+	__u32 min_us;
+	__u32 max_us;
+	__u32 hist[NVME_CMD_LAT_BUCKETS];
+};
+
+/*
+ * Indexed by [admin][opcode]. The table is allocated the first time the
+ * statistics are enabled and never freed, so that commands in flight on
+ * other threads can keep updating it without any locking.
+ */
+static struct nvme_cmd_lat (*nvme_cmd_lat)[256];
+static bool nvme_cmd_lat_enabled;
+static const struct nvme_cmd_hooks *nvme_cmd_hooks;
+static const struct __nvme_ioctl_ops *nvme_ioctl_ops;
+
+void __nvme_set_ioctl_ops(const struct __nvme_ioctl_ops *newops)
+{
+	__atomic_store_n(&nvme_ioctl_ops, newops, __ATOMIC_RELEASE);
+}
+
+static int nvme_ioctl(int fd, unsigned long ioctl_cmd, void *cmd)
+{
+	const struct __nvme_ioctl_ops *ops;
+
+	ops = __atomic_load_n(&nvme_ioctl_ops, __ATOMIC_ACQUIRE);
+	if (ops)
+		return ops->ioctl(fd, ioctl_cmd, cmd);
+	return ioctl(fd, ioctl_cmd, cmd);
+}
+
+/* the hooks and the latency statistics only see the ioctls as well */
+bool nvme_uring_passthru_enabled(void)
+{
+	return !__atomic_load_n(&nvme_ioctl_ops, __ATOMIC_ACQUIRE) &&
+		!__atomic_load_n(&nvme_cmd_hooks, __ATOMIC_ACQUIRE) &&
+		!__atomic_load_n(&nvme_cmd_lat_enabled, __ATOMIC_RELAXED);
+}
+
+static void nvme_cmd_lat_clear(struct nvme_cmd_lat *lat)
+{
+	memset(lat, 0, sizeof(*lat));
+	lat->min_us = UINT32_MAX;
+}
+
+static void nvme_cmd_lat_record(const struct nvme_cmd_trace *t)
+{
+	struct nvme_cmd_lat (*table)[256], *lat;
+	__u64 us = t->duration_ns / 1000;
+	__u32 old;
+	int b;
+
+	table = __atomic_load_n(&nvme_cmd_lat, __ATOMIC_ACQUIRE);
+	lat = &table[t->admin][t->opcode];
+	if (us > UINT32_MAX)
+		us = UINT32_MAX;
+
+	b = us > 1 ? 31 - __builtin_clz(us) : 0;
+	if (b >= NVME_CMD_LAT_BUCKETS)
+		b = NVME_CMD_LAT_BUCKETS - 1;
+	__atomic_fetch_add(&lat->hist[b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lat->sum_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lat->bytes, t->data_len, __ATOMIC_RELAXED);
+	if (t->status)
+		__atomic_fetch_add(&lat->errors, 1, __ATOMIC_RELAXED);
+
+	old = __atomic_load_n(&lat->min_us, __ATOMIC_RELAXED);
+	while (us < old &&
+	       !__atomic_compare_exchange_n(&lat->min_us, &old, us, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	old = __atomic_load_n(&lat->max_us, __ATOMIC_RELAXED);
+	while (us > old &&
+	       !__atomic_compare_exchange_n(&lat->max_us, &old, us, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	/* last, so that a reader seeing the count also sees the sample */
+	__atomic_fetch_add(&lat->count, 1, __ATOMIC_RELEASE);
+}
+
+static int nvme_submit_ioctl_traced(int fd, unsigned long ioctl_cmd,
+				    struct nvme_passthru_cmd *cmd,
+				    const struct nvme_cmd_hooks *hooks)
+{
+	struct nvme_cmd_trace t = {
+		.fd = fd,
+		.admin = ioctl_cmd == NVME_IOCTL_ADMIN_CMD ||
+			 ioctl_cmd == NVME_IOCTL_ADMIN64_CMD,
+		.opcode = cmd->opcode,
+		.nsid = cmd->nsid,
+		.cdw10 = cmd->cdw10,
+		.cdw11 = cmd->cdw11,
+		.data_len = cmd->data_len,
+	};
+	struct timespec start, end;
+	int err;
+
+	if (hooks && hooks->pre)
+		hooks->pre(&t, hooks->user_data);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	err = nvme_ioctl(fd, ioctl_cmd, cmd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	t.status = err < 0 ? -errno : err;
+	t.duration_ns = (end.tv_sec - start.tv_sec) * 1000000000ULL +
+		end.tv_nsec - start.tv_nsec;
+
+	if (__atomic_load_n(&nvme_cmd_lat_enabled, __ATOMIC_RELAXED))
+		nvme_cmd_lat_record(&t);
+	if (hooks && hooks->post)
+		hooks->post(&t, hooks->user_data);
+	if (err < 0)
+		errno = -t.status;
+	return err;
+}
+
+/*
+ * All passthrough ioctls go through here. The 64 bit command structure
+ * only differs from the 32 bit one in the size of the result, so both
+ * are traced from the common prefix.
+ */
+static inline int nvme_submit_ioctl(int fd, unsigned long ioctl_cmd,
+				    void *cmd)
+{
+	const struct nvme_cmd_hooks *hooks;
+
+	hooks = __atomic_load_n(&nvme_cmd_hooks, __ATOMIC_ACQUIRE);
+	if (!hooks && !__atomic_load_n(&nvme_cmd_lat_enabled, __ATOMIC_RELAXED))
+		return nvme_ioctl(fd, ioctl_cmd, cmd);
+
+	return nvme_submit_ioctl_traced(fd, ioctl_cmd, cmd, hooks);
+}
+
+void nvme_set_cmd_hooks(const struct nvme_cmd_hooks *hooks)
+{
+	__atomic_store_n(&nvme_cmd_hooks, hooks, __ATOMIC_RELEASE);
+}
+
+int nvme_enable_cmd_latency_stats(bool enable)
+{
+	struct nvme_cmd_lat (*lat)[256], (*expected)[256] = NULL;
+	int i;
+
+	if (enable && !__atomic_load_n(&nvme_cmd_lat, __ATOMIC_ACQUIRE)) {
+		lat = calloc(2, sizeof(*lat));
+		if (!lat)
+			return -1;
+		for (i = 0; i < 2 * 256; i++)
+			nvme_cmd_lat_clear(&lat[i / 256][i % 256]);
+		/* another thread may have won the race */
+		if (!__atomic_compare_exchange_n(&nvme_cmd_lat, &expected, lat,
+						 false, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE))
+			free(lat);
+	}
+
+	__atomic_store_n(&nvme_cmd_lat_enabled, enable, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* upper bound of the bucket holding the @pct percentile sample */
+static __u32 nvme_cmd_lat_percentile(const __u32 *hist, __u64 count,
+				     __u32 max_us, unsigned int pct)
+{
+	__u64 target, sum = 0, bound;
+	int b;
+
+	target = (count * pct + 99) / 100;
+	if (!target)
+		target = 1;
+
+	for (b = 0; b < NVME_CMD_LAT_BUCKETS - 1; b++) {
+		sum += hist[b];
+		if (sum >= target)
+			break;
+	}
+
+	bound = (2ULL << b) - 1;
+	return bound < max_us ? bound : max_us;
+}
+
+int nvme_get_cmd_latency_stats(bool admin, __u8 opcode,
+			       struct nvme_cmd_latency_stats *stats)
+{
+	struct nvme_cmd_lat (*table)[256], *lat;
+	__u32 hist[NVME_CMD_LAT_BUCKETS];
+	__u64 count;
+	int b;
+
+	table = __atomic_load_n(&nvme_cmd_lat, __ATOMIC_ACQUIRE);
+	if (!table) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	lat = &table[!!admin][opcode];
+	count = __atomic_load_n(&lat->count, __ATOMIC_ACQUIRE);
+	if (!count) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	/*
+	 * Samples recorded while the counters are read may be counted in
+	 * some of them only, which skews the result by at most a few
+	 * samples.
+	 */
+	memset(stats, 0, sizeof(*stats));
+	for (b = 0; b < NVME_CMD_LAT_BUCKETS; b++)
+		hist[b] = __atomic_load_n(&lat->hist[b], __ATOMIC_RELAXED);
+	stats->count = count;
+	stats->errors = __atomic_load_n(&lat->errors, __ATOMIC_RELAXED);
+	stats->bytes = __atomic_load_n(&lat->bytes, __ATOMIC_RELAXED);
+	stats->min_us = __atomic_load_n(&lat->min_us, __ATOMIC_RELAXED);
+	stats->max_us = __atomic_load_n(&lat->max_us, __ATOMIC_RELAXED);
+	stats->mean_us = __atomic_load_n(&lat->sum_us, __ATOMIC_RELAXED) / count;
+	stats->p50_us = nvme_cmd_lat_percentile(hist, count, stats->max_us, 50);
+	stats->p90_us = nvme_cmd_lat_percentile(hist, count, stats->max_us, 90);
+	stats->p99_us = nvme_cmd_lat_percentile(hist, count, stats->max_us, 99);
+	return 0;
+}
+
+void nvme_reset_cmd_latency_stats(void)
+{
+	struct nvme_cmd_lat (*table)[256];
+	int i;
+
+	table = __atomic_load_n(&nvme_cmd_lat, __ATOMIC_ACQUIRE);
+	if (!table)
+		return;
+
+	for (i = 0; i < 2 * 256; i++)
+		nvme_cmd_lat_clear(&table[i / 256][i % 256]);
+}
+
+int nvme_dump_cmd_latency_stats(FILE *fp)
+{
+	struct nvme_cmd_latency_stats st;
+	int admin, opcode, n = 0;
+
+	for (admin = 1; admin >= 0; admin--) {
+		for (opcode = 0; opcode < 256; opcode++) {
+			if (nvme_get_cmd_latency_stats(admin, opcode, &st))
+				continue;
+			if (fprintf(fp, "%s opcode 0x%02x: count %llu errors %llu "
+				    "bytes %llu min %u mean %u p50 %u p90 %u "
+				    "p99 %u max %u us\n",
+				    admin ? "admin" : "io", opcode,
+				    (unsigned long long)st.count,
+				    (unsigned long long)st.errors,
+				    (unsigned long long)st.bytes,
+				    st.min_us, st.mean_us, st.p50_us,
+				    st.p90_us, st.p99_us, st.max_us) < 0)
+				return -1;
+			n++;
+		}
+	}
+	return n;
+}
+
 static int nvme_submit_passthru64(int fd, unsigned long ioctl_cmd,
 				  struct nvme_passthru_cmd64 *cmd,
 				  __u64 *result)
 {
-	int err = ioctl(fd, ioctl_cmd, cmd);
+	int err = nvme_submit_ioctl(fd, ioctl_cmd, cmd);
 
 	if (err >= 0 && result)
 		*result = cmd->result;
@@ -89,13 +368,170 @@ static int nvme_submit_passthru64(int fd, unsigned long ioctl_cmd,
 static int nvme_submit_passthru(int fd, unsigned long ioctl_cmd,
 				struct nvme_passthru_cmd *cmd, __u32 *result)
 {
-	int err = ioctl(fd, ioctl_cmd, cmd);
+	int err = nvme_submit_ioctl(fd, ioctl_cmd, cmd);
 
 	if (err >= 0 && result)
 		*result = cmd->result;
 	return err;
 }
 
+static void nvme_submit_passthru_batch_ioctl(int fd, unsigned long ioctl_cmd,
+					     struct nvme_passthru_cmd64 *cmd,
+					     int *status)
+{
+	int err = nvme_submit_passthru64(fd, ioctl_cmd, cmd, NULL);
+
+	status[0] = err < 0 ? -errno : err;
+}
+
+static int nvme_submit_passthru_batch_uring(nvme_uring_t ring, int fd,
+					    unsigned long ioctl_cmd,
+					    struct nvme_passthru_cmd64 *cmds,
+					    int nr_cmds, int *status)
+{
+	struct nvme_uring_completion c[NVME_PASSTHRU_BATCH_DEPTH];
+	int queued = 0, i, n;
+
+	while (queued < nr_cmds || nvme_uring_inflight(ring)) {
+		while (queued < nr_cmds) {
+			void *tag = (void *)(uintptr_t)queued;
+			int err;
+
+			if (ioctl_cmd == NVME_IOCTL_ADMIN64_CMD)
+				err = nvme_uring_queue_admin_passthru64(ring,
+						fd, &cmds[queued], tag);
+			else if (ioctl_cmd == NVME_IOCTL_IO64_CMD_VEC)
+				err = nvme_uring_queue_io_passthru64_vec(ring,
+						fd, &cmds[queued], tag);
+			else
+				err = nvme_uring_queue_io_passthru64(ring,
+						fd, &cmds[queued], tag);
+			if (err)
+				break;
+			queued++;
+		}
+
+		if (nvme_uring_submit(ring) < 0)
+			return -1;
+
+		n = nvme_uring_reap(ring, c, NVME_PASSTHRU_BATCH_DEPTH, 1);
+		if (n < 0)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			int idx = (uintptr_t)c[i].user_data;
+
+			/*
+			 * The device node may not implement uring commands
+			 * (e.g. older kernels), retry these through ioctl.
+			 */
+			if (c[i].status == -EOPNOTSUPP ||
+			    c[i].status == -ENOTTY) {
+				nvme_submit_passthru_batch_ioctl(fd, ioctl_cmd,
+						&cmds[idx], &status[idx]);
+				continue;
+			}
+			status[idx] = c[i].status;
+			if (c[i].status >= 0)
+				cmds[idx].result = c[i].result;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Setting up a ring takes more system calls and mappings than a small
+ * batch needs to run, so the rings of finished batches are kept for the
+ * next ones. Concurrent batches each take a ring of their own.
+ */
+static struct {
+	pthread_mutex_t lock;
+	pid_t pid;
+	int nr;
+	nvme_uring_t rings[NVME_PASSTHRU_BATCH_RINGS];
+} nvme_batch_rings = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static nvme_uring_t nvme_batch_ring_get(void)
+{
+	nvme_uring_t ring = NULL;
+
+	pthread_mutex_lock(&nvme_batch_rings.lock);
+	/* a child must not share the rings with its parent */
+	if (nvme_batch_rings.pid != getpid()) {
+		while (nvme_batch_rings.nr)
+			nvme_uring_free(
+				nvme_batch_rings.rings[--nvme_batch_rings.nr]);
+		nvme_batch_rings.pid = getpid();
+	}
+	if (nvme_batch_rings.nr)
+		ring = nvme_batch_rings.rings[--nvme_batch_rings.nr];
+	pthread_mutex_unlock(&nvme_batch_rings.lock);
+
+	if (!ring)
+		ring = nvme_uring_create(NVME_PASSTHRU_BATCH_DEPTH, 0);
+	return ring;
+}
+
+static void nvme_batch_ring_put(nvme_uring_t ring)
+{
+	/* rings of aborted batches may still have commands in flight */
+	if (!nvme_uring_inflight(ring)) {
+		pthread_mutex_lock(&nvme_batch_rings.lock);
+		if (nvme_batch_rings.pid == getpid() &&
+		    nvme_batch_rings.nr < NVME_PASSTHRU_BATCH_RINGS) {
+			nvme_batch_rings.rings[nvme_batch_rings.nr++] = ring;
+			ring = NULL;
+		}
+		pthread_mutex_unlock(&nvme_batch_rings.lock);
+	}
+	nvme_uring_free(ring);
+}
+
+__attribute__((destructor))
+static void nvme_batch_rings_free(void)
+{
+	while (nvme_batch_rings.nr)
+		nvme_uring_free(nvme_batch_rings.rings[--nvme_batch_rings.nr]);
+}
+
+static int nvme_submit_passthru_batch(int fd, unsigned long ioctl_cmd,
+				      struct nvme_passthru_cmd64 *cmds,
+				      int nr_cmds, int *status)
+{
+	nvme_uring_t ring = NULL;
+	struct stat st;
+	int i, err;
+
+	if (nr_cmds < 0 || (nr_cmds && (!cmds || !status))) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < nr_cmds; i++)
+		status[i] = -ECANCELED;
+
+	/* io_uring passthrough is only wired up for the character devices */
+	if (nr_cmds > 1 && nvme_uring_passthru_enabled() &&
+	    !fstat(fd, &st) && S_ISCHR(st.st_mode))
+		ring = nvme_batch_ring_get();
+	if (ring) {
+		err = nvme_submit_passthru_batch_uring(ring, fd, ioctl_cmd,
+						       cmds, nr_cmds, status);
+		i = errno;
+		nvme_batch_ring_put(ring);
+		errno = i;
+		return err;
+	}
+
+	for (i = 0; i < nr_cmds; i++)
+		nvme_submit_passthru_batch_ioctl(fd, ioctl_cmd, &cmds[i],
+						 &status[i]);
+	return 0;
+}
+
 static int nvme_passthru64(int fd, unsigned long ioctl_cmd, __u8 opcode,
 			   __u8 flags, __u16 rsvd, __u32 nsid, __u32 cdw2,
 			   __u32 cdw3, __u32 cdw10, __u32 cdw11, __u32 cdw12,
@@ -162,6 +598,13 @@ int nvme_submit_admin_passthru64(int fd, struct nvme_passthru_cmd64 *cmd,
 	return nvme_submit_passthru64(fd, NVME_IOCTL_ADMIN64_CMD, cmd, result);
 }
 
+int nvme_submit_admin_passthru_batch(int fd, struct nvme_passthru_cmd64 *cmds,
+				     int nr_cmds, int *status)
+{
+	return nvme_submit_passthru_batch(fd, NVME_IOCTL_ADMIN64_CMD, cmds,
+					  nr_cmds, status);
+}
+
 int nvme_admin_passthru64(int fd, __u8 opcode, __u8 flags, __u16 rsvd,
 			 __u32 nsid, __u32 cdw2, __u32 cdw3, __u32 cdw10,
 			 __u32 cdw11, __u32 cdw12, __u32 cdw13, __u32 cdw14,
@@ -393,7 +836,8 @@ int nvme_identify(struct nvme_identify_args *args)
 	return nvme_submit_admin_passthru(args->fd, &cmd, args->result);
 }
 
-int nvme_get_log(struct nvme_get_log_args *args)
+void nvme_get_log_init_cmd(struct nvme_get_log_args *args,
+			   struct nvme_passthru_cmd *cmd)
 {
 	__u32 numd = (args->len >> 2) - 1;
 	__u16 numdu = numd >> 16, numdl = numd & 0xffff;
@@ -410,7 +854,7 @@ int nvme_get_log(struct nvme_get_log_args *args)
 			NVME_SET(!!args->ot, LOG_CDW14_OT) |
 			NVME_SET(args->csi, LOG_CDW14_CSI);
 
-	struct nvme_passthru_cmd cmd = {
+	*cmd = (struct nvme_passthru_cmd) {
 		.opcode		= nvme_admin_get_log_page,
 		.nsid		= args->nsid,
 		.addr		= (__u64)(uintptr_t)args->log,
@@ -422,11 +866,18 @@ int nvme_get_log(struct nvme_get_log_args *args)
 		.cdw14		= cdw14,
 		.timeout_ms	= args->timeout,
 	};
+}
+
+int nvme_get_log(struct nvme_get_log_args *args)
+{
+	struct nvme_passthru_cmd cmd;
 
 	if (args->args_size < sizeof(struct nvme_get_log_args)) {
 		errno = EINVAL;
 		return -1;
 	}
+
+	nvme_get_log_init_cmd(args, &cmd);
 	return nvme_submit_admin_passthru(args->fd, &cmd, args->result);
 }
 
@@ -1159,6 +1610,244 @@ int nvme_get_features_iocs_profile(int fd, enum nvme_get_features_sel sel,
 	return __nvme_get_features(fd, NVME_FEAT_FID_IOCS_PROFILE, sel, result);
 }
 
+struct nvme_feat_desc {
+	__u8 fid;
+	bool ns;
+	__u32 cdw11;
+	__u32 len;
+};
+
+/*
+ * Features a controller supports according to its Identify Controller
+ * data, for controllers without the FID Supported and Effects log.
+ * Features which need a target in cdw11, such as the NVM Set of the
+ * Predictable Latency features or the LBA Range Type, are left out.
+ */
+static bool nvme_feat_ctrl_supports(struct nvme_id_ctrl *id, __u8 fid,
+				    bool *ns)
+{
+	__u32 ctratt = le32_to_cpu(id->ctratt);
+	__u16 oncs = le16_to_cpu(id->oncs);
+
+	*ns = false;
+	switch (fid) {
+	case NVME_FEAT_FID_ARBITRATION:
+	case NVME_FEAT_FID_POWER_MGMT:
+	case NVME_FEAT_FID_TEMP_THRESH:
+	case NVME_FEAT_FID_NUM_QUEUES:
+	case NVME_FEAT_FID_IRQ_COALESCE:
+	case NVME_FEAT_FID_IRQ_CONFIG:
+	case NVME_FEAT_FID_WRITE_ATOMIC:
+	case NVME_FEAT_FID_ASYNC_EVENT:
+		return true;
+	case NVME_FEAT_FID_ERR_RECOVERY:
+		*ns = true;
+		return true;
+	case NVME_FEAT_FID_VOLATILE_WC:
+		return id->vwc & NVME_CTRL_VWC_PRESENT;
+	case NVME_FEAT_FID_AUTO_PST:
+		return id->apsta & NVME_CTRL_APSTA_APST;
+	case NVME_FEAT_FID_HOST_MEM_BUF:
+		return id->hmpre != 0;
+	case NVME_FEAT_FID_TIMESTAMP:
+		return oncs & NVME_CTRL_ONCS_TIMESTAMP;
+	case NVME_FEAT_FID_KATO:
+		return id->kas != 0;
+	case NVME_FEAT_FID_HCTM:
+		return le16_to_cpu(id->hctma) & 0x1;
+	case NVME_FEAT_FID_NOPSC:
+		return ctratt & NVME_CTRL_CTRATT_NON_OP_PSP;
+	case NVME_FEAT_FID_RRL:
+		return ctratt & NVME_CTRL_CTRATT_READ_RECV_LVLS;
+	case NVME_FEAT_FID_SANITIZE:
+		return id->sanicap != 0;
+	case NVME_FEAT_FID_HOST_ID:
+		return oncs & NVME_CTRL_ONCS_RESERVATIONS;
+	case NVME_FEAT_FID_RESV_MASK:
+	case NVME_FEAT_FID_RESV_PERSIST:
+		*ns = true;
+		return oncs & NVME_CTRL_ONCS_RESERVATIONS;
+	case NVME_FEAT_FID_WRITE_PROTECT:
+		*ns = true;
+		return id->nwpc & 0x1;
+	default:
+		return false;
+	}
+}
+
+static int nvme_feat_supported(int fd, struct nvme_id_ctrl *id, __u32 nsid,
+			       struct nvme_feat_desc *descs)
+{
+	struct nvme_fid_supported_effects_log *log;
+	int fid, nr = 0;
+	bool ns;
+
+	log = malloc(sizeof(*log));
+	if (!log) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (!nvme_get_log_fid_supported_effects(fd, false, log)) {
+		for (fid = 1; fid < NVME_LOG_FID_SUPPORTED_EFFECTS_MAX; fid++) {
+			__u32 fs = le32_to_cpu(log->fid_support[fid]);
+			__u32 scope = NVME_GET(fs, FID_SUPPORTED_EFFECTS_SCOPE);
+
+			if (!(fs & NVME_FID_SUPPORTED_EFFECTS_FSUPP))
+				continue;
+			ns = scope & NVME_FID_SUPPORTED_EFFECTS_SCOPE_NS;
+			if (ns && nsid == NVME_NSID_NONE)
+				continue;
+			descs[nr].fid = fid;
+			descs[nr].ns = ns;
+			descs[nr++].cdw11 = 0;
+		}
+		free(log);
+		return nr;
+	}
+	free(log);
+
+	for (fid = 1; fid < NVME_LOG_FID_SUPPORTED_EFFECTS_MAX; fid++) {
+		if (!nvme_feat_ctrl_supports(id, fid, &ns))
+			continue;
+		if (ns && nsid == NVME_NSID_NONE)
+			continue;
+		descs[nr].fid = fid;
+		descs[nr].ns = ns;
+		descs[nr++].cdw11 = 0;
+	}
+	return nr;
+}
+
+int nvme_get_features_all(int fd, __u32 nsid, unsigned int sels,
+			  struct nvme_feat_snapshot **snap)
+{
+	struct nvme_feat_desc descs[NVME_LOG_FID_SUPPORTED_EFFECTS_MAX];
+	struct nvme_passthru_cmd64 *cmds = NULL;
+	struct nvme_feat_snapshot *s = NULL;
+	struct nvme_id_ctrl id;
+	int i, n, sel, nr_descs, nr = 0, err = -1;
+	size_t data_size = 0, hdr_size;
+	int *status = NULL;
+	__u8 *data;
+
+	sels &= (1 << NVME_GET_FEATURES_SEL_CURRENT) |
+		(1 << NVME_GET_FEATURES_SEL_DEFAULT) |
+		(1 << NVME_GET_FEATURES_SEL_SAVED) |
+		(1 << NVME_GET_FEATURES_SEL_SUPPORTED);
+	if (!sels) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = nvme_identify_ctrl(fd, &id);
+	if (err) {
+		if (err > 0)
+			errno = EIO;
+		return -1;
+	}
+	err = -1;
+
+	nr_descs = nvme_feat_supported(fd, &id, nsid, descs);
+	if (nr_descs < 0)
+		return -1;
+
+	/* one Get Features for each selected value of each feature */
+	n = nr_descs * __builtin_popcount(sels);
+	for (i = 0; i < nr_descs; i++) {
+		struct nvme_feat_desc *d = &descs[i];
+
+		if (d->fid == NVME_FEAT_FID_HOST_ID &&
+		    le32_to_cpu(id.ctratt) & NVME_CTRL_CTRATT_128_ID)
+			d->cdw11 = 1;
+		/* unknown features are read for their dword0 only */
+		if (nvme_get_feature_length(d->fid, d->cdw11, &d->len))
+			d->len = 0;
+		data_size += round_up(d->len, 8) * __builtin_popcount(sels);
+	}
+
+	hdr_size = round_up(sizeof(*s) + n * sizeof(s->values[0]), 8);
+	s = calloc(1, hdr_size + data_size);
+	cmds = calloc(n ? n : 1, sizeof(*cmds));
+	status = calloc(n ? n : 1, sizeof(*status));
+	if (!s || !cmds || !status) {
+		errno = ENOMEM;
+		goto out;
+	}
+
+	data = (__u8 *)s + hdr_size;
+	for (i = 0; i < nr_descs; i++) {
+		struct nvme_feat_desc *d = &descs[i];
+
+		for (sel = NVME_GET_FEATURES_SEL_CURRENT;
+		     sel <= NVME_GET_FEATURES_SEL_SUPPORTED; sel++) {
+			struct nvme_feat_value *v = &s->values[nr];
+
+			if (!(sels & (1 << sel)))
+				continue;
+
+			v->fid = d->fid;
+			v->sel = sel;
+			v->nsid = d->ns ? nsid : NVME_NSID_NONE;
+			/* the supported capabilities are returned in dword0 */
+			if (d->len && sel != NVME_GET_FEATURES_SEL_SUPPORTED) {
+				v->data = data;
+				v->data_len = d->len;
+				data += round_up(d->len, 8);
+			}
+
+			cmds[nr].opcode = nvme_admin_get_features;
+			cmds[nr].nsid = v->nsid;
+			cmds[nr].addr = (__u64)(uintptr_t)v->data;
+			cmds[nr].data_len = v->data_len;
+			cmds[nr].cdw10 = NVME_SET(d->fid, FEATURES_CDW10_FID) |
+				NVME_SET(sel, GET_FEATURES_CDW10_SEL);
+			cmds[nr].cdw11 = d->cdw11;
+			cmds[nr].timeout_ms = NVME_DEFAULT_IOCTL_TIMEOUT;
+			nr++;
+		}
+	}
+	s->nr_values = nr;
+
+	if (nr && nvme_submit_admin_passthru_batch(fd, cmds, nr, status))
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		s->values[i].status = status[i];
+		s->values[i].result = cmds[i].result;
+	}
+
+	*snap = s;
+	s = NULL;
+	err = 0;
+out:
+	free(status);
+	free(cmds);
+	free(s);
+	return err;
+}
+
+static int nvme_feat_value_cmp(const void *key, const void *elem)
+{
+	const struct nvme_feat_value *k = key, *v = elem;
+
+	if (k->fid != v->fid)
+		return k->fid < v->fid ? -1 : 1;
+	if (k->sel != v->sel)
+		return k->sel < v->sel ? -1 : 1;
+	return 0;
+}
+
+const struct nvme_feat_value *nvme_feat_snapshot_find(
+	const struct nvme_feat_snapshot *snap, __u8 fid,
+	enum nvme_get_features_sel sel)
+{
+	struct nvme_feat_value key = { .fid = fid, .sel = sel };
+
+	return bsearch(&key, snap->values, snap->nr_values,
+		       sizeof(snap->values[0]), nvme_feat_value_cmp);
+}
+
 int nvme_format_nvm(struct nvme_format_nvm_args *args)
 {
 	const size_t size_v1 = sizeof_args(struct nvme_format_nvm_args, lbaf, __u64);
@@ -1350,6 +2039,237 @@ int nvme_get_lba_status(struct nvme_get_lba_status_args *args)
 	return nvme_submit_admin_passthru(args->fd, &cmd, args->result);
 }
 
+/* the range length of Get LBA Status is a 16-bit number of blocks */
+#define NVME_LBA_STATUS_MAX_RL		0xffff
+#define NVME_LBA_STATUS_BUF_SIZE	4096
+#define NVME_LBA_STATUS_MAX_DESCS	\
+	((NVME_LBA_STATUS_BUF_SIZE - sizeof(struct nvme_lba_status)) / \
+	 sizeof(struct nvme_lba_status_desc))
+
+struct nvme_lba_status_piece {
+	__u64 next;
+	__u64 end;
+	struct nvme_lba_status *lbas;
+};
+
+static int nvme_lba_status_add_extent(struct nvme_lba_extent **extents,
+				      __u64 *nr, __u64 *alloc, __u64 slba,
+				      __u64 nlb)
+{
+	struct nvme_lba_extent *e;
+
+	if (*nr && (*extents)[*nr - 1].slba + (*extents)[*nr - 1].nlb == slba) {
+		(*extents)[*nr - 1].nlb += nlb;
+		return 0;
+	}
+
+	if (*nr == *alloc) {
+		__u64 n = *alloc ? *alloc * 2 : 64;
+
+		e = realloc(*extents, n * sizeof(*e));
+		if (!e) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*extents = e;
+		*alloc = n;
+	}
+	(*extents)[*nr].slba = slba;
+	(*extents)[(*nr)++].nlb = nlb;
+	return 0;
+}
+
+static int nvme_lba_extent_cmp(const void *a, const void *b)
+{
+	const struct nvme_lba_extent *ea = a, *eb = b;
+
+	if (ea->slba != eb->slba)
+		return ea->slba < eb->slba ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Adds the descriptors of a response to the extents, clipped to the
+ * piece. Returns 1 if the piece needs another command, 0 if it is done
+ * and -1 with errno set on failure.
+ */
+static int nvme_lba_status_parse(struct nvme_lba_status_piece *p,
+				 struct nvme_lba_extent **extents, __u64 *nr,
+				 __u64 *alloc)
+{
+	__u32 i, nlsd = le32_to_cpu(p->lbas->nlsd);
+	__u64 last = p->next;
+
+	if (nlsd > NVME_LBA_STATUS_MAX_DESCS)
+		nlsd = NVME_LBA_STATUS_MAX_DESCS;
+
+	for (i = 0; i < nlsd; i++) {
+		struct nvme_lba_status_desc *d = &p->lbas->descs[i];
+		__u64 slba = le64_to_cpu(d->dslba);
+		__u64 end = slba + le32_to_cpu(d->nlb);
+
+		if (slba < p->next)
+			slba = p->next;
+		if (end > p->end)
+			end = p->end;
+		if (end <= slba)
+			continue;
+		if (nvme_lba_status_add_extent(extents, nr, alloc, slba,
+					       end - slba))
+			return -1;
+		if (end > last)
+			last = end;
+	}
+
+	/* a full response may have left out descriptors past the last one */
+	if (nlsd == NVME_LBA_STATUS_MAX_DESCS && last > p->next &&
+	    last < p->end) {
+		p->next = last;
+		return 1;
+	}
+	return 0;
+}
+
+int nvme_get_lba_status_map(int fd, __u32 nsid, __u64 slba, __u64 nlb,
+			    enum nvme_lba_status_atype atype,
+			    struct nvme_lba_status_map **map)
+{
+	struct nvme_lba_status_piece pieces[NVME_PASSTHRU_BATCH_DEPTH] = { };
+	struct nvme_passthru_cmd64 cmds[NVME_PASSTHRU_BATCH_DEPTH];
+	int status[NVME_PASSTHRU_BATCH_DEPTH];
+	struct nvme_lba_extent *extents = NULL;
+	__u64 nr = 0, alloc = 0, cursor, end, i, j;
+	struct nvme_lba_status_map *m;
+	struct nvme_id_ctrl id;
+	struct nvme_id_ns ns;
+	void *bufs = NULL;
+	int err, n, active = 0;
+
+	err = nvme_identify_ctrl(fd, &id);
+	if (err)
+		return err;
+	if (!(le16_to_cpu(id.oacs) & NVME_CTRL_OACS_LBA_STATUS)) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	if (!nlb) {
+		err = nvme_identify_ns(fd, nsid, &ns);
+		if (err)
+			return err;
+		if (slba >= le64_to_cpu(ns.nsze)) {
+			errno = EINVAL;
+			return -1;
+		}
+		nlb = le64_to_cpu(ns.nsze) - slba;
+	}
+
+	if (posix_memalign(&bufs, getpagesize(),
+			   NVME_PASSTHRU_BATCH_DEPTH * NVME_LBA_STATUS_BUF_SIZE)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < NVME_PASSTHRU_BATCH_DEPTH; i++)
+		pieces[i].lbas = (void *)((__u8 *)bufs +
+					  i * NVME_LBA_STATUS_BUF_SIZE);
+
+	err = -1;
+	cursor = slba;
+	end = slba + nlb;
+	do {
+		/* start new pieces in the slots which became free */
+		for (i = 0; i < NVME_PASSTHRU_BATCH_DEPTH && cursor < end; i++) {
+			if (pieces[i].next < pieces[i].end)
+				continue;
+			pieces[i].next = cursor;
+			pieces[i].end = end - cursor > NVME_LBA_STATUS_MAX_RL ?
+				cursor + NVME_LBA_STATUS_MAX_RL : end;
+			cursor = pieces[i].end;
+			active++;
+		}
+
+		for (i = 0, n = 0; i < NVME_PASSTHRU_BATCH_DEPTH; i++) {
+			struct nvme_lba_status_piece *p = &pieces[i];
+
+			if (p->next >= p->end)
+				continue;
+			cmds[n] = (struct nvme_passthru_cmd64) {
+				.opcode		= nvme_admin_get_lba_status,
+				.nsid		= nsid,
+				.addr		= (__u64)(uintptr_t)p->lbas,
+				.data_len	= NVME_LBA_STATUS_BUF_SIZE,
+				.cdw10		= p->next & 0xffffffff,
+				.cdw11		= p->next >> 32,
+				.cdw12		= (NVME_LBA_STATUS_BUF_SIZE >> 2) - 1,
+				.cdw13		= NVME_SET(p->end - p->next,
+						GET_LBA_STATUS_CDW13_RL) |
+					NVME_SET(atype,
+						GET_LBA_STATUS_CDW13_ATYPE),
+				.timeout_ms	= NVME_DEFAULT_IOCTL_TIMEOUT,
+			};
+			n++;
+		}
+
+		if (nvme_submit_admin_passthru_batch(fd, cmds, n, status))
+			goto out;
+
+		for (i = 0, j = 0; i < NVME_PASSTHRU_BATCH_DEPTH; i++) {
+			struct nvme_lba_status_piece *p = &pieces[i];
+			int more;
+
+			if (p->next >= p->end)
+				continue;
+			if (status[j] < 0) {
+				errno = -status[j];
+				goto out;
+			}
+			if (status[j] > 0) {
+				err = status[j];
+				goto out;
+			}
+			j++;
+
+			more = nvme_lba_status_parse(p, &extents, &nr, &alloc);
+			if (more < 0)
+				goto out;
+			if (!more) {
+				p->next = p->end;
+				active--;
+			}
+		}
+	} while (active || cursor < end);
+
+	/* pieces complete out of order, and may report the same ranges */
+	qsort(extents, nr, sizeof(*extents), nvme_lba_extent_cmp);
+	for (i = 0, j = 0; i < nr; i++) {
+		if (j && extents[j - 1].slba + extents[j - 1].nlb >=
+		    extents[i].slba) {
+			__u64 e = extents[i].slba + extents[i].nlb;
+
+			if (e > extents[j - 1].slba + extents[j - 1].nlb)
+				extents[j - 1].nlb = e - extents[j - 1].slba;
+			continue;
+		}
+		extents[j++] = extents[i];
+	}
+	nr = j;
+
+	m = malloc(sizeof(*m) + nr * sizeof(m->extents[0]));
+	if (!m) {
+		errno = ENOMEM;
+		goto out;
+	}
+	m->nr_extents = nr;
+	if (nr)
+		memcpy(m->extents, extents, nr * sizeof(m->extents[0]));
+	*map = m;
+	err = 0;
+out:
+	free(extents);
+	free(bufs);
+	return err;
+}
+
 int nvme_directive_send(struct nvme_directive_send_args *args)
 {
 	__u32 cdw10 = args->data_len ? (args->data_len >> 2) - 1 : 0;
@@ -1571,6 +2491,20 @@ int nvme_submit_io_passthru64(int fd, struct nvme_passthru_cmd64 *cmd,
 	return nvme_submit_passthru64(fd, NVME_IOCTL_IO64_CMD, cmd, result);
 }
 
+int nvme_submit_io_passthru_batch(int fd, struct nvme_passthru_cmd64 *cmds,
+				  int nr_cmds, int *status)
+{
+	return nvme_submit_passthru_batch(fd, NVME_IOCTL_IO64_CMD, cmds,
+					  nr_cmds, status);
+}
+
+int nvme_submit_io_passthru_vec_batch(int fd, struct nvme_passthru_cmd64 *cmds,
+				      int nr_cmds, int *status)
+{
+	return nvme_submit_passthru_batch(fd, NVME_IOCTL_IO64_CMD_VEC, cmds,
+					  nr_cmds, status);
+}
+
 int nvme_io_passthru64(int fd, __u8 opcode, __u8 flags, __u16 rsvd,
 		       __u32 nsid, __u32 cdw2, __u32 cdw3, __u32 cdw10,
 		       __u32 cdw11, __u32 cdw12, __u32 cdw13, __u32 cdw14,
@@ -1644,7 +2578,8 @@ static int nvme_set_var_size_tags(__u32 *cmd_dw2, __u32 *cmd_dw3, __u32 *cmd_dw1
 	return 0;
 }
 
-int nvme_io(struct nvme_io_args *args, __u8 opcode)
+int nvme_io_init_cmd(struct nvme_io_args *args, __u8 opcode,
+		     struct nvme_passthru_cmd *cmd)
 {
 	const size_t size_v1 = sizeof_args(struct nvme_io_args, dsm, __u64);
 	const size_t size_v2 = sizeof_args(struct nvme_io_args, pif, __u64);
@@ -1676,7 +2611,7 @@ int nvme_io(struct nvme_io_args *args, __u8 opcode)
 		}
 	}
 
-	struct nvme_passthru_cmd cmd = {
+	*cmd = (struct nvme_passthru_cmd) {
 		.opcode		= opcode,
 		.nsid		= args->nsid,
 		.cdw2		= cdw2,
@@ -1694,6 +2629,16 @@ int nvme_io(struct nvme_io_args *args, __u8 opcode)
 		.timeout_ms	= args->timeout,
 	};
 
+	return 0;
+}
+
+int nvme_io(struct nvme_io_args *args, __u8 opcode)
+{
+	struct nvme_passthru_cmd cmd;
+
+	if (nvme_io_init_cmd(args, opcode, &cmd))
+		return -1;
+
 	return nvme_submit_io_passthru(args->fd, &cmd, args->result);
 }
 
@@ -10,7 +10,9 @@
 #ifndef _LIBNVME_IOCTL_H
 #define _LIBNVME_IOCTL_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <sys/ioctl.h>
 #include "types.h"
 #include "api-types.h"
@@ -170,15 +172,23 @@ struct nvme_uring_cmd {
 #define NVME_IOCTL_IO_CMD	_IOWR('N', 0x43, struct nvme_passthru_cmd)
 #define NVME_IOCTL_ADMIN64_CMD  _IOWR('N', 0x47, struct nvme_passthru_cmd64)
 #define NVME_IOCTL_IO64_CMD     _IOWR('N', 0x48, struct nvme_passthru_cmd64)
+#define NVME_IOCTL_IO64_CMD_VEC	_IOWR('N', 0x49, struct nvme_passthru_cmd64)
 
 /* io_uring async commands: */
 #define NVME_URING_CMD_IO	_IOWR('N', 0x80, struct nvme_uring_cmd)
 #define NVME_URING_CMD_IO_VEC	_IOWR('N', 0x81, struct nvme_uring_cmd)
+#define NVME_URING_CMD_ADMIN	_IOWR('N', 0x82, struct nvme_uring_cmd)
+#define NVME_URING_CMD_ADMIN_VEC _IOWR('N', 0x83, struct nvme_uring_cmd)
 
 #endif /* _UAPI_LINUX_NVME_IOCTL_H */
 
 #endif /* _LINUX_NVME_IOCTL_H */
 
+/* not in the kernel headers before 5.18 */
+#ifndef NVME_IOCTL_IO64_CMD_VEC
+#define NVME_IOCTL_IO64_CMD_VEC	_IOWR('N', 0x49, struct nvme_passthru_cmd64)
+#endif
+
 /**
  * sizeof_args - Helper function used to determine structure sizes
  * @type:	Argument structure type
@@ -208,6 +218,31 @@ struct nvme_uring_cmd {
 int nvme_submit_admin_passthru64(int fd, struct nvme_passthru_cmd64 *cmd,
 				 __u64 *result);
 
+/**
+ * nvme_submit_admin_passthru_batch() - Submit an array of 64-bit nvme
+ *				admin passthrough commands
+ * @fd:		File descriptor of nvme device
+ * @cmds:	The nvme admin commands to send
+ * @nr_cmds:	Number of commands in @cmds
+ * @status:	Array of @nr_cmds entries receiving the status of each command
+ *
+ * Sends all commands in @cmds with one call. When io_uring passthrough is
+ * available and @fd is a character device, the commands are kept in flight
+ * concurrently and may execute in any order. Otherwise they are issued one
+ * after the other using NVME_IOCTL_ADMIN64_CMD.
+ *
+ * Each @status entry is set to 0 on success, the nvme command status if a
+ * response was received (see &enum nvme_status_field) or a negative errno
+ * value otherwise. The result field of each completed command is set from
+ * the CQE DW0-1.
+ *
+ * Return: 0 if all commands were sent, or -1 with errno set if the
+ * submission was aborted. Commands which did not complete then have their
+ * @status entry set to -ECANCELED.
+ */
+int nvme_submit_admin_passthru_batch(int fd, struct nvme_passthru_cmd64 *cmds,
+				     int nr_cmds, int *status);
+
 /**
  * nvme_admin_passthru64() - Submit a 64-bit nvme passthrough command
  * @fd:		File descriptor of nvme device
@@ -294,6 +329,31 @@ int nvme_admin_passthru(int fd, __u8 opcode, __u8 flags, __u16 rsvd,
 		__u32 data_len, void *data, __u32 metadata_len, void *metadata,
 		__u32 timeout_ms, __u32 *result);
 
+/**
+ * nvme_submit_io_passthru_batch() - Submit an array of 64-bit nvme
+ *				io passthrough commands
+ * @fd:		File descriptor of nvme device
+ * @cmds:	The nvme io commands to send
+ * @nr_cmds:	Number of commands in @cmds
+ * @status:	Array of @nr_cmds entries receiving the status of each command
+ *
+ * Sends all commands in @cmds with one call. When io_uring passthrough is
+ * available and @fd is a character device, the commands are kept in flight
+ * concurrently and may execute in any order. Otherwise they are issued one
+ * after the other using NVME_IOCTL_IO64_CMD.
+ *
+ * Each @status entry is set to 0 on success, the nvme command status if a
+ * response was received (see &enum nvme_status_field) or a negative errno
+ * value otherwise. The result field of each completed command is set from
+ * the CQE DW0-1.
+ *
+ * Return: 0 if all commands were sent, or -1 with errno set if the
+ * submission was aborted. Commands which did not complete then have their
+ * @status entry set to -ECANCELED.
+ */
+int nvme_submit_io_passthru_batch(int fd, struct nvme_passthru_cmd64 *cmds,
+				  int nr_cmds, int *status);
+
 /**
  * nvme_submit_io_passthru64() - Submit a 64-bit nvme passthrough command
  * @fd:		File descriptor of nvme device
@@ -2868,6 +2928,76 @@ int nvme_get_features_write_protect(int fd, __u32 nsid,
 int nvme_get_features_iocs_profile(int fd, enum nvme_get_features_sel sel,
 				   __u32 *result);
 
+/**
+ * struct nvme_feat_value - Feature value read by nvme_get_features_all()
+ * @status:	0 on success, the nvme command status if a response was
+ *		received (see &enum nvme_status_field) or a negative errno
+ *		value otherwise
+ * @result:	The command completion result from CQE dword0
+ * @data:	Feature data, NULL if the feature has no data structure
+ * @data_len:	Length of @data in bytes
+ * @nsid:	Namespace the feature was read for, NVME_NSID_NONE for
+ *		features which are not namespace specific
+ * @fid:	Feature identifier, see &enum nvme_features_id
+ * @sel:	Select which the value was read with, see
+ *		&enum nvme_get_features_sel
+ */
+struct nvme_feat_value {
+	int	status;
+	__u32	result;
+	void	*data;
+	__u32	data_len;
+	__u32	nsid;
+	__u8	fid;
+	__u8	sel;
+};
+
+/**
+ * struct nvme_feat_snapshot - Feature values of a controller
+ * @nr_values:	Number of entries in @values
+ * @values:	Feature values, ordered by feature identifier and select
+ */
+struct nvme_feat_snapshot {
+	int			nr_values;
+	struct nvme_feat_value	values[];
+};
+
+/**
+ * nvme_get_features_all() - Read all features supported by a controller
+ * @fd:		File descriptor of nvme device
+ * @nsid:	Namespace to read the namespace specific features for, or
+ *		NVME_NSID_NONE to leave them out
+ * @sels:	Bitmask of the values to read for each feature, each bit
+ *		being (1 << &enum nvme_get_features_sel)
+ * @snap:	On success, set to the snapshot of the features, which is to
+ *		be freed with free()
+ *
+ * The supported features are taken from the Feature Identifiers Supported
+ * and Effects log page. Controllers which do not support that log page
+ * report the features indicated by their Identify Controller data. All
+ * Get Features commands are then sent with
+ * nvme_submit_admin_passthru_batch(), so they run concurrently where
+ * io_uring passthrough is available. Features with a data structure are
+ * read into buffers sized by nvme_get_feature_length(). A feature which
+ * failed to read is kept in the snapshot, with its @status set.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_get_features_all(int fd, __u32 nsid, unsigned int sels,
+			  struct nvme_feat_snapshot **snap);
+
+/**
+ * nvme_feat_snapshot_find() - Look up a feature value in a snapshot
+ * @snap:	Snapshot from nvme_get_features_all()
+ * @fid:	Feature identifier, see &enum nvme_features_id
+ * @sel:	Select the value was read with, see &enum nvme_get_features_sel
+ *
+ * Return: The feature value, or NULL if @snap does not hold it.
+ */
+const struct nvme_feat_value *nvme_feat_snapshot_find(
+	const struct nvme_feat_snapshot *snap, __u8 fid,
+	enum nvme_get_features_sel sel);
+
 /**
  * nvme_format_nvm() - Format nvme namespace(s)
  * @args:	&struct nvme_format_nvme_args argument structure
@@ -3086,6 +3216,54 @@ int nvme_security_receive(struct nvme_security_receive_args *args);
  */
 int nvme_get_lba_status(struct nvme_get_lba_status_args *args);
 
+/**
+ * struct nvme_lba_extent - Range of logical blocks
+ * @slba:	First logical block of the range
+ * @nlb:	Number of logical blocks in the range
+ */
+struct nvme_lba_extent {
+	__u64	slba;
+	__u64	nlb;
+};
+
+/**
+ * struct nvme_lba_status_map - Ranges reported by Get LBA Status
+ * @nr_extents:	Number of entries in @extents
+ * @extents:	Ranges ordered by starting LBA, with adjacent and
+ *		overlapping descriptors merged
+ */
+struct nvme_lba_status_map {
+	__u64			nr_extents;
+	struct nvme_lba_extent	extents[];
+};
+
+/**
+ * nvme_get_lba_status_map() - Map the LBA status of a range of a namespace
+ * @fd:		File descriptor of nvme device
+ * @nsid:	Namespace ID
+ * @slba:	First logical block to check
+ * @nlb:	Number of logical blocks to check, 0 to check up to the end of
+ *		the namespace
+ * @atype:	Action type, see &enum nvme_lba_status_atype
+ * @map:	On success, set to the map of the reported ranges, which is to
+ *		be freed with free()
+ *
+ * A single Get LBA Status command checks at most 65535 logical blocks.
+ * This splits the range into pieces of that size and sends the commands
+ * for them with nvme_submit_admin_passthru_batch(), so they run
+ * concurrently where io_uring passthrough is available. A piece whose
+ * descriptors did not all fit into one response is continued with
+ * further commands.
+ *
+ * Return: 0 on success, the nvme command status of the first command
+ * which failed if a response was received (see &enum nvme_status_field)
+ * or -1 with errno set otherwise. errno is set to EOPNOTSUPP if the
+ * controller does not support the Get LBA Status command.
+ */
+int nvme_get_lba_status_map(int fd, __u32 nsid, __u64 slba, __u64 nlb,
+			    enum nvme_lba_status_atype atype,
+			    struct nvme_lba_status_map **map);
+
 /**
  * nvme_directive_send() - Send directive command
  * @args:	&struct nvme_directive_send_args argument structure
@@ -3664,4 +3842,128 @@ int nvme_zns_append(struct nvme_zns_append_args *args);
  */
 int nvme_dim_send(struct nvme_dim_args *args);
 
+/**
+ * struct nvme_cmd_trace - Passthrough command passed to the command hooks
+ * @fd:		File descriptor the command is sent on
+ * @admin:	Command is an admin command, otherwise an I/O command
+ * @opcode:	Operation code
+ * @nsid:	Namespace ID
+ * @cdw10:	Command Dword 10, e.g. the log page or feature identifier
+ * @cdw11:	Command Dword 11
+ * @data_len:	Data buffer transfer length
+ * @status:	Set after completion to the nvme command status (see
+ *		&enum nvme_status_field), or a negative errno value if the
+ *		ioctl failed
+ * @duration_ns: Set after completion to the time spent in the ioctl, in
+ *		nanoseconds
+ */
+struct nvme_cmd_trace {
+	int	fd;
+	bool	admin;
+	__u8	opcode;
+	__u32	nsid;
+	__u32	cdw10;
+	__u32	cdw11;
+	__u32	data_len;
+	int	status;
+	__u64	duration_ns;
+};
+
+/**
+ * struct nvme_cmd_hooks - Callbacks around every passthrough command
+ * @pre:	Called before the command is submitted, may be NULL
+ * @post:	Called after the command completed, may be NULL
+ * @user_data:	Passed to @pre and @post
+ *
+ * The hooks are called on the thread submitting the command, for the
+ * commands issued through the synchronous ioctl interface. While hooks are
+ * installed, the batches and pipelined commands of the library are sent
+ * with the ioctls as well. Commands the caller sends on its own io_uring
+ * submission context are not traced.
+ */
+struct nvme_cmd_hooks {
+	void	(*pre)(const struct nvme_cmd_trace *t, void *user_data);
+	void	(*post)(const struct nvme_cmd_trace *t, void *user_data);
+	void	*user_data;
+};
+
+/**
+ * nvme_set_cmd_hooks() - Install process wide command hooks
+ * @hooks:	Hooks to call, or NULL to remove them. Must remain valid until
+ *		replaced, including for commands still in flight on other
+ *		threads.
+ *
+ * Without hooks and latency statistics, commands are submitted without
+ * taking any timestamps.
+ */
+void nvme_set_cmd_hooks(const struct nvme_cmd_hooks *hooks);
+
+/**
+ * struct nvme_cmd_latency_stats - Latency history of a passthrough command
+ * @count:	Number of completed commands
+ * @errors:	Number of commands which failed, with an nvme status or errno
+ * @bytes:	Sum of the data transfer lengths
+ * @min_us:	Shortest latency, in microseconds
+ * @max_us:	Longest latency, in microseconds
+ * @mean_us:	Mean latency, in microseconds
+ * @p50_us:	Median latency, in microseconds
+ * @p90_us:	90th percentile latency, in microseconds
+ * @p99_us:	99th percentile latency, in microseconds
+ *
+ * Percentiles are approximated from a histogram with power-of-two sized
+ * buckets, and given as the upper bound of the bucket.
+ */
+struct nvme_cmd_latency_stats {
+	__u64	count;
+	__u64	errors;
+	__u64	bytes;
+	__u32	min_us;
+	__u32	max_us;
+	__u32	mean_us;
+	__u32	p50_us;
+	__u32	p90_us;
+	__u32	p99_us;
+};
+
+/**
+ * nvme_enable_cmd_latency_stats() - Record the latency of every command
+ * @enable:	Start or stop recording
+ *
+ * Latencies are recorded process wide per admin and I/O opcode, with
+ * atomic counters which are safe to update and read from any thread.
+ * Like with nvme_set_cmd_hooks(), the library sends its batches with the
+ * ioctls while recording. Stopping keeps the history recorded so far.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_enable_cmd_latency_stats(bool enable);
+
+/**
+ * nvme_get_cmd_latency_stats() - Get the latency history of a command
+ * @admin:	Admin command if true, otherwise I/O command
+ * @opcode:	Operation code, see &enum nvme_admin_opcode and
+ *		&enum nvme_io_opcode
+ * @stats:	Latency statistics to fill in
+ *
+ * Return: 0 on success, or -1 with errno set to ENOENT if no such command
+ * was recorded.
+ */
+int nvme_get_cmd_latency_stats(bool admin, __u8 opcode,
+			       struct nvme_cmd_latency_stats *stats);
+
+/**
+ * nvme_reset_cmd_latency_stats() - Discard the recorded latency history
+ */
+void nvme_reset_cmd_latency_stats(void);
+
+/**
+ * nvme_dump_cmd_latency_stats() - Print the recorded latency history
+ * @fp:		Stream to print to
+ *
+ * Prints one line for every admin and I/O opcode recorded so far.
+ *
+ * Return: Number of lines printed, or -1 with errno set on a write error.
+ */
+int nvme_dump_cmd_latency_stats(FILE *fp);
+
 #endif /* _LIBNVME_IOCTL_H */
@@ -7,335 +7,1159 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <sys/stat.h>
+
 #include <json.h>
 
 #include "fabrics.h"
 #include "log.h"
 #include "private.h"
 
+/*
+ * The config file is read with a streaming parser, which reports every
+ * value to a callback instead of building a json-c object tree first.
+ * Strings are decoded in place in the file buffer, so they stay valid
+ * until the whole file has been parsed and never need to be copied.
+ */
+#define JSON_MAX_DEPTH	32
+
+enum json_event {
+	JSON_EV_OBJECT_START,
+	JSON_EV_OBJECT_END,
+	JSON_EV_ARRAY_START,
+	JSON_EV_ARRAY_END,
+	JSON_EV_STRING,
+	JSON_EV_NUMBER,
+	JSON_EV_BOOL,
+	JSON_EV_NULL,
+};
+
+/*
+ * @key is the member name of the value within an object and NULL within
+ * an array. @str is set for strings, @num for numbers and booleans.
+ */
+typedef int (*json_event_cb)(void *arg, enum json_event ev, const char *key,
+			     const char *str, long long num);
+
+struct json_parser {
+	char *pos;
+	char *end;	/* followed by a NUL byte */
+	json_event_cb cb;
+	void *arg;
+};
+
+static int json_parse_value(struct json_parser *p, const char *key,
+			    int depth);
+
+static int json_syntax_error(struct json_parser *p)
+{
+	errno = EPROTO;
+	return -1;
+}
+
+static void json_skip_space(struct json_parser *p)
+{
+	while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' ||
+				   *p->pos == '\n' || *p->pos == '\r'))
+		p->pos++;
+}
+
+static int json_hex4(const char *s, unsigned int *val)
+{
+	int i;
+
+	*val = 0;
+	for (i = 0; i < 4; i++) {
+		*val <<= 4;
+		if (s[i] >= '0' && s[i] <= '9')
+			*val |= s[i] - '0';
+		else if (s[i] >= 'a' && s[i] <= 'f')
+			*val |= s[i] - 'a' + 10;
+		else if (s[i] >= 'A' && s[i] <= 'F')
+			*val |= s[i] - 'A' + 10;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+static char *json_put_utf8(char *out, unsigned int cp)
+{
+	if (cp < 0x80) {
+		*out++ = cp;
+	} else if (cp < 0x800) {
+		*out++ = 0xc0 | cp >> 6;
+		*out++ = 0x80 | (cp & 0x3f);
+	} else if (cp < 0x10000) {
+		*out++ = 0xe0 | cp >> 12;
+		*out++ = 0x80 | (cp >> 6 & 0x3f);
+		*out++ = 0x80 | (cp & 0x3f);
+	} else {
+		*out++ = 0xf0 | cp >> 18;
+		*out++ = 0x80 | (cp >> 12 & 0x3f);
+		*out++ = 0x80 | (cp >> 6 & 0x3f);
+		*out++ = 0x80 | (cp & 0x3f);
+	}
+	return out;
+}
+
+/* an escape sequence is never shorter than the character it stands for */
+static char *json_parse_string(struct json_parser *p)
+{
+	char *str = ++p->pos, *out = str;
+	unsigned int cp, lo;
+	char c;
+
+	while (p->pos < p->end) {
+		c = *p->pos++;
+		if (c == '"') {
+			*out = '\0';
+			return str;
+		}
+		if ((unsigned char)c < 0x20)
+			return NULL;
+		if (c != '\\') {
+			*out++ = c;
+			continue;
+		}
+		if (p->pos >= p->end)
+			return NULL;
+		switch (c = *p->pos++) {
+		case '"':
+		case '\\':
+		case '/':
+			*out++ = c;
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'u':
+			if (p->end - p->pos < 4 || json_hex4(p->pos, &cp))
+				return NULL;
+			p->pos += 4;
+			if (cp >= 0xd800 && cp < 0xdc00 &&
+			    p->end - p->pos >= 6 &&
+			    p->pos[0] == '\\' && p->pos[1] == 'u' &&
+			    !json_hex4(p->pos + 2, &lo) &&
+			    lo >= 0xdc00 && lo < 0xe000) {
+				cp = 0x10000 + ((cp - 0xd800) << 10) +
+					(lo - 0xdc00);
+				p->pos += 6;
+			}
+			out = json_put_utf8(out, cp);
+			break;
+		default:
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+static int json_parse_literal(struct json_parser *p, const char *key,
+			      const char *word, enum json_event ev,
+			      long long num)
+{
+	size_t len = strlen(word);
+
+	if ((size_t)(p->end - p->pos) < len || memcmp(p->pos, word, len))
+		return json_syntax_error(p);
+	p->pos += len;
+	return p->cb(p->arg, ev, key, NULL, num);
+}
+
+static int json_parse_number(struct json_parser *p, const char *key)
+{
+	char *endp;
+	long long num;
+
+	if (*p->pos != '-' && (*p->pos < '0' || *p->pos > '9'))
+		return json_syntax_error(p);
+	num = strtoll(p->pos, &endp, 10);
+	if (*endp == '.' || *endp == 'e' || *endp == 'E')
+		num = strtod(p->pos, &endp);
+	if (endp == p->pos || endp > p->end)
+		return json_syntax_error(p);
+	p->pos = endp;
+	return p->cb(p->arg, JSON_EV_NUMBER, key, NULL, num);
+}
+
+static int json_parse_container(struct json_parser *p, const char *key,
+				int depth)
+{
+	bool object = *p->pos == '{';
+	char close = object ? '}' : ']';
+	const char *name = NULL;
+	char c;
+
+	if (depth >= JSON_MAX_DEPTH)
+		return json_syntax_error(p);
+	p->pos++;
+	if (p->cb(p->arg, object ? JSON_EV_OBJECT_START : JSON_EV_ARRAY_START,
+		  key, NULL, 0))
+		return -1;
+
+	json_skip_space(p);
+	if (p->pos < p->end && *p->pos == close) {
+		p->pos++;
+		goto out;
+	}
+	for (;;) {
+		if (object) {
+			json_skip_space(p);
+			if (p->pos >= p->end || *p->pos != '"')
+				return json_syntax_error(p);
+			name = json_parse_string(p);
+			if (!name)
+				return json_syntax_error(p);
+			json_skip_space(p);
+			if (p->pos >= p->end || *p->pos++ != ':')
+				return json_syntax_error(p);
+		}
+		if (json_parse_value(p, name, depth + 1))
+			return -1;
+		json_skip_space(p);
+		if (p->pos >= p->end)
+			return json_syntax_error(p);
+		c = *p->pos++;
+		if (c == close)
+			break;
+		if (c != ',')
+			return json_syntax_error(p);
+	}
+out:
+	return p->cb(p->arg, object ? JSON_EV_OBJECT_END : JSON_EV_ARRAY_END,
+		     key, NULL, 0);
+}
+
+static int json_parse_value(struct json_parser *p, const char *key,
+			    int depth)
+{
+	char *str;
+
+	json_skip_space(p);
+	if (p->pos >= p->end)
+		return json_syntax_error(p);
+
+	switch (*p->pos) {
+	case '{':
+	case '[':
+		return json_parse_container(p, key, depth);
+	case '"':
+		str = json_parse_string(p);
+		if (!str)
+			return json_syntax_error(p);
+		return p->cb(p->arg, JSON_EV_STRING, key, str, 0);
+	case 't':
+		return json_parse_literal(p, key, "true", JSON_EV_BOOL, 1);
+	case 'f':
+		return json_parse_literal(p, key, "false", JSON_EV_BOOL, 0);
+	case 'n':
+		return json_parse_literal(p, key, "null", JSON_EV_NULL, 0);
+	default:
+		return json_parse_number(p, key);
+	}
+}
+
+static int json_parse(struct json_parser *p)
+{
+	if (json_parse_value(p, NULL, 0))
+		return -1;
+	json_skip_space(p);
+	if (p->pos != p->end)
+		return json_syntax_error(p);
+	return 0;
+}
+
+/*
+ * Hosts, subsystems and controllers are looked up as soon as the NQN
+ * of their parent is known, which is right away for files written by
+ * json_update_config(). Ports seen earlier, and their options, are kept
+ * until the enclosing host or subsystem object ends.
+ */
+enum json_config_ctx {
+	JSON_CTX_SKIP,
+	JSON_CTX_HOSTS,
+	JSON_CTX_HOST,
+	JSON_CTX_SUBSYSTEMS,
+	JSON_CTX_SUBSYS,
+	JSON_CTX_PORTS,
+	JSON_CTX_PORT,
+};
+
+struct json_opt {
+	const char *key;
+	const char *str;
+	long long num;
+};
+
+struct json_port {
+	const char *transport;
+	const char *traddr;
+	const char *host_traddr;
+	const char *host_iface;
+	const char *trsvcid;
+	const char *dhchap_ctrl_key;
+	unsigned int first_opt;
+	unsigned int nr_opts;
+};
+
+struct json_pending_subsys {
+	const char *nqn;
+	unsigned int first_port;
+	unsigned int nr_ports;
+};
+
+struct json_config {
+	nvme_root_t r;
+	enum json_config_ctx ctx[JSON_MAX_DEPTH];
+	int depth;
+
+	const char *hostnqn;
+	const char *hostid;
+	const char *dhchap_key;
+	const char *hostsymname;
+	bool host_resolved;
+	nvme_host_t h;
+
+	const char *subsysnqn;
+	bool subsys_resolved;
+	nvme_subsystem_t s;
+	unsigned int first_port;
+
+	struct json_port port;
+
+	struct json_opt *opts;
+	unsigned int nr_opts, alloc_opts;
+	struct json_port *ports;
+	unsigned int nr_ports, alloc_ports;
+	struct json_pending_subsys *subsys;
+	unsigned int nr_subsys, alloc_subsys;
+};
+
+static void *json_grow(void *array, unsigned int *alloc, unsigned int nr,
+		       size_t size)
+{
+	unsigned int n = *alloc ? *alloc * 2 : 16;
+	void *tmp;
+
+	if (nr < *alloc)
+		return array;
+	tmp = realloc(array, n * size);
+	if (!tmp) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	*alloc = n;
+	return tmp;
+}
+
+static int json_opt_get_int(const struct json_opt *o)
+{
+	return o->str ? atoi(o->str) : o->num;
+}
+
+static bool json_opt_get_bool(const struct json_opt *o)
+{
+	return o->str ? *o->str != '\0' : o->num != 0;
+}
+
 #define JSON_UPDATE_INT_OPTION(c, k, a, o)				\
-	if (!strcmp(# a, k ) && !c->a) c->a = json_object_get_int(o);
+	if (!strcmp(# a, k ) && !c->a) c->a = json_opt_get_int(o);
 #define JSON_UPDATE_BOOL_OPTION(c, k, a, o)				\
-	if (!strcmp(# a, k ) && !c->a) c->a = json_object_get_boolean(o);
+	if (!strcmp(# a, k ) && !c->a) c->a = json_opt_get_bool(o);
 
-static void json_update_attributes(nvme_ctrl_t c,
-				   struct json_object *ctrl_obj)
+static void json_update_attribute(nvme_ctrl_t c, const struct json_opt *o)
 {
 	struct nvme_fabrics_config *cfg = nvme_ctrl_get_config(c);
+	const char *key_str = o->key;
+
+	JSON_UPDATE_INT_OPTION(cfg, key_str, nr_io_queues, o);
+	JSON_UPDATE_INT_OPTION(cfg, key_str, nr_write_queues, o);
+	JSON_UPDATE_INT_OPTION(cfg, key_str, nr_poll_queues, o);
+	JSON_UPDATE_INT_OPTION(cfg, key_str, queue_size, o);
+	JSON_UPDATE_INT_OPTION(cfg, key_str, keep_alive_tmo, o);
+	JSON_UPDATE_INT_OPTION(cfg, key_str, reconnect_delay, o);
+	/* like the options above, only set if still at the default */
+	if (!strcmp("ctrl_loss_tmo", key_str) &&
+	    cfg->ctrl_loss_tmo == NVMF_DEF_CTRL_LOSS_TMO)
+		cfg->ctrl_loss_tmo = json_opt_get_int(o);
+	JSON_UPDATE_INT_OPTION(cfg, key_str, fast_io_fail_tmo, o);
+	if (!strcmp("tos", key_str) && cfg->tos == -1)
+		cfg->tos = json_opt_get_int(o);
+	JSON_UPDATE_BOOL_OPTION(cfg, key_str, duplicate_connect, o);
+	JSON_UPDATE_BOOL_OPTION(cfg, key_str, disable_sqflow, o);
+	JSON_UPDATE_BOOL_OPTION(cfg, key_str, hdr_digest, o);
+	JSON_UPDATE_BOOL_OPTION(cfg, key_str, data_digest, o);
+	JSON_UPDATE_BOOL_OPTION(cfg, key_str, tls, o);
+	if (!strcmp("persistent", key_str) &&
+	    !nvme_ctrl_is_persistent(c) && json_opt_get_bool(o))
+		nvme_ctrl_set_persistent(c, true);
+	if (!strcmp("discovery", key_str) &&
+	    !nvme_ctrl_is_discovery_ctrl(c) && json_opt_get_bool(o))
+		nvme_ctrl_set_discovery_ctrl(c, true);
+}
+
+/*
+ * The lookups add new nodes in front of their siblings. Move them to the
+ * end, so the tree and the file written from it keep the order of the
+ * file read. @first is the node which was in front before the lookup.
+ */
+static void json_keep_order(struct list_head *head, struct list_node *first,
+			    struct list_node *node)
+{
+	if (node == first || head->n.next != node)
+		return;
+	list_del(node);
+	list_add_tail(head, node);
+}
+
+static nvme_host_t json_lookup_host(nvme_root_t r, const char *hostnqn,
+				    const char *hostid)
+{
+	struct list_node *first = r->hosts.n.next;
+	nvme_host_t h;
+
+	h = nvme_lookup_host(r, hostnqn, hostid);
+	if (h)
+		json_keep_order(&r->hosts, first, &h->entry);
+	return h;
+}
+
+static nvme_subsystem_t json_lookup_subsys(nvme_host_t h, const char *nqn)
+{
+	struct list_node *first = h->subsystems.n.next;
+	nvme_subsystem_t s;
+
+	s = nvme_lookup_subsystem(h, NULL, nqn);
+	if (s)
+		json_keep_order(&h->subsystems, first, &s->entry);
+	return s;
+}
 
-	json_object_object_foreach(ctrl_obj, key_str, val_obj) {
-		JSON_UPDATE_INT_OPTION(cfg, key_str,
-				       nr_io_queues, val_obj);
-		JSON_UPDATE_INT_OPTION(cfg, key_str,
-				       nr_write_queues, val_obj);
-		JSON_UPDATE_INT_OPTION(cfg, key_str,
-				       nr_poll_queues, val_obj);
-		JSON_UPDATE_INT_OPTION(cfg, key_str,
-				       queue_size, val_obj);
-		JSON_UPDATE_INT_OPTION(cfg, key_str,
-				       keep_alive_tmo, val_obj);
-		JSON_UPDATE_INT_OPTION(cfg, key_str,
-				       reconnect_delay, val_obj);
-		if (!strcmp("ctrl_loss_tmo", key_str) &&
-		    cfg->ctrl_loss_tmo != NVMF_DEF_CTRL_LOSS_TMO)
-			cfg->ctrl_loss_tmo = json_object_get_int(val_obj);
-		JSON_UPDATE_INT_OPTION(cfg, key_str,
-				       fast_io_fail_tmo, val_obj);
-		if (!strcmp("tos", key_str) && cfg->tos != -1)
-			cfg->tos = json_object_get_int(val_obj);
-		JSON_UPDATE_BOOL_OPTION(cfg, key_str,
-					duplicate_connect, val_obj);
-		JSON_UPDATE_BOOL_OPTION(cfg, key_str,
-					disable_sqflow, val_obj);
-		JSON_UPDATE_BOOL_OPTION(cfg, key_str,
-					hdr_digest, val_obj);
-		JSON_UPDATE_BOOL_OPTION(cfg, key_str,
-					data_digest, val_obj);
-		JSON_UPDATE_BOOL_OPTION(cfg, key_str,
-					tls, val_obj);
-		if (!strcmp("persistent", key_str) &&
-		    !nvme_ctrl_is_persistent(c))
-			nvme_ctrl_set_persistent(c, true);
-		if (!strcmp("discovery", key_str) &&
-		    !nvme_ctrl_is_discovery_ctrl(c))
-			nvme_ctrl_set_discovery_ctrl(c, true);
-	}
-}
-
-static void json_parse_port(nvme_subsystem_t s, struct json_object *port_obj)
+static void json_apply_port(struct json_config *jc, nvme_subsystem_t s,
+			    const struct json_port *port)
 {
+	struct list_node *first = s->ctrls.n.next;
 	nvme_ctrl_t c;
-	struct json_object *attr_obj;
-	const char *transport, *traddr = NULL;
-	const char *host_traddr = NULL, *host_iface = NULL, *trsvcid = NULL;
+	unsigned int i;
 
-	attr_obj = json_object_object_get(port_obj, "transport");
-	if (!attr_obj)
+	if (!port->transport)
 		return;
-	transport = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "traddr");
-	if (attr_obj)
-		traddr = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "host_traddr");
-	if (attr_obj)
-		host_traddr = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "host_iface");
-	if (attr_obj)
-		host_iface = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(port_obj, "trsvcid");
-	if (attr_obj)
-		trsvcid = json_object_get_string(attr_obj);
-	c = nvme_lookup_ctrl(s, transport, traddr, host_traddr,
-			     host_iface, trsvcid, NULL);
+	c = nvme_lookup_ctrl(s, port->transport, port->traddr,
+			     port->host_traddr, port->host_iface,
+			     port->trsvcid, NULL);
 	if (!c)
 		return;
-	json_update_attributes(c, port_obj);
-	attr_obj = json_object_object_get(port_obj, "dhchap_ctrl_key");
-	if (attr_obj)
-		nvme_ctrl_set_dhchap_key(c, json_object_get_string(attr_obj));
+	json_keep_order(&s->ctrls, first, &c->entry);
+	for (i = 0; i < port->nr_opts; i++)
+		json_update_attribute(c, &jc->opts[port->first_opt + i]);
+	if (port->dhchap_ctrl_key)
+		nvme_ctrl_set_dhchap_key(c, port->dhchap_ctrl_key);
 }
 
-static void json_parse_subsys(nvme_host_t h, struct json_object *subsys_obj)
+/* applies and drops the ports of the current subsystem kept so far */
+static void json_flush_ports(struct json_config *jc)
 {
-	struct json_object *nqn_obj, *port_array;
-	nvme_subsystem_t s;
-	const char *nqn;
-	int p;
+	unsigned int i;
 
-	nqn_obj = json_object_object_get(subsys_obj, "nqn");
-	if (!nqn_obj)
+	if (jc->nr_ports == jc->first_port)
 		return;
-	nqn = json_object_get_string(nqn_obj);
-	s = nvme_lookup_subsystem(h, NULL, nqn);
-	port_array = json_object_object_get(subsys_obj, "ports");
-	if (!port_array)
+	for (i = jc->first_port; i < jc->nr_ports; i++)
+		json_apply_port(jc, jc->s, &jc->ports[i]);
+	jc->nr_opts = jc->ports[jc->first_port].first_opt;
+	jc->nr_ports = jc->first_port;
+}
+
+static void json_resolve_host(struct json_config *jc)
+{
+	if (jc->host_resolved || !jc->hostnqn)
 		return;
-	for (p = 0; p < json_object_array_length(port_array); p++) {
-		struct json_object *port_obj;
+	jc->host_resolved = true;
+	jc->h = json_lookup_host(jc->r, jc->hostnqn, jc->hostid);
+}
+
+static void json_resolve_subsys(struct json_config *jc)
+{
+	if (jc->subsys_resolved || !jc->host_resolved || !jc->subsysnqn)
+		return;
+	jc->subsys_resolved = true;
+	if (jc->h)
+		jc->s = json_lookup_subsys(jc->h, jc->subsysnqn);
+	if (jc->s)
+		json_flush_ports(jc);
+}
 
-		port_obj = json_object_array_get_idx(port_array, p);
-		if (port_obj)
-			json_parse_port(s, port_obj);
+static int json_end_port(struct json_config *jc)
+{
+	struct json_port *ports;
+
+	jc->port.nr_opts = jc->nr_opts - jc->port.first_opt;
+	json_resolve_subsys(jc);
+	if (jc->subsys_resolved) {
+		if (jc->s)
+			json_apply_port(jc, jc->s, &jc->port);
+		jc->nr_opts = jc->port.first_opt;
+		return 0;
 	}
+
+	ports = json_grow(jc->ports, &jc->alloc_ports, jc->nr_ports,
+			  sizeof(*ports));
+	if (!ports)
+		return -1;
+	jc->ports = ports;
+	jc->ports[jc->nr_ports++] = jc->port;
+	return 0;
 }
 
-static void json_parse_host(nvme_root_t r, struct json_object *host_obj)
+static int json_end_subsys(struct json_config *jc)
 {
-	struct json_object *attr_obj, *subsys_array, *subsys_obj;
-	nvme_host_t h;
-	const char *hostnqn, *hostid = NULL;
-	int s;
+	struct json_pending_subsys *subsys;
 
-	attr_obj = json_object_object_get(host_obj, "hostnqn");
-	if (!attr_obj)
-		return;
-	hostnqn = json_object_get_string(attr_obj);
-	attr_obj = json_object_object_get(host_obj, "hostid");
-	if (attr_obj)
-		hostid = json_object_get_string(attr_obj);
-	h = nvme_lookup_host(r, hostnqn, hostid);
-	attr_obj = json_object_object_get(host_obj, "dhchap_key");
-	if (attr_obj)
-		nvme_host_set_dhchap_key(h, json_object_get_string(attr_obj));
-	attr_obj = json_object_object_get(host_obj, "hostsymname");
-	if (attr_obj)
-		nvme_host_set_hostsymname(h, json_object_get_string(attr_obj));
-	subsys_array = json_object_object_get(host_obj, "subsystems");
-	if (!subsys_array)
-		return;
-	for (s = 0; s < json_object_array_length(subsys_array); s++) {
-		subsys_obj = json_object_array_get_idx(subsys_array, s);
-		if (subsys_obj)
-			json_parse_subsys(h, subsys_obj);
+	json_resolve_subsys(jc);
+	if (!jc->subsys_resolved && jc->subsysnqn) {
+		subsys = json_grow(jc->subsys, &jc->alloc_subsys,
+				   jc->nr_subsys, sizeof(*subsys));
+		if (!subsys)
+			return -1;
+		jc->subsys = subsys;
+		jc->subsys[jc->nr_subsys].nqn = jc->subsysnqn;
+		jc->subsys[jc->nr_subsys].first_port = jc->first_port;
+		jc->subsys[jc->nr_subsys].nr_ports =
+			jc->nr_ports - jc->first_port;
+		jc->nr_subsys++;
+	} else if (jc->nr_ports > jc->first_port) {
+		/* no NQN, or the subsystem could not be created */
+		jc->nr_opts = jc->ports[jc->first_port].first_opt;
+		jc->nr_ports = jc->first_port;
+	}
+	return 0;
+}
+
+static void json_end_host(struct json_config *jc)
+{
+	struct json_pending_subsys *ps;
+	nvme_subsystem_t s;
+	unsigned int i, j;
+
+	json_resolve_host(jc);
+	if (jc->h) {
+		if (jc->dhchap_key)
+			nvme_host_set_dhchap_key(jc->h, jc->dhchap_key);
+		if (jc->hostsymname)
+			nvme_host_set_hostsymname(jc->h, jc->hostsymname);
+		for (i = 0; i < jc->nr_subsys; i++) {
+			ps = &jc->subsys[i];
+			s = json_lookup_subsys(jc->h, ps->nqn);
+			if (!s)
+				continue;
+			for (j = 0; j < ps->nr_ports; j++)
+				json_apply_port(jc, s,
+						&jc->ports[ps->first_port + j]);
+		}
+	}
+	jc->nr_opts = 0;
+	jc->nr_ports = 0;
+	jc->nr_subsys = 0;
+}
+
+static int json_config_scalar(struct json_config *jc, enum json_config_ctx ctx,
+			      const char *key, const char *str, long long num)
+{
+	struct json_opt *opts;
+
+	switch (ctx) {
+	case JSON_CTX_HOST:
+		if (!str)
+			break;
+		if (!strcmp(key, "hostnqn"))
+			jc->hostnqn = str;
+		else if (!strcmp(key, "hostid"))
+			jc->hostid = str;
+		else if (!strcmp(key, "dhchap_key"))
+			jc->dhchap_key = str;
+		else if (!strcmp(key, "hostsymname"))
+			jc->hostsymname = str;
+		break;
+	case JSON_CTX_SUBSYS:
+		if (str && !strcmp(key, "nqn"))
+			jc->subsysnqn = str;
+		break;
+	case JSON_CTX_PORT:
+		if (str && !strcmp(key, "transport"))
+			jc->port.transport = str;
+		else if (str && !strcmp(key, "traddr"))
+			jc->port.traddr = str;
+		else if (str && !strcmp(key, "host_traddr"))
+			jc->port.host_traddr = str;
+		else if (str && !strcmp(key, "host_iface"))
+			jc->port.host_iface = str;
+		else if (str && !strcmp(key, "trsvcid"))
+			jc->port.trsvcid = str;
+		else if (str && !strcmp(key, "dhchap_ctrl_key"))
+			jc->port.dhchap_ctrl_key = str;
+		else {
+			opts = json_grow(jc->opts, &jc->alloc_opts,
+					 jc->nr_opts, sizeof(*opts));
+			if (!opts)
+				return -1;
+			jc->opts = opts;
+			jc->opts[jc->nr_opts].key = key;
+			jc->opts[jc->nr_opts].str = str;
+			jc->opts[jc->nr_opts].num = num;
+			jc->nr_opts++;
+		}
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static enum json_config_ctx json_config_child(enum json_config_ctx parent,
+					      bool object, const char *key)
+{
+	switch (parent) {
+	case JSON_CTX_HOSTS:
+		return object ? JSON_CTX_HOST : JSON_CTX_SKIP;
+	case JSON_CTX_HOST:
+		return !object && !strcmp(key, "subsystems") ?
+			JSON_CTX_SUBSYSTEMS : JSON_CTX_SKIP;
+	case JSON_CTX_SUBSYSTEMS:
+		return object ? JSON_CTX_SUBSYS : JSON_CTX_SKIP;
+	case JSON_CTX_SUBSYS:
+		return !object && !strcmp(key, "ports") ?
+			JSON_CTX_PORTS : JSON_CTX_SKIP;
+	case JSON_CTX_PORTS:
+		return object ? JSON_CTX_PORT : JSON_CTX_SKIP;
+	default:
+		return JSON_CTX_SKIP;
+	}
+}
+
+static int json_config_event(void *arg, enum json_event ev, const char *key,
+			     const char *str, long long num)
+{
+	struct json_config *jc = arg;
+	enum json_config_ctx ctx;
+
+	switch (ev) {
+	case JSON_EV_OBJECT_START:
+	case JSON_EV_ARRAY_START:
+		if (!jc->depth)
+			ctx = ev == JSON_EV_ARRAY_START ?
+				JSON_CTX_HOSTS : JSON_CTX_SKIP;
+		else
+			ctx = json_config_child(jc->ctx[jc->depth - 1],
+						ev == JSON_EV_OBJECT_START,
+						key);
+		jc->ctx[jc->depth++] = ctx;
+
+		switch (ctx) {
+		case JSON_CTX_HOST:
+			jc->hostnqn = jc->hostid = NULL;
+			jc->dhchap_key = jc->hostsymname = NULL;
+			jc->host_resolved = false;
+			jc->h = NULL;
+			break;
+		case JSON_CTX_SUBSYSTEMS:
+			json_resolve_host(jc);
+			break;
+		case JSON_CTX_SUBSYS:
+			jc->subsysnqn = NULL;
+			jc->subsys_resolved = false;
+			jc->s = NULL;
+			jc->first_port = jc->nr_ports;
+			break;
+		case JSON_CTX_PORTS:
+			json_resolve_subsys(jc);
+			break;
+		case JSON_CTX_PORT:
+			memset(&jc->port, 0, sizeof(jc->port));
+			jc->port.first_opt = jc->nr_opts;
+			break;
+		default:
+			break;
+		}
+		return 0;
+	case JSON_EV_OBJECT_END:
+	case JSON_EV_ARRAY_END:
+		switch (jc->ctx[--jc->depth]) {
+		case JSON_CTX_PORT:
+			return json_end_port(jc);
+		case JSON_CTX_SUBSYS:
+			return json_end_subsys(jc);
+		case JSON_CTX_HOST:
+			json_end_host(jc);
+			break;
+		default:
+			break;
+		}
+		return 0;
+	default:
+		if (!jc->depth || !key)
+			return 0;
+		return json_config_scalar(jc, jc->ctx[jc->depth - 1], key,
+					  str, num);
+	}
+}
+
+static char *json_read_file(const char *config_file, size_t *len)
+{
+	struct stat st;
+	size_t size = 0;
+	char *buf = NULL, *tmp;
+	ssize_t n;
+	int fd, err;
+
+	fd = open(config_file, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		size = st.st_size;
+
+	*len = 0;
+	for (;;) {
+		if (!buf || *len == size) {
+			if (buf || !size)
+				size = size ? size * 2 : 4096;
+			tmp = realloc(buf, size + 1);
+			if (!tmp) {
+				errno = ENOMEM;
+				goto fail;
+			}
+			buf = tmp;
+		}
+		n = read(fd, buf + *len, size - *len);
+		if (n < 0)
+			goto fail;
+		if (!n)
+			break;
+		*len += n;
+	}
+	buf[*len] = '\0';
+	close(fd);
+	return buf;
+
+fail:
+	err = errno;
+	free(buf);
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+static int json_check_event(void *arg, enum json_event ev, const char *key,
+			    const char *str, long long num)
+{
+	return 0;
+}
+
+/*
+ * The tree is only updated once the whole file is known to be valid.
+ * Strings are decoded in place, so the syntax is checked on a copy.
+ */
+static int json_check_syntax(nvme_root_t r, const char *config_file,
+			     const char *buf, size_t len)
+{
+	struct json_parser p = { .cb = json_check_event };
+	char *copy;
+	int ret;
+
+	copy = malloc(len + 1);
+	if (!copy) {
+		errno = ENOMEM;
+		return -1;
 	}
+	memcpy(copy, buf, len + 1);
+	p.pos = copy;
+	p.end = copy + len;
+	ret = json_parse(&p);
+	if (ret < 0 && errno == EPROTO)
+		nvme_msg(r, LOG_DEBUG, "Failed to read %s, syntax error at offset %zu\n",
+			 config_file, (size_t)(p.pos - copy));
+	free(copy);
+	return ret;
 }
 
 int json_read_config(nvme_root_t r, const char *config_file)
 {
-	struct json_object *json_root, *host_obj;
-	int fd, h;
+	struct json_config jc = { .r = r };
+	struct json_parser p = {
+		.cb = json_config_event,
+		.arg = &jc,
+	};
+	size_t len;
+	char *buf;
+	int ret;
 
-	fd = open(config_file, O_RDONLY);
-	if (fd < 0) {
+	buf = json_read_file(config_file, &len);
+	if (!buf) {
 		nvme_msg(r, LOG_DEBUG, "Error opening %s, %s\n",
 			 config_file, strerror(errno));
-		return fd;
-	}
-	json_root = json_object_from_fd(fd);
-	if (!json_root) {
-		nvme_msg(r, LOG_DEBUG, "Failed to read %s, %s\n",
-			config_file, json_util_get_last_err());
-		errno = EPROTO;
-		close(fd);
 		return -1;
 	}
-	for (h = 0; h < json_object_array_length(json_root); h++) {
-		host_obj = json_object_array_get_idx(json_root, h);
-		if (host_obj)
-			json_parse_host(r, host_obj);
+	ret = json_check_syntax(r, config_file, buf, len);
+	if (ret < 0) {
+		free(buf);
+		return ret;
 	}
-	json_object_put(json_root);
-	close(fd);
-	return 0;
+	p.pos = buf;
+	p.end = buf + len;
+	ret = json_parse(&p);
+	free(jc.subsys);
+	free(jc.ports);
+	free(jc.opts);
+	free(buf);
+	return ret;
 }
 
-#define JSON_STRING_OPTION(c, p, o)					\
-	if ((c)->o && strcmp((c)->o, "none"))				\
-		json_object_object_add((p), # o ,			\
-				       json_object_new_string((c)->o))
-#define JSON_INT_OPTION(c, p, o, d)					\
+/*
+ * The config file is written straight from the tree, in the same format
+ * as json_object_to_file_ext() with JSON_C_TO_STRING_PRETTY.
+ */
+struct json_writer {
+	FILE *fp;
+	int level;
+	bool first;
+};
+
+static void json_write_escaped(FILE *fp, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char c;
+
+	fputc('"', fp);
+	for (; (c = *str); str++) {
+		switch (c) {
+		case '\b':
+			fputs("\\b", fp);
+			break;
+		case '\f':
+			fputs("\\f", fp);
+			break;
+		case '\n':
+			fputs("\\n", fp);
+			break;
+		case '\r':
+			fputs("\\r", fp);
+			break;
+		case '\t':
+			fputs("\\t", fp);
+			break;
+		case '"':
+			fputs("\\\"", fp);
+			break;
+		case '\\':
+			fputs("\\\\", fp);
+			break;
+		case '/':
+			fputs("\\/", fp);
+			break;
+		default:
+			if (c < ' ')
+				fprintf(fp, "\\u00%c%c", hex[c >> 4], hex[c & 0xf]);
+			else
+				fputc(c, fp);
+		}
+	}
+	fputc('"', fp);
+}
+
+static void json_write_member(struct json_writer *w, const char *key)
+{
+	int i;
+
+	if (!w->level)
+		return;
+	fputs(w->first ? "" : ",\n", w->fp);
+	for (i = 0; i < w->level; i++)
+		fputs("  ", w->fp);
+	w->first = false;
+	if (key) {
+		json_write_escaped(w->fp, key);
+		fputc(':', w->fp);
+	}
+}
+
+static void json_write_open(struct json_writer *w, const char *key, char c)
+{
+	json_write_member(w, key);
+	fputc(c, w->fp);
+	fputc('\n', w->fp);
+	w->level++;
+	w->first = true;
+}
+
+static void json_write_close(struct json_writer *w, char c)
+{
+	int i;
+
+	if (!w->first)
+		fputc('\n', w->fp);
+	w->level--;
+	for (i = 0; i < w->level; i++)
+		fputs("  ", w->fp);
+	fputc(c, w->fp);
+	w->first = false;
+}
+
+static void json_write_string(struct json_writer *w, const char *key,
+			      const char *value)
+{
+	if (!value)
+		return;
+	json_write_member(w, key);
+	json_write_escaped(w->fp, value);
+}
+
+static void json_write_int(struct json_writer *w, const char *key, int value)
+{
+	json_write_member(w, key);
+	fprintf(w->fp, "%d", value);
+}
+
+static void json_write_bool(struct json_writer *w, const char *key,
+			    bool value)
+{
+	json_write_member(w, key);
+	fputs(value ? "true" : "false", w->fp);
+}
+
+#define JSON_WRITE_INT_OPTION(w, c, o, d)				\
 	if ((c)->o != d)						\
-		json_object_object_add((p), # o ,			\
-				       json_object_new_int((c)->o))
-#define JSON_BOOL_OPTION(c, p, o)					\
+		json_write_int((w), # o, (c)->o)
+#define JSON_WRITE_BOOL_OPTION(w, c, o)					\
 	if ((c)->o)							\
-		json_object_object_add((p), # o ,			\
-				       json_object_new_boolean((c)->o))
+		json_write_bool((w), # o, (c)->o)
 
-static void json_update_port(struct json_object *ctrl_array, nvme_ctrl_t c)
+static void json_update_port(struct json_writer *w, nvme_ctrl_t c)
 {
 	struct nvme_fabrics_config *cfg = nvme_ctrl_get_config(c);
-	struct json_object *port_obj = json_object_new_object();
-	const char *transport, *value;
+	const char *transport = nvme_ctrl_get_transport(c);
 
-	transport = nvme_ctrl_get_transport(c);
-	json_object_object_add(port_obj, "transport",
-			       json_object_new_string(transport));
-	value = nvme_ctrl_get_traddr(c);
-	if (value)
-		json_object_object_add(port_obj, "traddr",
-				       json_object_new_string(value));
-	value = nvme_ctrl_get_host_traddr(c);
-	if (value)
-		json_object_object_add(port_obj, "host_traddr",
-				       json_object_new_string(value));
-	value = nvme_ctrl_get_host_iface(c);
-	if (value)
-		json_object_object_add(port_obj, "host_iface",
-				       json_object_new_string(value));
-	value = nvme_ctrl_get_trsvcid(c);
-	if (value)
-		json_object_object_add(port_obj, "trsvcid",
-				       json_object_new_string(value));
-	value = nvme_ctrl_get_dhchap_key(c);
-	if (value)
-		json_object_object_add(port_obj, "dhchap_ctrl_key",
-				       json_object_new_string(value));
-	JSON_INT_OPTION(cfg, port_obj, nr_io_queues, 0);
-	JSON_INT_OPTION(cfg, port_obj, nr_write_queues, 0);
-	JSON_INT_OPTION(cfg, port_obj, nr_poll_queues, 0);
-	JSON_INT_OPTION(cfg, port_obj, queue_size, 0);
-	JSON_INT_OPTION(cfg, port_obj, keep_alive_tmo, 0);
-	JSON_INT_OPTION(cfg, port_obj, reconnect_delay, 0);
+	json_write_open(w, NULL, '{');
+	json_write_string(w, "transport", transport);
+	json_write_string(w, "traddr", nvme_ctrl_get_traddr(c));
+	json_write_string(w, "host_traddr", nvme_ctrl_get_host_traddr(c));
+	json_write_string(w, "host_iface", nvme_ctrl_get_host_iface(c));
+	json_write_string(w, "trsvcid", nvme_ctrl_get_trsvcid(c));
+	json_write_string(w, "dhchap_ctrl_key", nvme_ctrl_get_dhchap_key(c));
+	JSON_WRITE_INT_OPTION(w, cfg, nr_io_queues, 0);
+	JSON_WRITE_INT_OPTION(w, cfg, nr_write_queues, 0);
+	JSON_WRITE_INT_OPTION(w, cfg, nr_poll_queues, 0);
+	JSON_WRITE_INT_OPTION(w, cfg, queue_size, 0);
+	JSON_WRITE_INT_OPTION(w, cfg, keep_alive_tmo, 0);
+	JSON_WRITE_INT_OPTION(w, cfg, reconnect_delay, 0);
 	if (strcmp(transport, "loop")) {
-		JSON_INT_OPTION(cfg, port_obj, ctrl_loss_tmo,
-				NVMF_DEF_CTRL_LOSS_TMO);
-		JSON_INT_OPTION(cfg, port_obj, fast_io_fail_tmo, 0);
-	}
-	JSON_INT_OPTION(cfg, port_obj, tos, -1);
-	JSON_BOOL_OPTION(cfg, port_obj, duplicate_connect);
-	JSON_BOOL_OPTION(cfg, port_obj, disable_sqflow);
-	JSON_BOOL_OPTION(cfg, port_obj, hdr_digest);
-	JSON_BOOL_OPTION(cfg, port_obj, data_digest);
-	JSON_BOOL_OPTION(cfg, port_obj, tls);
+		JSON_WRITE_INT_OPTION(w, cfg, ctrl_loss_tmo,
+				      NVMF_DEF_CTRL_LOSS_TMO);
+		JSON_WRITE_INT_OPTION(w, cfg, fast_io_fail_tmo, 0);
+	}
+	JSON_WRITE_INT_OPTION(w, cfg, tos, -1);
+	JSON_WRITE_BOOL_OPTION(w, cfg, duplicate_connect);
+	JSON_WRITE_BOOL_OPTION(w, cfg, disable_sqflow);
+	JSON_WRITE_BOOL_OPTION(w, cfg, hdr_digest);
+	JSON_WRITE_BOOL_OPTION(w, cfg, data_digest);
+	JSON_WRITE_BOOL_OPTION(w, cfg, tls);
 	if (nvme_ctrl_is_persistent(c))
-		json_object_object_add(port_obj, "persistent",
-				       json_object_new_boolean(true));
+		json_write_bool(w, "persistent", true);
 	if (nvme_ctrl_is_discovery_ctrl(c))
-		json_object_object_add(port_obj, "discovery",
-				       json_object_new_boolean(true));
-	json_object_array_add(ctrl_array, port_obj);
+		json_write_bool(w, "discovery", true);
+	json_write_close(w, '}');
 }
 
-static void json_update_subsys(struct json_object *subsys_array,
-			       nvme_subsystem_t s)
+/* Skip discovery subsystems as the nqn is not unique */
+static bool json_skip_subsys(nvme_subsystem_t s)
+{
+	return !strcmp(nvme_subsystem_get_nqn(s), NVME_DISC_SUBSYS_NAME);
+}
+
+static void json_update_subsys(struct json_writer *w, nvme_subsystem_t s)
 {
 	nvme_ctrl_t c;
-	const char *subsysnqn = nvme_subsystem_get_nqn(s);
-	struct json_object *subsys_obj = json_object_new_object();
-	struct json_object *port_array;
 
-	/* Skip discovery subsystems as the nqn is not unique */
-	if (!strcmp(subsysnqn, NVME_DISC_SUBSYS_NAME))
-		return;
+	json_write_open(w, NULL, '{');
+	json_write_string(w, "nqn", nvme_subsystem_get_nqn(s));
+	if (nvme_subsystem_first_ctrl(s)) {
+		json_write_open(w, "ports", '[');
+		nvme_subsystem_for_each_ctrl(s, c)
+			json_update_port(w, c);
+		json_write_close(w, ']');
+	}
+	json_write_close(w, '}');
+}
 
-	json_object_object_add(subsys_obj, "nqn",
-			       json_object_new_string(subsysnqn));
-	port_array = json_object_new_array();
-	nvme_subsystem_for_each_ctrl(s, c) {
-		json_update_port(port_array, c);
+static void json_update_host(struct json_writer *w, nvme_host_t h)
+{
+	nvme_subsystem_t s;
+	bool subsys = false;
+
+	json_write_open(w, NULL, '{');
+	json_write_string(w, "hostnqn", nvme_host_get_hostnqn(h));
+	json_write_string(w, "hostid", nvme_host_get_hostid(h));
+	json_write_string(w, "dhchap_key", nvme_host_get_dhchap_key(h));
+	json_write_string(w, "hostsymname", nvme_host_get_hostsymname(h));
+	nvme_for_each_subsystem(h, s) {
+		if (json_skip_subsys(s))
+			continue;
+		if (!subsys)
+			json_write_open(w, "subsystems", '[');
+		subsys = true;
+		json_update_subsys(w, s);
 	}
-	if (json_object_array_length(port_array))
-		json_object_object_add(subsys_obj, "ports", port_array);
-	else
-		json_object_put(port_array);
-	json_object_array_add(subsys_array, subsys_obj);
+	if (subsys)
+		json_write_close(w, ']');
+	json_write_close(w, '}');
 }
 
-int json_update_config(nvme_root_t r, const char *config_file)
+/* whether @config_file holds exactly the @len bytes of @buf */
+static bool json_file_matches(const char *config_file, const char *buf,
+			      size_t len)
 {
-	nvme_host_t h;
-	struct json_object *json_root, *host_obj;
-	struct json_object *subsys_array;
-	int ret = 0;
+	size_t old_len;
+	char *old;
+	bool same;
 
-	json_root = json_object_new_array();
-	nvme_for_each_host(r, h) {
-		nvme_subsystem_t s;
-		const char *hostnqn, *hostid, *dhchap_key, *hostsymname;
+	old = json_read_file(config_file, &old_len);
+	if (!old)
+		return false;
+	same = old_len == len && !memcmp(old, buf, len);
+	free(old);
+	return same;
+}
 
-		host_obj = json_object_new_object();
-		if (!host_obj)
-			continue;
-		hostnqn = nvme_host_get_hostnqn(h);
-		json_object_object_add(host_obj, "hostnqn",
-				       json_object_new_string(hostnqn));
-		hostid = nvme_host_get_hostid(h);
-		if (hostid)
-			json_object_object_add(host_obj, "hostid",
-					       json_object_new_string(hostid));
-		dhchap_key = nvme_host_get_dhchap_key(h);
-		if (dhchap_key)
-			json_object_object_add(host_obj, "dhchap_key",
-					       json_object_new_string(dhchap_key));
-		hostsymname = nvme_host_get_hostsymname(h);
-		if (hostsymname)
-			json_object_object_add(host_obj, "hostsymname",
-					       json_object_new_string(hostsymname));
-		subsys_array = json_object_new_array();
-		nvme_for_each_subsystem(h, s) {
-			json_update_subsys(subsys_array, s);
+/*
+ * An unchanged config is not written at all. Otherwise the new one is
+ * written next to it and renamed over it once it is complete, so a
+ * failed or interrupted update leaves the old file in place.
+ */
+static int json_write_file(const char *config_file, const char *buf,
+			   size_t len)
+{
+	mode_t mode = 0644;
+	struct stat st;
+	size_t off = 0;
+	char *tmp;
+	ssize_t n;
+	int fd, err;
+
+	if (json_file_matches(config_file, buf, len))
+		return 0;
+	if (!stat(config_file, &st))
+		mode = st.st_mode & 07777;
+
+	if (asprintf(&tmp, "%s.XXXXXX", config_file) < 0) {
+		errno = ENOMEM;
+		return -1;
+	}
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		err = errno;
+		free(tmp);
+		errno = err;
+		return -1;
+	}
+	if (fchmod(fd, mode))
+		goto fail;
+	while (off < len) {
+		n = write(fd, buf + off, len - off);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
 		}
-		if (json_object_array_length(subsys_array))
-			json_object_object_add(host_obj, "subsystems",
-						    subsys_array);
-		else
-			json_object_put(subsys_array);
-		json_object_array_add(json_root, host_obj);
+		off += n;
 	}
+	if (fsync(fd))
+		goto fail;
+	err = close(fd);
+	fd = -1;
+	if (err || rename(tmp, config_file))
+		goto fail;
+	free(tmp);
+	return 0;
+
+fail:
+	err = errno;
+	if (fd >= 0)
+		close(fd);
+	unlink(tmp);
+	free(tmp);
+	errno = err;
+	return -1;
+}
+
+int json_update_config(nvme_root_t r, const char *config_file)
+{
+	struct json_writer w = { };
+	char *buf = NULL;
+	size_t len = 0;
+	nvme_host_t h;
+	int ret;
+
+	w.fp = open_memstream(&buf, &len);
+	if (!w.fp) {
+		errno = ENOMEM;
+		return -1;
+	}
+	json_write_open(&w, NULL, '[');
+	nvme_for_each_host(r, h)
+		json_update_host(&w, h);
+	json_write_close(&w, ']');
+	if (fclose(w.fp)) {
+		free(buf);
+		errno = ENOMEM;
+		return -1;
+	}
+
 	if (!config_file) {
-		ret = json_object_to_fd(1, json_root, JSON_C_TO_STRING_PRETTY);
+		ret = fwrite(buf, 1, len, stdout) == len ? 0 : -1;
 		printf("\n");
 	} else
-		ret = json_object_to_file_ext(config_file, json_root,
-					      JSON_C_TO_STRING_PRETTY);
+		ret = json_write_file(config_file, buf, len);
 	if (ret < 0) {
 		nvme_msg(r, LOG_ERR, "Failed to write to %s, %s\n",
-			 config_file ? "stdout" : config_file,
-			 json_util_get_last_err());
-		ret = -1;
+			 config_file ? config_file : "stdout",
+			 strerror(errno));
 		errno = EIO;
 	}
-	json_object_put(json_root);
+	free(buf);
 
 	return ret;
 }
 
+#define JSON_STRING_OPTION(c, p, o)					\
+	if ((c)->o && strcmp((c)->o, "none"))				\
+		json_object_object_add((p), # o ,			\
+				       json_object_new_string((c)->o))
+#define JSON_INT_OPTION(c, p, o, d)					\
+	if ((c)->o != d)						\
+		json_object_object_add((p), # o ,			\
+				       json_object_new_int((c)->o))
+#define JSON_BOOL_OPTION(c, p, o)					\
+	if ((c)->o)							\
+		json_object_object_add((p), # o ,			\
+				       json_object_new_boolean((c)->o))
+
 static void json_dump_ctrl(struct json_object *ctrl_array, nvme_ctrl_t c)
 {
 	struct nvme_fabrics_config *cfg = nvme_ctrl_get_config(c);
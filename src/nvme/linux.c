@@ -11,7 +11,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -33,6 +35,7 @@
 #include "linux.h"
 #include "tree.h"
 #include "log.h"
+#include "uring.h"
 #include "private.h"
 
 static int __nvme_open(const char *name)
@@ -59,8 +62,12 @@ int nvme_open(const char *name)
 
 	ret = sscanf(name, "nvme%dn%d", &id, &ns);
 	if (ret != 1 && ret != 2) {
-		errno = EINVAL;
-		return -1;
+		/* generic namespace character devices, e.g. ng0n1 */
+		if (sscanf(name, "ng%dn%d", &id, &ns) != 2) {
+			errno = EINVAL;
+			return -1;
+		}
+		ret = 1;
 	}
 	c = ret == 1;
 
@@ -89,6 +96,56 @@ close_fd:
 	return -1;
 }
 
+/*
+ * Transfer size used when the controller reports no MDTS limit. The kernel
+ * caps what it maps for a single passthrough command anyway, stay within
+ * what every configuration accepts.
+ */
+#define NVME_AUTO_XFER_MAX	(256 * 1024)
+
+/* chunks in flight for a pipelined log page fetch */
+#define NVME_LOG_PAGE_MAX_DEPTH	16
+
+/* concurrent firmware updates unless the caller asks otherwise */
+#define NVME_FW_UPDATE_DEFAULT_PARALLEL	16
+
+/* controllers whose logs are collected at the same time by default */
+#define NVME_COLLECT_DEFAULT_PARALLEL	16
+
+/* DSM and Copy commands of an extent set in flight by default */
+#define NVME_EXTENTS_DEFAULT_PARALLEL	8
+
+__u32 nvme_xfer_len_from_mdts(__u8 mdts, __u8 mpsmin, __u32 max)
+{
+	unsigned int shift = mdts + 12 + mpsmin;
+
+	/* MDTS is a power of two in units of CAP.MPSMIN, 0 means no limit */
+	if (!mdts || shift >= 32 || (1U << shift) > max)
+		return max;
+	return 1U << shift;
+}
+
+static __u32 nvme_auto_xfer_len(int fd, __u32 *fw_gran)
+{
+	struct nvme_id_ctrl id;
+
+	if (fw_gran)
+		*fw_gran = 4096;
+
+	if (nvme_identify_ctrl(fd, &id))
+		return 4096;
+
+	/* 0: no information, 0xff: no restriction */
+	if (fw_gran && id.fwug && id.fwug != 0xff)
+		*fw_gran = id.fwug * 4096;
+
+	/*
+	 * CAP.MPSMIN is not accessible through the fd. 4k is the smallest
+	 * possible value, so the result is never larger than allowed.
+	 */
+	return nvme_xfer_len_from_mdts(id.mdts, 0, NVME_AUTO_XFER_MAX);
+}
+
 int nvme_fw_download_seq(int fd, __u32 size, __u32 xfer, __u32 offset,
 			 void *buf)
 {
@@ -102,6 +159,16 @@ int nvme_fw_download_seq(int fd, __u32 size, __u32 xfer, __u32 offset,
 		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
 		.result = NULL,
 	};
+	__u32 gran;
+
+	if (!xfer) {
+		/*
+		 * The largest multiple of the firmware update granularity,
+		 * but never more than MDTS if the granularity exceeds it.
+		 */
+		xfer = nvme_auto_xfer_len(fd, &gran);
+		xfer = xfer > gran ? xfer - xfer % gran : xfer;
+	}
 
 	while (size > 0) {
 		args.data_len = MIN(xfer, size);
@@ -109,14 +176,186 @@ int nvme_fw_download_seq(int fd, __u32 size, __u32 xfer, __u32 offset,
 		if (err)
 			break;
 
-		args.data += xfer;
-		size -= xfer;
-		args.offset += xfer;
+		args.data += args.data_len;
+		size -= args.data_len;
+		args.offset += args.data_len;
 	}
 
 	return err;
 }
 
+static void *nvme_fw_map_image(int fd, __u32 *size)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat(fd, &st) < 0)
+		return NULL;
+
+	if (!S_ISREG(st.st_mode) || !st.st_size || st.st_size > UINT32_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	*size = st.st_size;
+	return map;
+}
+
+int nvme_fw_download_file(int fd, int image_fd, __u32 xfer, __u32 offset)
+{
+	int err, saved;
+	__u32 size;
+	void *map;
+
+	map = nvme_fw_map_image(image_fd, &size);
+	if (!map)
+		return -1;
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	err = nvme_fw_download_seq(fd, size, xfer, offset, map);
+	saved = errno;
+	munmap(map, size);
+	errno = saved;
+
+	return err;
+}
+
+struct nvme_fw_update_work {
+	struct nvme_fw_update_result *results;
+	unsigned int *idx;
+	int *fds;
+	__u32 *xfers;
+	void *image;
+	__u32 size;
+	__u8 slot;
+	enum nvme_fw_commit_ca action;
+};
+
+static void nvme_fw_update_download(unsigned int i, void *arg)
+{
+	struct nvme_fw_update_work *w = arg;
+	struct nvme_fw_update_result *res = &w->results[w->idx[i]];
+
+	res->status = nvme_fw_download_seq(w->fds[i], w->size, w->xfers[i], 0,
+					   w->image);
+	if (res->status < 0)
+		res->err = errno;
+}
+
+static void nvme_fw_update_commit(unsigned int i, void *arg)
+{
+	struct nvme_fw_update_work *w = arg;
+	struct nvme_fw_update_result *res = &w->results[w->idx[i]];
+	struct nvme_fw_commit_args args = {
+		.args_size = sizeof(args),
+		.fd = w->fds[i],
+		.slot = w->slot,
+		.action = w->action,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.result = &res->result,
+	};
+
+	if (res->status)
+		return;
+
+	res->committed = true;
+	res->status = nvme_fw_commit(&args);
+	if (res->status < 0)
+		res->err = errno;
+}
+
+int nvme_fw_update_ctrls(nvme_ctrl_t *ctrls, unsigned int nr, int image_fd,
+			 __u8 slot, enum nvme_fw_commit_ca action,
+			 unsigned int max_parallel,
+			 struct nvme_fw_update_result *results)
+{
+	struct nvme_fw_update_work w = {
+		.results = results,
+		.slot = slot,
+		.action = action,
+	};
+	unsigned int i, j, nr_first = 0;
+	unsigned int *first;
+	int updated = 0;
+
+	if (!ctrls || !nr || !results) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* index of the controller doing the work for each subsystem */
+	first = calloc(nr, sizeof(*first));
+	w.idx = calloc(nr, sizeof(*w.idx));
+	w.fds = calloc(nr, sizeof(*w.fds));
+	w.xfers = calloc(nr, sizeof(*w.xfers));
+	if (!first || !w.idx || !w.fds || !w.xfers) {
+		errno = ENOMEM;
+		goto free;
+	}
+
+	w.image = nvme_fw_map_image(image_fd, &w.size);
+	if (!w.image)
+		goto free;
+	/* the controllers read different parts of it at the same time */
+	madvise(w.image, w.size, MADV_WILLNEED);
+
+	/* the tree is only accessed from this thread */
+	for (i = 0; i < nr; i++) {
+		nvme_subsystem_t s = nvme_ctrl_get_subsystem(ctrls[i]);
+
+		memset(&results[i], 0, sizeof(results[i]));
+		results[i].c = ctrls[i];
+
+		for (j = 0; s && j < i; j++)
+			if (nvme_ctrl_get_subsystem(ctrls[j]) == s)
+				break;
+		first[i] = s ? j : i;
+		if (first[i] != i)
+			continue;
+
+		w.fds[nr_first] = nvme_ctrl_get_fd(ctrls[i]);
+		if (w.fds[nr_first] < 0) {
+			results[i].status = -1;
+			results[i].err = errno;
+			continue;
+		}
+		w.xfers[nr_first] = nvme_ctrl_get_fw_xfer_len(ctrls[i]);
+		w.idx[nr_first++] = i;
+	}
+
+	if (!max_parallel)
+		max_parallel = NVME_FW_UPDATE_DEFAULT_PARALLEL;
+	nvme_run_parallel(max_parallel, nr_first, nvme_fw_update_download, &w);
+	nvme_run_parallel(max_parallel, nr_first, nvme_fw_update_commit, &w);
+
+	for (i = 0; i < nr; i++) {
+		if (first[i] != i) {
+			results[i] = results[first[i]];
+			results[i].c = ctrls[i];
+		}
+		if (!results[i].status)
+			updated++;
+	}
+
+	munmap(w.image, w.size);
+	free(w.xfers);
+	free(w.fds);
+	free(w.idx);
+	free(first);
+	return updated;
+
+free:
+	free(w.xfers);
+	free(w.fds);
+	free(w.idx);
+	free(first);
+	return -1;
+}
+
 int nvme_get_log_page(int fd, __u32 xfer_len, struct nvme_get_log_args *args)
 {
 	__u64 offset = 0, xfer, data_len = args->len;
@@ -124,10 +363,9 @@ int nvme_get_log_page(int fd, __u32 xfer_len, struct nvme_get_log_args *args)
 	void *ptr = args->log;
 	int ret;
 
-	/*
-	 * 4k is the smallest possible transfer unit, so restricting to 4k
-	 * avoids having to check the MDTS value of the controller.
-	 */
+	if (!xfer_len)
+		xfer_len = nvme_auto_xfer_len(fd, NULL);
+
 	do {
 		xfer = data_len - offset;
 		if (xfer > xfer_len)
@@ -156,56 +394,121 @@ int nvme_get_log_page(int fd, __u32 xfer_len, struct nvme_get_log_args *args)
 	return 0;
 }
 
-static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
-				  struct nvme_telemetry_log **buf, enum nvme_telemetry_da da,
-				  size_t *size)
+static int nvme_get_log_page_chunks(nvme_uring_t ring, __u32 xfer_len,
+				    struct nvme_get_log_args *args,
+				    __u64 data_len)
 {
-	static const __u32 xfer = NVME_LOG_TELEM_BLOCK_SIZE;
+	struct nvme_uring_completion c[NVME_LOG_PAGE_MAX_DEPTH];
+	struct nvme_passthru_cmd64 cmd64;
+	struct nvme_passthru_cmd cmd;
+	struct nvme_get_log_args chunk = *args;
+	__u64 offset = 0;
+	int err = 0, n, i;
+
+	chunk.rae = true;
+	while (offset < data_len || nvme_uring_inflight(ring)) {
+		/* stop issuing more after the first failure */
+		while (!err && offset < data_len) {
+			chunk.lpo = offset;
+			chunk.log = args->log + offset;
+			chunk.len = MIN(xfer_len, data_len - offset);
+
+			nvme_get_log_init_cmd(&chunk, &cmd);
+			nvme_passthru_cmd_to_64(&cmd, &cmd64);
+			if (nvme_uring_queue_admin_passthru64(ring, chunk.fd,
+							      &cmd64, NULL))
+				break;
+			offset += chunk.len;
+		}
 
-	struct nvme_telemetry_log *telem;
-	enum nvme_cmd_get_log_lid lid;
-	struct nvme_id_ctrl id_ctrl;
-	void *log, *tmp;
+		if (nvme_uring_submit(ring) < 0)
+			return -1;
+		n = nvme_uring_reap(ring, c, NVME_LOG_PAGE_MAX_DEPTH, 1);
+		if (n < 0)
+			return -1;
+
+		for (i = 0; i < n && !err; i++) {
+			if (c[i].status < 0) {
+				errno = -c[i].status;
+				err = -1;
+			} else {
+				err = c[i].status;
+			}
+		}
+		if (err && !nvme_uring_inflight(ring))
+			break;
+	}
+
+	return err;
+}
+
+int nvme_get_log_page_pipelined(int fd, __u32 xfer_len, unsigned int depth,
+				struct nvme_get_log_args *args)
+{
+	__u64 data_len = args->len, head_len;
+	nvme_uring_t ring = NULL;
+	struct stat st;
 	int err;
-	struct nvme_get_log_args args = {
-		.args_size = sizeof(args),
-		.fd = fd,
-		.nsid = NVME_NSID_NONE,
-		.lsp = NVME_LOG_LSP_NONE,
-		.lsi = NVME_LOG_LSI_NONE,
-		.uuidx = NVME_UUID_NONE,
-		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
-		.result = NULL,
-		.csi = NVME_CSI_NVM,
-		.rae = rae,
-		.ot = false,
-	};
 
-	*size = 0;
+	if (!xfer_len)
+		xfer_len = nvme_auto_xfer_len(fd, NULL);
+	if (!depth || depth > NVME_LOG_PAGE_MAX_DEPTH)
+		depth = NVME_LOG_PAGE_MAX_DEPTH;
 
-	log = malloc(xfer);
-	if (!log) {
-		errno = ENOMEM;
-		return -1;
-	}
+	if (data_len <= xfer_len || depth == 1)
+		return nvme_get_log_page(fd, xfer_len, args);
+
+	/*
+	 * Everything but the final chunk is fetched concurrently with RAE
+	 * set. The final chunk is only issued once all others are done,
+	 * as it may clear the asynchronous event with the caller's RAE.
+	 */
+	head_len = ((data_len - 1) / xfer_len) * xfer_len;
+
+	/* io_uring passthrough is only wired up for the character devices */
+	if (nvme_uring_passthru_enabled() && !fstat(fd, &st) &&
+	    S_ISCHR(st.st_mode))
+		ring = nvme_uring_create(MIN(depth, head_len / xfer_len), 0);
+	if (!ring)
+		return nvme_get_log_page(fd, xfer_len, args);
+
+	err = nvme_get_log_page_chunks(ring, xfer_len, args, head_len);
+	nvme_uring_free(ring);
+	if (err)
+		return err;
+
+	args->lpo = head_len;
+	args->log += head_len;
+	args->len = data_len - head_len;
+	return nvme_get_log(args);
+}
+
+static int nvme_get_telemetry_header(int fd, bool create, bool ctrl,
+				     enum nvme_telemetry_da da,
+				     struct nvme_telemetry_log *telem,
+				     enum nvme_cmd_get_log_lid *lid,
+				     size_t *size)
+{
+	static const __u32 xfer = NVME_LOG_TELEM_BLOCK_SIZE;
+
+	struct nvme_id_ctrl id_ctrl;
+	int err;
 
 	if (ctrl) {
-		err = nvme_get_log_telemetry_ctrl(fd, true, 0, xfer, log);
-		lid = NVME_LOG_LID_TELEMETRY_CTRL;
+		err = nvme_get_log_telemetry_ctrl(fd, true, 0, xfer, telem);
+		*lid = NVME_LOG_LID_TELEMETRY_CTRL;
 	} else {
-		lid = NVME_LOG_LID_TELEMETRY_HOST;
+		*lid = NVME_LOG_LID_TELEMETRY_HOST;
 		if (create)
-			err = nvme_get_log_create_telemetry_host(fd, log);
+			err = nvme_get_log_create_telemetry_host(fd, telem);
 		else
-			err = nvme_get_log_telemetry_host(fd, 0, xfer, log);
+			err = nvme_get_log_telemetry_host(fd, 0, xfer, telem);
 	}
 
 	if (err)
-		goto free;
+		return err;
 
-	telem = log;
 	if (ctrl && !telem->ctrlavail) {
-		*buf = log;
 		*size = xfer;
 		return 0;
 	}
@@ -222,7 +525,7 @@ static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
 		if (err) {
 			perror("identify-ctrl");
 			errno = EINVAL;
-			goto free;
+			return err;
 		}
 
 		if (id_ctrl.lpa & 0x40) {
@@ -230,17 +533,63 @@ static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
 		} else {
 			fprintf(stderr, "Data area 4 unsupported, bit 6 of Log Page Attributes not set\n");
 			errno = EINVAL;
-			err = -1;
-			goto free;
+			return -1;
 		}
 		break;
 	default:
 		fprintf(stderr, "Invalid data area parameter - %d\n", da);
 		errno = EINVAL;
-		err = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
+				  struct nvme_telemetry_log **buf, enum nvme_telemetry_da da,
+				  size_t *size)
+{
+	static const __u32 xfer = NVME_LOG_TELEM_BLOCK_SIZE;
+
+	struct nvme_telemetry_log *telem;
+	enum nvme_cmd_get_log_lid lid;
+	void *log, *tmp;
+	int err;
+	struct nvme_get_log_args args = {
+		.args_size = sizeof(args),
+		.fd = fd,
+		.nsid = NVME_NSID_NONE,
+		.lsp = NVME_LOG_LSP_NONE,
+		.lsi = NVME_LOG_LSI_NONE,
+		.uuidx = NVME_UUID_NONE,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.result = NULL,
+		.csi = NVME_CSI_NVM,
+		.rae = rae,
+		.ot = false,
+	};
+
+	*size = 0;
+
+	log = malloc(xfer);
+	if (!log) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	telem = log;
+	err = nvme_get_telemetry_header(fd, create, ctrl, da, telem, &lid,
+					size);
+	if (err) {
+		*size = 0;
 		goto free;
 	}
 
+	if (ctrl && !telem->ctrlavail) {
+		*buf = log;
+		return 0;
+	}
+
 	tmp = realloc(log, *size);
 	if (!tmp) {
 		errno = ENOMEM;
@@ -252,7 +601,7 @@ static int nvme_get_telemetry_log(int fd, bool create, bool ctrl, bool rae,
 	args.lid = lid;
 	args.log = log;
 	args.len = *size;
-	err = nvme_get_log_page(fd, 4096, &args);
+	err = nvme_get_log_page(fd, 0, &args);
 	if (!err) {
 		*buf = log;
 		return 0;
@@ -262,6 +611,108 @@ free:
 	return err;
 }
 
+static int nvme_stream_telemetry_log(int fd, bool create, bool ctrl, bool rae,
+				     enum nvme_telemetry_da da, __u32 xfer_len,
+				     nvme_telemetry_chunk_cb_t cb,
+				     void *user_data, size_t *size)
+{
+	static const __u32 block = NVME_LOG_TELEM_BLOCK_SIZE;
+
+	enum nvme_cmd_get_log_lid lid;
+	size_t log_size = 0;
+	__u64 offset = 0;
+	void *buf;
+	int err;
+	struct nvme_get_log_args args = {
+		.args_size = sizeof(args),
+		.fd = fd,
+		.nsid = NVME_NSID_NONE,
+		.lsp = NVME_LOG_LSP_NONE,
+		.lsi = NVME_LOG_LSI_NONE,
+		.uuidx = NVME_UUID_NONE,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.result = NULL,
+		.csi = NVME_CSI_NVM,
+		.ot = false,
+	};
+
+	if (size)
+		*size = 0;
+
+	if (!xfer_len)
+		xfer_len = nvme_auto_xfer_len(fd, NULL);
+	/* the header has to fit, and chunks stay block aligned */
+	xfer_len = xfer_len > block ? xfer_len - xfer_len % block : block;
+
+	buf = malloc(xfer_len);
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	err = nvme_get_telemetry_header(fd, create, ctrl, da, buf, &lid,
+					&log_size);
+	if (err)
+		goto free;
+
+	if (ctrl && !((struct nvme_telemetry_log *)buf)->ctrlavail) {
+		err = cb(buf, log_size, 0, user_data);
+		if (!err && size)
+			*size = log_size;
+		goto free;
+	}
+
+	/*
+	 * The header is fetched again as part of the first chunk, so that
+	 * it stays consistent with the data areas that follow.
+	 */
+	args.lid = lid;
+	args.log = buf;
+	while (offset < log_size) {
+		args.lpo = offset;
+		args.len = MIN(xfer_len, log_size - offset);
+		/* only the last chunk may clear the asynchronous event */
+		args.rae = offset + args.len < log_size ? true : rae;
+
+		err = nvme_get_log(&args);
+		if (err)
+			goto free;
+
+		err = cb(buf, args.len, offset, user_data);
+		if (err)
+			goto free;
+
+		offset += args.len;
+	}
+
+	if (size)
+		*size = log_size;
+free:
+	free(buf);
+	return err;
+}
+
+static int nvme_telemetry_chunk_write(const void *chunk, size_t len,
+				      __u64 offset, void *user_data)
+{
+	int out_fd = *(int *)user_data;
+	const char *p = chunk;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(out_fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
 int nvme_get_ctrl_telemetry(int fd, bool rae, struct nvme_telemetry_log **log,
 		enum nvme_telemetry_da da, size_t *size)
 {
@@ -280,6 +731,212 @@ int nvme_get_new_host_telemetry(int fd, struct nvme_telemetry_log **log,
 	return nvme_get_telemetry_log(fd, true, false, false, log, da, size);
 }
 
+int nvme_stream_ctrl_telemetry(int fd, bool rae, enum nvme_telemetry_da da,
+			       __u32 xfer_len, nvme_telemetry_chunk_cb_t cb,
+			       void *user_data, size_t *size)
+{
+	return nvme_stream_telemetry_log(fd, false, true, rae, da, xfer_len,
+					 cb, user_data, size);
+}
+
+int nvme_stream_host_telemetry(int fd, bool create, enum nvme_telemetry_da da,
+			       __u32 xfer_len, nvme_telemetry_chunk_cb_t cb,
+			       void *user_data, size_t *size)
+{
+	return nvme_stream_telemetry_log(fd, create, false, false, da,
+					 xfer_len, cb, user_data, size);
+}
+
+int nvme_save_ctrl_telemetry(int fd, bool rae, enum nvme_telemetry_da da,
+			     int out_fd, size_t *size)
+{
+	return nvme_stream_telemetry_log(fd, false, true, rae, da, 0,
+					 nvme_telemetry_chunk_write, &out_fd,
+					 size);
+}
+
+int nvme_save_host_telemetry(int fd, bool create, enum nvme_telemetry_da da,
+			     int out_fd, size_t *size)
+{
+	return nvme_stream_telemetry_log(fd, create, false, false, da, 0,
+					 nvme_telemetry_chunk_write, &out_fd,
+					 size);
+}
+
+#define NVME_COLLECT_NR_LOGS	4
+
+/* indexed by the bit number of enum nvme_collect_log */
+static const char * const nvme_collect_suffix[NVME_COLLECT_NR_LOGS] = {
+	"smart", "error", "telemetry-ctrl", "telemetry-host",
+};
+
+struct nvme_collect_work {
+	nvme_ctrl_t *ctrls;
+	int *fds;
+	int (*status)[NVME_COLLECT_NR_LOGS];
+	int (*err)[NVME_COLLECT_NR_LOGS];
+	int dir_fd;
+	unsigned int logs;
+	enum nvme_telemetry_da da;
+};
+
+static int nvme_collect_write(int out_fd, const void *buf, size_t len)
+{
+	return nvme_telemetry_chunk_write(buf, len, 0, &out_fd);
+}
+
+static int nvme_collect_read_log(int fd, int out_fd, unsigned int log,
+				 enum nvme_telemetry_da da)
+{
+	struct nvme_error_log_page *err_log;
+	struct nvme_smart_log smart;
+	struct nvme_id_ctrl id;
+	unsigned int nr;
+	int ret;
+
+	switch (log) {
+	case NVME_COLLECT_SMART:
+		ret = nvme_get_log_smart(fd, NVME_NSID_ALL, true, &smart);
+		if (ret)
+			return ret;
+		return nvme_collect_write(out_fd, &smart, sizeof(smart));
+	case NVME_COLLECT_ERROR:
+		ret = nvme_identify_ctrl(fd, &id);
+		if (ret)
+			return ret;
+		nr = id.elpe + 1;
+		err_log = calloc(nr, sizeof(*err_log));
+		if (!err_log) {
+			errno = ENOMEM;
+			return -1;
+		}
+		ret = nvme_get_log_error(fd, nr, true, err_log);
+		if (!ret)
+			ret = nvme_collect_write(out_fd, err_log,
+						 nr * sizeof(*err_log));
+		free(err_log);
+		return ret;
+	case NVME_COLLECT_CTRL_TELEMETRY:
+		return nvme_save_ctrl_telemetry(fd, true, da, out_fd, NULL);
+	default:
+		return nvme_save_host_telemetry(fd, true, da, out_fd, NULL);
+	}
+}
+
+static void nvme_collect_one(unsigned int i, void *arg)
+{
+	struct nvme_collect_work *w = arg;
+	const char *name = nvme_ctrl_get_name(w->ctrls[i]);
+	unsigned int log;
+	char *path;
+	int out_fd;
+
+	for (log = 0; log < NVME_COLLECT_NR_LOGS; log++) {
+		if (!(w->logs & (1 << log)))
+			continue;
+
+		if (w->fds[i] < 0) {
+			w->status[i][log] = -1;
+			w->err[i][log] = -w->fds[i];
+			continue;
+		}
+
+		if (asprintf(&path, "%s-%s.bin", name,
+			     nvme_collect_suffix[log]) < 0) {
+			w->status[i][log] = -1;
+			w->err[i][log] = ENOMEM;
+			continue;
+		}
+		out_fd = openat(w->dir_fd, path,
+				O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		free(path);
+		if (out_fd < 0) {
+			w->status[i][log] = -1;
+			w->err[i][log] = errno;
+			continue;
+		}
+
+		w->status[i][log] = nvme_collect_read_log(w->fds[i], out_fd,
+							  1 << log, w->da);
+		if (w->status[i][log] < 0)
+			w->err[i][log] = errno;
+		close(out_fd);
+	}
+}
+
+int nvme_collect_logs(nvme_root_t r, int dir_fd, unsigned int logs,
+		      enum nvme_telemetry_da da, unsigned int max_parallel,
+		      nvme_collect_cb_t cb, void *user_data)
+{
+	struct nvme_collect_work w = {
+		.dir_fd = dir_fd,
+		.logs = logs,
+		.da = da,
+	};
+	unsigned int i, log, nr = 0;
+	nvme_subsystem_t s;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	int written = 0;
+
+	if (!(logs & NVME_COLLECT_ALL) || logs & ~NVME_COLLECT_ALL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nvme_for_each_host(r, h)
+		nvme_for_each_subsystem(h, s)
+			nvme_subsystem_for_each_ctrl(s, c)
+				nr++;
+	if (!nr)
+		return 0;
+
+	w.ctrls = calloc(nr, sizeof(*w.ctrls));
+	w.fds = calloc(nr, sizeof(*w.fds));
+	w.status = calloc(nr, sizeof(*w.status));
+	w.err = calloc(nr, sizeof(*w.err));
+	if (!w.ctrls || !w.fds || !w.status || !w.err) {
+		errno = ENOMEM;
+		written = -1;
+		goto free;
+	}
+
+	/* the tree is only accessed from this thread */
+	i = 0;
+	nvme_for_each_host(r, h)
+		nvme_for_each_subsystem(h, s)
+			nvme_subsystem_for_each_ctrl(s, c) {
+				w.ctrls[i] = c;
+				w.fds[i] = nvme_ctrl_get_fd(c);
+				if (w.fds[i] < 0)
+					w.fds[i] = -errno;
+				i++;
+			}
+
+	nvme_run_parallel(max_parallel ? max_parallel :
+			  NVME_COLLECT_DEFAULT_PARALLEL,
+			  nr, nvme_collect_one, &w);
+
+	for (i = 0; i < nr; i++) {
+		for (log = 0; log < NVME_COLLECT_NR_LOGS; log++) {
+			if (!(logs & (1 << log)))
+				continue;
+			if (!w.status[i][log])
+				written++;
+			if (cb)
+				cb(w.ctrls[i], 1 << log, w.status[i][log],
+				   w.err[i][log], user_data);
+		}
+	}
+
+free:
+	free(w.err);
+	free(w.status);
+	free(w.fds);
+	free(w.ctrls);
+	return written;
+}
+
 int nvme_get_lba_status_log(int fd, bool rae, struct nvme_lba_status_log **log)
 {
 	__u32 size = sizeof(struct nvme_lba_status_log);
@@ -308,29 +965,408 @@ int nvme_get_lba_status_log(int fd, bool rae, struct nvme_lba_status_log **log)
 	if (err)
 		goto free;
 
-	size = le32_to_cpu((*log)->lslplen);
-	if (!size)
+	size = le32_to_cpu((*log)->lslplen);
+	if (!size)
+		return 0;
+
+	tmp = realloc(buf, size);
+	if (!tmp) {
+		err = -1;
+		goto free;
+	}
+	buf = tmp;
+	*log = buf;
+
+	args.lid = NVME_LOG_LID_LBA_STATUS;
+	args.log = buf;
+	args.len = size;
+	err = nvme_get_log_page(fd, 4096, &args);
+	if (!err)
+		return 0;
+
+free:
+	*log = NULL;
+	free(buf);
+	return err;
+}
+
+struct nvme_extent {
+	__u64 slba;
+	__u64 nlb;
+};
+
+struct nvme_extents {
+	struct nvme_extent *ext;
+	size_t nr;
+	size_t alloc;
+};
+
+/* per command limits, all non-zero */
+struct nvme_extent_limits {
+	unsigned int max_ranges;
+	__u64 max_range_len;
+	__u64 max_cmd_len;
+};
+
+/* the ranges of one command are pieces[first] up to pieces[first + nr] */
+struct nvme_extent_cmd {
+	size_t first;
+	unsigned int nr;
+	__u64 sdlba;
+};
+
+struct nvme_extents_work {
+	__u32 nsid;
+	struct nvme_extent *pieces;
+	struct nvme_extent_cmd *cmds;
+	/* range descriptors of all commands, in the order of the pieces */
+	void *ranges;
+};
+
+nvme_extents_t nvme_extents_create(void)
+{
+	struct nvme_extents *e;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		errno = ENOMEM;
+	return e;
+}
+
+void nvme_extents_free(nvme_extents_t e)
+{
+	if (!e)
+		return;
+
+	free(e->ext);
+	free(e);
+}
+
+void nvme_extents_reset(nvme_extents_t e)
+{
+	e->nr = 0;
+}
+
+size_t nvme_extents_get_nr(nvme_extents_t e)
+{
+	return e->nr;
+}
+
+static int nvme_extent_push(struct nvme_extent **ext, size_t *nr,
+			    size_t *alloc, __u64 slba, __u64 nlb)
+{
+	struct nvme_extent *tmp;
+
+	if (*nr == *alloc) {
+		size_t n = *alloc ? *alloc * 2 : 64;
+
+		tmp = realloc(*ext, n * sizeof(*tmp));
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*ext = tmp;
+		*alloc = n;
+	}
+
+	(*ext)[*nr].slba = slba;
+	(*ext)[*nr].nlb = nlb;
+	(*nr)++;
+	return 0;
+}
+
+int nvme_extents_add(nvme_extents_t e, __u64 slba, __u64 nlb)
+{
+	struct nvme_extent *last = e->nr ? &e->ext[e->nr - 1] : NULL;
+
+	if (!nlb || slba + nlb < slba) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* streams of consecutive extents are the common case */
+	if (last && last->slba + last->nlb == slba) {
+		last->nlb += nlb;
+		return 0;
+	}
+
+	return nvme_extent_push(&e->ext, &e->nr, &e->alloc, slba, nlb);
+}
+
+static int nvme_extent_cmp(const void *a, const void *b)
+{
+	const struct nvme_extent *x = a, *y = b;
+
+	if (x->slba != y->slba)
+		return x->slba < y->slba ? -1 : 1;
+	return 0;
+}
+
+/* sorts the set and merges overlapping and adjacent extents */
+static void nvme_extents_coalesce(nvme_extents_t e)
+{
+	size_t i, n = 0;
+	__u64 end;
+
+	if (e->nr < 2)
+		return;
+
+	qsort(e->ext, e->nr, sizeof(*e->ext), nvme_extent_cmp);
+
+	for (i = 1; i < e->nr; i++) {
+		struct nvme_extent *cur = &e->ext[n];
+
+		if (e->ext[i].slba <= cur->slba + cur->nlb) {
+			end = e->ext[i].slba + e->ext[i].nlb;
+			if (end > cur->slba + cur->nlb)
+				cur->nlb = end - cur->slba;
+			continue;
+		}
+		e->ext[++n] = e->ext[i];
+	}
+	e->nr = n + 1;
+}
+
+/* splits the set into as few commands as the limits permit */
+static int nvme_extents_plan(nvme_extents_t e,
+			     const struct nvme_extent_limits *lim,
+			     struct nvme_extent **pieces,
+			     struct nvme_extent_cmd **cmds, size_t *nr_cmds)
+{
+	size_t nr_pieces = 0, alloc_pieces = 0, alloc_cmds = 0, i;
+	struct nvme_extent_cmd *cmd = NULL, *tmp;
+	__u64 slba, left, n, cmd_len = 0;
+
+	*pieces = NULL;
+	*cmds = NULL;
+	*nr_cmds = 0;
+
+	for (i = 0; i < e->nr; i++) {
+		slba = e->ext[i].slba;
+		left = e->ext[i].nlb;
+
+		while (left) {
+			if (!cmd || cmd->nr == lim->max_ranges ||
+			    cmd_len == lim->max_cmd_len) {
+				if (*nr_cmds == alloc_cmds) {
+					alloc_cmds = alloc_cmds ?
+						alloc_cmds * 2 : 16;
+					tmp = realloc(*cmds, alloc_cmds *
+						      sizeof(*tmp));
+					if (!tmp)
+						goto enomem;
+					*cmds = tmp;
+				}
+				cmd = &(*cmds)[(*nr_cmds)++];
+				cmd->first = nr_pieces;
+				cmd->nr = 0;
+				cmd->sdlba = cmd == *cmds ? 0 :
+					cmd[-1].sdlba + cmd_len;
+				cmd_len = 0;
+			}
+
+			n = left;
+			if (n > lim->max_range_len)
+				n = lim->max_range_len;
+			if (n > lim->max_cmd_len - cmd_len)
+				n = lim->max_cmd_len - cmd_len;
+
+			if (nvme_extent_push(pieces, &nr_pieces, &alloc_pieces,
+					     slba, n))
+				goto enomem;
+			cmd->nr++;
+			cmd_len += n;
+			slba += n;
+			left -= n;
+		}
+	}
+
+	return 0;
+
+enomem:
+	free(*pieces);
+	free(*cmds);
+	errno = ENOMEM;
+	return -1;
+}
+
+static void nvme_extents_dsm_cmd(struct nvme_extents_work *w, size_t i,
+				 struct nvme_passthru_cmd64 *cmd)
+{
+	struct nvme_extent_cmd *c = &w->cmds[i];
+	struct nvme_dsm_range *dsm = (struct nvme_dsm_range *)w->ranges +
+		c->first;
+	unsigned int r;
+
+	for (r = 0; r < c->nr; r++) {
+		dsm[r].slba = cpu_to_le64(w->pieces[c->first + r].slba);
+		dsm[r].nlb = cpu_to_le32(w->pieces[c->first + r].nlb);
+	}
+
+	cmd->opcode = nvme_cmd_dsm;
+	cmd->nsid = w->nsid;
+	cmd->addr = (__u64)(uintptr_t)dsm;
+	cmd->data_len = c->nr * sizeof(*dsm);
+	cmd->cdw10 = c->nr - 1;
+	cmd->cdw11 = NVME_DSMGMT_AD;
+	cmd->timeout_ms = NVME_DEFAULT_IOCTL_TIMEOUT;
+}
+
+static void nvme_extents_copy_cmd(struct nvme_extents_work *w, size_t i,
+				  struct nvme_passthru_cmd64 *cmd)
+{
+	struct nvme_extent_cmd *c = &w->cmds[i];
+	struct nvme_copy_range *copy = (struct nvme_copy_range *)w->ranges +
+		c->first;
+	unsigned int r;
+
+	for (r = 0; r < c->nr; r++) {
+		copy[r].slba = cpu_to_le64(w->pieces[c->first + r].slba);
+		copy[r].nlb = cpu_to_le16(w->pieces[c->first + r].nlb - 1);
+	}
+
+	/* source range format 0, no protection information checks */
+	cmd->opcode = nvme_cmd_copy;
+	cmd->nsid = w->nsid;
+	cmd->addr = (__u64)(uintptr_t)copy;
+	cmd->data_len = c->nr * sizeof(*copy);
+	cmd->cdw10 = c->sdlba & 0xffffffff;
+	cmd->cdw11 = c->sdlba >> 32;
+	cmd->cdw12 = (c->nr - 1) & 0xff;
+	cmd->timeout_ms = NVME_DEFAULT_IOCTL_TIMEOUT;
+}
+
+/*
+ * The commands go out through nvme_submit_io_passthru_batch(), at most
+ * @max_parallel at a time. A failed command stops the remaining ones
+ * from being sent.
+ */
+static int nvme_extents_issue(nvme_extents_t e, int fd, __u32 nsid,
+			      const struct nvme_extent_limits *lim,
+			      __u64 sdlba, unsigned int max_parallel,
+			      size_t range_size,
+			      void (*build)(struct nvme_extents_work *, size_t,
+					    struct nvme_passthru_cmd64 *))
+{
+	struct nvme_extents_work w = { .nsid = nsid };
+	struct nvme_passthru_cmd64 *cmds = NULL;
+	size_t nr_cmds, nr_pieces, i, j, n;
+	int *status = NULL;
+	int ret = 0;
+
+	if (nvme_extents_plan(e, lim, &w.pieces, &w.cmds, &nr_cmds))
+		return -1;
+	if (!nr_cmds)
 		return 0;
 
-	tmp = realloc(buf, size);
-	if (!tmp) {
-		err = -1;
+	for (i = 0; i < nr_cmds; i++)
+		w.cmds[i].sdlba += sdlba;
+
+	if (!max_parallel)
+		max_parallel = NVME_EXTENTS_DEFAULT_PARALLEL;
+	if (max_parallel > nr_cmds)
+		max_parallel = nr_cmds;
+
+	nr_pieces = w.cmds[nr_cmds - 1].first + w.cmds[nr_cmds - 1].nr;
+	w.ranges = calloc(nr_pieces, range_size);
+	cmds = calloc(nr_cmds, sizeof(*cmds));
+	status = calloc(max_parallel, sizeof(*status));
+	if (!w.ranges || !cmds || !status) {
+		errno = ENOMEM;
+		ret = -1;
 		goto free;
 	}
-	buf = tmp;
-	*log = buf;
 
-	args.lid = NVME_LOG_LID_LBA_STATUS;
-	args.log = buf;
-	args.len = size;
-	err = nvme_get_log_page(fd, 4096, &args);
-	if (!err)
-		return 0;
+	for (i = 0; i < nr_cmds; i++)
+		build(&w, i, &cmds[i]);
+
+	for (i = 0; i < nr_cmds && !ret; i += n) {
+		n = nr_cmds - i < max_parallel ? nr_cmds - i : max_parallel;
+		if (nvme_submit_io_passthru_batch(fd, &cmds[i], n, status)) {
+			ret = -1;
+			break;
+		}
+		for (j = 0; j < n; j++) {
+			if (!status[j])
+				continue;
+			if (status[j] < 0) {
+				errno = -status[j];
+				ret = -1;
+			} else {
+				ret = status[j];
+			}
+			break;
+		}
+	}
 
 free:
-	*log = NULL;
-	free(buf);
-	return err;
+	free(status);
+	free(cmds);
+	free(w.ranges);
+	free(w.cmds);
+	free(w.pieces);
+	return ret;
+}
+
+int nvme_extents_deallocate(nvme_extents_t e, int fd, __u32 nsid,
+			    unsigned int max_parallel)
+{
+	struct nvme_extent_limits lim = {
+		.max_ranges = NVME_DSM_MAX_RANGES,
+		.max_range_len = UINT32_MAX,
+		.max_cmd_len = UINT64_MAX,
+	};
+	struct nvme_id_ctrl_nvm *id;
+
+	nvme_extents_coalesce(e);
+
+	id = malloc(sizeof(*id));
+	if (!id) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* older controllers lack the limits, they allow the field maximum */
+	if (!nvme_nvm_identify_ctrl(fd, id)) {
+		if (id->dmrl)
+			lim.max_ranges = id->dmrl;
+		if (le32_to_cpu(id->dmrsl))
+			lim.max_range_len = le32_to_cpu(id->dmrsl);
+		if (le64_to_cpu(id->dmsl))
+			lim.max_cmd_len = le64_to_cpu(id->dmsl);
+	}
+	free(id);
+
+	return nvme_extents_issue(e, fd, nsid, &lim, 0, max_parallel,
+				  sizeof(struct nvme_dsm_range),
+				  nvme_extents_dsm_cmd);
+}
+
+int nvme_extents_copy(nvme_extents_t e, int fd, __u32 nsid, __u64 sdlba,
+		      unsigned int max_parallel)
+{
+	struct nvme_extent_limits lim = {
+		.max_ranges = NVME_DSM_MAX_RANGES,
+		.max_range_len = 0x10000,
+		.max_cmd_len = UINT64_MAX,
+	};
+	struct nvme_id_ns ns;
+	int ret;
+
+	ret = nvme_identify_ns(fd, nsid, &ns);
+	if (ret)
+		return ret;
+
+	lim.max_ranges = ns.msrc + 1;
+	if (le16_to_cpu(ns.mssrl))
+		lim.max_range_len = le16_to_cpu(ns.mssrl);
+	if (le32_to_cpu(ns.mcl))
+		lim.max_cmd_len = le32_to_cpu(ns.mcl);
+
+	/* not coalesced, the order of the ranges is the destination layout */
+	return nvme_extents_issue(e, fd, nsid, &lim, sdlba, max_parallel,
+				  sizeof(struct nvme_copy_range),
+				  nvme_extents_copy_cmd);
 }
 
 static int nvme_ns_attachment(int fd, __u32 nsid, __u16 num_ctrls,
@@ -429,33 +1465,97 @@ int nvme_set_attr(const char *dir, const char *attr, const char *value)
 	return ret;
 }
 
-static char *__nvme_get_attr(const char *path)
+static char *nvme_attr_value(char *value)
+{
+	errno = 0;
+	if (!strlen(value))
+		return NULL;
+
+	if (value[strlen(value) - 1] == '\n')
+		value[strlen(value) - 1] = '\0';
+	while (strlen(value) > 0 && value[strlen(value) - 1] == ' ')
+		value[strlen(value) - 1] = '\0';
+
+	return strlen(value) ? strdup(value) : NULL;
+}
+
+static char *__nvme_read_attr(int fd, bool reread)
 {
 	char value[4096] = { 0 };
-	int ret, fd;
+	int ret;
+
+	if (reread)
+		ret = pread(fd, value, sizeof(value) - 1, 0);
+	else
+		ret = read(fd, value, sizeof(value) - 1);
+	if (ret < 0)
+		return NULL;
+
+	return nvme_attr_value(value);
+}
+
+static char *__nvme_get_attr(const char *path)
+{
+	char *value;
 	int saved_errno;
+	int fd;
 
 	fd = open(path, O_RDONLY);
 	if (fd < 0)
 		return NULL;
 
-	ret = read(fd, value, sizeof(value) - 1);
+	value = __nvme_read_attr(fd, false);
 	saved_errno = errno;
 	close(fd);
-	if (ret < 0) {
-		errno = saved_errno;
-		return NULL;
+	errno = saved_errno;
+	return value;
+}
+
+int nvme_open_attr(const char *dir, const char *attr)
+{
+	char *path;
+	int fd;
+
+	if (asprintf(&path, "%s/%s", dir, attr) < 0) {
+		errno = ENOMEM;
+		return -1;
 	}
-	errno = 0;
-	if (!strlen(value))
-		return NULL;
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	return fd;
+}
 
-	if (value[strlen(value) - 1] == '\n')
-		value[strlen(value) - 1] = '\0';
-	while (strlen(value) > 0 && value[strlen(value) - 1] == ' ')
-		value[strlen(value) - 1] = '\0';
+char *nvme_reread_attr(int fd)
+{
+	return __nvme_read_attr(fd, true);
+}
 
-	return strlen(value) ? strdup(value) : NULL;
+int nvme_get_attrs(const char *dir, const char * const *attrs, int nr,
+		   char **values)
+{
+	int dfd, fd, i, saved_errno;
+
+	for (i = 0; i < nr; i++)
+		values[i] = NULL;
+
+	/* resolve the directory once instead of once per attribute */
+	dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return -1;
+
+	for (i = 0; i < nr; i++) {
+		fd = openat(dfd, attrs[i], O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		values[i] = __nvme_read_attr(fd, false);
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+
+	close(dfd);
+	errno = 0;
+	return 0;
 }
 
 char *nvme_get_attr(const char *dir, const char *attr)
@@ -509,32 +1609,118 @@ int nvme_gen_dhchap_key(char *hostnqn, enum nvme_hmac_alg hmac,
 	memcpy(key, secret, key_len);
 	return 0;
 }
-#endif /* !CONFIG_OPENSSL */
 
+int nvme_gen_dhchap_key_cached(nvme_root_t r, char *hostnqn,
+			       enum nvme_hmac_alg hmac, unsigned int key_len,
+			       unsigned char *secret, unsigned char *key)
+{
+	return nvme_gen_dhchap_key(hostnqn, hmac, key_len, secret, key);
+}
+
+void nvme_dhchap_cache_free(struct nvme_dhchap_cache *cache)
+{
+}
+#else /* CONFIG_OPENSSL */
+
+/*
+ * Keys derived for a root are kept by host NQN, secret and algorithm,
+ * the least recently used ones are dropped once this many are cached.
+ */
+#define NVME_DHCHAP_CACHE_MAX	1024
+
+struct nvme_dhchap_key {
+	struct list_node entry;
+	struct nvme_hnode hnode;
+	enum nvme_hmac_alg hmac;
+	unsigned int key_len;
+	unsigned char *secret;
+	unsigned char *key;
+	char hostnqn[];
+};
+
+/*
+ * The OpenSSL state needed for the HMAC transformation, set up on first
+ * use. nvme_gen_dhchap_key() uses a new one for every call, and
+ * nvme_gen_dhchap_key_cached() one per root together with the derived
+ * keys. The lock of a root's cache covers the keys and the contexts.
+ */
+struct nvme_dhchap_cache {
+	pthread_mutex_t lock;
+	struct list_head keys;
+	struct nvme_htable index;
+	unsigned int nr_keys;
 #ifdef CONFIG_OPENSSL_1
-int nvme_gen_dhchap_key(char *hostnqn, enum nvme_hmac_alg hmac,
-			unsigned int key_len, unsigned char *secret,
-			unsigned char *key)
+	bool engines_loaded;
+	HMAC_CTX *hmac_ctx;
+#endif
+#ifdef CONFIG_OPENSSL_3
+	OSSL_LIB_CTX *lib_ctx;
+	EVP_MAC *mac;
+	EVP_MAC_CTX *mac_ctx[NVME_HMAC_ALG_SHA2_512];
+#endif
+};
+
+static void nvme_dhchap_cache_release(struct nvme_dhchap_cache *cache)
+{
+	struct nvme_dhchap_key *k, *_k;
+
+	list_for_each_safe(&cache->keys, k, _k, entry) {
+		list_del(&k->entry);
+		OPENSSL_cleanse(k->secret, 2 * k->key_len);
+		free(k);
+	}
+	nvme_htable_free(&cache->index);
+#ifdef CONFIG_OPENSSL_1
+	HMAC_CTX_free(cache->hmac_ctx);
+#endif
+#ifdef CONFIG_OPENSSL_3
+	{
+		int i;
+
+		for (i = 0; i < NVME_HMAC_ALG_SHA2_512; i++)
+			EVP_MAC_CTX_free(cache->mac_ctx[i]);
+		EVP_MAC_free(cache->mac);
+		OSSL_LIB_CTX_free(cache->lib_ctx);
+	}
+#endif
+}
+
+void nvme_dhchap_cache_free(struct nvme_dhchap_cache *cache)
+{
+	if (!cache)
+		return;
+	nvme_dhchap_cache_release(cache);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+#endif /* CONFIG_OPENSSL */
+
+#ifdef CONFIG_OPENSSL_1
+static int nvme_dhchap_hmac(struct nvme_dhchap_cache *cache, char *hostnqn,
+			    enum nvme_hmac_alg hmac, unsigned int key_len,
+			    unsigned char *secret, unsigned char *key)
 {
 	const char hmac_seed[] = "NVMe-over-Fabrics";
-	HMAC_CTX *hmac_ctx;
 	const EVP_MD *md;
-	int err = -1;
 
-	ENGINE_load_builtin_engines();
-	ENGINE_register_all_complete();
+	if (!cache->engines_loaded) {
+		ENGINE_load_builtin_engines();
+		ENGINE_register_all_complete();
+		cache->engines_loaded = true;
+	}
 
-	hmac_ctx = HMAC_CTX_new();
-	if (!hmac_ctx) {
-		errno = ENOMEM;
-		return err;
+	if (!cache->hmac_ctx) {
+		cache->hmac_ctx = HMAC_CTX_new();
+		if (!cache->hmac_ctx) {
+			errno = ENOMEM;
+			return -1;
+		}
 	}
 
 	switch (hmac) {
 	case NVME_HMAC_ALG_NONE:
 		memcpy(key, secret, key_len);
-		err = 0;
-		goto out;
+		return 0;
 	case NVME_HMAC_ALG_SHA2_256:
 		md = EVP_sha256();
 		break;
@@ -546,134 +1732,287 @@ int nvme_gen_dhchap_key(char *hostnqn, enum nvme_hmac_alg hmac,
 		break;
 	default:
 		errno = EINVAL;
-		goto out;
+		return -1;
 	}
 
 	if (!md) {
 		errno = EINVAL;
-		goto out;
+		return -1;
 	}
 
-	if (!HMAC_Init_ex(hmac_ctx, secret, key_len, md, NULL)) {
+	if (!HMAC_Init_ex(cache->hmac_ctx, secret, key_len, md, NULL)) {
 		errno = ENOMEM;
-		goto out;
+		return -1;
 	}
 
-	if (!HMAC_Update(hmac_ctx, (unsigned char *)hostnqn,
+	if (!HMAC_Update(cache->hmac_ctx, (unsigned char *)hostnqn,
 			 strlen(hostnqn))) {
 		errno = ENOKEY;
-		goto out;
+		return -1;
 	}
 
-	if (!HMAC_Update(hmac_ctx, (unsigned char *)hmac_seed,
+	if (!HMAC_Update(cache->hmac_ctx, (unsigned char *)hmac_seed,
 			 strlen(hmac_seed))) {
 		errno = ENOKEY;
-		goto out;
+		return -1;
 	}
 
-	if (!HMAC_Final(hmac_ctx, key, &key_len)) {
+	if (!HMAC_Final(cache->hmac_ctx, key, &key_len)) {
 		errno = ENOKEY;
-		goto out;
+		return -1;
 	}
 
-	err = 0;
-
-out:
-	HMAC_CTX_free(hmac_ctx);
-	return err;
+	return 0;
 }
 #endif /* !CONFIG_OPENSSL_1 */
 
 #ifdef CONFIG_OPENSSL_3
-int nvme_gen_dhchap_key(char *hostnqn, enum nvme_hmac_alg hmac,
-			unsigned int key_len, unsigned char *secret,
-			unsigned char *key)
+/* the context of each digest keeps its digest, only the key changes */
+static EVP_MAC_CTX *nvme_dhchap_mac_ctx(struct nvme_dhchap_cache *cache,
+					enum nvme_hmac_alg hmac)
 {
-	const char hmac_seed[] = "NVMe-over-Fabrics";
 	OSSL_PARAM params[2], *p = params;
-	OSSL_LIB_CTX *lib_ctx;
-	EVP_MAC_CTX *mac_ctx = NULL;
-	EVP_MAC *mac = NULL;
+	EVP_MAC_CTX **mac_ctx = &cache->mac_ctx[hmac - 1];
 	char *progq = NULL;
 	char *digest;
-	size_t len;
-	int err = -1;
 
-	lib_ctx = OSSL_LIB_CTX_new();
-	if (!lib_ctx) {
-		errno = ENOMEM;
-		return err;
+	if (*mac_ctx)
+		return *mac_ctx;
+
+	switch (hmac) {
+	case NVME_HMAC_ALG_SHA2_256:
+		digest = OSSL_DIGEST_NAME_SHA2_256;
+		break;
+	case NVME_HMAC_ALG_SHA2_384:
+		digest = OSSL_DIGEST_NAME_SHA2_384;
+		break;
+	default:
+		digest = OSSL_DIGEST_NAME_SHA2_512;
+		break;
 	}
 
-	mac = EVP_MAC_fetch(lib_ctx, OSSL_MAC_NAME_HMAC, progq);
-	if (!mac) {
-		errno = ENOMEM;
-		goto out;
+	if (!cache->lib_ctx) {
+		cache->lib_ctx = OSSL_LIB_CTX_new();
+		if (!cache->lib_ctx) {
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	if (!cache->mac) {
+		cache->mac = EVP_MAC_fetch(cache->lib_ctx, OSSL_MAC_NAME_HMAC,
+					   progq);
+		if (!cache->mac) {
+			errno = ENOMEM;
+			return NULL;
+		}
 	}
 
-	mac_ctx = EVP_MAC_CTX_new(mac);
-	if (!mac_ctx) {
+	*mac_ctx = EVP_MAC_CTX_new(cache->mac);
+	if (!*mac_ctx) {
 		errno = ENOMEM;
-		goto out;
+		return NULL;
+	}
+
+	*p++ = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+						digest,
+						0);
+	*p = OSSL_PARAM_construct_end();
+
+	if (!EVP_MAC_CTX_set_params(*mac_ctx, params)) {
+		EVP_MAC_CTX_free(*mac_ctx);
+		*mac_ctx = NULL;
+		errno = ENOKEY;
+		return NULL;
 	}
+	return *mac_ctx;
+}
+
+static int nvme_dhchap_hmac(struct nvme_dhchap_cache *cache, char *hostnqn,
+			    enum nvme_hmac_alg hmac, unsigned int key_len,
+			    unsigned char *secret, unsigned char *key)
+{
+	const char hmac_seed[] = "NVMe-over-Fabrics";
+	EVP_MAC_CTX *mac_ctx;
+	size_t len;
 
 	switch (hmac) {
 	case NVME_HMAC_ALG_NONE:
 		memcpy(key, secret, key_len);
-		err = 0;
-		goto out;
+		return 0;
 	case NVME_HMAC_ALG_SHA2_256:
-		digest = OSSL_DIGEST_NAME_SHA2_256;
-		break;
 	case NVME_HMAC_ALG_SHA2_384:
-		digest = OSSL_DIGEST_NAME_SHA2_384;
-		break;
 	case NVME_HMAC_ALG_SHA2_512:
-		digest = OSSL_DIGEST_NAME_SHA2_512;
 		break;
 	default:
 		errno = EINVAL;
-		goto out;
+		return -1;
 	}
-	*p++ = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
-						digest,
-						0);
-	*p = OSSL_PARAM_construct_end();
 
-	if (!EVP_MAC_init(mac_ctx, secret, key_len, params)) {
+	mac_ctx = nvme_dhchap_mac_ctx(cache, hmac);
+	if (!mac_ctx)
+		return -1;
+
+	if (!EVP_MAC_init(mac_ctx, secret, key_len, NULL)) {
 		errno = ENOKEY;
-		goto out;
+		return -1;
 	}
 
 	if (!EVP_MAC_update(mac_ctx, (unsigned char *)hostnqn,
 			    strlen(hostnqn))) {
 		errno = ENOKEY;
-		goto out;
+		return -1;
 	}
 
 	if (!EVP_MAC_update(mac_ctx, (unsigned char *)hmac_seed,
 			    strlen(hmac_seed))) {
 		errno = ENOKEY;
-		goto out;
+		return -1;
 	}
 
 	if (!EVP_MAC_final(mac_ctx, key, &len, key_len)) {
 		errno = ENOKEY;
-		goto out;
+		return -1;
 	}
 
 	if (len != key_len) {
 		errno = EMSGSIZE;
-		goto out;
+		return -1;
+	}
+
+	return 0;
+}
+#endif /* !CONFIG_OPENSSL_3 */
+
+#ifdef CONFIG_OPENSSL
+int nvme_gen_dhchap_key(char *hostnqn, enum nvme_hmac_alg hmac,
+			unsigned int key_len, unsigned char *secret,
+			unsigned char *key)
+{
+	struct nvme_dhchap_cache cache = { };
+	int ret, err;
+
+	list_head_init(&cache.keys);
+	ret = nvme_dhchap_hmac(&cache, hostnqn, hmac, key_len, secret, key);
+	err = errno;
+	nvme_dhchap_cache_release(&cache);
+	errno = err;
+	return ret;
+}
+
+static unsigned int nvme_dhchap_key_hash(const char *hostnqn,
+					 enum nvme_hmac_alg hmac,
+					 unsigned int key_len,
+					 const unsigned char *secret)
+{
+	unsigned int hash = nvme_hash_str(hmac, hostnqn, false);
+
+	return nvme_hash_mem(hash, secret, key_len);
+}
+
+static struct nvme_dhchap_key *
+nvme_dhchap_key_find(struct nvme_dhchap_cache *cache, const char *hostnqn,
+		     enum nvme_hmac_alg hmac, unsigned int key_len,
+		     const unsigned char *secret, unsigned int hash)
+{
+	struct nvme_hnode *node;
+	struct nvme_dhchap_key *k;
+
+	for (node = nvme_htable_first(&cache->index, hash); node;
+	     node = node->next) {
+		if (node->hash != hash)
+			continue;
+		k = container_of(node, struct nvme_dhchap_key, hnode);
+		if (k->hmac == hmac && k->key_len == key_len &&
+		    !strcmp(k->hostnqn, hostnqn) &&
+		    !CRYPTO_memcmp(k->secret, secret, key_len))
+			return k;
+	}
+	return NULL;
+}
+
+static void nvme_dhchap_key_add(struct nvme_dhchap_cache *cache,
+				const char *hostnqn, enum nvme_hmac_alg hmac,
+				unsigned int key_len,
+				const unsigned char *secret,
+				const unsigned char *key, unsigned int hash)
+{
+	size_t nqn_len = strlen(hostnqn) + 1;
+	struct nvme_dhchap_key *k;
+
+	if (cache->nr_keys >= NVME_DHCHAP_CACHE_MAX) {
+		k = list_tail(&cache->keys, struct nvme_dhchap_key, entry);
+		list_del(&k->entry);
+		nvme_htable_del(&cache->index, &k->hnode);
+		OPENSSL_cleanse(k->secret, 2 * k->key_len);
+		free(k);
+		cache->nr_keys--;
 	}
 
-	err = 0;
+	/* a failed allocation only means the key is derived again */
+	k = calloc(1, sizeof(*k) + nqn_len + 2 * key_len);
+	if (!k)
+		return;
+	k->hmac = hmac;
+	k->key_len = key_len;
+	memcpy(k->hostnqn, hostnqn, nqn_len);
+	k->secret = (unsigned char *)k->hostnqn + nqn_len;
+	k->key = k->secret + key_len;
+	memcpy(k->secret, secret, key_len);
+	memcpy(k->key, key, key_len);
+	list_add(&cache->keys, &k->entry);
+	nvme_htable_add(&cache->index, &k->hnode, hash);
+	cache->nr_keys++;
+}
 
-out:
-	EVP_MAC_CTX_free(mac_ctx);
-	EVP_MAC_free(mac);
-	OSSL_LIB_CTX_free(lib_ctx);
+int nvme_gen_dhchap_key_cached(nvme_root_t r, char *hostnqn,
+			       enum nvme_hmac_alg hmac, unsigned int key_len,
+			       unsigned char *secret, unsigned char *key)
+{
+	struct nvme_dhchap_cache *cache, *expected = NULL;
+	struct nvme_dhchap_key *k;
+	unsigned int hash;
+	int ret = 0;
 
-	return err;
+	if (hmac == NVME_HMAC_ALG_NONE) {
+		memcpy(key, secret, key_len);
+		return 0;
+	}
+
+	cache = __atomic_load_n(&r->dhchap_cache, __ATOMIC_ACQUIRE);
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (!cache) {
+			errno = ENOMEM;
+			return -1;
+		}
+		pthread_mutex_init(&cache->lock, NULL);
+		list_head_init(&cache->keys);
+		/* another thread may have won the race */
+		if (!__atomic_compare_exchange_n(&r->dhchap_cache, &expected,
+						 cache, false, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			nvme_dhchap_cache_free(cache);
+			cache = expected;
+		}
+	}
+
+	hash = nvme_dhchap_key_hash(hostnqn, hmac, key_len, secret);
+	pthread_mutex_lock(&cache->lock);
+	k = nvme_dhchap_key_find(cache, hostnqn, hmac, key_len, secret, hash);
+	if (k) {
+		memcpy(key, k->key, key_len);
+		/* the most recently used keys are at the head */
+		list_del(&k->entry);
+		list_add(&cache->keys, &k->entry);
+	} else {
+		ret = nvme_dhchap_hmac(cache, hostnqn, hmac, key_len, secret,
+				       key);
+		if (!ret)
+			nvme_dhchap_key_add(cache, hostnqn, hmac, key_len,
+					    secret, key, hash);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return ret;
 }
-#endif /* !CONFIG_OPENSSL_3 */
+#endif /* CONFIG_OPENSSL */
@@ -12,6 +12,7 @@
 #include <stddef.h>
 
 #include "ioctl.h"
+#include "tree.h"
 #include "types.h"
 
 /**
@@ -24,7 +25,10 @@
  * nvme_fw_download_seq() - Firmware download sequence
  * @fd:		File descriptor of nvme device
  * @size:	Total size of the firmware image to transfer
- * @xfer:	Maximum size to send with each partial transfer
+ * @xfer:	Maximum size to send with each partial transfer, or 0 to derive
+ *		it from the controller's MDTS and firmware update granularity.
+ *		For a controller of the tree, nvme_ctrl_get_fw_xfer_len()
+ *		gives it from the cached limits.
  * @offset:	Starting offset to send with this firmware download
  * @buf:	Address of buffer containing all or part of the firmware image.
  *
@@ -34,6 +38,73 @@
 int nvme_fw_download_seq(int fd, __u32 size, __u32 xfer, __u32 offset,
 			 void *buf);
 
+/**
+ * nvme_fw_download_file() - Firmware download sequence from a file
+ * @fd:		File descriptor of nvme device
+ * @image_fd:	File descriptor of the firmware image, a regular file
+ * @xfer:	Maximum size to send with each partial transfer, or 0 to derive
+ *		it from the controller's MDTS and firmware update granularity.
+ *		For a controller of the tree, nvme_ctrl_get_fw_xfer_len()
+ *		gives it from the cached limits.
+ * @offset:	Starting offset to send with this firmware download
+ *
+ * Works like nvme_fw_download_seq() for the whole content of @image_fd,
+ * but maps the file instead of requiring a copy of it in memory. Processes
+ * updating controllers with the same image share its page cache pages.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_fw_download_file(int fd, int image_fd, __u32 xfer, __u32 offset);
+
+/**
+ * struct nvme_fw_update_result - Outcome of a firmware update of a controller
+ * @c:		Controller
+ * @status:	0 on success, otherwise the NVMe status of the failed download
+ *		or commit command, or -1 if the update failed locally
+ * @err:	errno value if @status is -1
+ * @result:	Command completion dword 0 of the commit command
+ * @committed:	The commit command was issued
+ */
+struct nvme_fw_update_result {
+	nvme_ctrl_t c;
+	int status;
+	int err;
+	__u32 result;
+	bool committed;
+};
+
+/**
+ * nvme_fw_update_ctrls() - Download and commit a firmware image on several
+ * controllers
+ * @ctrls:	Controllers to update
+ * @nr:		Number of entries in @ctrls
+ * @image_fd:	File descriptor of the firmware image, a regular file
+ * @slot:	Firmware slot to commit the image to
+ * @action:	Commit action, see &enum nvme_fw_commit_ca
+ * @max_parallel: Maximum number of controllers updated at the same time, or
+ *		0 for a default of 16
+ * @results:	Array of @nr entries receiving the result for each controller
+ *
+ * The image is mapped into memory once and shared by all transfers. It is
+ * downloaded to the controllers concurrently, each in chunks sized from
+ * its MDTS and firmware update granularity as in nvme_fw_download_seq(),
+ * and then committed.
+ *
+ * Controllers of one subsystem share their firmware: for each subsystem
+ * the image is downloaded and committed once, through the first of its
+ * controllers in @ctrls. The commit is only issued if the whole image was
+ * downloaded, and all controllers of the subsystem receive the same result.
+ * The tree is only accessed by the calling thread.
+ *
+ * Return: Number of controllers updated successfully, or -1 with errno set
+ * if no update could be attempted.
+ */
+int nvme_fw_update_ctrls(nvme_ctrl_t *ctrls, unsigned int nr, int image_fd,
+			 __u8 slot, enum nvme_fw_commit_ca action,
+			 unsigned int max_parallel,
+			 struct nvme_fw_update_result *results);
+
 /**
  * enum nvme_telemetry_da - Telemetry Log Data Area
  * @NVME_TELEMETRY_DA_1:	Data Area 1
@@ -97,10 +168,110 @@ int nvme_get_host_telemetry(int fd,  struct nvme_telemetry_log **log,
 int nvme_get_new_host_telemetry(int fd,  struct nvme_telemetry_log **log,
 		enum nvme_telemetry_da da, size_t *size);
 
+/**
+ * typedef nvme_telemetry_chunk_cb_t - Telemetry log chunk handler
+ * @chunk:	Log data of this chunk
+ * @len:	Length of @chunk in bytes
+ * @offset:	Offset of @chunk from the start of the log
+ * @user_data:	Pointer passed to the streaming function
+ *
+ * The buffer backing @chunk is reused for the next chunk once the
+ * handler returns.
+ *
+ * Return: 0 to continue, any other value stops the transfer and is
+ * returned to the caller of the streaming function.
+ */
+typedef int (*nvme_telemetry_chunk_cb_t)(const void *chunk, size_t len,
+					 __u64 offset, void *user_data);
+
+/**
+ * nvme_stream_ctrl_telemetry() - Read controller telemetry log in chunks
+ * @fd:		File descriptor of nvme device
+ * @rae:	Retain asynchronous events
+ * @da:		Log page data area, valid values: &enum nvme_telemetry_da
+ * @xfer_len:	Chunk size, or 0 to derive it from the controller's MDTS,
+ *		see nvme_ctrl_get_max_xfer_len(). Rounded down to a multiple
+ *		of NVME_LOG_TELEM_BLOCK_SIZE.
+ * @cb:		Handler called for each chunk, in log order
+ * @user_data:	Passed to @cb
+ * @size:	Ptr to the telemetry log size, so it can be returned, or NULL
+ *
+ * Like nvme_get_ctrl_telemetry(), but the log is read into a single
+ * buffer of @xfer_len bytes which is handed to @cb after each transfer,
+ * so memory use does not grow with the size of the log. Only the last
+ * chunk is read with the given @rae value.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field), -1 with errno set, or the non-zero value
+ * returned by @cb.
+ */
+int nvme_stream_ctrl_telemetry(int fd, bool rae, enum nvme_telemetry_da da,
+			       __u32 xfer_len, nvme_telemetry_chunk_cb_t cb,
+			       void *user_data, size_t *size);
+
+/**
+ * nvme_stream_host_telemetry() - Read host telemetry log in chunks
+ * @fd:		File descriptor of nvme device
+ * @create:	Capture a new host-initiated telemetry log first
+ * @da:		Log page data area, valid values: &enum nvme_telemetry_da
+ * @xfer_len:	Chunk size, or 0 to derive it from the controller's MDTS,
+ *		see nvme_ctrl_get_max_xfer_len(). Rounded down to a multiple
+ *		of NVME_LOG_TELEM_BLOCK_SIZE.
+ * @cb:		Handler called for each chunk, in log order
+ * @user_data:	Passed to @cb
+ * @size:	Ptr to the telemetry log size, so it can be returned, or NULL
+ *
+ * Chunked counterpart of nvme_get_host_telemetry() and
+ * nvme_get_new_host_telemetry(), see nvme_stream_ctrl_telemetry().
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field), -1 with errno set, or the non-zero value
+ * returned by @cb.
+ */
+int nvme_stream_host_telemetry(int fd, bool create, enum nvme_telemetry_da da,
+			       __u32 xfer_len, nvme_telemetry_chunk_cb_t cb,
+			       void *user_data, size_t *size);
+
+/**
+ * nvme_save_ctrl_telemetry() - Write controller telemetry log to a file
+ * @fd:		File descriptor of nvme device
+ * @rae:	Retain asynchronous events
+ * @da:		Log page data area, valid values: &enum nvme_telemetry_da
+ * @out_fd:	File descriptor the log is written to
+ * @size:	Ptr to the telemetry log size, so it can be returned, or NULL
+ *
+ * Streams the log to @out_fd with nvme_stream_ctrl_telemetry(), starting
+ * at its current file offset.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_save_ctrl_telemetry(int fd, bool rae, enum nvme_telemetry_da da,
+			     int out_fd, size_t *size);
+
+/**
+ * nvme_save_host_telemetry() - Write host telemetry log to a file
+ * @fd:		File descriptor of nvme device
+ * @create:	Capture a new host-initiated telemetry log first
+ * @da:		Log page data area, valid values: &enum nvme_telemetry_da
+ * @out_fd:	File descriptor the log is written to
+ * @size:	Ptr to the telemetry log size, so it can be returned, or NULL
+ *
+ * Streams the log to @out_fd with nvme_stream_host_telemetry(), starting
+ * at its current file offset.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_save_host_telemetry(int fd, bool create, enum nvme_telemetry_da da,
+			     int out_fd, size_t *size);
+
 /**
  * nvme_get_log_page() - Get log page data
  * @fd:		File descriptor of nvme device
- * @xfer_len:	Max log transfer size per request to split the total.
+ * @xfer_len:	Max log transfer size per request to split the total, or 0
+ *		to derive it from the controller's MDTS, see
+ *		nvme_ctrl_get_max_xfer_len().
  * @args:	&struct nvme_get_log_args argument structure
  *
  * Return: The nvme command status if a response was received (see
@@ -108,6 +279,28 @@ int nvme_get_new_host_telemetry(int fd,  struct nvme_telemetry_log **log,
  */
 int nvme_get_log_page(int fd, __u32 xfer_len, struct nvme_get_log_args *args);
 
+/**
+ * nvme_get_log_page_pipelined() - Get log page data with several requests
+ *				   in flight
+ * @fd:		File descriptor of nvme controller character device
+ * @xfer_len:	Max log transfer size per request to split the total, or 0
+ *		to derive it from the controller's MDTS, see
+ *		nvme_ctrl_get_max_xfer_len().
+ * @depth:	Max number of requests in flight, or 0 for the default
+ * @args:	&struct nvme_get_log_args argument structure
+ *
+ * Like nvme_get_log_page(), but keeps up to @depth requests for different
+ * offsets outstanding at once through io_uring. All but the last request
+ * are sent with RAE set; the last one is only sent once all others have
+ * completed, with the RAE value given in @args. Falls back to
+ * nvme_get_log_page() if io_uring passthrough is not available.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_get_log_page_pipelined(int fd, __u32 xfer_len, unsigned int depth,
+				struct nvme_get_log_args *args);
+
 /**
  * nvme_get_ana_log_len() - Retrieve size of the current ANA log
  * @fd:		File descriptor of nvme device
@@ -129,6 +322,65 @@ int nvme_get_ana_log_len(int fd, size_t *analen);
  */
 int nvme_get_logical_block_size(int fd, __u32 nsid, int *blksize);
 
+/**
+ * enum nvme_collect_log - Log pages gathered by nvme_collect_logs()
+ * @NVME_COLLECT_SMART:		SMART / Health Information, written to
+ *				'<ctrl>-smart.bin'
+ * @NVME_COLLECT_ERROR:		All Error Information entries, written to
+ *				'<ctrl>-error.bin'
+ * @NVME_COLLECT_CTRL_TELEMETRY: Controller-initiated telemetry log, written to
+ *				'<ctrl>-telemetry-ctrl.bin'
+ * @NVME_COLLECT_HOST_TELEMETRY: Newly captured host-initiated telemetry log,
+ *				written to '<ctrl>-telemetry-host.bin'
+ * @NVME_COLLECT_ALL:		Mask of all log pages
+ */
+enum nvme_collect_log {
+	NVME_COLLECT_SMART		= 1 << 0,
+	NVME_COLLECT_ERROR		= 1 << 1,
+	NVME_COLLECT_CTRL_TELEMETRY	= 1 << 2,
+	NVME_COLLECT_HOST_TELEMETRY	= 1 << 3,
+	NVME_COLLECT_ALL		= 0xf,
+};
+
+/**
+ * typedef nvme_collect_cb_t - Log collection result handler
+ * @c:		Controller the log was read from
+ * @log:	Log page, one of &enum nvme_collect_log
+ * @status:	0 on success, the nvme command status if a response was
+ *		received, or -1 if the log could not be read or written
+ * @err:	errno value if @status is -1
+ * @user_data:	Pointer passed to nvme_collect_logs()
+ */
+typedef void (*nvme_collect_cb_t)(nvme_ctrl_t c, unsigned int log,
+				  int status, int err, void *user_data);
+
+/**
+ * nvme_collect_logs() - Save log pages of all controllers to files
+ * @r:		&nvme_root_t object
+ * @dir_fd:	Directory the files are created in, or AT_FDCWD
+ * @logs:	Log pages to collect, see &enum nvme_collect_log
+ * @da:		Telemetry log data area, valid values: &enum nvme_telemetry_da
+ * @max_parallel: Maximum number of controllers read from at the same time,
+ *		or 0 for a default of 16
+ * @cb:		Optional handler called with the result of each log
+ * @user_data:	Passed to @cb
+ *
+ * Reads the requested log pages of every controller in the tree on a
+ * bounded pool of worker threads. Each log is written to its own file
+ * named after the controller, which is truncated first. Telemetry logs
+ * are streamed to the file as they are read, see nvme_save_ctrl_telemetry().
+ * All log pages are read with RAE set, so pending asynchronous events are
+ * not cleared.
+ *
+ * The tree is only accessed by the calling thread, which also runs @cb
+ * once all controllers have been processed.
+ *
+ * Return: Number of log files written successfully, or -1 with errno set.
+ */
+int nvme_collect_logs(nvme_root_t r, int dir_fd, unsigned int logs,
+		      enum nvme_telemetry_da da, unsigned int max_parallel,
+		      nvme_collect_cb_t cb, void *user_data);
+
 /**
  * nvme_get_lba_status_log() - Retrieve the LBA Status log page
  * @fd:		File descriptor of the nvme device
@@ -140,6 +392,115 @@ int nvme_get_logical_block_size(int fd, __u32 nsid, int *blksize);
  */
 int nvme_get_lba_status_log(int fd, bool rae, struct nvme_lba_status_log **log);
 
+/**
+ * typedef nvme_extents_t - Set of logical block ranges
+ *
+ * The ranges are kept in the order they were added, only a range starting
+ * right after the previous one is merged into it. nvme_extents_deallocate()
+ * sorts the set and merges overlapping and adjacent ranges first, while
+ * nvme_extents_copy() keeps the order, as it determines where each range
+ * ends up in the destination.
+ */
+typedef struct nvme_extents * nvme_extents_t;
+
+/**
+ * nvme_extents_create() - Create an empty set of logical block ranges
+ *
+ * An extent set collects the ranges of a Dataset Management deallocate or
+ * a Simple Copy, for instance the blocks freed by a file system, and turns
+ * them into as few commands as the controller limits permit.
+ *
+ * Return: New extent set, or NULL with errno set on failure.
+ */
+nvme_extents_t nvme_extents_create(void);
+
+/**
+ * nvme_extents_free() - Free an extent set
+ * @e:		Extent set
+ */
+void nvme_extents_free(nvme_extents_t e);
+
+/**
+ * nvme_extents_reset() - Remove all ranges from an extent set
+ * @e:		Extent set
+ *
+ * Keeps the memory of the set for reuse.
+ */
+void nvme_extents_reset(nvme_extents_t e);
+
+/**
+ * nvme_extents_add() - Add a range of logical blocks to an extent set
+ * @e:		Extent set
+ * @slba:	First logical block of the range
+ * @nlb:	Number of logical blocks, at least 1
+ *
+ * A range starting right after the previously added one is merged into it.
+ * There is no limit on the length of a range.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_extents_add(nvme_extents_t e, __u64 slba, __u64 nlb);
+
+/**
+ * nvme_extents_get_nr() - Number of ranges of an extent set
+ * @e:		Extent set
+ *
+ * Return: Number of ranges after merging.
+ */
+size_t nvme_extents_get_nr(nvme_extents_t e);
+
+/**
+ * nvme_extents_deallocate() - Deallocate the ranges of an extent set
+ * @e:		Extent set
+ * @fd:		File descriptor of the nvme device
+ * @nsid:	Namespace ID
+ * @max_parallel: Maximum number of commands in flight, or 0 for a default
+ *		of 8
+ *
+ * Sorts the set and merges overlapping and adjacent ranges, then splits
+ * the result into Dataset Management commands with the deallocate
+ * attribute, honouring the range count, range size and total size limits
+ * the controller reports in its I/O Command Set specific Identify
+ * Controller data. The commands are sent in batches of @max_parallel
+ * with nvme_submit_io_passthru_batch(), and no further batches are sent
+ * once a command failed.
+ *
+ * Return: 0 if all commands succeeded, otherwise the nvme command status of
+ * the first failed command if a response was received (see &enum
+ * nvme_status_field) or -1 with errno set. Commands other than the failed
+ * one may have completed.
+ */
+int nvme_extents_deallocate(nvme_extents_t e, int fd, __u32 nsid,
+			    unsigned int max_parallel);
+
+/**
+ * nvme_extents_copy() - Copy the ranges of an extent set
+ * @e:		Extent set
+ * @fd:		File descriptor of the nvme device
+ * @nsid:	Namespace ID
+ * @sdlba:	First logical block of the destination
+ * @max_parallel: Maximum number of commands in flight, or 0 for a default
+ *		of 8
+ *
+ * The ranges are written back to back starting at @sdlba, in the order
+ * they were added. They are not sorted or merged beyond what
+ * nvme_extents_add() does, so a range given twice is copied twice; add
+ * the ranges in ascending order and without overlaps to get the fewest
+ * commands. They are split into Copy commands with source range
+ * format 0, honouring the source range count, single source range length
+ * and copy length limits of the namespace. The commands are sent in
+ * batches of @max_parallel with nvme_submit_io_passthru_batch(), and may
+ * execute in any order, so the source ranges must not overlap the
+ * destination. No further batches are sent once a command failed.
+ *
+ * Return: 0 if all commands succeeded, otherwise the nvme command status of
+ * the first failed command if a response was received (see &enum
+ * nvme_status_field) or -1 with errno set. Commands other than the failed
+ * one may have completed.
+ */
+int nvme_extents_copy(nvme_extents_t e, int fd, __u32 nsid, __u64 sdlba,
+		      unsigned int max_parallel);
+
 /**
  * nvme_namespace_attach_ctrls() - Attach namespace to controller(s)
  * @fd:		File descriptor of nvme device
@@ -169,7 +530,8 @@ int nvme_namespace_detach_ctrls(int fd, __u32 nsid, __u16 num_ctrls, __u16 *ctrl
  * @name:	The basename of the device to open
  *
  * This will look for the handle in /dev/ and validate the name and filetype
- * match linux conventions.
+ * match linux conventions. Besides the controller (nvmeX) and block (nvmeXnY)
+ * devices, the generic namespace character devices (ngXnY) are accepted.
  *
  * Return: A file descriptor for the device on a successful open, or -1 with
  * errno set otherwise.
@@ -205,4 +567,29 @@ int nvme_gen_dhchap_key(char *hostnqn, enum nvme_hmac_alg hmac,
 			unsigned int key_len, unsigned char *secret,
 			unsigned char *key);
 
+/**
+ * nvme_gen_dhchap_key_cached() - DH-HMAC-CHAP key generation with caching
+ * @r:		&nvme_root_t object
+ * @hostnqn:	Host NVMe Qualified Name
+ * @hmac:	HMAC algorithm
+ * @key_len:	Output key length
+ * @secret:	Secret to used for digest
+ * @key:	Generated DH-HMAC-CHAP key
+ *
+ * Same as nvme_gen_dhchap_key(), but the OpenSSL library context and MAC
+ * contexts are set up once and reused by all calls for @r, and derived
+ * keys are remembered by host NQN, secret and algorithm. This makes
+ * deriving the keys for many controllers, such as when they reconnect at
+ * the same time, cheap. At most 1024 keys are kept per root, the least
+ * recently used ones are dropped first. The cache is protected by a lock,
+ * so the function may be called from several threads for the same @r. The
+ * cached secrets and keys are cleared when @r is freed.
+ *
+ * Return: If key generation was successful the function returns 0 or
+ * -1 with errno set otherwise.
+ */
+int nvme_gen_dhchap_key_cached(nvme_root_t r, char *hostnqn,
+			       enum nvme_hmac_alg hmac, unsigned int key_len,
+			       unsigned char *secret, unsigned char *key);
+
 #endif /* _LIBNVME_LINUX_H */
@@ -8,8 +8,11 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <poll.h>
@@ -21,6 +24,7 @@
 #include <linux/mctp.h>
 #endif
 
+#include <ccan/array_size/array_size.h>
 #include <ccan/endian/endian.h>
 
 #ifdef CONFIG_LIBSYSTEMD
@@ -84,6 +88,12 @@ struct nvme_mi_transport_mctp {
 	int	net;
 	__u8	eid;
 	int	sd;
+	struct sockaddr_mctp addr;
+
+	/* idle preallocated tags, kept across requests */
+	__u8	tags[NVME_MI_NR_SLOTS];
+	int	nr_tags;
+	bool	no_tag_alloc;
 };
 
 static int ioctl_tag(int sd, unsigned long req, struct mctp_ioc_tag_ctl *ctl)
@@ -115,11 +125,25 @@ static __u8 nvme_mi_mctp_tag_alloc(struct nvme_mi_ep *ep)
 
 	mctp = ep->transport_data;
 
+	if (mctp->nr_tags)
+		return mctp->tags[--mctp->nr_tags];
+	if (mctp->no_tag_alloc)
+		return MCTP_TAG_OWNER;
+
 	ctl.peer_addr = mctp->eid;
 
 	errno = 0;
 	rc = ops.ioctl_tag(mctp->sd, SIOCMCTPALLOCTAG, &ctl);
 	if (rc) {
+		/*
+		 * Only stop trying when the kernel doesn't support it; a
+		 * transient failure, e.g. all tags to the peer in use, only
+		 * affects this request.
+		 */
+		if (errno != ENOTTY && errno != EOPNOTSUPP && errno != EINVAL)
+			return MCTP_TAG_OWNER;
+
+		mctp->no_tag_alloc = true;
 		if (!logged) {
 			/* not necessarily fatal, just means we can't handle
 			 * "more processing required" messages */
@@ -149,6 +173,24 @@ static void nvme_mi_mctp_tag_drop(struct nvme_mi_ep *ep, __u8 tag)
 	ops.ioctl_tag(mctp->sd, SIOCMCTPDROPTAG, &ctl);
 }
 
+/*
+ * Return a tag after a completed request, keeping it for the next one.
+ * Tags of failed or timed out requests are dropped instead, so that a
+ * late response can't be mistaken for that of a later request.
+ */
+static void nvme_mi_mctp_tag_release(struct nvme_mi_ep *ep, __u8 tag)
+{
+	struct nvme_mi_transport_mctp *mctp = ep->transport_data;
+
+	if (!(tag & MCTP_TAG_PREALLOC))
+		return;
+
+	if (mctp->nr_tags < (int)ARRAY_SIZE(mctp->tags))
+		mctp->tags[mctp->nr_tags++] = tag;
+	else
+		nvme_mi_mctp_tag_drop(ep, tag);
+}
+
 #else /*  !defined SIOMCTPTAGALLOC */
 
 static __u8 nvme_mi_mctp_tag_alloc(struct nvme_mi_ep *ep)
@@ -166,6 +208,10 @@ static void nvme_mi_mctp_tag_drop(struct nvme_mi_ep *ep, __u8 tag)
 {
 }
 
+static void nvme_mi_mctp_tag_release(struct nvme_mi_ep *ep, __u8 tag)
+{
+}
+
 #endif /* !defined SIOMCTPTAGALLOC */
 
 struct nvme_mi_msg_resp_mpr {
@@ -206,7 +252,8 @@ static bool nvme_mi_mctp_resp_is_mpr(struct nvme_mi_resp *resp, size_t len,
 	if (resp->hdr_len > sizeof(*msg))
 		mic = *(__le32 *)(msg + 1);
 	else
-		mic = *(__le32 *)(resp->data);
+		nvme_mi_data_read(resp->data, resp->data_iov,
+				  resp->data_iovcnt, 0, &mic, sizeof(mic));
 
 	crc = ~nvme_mi_crc32_update(0xffffffff, msg, sizeof(*msg));
 	if (le32_to_cpu(mic) != crc)
@@ -218,40 +265,29 @@ static bool nvme_mi_mctp_resp_is_mpr(struct nvme_mi_resp *resp, size_t len,
 	return true;
 }
 
-static int nvme_mi_mctp_submit(struct nvme_mi_ep *ep,
-			       struct nvme_mi_req *req,
-			       struct nvme_mi_resp *resp)
+static void nvme_mi_mctp_init_addr(struct nvme_mi_transport_mctp *mctp)
 {
-	struct nvme_mi_transport_mctp *mctp;
-	struct iovec req_iov[3], resp_iov[3];
-	struct msghdr req_msg, resp_msg;
-	int i, rc, errno_save, timeout;
+	struct sockaddr_mctp *addr = &mctp->addr;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->smctp_family = AF_MCTP;
+	addr->smctp_network = mctp->net;
+	addr->smctp_addr.s_addr = mctp->eid;
+	addr->smctp_type = MCTP_TYPE_NVME | MCTP_TYPE_MIC;
+}
+
+static int nvme_mi_mctp_send_req(struct nvme_mi_ep *ep,
+				 struct nvme_mi_req *req, __u8 tag)
+{
+	struct nvme_mi_transport_mctp *mctp = ep->transport_data;
+	struct iovec req_iov[NVME_MI_MAX_DATA_IOV + 2];
 	struct sockaddr_mctp addr;
-	struct pollfd pollfds[1];
-	unsigned int mpr_time;
+	struct msghdr req_msg;
+	int i, j, errno_save;
 	ssize_t len;
 	__le32 mic;
-	__u8 tag;
-
-	if (ep->transport != &nvme_mi_transport_mctp) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	/* we need enough space for at least a generic (/error) response */
-	if (resp->hdr_len < sizeof(struct nvme_mi_msg_resp)) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	mctp = ep->transport_data;
-	tag = nvme_mi_mctp_tag_alloc(ep);
 
-	memset(&addr, 0, sizeof(addr));
-	addr.smctp_family = AF_MCTP;
-	addr.smctp_network = mctp->net;
-	addr.smctp_addr.s_addr = mctp->eid;
-	addr.smctp_type = MCTP_TYPE_NVME | MCTP_TYPE_MIC;
+	addr = mctp->addr;
 	addr.smctp_tag = tag;
 
 	i = 0;
@@ -259,7 +295,11 @@ static int nvme_mi_mctp_submit(struct nvme_mi_ep *ep,
 	req_iov[i].iov_len = req->hdr_len - 1;
 	i++;
 
-	if (req->data_len) {
+	/* vectored data goes straight from the caller's buffers */
+	if (req->data_iov) {
+		for (j = 0; j < req->data_iovcnt; j++)
+			req_iov[i++] = req->data_iov[j];
+	} else if (req->data_len) {
 		req_iov[i].iov_base = req->data;
 		req_iov[i].iov_len = req->data_len;
 		i++;
@@ -282,47 +322,47 @@ static int nvme_mi_mctp_submit(struct nvme_mi_ep *ep,
 		nvme_msg(ep->root, LOG_ERR,
 			 "Failure sending MCTP message: %m\n");
 		errno = errno_save;
-		rc = -1;
-		goto out;
+		return -1;
 	}
 
-	resp_iov[0].iov_base = ((__u8 *)resp->hdr) + 1;
-	resp_iov[0].iov_len = resp->hdr_len - 1;
+	return 0;
+}
 
-	resp_iov[1].iov_base = ((__u8 *)resp->data);
-	resp_iov[1].iov_len = resp->data_len;
+/* receives a message into @resp, returning its length including the type */
+static ssize_t nvme_mi_mctp_recv_resp(struct nvme_mi_ep *ep,
+				      struct nvme_mi_resp *resp, __le32 *mic)
+{
+	struct nvme_mi_transport_mctp *mctp = ep->transport_data;
+	struct iovec resp_iov[NVME_MI_MAX_DATA_IOV + 2];
+	struct sockaddr_mctp addr;
+	struct msghdr resp_msg;
+	int i, j, errno_save;
+	ssize_t len;
 
-	resp_iov[2].iov_base = &mic;
-	resp_iov[2].iov_len = sizeof(mic);
+	i = 0;
+	resp_iov[i].iov_base = ((__u8 *)resp->hdr) + 1;
+	resp_iov[i].iov_len = resp->hdr_len - 1;
+	i++;
+
+	if (resp->data_iov) {
+		for (j = 0; j < resp->data_iovcnt; j++)
+			resp_iov[i++] = resp->data_iov[j];
+	} else {
+		resp_iov[i].iov_base = ((__u8 *)resp->data);
+		resp_iov[i].iov_len = resp->data_len;
+		i++;
+	}
+
+	resp_iov[i].iov_base = mic;
+	resp_iov[i].iov_len = sizeof(*mic);
+	i++;
 
 	memset(&resp_msg, 0, sizeof(resp_msg));
 	resp_msg.msg_name = &addr;
 	resp_msg.msg_namelen = sizeof(addr);
 	resp_msg.msg_iov = resp_iov;
-	resp_msg.msg_iovlen = 3;
-
-	pollfds[0].fd = mctp->sd;
-	pollfds[0].events = POLLIN;
-	timeout = ep->timeout ?: -1;
-retry:
-	rc = ops.poll(pollfds, 1, timeout);
-	if (rc < 0) {
-		if (errno == EINTR)
-			goto retry;
-		errno_save = errno;
-		nvme_msg(ep->root, LOG_ERR,
-			 "Failed polling on MCTP socket: %m");
-		errno = errno_save;
-		return -1;
-	}
+	resp_msg.msg_iovlen = i;
 
-	if (rc == 0) {
-		nvme_msg(ep->root, LOG_DEBUG, "Timeout on MCTP socket");
-		errno = ETIMEDOUT;
-		return -1;
-	}
-
-	rc = -1;
 	len = ops.recvmsg(mctp->sd, &resp_msg, MSG_DONTWAIT);
 
 	if (len < 0) {
@@ -330,14 +370,14 @@ retry:
 		nvme_msg(ep->root, LOG_ERR,
 			 "Failure receiving MCTP message: %m\n");
 		errno = errno_save;
-		goto out;
+		return -1;
 	}
 
 
 	if (len == 0) {
 		nvme_msg(ep->root, LOG_WARNING, "No data from MCTP endpoint\n");
 		errno = EIO;
-		goto out;
+		return -1;
 	}
 
 	/* Re-add the type byte, so we can work on aligned lengths from here */
@@ -347,12 +387,12 @@ retry:
 	/* The smallest response data is 8 bytes: generic 4-byte message header
 	 * plus four bytes of error data (excluding MIC). Ensure we have enough.
 	 */
-	if (len < 8 + sizeof(mic)) {
+	if (len < 8 + sizeof(*mic)) {
 		nvme_msg(ep->root, LOG_ERR,
 			 "Invalid MCTP response: too short (%zd bytes, needed %zd)\n",
-			 len, 8 + sizeof(mic));
+			 len, 8 + sizeof(*mic));
 		errno = EPROTO;
-		goto out;
+		return -1;
 	}
 
 	/* We can't have header/payload data that isn't a multiple of 4 bytes */
@@ -361,35 +401,20 @@ retry:
 			 "Response message has unaligned length (%zd)!\n",
 			 len);
 		errno = EPROTO;
-		goto out;
+		return -1;
 	}
 
-	/* Check for a More Processing Required response. This is a slight
-	 * layering violation, as we're pre-checking the MIC and inspecting
-	 * header fields. However, we need to do this in the transport in order
-	 * to keep the tag allocated and retry the recvmsg
-	 */
-	if (nvme_mi_mctp_resp_is_mpr(resp, len, &mpr_time)) {
-		nvme_msg(ep->root, LOG_DEBUG,
-			 "Received More Processing Required, waiting for response\n");
-
-		/* if the controller hasn't set MPRT, fall back to our command/
-		 * response timeout, or the largest possible MPRT if none set */
-		if (!mpr_time)
-			mpr_time = ep->timeout ?: 0xffff;
-
-		/* clamp to the endpoint max */
-		if (ep->mprt_max && mpr_time > ep->mprt_max)
-			mpr_time = ep->mprt_max;
-
-		timeout = mpr_time;
-		goto retry;
-	}
+	return len;
+}
 
+static void nvme_mi_mctp_layout_resp(struct nvme_mi_resp *resp, ssize_t len,
+				     __le32 mic)
+{
 	/* If we have a shorter than expected response, we need to find the
 	 * MIC and the correct split between header & data. We know that the
-	 * split is 4-byte aligned, so the MIC will be entirely within one
-	 * of the iovecs.
+	 * split is 4-byte aligned, so the MIC will be entirely within either
+	 * the header or the data, although vectored data may split it
+	 * between the caller's buffers.
 	 */
 	if (len == resp->hdr_len + resp->data_len + sizeof(mic)) {
 		/* Common case: expected data length. Header, data and MIC
@@ -407,20 +432,307 @@ retry:
 		/* We have a full header, but data is truncated - possibly
 		 * zero bytes. MIC is somewhere in the data buf */
 		resp->data_len = len - resp->hdr_len - sizeof(mic);
-		memcpy(&mic, ((uint8_t *)resp->data) + resp->data_len,
-		       sizeof(mic));
+		nvme_mi_data_read(resp->data, resp->data_iov,
+				  resp->data_iovcnt, resp->data_len,
+				  &mic, sizeof(mic));
 	}
 
 	resp->mic = le32_to_cpu(mic);
+}
+
+/*
+ * The wait time after a More Processing Required response. The device
+ * told us how long it needs, so the adaptive timeouts don't apply.
+ */
+static unsigned int nvme_mi_mctp_mpr_timeout(struct nvme_mi_ep *ep,
+					     unsigned int mpr_time)
+{
+	/* if the controller hasn't set MPRT, fall back to our command/
+	 * response timeout, or the largest possible MPRT if none set */
+	if (!mpr_time)
+		mpr_time = ep->timeout ?: 0xffff;
+
+	/* clamp to the endpoint max */
+	if (ep->mprt_max && mpr_time > ep->mprt_max)
+		mpr_time = ep->mprt_max;
+
+	return mpr_time;
+}
+
+static int nvme_mi_mctp_submit(struct nvme_mi_ep *ep,
+			       struct nvme_mi_req *req,
+			       struct nvme_mi_resp *resp)
+{
+	struct nvme_mi_transport_mctp *mctp;
+	int rc, errno_save, timeout;
+	struct pollfd pollfds[1];
+	unsigned int mpr_time;
+	ssize_t len;
+	__le32 mic;
+	__u8 tag;
+
+	if (ep->transport != &nvme_mi_transport_mctp) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* we need enough space for at least a generic (/error) response */
+	if (resp->hdr_len < sizeof(struct nvme_mi_msg_resp)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mctp = ep->transport_data;
+	tag = nvme_mi_mctp_tag_alloc(ep);
+
+	rc = nvme_mi_mctp_send_req(ep, req, tag);
+	if (rc)
+		goto out;
+
+	pollfds[0].fd = mctp->sd;
+	pollfds[0].events = POLLIN;
+	timeout = nvme_mi_ep_req_timeout(ep, req) ?: -1;
+retry:
+	rc = ops.poll(pollfds, 1, timeout);
+	if (rc < 0) {
+		if (errno == EINTR)
+			goto retry;
+		errno_save = errno;
+		nvme_msg(ep->root, LOG_ERR,
+			 "Failed polling on MCTP socket: %m");
+		errno = errno_save;
+		rc = -1;
+		goto out;
+	}
+
+	if (rc == 0) {
+		nvme_msg(ep->root, LOG_DEBUG, "Timeout on MCTP socket");
+		errno = ETIMEDOUT;
+		rc = -1;
+		goto out;
+	}
+
+	rc = -1;
+	len = nvme_mi_mctp_recv_resp(ep, resp, &mic);
+	if (len < 0)
+		goto out;
+
+	/* Check for a More Processing Required response. This is a slight
+	 * layering violation, as we're pre-checking the MIC and inspecting
+	 * header fields. However, we need to do this in the transport in order
+	 * to keep the tag allocated and retry the recvmsg
+	 */
+	if (nvme_mi_mctp_resp_is_mpr(resp, len, &mpr_time)) {
+		nvme_msg(ep->root, LOG_DEBUG,
+			 "Received More Processing Required, waiting for response\n");
+
+		timeout = nvme_mi_mctp_mpr_timeout(ep, mpr_time);
+		goto retry;
+	}
+
+	nvme_mi_mctp_layout_resp(resp, len, mic);
 
 	rc = 0;
 
 out:
-	nvme_mi_mctp_tag_drop(ep, tag);
+	errno_save = errno;
+	if (rc)
+		nvme_mi_mctp_tag_drop(ep, tag);
+	else
+		nvme_mi_mctp_tag_release(ep, tag);
+	errno = errno_save;
 
 	return rc;
 }
 
+static void nvme_mi_mctp_set_deadline(struct nvme_mi_xfer *xfer,
+				      unsigned int timeout)
+{
+	clock_gettime(CLOCK_MONOTONIC, &xfer->deadline);
+	if (!timeout) {
+		/* no timeout */
+		xfer->deadline.tv_sec = 0;
+		xfer->deadline.tv_nsec = 0;
+		return;
+	}
+	xfer->deadline.tv_sec += timeout / 1000;
+	xfer->deadline.tv_nsec += (timeout % 1000) * 1000000;
+	if (xfer->deadline.tv_nsec >= 1000000000) {
+		xfer->deadline.tv_sec++;
+		xfer->deadline.tv_nsec -= 1000000000;
+	}
+}
+
+static void nvme_mi_mctp_complete(struct nvme_mi_ep *ep,
+				  struct nvme_mi_xfer *xfer, int rc, int err)
+{
+	if (rc)
+		nvme_mi_mctp_tag_drop(ep, xfer->tag);
+	else
+		nvme_mi_mctp_tag_release(ep, xfer->tag);
+	xfer->done = true;
+	xfer->rc = rc;
+	xfer->err = err;
+}
+
+static int nvme_mi_mctp_send(struct nvme_mi_ep *ep, struct nvme_mi_xfer *xfer)
+{
+	int rc;
+
+	if (ep->transport != &nvme_mi_transport_mctp) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (xfer->resp->hdr_len < sizeof(struct nvme_mi_msg_resp)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	xfer->tag = nvme_mi_mctp_tag_alloc(ep);
+	rc = nvme_mi_mctp_send_req(ep, xfer->req, xfer->tag);
+	if (rc) {
+		/* nothing was sent, so the tag is still clean */
+		nvme_mi_mctp_tag_release(ep, xfer->tag);
+		return rc;
+	}
+
+	nvme_mi_mctp_set_deadline(xfer, nvme_mi_ep_req_timeout(ep, xfer->req));
+	return 0;
+}
+
+/* the socket is unusable, complete everything still waiting on it */
+static int nvme_mi_mctp_recv_fail(struct nvme_mi_ep *ep,
+				  struct nvme_mi_xfer **xfers, int nr, int err)
+{
+	int i;
+
+	for (i = 0; i < nr; i++)
+		if (!xfers[i]->done)
+			nvme_mi_mctp_complete(ep, xfers[i], -1, err);
+	errno = err;
+	return -1;
+}
+
+/*
+ * Responses are matched to the outstanding requests by their command
+ * slot, so the header is peeked at before receiving the message into
+ * the response buffers.
+ */
+static int nvme_mi_mctp_recv(struct nvme_mi_ep *ep, struct nvme_mi_xfer **xfers,
+			     int nr, bool nowait)
+{
+	struct nvme_mi_transport_mctp *mctp = ep->transport_data;
+	struct nvme_mi_xfer *xfer;
+	struct pollfd pollfds[1];
+	struct timespec now;
+	unsigned int mpr_time;
+	int i, rc, timeout, left, done;
+	__u8 nmp, discard[8];
+	struct iovec iov;
+	struct msghdr msg;
+	ssize_t len;
+
+	pollfds[0].fd = mctp->sd;
+	pollfds[0].events = POLLIN;
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timeout = -1;
+		done = 0;
+		for (i = 0; i < nr; i++) {
+			xfer = xfers[i];
+			if (xfer->done)
+				continue;
+			left = nvme_mi_xfer_time_left(xfer, &now);
+			if (!left) {
+				nvme_msg(ep->root, LOG_DEBUG,
+					 "Timeout on MCTP socket");
+				nvme_mi_mctp_complete(ep, xfer, -1, ETIMEDOUT);
+				done++;
+				continue;
+			}
+			if (left > 0 && (timeout < 0 || left < timeout))
+				timeout = left;
+		}
+		if (done)
+			return 0;
+
+		rc = ops.poll(pollfds, 1, nowait ? 0 : timeout);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = errno;
+			nvme_msg(ep->root, LOG_ERR,
+				 "Failed polling on MCTP socket: %m");
+			return nvme_mi_mctp_recv_fail(ep, xfers, nr, rc);
+		}
+		if (rc == 0) {
+			if (nowait)
+				return 0;
+			continue;
+		}
+
+		/* the first byte after the type holds the command slot */
+		iov.iov_base = &nmp;
+		iov.iov_len = sizeof(nmp);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		len = ops.recvmsg(mctp->sd, &msg, MSG_PEEK | MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (len < 0) {
+			rc = errno;
+			nvme_msg(ep->root, LOG_ERR,
+				 "Failed receiving from MCTP socket: %m\n");
+			return nvme_mi_mctp_recv_fail(ep, xfers, nr, rc);
+		}
+
+		xfer = NULL;
+		for (i = 0; len > 0 && i < nr; i++) {
+			if (!xfers[i]->done &&
+			    (xfers[i]->req->hdr->nmp & 0x1) == (nmp & 0x1)) {
+				xfer = xfers[i];
+				break;
+			}
+		}
+		if (!xfer) {
+			nvme_msg(ep->root, LOG_WARNING,
+				 "Dropping MCTP message for idle command slot\n");
+			iov.iov_base = discard;
+			iov.iov_len = sizeof(discard);
+			ops.recvmsg(mctp->sd, &msg, MSG_DONTWAIT);
+			continue;
+		}
+
+		len = nvme_mi_mctp_recv_resp(ep, xfer->resp, &xfer->mic);
+		if (len < 0) {
+			nvme_mi_mctp_complete(ep, xfer, -1, errno);
+			return 0;
+		}
+
+		if (nvme_mi_mctp_resp_is_mpr(xfer->resp, len, &mpr_time)) {
+			nvme_msg(ep->root, LOG_DEBUG,
+				 "Received More Processing Required, waiting for response\n");
+			nvme_mi_mctp_set_deadline(xfer,
+				nvme_mi_mctp_mpr_timeout(ep, mpr_time));
+			continue;
+		}
+
+		nvme_mi_mctp_layout_resp(xfer->resp, len, xfer->mic);
+		nvme_mi_mctp_complete(ep, xfer, 0, 0);
+		return 0;
+	} while (1);
+}
+
+static int nvme_mi_mctp_get_fd(struct nvme_mi_ep *ep)
+{
+	struct nvme_mi_transport_mctp *mctp = ep->transport_data;
+
+	return mctp->sd;
+}
+
 static void nvme_mi_mctp_close(struct nvme_mi_ep *ep)
 {
 	struct nvme_mi_transport_mctp *mctp;
@@ -429,6 +741,8 @@ static void nvme_mi_mctp_close(struct nvme_mi_ep *ep)
 		return;
 
 	mctp = ep->transport_data;
+	while (mctp->nr_tags)
+		nvme_mi_mctp_tag_drop(ep, mctp->tags[--mctp->nr_tags]);
 	close(mctp->sd);
 	free(ep->transport_data);
 }
@@ -453,6 +767,9 @@ static const struct nvme_mi_transport nvme_mi_transport_mctp = {
 	.name = "mctp",
 	.mic_enabled = true,
 	.submit = nvme_mi_mctp_submit,
+	.send = nvme_mi_mctp_send,
+	.recv = nvme_mi_mctp_recv,
+	.get_fd = nvme_mi_mctp_get_fd,
 	.close = nvme_mi_mctp_close,
 	.desc_ep = nvme_mi_mctp_desc_ep,
 };
@@ -467,12 +784,13 @@ nvme_mi_ep_t nvme_mi_open_mctp(nvme_root_t root, unsigned int netid, __u8 eid)
 	if (!ep)
 		return NULL;
 
-	mctp = malloc(sizeof(*mctp));
+	mctp = calloc(1, sizeof(*mctp));
 	if (!mctp)
 		goto err_free_ep;
 
 	mctp->net = netid;
 	mctp->eid = eid;
+	nvme_mi_mctp_init_addr(mctp);
 
 	mctp->sd = ops.socket(AF_MCTP, SOCK_DGRAM, 0);
 	if (mctp->sd < 0)
@@ -492,6 +810,7 @@ nvme_mi_ep_t nvme_mi_open_mctp(nvme_root_t root, unsigned int netid, __u8 eid)
 
 err_free_ep:
 	errno_save = errno;
+	free(mctp);
 	free(ep);
 	errno = errno_save;
 	return NULL;
@@ -511,7 +830,8 @@ static void _dbus_err(nvme_root_t root, int rc, int line)
 
 #define dbus_err(r, rc) _dbus_err(r, rc, __LINE__)
 
-static int nvme_mi_mctp_add(nvme_root_t root, unsigned int netid, __u8 eid)
+static nvme_mi_ep_t nvme_mi_mctp_add(nvme_root_t root, unsigned int netid,
+				     __u8 eid)
 {
 	nvme_mi_ep_t ep = NULL;
 
@@ -523,14 +843,10 @@ static int nvme_mi_mctp_add(nvme_root_t root, unsigned int netid, __u8 eid)
 		}
 		const struct nvme_mi_transport_mctp *t = ep->transport_data;
 		if (t->eid == eid && t->net == netid)
-			return 0;
+			return ep;
 	}
 
-	ep = nvme_mi_open_mctp(root, netid, eid);
-	if (!ep)
-		return -1;
-
-	return 0;
+	return nvme_mi_open_mctp(root, netid, eid);
 }
 
 /* We can't rely on sd_bus_message_enter_container() == 0 at the end of
@@ -541,7 +857,7 @@ static bool container_end(sd_bus_message *m)
 }
 
 static int handle_mctp_endpoint(nvme_root_t root, const char* objpath,
-	sd_bus_message *m)
+	sd_bus_message *m, nvme_mi_ep_t *epp)
 {
 	bool have_eid = false, have_net = false, have_nvmemi = false;
 	mctp_eid_t eid;
@@ -620,7 +936,8 @@ static int handle_mctp_endpoint(nvme_root_t root, const char* objpath,
 			errno = ENOENT;
 			return -1;
 		}
-		rc = nvme_mi_mctp_add(root, net, eid);
+		*epp = nvme_mi_mctp_add(root, net, eid);
+		rc = *epp ? 0 : -1;
 		if (rc < 0) {
 			int errno_save = errno;
 			nvme_msg(root, LOG_ERR,
@@ -634,12 +951,16 @@ static int handle_mctp_endpoint(nvme_root_t root, const char* objpath,
 	return rc;
 }
 
-static int handle_mctp_obj(nvme_root_t root, sd_bus_message *m)
+/* parses an object path and its interfaces; @epp is set to the NVMe-MI
+ * endpoint found there, if any */
+static int handle_mctp_obj(nvme_root_t root, sd_bus_message *m,
+			   const char **objpathp, nvme_mi_ep_t *epp)
 {
 	char *objpath = NULL;
 	char *ifname = NULL;
 	int rc;
 
+	*epp = NULL;
 	rc = sd_bus_message_read(m, "o", &objpath);
 	if (rc < 0) {
 		dbus_err(root, rc);
@@ -648,6 +969,9 @@ static int handle_mctp_obj(nvme_root_t root, sd_bus_message *m)
 
 	/* Enter response object: our array of (string, property dict)
 	 * values */
+	if (objpathp)
+		*objpathp = objpath;
+
 	rc = sd_bus_message_enter_container(m, 'a', "{sa{sv}}");
 	if (rc < 0) {
 		dbus_err(root, rc);
@@ -672,7 +996,7 @@ static int handle_mctp_obj(nvme_root_t root, sd_bus_message *m)
 
 		if (!strcmp(ifname, MCTP_DBUS_IFACE_ENDPOINT)) {
 
-			rc = handle_mctp_endpoint(root, objpath, m);
+			rc = handle_mctp_endpoint(root, objpath, m, epp);
 			if (rc < 0) {
 				/* continue to next object */
 			}
@@ -703,6 +1027,94 @@ static int handle_mctp_obj(nvme_root_t root, sd_bus_message *m)
 	return 0;
 }
 
+struct nvme_mi_mctp_monitor_ep {
+	struct list_node entry;
+	char *objpath;
+	nvme_mi_ep_t ep;
+};
+
+struct nvme_mi_mctp_monitor {
+	nvme_root_t root;
+	sd_bus *bus;
+	sd_bus_slot *added_slot;
+	sd_bus_slot *removed_slot;
+	sd_bus_slot *scan_slot;
+	nvme_mi_mctp_monitor_cb_t cb;
+	void *user_data;
+	struct list_head eps;
+	int nr_events;
+};
+
+static void nvme_mi_mctp_monitor_added(struct nvme_mi_mctp_monitor *mon,
+				       const char *objpath, nvme_mi_ep_t ep)
+{
+	struct nvme_mi_mctp_monitor_ep *mep;
+
+	/* the initial scan and a signal may both report an endpoint */
+	list_for_each(&mon->eps, mep, entry) {
+		if (mep->ep == ep)
+			return;
+	}
+
+	mep = calloc(1, sizeof(*mep));
+	if (!mep)
+		return;
+	mep->objpath = strdup(objpath);
+	if (!mep->objpath) {
+		free(mep);
+		return;
+	}
+	mep->ep = ep;
+	list_add_tail(&mon->eps, &mep->entry);
+
+	mon->nr_events++;
+	mon->cb(mon, NVME_MI_MCTP_MONITOR_ADDED, ep, mon->user_data);
+}
+
+/* parses a GetManagedObjects reply, reporting endpoints to @mon if set */
+static int handle_mctp_objs(nvme_root_t root, sd_bus_message *resp,
+			    struct nvme_mi_mctp_monitor *mon)
+{
+	const char *objpath;
+	nvme_mi_ep_t ep;
+	int rc;
+
+	rc = sd_bus_message_enter_container(resp, 'a', "{oa{sa{sv}}}");
+	if (rc != 1) {
+		dbus_err(root, rc);
+		if (rc == 0)
+			errno = EPROTO;
+		return -1;
+	}
+
+	/* Iterate over all managed objects */
+	while (!container_end(resp)) {
+		rc = sd_bus_message_enter_container(resp, 'e', "oa{sa{sv}}");
+		if (rc < 0) {
+			dbus_err(root, rc);
+			return -1;
+		}
+
+		handle_mctp_obj(root, resp, &objpath, &ep);
+		if (mon && ep)
+			nvme_mi_mctp_monitor_added(mon, objpath, ep);
+
+		rc = sd_bus_message_exit_container(resp);
+		if (rc < 0) {
+			dbus_err(root, rc);
+			return -1;
+		}
+	}
+
+	rc = sd_bus_message_exit_container(resp);
+	if (rc < 0) {
+		dbus_err(root, rc);
+		return -1;
+	}
+
+	return 0;
+}
+
 nvme_root_t nvme_mi_scan_mctp(void)
 {
 	sd_bus *bus = NULL;
@@ -743,40 +1155,9 @@ nvme_root_t nvme_mi_scan_mctp(void)
 		goto out;
 	}
 
-	rc = sd_bus_message_enter_container(resp, 'a', "{oa{sa{sv}}}");
-	if (rc != 1) {
-		dbus_err(root, rc);
-		if (rc == 0)
-			errno = EPROTO;
-		rc = -1;
+	rc = handle_mctp_objs(root, resp, NULL);
+	if (rc < 0)
 		goto out;
-	}
-
-	/* Iterate over all managed objects */
-	while (!container_end(resp)) {
-		rc = sd_bus_message_enter_container(resp, 'e', "oa{sa{sv}}");
-		if (rc < 0) {
-			dbus_err(root, rc);
-			rc = -1;
-			goto out;
-		}
-
-		handle_mctp_obj(root, resp);
-
-		rc = sd_bus_message_exit_container(resp);
-		if (rc < 0) {
-			dbus_err(root, rc);
-			rc = -1;
-			goto out;
-		}
-	}
-
-	rc = sd_bus_message_exit_container(resp);
-	if (rc < 0) {
-		dbus_err(root, rc);
-		rc = -1;
-		goto out;
-	}
 	rc = 0;
 
 out:
@@ -795,6 +1176,211 @@ out:
 	return root;
 }
 
+static int nvme_mi_mctp_monitor_scan_reply(sd_bus_message *m, void *data,
+					   sd_bus_error *berr)
+{
+	struct nvme_mi_mctp_monitor *mon = data;
+	const sd_bus_error *err;
+
+	mon->scan_slot = sd_bus_slot_unref(mon->scan_slot);
+
+	err = sd_bus_message_get_error(m);
+	if (err) {
+		nvme_msg(mon->root, LOG_ERR,
+			 "Failed querying MCTP D-Bus: %s (%s)\n",
+			 err->message, err->name);
+		return 0;
+	}
+
+	handle_mctp_objs(mon->root, m, mon);
+	return 0;
+}
+
+static int nvme_mi_mctp_monitor_ifaces_added(sd_bus_message *m, void *data,
+					     sd_bus_error *berr)
+{
+	struct nvme_mi_mctp_monitor *mon = data;
+	const char *objpath;
+	nvme_mi_ep_t ep;
+
+	/* same layout as an entry of the GetManagedObjects reply */
+	if (!handle_mctp_obj(mon->root, m, &objpath, &ep) && ep)
+		nvme_mi_mctp_monitor_added(mon, objpath, ep);
+	return 0;
+}
+
+static int nvme_mi_mctp_monitor_ifaces_removed(sd_bus_message *m, void *data,
+					       sd_bus_error *berr)
+{
+	struct nvme_mi_mctp_monitor *mon = data;
+	struct nvme_mi_mctp_monitor_ep *mep;
+	const char *objpath, *ifname;
+	bool endpoint = false;
+	int rc;
+
+	rc = sd_bus_message_read(m, "o", &objpath);
+	if (rc < 0) {
+		dbus_err(mon->root, rc);
+		return 0;
+	}
+
+	rc = sd_bus_message_enter_container(m, 'a', "s");
+	if (rc < 0) {
+		dbus_err(mon->root, rc);
+		return 0;
+	}
+	while ((rc = sd_bus_message_read(m, "s", &ifname)) > 0) {
+		if (!strcmp(ifname, MCTP_DBUS_IFACE_ENDPOINT))
+			endpoint = true;
+	}
+	if (rc < 0) {
+		dbus_err(mon->root, rc);
+		return 0;
+	}
+	if (!endpoint)
+		return 0;
+
+	list_for_each(&mon->eps, mep, entry) {
+		if (strcmp(mep->objpath, objpath))
+			continue;
+
+		list_del(&mep->entry);
+		mon->nr_events++;
+		mon->cb(mon, NVME_MI_MCTP_MONITOR_REMOVED, mep->ep,
+			mon->user_data);
+		nvme_mi_close(mep->ep);
+		free(mep->objpath);
+		free(mep);
+		break;
+	}
+	return 0;
+}
+
+nvme_mi_mctp_monitor_t nvme_mi_mctp_monitor_create(nvme_root_t root,
+		nvme_mi_mctp_monitor_cb_t cb, void *user_data)
+{
+	struct nvme_mi_mctp_monitor *mon;
+	int rc;
+
+	if (!cb) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	mon = calloc(1, sizeof(*mon));
+	if (!mon) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	mon->root = root;
+	mon->cb = cb;
+	mon->user_data = user_data;
+	list_head_init(&mon->eps);
+
+	/* a private connection, as we process it from the caller's loop */
+	rc = sd_bus_open_system(&mon->bus);
+	if (rc < 0) {
+		nvme_msg(root, LOG_ERR, "Failed opening D-Bus: %s\n",
+			 strerror(-rc));
+		goto err;
+	}
+
+	/* subscribe before scanning, so no hotplug event is missed */
+	rc = sd_bus_match_signal_async(mon->bus, &mon->added_slot,
+				       MCTP_DBUS_IFACE, MCTP_DBUS_PATH,
+				       "org.freedesktop.DBus.ObjectManager",
+				       "InterfacesAdded",
+				       nvme_mi_mctp_monitor_ifaces_added,
+				       NULL, mon);
+	if (rc < 0)
+		goto err_dbus;
+
+	rc = sd_bus_match_signal_async(mon->bus, &mon->removed_slot,
+				       MCTP_DBUS_IFACE, MCTP_DBUS_PATH,
+				       "org.freedesktop.DBus.ObjectManager",
+				       "InterfacesRemoved",
+				       nvme_mi_mctp_monitor_ifaces_removed,
+				       NULL, mon);
+	if (rc < 0)
+		goto err_dbus;
+
+	rc = sd_bus_call_method_async(mon->bus, &mon->scan_slot,
+				      MCTP_DBUS_IFACE, MCTP_DBUS_PATH,
+				      "org.freedesktop.DBus.ObjectManager",
+				      "GetManagedObjects",
+				      nvme_mi_mctp_monitor_scan_reply, mon,
+				      "");
+	if (rc < 0)
+		goto err_dbus;
+
+	return mon;
+
+err_dbus:
+	dbus_err(root, rc);
+err:
+	nvme_mi_mctp_monitor_free(mon);
+	errno = -rc;
+	return NULL;
+}
+
+void nvme_mi_mctp_monitor_free(nvme_mi_mctp_monitor_t mon)
+{
+	struct nvme_mi_mctp_monitor_ep *mep, *tmp;
+
+	if (!mon)
+		return;
+
+	/* the endpoints stay with the root */
+	list_for_each_safe(&mon->eps, mep, tmp, entry) {
+		list_del(&mep->entry);
+		free(mep->objpath);
+		free(mep);
+	}
+	sd_bus_slot_unref(mon->scan_slot);
+	sd_bus_slot_unref(mon->added_slot);
+	sd_bus_slot_unref(mon->removed_slot);
+	sd_bus_flush_close_unref(mon->bus);
+	free(mon);
+}
+
+int nvme_mi_mctp_monitor_get_fd(nvme_mi_mctp_monitor_t mon)
+{
+	return sd_bus_get_fd(mon->bus);
+}
+
+int nvme_mi_mctp_monitor_process(nvme_mi_mctp_monitor_t mon, int timeout)
+{
+	int rc;
+
+	mon->nr_events = 0;
+
+	/* work queued by earlier calls goes first */
+	do {
+		rc = sd_bus_process(mon->bus, NULL);
+	} while (rc > 0);
+	if (rc < 0)
+		goto err;
+
+	if (timeout && !mon->nr_events) {
+		rc = sd_bus_wait(mon->bus, timeout < 0 ? UINT64_MAX :
+				 (uint64_t)timeout * 1000);
+		if (rc < 0 && rc != -EINTR)
+			goto err;
+
+		do {
+			rc = sd_bus_process(mon->bus, NULL);
+		} while (rc > 0);
+		if (rc < 0)
+			goto err;
+	}
+
+	return mon->nr_events;
+
+err:
+	dbus_err(mon->root, rc);
+	return -1;
+}
+
 #else /* CONFIG_LIBSYSTEMD */
 
 nvme_root_t nvme_mi_scan_mctp(void)
@@ -802,4 +1388,27 @@ nvme_root_t nvme_mi_scan_mctp(void)
 	return NULL;
 }
 
+nvme_mi_mctp_monitor_t nvme_mi_mctp_monitor_create(nvme_root_t root,
+		nvme_mi_mctp_monitor_cb_t cb, void *user_data)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void nvme_mi_mctp_monitor_free(nvme_mi_mctp_monitor_t mon)
+{
+}
+
+int nvme_mi_mctp_monitor_get_fd(nvme_mi_mctp_monitor_t mon)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_mi_mctp_monitor_process(nvme_mi_mctp_monitor_t mon, int timeout)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
 #endif /* CONFIG_LIBSYSTEMD */
@@ -7,10 +7,23 @@
  */
 
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include <sys/epoll.h>
+
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <ccan/array_size/array_size.h>
 #include <ccan/endian/endian.h>
 
 #include "log.h"
@@ -20,6 +33,9 @@
 static const int default_timeout = 1000; /* milliseconds; endpoints may
 					    override */
 
+/* the MI specification limits the data of a single request to 4k */
+static const size_t default_xfer_size = 4096;
+
 /* MI-equivalent of nvme_create_root, but avoids clashing symbol names
  * when linking against both libnvme and libnvme-mi.
  */
@@ -62,6 +78,8 @@ struct nvme_mi_ep *nvme_mi_init_ep(nvme_root_t root)
 	ep->controllers_scanned = false;
 	ep->timeout = default_timeout;
 	ep->mprt_max = 0;
+	ep->xfer_size = default_xfer_size;
+	ep->max_inflight = 1;
 	list_head_init(&ep->controllers);
 
 	list_add(&root->endpoints, &ep->root_entry);
@@ -92,6 +110,229 @@ unsigned int nvme_mi_ep_get_timeout(nvme_mi_ep_t ep)
 	return ep->timeout;
 }
 
+int nvme_mi_ep_set_xfer_size(nvme_mi_ep_t ep, size_t size)
+{
+	if (size < 4 || size & 0x3 || size > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ep->xfer_size = size;
+	return 0;
+}
+
+size_t nvme_mi_ep_get_xfer_size(nvme_mi_ep_t ep)
+{
+	return ep->xfer_size;
+}
+
+int nvme_mi_ep_set_max_inflight(nvme_mi_ep_t ep, unsigned int nr)
+{
+	if (!nr || nr > NVME_MI_NR_SLOTS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ep->max_inflight = nr;
+	return 0;
+}
+
+/* adaptive timeouts need some history, and never go below this */
+#define NVME_MI_ADAPTIVE_MIN_SAMPLES	8
+#define NVME_MI_ADAPTIVE_MIN_TIMEOUT	100
+
+static void nvme_mi_req_cmd(struct nvme_mi_req *req, __u8 *type, __u8 *opcode)
+{
+	*type = (req->hdr->nmp >> 3) & 0xf;
+	*opcode = req->hdr_len > 4 ? ((__u8 *)req->hdr)[4] : 0;
+}
+
+static struct nvme_mi_lat *nvme_mi_lat_find(nvme_mi_ep_t ep, __u8 type,
+					    __u8 opcode, bool create)
+{
+	struct nvme_mi_lat *lat;
+	unsigned int i;
+
+	for (i = 0; i < ep->nr_lat; i++) {
+		if (ep->lat[i].type == type && ep->lat[i].opcode == opcode)
+			return &ep->lat[i];
+	}
+
+	if (!create)
+		return NULL;
+
+	lat = realloc(ep->lat, (ep->nr_lat + 1) * sizeof(*lat));
+	if (!lat)
+		return NULL;
+	ep->lat = lat;
+
+	lat = &ep->lat[ep->nr_lat++];
+	memset(lat, 0, sizeof(*lat));
+	lat->type = type;
+	lat->opcode = opcode;
+	lat->min_us = UINT32_MAX;
+	return lat;
+}
+
+static void nvme_mi_lat_record(nvme_mi_ep_t ep, struct nvme_mi_req *req,
+			       const struct timespec *start, bool timeout)
+{
+	struct nvme_mi_lat *lat;
+	struct timespec now;
+	__u8 type, opcode;
+	__u64 us;
+	int b;
+
+	nvme_mi_req_cmd(req, &type, &opcode);
+	lat = nvme_mi_lat_find(ep, type, opcode, true);
+	if (!lat)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+	if (us > UINT32_MAX)
+		us = UINT32_MAX;
+
+	/*
+	 * Timeouts count as samples of the time waited, so that a command
+	 * which got slower pushes its own timeout up again.
+	 */
+	b = us > 1 ? 31 - __builtin_clz(us) : 0;
+	if (b >= NVME_MI_LAT_BUCKETS)
+		b = NVME_MI_LAT_BUCKETS - 1;
+	lat->hist[b]++;
+	lat->count++;
+	lat->sum_us += us;
+	if (us < lat->min_us)
+		lat->min_us = us;
+	if (us > lat->max_us)
+		lat->max_us = us;
+	if (timeout)
+		lat->timeouts++;
+}
+
+/* upper bound of the bucket holding the @pct percentile sample */
+static __u32 nvme_mi_lat_percentile(struct nvme_mi_lat *lat, unsigned int pct)
+{
+	__u64 target, sum = 0, bound;
+	int b;
+
+	target = ((__u64)lat->count * pct + 99) / 100;
+	if (!target)
+		target = 1;
+
+	for (b = 0; b < NVME_MI_LAT_BUCKETS; b++) {
+		sum += lat->hist[b];
+		if (sum >= target)
+			break;
+	}
+
+	bound = (2ULL << b) - 1;
+	return bound < lat->max_us ? bound : lat->max_us;
+}
+
+unsigned int nvme_mi_ep_req_timeout(nvme_mi_ep_t ep, struct nvme_mi_req *req)
+{
+	struct nvme_mi_lat *lat;
+	__u8 type, opcode;
+	__u64 timeout;
+
+	if (!ep->adaptive_pct)
+		return ep->timeout;
+
+	nvme_mi_req_cmd(req, &type, &opcode);
+	lat = nvme_mi_lat_find(ep, type, opcode, false);
+	if (!lat || lat->count < NVME_MI_ADAPTIVE_MIN_SAMPLES)
+		return ep->timeout;
+
+	timeout = ((__u64)nvme_mi_lat_percentile(lat, ep->adaptive_pct) *
+		   ep->adaptive_factor + 999) / 1000;
+	if (timeout < NVME_MI_ADAPTIVE_MIN_TIMEOUT)
+		timeout = NVME_MI_ADAPTIVE_MIN_TIMEOUT;
+	if (ep->timeout && timeout > ep->timeout)
+		timeout = ep->timeout;
+
+	return timeout;
+}
+
+int nvme_mi_ep_set_adaptive_timeout(nvme_mi_ep_t ep, unsigned int percentile,
+				    unsigned int factor)
+{
+	if (percentile > 100 || (percentile && !factor)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ep->adaptive_pct = percentile;
+	ep->adaptive_factor = factor;
+	return 0;
+}
+
+int nvme_mi_ep_get_latency_stats(nvme_mi_ep_t ep,
+				 enum nvme_mi_message_type type, __u8 opcode,
+				 struct nvme_mi_latency_stats *stats)
+{
+	struct nvme_mi_lat *lat;
+
+	lat = nvme_mi_lat_find(ep, type, opcode, false);
+	if (!lat) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	stats->count = lat->count;
+	stats->timeouts = lat->timeouts;
+	stats->min_us = lat->min_us;
+	stats->max_us = lat->max_us;
+	stats->mean_us = lat->sum_us / lat->count;
+	stats->p50_us = nvme_mi_lat_percentile(lat, 50);
+	stats->p90_us = nvme_mi_lat_percentile(lat, 90);
+	stats->p99_us = nvme_mi_lat_percentile(lat, 99);
+	return 0;
+}
+
+void nvme_mi_ep_reset_latency_stats(nvme_mi_ep_t ep)
+{
+	free(ep->lat);
+	ep->lat = NULL;
+	ep->nr_lat = 0;
+}
+
+void nvme_mi_ep_set_cmd_hook(nvme_mi_ep_t ep, nvme_mi_cmd_hook_t hook,
+			     void *user_data)
+{
+	ep->cmd_hook = hook;
+	ep->cmd_hook_data = user_data;
+}
+
+static void nvme_mi_trace(nvme_mi_ep_t ep, struct nvme_mi_req *req,
+			  struct nvme_mi_resp *resp,
+			  const struct timespec *start, int err)
+{
+	struct nvme_mi_cmd_trace t = { 0 };
+	struct timespec now;
+	__u64 us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+
+	nvme_mi_req_cmd(req, &t.type, &t.opcode);
+	t.req_data_len = req->data_len;
+	if (err) {
+		t.status = -err;
+	} else {
+		/* MI and Admin responses both carry the status after the header */
+		t.status = resp->hdr_len > 4 ? ((__u8 *)resp->hdr)[4] : 0;
+		t.resp_data_len = resp->data_len;
+	}
+	t.duration_us = us > UINT32_MAX ? UINT32_MAX : us;
+
+	ep->cmd_hook(ep, &t, ep->cmd_hook_data);
+}
+
 struct nvme_mi_ctrl *nvme_mi_init_ctrl(nvme_mi_ep_t ep, __u16 ctrl_id)
 {
 	struct nvme_mi_ctrl *ctrl;
@@ -108,17 +349,32 @@ struct nvme_mi_ctrl *nvme_mi_init_ctrl(nvme_mi_ep_t ep, __u16 ctrl_id)
 	return ctrl;
 }
 
+static bool nvme_mi_ctrl_list_has(struct nvme_ctrl_list *list,
+				  unsigned int n_ctrl, __u16 id)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_ctrl; i++) {
+		if (le16_to_cpu(list->identifier[i]) == id)
+			return true;
+	}
+	return false;
+}
+
 int nvme_mi_scan_ep(nvme_mi_ep_t ep, bool force_rescan)
 {
+	struct nvme_mi_ctrl *ctrl, *tmp;
 	struct nvme_ctrl_list list;
 	unsigned int i, n_ctrl;
+	bool stale = false;
 	int rc;
 
 	if (ep->controllers_scanned) {
 		if (force_rescan) {
-			struct nvme_mi_ctrl *ctrl, *tmp;
 			nvme_mi_for_each_ctrl_safe(ep, ctrl, tmp)
 				nvme_mi_close_ctrl(ctrl);
+		} else if (ep->ctrl_list_stale) {
+			stale = true;
 		} else {
 			return 0;
 		}
@@ -134,41 +390,263 @@ int nvme_mi_scan_ep(nvme_mi_ep_t ep, bool force_rescan)
 		return -1;
 	}
 
+	/* after a change, keep the controllers which are still there */
+	if (stale) {
+		nvme_mi_for_each_ctrl_safe(ep, ctrl, tmp) {
+			if (!nvme_mi_ctrl_list_has(&list, n_ctrl, ctrl->id))
+				nvme_mi_close_ctrl(ctrl);
+		}
+	}
+
 	for (i = 0; i < n_ctrl; i++) {
-		struct nvme_mi_ctrl *ctrl;
 		__u16 id;
 
-		id = le32_to_cpu(list.identifier[i]);
+		id = le16_to_cpu(list.identifier[i]);
 		if (!id)
 			continue;
 
+		if (stale) {
+			bool found = false;
+
+			nvme_mi_for_each_ctrl(ep, ctrl) {
+				if (ctrl->id == id) {
+					found = true;
+					break;
+				}
+			}
+			if (found)
+				continue;
+		}
+
 		ctrl = nvme_mi_init_ctrl(ep, id);
 		if (!ctrl)
 			break;
 	}
 
 	ep->controllers_scanned = true;
+	ep->ctrl_list_stale = false;
 	return 0;
 }
 
+void nvme_mi_ep_set_data_cache(nvme_mi_ep_t ep, bool enable)
+{
+	ep->cache_enabled = enable;
+	nvme_mi_ep_invalidate_data_cache(ep);
+}
+
+void nvme_mi_ep_invalidate_data_cache(nvme_mi_ep_t ep)
+{
+	ep->subsys_cached = false;
+	free(ep->ports);
+	ep->ports = NULL;
+	ep->nr_ports = 0;
+	if (ep->cache_enabled)
+		ep->ctrl_list_stale = true;
+}
+
+/* subsystem resets and controller changes may alter any MI data */
+#define NVME_MI_CACHE_INVAL_CCS \
+	(NVME_MI_CCS_NSSRO | NVME_MI_CCS_CECO | NVME_MI_CCS_FA)
+
+static void nvme_mi_ep_check_ccs(nvme_mi_ep_t ep,
+				 struct nvme_mi_nvm_ss_health_status *sshs)
+{
+	if (ep->cache_enabled &&
+	    le16_to_cpu(sshs->ccs) & NVME_MI_CACHE_INVAL_CCS)
+		nvme_mi_ep_invalidate_data_cache(ep);
+}
+
+static struct nvme_mi_port_cache *nvme_mi_ep_find_port(nvme_mi_ep_t ep,
+						       __u8 portid)
+{
+	unsigned int i;
+
+	for (i = 0; i < ep->nr_ports; i++) {
+		if (ep->ports[i].portid == portid)
+			return &ep->ports[i];
+	}
+	return NULL;
+}
+
+/* CRC-32C (Castagnoli), reflected */
+#define NVME_MI_CRC32C_POLY	0x82F63B78
+
+/* slicing-by-8 tables, entry [k][b] is the CRC of b followed by k zeroes */
+static __u32 nvme_mi_crc32_table[8][256];
+
+static __u32 nvme_mi_crc32_sw(__u32 crc, const __u8 *p, size_t len)
+{
+	__u32 lo, hi;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = (crc >> 8) ^ nvme_mi_crc32_table[0][(crc ^ *p++) & 0xff];
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&lo, p, sizeof(lo));
+		memcpy(&hi, p + 4, sizeof(hi));
+		lo = le32_to_cpu(lo) ^ crc;
+		hi = le32_to_cpu(hi);
+		crc = nvme_mi_crc32_table[7][lo & 0xff] ^
+			nvme_mi_crc32_table[6][(lo >> 8) & 0xff] ^
+			nvme_mi_crc32_table[5][(lo >> 16) & 0xff] ^
+			nvme_mi_crc32_table[4][lo >> 24] ^
+			nvme_mi_crc32_table[3][hi & 0xff] ^
+			nvme_mi_crc32_table[2][(hi >> 8) & 0xff] ^
+			nvme_mi_crc32_table[1][(hi >> 16) & 0xff] ^
+			nvme_mi_crc32_table[0][hi >> 24];
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ nvme_mi_crc32_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <nmmintrin.h>
+
+__attribute__((target("sse4.2")))
+static __u32 nvme_mi_crc32_hw(__u32 crc, const __u8 *p, size_t len)
+{
+	__u64 crc64, v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	for (crc64 = crc; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc64 = _mm_crc32_u64(crc64, v);
+	}
+
+	for (crc = crc64; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+static bool nvme_mi_crc32_hw_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(HWCAP_CRC32)
+#include <arm_acle.h>
+
+__attribute__((target("+crc")))
+static __u32 nvme_mi_crc32_hw(__u32 crc, const __u8 *p, size_t len)
+{
+	__u64 v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = __crc32cb(crc, *p++);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+
+static bool nvme_mi_crc32_hw_supported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#else
+#define nvme_mi_crc32_hw nvme_mi_crc32_sw
+
+static bool nvme_mi_crc32_hw_supported(void)
+{
+	return false;
+}
+#endif
+
+static __u32 (*nvme_mi_crc32_fn)(__u32 crc, const __u8 *p, size_t len) =
+	nvme_mi_crc32_sw;
+
+/* runs at load time, so MIC calculation needs no locking */
+__attribute__((constructor))
+static void nvme_mi_crc32_init(void)
+{
+	__u32 crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ ((crc & 1) ? NVME_MI_CRC32C_POLY : 0);
+		nvme_mi_crc32_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++) {
+		crc = nvme_mi_crc32_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = (crc >> 8) ^ nvme_mi_crc32_table[0][crc & 0xff];
+			nvme_mi_crc32_table[j][i] = crc;
+		}
+	}
+
+	if (nvme_mi_crc32_hw_supported())
+		nvme_mi_crc32_fn = nvme_mi_crc32_hw;
+}
+
 __u32 nvme_mi_crc32_update(__u32 crc, void *data, size_t len)
 {
+	return nvme_mi_crc32_fn(crc, data, len);
+}
+
+/* CRC of the first @len bytes of message data */
+static __u32 nvme_mi_crc32_data(__u32 crc, void *data,
+				const struct iovec *iov, int iovcnt,
+				size_t len)
+{
+	size_t n;
 	int i;
 
-	while (len--) {
-		crc ^= *(unsigned char *)(data++);
-		for (i = 0; i < 8; i++)
-			crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+	if (!iov)
+		return nvme_mi_crc32_update(crc, data, len);
+
+	for (i = 0; i < iovcnt && len; i++) {
+		n = iov[i].iov_len < len ? iov[i].iov_len : len;
+		crc = nvme_mi_crc32_update(crc, iov[i].iov_base, n);
+		len -= n;
 	}
 	return crc;
 }
 
+void nvme_mi_data_read(void *data, const struct iovec *iov, int iovcnt,
+		       size_t off, void *buf, size_t len)
+{
+	__u8 *p = buf;
+	size_t n;
+	int i;
+
+	if (!iov) {
+		memcpy(buf, (__u8 *)data + off, len);
+		return;
+	}
+
+	for (i = 0; i < iovcnt && len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+		n = iov[i].iov_len - off;
+		if (n > len)
+			n = len;
+		memcpy(p, (__u8 *)iov[i].iov_base + off, n);
+		p += n;
+		len -= n;
+		off = 0;
+	}
+}
+
 static void nvme_mi_calc_req_mic(struct nvme_mi_req *req)
 {
 	__u32 crc = 0xffffffff;
 
 	crc = nvme_mi_crc32_update(crc, req->hdr, req->hdr_len);
-	crc = nvme_mi_crc32_update(crc, req->data, req->data_len);
+	crc = nvme_mi_crc32_data(crc, req->data, req->data_iov,
+				 req->data_iovcnt, req->data_len);
 
 	req->mic = ~crc;
 }
@@ -179,16 +657,41 @@ static int nvme_mi_verify_resp_mic(struct nvme_mi_resp *resp)
 	__u32 crc = 0xffffffff;
 
 	crc = nvme_mi_crc32_update(crc, resp->hdr, resp->hdr_len);
-	crc = nvme_mi_crc32_update(crc, resp->data, resp->data_len);
+	crc = nvme_mi_crc32_data(crc, resp->data, resp->data_iov,
+				 resp->data_iovcnt, resp->data_len);
 
 	return resp->mic != ~crc;
 }
 
-int nvme_mi_submit(nvme_mi_ep_t ep, struct nvme_mi_req *req,
-		   struct nvme_mi_resp *resp)
+/* vectors must be within limits and add up to the data length */
+static int nvme_mi_check_iov(const struct iovec *iov, int iovcnt,
+			     size_t len)
 {
-	int rc;
+	size_t total = 0;
+	int i;
 
+	if (!iov)
+		return 0;
+
+	if (iovcnt < 0 || iovcnt > NVME_MI_MAX_DATA_IOV) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	if (total != len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int nvme_mi_check_req(struct nvme_mi_req *req,
+			     struct nvme_mi_resp *resp)
+{
 	if (req->hdr_len < sizeof(struct nvme_mi_msg_hdr)) {
 		errno = EINVAL;
 		return -1;
@@ -204,6 +707,9 @@ int nvme_mi_submit(nvme_mi_ep_t ep, struct nvme_mi_req *req,
 		return -1;
 	}
 
+	if (nvme_mi_check_iov(req->data_iov, req->data_iovcnt, req->data_len))
+		return -1;
+
 	if (resp->hdr_len < sizeof(struct nvme_mi_msg_hdr)) {
 		errno = EINVAL;
 		return -1;
@@ -219,14 +725,17 @@ int nvme_mi_submit(nvme_mi_ep_t ep, struct nvme_mi_req *req,
 		return -1;
 	}
 
-	if (ep->transport->mic_enabled)
-		nvme_mi_calc_req_mic(req);
+	if (nvme_mi_check_iov(resp->data_iov, resp->data_iovcnt,
+			      resp->data_len))
+		return -1;
 
-	rc = ep->transport->submit(ep, req, resp);
-	if (rc) {
-		nvme_msg(ep->root, LOG_INFO, "transport failure\n");
-		return rc;
-	}
+	return 0;
+}
+
+static int nvme_mi_check_resp(nvme_mi_ep_t ep, struct nvme_mi_req *req,
+			      struct nvme_mi_resp *resp)
+{
+	int rc;
 
 	if (ep->transport->mic_enabled) {
 		rc = nvme_mi_verify_resp_mic(resp);
@@ -270,6 +779,120 @@ int nvme_mi_submit(nvme_mi_ep_t ep, struct nvme_mi_req *req,
 	return 0;
 }
 
+int nvme_mi_submit(nvme_mi_ep_t ep, struct nvme_mi_req *req,
+		   struct nvme_mi_resp *resp)
+{
+	struct timespec start;
+	int rc, errno_save;
+
+	rc = nvme_mi_check_req(req, resp);
+	if (rc)
+		return rc;
+
+	if (ep->transport->mic_enabled)
+		nvme_mi_calc_req_mic(req);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = ep->transport->submit(ep, req, resp);
+	if (rc) {
+		errno_save = errno;
+		nvme_msg(ep->root, LOG_INFO, "transport failure\n");
+		if (errno_save == ETIMEDOUT)
+			nvme_mi_lat_record(ep, req, &start, true);
+		if (ep->cmd_hook)
+			nvme_mi_trace(ep, req, resp, &start, errno_save);
+		errno = errno_save;
+		return rc;
+	}
+	nvme_mi_lat_record(ep, req, &start, false);
+
+	rc = nvme_mi_check_resp(ep, req, resp);
+	if (ep->cmd_hook) {
+		errno_save = errno;
+		nvme_mi_trace(ep, req, resp, &start, rc ? errno_save : 0);
+		errno = errno_save;
+	}
+	return rc;
+}
+
+int nvme_mi_submit_start(nvme_mi_ep_t ep, struct nvme_mi_xfer *xfer)
+{
+	int rc;
+
+	if (!ep->transport->send || !ep->transport->recv) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	rc = nvme_mi_check_req(xfer->req, xfer->resp);
+	if (rc)
+		return rc;
+
+	if (ep->transport->mic_enabled)
+		nvme_mi_calc_req_mic(xfer->req);
+
+	xfer->done = false;
+	xfer->rc = 0;
+	xfer->err = 0;
+	clock_gettime(CLOCK_MONOTONIC, &xfer->start);
+	rc = ep->transport->send(ep, xfer);
+	if (rc)
+		nvme_msg(ep->root, LOG_INFO, "transport failure\n");
+	return rc;
+}
+
+int nvme_mi_submit_wait(nvme_mi_ep_t ep, struct nvme_mi_xfer **xfers, int nr,
+			bool nowait)
+{
+	bool pending[NVME_MI_NR_SLOTS];
+	struct nvme_mi_xfer *x;
+	int i, rc;
+
+	if (nr > (int)ARRAY_SIZE(pending)) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < nr; i++)
+		pending[i] = !xfers[i]->done;
+
+	rc = ep->transport->recv(ep, xfers, nr, nowait);
+	if (rc) {
+		nvme_msg(ep->root, LOG_INFO, "transport failure\n");
+		return rc;
+	}
+
+	/* validate what has just completed */
+	for (i = 0; i < nr; i++) {
+		x = xfers[i];
+		if (!pending[i] || !x->done)
+			continue;
+		if (!x->rc || x->err == ETIMEDOUT)
+			nvme_mi_lat_record(ep, x->req, &x->start, !!x->rc);
+		if (!x->rc) {
+			x->rc = nvme_mi_check_resp(ep, x->req, x->resp);
+			if (x->rc)
+				x->err = errno;
+		}
+		if (ep->cmd_hook)
+			nvme_mi_trace(ep, x->req, x->resp, &x->start,
+				      x->rc ? x->err : 0);
+	}
+	return 0;
+}
+
+int nvme_mi_xfer_time_left(struct nvme_mi_xfer *xfer,
+			   const struct timespec *now)
+{
+	long long ms;
+
+	if (!xfer->deadline.tv_sec && !xfer->deadline.tv_nsec)
+		return -1;
+
+	ms = (xfer->deadline.tv_sec - now->tv_sec) * 1000LL +
+		(xfer->deadline.tv_nsec - now->tv_nsec) / 1000000;
+	return ms < 0 ? 0 : ms;
+}
+
 static void nvme_mi_admin_init_req(struct nvme_mi_req *req,
 				   struct nvme_mi_admin_req_hdr *hdr,
 				   __u16 ctrl_id, __u8 opcode)
@@ -295,16 +918,30 @@ static void nvme_mi_admin_init_resp(struct nvme_mi_resp *resp,
 	resp->hdr_len = sizeof(*hdr);
 }
 
-int nvme_mi_admin_xfer(nvme_mi_ctrl_t ctrl,
-		       struct nvme_mi_admin_req_hdr *admin_req,
-		       size_t req_data_size,
-		       struct nvme_mi_admin_resp_hdr *admin_resp,
-		       off_t resp_data_offset,
-		       size_t *resp_data_size)
+int nvme_mi_admin_xfer_iov(nvme_mi_ctrl_t ctrl,
+			   struct nvme_mi_admin_req_hdr *admin_req,
+			   const struct iovec *req_iov, int req_iovcnt,
+			   struct nvme_mi_admin_resp_hdr *admin_resp,
+			   off_t resp_data_offset,
+			   const struct iovec *resp_iov, int resp_iovcnt,
+			   size_t *resp_data_size)
 {
+	size_t req_data_size = 0, resp_space = 0;
+	struct iovec iov[NVME_MI_MAX_DATA_IOV];
 	struct nvme_mi_resp resp;
 	struct nvme_mi_req req;
-	int rc;
+	int i, rc;
+
+	if (req_iovcnt < 0 || req_iovcnt > NVME_MI_MAX_DATA_IOV ||
+	    resp_iovcnt < 0 || resp_iovcnt > NVME_MI_MAX_DATA_IOV) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < req_iovcnt; i++)
+		req_data_size += req_iov[i].iov_len;
+	for (i = 0; i < resp_iovcnt; i++)
+		resp_space += resp_iov[i].iov_len;
 
 	/* length/offset checks. The common _submit() API will do further
 	 * checking on the message lengths too, so these are kept specific
@@ -312,7 +949,7 @@ int nvme_mi_admin_xfer(nvme_mi_ctrl_t ctrl,
 	 */
 
 	/* NVMe-MI v1.2 imposes a limit of 4096 bytes on the dlen field */
-	if (*resp_data_size > 4096) {
+	if (*resp_data_size > 4096 || *resp_data_size > resp_space) {
 		errno = EINVAL;
 		return -1;
 	}
@@ -346,16 +983,36 @@ int nvme_mi_admin_xfer(nvme_mi_ctrl_t ctrl,
 	memset(&req, 0, sizeof(req));
 	req.hdr = &admin_req->hdr;
 	req.hdr_len = sizeof(*admin_req);
-	req.data = admin_req + 1;
 	req.data_len = req_data_size;
-
-	nvme_mi_calc_req_mic(&req);
+	if (req_iovcnt == 1) {
+		req.data = req_iov[0].iov_base;
+	} else if (req_data_size) {
+		req.data_iov = req_iov;
+		req.data_iovcnt = req_iovcnt;
+	}
 
 	memset(&resp, 0, sizeof(resp));
 	resp.hdr = &admin_resp->hdr;
 	resp.hdr_len = sizeof(*admin_resp);
-	resp.data = admin_resp + 1;
 	resp.data_len = *resp_data_size;
+	if (resp.data_len) {
+		/* only as much of the vectors as was asked for */
+		size_t left = resp.data_len;
+		int n;
+
+		for (n = 0; n < resp_iovcnt && left; n++) {
+			iov[n] = resp_iov[n];
+			if (iov[n].iov_len > left)
+				iov[n].iov_len = left;
+			left -= iov[n].iov_len;
+		}
+		if (n == 1) {
+			resp.data = iov[0].iov_base;
+		} else {
+			resp.data_iov = iov;
+			resp.data_iovcnt = n;
+		}
+	}
 
 	/* limit the response size, specify offset */
 	admin_req->flags = 0x3;
@@ -371,6 +1028,27 @@ int nvme_mi_admin_xfer(nvme_mi_ctrl_t ctrl,
 	return 0;
 }
 
+int nvme_mi_admin_xfer(nvme_mi_ctrl_t ctrl,
+		       struct nvme_mi_admin_req_hdr *admin_req,
+		       size_t req_data_size,
+		       struct nvme_mi_admin_resp_hdr *admin_resp,
+		       off_t resp_data_offset,
+		       size_t *resp_data_size)
+{
+	struct iovec req_iov = {
+		.iov_base = admin_req + 1,
+		.iov_len = req_data_size,
+	};
+	struct iovec resp_iov = {
+		.iov_base = admin_resp + 1,
+		.iov_len = *resp_data_size,
+	};
+
+	return nvme_mi_admin_xfer_iov(ctrl, admin_req, &req_iov, 1,
+				      admin_resp, resp_data_offset,
+				      &resp_iov, 1, resp_data_size);
+}
+
 int nvme_mi_admin_identify_partial(nvme_mi_ctrl_t ctrl,
 				   struct nvme_identify_args *args,
 				   off_t offset, size_t size)
@@ -432,74 +1110,182 @@ int nvme_mi_admin_identify_partial(nvme_mi_ctrl_t ctrl,
 
 /* retrieves a MCTP-messsage-sized chunk of log page data. offset and len are
  * specified within the args->data area */
-static int __nvme_mi_admin_get_log(nvme_mi_ctrl_t ctrl,
-				   const struct nvme_get_log_args *args,
-				   off_t offset, size_t *lenp, bool final)
-{
+struct nvme_mi_get_log_xfer {
 	struct nvme_mi_admin_resp_hdr resp_hdr;
 	struct nvme_mi_admin_req_hdr req_hdr;
 	struct nvme_mi_resp resp;
 	struct nvme_mi_req req;
+	struct nvme_mi_xfer xfer;
+	off_t offset;
 	size_t len;
+};
+
+/* chunks are addressed through the log page offset, relative to args->lpo */
+static int nvme_mi_admin_get_log_init(nvme_mi_ctrl_t ctrl,
+				      const struct nvme_get_log_args *args,
+				      struct nvme_mi_get_log_xfer *x,
+				      off_t offset, size_t len, bool final)
+{
+	__u64 lpo = args->lpo + offset;
 	__u32 ndw;
-	int rc;
 
 	/* MI spec requires that the data length field is less than or equal
-	 * to 4096 */
-	len = *lenp;
-	if (!len || len > 4096 || len < 4) {
+	 * to 4096, unless the endpoint has been set up for more */
+	if (!len || len > ctrl->ep->xfer_size || len < 4 || len & 0x3) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (offset < 0 || offset >= len) {
+	if (offset < 0 || offset >= args->len || offset + len > args->len) {
 		errno = EINVAL;
 		return -1;
 	}
 
 	ndw = (len >> 2) - 1;
 
-	nvme_mi_admin_init_req(&req, &req_hdr, ctrl->id, nvme_admin_get_log_page);
-	req_hdr.cdw1 = cpu_to_le32(args->nsid);
-	req_hdr.cdw10 = cpu_to_le32((ndw & 0xffff) << 16 |
-				    ((!final || args->rae) ? 1 : 0) << 15 |
-				    args->lsp << 8 |
-				    (args->lid & 0xff));
-	req_hdr.cdw11 = cpu_to_le32(args->lsi << 16 |
-				    ndw >> 16);
-	req_hdr.cdw12 = cpu_to_le32(args->lpo & 0xffffffff);
-	req_hdr.cdw13 = cpu_to_le32(args->lpo >> 32);
-	req_hdr.cdw14 = cpu_to_le32(args->csi << 24 |
-				    (args->ot ? 1 : 0) << 23 |
-				    args->uuidx);
-	req_hdr.flags = 0x1;
-	req_hdr.dlen = cpu_to_le32(len & 0xffffffff);
-	if (offset) {
-		req_hdr.flags |= 0x2;
-		req_hdr.doff = cpu_to_le32(offset);
-	}
+	nvme_mi_admin_init_req(&x->req, &x->req_hdr, ctrl->id,
+			       nvme_admin_get_log_page);
+	x->req_hdr.cdw1 = cpu_to_le32(args->nsid);
+	x->req_hdr.cdw10 = cpu_to_le32((ndw & 0xffff) << 16 |
+				       ((!final || args->rae) ? 1 : 0) << 15 |
+				       args->lsp << 8 |
+				       (args->lid & 0xff));
+	x->req_hdr.cdw11 = cpu_to_le32(args->lsi << 16 |
+				       ndw >> 16);
+	x->req_hdr.cdw12 = cpu_to_le32(lpo & 0xffffffff);
+	x->req_hdr.cdw13 = cpu_to_le32(lpo >> 32);
+	x->req_hdr.cdw14 = cpu_to_le32(args->csi << 24 |
+				       (args->ot ? 1 : 0) << 23 |
+				       args->uuidx);
+	x->req_hdr.flags = 0x1;
+	x->req_hdr.dlen = cpu_to_le32(len & 0xffffffff);
+
+	nvme_mi_admin_init_resp(&x->resp, &x->resp_hdr);
+	x->resp.data = args->log + offset;
+	x->resp.data_len = len;
+
+	x->offset = offset;
+	x->len = len;
+	return 0;
+}
 
-	nvme_mi_calc_req_mic(&req);
+static int __nvme_mi_admin_get_log(nvme_mi_ctrl_t ctrl,
+				   const struct nvme_get_log_args *args,
+				   off_t offset, size_t *lenp, bool final)
+{
+	struct nvme_mi_get_log_xfer x;
+	int rc;
 
-	nvme_mi_admin_init_resp(&resp, &resp_hdr);
-	resp.data = args->log + offset;
-	resp.data_len = len;
+	rc = nvme_mi_admin_get_log_init(ctrl, args, &x, offset, *lenp, final);
+	if (rc)
+		return rc;
 
-	rc = nvme_mi_submit(ctrl->ep, &req, &resp);
+	rc = nvme_mi_submit(ctrl->ep, &x.req, &x.resp);
 	if (rc)
 		return rc;
 
-	if (resp_hdr.status)
-		return resp_hdr.status;
+	if (x.resp_hdr.status)
+		return x.resp_hdr.status;
+
+	*lenp = x.resp.data_len;
+
+	return 0;
+}
+
+static size_t nvme_mi_get_log_chunk(nvme_mi_ctrl_t ctrl,
+				    struct nvme_get_log_args *args,
+				    off_t offset)
+{
+	size_t len = ctrl->ep->xfer_size;
+
+	if (offset + len > args->len)
+		len = args->len - offset;
+	return len;
+}
+
+/*
+ * Keeps a chunk outstanding on each command slot. A short chunk marks
+ * the end of the log page, chunks beyond it are not issued any more.
+ */
+static int nvme_mi_admin_get_log_pipelined(nvme_mi_ctrl_t ctrl,
+					   struct nvme_get_log_args *args,
+					   unsigned int nr_slots)
+{
+	struct nvme_mi_get_log_xfer x[NVME_MI_NR_SLOTS];
+	struct nvme_mi_xfer *xfers[NVME_MI_NR_SLOTS];
+	bool busy[NVME_MI_NR_SLOTS] = { };
+	off_t next = 0, end = args->len;
+	int rc = 0, err = 0, nr;
+	unsigned int slot;
+	size_t len;
+
+	while (1) {
+		nr = 0;
+		for (slot = 0; slot < nr_slots; slot++) {
+			struct nvme_mi_get_log_xfer *xf = &x[slot];
+
+			if (!busy[slot] && !rc && next < end) {
+				len = nvme_mi_get_log_chunk(ctrl, args, next);
+				rc = nvme_mi_admin_get_log_init(ctrl, args, xf,
+						next, len, next + len >= args->len);
+				if (!rc) {
+					xf->req_hdr.hdr.nmp |= slot;
+					xf->xfer.req = &xf->req;
+					xf->xfer.resp = &xf->resp;
+					rc = nvme_mi_submit_start(ctrl->ep,
+								  &xf->xfer);
+				}
+				if (rc) {
+					err = errno;
+					continue;
+				}
+				busy[slot] = true;
+				next += len;
+			}
+			if (busy[slot])
+				xfers[nr++] = &xf->xfer;
+		}
+		if (!nr)
+			break;
+
+		/* on failure the transport has given up on all requests */
+		if (nvme_mi_submit_wait(ctrl->ep, xfers, nr, false))
+			return -1;
+
+		for (slot = 0; slot < nr_slots; slot++) {
+			struct nvme_mi_get_log_xfer *xf = &x[slot];
+
+			if (!busy[slot] || !xf->xfer.done)
+				continue;
+			busy[slot] = false;
+
+			if (rc)
+				continue;
+			if (xf->xfer.rc) {
+				rc = xf->xfer.rc;
+				err = xf->xfer.err;
+			} else if (xf->resp_hdr.status) {
+				rc = xf->resp_hdr.status;
+			} else if (xf->resp.data_len != xf->len &&
+				   xf->offset + xf->resp.data_len < end) {
+				end = xf->offset + xf->resp.data_len;
+			}
+		}
+	}
 
-	*lenp = resp.data_len;
+	if (rc) {
+		if (rc < 0)
+			errno = err;
+		return rc;
+	}
 
+	args->len = next < end ? next : end;
 	return 0;
 }
 
 int nvme_mi_admin_get_log(nvme_mi_ctrl_t ctrl, struct nvme_get_log_args *args)
 {
-	const size_t xfer_size = 4096;
+	const struct nvme_mi_transport *tr = ctrl->ep->transport;
 	off_t xfer_offset;
 	int rc = 0;
 
@@ -508,13 +1294,16 @@ int nvme_mi_admin_get_log(nvme_mi_ctrl_t ctrl, struct nvme_get_log_args *args)
 		return -1;
 	}
 
+	if (ctrl->ep->max_inflight > 1 && tr->send && tr->recv &&
+	    args->len > ctrl->ep->xfer_size)
+		return nvme_mi_admin_get_log_pipelined(ctrl, args,
+						       ctrl->ep->max_inflight);
+
 	for (xfer_offset = 0; xfer_offset < args->len;) {
-		size_t tmp, cur_xfer_size = xfer_size;
+		size_t tmp, cur_xfer_size;
 		bool final;
 
-		if (xfer_offset + cur_xfer_size > args->len)
-			cur_xfer_size = args->len - xfer_offset;
-
+		cur_xfer_size = nvme_mi_get_log_chunk(ctrl, args, xfer_offset);
 		tmp = cur_xfer_size;
 
 		final = xfer_offset + cur_xfer_size >= args->len;
@@ -643,6 +1432,236 @@ int nvme_mi_admin_security_recv(nvme_mi_ctrl_t ctrl,
 	return 0;
 }
 
+struct nvme_mi_fw_download_xfer {
+	struct nvme_mi_admin_resp_hdr resp_hdr;
+	struct nvme_mi_admin_req_hdr req_hdr;
+	struct nvme_mi_resp resp;
+	struct nvme_mi_req req;
+	struct nvme_mi_xfer xfer;
+	__u32 len;
+};
+
+static int nvme_mi_admin_fw_download_init(nvme_mi_ctrl_t ctrl,
+					  struct nvme_mi_fw_download_xfer *x,
+					  void *data, __u32 offset, __u32 len)
+{
+	if (!len || len & 0x3 || offset & 0x3 || len > ctrl->ep->xfer_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nvme_mi_admin_init_req(&x->req, &x->req_hdr, ctrl->id,
+			       nvme_admin_fw_download);
+	x->req_hdr.cdw10 = cpu_to_le32((len >> 2) - 1);
+	x->req_hdr.cdw11 = cpu_to_le32(offset >> 2);
+	x->req_hdr.flags = 0x1;
+	x->req_hdr.dlen = cpu_to_le32(len);
+	x->req.data = data;
+	x->req.data_len = len;
+
+	nvme_mi_admin_init_resp(&x->resp, &x->resp_hdr);
+
+	x->len = len;
+	return 0;
+}
+
+int nvme_mi_admin_fw_download(nvme_mi_ctrl_t ctrl,
+			      struct nvme_fw_download_args *args)
+{
+	struct nvme_mi_fw_download_xfer x;
+	int rc;
+
+	if (args->args_size < sizeof(*args)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	rc = nvme_mi_admin_fw_download_init(ctrl, &x, args->data,
+					    args->offset, args->data_len);
+	if (rc)
+		return rc;
+
+	nvme_mi_calc_req_mic(&x.req);
+
+	rc = nvme_mi_submit(ctrl->ep, &x.req, &x.resp);
+	if (rc)
+		return rc;
+
+	if (x.resp_hdr.status)
+		return x.resp_hdr.status;
+
+	if (args->result)
+		*args->result = le32_to_cpu(x.resp_hdr.cdw0);
+
+	return 0;
+}
+
+/*
+ * Keeps a chunk outstanding on each command slot, in the same way as
+ * nvme_mi_admin_get_log_pipelined(). Progress is only reported for
+ * completed chunks, in the order they complete.
+ */
+static int nvme_mi_admin_fw_download_pipelined(nvme_mi_ctrl_t ctrl,
+		void *buf, __u32 size, __u32 xfer, __u32 offset,
+		nvme_mi_fw_progress_cb_t cb, void *data,
+		unsigned int nr_slots)
+{
+	struct nvme_mi_fw_download_xfer x[NVME_MI_NR_SLOTS];
+	struct nvme_mi_xfer *xfers[NVME_MI_NR_SLOTS];
+	bool busy[NVME_MI_NR_SLOTS] = { };
+	__u32 next = 0, done = 0, len;
+	int rc = 0, err = 0, nr;
+	unsigned int slot;
+
+	while (1) {
+		nr = 0;
+		for (slot = 0; slot < nr_slots; slot++) {
+			struct nvme_mi_fw_download_xfer *xf = &x[slot];
+
+			if (!busy[slot] && !rc && next < size) {
+				len = size - next < xfer ? size - next : xfer;
+				rc = nvme_mi_admin_fw_download_init(ctrl, xf,
+						(__u8 *)buf + next,
+						offset + next, len);
+				if (!rc) {
+					xf->req_hdr.hdr.nmp |= slot;
+					xf->xfer.req = &xf->req;
+					xf->xfer.resp = &xf->resp;
+					rc = nvme_mi_submit_start(ctrl->ep,
+								  &xf->xfer);
+				}
+				if (rc) {
+					err = errno;
+					continue;
+				}
+				busy[slot] = true;
+				next += len;
+			}
+			if (busy[slot])
+				xfers[nr++] = &xf->xfer;
+		}
+		if (!nr)
+			break;
+
+		/* on failure the transport has given up on all requests */
+		if (nvme_mi_submit_wait(ctrl->ep, xfers, nr, false))
+			return -1;
+
+		for (slot = 0; slot < nr_slots; slot++) {
+			struct nvme_mi_fw_download_xfer *xf = &x[slot];
+
+			if (!busy[slot] || !xf->xfer.done)
+				continue;
+			busy[slot] = false;
+
+			if (rc)
+				continue;
+			if (xf->xfer.rc) {
+				rc = xf->xfer.rc;
+				err = xf->xfer.err;
+			} else if (xf->resp_hdr.status) {
+				rc = xf->resp_hdr.status;
+			} else {
+				done += xf->len;
+				if (cb)
+					cb(ctrl, done, size, data);
+			}
+		}
+	}
+
+	if (rc < 0)
+		errno = err;
+	return rc;
+}
+
+int nvme_mi_admin_fw_download_seq(nvme_mi_ctrl_t ctrl, void *buf,
+				  __u32 size, __u32 xfer, __u32 offset,
+				  nvme_mi_fw_progress_cb_t cb, void *data)
+{
+	const struct nvme_mi_transport *tr = ctrl->ep->transport;
+	struct nvme_mi_fw_download_xfer x;
+	__u32 done = 0, len;
+	int rc;
+
+	/* the largest chunk that fits a single MI message */
+	if (!xfer || xfer > ctrl->ep->xfer_size)
+		xfer = ctrl->ep->xfer_size;
+
+	if (xfer & 0x3 || size & 0x3 || offset & 0x3) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (ctrl->ep->max_inflight > 1 && tr->send && tr->recv &&
+	    size > xfer)
+		return nvme_mi_admin_fw_download_pipelined(ctrl, buf, size,
+				xfer, offset, cb, data,
+				ctrl->ep->max_inflight);
+
+	while (done < size) {
+		len = size - done < xfer ? size - done : xfer;
+
+		rc = nvme_mi_admin_fw_download_init(ctrl, &x,
+						    (__u8 *)buf + done,
+						    offset + done, len);
+		if (rc)
+			return rc;
+
+		nvme_mi_calc_req_mic(&x.req);
+
+		rc = nvme_mi_submit(ctrl->ep, &x.req, &x.resp);
+		if (rc)
+			return rc;
+
+		if (x.resp_hdr.status)
+			return x.resp_hdr.status;
+
+		done += len;
+		if (cb)
+			cb(ctrl, done, size, data);
+	}
+
+	return 0;
+}
+
+int nvme_mi_admin_fw_commit(nvme_mi_ctrl_t ctrl,
+			    struct nvme_fw_commit_args *args)
+{
+	struct nvme_mi_admin_resp_hdr resp_hdr;
+	struct nvme_mi_admin_req_hdr req_hdr;
+	struct nvme_mi_resp resp;
+	struct nvme_mi_req req;
+	int rc;
+
+	if (args->args_size < sizeof(*args)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nvme_mi_admin_init_req(&req, &req_hdr, ctrl->id,
+			       nvme_admin_fw_commit);
+
+	req_hdr.cdw10 = cpu_to_le32(((__u32)(args->bpid & 0x1) << 31) |
+				    ((args->action & 0x7) << 3) |
+				    (args->slot & 0x7));
+
+	nvme_mi_calc_req_mic(&req);
+
+	nvme_mi_admin_init_resp(&resp, &resp_hdr);
+
+	rc = nvme_mi_submit(ctrl->ep, &req, &resp);
+	if (rc)
+		return rc;
+
+	if (resp_hdr.status)
+		return resp_hdr.status;
+
+	if (args->result)
+		*args->result = le32_to_cpu(resp_hdr.cdw0);
+
+	return 0;
+}
+
 static int nvme_mi_read_data(nvme_mi_ep_t ep, __u32 cdw0,
 			     void *data, size_t *data_len)
 {
@@ -688,6 +1707,11 @@ int nvme_mi_mi_read_mi_data_subsys(nvme_mi_ep_t ep,
 	__u32 cdw0;
 	int rc;
 
+	if (ep->subsys_cached) {
+		*s = ep->subsys;
+		return 0;
+	}
+
 	cdw0 = (__u8)nvme_mi_dtyp_subsys_info << 24;
 	len = sizeof(*s);
 
@@ -704,16 +1728,28 @@ int nvme_mi_mi_read_mi_data_subsys(nvme_mi_ep_t ep,
 		return -1;
 	}
 
+	if (ep->cache_enabled) {
+		ep->subsys = *s;
+		ep->subsys_cached = true;
+	}
+
 	return 0;
 }
 
 int nvme_mi_mi_read_mi_data_port(nvme_mi_ep_t ep, __u8 portid,
 				 struct nvme_mi_read_port_info *p)
 {
+	struct nvme_mi_port_cache *pc;
 	size_t len;
 	__u32 cdw0;
 	int rc;
 
+	pc = nvme_mi_ep_find_port(ep, portid);
+	if (pc) {
+		*p = pc->info;
+		return 0;
+	}
+
 	cdw0 = ((__u8)nvme_mi_dtyp_port_info << 24) | (portid << 16);
 	len = sizeof(*p);
 
@@ -726,6 +1762,16 @@ int nvme_mi_mi_read_mi_data_port(nvme_mi_ep_t ep, __u8 portid,
 		return -1;
 	}
 
+	if (ep->cache_enabled) {
+		pc = realloc(ep->ports, (ep->nr_ports + 1) * sizeof(*pc));
+		if (pc) {
+			ep->ports = pc;
+			pc = &ep->ports[ep->nr_ports++];
+			pc->portid = portid;
+			pc->info = *p;
+		}
+	}
+
 	return 0;
 }
 
@@ -768,6 +1814,52 @@ int nvme_mi_mi_read_mi_data_ctrl(nvme_mi_ep_t ep, __u16 ctrl_id,
 	return 0;
 }
 
+static void nvme_mi_health_status_poll_init(struct nvme_mi_mi_req_hdr *req_hdr,
+					    struct nvme_mi_req *req,
+					    struct nvme_mi_mi_resp_hdr *resp_hdr,
+					    struct nvme_mi_resp *resp,
+					    bool clear,
+					    struct nvme_mi_nvm_ss_health_status *sshs)
+{
+	memset(req_hdr, 0, sizeof(*req_hdr));
+	req_hdr->hdr.type = NVME_MI_MSGTYPE_NVME;;
+	req_hdr->hdr.nmp = (NVME_MI_ROR_REQ << 7) |
+		(NVME_MI_MT_MI << 3);
+	req_hdr->opcode = nvme_mi_mi_opcode_subsys_health_status_poll;
+	req_hdr->cdw1 = (clear ? 1 : 0) << 31;
+
+	memset(req, 0, sizeof(*req));
+	req->hdr = &req_hdr->hdr;
+	req->hdr_len = sizeof(*req_hdr);
+
+	memset(resp, 0, sizeof(*resp));
+	resp->hdr = &resp_hdr->hdr;
+	resp->hdr_len = sizeof(*resp_hdr);
+	resp->data = sshs;
+	resp->data_len = sizeof(*sshs);
+}
+
+static int nvme_mi_health_status_poll_check(nvme_mi_ep_t ep,
+					    struct nvme_mi_mi_resp_hdr *resp_hdr,
+					    struct nvme_mi_resp *resp)
+{
+	if (resp_hdr->status)
+		return resp_hdr->status;
+
+	if (resp->data_len != sizeof(struct nvme_mi_nvm_ss_health_status)) {
+		nvme_msg(ep->root, LOG_WARNING,
+			 "MI Subsystem Health Status length mismatch: "
+			 "got %zd bytes, expected %zd\n",
+			 resp->data_len,
+			 sizeof(struct nvme_mi_nvm_ss_health_status));
+		errno = EPROTO;
+		return -1;
+	}
+
+	nvme_mi_ep_check_ccs(ep, resp->data);
+	return 0;
+}
+
 int nvme_mi_mi_subsystem_health_status_poll(nvme_mi_ep_t ep, bool clear,
 					    struct nvme_mi_nvm_ss_health_status *sshs)
 {
@@ -777,39 +1869,167 @@ int nvme_mi_mi_subsystem_health_status_poll(nvme_mi_ep_t ep, bool clear,
 	struct nvme_mi_req req;
 	int rc;
 
-	memset(&req_hdr, 0, sizeof(req_hdr));
-	req_hdr.hdr.type = NVME_MI_MSGTYPE_NVME;;
-	req_hdr.hdr.nmp = (NVME_MI_ROR_REQ << 7) |
-		(NVME_MI_MT_MI << 3);
-	req_hdr.opcode = nvme_mi_mi_opcode_subsys_health_status_poll;
-	req_hdr.cdw1 = (clear ? 1 : 0) << 31;
-
-	memset(&req, 0, sizeof(req));
-	req.hdr = &req_hdr.hdr;
-	req.hdr_len = sizeof(req_hdr);
-
-	memset(&resp, 0, sizeof(resp));
-	resp.hdr = &resp_hdr.hdr;
-	resp.hdr_len = sizeof(resp_hdr);
-	resp.data = sshs;
-	resp.data_len = sizeof(*sshs);
+	nvme_mi_health_status_poll_init(&req_hdr, &req, &resp_hdr, &resp,
+					clear, sshs);
 
 	rc = nvme_mi_submit(ep, &req, &resp);
 	if (rc)
 		return rc;
 
-	if (resp_hdr.status)
-		return resp_hdr.status;
+	return nvme_mi_health_status_poll_check(ep, &resp_hdr, &resp);
+}
 
-	if (resp.data_len != sizeof(*sshs)) {
-		nvme_msg(ep->root, LOG_WARNING,
-			 "MI Subsystem Health Status length mismatch: "
-			 "got %zd bytes, expected %zd\n",
-			 resp.data_len, sizeof(*sshs));
-		errno = EPROTO;
+struct nvme_mi_health_poll {
+	nvme_mi_ep_t ep;
+	struct nvme_mi_mi_req_hdr req_hdr;
+	struct nvme_mi_mi_resp_hdr resp_hdr;
+	struct nvme_mi_req req;
+	struct nvme_mi_resp resp;
+	struct nvme_mi_xfer xfer;
+	struct nvme_mi_nvm_ss_health_status sshs;
+	bool async;
+};
+
+static void nvme_mi_health_poll_complete(struct nvme_mi_health_poll *p,
+					 nvme_mi_health_status_cb_t cb,
+					 void *data)
+{
+	int rc;
+
+	if (p->xfer.rc) {
+		rc = p->xfer.rc;
+		if (rc < 0)
+			errno = p->xfer.err;
+	} else {
+		rc = nvme_mi_health_status_poll_check(p->ep, &p->resp_hdr,
+						      &p->resp);
+	}
+
+	cb(p->ep, rc, rc ? NULL : &p->sshs, data);
+}
+
+/* time until the first of the outstanding polls expires */
+static int nvme_mi_health_poll_timeout(struct nvme_mi_health_poll *polls,
+				       int nr)
+{
+	int i, left, timeout = -1;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < nr; i++) {
+		if (!polls[i].async || polls[i].xfer.done)
+			continue;
+		left = nvme_mi_xfer_time_left(&polls[i].xfer, &now);
+		if (left >= 0 && (timeout < 0 || left < timeout))
+			timeout = left;
+	}
+	return timeout;
+}
+
+int nvme_mi_mi_subsystem_health_status_poll_all(nvme_root_t m, bool clear,
+						nvme_mi_health_status_cb_t cb,
+						void *data)
+{
+	struct epoll_event events[16];
+	struct nvme_mi_health_poll *polls, *p;
+	struct nvme_mi_xfer *xfer;
+	int i, n, nr, pending, epoll_fd;
+	nvme_mi_ep_t ep;
+
+	nr = 0;
+	nvme_mi_for_each_endpoint(m, ep)
+		nr++;
+	if (!nr)
+		return 0;
+
+	polls = calloc(nr, sizeof(*polls));
+	if (!polls) {
+		errno = ENOMEM;
 		return -1;
 	}
 
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		free(polls);
+		return -1;
+	}
+
+	/* start a request on every endpoint whose transport allows it */
+	i = 0;
+	pending = 0;
+	nvme_mi_for_each_endpoint(m, ep) {
+		const struct nvme_mi_transport *tr = ep->transport;
+		struct epoll_event ev = { .events = EPOLLIN };
+
+		p = &polls[i++];
+		p->ep = ep;
+		nvme_mi_health_status_poll_init(&p->req_hdr, &p->req,
+						&p->resp_hdr, &p->resp,
+						clear, &p->sshs);
+		p->xfer.req = &p->req;
+		p->xfer.resp = &p->resp;
+
+		if (!tr->send || !tr->recv || !tr->get_fd)
+			continue;
+
+		ev.data.ptr = p;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tr->get_fd(ep), &ev))
+			continue;
+
+		p->async = true;
+		if (nvme_mi_submit_start(ep, &p->xfer)) {
+			p->xfer.done = true;
+			p->xfer.rc = -1;
+			p->xfer.err = errno;
+			continue;
+		}
+		pending++;
+	}
+
+	/* the others are polled one by one meanwhile */
+	for (i = 0; i < nr; i++) {
+		p = &polls[i];
+		if (!p->async) {
+			p->xfer.rc = nvme_mi_submit(p->ep, &p->req, &p->resp);
+			p->xfer.err = errno;
+			p->xfer.done = true;
+			nvme_mi_health_poll_complete(p, cb, data);
+		} else if (p->xfer.done) {
+			nvme_mi_health_poll_complete(p, cb, data);
+		}
+	}
+
+	while (pending) {
+		n = epoll_wait(epoll_fd, events, ARRAY_SIZE(events),
+			       nvme_mi_health_poll_timeout(polls, nr));
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		/* on timeout (or failure) let the transports expire requests */
+		for (i = 0; i < (n > 0 ? n : nr); i++) {
+			p = n > 0 ? events[i].data.ptr : &polls[i];
+			if (!p->async || p->xfer.done)
+				continue;
+
+			xfer = &p->xfer;
+			if (nvme_mi_submit_wait(p->ep, &xfer, 1, n >= 0) &&
+			    !xfer->done) {
+				xfer->done = true;
+				xfer->rc = -1;
+				xfer->err = errno;
+			}
+			if (!xfer->done)
+				continue;
+
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL,
+				  p->ep->transport->get_fd(p->ep), NULL);
+			pending--;
+			nvme_mi_health_poll_complete(p, cb, data);
+		}
+	}
+
+	close(epoll_fd);
+	free(polls);
 	return 0;
 }
 
@@ -874,6 +2094,11 @@ int nvme_mi_mi_config_set(nvme_mi_ep_t ep, __u32 dw0, __u32 dw1)
 	resp.hdr = &resp_hdr.hdr;
 	resp.hdr_len = sizeof(resp_hdr);
 
+	/* port settings such as the MTU are part of the port data */
+	free(ep->ports);
+	ep->ports = NULL;
+	ep->nr_ports = 0;
+
 	rc = nvme_mi_submit(ep, &req, &resp);
 	if (rc)
 		return rc;
@@ -897,6 +2122,8 @@ void nvme_mi_close(nvme_mi_ep_t ep)
 	if (ep->transport->close)
 		ep->transport->close(ep);
 	list_del(&ep->root_entry);
+	free(ep->lat);
+	free(ep->ports);
 	free(ep);
 }
 
@@ -86,6 +86,7 @@
 
 #include <endian.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "types.h"
 #include "tree.h"
@@ -484,6 +485,163 @@ void nvme_mi_ep_set_mprt_max(nvme_mi_ep_t ep, unsigned int mprt_max_ms);
  */
 unsigned int nvme_mi_ep_get_timeout(nvme_mi_ep_t ep);
 
+/**
+ * nvme_mi_ep_set_xfer_size - set the maximum data size of a single request
+ * @ep: MI endpoint object
+ * @size: Maximum data transfer size, in bytes
+ *
+ * Larger transfers, such as log pages, are split into requests of at most
+ * @size bytes each. The NVMe-MI specification limits the data of a single
+ * request to 4096 bytes, which is the default; only raise this for
+ * endpoints known to accept larger messages.
+ *
+ * Return: 0 on success, -1 with errno set to EINVAL if @size is not a
+ * non-zero multiple of 4.
+ */
+int nvme_mi_ep_set_xfer_size(nvme_mi_ep_t ep, size_t size);
+
+/**
+ * nvme_mi_ep_get_xfer_size - get the maximum data size of a single request
+ * @ep: MI endpoint object
+ *
+ * Returns the current maximum data transfer size, in bytes, for this
+ * endpoint.
+ */
+size_t nvme_mi_ep_get_xfer_size(nvme_mi_ep_t ep);
+
+/**
+ * nvme_mi_ep_set_max_inflight - set the number of requests kept in flight
+ * @ep: MI endpoint object
+ * @nr: Maximum number of outstanding requests
+ *
+ * Multi-request transfers keep up to @nr requests outstanding at once, using
+ * one NVMe-MI command slot each. The default of 1 issues requests one after
+ * the other. Only transports supporting asynchronous submission (currently
+ * MCTP) make use of more than one.
+ *
+ * Return: 0 on success, -1 with errno set to EINVAL if @nr is 0 or exceeds
+ * the two command slots defined by NVMe-MI.
+ */
+int nvme_mi_ep_set_max_inflight(nvme_mi_ep_t ep, unsigned int nr);
+
+/**
+ * struct nvme_mi_latency_stats - Response latency history of a command
+ * @count: Number of completed or timed out requests
+ * @timeouts: Number of requests which timed out, counted with the time
+ * waited for them
+ * @min_us: Shortest latency, in microseconds
+ * @max_us: Longest latency, in microseconds
+ * @mean_us: Mean latency, in microseconds
+ * @p50_us: Median latency, in microseconds
+ * @p90_us: 90th percentile latency, in microseconds
+ * @p99_us: 99th percentile latency, in microseconds
+ *
+ * Percentiles are approximated from a histogram with power-of-two sized
+ * buckets, and given as the upper bound of the bucket.
+ */
+struct nvme_mi_latency_stats {
+	__u32 count;
+	__u32 timeouts;
+	__u32 min_us;
+	__u32 max_us;
+	__u32 mean_us;
+	__u32 p50_us;
+	__u32 p90_us;
+	__u32 p99_us;
+};
+
+/**
+ * nvme_mi_ep_get_latency_stats - get the response latency of a command
+ * @ep: MI endpoint object
+ * @type: Message type of the command, see &enum nvme_mi_message_type
+ * @opcode: Opcode of the command, e.g. &enum nvme_admin_opcode for
+ * %NVME_MI_MT_ADMIN
+ * @stats: Latency statistics to fill in
+ *
+ * Every endpoint records the time from sending each request to receiving
+ * its response, including any More Processing Required wait, per message
+ * type and opcode.
+ *
+ * Return: 0 on success, -1 with errno set to ENOENT if no such command
+ * was sent to @ep.
+ */
+int nvme_mi_ep_get_latency_stats(nvme_mi_ep_t ep,
+				 enum nvme_mi_message_type type, __u8 opcode,
+				 struct nvme_mi_latency_stats *stats);
+
+/**
+ * nvme_mi_ep_reset_latency_stats - discard the latency history of an endpoint
+ * @ep: MI endpoint object
+ *
+ * This also resets adaptive timeouts to start over from the configured
+ * timeout.
+ */
+void nvme_mi_ep_reset_latency_stats(nvme_mi_ep_t ep);
+
+/**
+ * struct nvme_mi_cmd_trace - Command passed to the endpoint command hook
+ * @type: Message type, see &enum nvme_mi_message_type
+ * @opcode: Opcode of the command
+ * @req_data_len: Length of the request data
+ * @resp_data_len: Length of the response data received, 0 on failure
+ * @status: Status of the response, see &enum nvme_mi_resp_status and
+ * &enum nvme_status_field, or a negative errno value if no valid response
+ * was received
+ * @duration_us: Time from sending the request to receiving and checking its
+ * response, in microseconds
+ */
+struct nvme_mi_cmd_trace {
+	__u8 type;
+	__u8 opcode;
+	__u32 req_data_len;
+	__u32 resp_data_len;
+	int status;
+	__u32 duration_us;
+};
+
+/**
+ * typedef nvme_mi_cmd_hook_t - Endpoint command hook
+ * @ep: MI endpoint object the command was sent to
+ * @t: Command and its outcome
+ * @user_data: Pointer passed to nvme_mi_ep_set_cmd_hook()
+ */
+typedef void (*nvme_mi_cmd_hook_t)(nvme_mi_ep_t ep,
+				   const struct nvme_mi_cmd_trace *t,
+				   void *user_data);
+
+/**
+ * nvme_mi_ep_set_cmd_hook - call a function after every command on an endpoint
+ * @ep: MI endpoint object
+ * @hook: Function to call, or NULL to remove it
+ * @user_data: Passed to @hook
+ *
+ * @hook runs once each request sent to @ep completes, fails or times
+ * out, from nvme_mi_submit() or nvme_mi_submit_wait().
+ */
+void nvme_mi_ep_set_cmd_hook(nvme_mi_ep_t ep, nvme_mi_cmd_hook_t hook,
+			     void *user_data);
+
+/**
+ * nvme_mi_ep_set_adaptive_timeout - derive timeouts from observed latency
+ * @ep: MI endpoint object
+ * @percentile: Latency percentile to base timeouts on, or 0 to disable
+ * @factor: Multiple of the percentile latency to wait for a response
+ *
+ * Once a command has some latency history on @ep, its responses are only
+ * waited for @factor times its @percentile latency, with a floor of 100ms
+ * and never longer than the timeout set by &nvme_mi_ep_set_timeout. Waits
+ * after a More Processing Required response use the time the endpoint
+ * reports, limited only by &nvme_mi_ep_set_mprt_max. This stops a hung
+ * endpoint from stalling every command for the worst-case timeout.
+ * Timed out requests are part of the history, so the timeout grows again
+ * when an endpoint slows down for good.
+ *
+ * Return: 0 on success, -1 with errno set to EINVAL if @percentile exceeds
+ * 100 or @factor is 0.
+ */
+int nvme_mi_ep_set_adaptive_timeout(nvme_mi_ep_t ep, unsigned int percentile,
+				    unsigned int factor);
+
 struct nvme_mi_ctrl;
 
 /**
@@ -587,6 +745,87 @@ void nvme_mi_close(nvme_mi_ep_t ep);
  */
 nvme_root_t nvme_mi_scan_mctp(void);
 
+/**
+ * typedef nvme_mi_mctp_monitor_t - Monitor for MCTP endpoints coming and going
+ */
+typedef struct nvme_mi_mctp_monitor * nvme_mi_mctp_monitor_t;
+
+/**
+ * enum nvme_mi_mctp_monitor_event - Kind of an MCTP monitor event
+ * @NVME_MI_MCTP_MONITOR_ADDED:	An NVMe-MI endpoint was found and opened
+ * @NVME_MI_MCTP_MONITOR_REMOVED: An NVMe-MI endpoint has gone away, and is
+ *				closed once the callback returns
+ */
+enum nvme_mi_mctp_monitor_event {
+	NVME_MI_MCTP_MONITOR_ADDED,
+	NVME_MI_MCTP_MONITOR_REMOVED,
+};
+
+/**
+ * typedef nvme_mi_mctp_monitor_cb_t - MCTP monitor callback
+ * @mon:	Monitor which received the event
+ * @event:	Event type, see &enum nvme_mi_mctp_monitor_event
+ * @ep:		Endpoint added or removed
+ * @user_data:	Pointer passed to &nvme_mi_mctp_monitor_create
+ */
+typedef void (*nvme_mi_mctp_monitor_cb_t)(nvme_mi_mctp_monitor_t mon,
+					  enum nvme_mi_mctp_monitor_event event,
+					  nvme_mi_ep_t ep, void *user_data);
+
+/**
+ * nvme_mi_mctp_monitor_create() - Track MCTP-connected NVMe-MI endpoints
+ * @root:	root object to create endpoints under, must outlive the monitor
+ * @cb:		Callback for endpoints being added and removed
+ * @user_data:	Passed to @cb
+ *
+ * Description: The incremental counterpart of &nvme_mi_scan_mctp. The
+ * monitor subscribes to the InterfacesAdded and InterfacesRemoved signals
+ * of the MCTP daemon and queries its current endpoints asynchronously, so
+ * that creating it does not block. As the results arrive from
+ * &nvme_mi_mctp_monitor_process, endpoints supporting NVMe-MI are opened
+ * under @root and reported to @cb, and closed again once the daemon
+ * removes them. Endpoints reported by the monitor must not be closed by
+ * the caller while it exists.
+ *
+ * This requires libnvme-mi to be compiled with D-Bus support; if not, this
+ * fails with EOPNOTSUPP.
+ *
+ * Return: New monitor, or NULL with errno set on failure.
+ */
+nvme_mi_mctp_monitor_t nvme_mi_mctp_monitor_create(nvme_root_t root,
+		nvme_mi_mctp_monitor_cb_t cb, void *user_data);
+
+/**
+ * nvme_mi_mctp_monitor_free() - Free an MCTP monitor
+ * @mon:	Monitor to free
+ *
+ * Endpoints opened by the monitor remain part of their root.
+ */
+void nvme_mi_mctp_monitor_free(nvme_mi_mctp_monitor_t mon);
+
+/**
+ * nvme_mi_mctp_monitor_get_fd() - Pollable file descriptor of an MCTP monitor
+ * @mon:	Monitor
+ *
+ * The descriptor becomes readable when D-Bus messages are pending, and can
+ * be added to the caller's own poll or epoll set. Call
+ * &nvme_mi_mctp_monitor_process with a timeout of 0 once it is readable.
+ *
+ * Return: File descriptor owned by @mon, or -1 with errno set.
+ */
+int nvme_mi_mctp_monitor_get_fd(nvme_mi_mctp_monitor_t mon);
+
+/**
+ * nvme_mi_mctp_monitor_process() - Wait for and dispatch MCTP monitor events
+ * @mon:	Monitor
+ * @timeout:	Time to wait for events in milliseconds, 0 to not wait at
+ *		all or -1 to wait indefinitely
+ *
+ * Return: Number of endpoints added or removed, which may be 0 when the
+ * timeout expired, or -1 with errno set on failure.
+ */
+int nvme_mi_mctp_monitor_process(nvme_mi_mctp_monitor_t mon, int timeout);
+
 /**
  * nvme_mi_scan_ep - query an endpoint for its NVMe controllers.
  * @ep: Endpoint to scan
@@ -601,12 +840,43 @@ nvme_root_t nvme_mi_scan_mctp(void);
  * so, all existing controller objects will be freed - the caller must not
  * hold a reference to those across this call.
  *
+ * With the data cache of &nvme_mi_ep_set_data_cache enabled, the list is
+ * also read again once the cache was invalidated. Controllers still present
+ * then keep their objects, only those which have gone away are freed.
+ *
  * Return: 0 on success, non-zero on failure
  *
  * See: &nvme_mi_for_each_ctrl
  */
 int nvme_mi_scan_ep(nvme_mi_ep_t ep, bool force_rescan);
 
+/**
+ * nvme_mi_ep_set_data_cache - cache the MI data structures of an endpoint
+ * @ep: Endpoint
+ * @enable: Whether to cache
+ *
+ * With caching enabled, &nvme_mi_mi_read_mi_data_subsys and
+ * &nvme_mi_mi_read_mi_data_port return the data structures read earlier
+ * instead of querying the endpoint again. The cache is revalidated through
+ * the Composite Controller Status flags of every Subsystem Health Status
+ * Poll response: an NVM Subsystem Reset, Controller Enable Change or
+ * Firmware Activation drops the cached data, and marks the controller list
+ * for rescanning by the next &nvme_mi_scan_ep. A Configuration Set drops the
+ * cached port data. As the flags are only reported once set, callers should
+ * poll the health status regularly while relying on the cache.
+ *
+ * Changing the setting drops any cached data.
+ */
+void nvme_mi_ep_set_data_cache(nvme_mi_ep_t ep, bool enable);
+
+/**
+ * nvme_mi_ep_invalidate_data_cache - drop the cached MI data of an endpoint
+ * @ep: Endpoint
+ *
+ * The next reads query the endpoint again, see &nvme_mi_ep_set_data_cache.
+ */
+void nvme_mi_ep_invalidate_data_cache(nvme_mi_ep_t ep);
+
 /**
  * nvme_mi_init_ctrl() - initialise a NVMe controller.
  * @ep: Endpoint to create under
@@ -727,6 +997,40 @@ int nvme_mi_mi_read_mi_data_ctrl(nvme_mi_ep_t ep, __u16 ctrl_id,
 int nvme_mi_mi_subsystem_health_status_poll(nvme_mi_ep_t ep, bool clear,
 					    struct nvme_mi_nvm_ss_health_status *nshds);
 
+/**
+ * typedef nvme_mi_health_status_cb_t - Health status result callback
+ * @ep: Endpoint which was polled
+ * @rc: Result as returned by &nvme_mi_mi_subsystem_health_status_poll,
+ * with errno set when negative
+ * @sshs: Subsystem health status, or NULL if @rc is non-zero
+ * @data: Pointer passed to &nvme_mi_mi_subsystem_health_status_poll_all
+ */
+typedef void (*nvme_mi_health_status_cb_t)(nvme_mi_ep_t ep, int rc,
+			struct nvme_mi_nvm_ss_health_status *sshs,
+			void *data);
+
+/**
+ * nvme_mi_mi_subsystem_health_status_poll_all() - Read the Subsystem Health
+ * Data Structure of all endpoints
+ * @m: &nvme_root_t object holding the endpoints
+ * @clear: flag to clear the Composite Controller Status state
+ * @cb: Called once for every endpoint, in order of completion
+ * @data: Passed to @cb
+ *
+ * Performs a &nvme_mi_mi_subsystem_health_status_poll on every endpoint of
+ * @m concurrently: requests to all endpoints are sent up front and the
+ * responses collected as they arrive, so the whole sweep takes about as
+ * long as the slowest endpoint rather than the sum of all of them.
+ * Endpoints on transports which can only complete one request at a time
+ * are polled in turn while the others are outstanding.
+ *
+ * Return: 0 once @cb was called for every endpoint, or -1 with errno set
+ * if the sweep could not be started. Per-endpoint results are passed to @cb.
+ */
+int nvme_mi_mi_subsystem_health_status_poll_all(nvme_root_t m, bool clear,
+						nvme_mi_health_status_cb_t cb,
+						void *data);
+
 /**
  * nvme_mi_mi_config_get - query a configuration parameter
  * @ep: endpoint for MI communication
@@ -787,7 +1091,7 @@ static inline int nvme_mi_mi_config_get_smbus_freq(nvme_mi_ep_t ep, __u8 port,
 
 	rc = nvme_mi_mi_config_get(ep, dw0, 0, &tmp);
 	if (!rc)
-		*freq = tmp & 0x3;
+		*freq = (enum nvme_mi_config_smbus_freq)(tmp & 0x3);
 	return rc;
 }
 
@@ -927,6 +1231,35 @@ int nvme_mi_admin_xfer(nvme_mi_ctrl_t ctrl,
 		       off_t resp_data_offset,
 		       size_t *resp_data_size);
 
+/**
+ * nvme_mi_admin_xfer_iov() - Raw admin transfer with vectored payloads.
+ * @ctrl: controller to send the admin command to
+ * @admin_req: request header
+ * @req_iov: request data payload segments
+ * @req_iovcnt: number of entries in @req_iov
+ * @admin_resp: buffer for the response header
+ * @resp_data_offset: offset into request data to retrieve from controller
+ * @resp_iov: response data payload segments
+ * @resp_iovcnt: number of entries in @resp_iov
+ * @resp_data_size: size of response data to request, at most the total
+ *		    length of @resp_iov, updated to received size
+ *
+ * As nvme_mi_admin_xfer(), but the request and response payloads are
+ * described by up to 16 iovec segments each, rather than being placed
+ * directly after their headers. The segments are passed to the transport
+ * as-is, and the message integrity check is calculated over them, so no
+ * intermediate copies of the payload are made.
+ *
+ * Return: 0 on success, non-zero on failure.
+ */
+int nvme_mi_admin_xfer_iov(nvme_mi_ctrl_t ctrl,
+			   struct nvme_mi_admin_req_hdr *admin_req,
+			   const struct iovec *req_iov, int req_iovcnt,
+			   struct nvme_mi_admin_resp_hdr *admin_resp,
+			   off_t resp_data_offset,
+			   const struct iovec *resp_iov, int resp_iovcnt,
+			   size_t *resp_data_size);
+
 /**
  * nvme_mi_admin_identify_partial() - Perform an Admin identify command,
  * and retrieve partial response data.
@@ -1140,4 +1473,73 @@ int nvme_mi_admin_security_recv(nvme_mi_ctrl_t ctrl,
 				struct nvme_security_receive_args *args);
 
 
+/**
+ * nvme_mi_admin_fw_download() - Download part or all of a firmware image to
+ * a controller
+ * @ctrl: Controller to send firmware data to
+ * @args: Firmware Download command arguments
+ *
+ * Performs a single Firmware Download Admin command as specified by @args.
+ * @args->offset and @args->data_len must be multiples of 4 bytes, and
+ * @args->data_len must not exceed the maximum transfer size of the endpoint,
+ * see nvme_mi_ep_set_xfer_size(). Use nvme_mi_admin_fw_download_seq() to
+ * transfer an image of any size.
+ *
+ * Return: 0 on success, non-zero on failure
+ *
+ * See: &struct nvme_fw_download_args
+ */
+int nvme_mi_admin_fw_download(nvme_mi_ctrl_t ctrl,
+			      struct nvme_fw_download_args *args);
+
+/**
+ * typedef nvme_mi_fw_progress_cb_t - Firmware download progress callback
+ * @ctrl: Controller the image is downloaded to
+ * @done: Number of bytes transferred so far
+ * @total: Total number of bytes to transfer
+ * @data: User data passed to nvme_mi_admin_fw_download_seq()
+ */
+typedef void (*nvme_mi_fw_progress_cb_t)(nvme_mi_ctrl_t ctrl, __u32 done,
+					 __u32 total, void *data);
+
+/**
+ * nvme_mi_admin_fw_download_seq() - Download a firmware image in chunks
+ * @ctrl: Controller to send firmware data to
+ * @buf: Firmware image data
+ * @size: Size of @buf in bytes
+ * @xfer: Chunk size in bytes, or 0 to use the maximum transfer size of
+ *	  the endpoint
+ * @offset: Offset of @buf within the firmware image
+ * @cb: Optional callback invoked after every completed chunk
+ * @data: User data passed to @cb
+ *
+ * Splits @buf into Firmware Download commands of at most @xfer bytes,
+ * limited by the maximum transfer size of the endpoint. @size, @xfer and
+ * @offset must be multiples of 4 bytes; when the controller reports an
+ * update granularity, @xfer should be a multiple of it.
+ *
+ * If the endpoint allows more than one command in flight (see
+ * nvme_mi_ep_set_max_inflight()) and the transport supports it, the next
+ * chunk is sent while the previous one is still being processed. Once a
+ * chunk fails no further chunks are sent.
+ *
+ * Return: 0 on success, the NVMe status of the first failing chunk, or -1
+ * with errno set otherwise.
+ */
+int nvme_mi_admin_fw_download_seq(nvme_mi_ctrl_t ctrl, void *buf,
+				  __u32 size, __u32 xfer, __u32 offset,
+				  nvme_mi_fw_progress_cb_t cb, void *data);
+
+/**
+ * nvme_mi_admin_fw_commit() - Commit a downloaded firmware image
+ * @ctrl: Controller to send command to
+ * @args: Firmware Commit command arguments
+ *
+ * Return: 0 on success, non-zero on failure
+ *
+ * See: &struct nvme_fw_commit_args
+ */
+int nvme_mi_admin_fw_commit(nvme_mi_ctrl_t ctrl,
+			    struct nvme_fw_commit_args *args);
+
 #endif /* _LIBNVME_MI_MI_H */
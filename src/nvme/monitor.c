@@ -0,0 +1,400 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include <ccan/list/list.h>
+
+#include "log.h"
+#include "monitor.h"
+#include "private.h"
+
+/* the kernel limits a single uevent to UEVENT_BUFFER_SIZE (2k) */
+#define NVME_MONITOR_MSG_SIZE		8192
+#define NVME_MONITOR_RCVBUF_SIZE	(1024 * 1024)
+#define NVME_MONITOR_KERNEL_GROUP	1
+
+struct nvme_monitor_callback {
+	struct list_node entry;
+	unsigned int mask;
+	nvme_monitor_cb_t cb;
+	void *user_data;
+	bool removed;
+};
+
+struct nvme_monitor {
+	nvme_root_t r;
+	int epoll_fd;
+	int nl_fd;
+	struct list_head callbacks;
+	bool dispatching;
+	char buf[NVME_MONITOR_MSG_SIZE];
+};
+
+static int nvme_monitor_open_netlink(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = NVME_MONITOR_KERNEL_GROUP,
+	};
+	int size = NVME_MONITOR_RCVBUF_SIZE;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+
+	/* bursts are common when a host with many controllers reconnects */
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+nvme_monitor_t nvme_monitor_create(nvme_root_t r)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct nvme_monitor *m;
+	int err;
+
+	m = calloc(1, sizeof(*m));
+	if (!m) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	m->r = r;
+	list_head_init(&m->callbacks);
+
+	m->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (m->epoll_fd < 0)
+		goto free;
+
+	m->nl_fd = nvme_monitor_open_netlink();
+	if (m->nl_fd < 0) {
+		nvme_msg(r, LOG_ERR, "failed to open uevent socket: %s\n",
+			 strerror(errno));
+		goto close_epoll;
+	}
+
+	if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->nl_fd, &ev) < 0)
+		goto close_nl;
+
+	return m;
+
+close_nl:
+	err = errno;
+	close(m->nl_fd);
+	errno = err;
+close_epoll:
+	err = errno;
+	close(m->epoll_fd);
+	errno = err;
+free:
+	free(m);
+	return NULL;
+}
+
+void nvme_monitor_free(nvme_monitor_t m)
+{
+	struct nvme_monitor_callback *cb, *_cb;
+
+	if (!m)
+		return;
+
+	list_for_each_safe(&m->callbacks, cb, _cb, entry) {
+		list_del(&cb->entry);
+		free(cb);
+	}
+	close(m->nl_fd);
+	close(m->epoll_fd);
+	free(m);
+}
+
+int nvme_monitor_add_callback(nvme_monitor_t m, unsigned int mask,
+			      nvme_monitor_cb_t cb, void *user_data)
+{
+	struct nvme_monitor_callback *mcb;
+
+	if (!cb || !(mask & NVME_MONITOR_EVENT_ALL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	mcb = calloc(1, sizeof(*mcb));
+	if (!mcb) {
+		errno = ENOMEM;
+		return -1;
+	}
+	mcb->mask = mask;
+	mcb->cb = cb;
+	mcb->user_data = user_data;
+	list_add_tail(&m->callbacks, &mcb->entry);
+
+	return 0;
+}
+
+int nvme_monitor_remove_callback(nvme_monitor_t m, nvme_monitor_cb_t cb,
+				 void *user_data)
+{
+	struct nvme_monitor_callback *mcb;
+
+	list_for_each(&m->callbacks, mcb, entry) {
+		if (mcb->removed || mcb->cb != cb ||
+		    mcb->user_data != user_data)
+			continue;
+
+		/* unlinked once the current dispatch is done */
+		if (m->dispatching) {
+			mcb->removed = true;
+		} else {
+			list_del(&mcb->entry);
+			free(mcb);
+		}
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+int nvme_monitor_get_fd(nvme_monitor_t m)
+{
+	return m->epoll_fd;
+}
+
+static void nvme_monitor_lookup(nvme_root_t r, struct nvme_monitor_event *ev)
+{
+	nvme_host_t h;
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	nvme_path_t p;
+	nvme_ns_t n;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ns(s, n) {
+				if (!strcmp(nvme_ns_get_name(n), ev->name)) {
+					ev->n = n;
+					return;
+				}
+			}
+			nvme_subsystem_for_each_ctrl(s, c) {
+				/* not connected yet, e.g. from a config file */
+				if (!c->name)
+					continue;
+				if (!strcmp(c->name, ev->name)) {
+					ev->c = c;
+					return;
+				}
+				nvme_ctrl_for_each_ns(c, n) {
+					if (!strcmp(nvme_ns_get_name(n),
+						    ev->name)) {
+						ev->c = c;
+						ev->n = n;
+						return;
+					}
+				}
+				nvme_ctrl_for_each_path(c, p) {
+					if (!strcmp(nvme_path_get_name(p),
+						    ev->name)) {
+						ev->c = c;
+						ev->n = nvme_path_get_ns(p);
+						return;
+					}
+				}
+			}
+		}
+	}
+}
+
+static bool nvme_monitor_parse(char *buf, size_t len,
+			       struct nvme_monitor_event *ev)
+{
+	const char *action = NULL, *devname = NULL, *aen = NULL;
+	char *p, *end = buf + len;
+
+	memset(ev, 0, sizeof(*ev));
+
+	/* "<action>@<devpath>" followed by NUL terminated KEY=value pairs */
+	if (!memchr(buf, '@', strnlen(buf, len)))
+		return false;
+
+	for (p = buf + strnlen(buf, len) + 1; p < end; p += strlen(p) + 1) {
+		if (!memchr(p, '\0', end - p))
+			break;
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "DEVPATH=", 8))
+			ev->devpath = p + 8;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			ev->subsystem = p + 10;
+		else if (!strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+		else if (!strncmp(p, "NVME_AEN=", 9))
+			aen = p + 9;
+		else if (!strncmp(p, "NVME_EVENT=", 11))
+			ev->event = p + 11;
+	}
+
+	if (!action || !ev->devpath || !ev->subsystem)
+		return false;
+	if (strcmp(ev->subsystem, "nvme") && strcmp(ev->subsystem, "block"))
+		return false;
+
+	ev->name = devname ? devname : strrchr(ev->devpath, '/');
+	if (!ev->name)
+		return false;
+	if (ev->name[0] == '/')
+		ev->name++;
+	if (strncmp(ev->name, "nvme", 4))
+		return false;
+
+	if (!strcmp(action, "add")) {
+		ev->type = NVME_MONITOR_EVENT_ADD;
+	} else if (!strcmp(action, "remove")) {
+		ev->type = NVME_MONITOR_EVENT_REMOVE;
+	} else if (!strcmp(action, "change")) {
+		if (aen) {
+			ev->type = NVME_MONITOR_EVENT_AEN;
+			ev->aen = strtoul(aen, NULL, 16);
+			ev->aen_type = ev->aen & 0x07;
+			ev->aen_info = (ev->aen >> 8) & 0xff;
+			ev->aen_lid = (ev->aen >> 16) & 0xff;
+		} else {
+			ev->type = NVME_MONITOR_EVENT_CHANGE;
+		}
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+static void nvme_monitor_dispatch(nvme_monitor_t m,
+				  struct nvme_monitor_event *ev)
+{
+	struct nvme_monitor_callback *mcb, *_mcb;
+
+	m->dispatching = true;
+	list_for_each(&m->callbacks, mcb, entry) {
+		if (!mcb->removed && (mcb->mask & ev->type))
+			mcb->cb(m, ev, mcb->user_data);
+	}
+	m->dispatching = false;
+
+	list_for_each_safe(&m->callbacks, mcb, _mcb, entry) {
+		if (mcb->removed) {
+			list_del(&mcb->entry);
+			free(mcb);
+		}
+	}
+}
+
+/* decodes and dispatches the @len bytes of m->buf, returns if it was an event */
+static bool nvme_monitor_handle(nvme_monitor_t m, size_t len)
+{
+	struct nvme_monitor_event ev;
+
+	m->buf[len] = '\0';
+	if (!nvme_monitor_parse(m->buf, len, &ev))
+		return false;
+
+	nvme_monitor_lookup(m->r, &ev);
+
+	/* callbacks see the ANA group states the event announced */
+	if (ev.type == NVME_MONITOR_EVENT_AEN && ev.c && !m->r->published &&
+	    ev.aen_type == NVME_AER_NOTICE && ev.aen_lid == NVME_LOG_LID_ANA &&
+	    nvme_ctrl_refresh_ana(ev.c))
+		nvme_msg(m->r, LOG_DEBUG, "%s: failed to refresh ANA states\n",
+			 ev.name);
+
+	nvme_monitor_dispatch(m, &ev);
+	return true;
+}
+
+static int nvme_monitor_recv(nvme_monitor_t m)
+{
+	struct sockaddr_nl addr;
+	struct iovec iov = {
+		.iov_base = m->buf,
+		.iov_len = sizeof(m->buf) - 1,
+	};
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	int nr = 0;
+	ssize_t len;
+
+	while (1) {
+		len = recvmsg(m->nl_fd, &msg, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ENOBUFS) {
+				nvme_msg(m->r, LOG_WARNING,
+					 "uevent socket overrun, events lost\n");
+				continue;
+			}
+			return -1;
+		}
+
+		/* only trust messages sent by the kernel */
+		if (addr.nl_pid || msg.msg_flags & MSG_TRUNC)
+			continue;
+
+		if (nvme_monitor_handle(m, len))
+			nr++;
+	}
+
+	return nr;
+}
+
+int nvme_monitor_inject(nvme_monitor_t m, const void *buf, size_t len)
+{
+	if (len >= sizeof(m->buf)) {
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(m->buf, buf, len);
+	return nvme_monitor_handle(m, len);
+}
+
+int nvme_monitor_process(nvme_monitor_t m, int timeout)
+{
+	struct epoll_event ev;
+	int ret;
+
+	do {
+		ret = epoll_wait(m->epoll_fd, &ev, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0)
+		return ret;
+
+	return nvme_monitor_recv(m);
+}
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_MONITOR_H
+#define _LIBNVME_MONITOR_H
+
+#include "tree.h"
+
+/**
+ * DOC: monitor.h
+ *
+ * Kernel event monitoring
+ *
+ * The kernel reports asynchronous event notifications of a controller,
+ * as well as controllers and namespaces coming and going, as uevents.
+ * A monitor receives these for all controllers of a host through a single
+ * netlink socket, decodes them, resolves the objects in the tree they
+ * refer to and dispatches them to the registered callbacks.
+ *
+ * The monitor does not modify the tree: a callback receiving
+ * %NVME_MONITOR_EVENT_ADD or %NVME_MONITOR_EVENT_REMOVE is expected to
+ * refresh it as needed.
+ */
+
+/**
+ * typedef nvme_monitor_t - NVMe kernel event monitor
+ */
+typedef struct nvme_monitor * nvme_monitor_t;
+
+/**
+ * enum nvme_monitor_event_type - Kind of a monitor event
+ * @NVME_MONITOR_EVENT_AEN:	Controller asynchronous event notification
+ * @NVME_MONITOR_EVENT_ADD:	Controller or namespace device added
+ * @NVME_MONITOR_EVENT_REMOVE:	Controller or namespace device removed
+ * @NVME_MONITOR_EVENT_CHANGE:	Any other change of a controller or
+ *				namespace device, e.g. a fabrics
+ *				reconnect
+ * @NVME_MONITOR_EVENT_ALL:	Mask of all event types
+ */
+enum nvme_monitor_event_type {
+	NVME_MONITOR_EVENT_AEN		= 1 << 0,
+	NVME_MONITOR_EVENT_ADD		= 1 << 1,
+	NVME_MONITOR_EVENT_REMOVE	= 1 << 2,
+	NVME_MONITOR_EVENT_CHANGE	= 1 << 3,
+	NVME_MONITOR_EVENT_ALL		= 0xf,
+};
+
+/**
+ * struct nvme_monitor_event - Decoded kernel event
+ * @type:	Event type, see &enum nvme_monitor_event_type
+ * @name:	Kernel device name, e.g. 'nvme0' or 'nvme0n1'
+ * @devpath:	Device path relative to /sys
+ * @subsystem:	Kernel subsystem of the device, e.g. 'nvme' or 'block'
+ * @event:	Value of NVME_EVENT for fabrics events, or NULL
+ * @c:		Controller the event refers to, or NULL if not in the tree
+ * @n:		Namespace the event refers to, or NULL if not in the tree or
+ *		not a namespace event
+ * @aen:	Raw AEN completion dword 0 for %NVME_MONITOR_EVENT_AEN
+ * @aen_type:	Asynchronous event type, see &enum nvme_ae_type
+ * @aen_info:	Asynchronous event information
+ * @aen_lid:	Log page associated with the event
+ *
+ * For an ANA change notice of @c, the monitor has refreshed the ANA group
+ * states of @c with nvme_ctrl_refresh_ana() before the callbacks are run.
+ *
+ * All pointers are only valid for the duration of the callback.
+ */
+struct nvme_monitor_event {
+	enum nvme_monitor_event_type type;
+	const char *name;
+	const char *devpath;
+	const char *subsystem;
+	const char *event;
+	nvme_ctrl_t c;
+	nvme_ns_t n;
+	__u32 aen;
+	__u8 aen_type;
+	__u8 aen_info;
+	__u8 aen_lid;
+};
+
+/**
+ * typedef nvme_monitor_cb_t - Monitor event callback
+ * @m:		Monitor which received the event
+ * @ev:		Decoded event
+ * @user_data:	Pointer passed to nvme_monitor_add_callback()
+ */
+typedef void (*nvme_monitor_cb_t)(nvme_monitor_t m,
+				  struct nvme_monitor_event *ev,
+				  void *user_data);
+
+/**
+ * nvme_monitor_create() - Create an event monitor
+ * @r:		&nvme_root_t object used to resolve devices, must outlive
+ *		the monitor
+ *
+ * Return: New monitor, or NULL with errno set on failure.
+ */
+nvme_monitor_t nvme_monitor_create(nvme_root_t r);
+
+/**
+ * nvme_monitor_free() - Free an event monitor
+ * @m:		Monitor to free
+ */
+void nvme_monitor_free(nvme_monitor_t m);
+
+/**
+ * nvme_monitor_add_callback() - Register an event callback
+ * @m:		Monitor
+ * @mask:	Event types to deliver, see &enum nvme_monitor_event_type
+ * @cb:		Callback
+ * @user_data:	Passed to @cb
+ *
+ * Callbacks are invoked in the order they were registered.
+ *
+ * Return: 0 on success, -1 with errno set otherwise.
+ */
+int nvme_monitor_add_callback(nvme_monitor_t m, unsigned int mask,
+			      nvme_monitor_cb_t cb, void *user_data);
+
+/**
+ * nvme_monitor_remove_callback() - Unregister an event callback
+ * @m:		Monitor
+ * @cb:		Callback passed to nvme_monitor_add_callback()
+ * @user_data:	User data passed to nvme_monitor_add_callback()
+ *
+ * May be called from within a callback.
+ *
+ * Return: 0 on success, -1 with errno set to ENOENT if no such callback
+ * is registered.
+ */
+int nvme_monitor_remove_callback(nvme_monitor_t m, nvme_monitor_cb_t cb,
+				 void *user_data);
+
+/**
+ * nvme_monitor_get_fd() - Pollable file descriptor of a monitor
+ * @m:		Monitor
+ *
+ * The descriptor becomes readable when events are pending, and can be
+ * added to the caller's own poll or epoll set. Call
+ * nvme_monitor_process() with a timeout of 0 once it is readable.
+ *
+ * Return: File descriptor owned by @m.
+ */
+int nvme_monitor_get_fd(nvme_monitor_t m);
+
+/**
+ * nvme_monitor_process() - Wait for and dispatch events
+ * @m:		Monitor
+ * @timeout:	Time to wait for events in milliseconds, 0 to not wait at
+ *		all or -1 to wait indefinitely
+ *
+ * Return: Number of events dispatched, which may be 0 when the timeout
+ * expired, or -1 with errno set on failure.
+ */
+int nvme_monitor_process(nvme_monitor_t m, int timeout);
+
+#endif /* _LIBNVME_MONITOR_H */
@@ -0,0 +1,485 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <ccan/endian/endian.h>
+
+#include "pi.h"
+#include "types.h"
+#include "private.h"
+
+/* T10 DIF, not reflected */
+#define NVME_CRC16_POLY		0x8bb7
+/* NVMe CRC-64, normal form, the tables use it reflected */
+#define NVME_CRC64_POLY		0xad93d23594c93659ULL
+
+/* slicing-by-8 tables, entry [k][b] is the CRC of b followed by k zeroes */
+static __u16 nvme_crc16_table[8][256];
+static __u64 nvme_crc64_table[8][256];
+
+static __u64 nvme_pi_reflect64(__u64 v)
+{
+	__u64 r = 0;
+	int i;
+
+	for (i = 0; i < 64; i++, v >>= 1)
+		r = (r << 1) | (v & 1);
+	return r;
+}
+
+/* x^n modulo the @w bit generator polynomial @poly, in normal form */
+static __u64 nvme_pi_xpow_mod(unsigned int n, __u64 poly, int w)
+{
+	__u64 top = 1ULL << (w - 1), mask = top | (top - 1), r = 1;
+	bool carry;
+
+	while (n--) {
+		carry = r & top;
+		r = (r << 1) & mask;
+		if (carry)
+			r ^= poly;
+	}
+	return r;
+}
+
+static __u16 nvme_crc16_sw(__u16 crc, const __u8 *p, size_t len)
+{
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = (crc << 8) ^ nvme_crc16_table[0][(crc >> 8) ^ *p++];
+
+	for (; len >= 8; len -= 8, p += 8)
+		crc = nvme_crc16_table[7][p[0] ^ (crc >> 8)] ^
+			nvme_crc16_table[6][p[1] ^ (crc & 0xff)] ^
+			nvme_crc16_table[5][p[2]] ^
+			nvme_crc16_table[4][p[3]] ^
+			nvme_crc16_table[3][p[4]] ^
+			nvme_crc16_table[2][p[5]] ^
+			nvme_crc16_table[1][p[6]] ^
+			nvme_crc16_table[0][p[7]];
+
+	while (len--)
+		crc = (crc << 8) ^ nvme_crc16_table[0][(crc >> 8) ^ *p++];
+	return crc;
+}
+
+/* @crc is the CRC register, without the inversion */
+static __u64 nvme_crc64_sw(__u64 crc, const __u8 *p, size_t len)
+{
+	__u64 v;
+
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = (crc >> 8) ^ nvme_crc64_table[0][(crc ^ *p++) & 0xff];
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		v = le64_to_cpu(v) ^ crc;
+		crc = nvme_crc64_table[7][v & 0xff] ^
+			nvme_crc64_table[6][(v >> 8) & 0xff] ^
+			nvme_crc64_table[5][(v >> 16) & 0xff] ^
+			nvme_crc64_table[4][(v >> 24) & 0xff] ^
+			nvme_crc64_table[3][(v >> 32) & 0xff] ^
+			nvme_crc64_table[2][(v >> 40) & 0xff] ^
+			nvme_crc64_table[1][(v >> 48) & 0xff] ^
+			nvme_crc64_table[0][v >> 56];
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ nvme_crc64_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+
+/*
+ * Folding with carry-less multiplication: a 128 bit block A followed by
+ * D bits of data is congruent to A_hi * (x^(D+64) mod P) + A_lo *
+ * (x^D mod P) followed by the same data, so the data is reduced to a
+ * single 128 bit block 16 or 64 bytes at a time, four blocks in parallel.
+ * The resulting block and the tail then go through the table code.
+ */
+struct nvme_pi_fold {
+	__u64 k128[2];
+	__u64 k512[2];
+};
+
+static struct nvme_pi_fold nvme_crc16_fold, nvme_crc64_fold;
+
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i nvme_pi_fold(__m128i x, __m128i k, __m128i next)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					   _mm_clmulepi64_si128(x, k, 0x11)),
+			     next);
+}
+
+/*
+ * Reduces @len bytes, a multiple of 16 and at least 64, to 16 bytes in
+ * @out. @bswap loads the blocks big endian for CRCs which are not
+ * reflected, @init is already in block position.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static void nvme_pi_fold_blocks(const struct nvme_pi_fold *f, bool bswap,
+				__m128i init, const __u8 *p, size_t len,
+				__u8 *out)
+{
+	const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					  8, 9, 10, 11, 12, 13, 14, 15);
+	const __m128i k128 = _mm_loadu_si128((const __m128i *)f->k128);
+	const __m128i k512 = _mm_loadu_si128((const __m128i *)f->k512);
+	__m128i x[4], v;
+	int i;
+
+#define NVME_PI_LOAD(p) (bswap ? \
+	_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), swap) : \
+	_mm_loadu_si128((const __m128i *)(p)))
+
+	for (i = 0; i < 4; i++)
+		x[i] = NVME_PI_LOAD(p + i * 16);
+	x[0] = _mm_xor_si128(x[0], init);
+	p += 64;
+	len -= 64;
+
+	for (; len >= 64; len -= 64, p += 64) {
+		for (i = 0; i < 4; i++)
+			x[i] = nvme_pi_fold(x[i], k512,
+					    NVME_PI_LOAD(p + i * 16));
+	}
+
+	v = nvme_pi_fold(x[0], k128, x[1]);
+	v = nvme_pi_fold(v, k128, x[2]);
+	v = nvme_pi_fold(v, k128, x[3]);
+
+	for (; len; len -= 16, p += 16)
+		v = nvme_pi_fold(v, k128, NVME_PI_LOAD(p));
+
+	if (bswap)
+		v = _mm_shuffle_epi8(v, swap);
+	_mm_storeu_si128((__m128i *)out, v);
+#undef NVME_PI_LOAD
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static __u16 nvme_crc16_hw(__u16 crc, const __u8 *p, size_t len)
+{
+	size_t n = len & ~(size_t)15;
+	__u8 block[16];
+
+	if (len < 64)
+		return nvme_crc16_sw(crc, p, len);
+
+	/* the register lines up with the first two bytes */
+	nvme_pi_fold_blocks(&nvme_crc16_fold, true,
+			    _mm_set_epi64x((__u64)crc << 48, 0), p, n, block);
+	crc = nvme_crc16_sw(0, block, sizeof(block));
+	return nvme_crc16_sw(crc, p + n, len - n);
+}
+
+__attribute__((target("pclmul,sse4.1")))
+static __u64 nvme_crc64_hw(__u64 crc, const __u8 *p, size_t len)
+{
+	size_t n = len & ~(size_t)15;
+	__u8 block[16];
+
+	if (len < 64)
+		return nvme_crc64_sw(crc, p, len);
+
+	/* reflected, the register lines up with the first eight bytes */
+	nvme_pi_fold_blocks(&nvme_crc64_fold, false,
+			    _mm_set_epi64x(0, crc), p, n, block);
+	crc = nvme_crc64_sw(0, block, sizeof(block));
+	return nvme_crc64_sw(crc, p + n, len - n);
+}
+
+static bool nvme_pi_hw_init(void)
+{
+	int i;
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("pclmul") ||
+	    !__builtin_cpu_supports("sse4.1"))
+		return false;
+
+	/*
+	 * Block registers hold the first bytes in the high half when loaded
+	 * big endian, in the low half when reflected. A reflected product
+	 * comes out one bit short, which the constants make up for.
+	 */
+	for (i = 0; i < 2; i++) {
+		unsigned int d = i ? 512 : 128;
+		__u64 *k16 = i ? nvme_crc16_fold.k512 : nvme_crc16_fold.k128;
+		__u64 *k64 = i ? nvme_crc64_fold.k512 : nvme_crc64_fold.k128;
+
+		k16[0] = nvme_pi_xpow_mod(d, NVME_CRC16_POLY, 16);
+		k16[1] = nvme_pi_xpow_mod(d + 64, NVME_CRC16_POLY, 16);
+		k64[0] = nvme_pi_reflect64(nvme_pi_xpow_mod(d + 63,
+						NVME_CRC64_POLY, 64));
+		k64[1] = nvme_pi_reflect64(nvme_pi_xpow_mod(d - 1,
+						NVME_CRC64_POLY, 64));
+	}
+	return true;
+}
+#else
+#define nvme_crc16_hw nvme_crc16_sw
+#define nvme_crc64_hw nvme_crc64_sw
+
+static bool nvme_pi_hw_init(void)
+{
+	return false;
+}
+#endif
+
+static __u16 (*nvme_crc16_fn)(__u16 crc, const __u8 *p, size_t len) =
+	nvme_crc16_sw;
+static __u64 (*nvme_crc64_fn)(__u64 crc, const __u8 *p, size_t len) =
+	nvme_crc64_sw;
+static bool nvme_pi_have_hw;
+
+/* runs at load time, so guard calculation needs no locking */
+__attribute__((constructor))
+static void nvme_pi_crc_init(void)
+{
+	__u64 reflected = nvme_pi_reflect64(NVME_CRC64_POLY), c64;
+	__u16 c16;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c16 = i << 8;
+		c64 = i;
+		for (j = 0; j < 8; j++) {
+			c16 = (c16 << 1) ^ ((c16 & 0x8000) ? NVME_CRC16_POLY : 0);
+			c64 = (c64 >> 1) ^ ((c64 & 1) ? reflected : 0);
+		}
+		nvme_crc16_table[0][i] = c16;
+		nvme_crc64_table[0][i] = c64;
+	}
+	for (i = 0; i < 256; i++) {
+		c16 = nvme_crc16_table[0][i];
+		c64 = nvme_crc64_table[0][i];
+		for (j = 1; j < 8; j++) {
+			c16 = (c16 << 8) ^ nvme_crc16_table[0][c16 >> 8];
+			c64 = (c64 >> 8) ^ nvme_crc64_table[0][c64 & 0xff];
+			nvme_crc16_table[j][i] = c16;
+			nvme_crc64_table[j][i] = c64;
+		}
+	}
+
+	nvme_pi_have_hw = nvme_pi_hw_init();
+	nvme_pi_crc_use_hw(true);
+}
+
+bool nvme_pi_crc_use_hw(bool hw)
+{
+	hw = hw && nvme_pi_have_hw;
+	nvme_crc16_fn = hw ? nvme_crc16_hw : nvme_crc16_sw;
+	nvme_crc64_fn = hw ? nvme_crc64_hw : nvme_crc64_sw;
+	return hw;
+}
+
+__u16 nvme_crc16_t10dif(__u16 crc, const void *buf, size_t len)
+{
+	return nvme_crc16_fn(crc, buf, len);
+}
+
+__u64 nvme_crc64_nvme(__u64 crc, const void *buf, size_t len)
+{
+	return ~nvme_crc64_fn(~crc, buf, len);
+}
+
+static __u64 nvme_pi_mask(unsigned int bits)
+{
+	return bits >= 64 ? ~0ULL : (1ULL << bits) - 1;
+}
+
+/* size of the protection information and of its storage and reference tag */
+static int nvme_pi_sizes(const struct nvme_pi_format *fmt,
+			 unsigned int *pi_size, unsigned int *tag_bits)
+{
+	switch (fmt->pif) {
+	case NVME_PI_GUARD_16:
+		*pi_size = 8;
+		*tag_bits = 32;
+		break;
+	case NVME_PI_GUARD_64:
+		*pi_size = 16;
+		*tag_bits = 48;
+		break;
+	case NVME_PI_GUARD_32:
+		errno = EOPNOTSUPP;
+		return -1;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fmt->pi_type == NVME_NS_DPS_PI_NONE ||
+	    fmt->pi_type > NVME_NS_DPS_PI_TYPE3 || fmt->ms < *pi_size ||
+	    fmt->sts > *tag_bits || !fmt->lba_size) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+struct nvme_pi_block {
+	const __u8 *data;
+	__u8 *pi;
+	__u32 guard_len;
+};
+
+/* the guard covers the data and any metadata in front of the PI */
+static void nvme_pi_locate(const struct nvme_pi_format *fmt, const void *data,
+			   const void *meta, __u32 i, unsigned int pi_size,
+			   struct nvme_pi_block *b)
+{
+	unsigned int off = fmt->pi_first ? 0 : fmt->ms - pi_size;
+	const __u8 *md;
+
+	if (fmt->extended) {
+		b->data = (const __u8 *)data +
+			(size_t)i * (fmt->lba_size + fmt->ms);
+		b->pi = (__u8 *)b->data + fmt->lba_size + off;
+		b->guard_len = fmt->lba_size + off;
+		return;
+	}
+
+	b->data = (const __u8 *)data + (size_t)i * fmt->lba_size;
+	md = (const __u8 *)meta + (size_t)i * fmt->ms;
+	b->pi = (__u8 *)md + off;
+	b->guard_len = off;
+}
+
+static __u64 nvme_pi_guard(const struct nvme_pi_format *fmt,
+			   const struct nvme_pi_block *b)
+{
+	const __u8 *md;
+
+	if (fmt->extended) {
+		if (fmt->pif == NVME_PI_GUARD_16)
+			return nvme_crc16_t10dif(0, b->data, b->guard_len);
+		return nvme_crc64_nvme(0, b->data, b->guard_len);
+	}
+
+	md = b->pi - b->guard_len;
+	if (fmt->pif == NVME_PI_GUARD_16)
+		return nvme_crc16_t10dif(nvme_crc16_t10dif(0, b->data,
+							   fmt->lba_size),
+					 md, b->guard_len);
+	return nvme_crc64_nvme(nvme_crc64_nvme(0, b->data, fmt->lba_size),
+			       md, b->guard_len);
+}
+
+static __u64 nvme_pi_get_be(const __u8 *p, unsigned int len)
+{
+	__u64 v = 0;
+
+	while (len--)
+		v = (v << 8) | *p++;
+	return v;
+}
+
+static void nvme_pi_put_be(__u8 *p, __u64 v, unsigned int len)
+{
+	while (len--) {
+		p[len] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+int nvme_pi_generate(const struct nvme_pi_format *fmt, void *data, void *meta,
+		     __u32 nlb, __u64 reftag, __u16 apptag, __u64 storage_tag)
+{
+	unsigned int pi_size, tag_bits, ref_bits, glen;
+	struct nvme_pi_block b;
+	__u64 tag, ref;
+	__u32 i;
+
+	if (nvme_pi_sizes(fmt, &pi_size, &tag_bits))
+		return -1;
+	if (!data || (!fmt->extended && !meta)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	glen = pi_size == 8 ? 2 : 8;
+	ref_bits = tag_bits - fmt->sts;
+	for (i = 0; i < nlb; i++) {
+		nvme_pi_locate(fmt, data, meta, i, pi_size, &b);
+
+		ref = reftag;
+		if (fmt->pi_type != NVME_NS_DPS_PI_TYPE3)
+			ref += i;
+		tag = (ref & nvme_pi_mask(ref_bits)) |
+			(fmt->sts ? storage_tag << ref_bits : 0);
+
+		nvme_pi_put_be(b.pi, nvme_pi_guard(fmt, &b), glen);
+		nvme_pi_put_be(b.pi + glen, apptag, 2);
+		nvme_pi_put_be(b.pi + glen + 2, tag & nvme_pi_mask(tag_bits),
+			       tag_bits / 8);
+	}
+	return 0;
+}
+
+int nvme_pi_verify(const struct nvme_pi_format *fmt, const void *data,
+		   const void *meta, __u32 nlb, __u64 reftag, __u16 apptag,
+		   __u16 appmask, __u64 storage_tag, unsigned int checks,
+		   __u32 *block)
+{
+	unsigned int pi_size, tag_bits, ref_bits, glen;
+	__u64 tag, expect, tag_mask;
+	struct nvme_pi_block b;
+	__u16 app;
+	__u32 i;
+
+	if (nvme_pi_sizes(fmt, &pi_size, &tag_bits))
+		return -1;
+	if (!data || (!fmt->extended && !meta)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	glen = pi_size == 8 ? 2 : 8;
+	ref_bits = tag_bits - fmt->sts;
+	tag_mask = nvme_pi_mask(tag_bits);
+	for (i = 0; i < nlb; i++) {
+		nvme_pi_locate(fmt, data, meta, i, pi_size, &b);
+		app = nvme_pi_get_be(b.pi + glen, 2);
+		tag = nvme_pi_get_be(b.pi + glen + 2, tag_bits / 8);
+
+		/* escape values, the block is not checked */
+		if (app == 0xffff && (fmt->pi_type != NVME_NS_DPS_PI_TYPE3 ||
+				      tag == tag_mask))
+			continue;
+
+		if ((checks & NVME_IO_PRINFO_PRCHK_GUARD) &&
+		    nvme_pi_get_be(b.pi, glen) != nvme_pi_guard(fmt, &b))
+			goto fail;
+
+		if ((checks & NVME_IO_PRINFO_PRCHK_APP) &&
+		    ((app ^ apptag) & appmask))
+			goto fail;
+
+		if (!(checks & NVME_IO_PRINFO_PRCHK_REF))
+			continue;
+
+		expect = fmt->sts ? storage_tag << ref_bits : 0;
+		if (fmt->pi_type != NVME_NS_DPS_PI_TYPE3)
+			expect |= (reftag + i) & nvme_pi_mask(ref_bits);
+		else
+			expect |= tag & nvme_pi_mask(ref_bits);
+		if (tag != (expect & tag_mask))
+			goto fail;
+	}
+	return 0;
+
+fail:
+	if (block)
+		*block = i;
+	errno = EILSEQ;
+	return -1;
+}
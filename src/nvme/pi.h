@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_PI_H
+#define _LIBNVME_PI_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "tree.h"
+
+/**
+ * DOC: pi.h
+ *
+ * End-to-end protection information
+ *
+ * A namespace formatted with protection information carries a guard, an
+ * application tag and a reference tag, optionally combined with a storage
+ * tag, in the metadata of every logical block. Unless the controller
+ * inserts and strips them (PRACT set), the host has to generate them
+ * before a write and can verify them after a read. The guard is a CRC of
+ * the logical block data, which these helpers compute with carry-less
+ * multiplication where the CPU supports it.
+ */
+
+/**
+ * enum nvme_pi_guard - Protection information formats
+ * @NVME_PI_GUARD_16: 8 bytes with a 16 bit CRC guard (T10 DIF)
+ * @NVME_PI_GUARD_32: 16 bytes with a 32 bit CRC guard
+ * @NVME_PI_GUARD_64: 16 bytes with a 64 bit CRC guard
+ */
+enum nvme_pi_guard {
+	NVME_PI_GUARD_16	= 0,
+	NVME_PI_GUARD_32	= 1,
+	NVME_PI_GUARD_64	= 2,
+};
+
+/**
+ * struct nvme_pi_format - Protection information layout of a namespace
+ * @lba_size:	Logical block data size in bytes
+ * @ms:		Metadata size per logical block in bytes
+ * @pi_type:	Protection information type, see &enum nvme_id_ns_dps, or
+ *		%NVME_NS_DPS_PI_NONE if protection is disabled
+ * @pif:	Protection information format, see &enum nvme_pi_guard
+ * @sts:	Storage tag size in bits
+ * @pi_first:	Protection information is in the first bytes of the metadata
+ *		instead of the last
+ * @extended:	Metadata is interleaved with the data of each logical block
+ *		instead of being transferred in a separate buffer
+ */
+struct nvme_pi_format {
+	__u32	lba_size;
+	__u16	ms;
+	__u8	pi_type;
+	__u8	pif;
+	__u8	sts;
+	bool	pi_first;
+	bool	extended;
+};
+
+/**
+ * nvme_ns_get_pi_format() - Protection information layout of a namespace
+ * @n:		Namespace instance
+ * @fmt:	Filled with the layout of the LBA format in use
+ *
+ * The layout is read with the Identify Namespace data when the namespace
+ * is initialized, for a namespace with protection information enabled
+ * including the I/O Command Set specific data which holds the protection
+ * information format and storage tag size.
+ *
+ * Return: 0 on success, or -1 with errno set if @n has not been
+ * identified.
+ */
+int nvme_ns_get_pi_format(nvme_ns_t n, struct nvme_pi_format *fmt);
+
+/**
+ * nvme_pi_generate() - Generate protection information for logical blocks
+ * @fmt:	Protection information layout
+ * @data:	Logical block data, with the metadata interleaved if
+ *		@fmt->extended is set
+ * @meta:	Metadata buffer, unused if @fmt->extended is set
+ * @nlb:	Number of logical blocks
+ * @reftag:	Reference tag of the first block, incremented for every
+ *		following block unless the namespace uses Type 3 protection
+ * @apptag:	Application tag
+ * @storage_tag: Storage tag, if @fmt->sts is not 0
+ *
+ * Fills the protection information of @nlb blocks, leaving the other
+ * metadata bytes alone. For formats with the protection information in
+ * the last bytes, the guard covers the metadata bytes in front of them.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise. errno is set to
+ * EOPNOTSUPP for the 32 bit guard format.
+ */
+int nvme_pi_generate(const struct nvme_pi_format *fmt, void *data, void *meta,
+		     __u32 nlb, __u64 reftag, __u16 apptag, __u64 storage_tag);
+
+/**
+ * nvme_pi_verify() - Verify protection information of logical blocks
+ * @fmt:	Protection information layout
+ * @data:	Logical block data, with the metadata interleaved if
+ *		@fmt->extended is set
+ * @meta:	Metadata buffer, unused if @fmt->extended is set
+ * @nlb:	Number of logical blocks
+ * @reftag:	Expected reference tag of the first block
+ * @apptag:	Expected application tag
+ * @appmask:	Bits of the application tag which are compared
+ * @storage_tag: Expected storage tag, if @fmt->sts is not 0
+ * @checks:	Fields to check, a combination of %NVME_IO_PRINFO_PRCHK_GUARD,
+ *		%NVME_IO_PRINFO_PRCHK_APP and %NVME_IO_PRINFO_PRCHK_REF
+ * @block:	Set to the index of the first block that failed, may be NULL
+ *
+ * Checks blocks the same way a controller does: blocks with an
+ * application tag of all ones, for Type 3 protection together with a
+ * reference tag of all ones, are not checked. The storage tag is compared
+ * together with the reference tag.
+ *
+ * Return: 0 if all blocks are intact, or -1 with errno set otherwise.
+ * errno is set to EILSEQ if a check failed and to EOPNOTSUPP for the 32
+ * bit guard format.
+ */
+int nvme_pi_verify(const struct nvme_pi_format *fmt, const void *data,
+		   const void *meta, __u32 nlb, __u64 reftag, __u16 apptag,
+		   __u16 appmask, __u64 storage_tag, unsigned int checks,
+		   __u32 *block);
+
+/**
+ * nvme_crc16_t10dif() - CRC of the 16 bit guard format
+ * @crc:	Value returned for the preceding data, or 0 to start
+ * @buf:	Data
+ * @len:	Length of @buf in bytes
+ *
+ * Return: The T10 DIF CRC (polynomial 0x8bb7) of the data so far.
+ */
+__u16 nvme_crc16_t10dif(__u16 crc, const void *buf, size_t len);
+
+/**
+ * nvme_crc64_nvme() - CRC of the 64 bit guard format
+ * @crc:	Value returned for the preceding data, or 0 to start
+ * @buf:	Data
+ * @len:	Length of @buf in bytes
+ *
+ * Return: The NVMe CRC-64 (polynomial 0xad93d23594c93659, reflected,
+ * inverted) of the data so far.
+ */
+__u64 nvme_crc64_nvme(__u64 crc, const void *buf, size_t len);
+
+#endif /* _LIBNVME_PI_H */
@@ -11,10 +11,16 @@
 
 #include <ccan/list/list.h>
 #include <poll.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+
+#include <sys/uio.h>
 
 #include "fabrics.h"
 #include "mi.h"
+#include "monitor.h"
 
 #include <uuid.h>
 
@@ -23,6 +29,42 @@ extern const char *nvme_ctrl_sysfs_dir;
 extern const char *nvme_subsys_sysfs_dir;
 extern const char *nvme_ns_sysfs_dir;
 
+/*
+ * Intrusive hash table indexing the tree nodes for lookups. Entries
+ * keep the hash they were inserted with for rehashing, and the sequence
+ * number of their list insertion: lookups return the matching entry
+ * with the highest one, which is the first one found by a list walk.
+ * A table which once failed to allocate its buckets is not used.
+ */
+struct nvme_hnode {
+	struct nvme_hnode *next;
+	struct nvme_hnode **pprev;
+	unsigned int hash;
+	unsigned long seq;
+};
+
+struct nvme_htable {
+	struct nvme_hnode **buckets;
+	unsigned int size;
+	unsigned int nr;
+	bool failed;
+};
+
+void nvme_htable_add(struct nvme_htable *t, struct nvme_hnode *node,
+		     unsigned int hash);
+void nvme_htable_del(struct nvme_htable *t, struct nvme_hnode *node);
+void nvme_htable_free(struct nvme_htable *t);
+
+static inline struct nvme_hnode *nvme_htable_first(struct nvme_htable *t,
+						   unsigned int hash)
+{
+	return t->size ? t->buckets[hash & (t->size - 1)] : NULL;
+}
+
+unsigned int nvme_hash_ptr(const void *ptr);
+unsigned int nvme_hash_str(unsigned int hash, const char *str, bool icase);
+unsigned int nvme_hash_mem(unsigned int hash, const void *buf, size_t len);
+
 struct nvme_path {
 	struct list_node entry;
 	struct list_node nentry;
@@ -33,17 +75,20 @@ struct nvme_path {
 	char *name;
 	char *sysfs_dir;
 	char *ana_state;
+	int ana_state_fd;
 	int grpid;
 };
 
 struct nvme_ns {
 	struct list_node entry;
+	struct nvme_hnode hnode;
 	struct list_head paths;
 
 	struct nvme_subsystem *s;
 	struct nvme_ctrl *c;
 
 	int fd;
+	int generic_fd;
 	__u32 nsid;
 	char *name;
 	char *generic_name;
@@ -52,6 +97,12 @@ struct nvme_ns {
 	int lba_shift;
 	int lba_size;
 	int meta_size;
+	__u8 pi_type;
+	__u8 pif;
+	__u8 sts;
+	bool pi_first;
+	bool meta_ext;
+	unsigned int path_rr;
 	uint64_t lba_count;
 	uint64_t lba_util;
 
@@ -59,10 +110,29 @@ struct nvme_ns {
 	uint8_t nguid[16];
 	uuid_t  uuid;
 	enum nvme_csi csi;
+
+	struct nvme_uring *ring;
+	struct nvme_buf_pool *pool;
+	bool polled;
+
+	__u32 max_xfer_len;
+	unsigned int max_segments;
+	__u64 io_boundary;
+	bool rw_limits_valid;
+
+	bool identified;
+	bool pending;
+	int scan_errno;
+};
+
+struct nvme_ana_group_state {
+	__u32 grpid;
+	__u8 state;
 };
 
 struct nvme_ctrl {
 	struct list_node entry;
+	struct nvme_hnode hnode;
 	struct list_head paths;
 	struct list_head namespaces;
 	struct nvme_subsystem *s;
@@ -74,6 +144,7 @@ struct nvme_ctrl {
 	char *firmware;
 	char *model;
 	char *state;
+	int state_fd;
 	char *numa_node;
 	char *queue_count;
 	char *serial;
@@ -89,10 +160,27 @@ struct nvme_ctrl {
 	bool discovered;
 	bool persistent;
 	struct nvme_fabrics_config cfg;
+
+	/* last discovery log, see nvmf_get_discovery_log_cached() */
+	struct nvmf_discovery_log *disc_log;
+
+	/* transfer limits, read on first use */
+	bool xfer_valid;
+	__u8 mdts;
+	__u8 mpsmin;
+	__u32 max_xfer_len;
+	__u32 fw_gran;
+
+	/* ANA group states sorted by group, see nvme_ctrl_refresh_ana() */
+	bool ana_valid;
+	unsigned int nr_ana_groups;
+	struct nvme_ana_group_state *ana_groups;
+	__u64 ana_chgcnt;
 };
 
 struct nvme_subsystem {
 	struct list_node entry;
+	struct nvme_hnode hnode;
 	struct list_head ctrls;
 	struct list_head namespaces;
 	struct nvme_host *h;
@@ -108,6 +196,7 @@ struct nvme_subsystem {
 
 struct nvme_host {
 	struct list_node entry;
+	struct nvme_hnode hnode;
 	struct list_head subsystems;
 	struct nvme_root *r;
 
@@ -126,10 +215,71 @@ struct nvme_root {
 	bool log_pid;
 	bool log_timestamp;
 	bool modified;
+
+	struct nvme_slab *host_slab;
+	struct nvme_slab *subsys_slab;
+	struct nvme_slab *ctrl_slab;
+	struct nvme_slab *ns_slab;
+	struct nvme_slab *path_slab;
+
+	/* lookup indexes, see nvme_hnode */
+	unsigned long index_seq;
+	struct nvme_htable host_index;
+	struct nvme_htable subsys_index;
+	struct nvme_htable ctrl_index;
+	struct nvme_htable ns_index;
+
+	unsigned int scan_threads;
+	bool lazy_ns_identify;
+	bool scanning;
+	struct nvme_ns **pending_ns;
+	int nr_pending_ns;
+	int max_pending_ns;
+
+	/* see nvme_gen_dhchap_key_cached() */
+	struct nvme_dhchap_cache *dhchap_cache;
+
+	/* see nvme_root_set_resolver_ttl() */
+	struct nvme_resolver_cache *resolver_cache;
+	unsigned int resolver_ttl;
+
+	/* see nvme_root_set_cache_attr_fds() */
+	bool cache_attr_fds;
+
+	/* generation of an nvme_topology, read concurrently and immutable */
+	bool published;
+	int refs;
 };
 
+void nvme_dhchap_cache_free(struct nvme_dhchap_cache *cache);
+
+/*
+ * Fills the caches the getters would otherwise fill on first use (transfer
+ * limits, ANA group states), so that a published tree is only read.
+ */
+void nvme_prepare_published(nvme_root_t r);
+
+/* seconds a resolved hostname is cached for unless set otherwise */
+#define NVME_RESOLVER_DEFAULT_TTL	60
+
+void nvme_resolver_cache_free(struct nvme_resolver_cache *cache);
+
+/*
+ * Resolves the hostnames which are not cached yet concurrently and adds
+ * them to the cache of @r, so that hostname2traddr() finds them.
+ */
+int nvme_resolve_hostnames(nvme_root_t r, const char * const *hostnames,
+			   unsigned int nr, unsigned int max_parallel);
+
 int nvme_set_attr(const char *dir, const char *attr, const char *value);
 
+/*
+ * Keep an attribute open to cheaply read its current value again with
+ * nvme_reread_attr(), for volatile attributes such as the state.
+ */
+int nvme_open_attr(const char *dir, const char *attr);
+char *nvme_reread_attr(int fd);
+
 int json_read_config(nvme_root_t r, const char *config_file);
 
 int json_update_config(nvme_root_t r, const char *config_file);
@@ -141,6 +291,76 @@ nvme_ctrl_t __nvme_lookup_ctrl(nvme_subsystem_t s, const char *transport,
 			       const char *host_iface, const char *trsvcid,
 			       nvme_ctrl_t p);
 
+/* re-index a linked controller after changing its transport address */
+void nvme_ctrl_reindex(nvme_ctrl_t c);
+
+/*
+ * Index or link objects built by hand, such as those of a snapshot. The
+ * objects are added to the head of their list.
+ */
+void nvme_index_host(nvme_root_t r, struct nvme_host *h);
+void nvme_index_subsystem(nvme_root_t r, struct nvme_subsystem *s);
+void nvme_link_ctrl(struct nvme_subsystem *s, struct nvme_ctrl *c);
+void nvme_index_ns(nvme_root_t r, struct nvme_ns *n);
+
+int nvme_io_init_cmd(struct nvme_io_args *args, __u8 opcode,
+		     struct nvme_passthru_cmd *cmd);
+
+void nvme_get_log_init_cmd(struct nvme_get_log_args *args,
+			   struct nvme_passthru_cmd *cmd);
+
+__u32 nvme_xfer_len_from_mdts(__u8 mdts, __u8 mpsmin, __u32 max);
+
+/* both layouts are identical up to the result field */
+static inline void nvme_passthru_cmd_to_64(struct nvme_passthru_cmd *cmd,
+					   struct nvme_passthru_cmd64 *cmd64)
+{
+	memset(cmd64, 0, sizeof(*cmd64));
+	memcpy(cmd64, cmd, offsetof(struct nvme_passthru_cmd, result));
+}
+
+struct nvme_buf_pool;
+struct nvme_uring;
+
+int nvme_buf_pool_set_ring(struct nvme_buf_pool *pool, struct nvme_uring *ring);
+
+/*
+ * Vectored I/O passthrough: the addr of @cmd points to an array of
+ * struct iovec and its data_len is the number of entries.
+ */
+int nvme_uring_queue_io_passthru64_vec(struct nvme_uring *ring, int fd,
+				       struct nvme_passthru_cmd64 *cmd,
+				       void *user_data);
+
+/*
+ * nvme_submit_io_passthru_batch() for vectored commands, which are sent
+ * with NVME_IOCTL_IO64_CMD_VEC without io_uring. Kernels without them
+ * complete the commands with -ENOTTY.
+ */
+int nvme_submit_io_passthru_vec_batch(int fd, struct nvme_passthru_cmd64 *cmds,
+				      int nr_cmds, int *status);
+
+/*
+ * Fixed size object allocator for the tree nodes. Freed objects are
+ * reused, and the memory is returned in chunks once the slab has been
+ * destroyed and its last object freed. A NULL slab falls back to
+ * calloc(), nvme_slab_free() handles both.
+ */
+struct nvme_slab;
+
+struct nvme_slab *nvme_slab_create(size_t size, unsigned int per_chunk);
+void nvme_slab_destroy(struct nvme_slab *slab);
+void *nvme_slab_zalloc(struct nvme_slab *slab, size_t size);
+void nvme_slab_free(void *ptr);
+
+/*
+ * Calls @fn for every index below @nr_items, spread over up to
+ * @nr_threads threads including the caller. Returns once all calls
+ * have finished.
+ */
+void nvme_run_parallel(unsigned int nr_threads, unsigned int nr_items,
+		       void (*fn)(unsigned int idx, void *arg), void *arg);
+
 #if (LOG_FUNCNAME == 1)
 #define __nvme_log_func __func__
 #else
@@ -160,11 +380,22 @@ __nvme_msg(nvme_root_t r, int lvl, const char *func, const char *format, ...);
 /* mi internal headers */
 
 /* internal transport API */
+
+/*
+ * Message data is either the single buffer at data, or, if data_iov is
+ * set, scattered over data_iovcnt vectors. data_len is the total size in
+ * both cases; for responses it is the space available on submission and
+ * the size received on completion.
+ */
+#define NVME_MI_MAX_DATA_IOV	16
+
 struct nvme_mi_req {
 	struct nvme_mi_msg_hdr *hdr;
 	size_t hdr_len;
 	void *data;
 	size_t data_len;
+	const struct iovec *data_iov;
+	int data_iovcnt;
 	__u32 mic;
 };
 
@@ -173,20 +404,77 @@ struct nvme_mi_resp {
 	size_t hdr_len;
 	void *data;
 	size_t data_len;
+	const struct iovec *data_iov;
+	int data_iovcnt;
 	__u32 mic;
 };
 
+/* copies @len bytes from offset @off of message data to @buf */
+void nvme_mi_data_read(void *data, const struct iovec *iov, int iovcnt,
+		       size_t off, void *buf, size_t len);
+
+/* Number of NVMe-MI command slots, each may hold one outstanding request */
+#define NVME_MI_NR_SLOTS	2
+
+/* An outstanding request, matched to its response by command slot */
+struct nvme_mi_xfer {
+	struct nvme_mi_req *req;
+	struct nvme_mi_resp *resp;
+	bool done;
+	int rc;
+	int err;
+
+	/* transport state */
+	__u8 tag;
+	__le32 mic;
+	struct timespec deadline;
+
+	struct timespec start;
+};
+
+/*
+ * Transports may implement send/recv to allow outstanding requests on
+ * both command slots of an endpoint. recv waits for at least one of the
+ * given transfers to complete, setting done, rc and err of it; with
+ * nowait it only processes what has already arrived or timed out.
+ * get_fd returns a descriptor which becomes readable on a response, for
+ * waiting on many endpoints at once.
+ */
 struct nvme_mi_transport {
 	const char *name;
 	bool mic_enabled;
 	int (*submit)(struct nvme_mi_ep *ep,
 		      struct nvme_mi_req *req,
 		      struct nvme_mi_resp *resp);
+	int (*send)(struct nvme_mi_ep *ep, struct nvme_mi_xfer *xfer);
+	int (*recv)(struct nvme_mi_ep *ep, struct nvme_mi_xfer **xfers,
+		    int nr, bool nowait);
+	int (*get_fd)(struct nvme_mi_ep *ep);
 	void (*close)(struct nvme_mi_ep *ep);
 	int (*desc_ep)(struct nvme_mi_ep *ep, char *buf, size_t len);
 	int (*check_timeout)(struct nvme_mi_ep *ep, unsigned int timeout);
 };
 
+/* latency history of one command, in log2-sized microsecond buckets */
+#define NVME_MI_LAT_BUCKETS	32
+
+struct nvme_mi_lat {
+	__u8 type;
+	__u8 opcode;
+	__u32 count;
+	__u32 timeouts;
+	__u64 sum_us;
+	__u32 min_us;
+	__u32 max_us;
+	__u32 hist[NVME_MI_LAT_BUCKETS];
+};
+
+/* a cached Port Information data structure */
+struct nvme_mi_port_cache {
+	__u8 portid;
+	struct nvme_mi_read_port_info info;
+};
+
 struct nvme_mi_ep {
 	struct nvme_root *root;
 	const struct nvme_mi_transport *transport;
@@ -196,6 +484,22 @@ struct nvme_mi_ep {
 	bool controllers_scanned;
 	unsigned int timeout;
 	unsigned int mprt_max;
+	size_t xfer_size;
+	unsigned int max_inflight;
+	struct nvme_mi_lat *lat;
+	unsigned int nr_lat;
+	unsigned int adaptive_pct;
+	unsigned int adaptive_factor;
+	nvme_mi_cmd_hook_t cmd_hook;
+	void *cmd_hook_data;
+
+	/* MI data structures, see nvme_mi_ep_set_data_cache() */
+	bool cache_enabled;
+	bool subsys_cached;
+	bool ctrl_list_stale;
+	struct nvme_mi_read_nvm_ss_info subsys;
+	struct nvme_mi_port_cache *ports;
+	unsigned int nr_ports;
 };
 
 struct nvme_mi_ctrl {
@@ -206,9 +510,37 @@ struct nvme_mi_ctrl {
 
 struct nvme_mi_ep *nvme_mi_init_ep(struct nvme_root *root);
 
+/*
+ * Pipelined submission, for transports with send/recv: start a request
+ * on the command slot set in its header, then wait for at least one
+ * of the started ones to complete.
+ */
+int nvme_mi_submit_start(nvme_mi_ep_t ep, struct nvme_mi_xfer *xfer);
+int nvme_mi_submit_wait(nvme_mi_ep_t ep, struct nvme_mi_xfer **xfers, int nr,
+			bool nowait);
+
+/*
+ * Response timeout for @req in milliseconds, 0 for none: ep->timeout, or
+ * less once adaptive timeouts are enabled and the command has a history.
+ */
+unsigned int nvme_mi_ep_req_timeout(nvme_mi_ep_t ep, struct nvme_mi_req *req);
+
+/* milliseconds until the deadline of @xfer, or -1 if it has none */
+int nvme_mi_xfer_time_left(struct nvme_mi_xfer *xfer,
+			   const struct timespec *now);
+
 /* for tests, we need to calculate the correct MICs */
 __u32 nvme_mi_crc32_update(__u32 crc, void *data, size_t len);
 
+/* for tests, handles @buf as if it was a uevent received from the kernel */
+int nvme_monitor_inject(nvme_monitor_t m, const void *buf, size_t len);
+
+/*
+ * For tests, selects the carry-less multiplication or the table code for
+ * the protection information CRCs. Returns whether the former is in use.
+ */
+bool nvme_pi_crc_use_hw(bool hw);
+
 /* we have a facility to mock MCTP socket operations in the mi-mctp transport,
  * using this ops type. This should only be used for test, and isn't exposed
  * in the shared lib */;
@@ -222,4 +554,19 @@ struct __mi_mctp_socket_ops {
 };
 void __nvme_mi_mctp_set_ops(const struct __mi_mctp_socket_ops *newops);
 
+/* The passthrough ioctls can be redirected the same way, which the command
+ * recorder and replay use. NULL restores the ioctl() system call. The ops
+ * have to stay valid until they are replaced, and may be called from any
+ * thread. */
+struct __nvme_ioctl_ops {
+	int (*ioctl)(int fd, unsigned long req, void *arg);
+};
+void __nvme_set_ioctl_ops(const struct __nvme_ioctl_ops *newops);
+
+/* Commands queued on an io_uring bypass the ops, the command hooks and the
+ * latency statistics, so the internal users of uring passthrough have to
+ * check this before every batch and send the commands one by one with the
+ * ioctls while it is false. */
+bool nvme_uring_passthru_enabled(void);
+
 #endif /* _LIBNVME_PRIVATE_H */
@@ -0,0 +1,387 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+
+#include <ccan/endian/endian.h>
+#include <ccan/list/list.h>
+
+#include "ioctl.h"
+#include "progress.h"
+
+/* progress is kept in units of 1/65536, like the sanitize progress */
+#define NVME_PROGRESS_MAX		65536
+
+#define NVME_PROGRESS_MIN_INTERVAL	(100ULL * 1000 * 1000)
+#define NVME_PROGRESS_MAX_INTERVAL	(10ULL * 1000 * 1000 * 1000)
+
+struct nvme_progress_entry {
+	struct list_node entry;
+	int fd;
+	enum nvme_progress_op op;
+	__u32 nsid;
+	nvme_progress_cb_t cb;
+	void *user_data;
+	bool removed;
+
+	__u64 due;
+	__u64 interval;
+	__u64 changed;
+	unsigned int progress;
+	int percent;
+};
+
+struct nvme_progress {
+	int timer_fd;
+	struct list_head ops;
+	bool dispatching;
+};
+
+static __u64 nvme_progress_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+nvme_progress_t nvme_progress_create(void)
+{
+	struct nvme_progress *p;
+
+	p = calloc(1, sizeof(*p));
+	if (!p) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	list_head_init(&p->ops);
+
+	p->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (p->timer_fd < 0) {
+		free(p);
+		return NULL;
+	}
+
+	return p;
+}
+
+void nvme_progress_free(nvme_progress_t p)
+{
+	struct nvme_progress_entry *e, *_e;
+
+	if (!p)
+		return;
+
+	list_for_each_safe(&p->ops, e, _e, entry) {
+		list_del(&e->entry);
+		free(e);
+	}
+	close(p->timer_fd);
+	free(p);
+}
+
+/* arm the timer for the operation which is due first */
+static void nvme_progress_arm(nvme_progress_t p)
+{
+	struct itimerspec its = { };
+	struct nvme_progress_entry *e;
+	__u64 due = 0;
+
+	list_for_each(&p->ops, e, entry) {
+		if (!e->removed && (!due || e->due < due))
+			due = e->due;
+	}
+
+	/* an all zero expiry disarms the timer */
+	if (due) {
+		its.it_value.tv_sec = due / 1000000000ULL;
+		its.it_value.tv_nsec = due % 1000000000ULL;
+	}
+	timerfd_settime(p->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int nvme_progress_add(nvme_progress_t p, int fd, enum nvme_progress_op op,
+		      __u32 nsid, nvme_progress_cb_t cb, void *user_data)
+{
+	struct nvme_progress_entry *e;
+
+	if (fd < 0 || !cb || op > NVME_PROGRESS_FORMAT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (!e) {
+		errno = ENOMEM;
+		return -1;
+	}
+	e->fd = fd;
+	e->op = op;
+	e->nsid = op == NVME_PROGRESS_FORMAT ? nsid : NVME_NSID_NONE;
+	e->cb = cb;
+	e->user_data = user_data;
+	e->due = nvme_progress_now();
+	e->changed = e->due;
+	e->interval = NVME_PROGRESS_MIN_INTERVAL;
+	e->percent = -1;
+	list_add_tail(&p->ops, &e->entry);
+
+	if (!p->dispatching)
+		nvme_progress_arm(p);
+	return 0;
+}
+
+int nvme_progress_remove(nvme_progress_t p, int fd, enum nvme_progress_op op)
+{
+	struct nvme_progress_entry *e;
+
+	list_for_each(&p->ops, e, entry) {
+		if (e->removed || e->fd != fd || e->op != op)
+			continue;
+
+		/* unlinked once the current dispatch is done */
+		if (p->dispatching) {
+			e->removed = true;
+		} else {
+			list_del(&e->entry);
+			free(e);
+			nvme_progress_arm(p);
+		}
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+void nvme_progress_kick(nvme_progress_t p)
+{
+	struct nvme_progress_entry *e;
+	__u64 now = nvme_progress_now();
+
+	list_for_each(&p->ops, e, entry)
+		e->due = now;
+	if (!p->dispatching)
+		nvme_progress_arm(p);
+}
+
+int nvme_progress_get_fd(nvme_progress_t p)
+{
+	return p->timer_fd;
+}
+
+/* rounded up, so the percentage reported back is the one read */
+static unsigned int nvme_progress_from_percent(unsigned int percent)
+{
+	return (percent * NVME_PROGRESS_MAX + 99) / 100;
+}
+
+static int nvme_progress_err(int err)
+{
+	return err < 0 ? -errno : -EIO;
+}
+
+static int nvme_progress_poll_sanitize(struct nvme_progress_entry *e,
+				       struct nvme_progress_event *ev)
+{
+	struct nvme_sanitize_log_page log;
+	int err;
+
+	/* reading the log clears the sanitize completed event */
+	err = nvme_get_log_sanitize(e->fd, false, &log);
+	if (err)
+		return nvme_progress_err(err);
+
+	switch (NVME_GET(le16_to_cpu(log.sstat), SANITIZE_SSTAT_STATUS)) {
+	case NVME_SANITIZE_SSTAT_STATUS_IN_PROGESS:
+		e->progress = le16_to_cpu(log.sprog);
+		break;
+	case NVME_SANITIZE_SSTAT_STATUS_COMPLETE_SUCCESS:
+	case NVME_SANITIZE_SSTAT_STATUS_ND_COMPLETE_SUCCESS:
+		ev->done = true;
+		break;
+	case NVME_SANITIZE_SSTAT_STATUS_COMPLETED_FAILED:
+		ev->done = true;
+		ev->status = NVME_SANITIZE_SSTAT_STATUS_COMPLETED_FAILED;
+		break;
+	default:
+		return -ENOENT;
+	}
+	return 0;
+}
+
+static int nvme_progress_poll_self_test(struct nvme_progress_entry *e,
+					struct nvme_progress_event *ev)
+{
+	struct nvme_self_test_log log;
+	int err;
+
+	err = nvme_get_log_device_self_test(e->fd, &log);
+	if (err)
+		return nvme_progress_err(err);
+
+	if (log.current_operation & NVME_ST_CURR_OP_MASK) {
+		e->progress = nvme_progress_from_percent(log.completion &
+						NVME_ST_CURR_OP_CMPL_MASK);
+		return 0;
+	}
+
+	/* the newest result is the one of the test which just finished */
+	ev->done = true;
+	ev->status = log.result[0].dsts & NVME_ST_RESULT_MASK;
+	if (ev->status == NVME_ST_RESULT_NOT_USED)
+		return -ENOENT;
+	return 0;
+}
+
+static int nvme_progress_poll_format(struct nvme_progress_entry *e,
+				     struct nvme_progress_event *ev)
+{
+	struct nvme_id_ns ns;
+	int err;
+
+	err = nvme_identify_ns(e->fd, e->nsid, &ns);
+	/* some controllers don't answer for a namespace being formatted */
+	if (err > 0 && (nvme_status_code(err) == NVME_SC_FORMAT_IN_PROGRESS ||
+			nvme_status_code(err) == NVME_SC_NS_NOT_READY))
+		return 0;
+	if (err)
+		return nvme_progress_err(err);
+
+	if (!(ns.fpi & NVME_NS_FPI_SUPPORTED))
+		return -EOPNOTSUPP;
+
+	if (!(ns.fpi & NVME_NS_FPI_REMAINING))
+		ev->done = true;
+	else
+		e->progress = nvme_progress_from_percent(100 -
+						(ns.fpi & NVME_NS_FPI_REMAINING));
+	return 0;
+}
+
+/*
+ * Poll again when the operation is expected to have made another percent
+ * of progress at the rate seen since it last changed, and back off while
+ * it does not make any.
+ */
+static void nvme_progress_schedule(struct nvme_progress_entry *e,
+				   unsigned int old, __u64 now)
+{
+	__u64 interval;
+
+	if (e->progress > old) {
+		interval = (now - e->changed) * (NVME_PROGRESS_MAX / 100) /
+			(e->progress - old);
+		e->changed = now;
+	} else {
+		interval = e->interval * 2;
+	}
+
+	if (interval < NVME_PROGRESS_MIN_INTERVAL)
+		interval = NVME_PROGRESS_MIN_INTERVAL;
+	if (interval > NVME_PROGRESS_MAX_INTERVAL)
+		interval = NVME_PROGRESS_MAX_INTERVAL;
+	e->interval = interval;
+	e->due = now + interval;
+}
+
+/* returns true if the operation finished */
+static bool nvme_progress_poll(nvme_progress_t p,
+			       struct nvme_progress_entry *e, __u64 now)
+{
+	struct nvme_progress_event ev = {
+		.op = e->op,
+		.fd = e->fd,
+		.nsid = e->nsid,
+	};
+	unsigned int old = e->progress;
+	int err;
+
+	switch (e->op) {
+	case NVME_PROGRESS_SANITIZE:
+		err = nvme_progress_poll_sanitize(e, &ev);
+		break;
+	case NVME_PROGRESS_SELF_TEST:
+		err = nvme_progress_poll_self_test(e, &ev);
+		break;
+	case NVME_PROGRESS_FORMAT:
+	default:
+		err = nvme_progress_poll_format(e, &ev);
+		break;
+	}
+
+	if (err) {
+		ev.done = true;
+		ev.status = err;
+	}
+	if (ev.done && !ev.status)
+		e->progress = NVME_PROGRESS_MAX;
+	if (e->progress > NVME_PROGRESS_MAX)
+		e->progress = NVME_PROGRESS_MAX;
+	ev.percent = e->progress * 100 / NVME_PROGRESS_MAX;
+
+	if (ev.done || (int)ev.percent != e->percent) {
+		e->percent = ev.percent;
+		e->cb(p, &ev, e->user_data);
+	}
+
+	if (!ev.done)
+		nvme_progress_schedule(e, old, now);
+	return ev.done;
+}
+
+int nvme_progress_process(nvme_progress_t p, int timeout)
+{
+	struct nvme_progress_entry *e, *_e;
+	struct pollfd pfd = {
+		.fd = p->timer_fd,
+		.events = POLLIN,
+	};
+	__u64 expirations, now;
+	int ret, nr = 0;
+
+	if (list_empty(&p->ops))
+		return 0;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+
+	if (read(p->timer_fd, &expirations, sizeof(expirations)) < 0 &&
+	    errno != EAGAIN)
+		return -1;
+
+	now = nvme_progress_now();
+	p->dispatching = true;
+	list_for_each(&p->ops, e, entry) {
+		if (e->removed || e->due > now)
+			continue;
+		if (nvme_progress_poll(p, e, now))
+			e->removed = true;
+	}
+	p->dispatching = false;
+
+	list_for_each_safe(&p->ops, e, _e, entry) {
+		if (e->removed) {
+			list_del(&e->entry);
+			free(e);
+		} else {
+			nr++;
+		}
+	}
+
+	nvme_progress_arm(p);
+	return nr;
+}
@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_PROGRESS_H
+#define _LIBNVME_PROGRESS_H
+
+#include <stdbool.h>
+
+#include "types.h"
+
+/**
+ * DOC: progress.h
+ *
+ * Tracking long running operations
+ *
+ * Sanitize, device self-test and format operations keep running on the
+ * controller after the command which started them has completed. A
+ * progress tracker polls the Sanitize Status log page, the Device
+ * Self-test log page or the Format Progress Indicator of the namespace
+ * for any number of operations on any number of controllers, and
+ * dispatches a callback whenever the progress of an operation changed
+ * and once when it finished.
+ *
+ * Each operation is polled on its own schedule: often while it is making
+ * progress quickly, and less and less often while it is not, based on
+ * the rate of progress seen so far. nvme_progress_kick() makes the
+ * tracker poll all operations right away, e.g. from a monitor callback
+ * receiving the asynchronous event which reports the completion of a
+ * sanitize operation.
+ *
+ * A tracker is driven by calling nvme_progress_process(), either in a
+ * loop on a thread of its own or whenever the descriptor returned by
+ * nvme_progress_get_fd() becomes readable. A tracker must only be used
+ * from one thread at a time.
+ */
+
+/**
+ * typedef nvme_progress_t - Tracker for long running operations
+ */
+typedef struct nvme_progress * nvme_progress_t;
+
+/**
+ * enum nvme_progress_op - Kind of a tracked operation
+ * @NVME_PROGRESS_SANITIZE:	Sanitize operation of the NVM subsystem,
+ *				tracked with the Sanitize Status log page
+ * @NVME_PROGRESS_SELF_TEST:	Device self-test operation, tracked with the
+ *				Device Self-test log page
+ * @NVME_PROGRESS_FORMAT:	Format NVM operation of a namespace, tracked
+ *				with the Format Progress Indicator of the
+ *				Identify Namespace data structure
+ */
+enum nvme_progress_op {
+	NVME_PROGRESS_SANITIZE,
+	NVME_PROGRESS_SELF_TEST,
+	NVME_PROGRESS_FORMAT,
+};
+
+/**
+ * struct nvme_progress_event - Progress of a tracked operation
+ * @op:		Kind of the operation
+ * @fd:		File descriptor the operation is tracked on
+ * @nsid:	Namespace of the operation
+ * @percent:	Completed part of the operation, from 0 to 100
+ * @done:	The operation finished, and is no longer tracked after the
+ *		callback returns
+ * @status:	When @done, 0 if the operation completed successfully, a
+ *		positive value if it failed and a negative errno value if
+ *		tracking it failed. For a sanitize operation a failure is
+ *		reported as %NVME_SANITIZE_SSTAT_STATUS_COMPLETED_FAILED,
+ *		for a device self-test as the result of the test, see
+ *		&enum nvme_st_result.
+ */
+struct nvme_progress_event {
+	enum nvme_progress_op op;
+	int fd;
+	__u32 nsid;
+	unsigned int percent;
+	bool done;
+	int status;
+};
+
+/**
+ * typedef nvme_progress_cb_t - Progress callback
+ * @p:		Tracker which polled the operation
+ * @ev:		Progress of the operation
+ * @user_data:	Pointer passed to nvme_progress_add()
+ */
+typedef void (*nvme_progress_cb_t)(nvme_progress_t p,
+				   struct nvme_progress_event *ev,
+				   void *user_data);
+
+/**
+ * nvme_progress_create() - Create a progress tracker
+ *
+ * Return: New tracker, or NULL with errno set on failure.
+ */
+nvme_progress_t nvme_progress_create(void);
+
+/**
+ * nvme_progress_free() - Free a progress tracker
+ * @p:		Tracker to free
+ *
+ * Operations which are still tracked are dropped without calling their
+ * callbacks.
+ */
+void nvme_progress_free(nvme_progress_t p);
+
+/**
+ * nvme_progress_add() - Track a long running operation
+ * @p:		Tracker
+ * @fd:		File descriptor of the controller or namespace, which must
+ *		stay open while the operation is tracked
+ * @op:		Kind of the operation
+ * @nsid:	Namespace being formatted for %NVME_PROGRESS_FORMAT, ignored
+ *		otherwise
+ * @cb:		Callback
+ * @user_data:	Passed to @cb
+ *
+ * To be called once the command starting the operation completed. The
+ * operation is first polled by the next call to nvme_progress_process().
+ * May be called from within a callback.
+ *
+ * Return: 0 on success, -1 with errno set otherwise.
+ */
+int nvme_progress_add(nvme_progress_t p, int fd, enum nvme_progress_op op,
+		      __u32 nsid, nvme_progress_cb_t cb, void *user_data);
+
+/**
+ * nvme_progress_remove() - Stop tracking an operation
+ * @p:		Tracker
+ * @fd:		File descriptor passed to nvme_progress_add()
+ * @op:		Kind of the operation passed to nvme_progress_add()
+ *
+ * May be called from within a callback.
+ *
+ * Return: 0 on success, -1 with errno set to ENOENT if no such operation
+ * is tracked.
+ */
+int nvme_progress_remove(nvme_progress_t p, int fd, enum nvme_progress_op op);
+
+/**
+ * nvme_progress_kick() - Poll all tracked operations right away
+ * @p:		Tracker
+ *
+ * The operations are polled by the next call to nvme_progress_process(),
+ * regardless of their schedule.
+ */
+void nvme_progress_kick(nvme_progress_t p);
+
+/**
+ * nvme_progress_get_fd() - Pollable file descriptor of a tracker
+ * @p:		Tracker
+ *
+ * The descriptor becomes readable when an operation is due to be polled,
+ * and can be added to the caller's own poll or epoll set. Call
+ * nvme_progress_process() with a timeout of 0 once it is readable.
+ *
+ * Return: File descriptor owned by @p.
+ */
+int nvme_progress_get_fd(nvme_progress_t p);
+
+/**
+ * nvme_progress_process() - Poll the operations which are due
+ * @p:		Tracker
+ * @timeout:	Time to wait for an operation to become due in milliseconds,
+ *		0 to not wait at all or -1 to wait until one is due
+ *
+ * Polls all operations which are due, dispatches the callbacks and stops
+ * tracking the operations which finished.
+ *
+ * Return: Number of operations still tracked, or -1 with errno set on
+ * failure. Returns 0 without waiting if no operation is tracked.
+ */
+int nvme_progress_process(nvme_progress_t p, int timeout);
+
+#endif /* _LIBNVME_PROGRESS_H */
@@ -0,0 +1,470 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "ioctl.h"
+#include "replay.h"
+#include "private.h"
+
+#define NVME_REPLAY_MAGIC	"LIBNVMER"
+#define NVME_REPLAY_VERSION	1
+
+/* data and metadata are padded to keep the records aligned */
+#define NVME_REPLAY_ALIGN(x)	(((__u64)(x) + 7) & ~7ULL)
+
+#define NVME_REPLAY_ADMIN	(1 << 0)
+#define NVME_REPLAY_64		(1 << 1)
+
+struct nvme_replay_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 rec_size;
+};
+
+/* what identifies a command, compared as a whole */
+struct nvme_replay_cmd {
+	__u8 opcode;
+	__u8 flags;
+	__u16 rsvd;
+	__u32 nsid;
+	__u32 cdw2;
+	__u32 cdw3;
+	__u32 cdw10;
+	__u32 cdw11;
+	__u32 cdw12;
+	__u32 cdw13;
+	__u32 cdw14;
+	__u32 cdw15;
+	__u32 data_len;
+	__u32 metadata_len;
+};
+
+/* followed by data_out bytes of data and meta_out bytes of metadata, each
+ * padded to a multiple of 8 bytes */
+struct nvme_replay_rec {
+	struct nvme_replay_cmd cmd;
+	__s32 status;
+	__u32 data_out;
+	__u32 meta_out;
+	__u32 rsvd;
+	__u64 result;
+	__u64 start_ns;
+	__u64 duration_ns;
+};
+
+struct nvme_replay_entry {
+	const struct nvme_replay_rec *rec;
+	const void *data;
+	const void *meta;
+	bool used;
+};
+
+enum {
+	NVME_REPLAY_IDLE,
+	NVME_REPLAY_RECORDING,
+	NVME_REPLAY_REPLAYING,
+};
+
+static struct {
+	pthread_mutex_t lock;
+	int mode;
+	/* recording */
+	FILE *fp;
+	int err;
+	struct timespec start;
+	/* replay */
+	unsigned int flags;
+	void *buf;
+	struct nvme_replay_entry *entries;
+	size_t nr_entries;
+	size_t next;
+} replay = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __u64 nvme_replay_ns(const struct timespec *from,
+			    const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000000ULL +
+		to->tv_nsec - from->tv_nsec;
+}
+
+static void nvme_replay_cmd_init(struct nvme_replay_cmd *c,
+				 unsigned long req,
+				 const struct nvme_passthru_cmd *cmd)
+{
+	memset(c, 0, sizeof(*c));
+	c->opcode = cmd->opcode;
+	if (req == NVME_IOCTL_ADMIN_CMD || req == NVME_IOCTL_ADMIN64_CMD)
+		c->flags |= NVME_REPLAY_ADMIN;
+	if (req == NVME_IOCTL_ADMIN64_CMD || req == NVME_IOCTL_IO64_CMD)
+		c->flags |= NVME_REPLAY_64;
+	c->nsid = cmd->nsid;
+	c->cdw2 = cmd->cdw2;
+	c->cdw3 = cmd->cdw3;
+	c->cdw10 = cmd->cdw10;
+	c->cdw11 = cmd->cdw11;
+	c->cdw12 = cmd->cdw12;
+	c->cdw13 = cmd->cdw13;
+	c->cdw14 = cmd->cdw14;
+	c->cdw15 = cmd->cdw15;
+	c->data_len = cmd->data_len;
+	c->metadata_len = cmd->metadata_len;
+}
+
+/* the two low opcode bits give the data direction, 2 is to the host */
+static bool nvme_replay_to_host(__u8 opcode)
+{
+	return opcode & 2;
+}
+
+static int nvme_record_data(FILE *fp, __u64 addr, __u32 len)
+{
+	static const char pad[8];
+	size_t n = NVME_REPLAY_ALIGN(len) - len;
+
+	if (len && fwrite((void *)(uintptr_t)addr, len, 1, fp) != 1)
+		return -1;
+	if (n && fwrite(pad, n, 1, fp) != 1)
+		return -1;
+	return 0;
+}
+
+static int nvme_record_ioctl(int fd, unsigned long req, void *arg)
+{
+	struct nvme_passthru_cmd *cmd = arg;
+	struct nvme_replay_rec rec;
+	struct timespec start, end;
+	int err, errno_save;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	err = ioctl(fd, req, arg);
+	errno_save = errno;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	memset(&rec, 0, sizeof(rec));
+	nvme_replay_cmd_init(&rec.cmd, req, cmd);
+	rec.status = err < 0 ? -errno_save : err;
+	rec.duration_ns = nvme_replay_ns(&start, &end);
+	if (err >= 0) {
+		if (rec.cmd.flags & NVME_REPLAY_64)
+			rec.result = ((struct nvme_passthru_cmd64 *)arg)->result;
+		else
+			rec.result = cmd->result;
+		if (nvme_replay_to_host(cmd->opcode)) {
+			if (cmd->addr)
+				rec.data_out = cmd->data_len;
+			if (cmd->metadata)
+				rec.meta_out = cmd->metadata_len;
+		}
+	}
+
+	pthread_mutex_lock(&replay.lock);
+	if (replay.fp && !replay.err) {
+		rec.start_ns = nvme_replay_ns(&replay.start, &start);
+		if (fwrite(&rec, sizeof(rec), 1, replay.fp) != 1 ||
+		    nvme_record_data(replay.fp, cmd->addr, rec.data_out) ||
+		    nvme_record_data(replay.fp, cmd->metadata, rec.meta_out))
+			replay.err = errno ? errno : EIO;
+	}
+	pthread_mutex_unlock(&replay.lock);
+
+	errno = errno_save;
+	return err;
+}
+
+static const struct __nvme_ioctl_ops nvme_record_ops = {
+	.ioctl = nvme_record_ioctl,
+};
+
+int nvme_ioctl_record_start(const char *path)
+{
+	struct nvme_replay_hdr hdr = {
+		.magic = NVME_REPLAY_MAGIC,
+		.version = NVME_REPLAY_VERSION,
+		.rec_size = sizeof(struct nvme_replay_rec),
+	};
+	FILE *fp;
+	int err;
+
+	pthread_mutex_lock(&replay.lock);
+	if (replay.mode != NVME_REPLAY_IDLE) {
+		pthread_mutex_unlock(&replay.lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	fp = fopen(path, "w");
+	if (!fp)
+		goto unlock;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) {
+		err = errno;
+		fclose(fp);
+		errno = err;
+		goto unlock;
+	}
+
+	replay.fp = fp;
+	replay.err = 0;
+	clock_gettime(CLOCK_MONOTONIC, &replay.start);
+	replay.mode = NVME_REPLAY_RECORDING;
+	__nvme_set_ioctl_ops(&nvme_record_ops);
+	pthread_mutex_unlock(&replay.lock);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&replay.lock);
+	return -1;
+}
+
+int nvme_ioctl_record_stop(void)
+{
+	int err;
+
+	pthread_mutex_lock(&replay.lock);
+	if (replay.mode != NVME_REPLAY_RECORDING) {
+		pthread_mutex_unlock(&replay.lock);
+		return 0;
+	}
+
+	__nvme_set_ioctl_ops(NULL);
+	err = replay.err;
+	if (fclose(replay.fp) && !err)
+		err = errno;
+	replay.fp = NULL;
+	replay.mode = NVME_REPLAY_IDLE;
+	pthread_mutex_unlock(&replay.lock);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int nvme_replay_ioctl(int fd, unsigned long req, void *arg)
+{
+	struct nvme_passthru_cmd *cmd = arg;
+	const struct nvme_replay_rec *rec = NULL;
+	struct nvme_replay_entry *e;
+	struct nvme_replay_cmd key;
+	struct timespec start, end;
+	unsigned int flags;
+	__u64 duration_ns;
+	size_t i;
+	int status;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	nvme_replay_cmd_init(&key, req, cmd);
+
+	pthread_mutex_lock(&replay.lock);
+	for (i = replay.next; i < replay.nr_entries; i++) {
+		e = &replay.entries[i];
+		if (!e->used && !memcmp(&e->rec->cmd, &key, sizeof(key))) {
+			rec = e->rec;
+			break;
+		}
+	}
+	if (!rec) {
+		pthread_mutex_unlock(&replay.lock);
+		errno = ENOMSG;
+		return -1;
+	}
+
+	e->used = true;
+	while (replay.next < replay.nr_entries &&
+	       replay.entries[replay.next].used)
+		replay.next++;
+
+	if (rec->data_out)
+		memcpy((void *)(uintptr_t)cmd->addr, e->data, rec->data_out);
+	if (rec->meta_out)
+		memcpy((void *)(uintptr_t)cmd->metadata, e->meta,
+		       rec->meta_out);
+	if (rec->status >= 0) {
+		if (key.flags & NVME_REPLAY_64)
+			((struct nvme_passthru_cmd64 *)arg)->result = rec->result;
+		else
+			cmd->result = rec->result;
+	}
+	status = rec->status;
+	duration_ns = rec->duration_ns;
+	flags = replay.flags;
+	pthread_mutex_unlock(&replay.lock);
+
+	if (flags & NVME_IOCTL_REPLAY_TIMING) {
+		end.tv_sec = start.tv_sec + duration_ns / 1000000000ULL;
+		end.tv_nsec = start.tv_nsec + duration_ns % 1000000000ULL;
+		if (end.tv_nsec >= 1000000000L) {
+			end.tv_sec++;
+			end.tv_nsec -= 1000000000L;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &end,
+				       NULL) == EINTR)
+			;
+	}
+
+	if (status < 0) {
+		errno = -status;
+		return -1;
+	}
+	return status;
+}
+
+static const struct __nvme_ioctl_ops nvme_replay_ops = {
+	.ioctl = nvme_replay_ioctl,
+};
+
+static void *nvme_replay_read(const char *path, size_t *len)
+{
+	struct stat st;
+	void *buf;
+	FILE *fp;
+	int err;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+	if (fstat(fileno(fp), &st))
+		goto close;
+
+	*len = st.st_size;
+	buf = malloc(*len ? *len : 1);
+	if (!buf)
+		goto close;
+	if (*len && fread(buf, *len, 1, fp) != 1) {
+		free(buf);
+		errno = EIO;
+		goto close;
+	}
+	fclose(fp);
+	return buf;
+
+close:
+	err = errno;
+	fclose(fp);
+	errno = err;
+	return NULL;
+}
+
+static int nvme_replay_index(void *buf, size_t len)
+{
+	const struct nvme_replay_hdr *hdr = buf;
+	const struct nvme_replay_rec *rec;
+	struct nvme_replay_entry *entries = NULL, *tmp;
+	size_t nr = 0, max = 0, off = sizeof(*hdr);
+
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, NVME_REPLAY_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != NVME_REPLAY_VERSION ||
+	    hdr->rec_size != sizeof(*rec))
+		goto invalid;
+
+	while (off < len) {
+		rec = (const void *)((char *)buf + off);
+		if (len - off < sizeof(*rec) ||
+		    len - off - sizeof(*rec) <
+		    NVME_REPLAY_ALIGN(rec->data_out) +
+		    NVME_REPLAY_ALIGN(rec->meta_out) ||
+		    rec->data_out > rec->cmd.data_len ||
+		    rec->meta_out > rec->cmd.metadata_len)
+			goto invalid;
+
+		if (nr == max) {
+			max = max ? max * 2 : 256;
+			tmp = realloc(entries, max * sizeof(*entries));
+			if (!tmp) {
+				free(entries);
+				return -1;
+			}
+			entries = tmp;
+		}
+		entries[nr].rec = rec;
+		entries[nr].data = rec + 1;
+		entries[nr].meta = (const char *)(rec + 1) +
+			NVME_REPLAY_ALIGN(rec->data_out);
+		entries[nr].used = false;
+		nr++;
+		off += sizeof(*rec) + NVME_REPLAY_ALIGN(rec->data_out) +
+			NVME_REPLAY_ALIGN(rec->meta_out);
+	}
+
+	replay.entries = entries;
+	replay.nr_entries = nr;
+	replay.next = 0;
+	return 0;
+
+invalid:
+	free(entries);
+	errno = EINVAL;
+	return -1;
+}
+
+int nvme_ioctl_replay_start(const char *path, unsigned int flags)
+{
+	size_t len;
+	void *buf;
+
+	pthread_mutex_lock(&replay.lock);
+	if (replay.mode != NVME_REPLAY_IDLE) {
+		pthread_mutex_unlock(&replay.lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	buf = nvme_replay_read(path, &len);
+	if (!buf)
+		goto unlock;
+	if (nvme_replay_index(buf, len)) {
+		free(buf);
+		goto unlock;
+	}
+
+	replay.buf = buf;
+	replay.flags = flags;
+	replay.mode = NVME_REPLAY_REPLAYING;
+	__nvme_set_ioctl_ops(&nvme_replay_ops);
+	pthread_mutex_unlock(&replay.lock);
+	return 0;
+
+unlock:
+	pthread_mutex_unlock(&replay.lock);
+	return -1;
+}
+
+int nvme_ioctl_replay_stop(void)
+{
+	size_t i;
+	int left = 0;
+
+	pthread_mutex_lock(&replay.lock);
+	if (replay.mode != NVME_REPLAY_REPLAYING) {
+		pthread_mutex_unlock(&replay.lock);
+		return 0;
+	}
+
+	__nvme_set_ioctl_ops(NULL);
+	for (i = replay.next; i < replay.nr_entries; i++)
+		left += !replay.entries[i].used;
+	free(replay.entries);
+	free(replay.buf);
+	replay.entries = NULL;
+	replay.nr_entries = 0;
+	replay.buf = NULL;
+	replay.mode = NVME_REPLAY_IDLE;
+	pthread_mutex_unlock(&replay.lock);
+
+	return left;
+}
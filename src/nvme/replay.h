@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_REPLAY_H
+#define _LIBNVME_REPLAY_H
+
+#include <stdbool.h>
+
+/**
+ * DOC: replay.h
+ *
+ * Recording and replaying passthrough commands
+ *
+ * The recorder writes every admin and I/O passthrough command sent through
+ * the synchronous ioctl interface to a file, together with its completion,
+ * the data it returned and the time it took. Replaying that file answers
+ * the same commands from the file instead of a device, so a workflow
+ * which was recorded once on a machine with real drives can be rerun and
+ * profiled anywhere, with the original command latencies or as fast as
+ * possible.
+ *
+ * While replaying, the file descriptor a command is sent on is not used,
+ * so any open file, e.g. /dev/null, can stand in for the device. Commands
+ * are matched by opcode, namespace, command dwords and transfer length,
+ * in the order they were recorded; a command which was recorded several
+ * times is answered with its recordings in turn. Commands sent on an
+ * io_uring submission context, and other ioctls such as nvme_get_nsid(),
+ * are neither recorded nor replayed.
+ *
+ * Recordings are in host byte order and only replay on machines of the
+ * same endianness.
+ */
+
+/**
+ * nvme_ioctl_record_start() - Record all passthrough commands to a file
+ * @path:	File to write, created or truncated
+ *
+ * Return: 0 on success, or -1 with errno set otherwise. errno is set to
+ * EBUSY if a recording or replay is already active.
+ */
+int nvme_ioctl_record_start(const char *path);
+
+/**
+ * nvme_ioctl_record_stop() - Stop recording passthrough commands
+ *
+ * Return: 0 on success, or -1 with errno set if writing the recording
+ * failed.
+ */
+int nvme_ioctl_record_stop(void);
+
+/**
+ * enum nvme_ioctl_replay_flags - Replay flags
+ * @NVME_IOCTL_REPLAY_TIMING:	Take as long for each command as it took when
+ *				its completion was recorded, instead of
+ *				completing it right away
+ */
+enum nvme_ioctl_replay_flags {
+	NVME_IOCTL_REPLAY_TIMING	= 1 << 0,
+};
+
+/**
+ * nvme_ioctl_replay_start() - Answer passthrough commands from a recording
+ * @path:	File written by nvme_ioctl_record_start()
+ * @flags:	Replay flags, see &enum nvme_ioctl_replay_flags
+ *
+ * Until nvme_ioctl_replay_stop() is called, passthrough commands are not
+ * sent to a device. A command found in the recording completes with the
+ * recorded status, result and data. A command which is not in the
+ * recording, or whose recordings have all been used, fails with errno
+ * set to ENOMSG.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise. errno is set to
+ * EINVAL if @path is not a valid recording, and to EBUSY if a recording
+ * or replay is already active.
+ */
+int nvme_ioctl_replay_start(const char *path, unsigned int flags);
+
+/**
+ * nvme_ioctl_replay_stop() - Send passthrough commands to devices again
+ *
+ * Return: Number of recorded commands which were not replayed.
+ */
+int nvme_ioctl_replay_stop(void);
+
+#endif /* _LIBNVME_REPLAY_H */
@@ -0,0 +1,750 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <ccan/endian/endian.h>
+
+#include "ioctl.h"
+#include "sampler.h"
+#include "uring.h"
+#include "private.h"
+
+#define NVME_SAMPLER_URING_DEPTH	64
+
+/* timestamp, status and every value, each as a varint of up to 10 bytes */
+#define NVME_SAMPLER_MAX_RECORD		((2 + NVME_SAMPLER_NR_VALUES) * 10)
+
+/*
+ * The history of a log page is a byte ring of records, each holding the
+ * difference of every field of a sample to the previous sample as a
+ * zigzag encoded varint. @base is the sample preceding the oldest record,
+ * applying all records to it in order yields @latest. When a new record
+ * does not fit, the oldest records are folded into @base.
+ */
+struct nvme_sampler_src {
+	nvme_ctrl_t c;
+	int fd;
+	__u16 endgid;
+	char sn[20];
+
+	union {
+		struct nvme_smart_log smart;
+		struct nvme_endurance_group_log endgrp;
+	} log;
+	struct nvme_passthru_cmd64 cmd;
+	int status;
+
+	bool sampled;
+	struct nvme_sampler_sample latest;
+
+	__u8 *ring;
+	size_t size;
+	size_t head;
+	size_t len;
+	unsigned int nr;
+	struct nvme_sampler_sample base;
+};
+
+struct nvme_sampler {
+	nvme_root_t r;
+	int timer_fd;
+	unsigned int period_ms;
+	size_t history;
+	struct nvme_sampler_src *srcs;
+	int nr_srcs;
+	nvme_uring_t ring;
+
+	char *shm_name;
+	struct nvme_sampler_shm *shm;
+	size_t shm_size;
+};
+
+static int nvme_sampler_add_src(nvme_sampler_t s, nvme_ctrl_t c, int fd,
+				__u16 endgid)
+{
+	struct nvme_sampler_src *srcs, *src;
+	const char *sn = nvme_ctrl_get_serial(c);
+
+	srcs = realloc(s->srcs, (s->nr_srcs + 1) * sizeof(*srcs));
+	if (!srcs) {
+		errno = ENOMEM;
+		return -1;
+	}
+	s->srcs = srcs;
+
+	src = &srcs[s->nr_srcs];
+	memset(src, 0, sizeof(*src));
+	src->c = c;
+	src->fd = fd;
+	src->endgid = endgid;
+	if (sn)
+		memcpy(src->sn, sn, strnlen(sn, sizeof(src->sn)));
+
+	if (s->history) {
+		src->ring = malloc(s->history);
+		if (!src->ring) {
+			errno = ENOMEM;
+			return -1;
+		}
+		src->size = s->history;
+	}
+	s->nr_srcs++;
+	return 0;
+}
+
+static int nvme_sampler_add_ctrl(nvme_sampler_t s, nvme_ctrl_t c)
+{
+	struct nvme_id_endurance_group_list list;
+	struct nvme_id_ctrl id;
+	int fd, i, nr;
+
+	fd = nvme_ctrl_get_fd(c);
+	if (fd < 0)
+		return 0;
+
+	if (nvme_sampler_add_src(s, c, fd, 0))
+		return -1;
+
+	if (nvme_identify_ctrl(fd, &id) ||
+	    !(le32_to_cpu(id.ctratt) & NVME_CTRL_CTRATT_ENDURANCE_GROUPS))
+		return 0;
+
+	if (nvme_identify_endurance_group_list(fd, 0, &list))
+		return 0;
+
+	nr = le16_to_cpu(list.num);
+	if (nr > NVME_ID_ENDURANCE_GROUP_LIST_MAX)
+		nr = NVME_ID_ENDURANCE_GROUP_LIST_MAX;
+	for (i = 0; i < nr; i++) {
+		if (nvme_sampler_add_src(s, c, fd,
+					 le16_to_cpu(list.identifier[i])))
+			return -1;
+	}
+	return 0;
+}
+
+nvme_sampler_t nvme_sampler_create(nvme_root_t r, unsigned int period_ms,
+				   size_t history)
+{
+	struct itimerspec its = { };
+	struct nvme_sampler *s;
+	nvme_subsystem_t subsys;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	int err;
+
+	if (!period_ms || (history && history < NVME_SAMPLER_MAX_RECORD)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	s->r = r;
+	s->timer_fd = -1;
+	s->period_ms = period_ms;
+	s->history = history;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, subsys) {
+			nvme_subsystem_for_each_ctrl(subsys, c) {
+				if (nvme_sampler_add_ctrl(s, c))
+					goto free;
+			}
+		}
+	}
+
+	s->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				     TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->timer_fd < 0)
+		goto free;
+
+	/* the first round is due right away */
+	its.it_value.tv_nsec = 1;
+	its.it_interval.tv_sec = period_ms / 1000;
+	its.it_interval.tv_nsec = (period_ms % 1000) * 1000000L;
+	if (timerfd_settime(s->timer_fd, 0, &its, NULL) < 0)
+		goto free;
+
+	/* without io_uring the logs are read one after the other */
+	if (s->nr_srcs > 1)
+		s->ring = nvme_uring_create(s->nr_srcs < NVME_SAMPLER_URING_DEPTH ?
+				s->nr_srcs : NVME_SAMPLER_URING_DEPTH, 0);
+
+	return s;
+
+free:
+	err = errno;
+	nvme_sampler_free(s);
+	errno = err;
+	return NULL;
+}
+
+void nvme_sampler_free(nvme_sampler_t s)
+{
+	int i;
+
+	if (!s)
+		return;
+
+	if (s->shm) {
+		munmap(s->shm, s->shm_size);
+		shm_unlink(s->shm_name);
+		free(s->shm_name);
+	}
+	nvme_uring_free(s->ring);
+	if (s->timer_fd >= 0)
+		close(s->timer_fd);
+	for (i = 0; i < s->nr_srcs; i++)
+		free(s->srcs[i].ring);
+	free(s->srcs);
+	free(s);
+}
+
+int nvme_sampler_get_fd(nvme_sampler_t s)
+{
+	return s->timer_fd;
+}
+
+static void nvme_sampler_init_cmd(struct nvme_sampler_src *src)
+{
+	struct nvme_get_log_args args = {
+		.args_size = sizeof(args),
+		.fd = src->fd,
+		.log = &src->log,
+		.len = sizeof(src->log),
+		.csi = NVME_CSI_NVM,
+		.lsp = NVME_LOG_LSP_NONE,
+		.uuidx = NVME_UUID_NONE,
+		/* leave the health events to whoever handles them */
+		.rae = true,
+	};
+	struct nvme_passthru_cmd cmd;
+
+	if (src->endgid) {
+		args.lid = NVME_LOG_LID_ENDURANCE_GROUP;
+		args.nsid = NVME_NSID_NONE;
+		args.lsi = src->endgid;
+	} else {
+		args.lid = NVME_LOG_LID_SMART;
+		args.nsid = NVME_NSID_ALL;
+	}
+	nvme_get_log_init_cmd(&args, &cmd);
+
+	src->cmd = (struct nvme_passthru_cmd64) {
+		.opcode		= cmd.opcode,
+		.nsid		= cmd.nsid,
+		.addr		= cmd.addr,
+		.data_len	= cmd.data_len,
+		.cdw10		= cmd.cdw10,
+		.cdw11		= cmd.cdw11,
+		.cdw12		= cmd.cdw12,
+		.cdw13		= cmd.cdw13,
+		.cdw14		= cmd.cdw14,
+		.timeout_ms	= cmd.timeout_ms,
+	};
+	src->status = -ECANCELED;
+}
+
+static void nvme_sampler_submit_ioctl(struct nvme_sampler_src *src)
+{
+	int err = nvme_submit_admin_passthru64(src->fd, &src->cmd, NULL);
+
+	src->status = err < 0 ? -errno : err;
+}
+
+static int nvme_sampler_submit_uring(nvme_sampler_t s)
+{
+	struct nvme_uring_completion c[NVME_SAMPLER_URING_DEPTH];
+	int queued = 0, i, n;
+
+	while (queued < s->nr_srcs || nvme_uring_inflight(s->ring)) {
+		while (queued < s->nr_srcs) {
+			struct nvme_sampler_src *src = &s->srcs[queued];
+
+			if (nvme_uring_queue_admin_passthru64(s->ring, src->fd,
+							      &src->cmd, src))
+				break;
+			queued++;
+		}
+
+		if (nvme_uring_submit(s->ring) < 0)
+			return -1;
+
+		n = nvme_uring_reap(s->ring, c, NVME_SAMPLER_URING_DEPTH, 1);
+		if (n < 0)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			struct nvme_sampler_src *src = c[i].user_data;
+
+			/* the kernel may not implement uring commands */
+			if (c[i].status == -EOPNOTSUPP ||
+			    c[i].status == -ENOTTY)
+				nvme_sampler_submit_ioctl(src);
+			else
+				src->status = c[i].status;
+		}
+	}
+	return 0;
+}
+
+static void nvme_sampler_submit(nvme_sampler_t s)
+{
+	int i;
+
+	for (i = 0; i < s->nr_srcs; i++)
+		nvme_sampler_init_cmd(&s->srcs[i]);
+
+	if (s->ring && nvme_uring_passthru_enabled() &&
+	    nvme_sampler_submit_uring(s)) {
+		/* stop using a broken ring, it won't get any better */
+		nvme_uring_free(s->ring);
+		s->ring = NULL;
+	}
+
+	for (i = 0; i < s->nr_srcs; i++) {
+		if (s->srcs[i].status == -ECANCELED)
+			nvme_sampler_submit_ioctl(&s->srcs[i]);
+	}
+}
+
+/* the low 64 bits of a 128-bit little endian counter, saturating */
+static __u64 nvme_sampler_u128(const __u8 *v)
+{
+	__le64 lo;
+	int i;
+
+	for (i = 8; i < 16; i++) {
+		if (v[i])
+			return UINT64_MAX;
+	}
+	memcpy(&lo, v, sizeof(lo));
+	return le64_to_cpu(lo);
+}
+
+static void nvme_sampler_decode_smart(struct nvme_smart_log *log, __u64 *v)
+{
+	v[NVME_SAMPLER_CRITICAL_WARNING] = log->critical_warning;
+	v[NVME_SAMPLER_TEMPERATURE] = log->temperature[0] |
+		log->temperature[1] << 8;
+	v[NVME_SAMPLER_AVAIL_SPARE] = log->avail_spare;
+	v[NVME_SAMPLER_SPARE_THRESH] = log->spare_thresh;
+	v[NVME_SAMPLER_PERCENT_USED] = log->percent_used;
+	v[NVME_SAMPLER_DATA_UNITS_READ] =
+		nvme_sampler_u128(log->data_units_read);
+	v[NVME_SAMPLER_DATA_UNITS_WRITTEN] =
+		nvme_sampler_u128(log->data_units_written);
+	v[NVME_SAMPLER_HOST_READS] = nvme_sampler_u128(log->host_reads);
+	v[NVME_SAMPLER_HOST_WRITES] = nvme_sampler_u128(log->host_writes);
+	v[NVME_SAMPLER_CTRL_BUSY_TIME] =
+		nvme_sampler_u128(log->ctrl_busy_time);
+	v[NVME_SAMPLER_POWER_CYCLES] = nvme_sampler_u128(log->power_cycles);
+	v[NVME_SAMPLER_POWER_ON_HOURS] =
+		nvme_sampler_u128(log->power_on_hours);
+	v[NVME_SAMPLER_UNSAFE_SHUTDOWNS] =
+		nvme_sampler_u128(log->unsafe_shutdowns);
+	v[NVME_SAMPLER_MEDIA_ERRORS] = nvme_sampler_u128(log->media_errors);
+	v[NVME_SAMPLER_ERR_LOG_ENTRIES] =
+		nvme_sampler_u128(log->num_err_log_entries);
+	v[NVME_SAMPLER_WARNING_TEMP_TIME] =
+		le32_to_cpu(log->warning_temp_time);
+	v[NVME_SAMPLER_CRITICAL_TEMP_TIME] =
+		le32_to_cpu(log->critical_comp_time);
+}
+
+static void nvme_sampler_decode_endgrp(struct nvme_endurance_group_log *log,
+				       __u64 *v)
+{
+	v[NVME_SAMPLER_CRITICAL_WARNING] = log->critical_warning;
+	v[NVME_SAMPLER_AVAIL_SPARE] = log->avl_spare;
+	v[NVME_SAMPLER_SPARE_THRESH] = log->avl_spare_threshold;
+	v[NVME_SAMPLER_PERCENT_USED] = log->percent_used;
+	v[NVME_SAMPLER_DATA_UNITS_READ] =
+		nvme_sampler_u128(log->data_units_read);
+	v[NVME_SAMPLER_DATA_UNITS_WRITTEN] =
+		nvme_sampler_u128(log->data_units_written);
+	v[NVME_SAMPLER_MEDIA_UNITS_WRITTEN] =
+		nvme_sampler_u128(log->media_units_written);
+	v[NVME_SAMPLER_HOST_READS] = nvme_sampler_u128(log->host_read_cmds);
+	v[NVME_SAMPLER_HOST_WRITES] = nvme_sampler_u128(log->host_write_cmds);
+	v[NVME_SAMPLER_MEDIA_ERRORS] =
+		nvme_sampler_u128(log->media_data_integrity_err);
+	v[NVME_SAMPLER_ERR_LOG_ENTRIES] =
+		nvme_sampler_u128(log->num_err_info_log_entries);
+}
+
+static size_t nvme_sampler_put_varint(__u8 *buf, __s64 delta)
+{
+	__u64 v = ((__u64)delta << 1) ^ (__u64)(delta >> 63);
+	size_t n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = v | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	return n;
+}
+
+static __s64 nvme_sampler_get_varint(struct nvme_sampler_src *src,
+				     size_t *pos)
+{
+	unsigned int shift = 0;
+	__u64 v = 0;
+	__u8 b;
+
+	do {
+		b = src->ring[*pos];
+		*pos = (*pos + 1) % src->size;
+		v |= (__u64)(b & 0x7f) << shift;
+		shift += 7;
+	} while (b & 0x80);
+
+	return (__s64)(v >> 1) ^ -(__s64)(v & 1);
+}
+
+/* applies the record at @pos to @sample, returns the record length */
+static size_t nvme_sampler_decode_record(struct nvme_sampler_src *src,
+					 size_t pos,
+					 struct nvme_sampler_sample *sample)
+{
+	size_t start = pos;
+	int i;
+
+	sample->timestamp_ms += nvme_sampler_get_varint(src, &pos);
+	sample->status += nvme_sampler_get_varint(src, &pos);
+	for (i = 0; i < NVME_SAMPLER_NR_VALUES; i++)
+		sample->values[i] += nvme_sampler_get_varint(src, &pos);
+
+	return (pos + src->size - start) % src->size;
+}
+
+static void nvme_sampler_record(struct nvme_sampler_src *src,
+				struct nvme_sampler_sample *sample)
+{
+	struct nvme_sampler_sample *prev = &src->latest;
+	__u8 rec[NVME_SAMPLER_MAX_RECORD];
+	size_t len = 0, i, tail;
+
+	len += nvme_sampler_put_varint(rec + len,
+			sample->timestamp_ms - prev->timestamp_ms);
+	len += nvme_sampler_put_varint(rec + len,
+			(__s64)sample->status - prev->status);
+	for (i = 0; i < NVME_SAMPLER_NR_VALUES; i++)
+		len += nvme_sampler_put_varint(rec + len,
+				sample->values[i] - prev->values[i]);
+
+	while (src->size - src->len < len) {
+		size_t n = nvme_sampler_decode_record(src, src->head,
+						      &src->base);
+
+		src->head = (src->head + n) % src->size;
+		src->len -= n;
+		src->nr--;
+	}
+
+	tail = (src->head + src->len) % src->size;
+	for (i = 0; i < len; i++)
+		src->ring[(tail + i) % src->size] = rec[i];
+	src->len += len;
+	src->nr++;
+}
+
+static void nvme_sampler_update(struct nvme_sampler_src *src, __u64 now)
+{
+	struct nvme_sampler_sample sample;
+
+	/* a failed sample repeats the values of the previous one */
+	sample = src->latest;
+	sample.timestamp_ms = now;
+	sample.status = src->status;
+	if (!src->status) {
+		memset(sample.values, 0, sizeof(sample.values));
+		if (src->endgid)
+			nvme_sampler_decode_endgrp(&src->log.endgrp,
+						   sample.values);
+		else
+			nvme_sampler_decode_smart(&src->log.smart,
+						  sample.values);
+	}
+
+	if (src->ring)
+		nvme_sampler_record(src, &sample);
+	src->latest = sample;
+	src->sampled = true;
+}
+
+static void nvme_sampler_publish(nvme_sampler_t s)
+{
+	__u64 seq = s->shm->seq;
+	int i;
+
+	__atomic_store_n(&s->shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (i = 0; i < s->nr_srcs; i++)
+		s->shm->entries[i].sample = s->srcs[i].latest;
+	__atomic_store_n(&s->shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int nvme_sampler_process(nvme_sampler_t s, int timeout)
+{
+	struct pollfd pfd = {
+		.fd = s->timer_fd,
+		.events = POLLIN,
+	};
+	__u64 expirations, now;
+	struct timespec ts;
+	int ret, i;
+
+	do {
+		ret = poll(&pfd, 1, timeout);
+	} while (ret < 0 && errno == EINTR);
+	if (ret <= 0)
+		return ret;
+
+	/* rounds missed while the caller was busy are not made up for */
+	if (read(s->timer_fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		return -1;
+	}
+
+	nvme_sampler_submit(s);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (__u64)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	for (i = 0; i < s->nr_srcs; i++)
+		nvme_sampler_update(&s->srcs[i], now);
+
+	if (s->shm)
+		nvme_sampler_publish(s);
+	return s->nr_srcs;
+}
+
+static struct nvme_sampler_src *nvme_sampler_find(nvme_sampler_t s,
+						  nvme_ctrl_t c, __u16 endgid)
+{
+	int i;
+
+	for (i = 0; i < s->nr_srcs; i++) {
+		if (s->srcs[i].c == c && s->srcs[i].endgid == endgid)
+			return &s->srcs[i];
+	}
+	errno = ENOENT;
+	return NULL;
+}
+
+int nvme_sampler_get_latest(nvme_sampler_t s, nvme_ctrl_t c, __u16 endgid,
+			    struct nvme_sampler_sample *sample)
+{
+	struct nvme_sampler_src *src = nvme_sampler_find(s, c, endgid);
+
+	if (!src)
+		return -1;
+	if (!src->sampled) {
+		errno = ENOENT;
+		return -1;
+	}
+	*sample = src->latest;
+	return 0;
+}
+
+int nvme_sampler_get_history(nvme_sampler_t s, nvme_ctrl_t c, __u16 endgid,
+			     struct nvme_sampler_sample *samples, int nr)
+{
+	struct nvme_sampler_src *src = nvme_sampler_find(s, c, endgid);
+	struct nvme_sampler_sample cur;
+	unsigned int i, skip;
+	size_t pos;
+	int n = 0;
+
+	if (!src)
+		return -1;
+	if (nr <= 0 || !src->ring)
+		return 0;
+
+	skip = src->nr > (unsigned int)nr ? src->nr - nr : 0;
+	cur = src->base;
+	pos = src->head;
+	for (i = 0; i < src->nr; i++) {
+		pos = (pos + nvme_sampler_decode_record(src, pos, &cur)) %
+			src->size;
+		if (i >= skip)
+			samples[n++] = cur;
+	}
+	return n;
+}
+
+int nvme_sampler_export(nvme_sampler_t s, const char *name)
+{
+	struct nvme_sampler_shm *shm;
+	size_t size;
+	int fd, i, err;
+
+	if (s->shm) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	size = sizeof(*shm) + s->nr_srcs * sizeof(shm->entries[0]);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, size) < 0)
+		goto unlink;
+	shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto unlink;
+	close(fd);
+
+	s->shm_name = strdup(name);
+	if (!s->shm_name) {
+		munmap(shm, size);
+		shm_unlink(name);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	shm->version = NVME_SAMPLER_SHM_VERSION;
+	shm->nr_entries = s->nr_srcs;
+	shm->entry_size = sizeof(shm->entries[0]);
+	shm->nr_values = NVME_SAMPLER_NR_VALUES;
+	shm->period_ms = s->period_ms;
+	for (i = 0; i < s->nr_srcs; i++) {
+		struct nvme_sampler_shm_entry *e = &shm->entries[i];
+		const char *cname = nvme_ctrl_get_name(s->srcs[i].c);
+
+		if (cname)
+			strncpy(e->name, cname, sizeof(e->name) - 1);
+		memcpy(e->sn, s->srcs[i].sn, sizeof(e->sn));
+		e->endgid = s->srcs[i].endgid;
+		e->sample = s->srcs[i].latest;
+	}
+	/* readers check the magic last, so the layout is complete */
+	__atomic_store_n(&shm->magic, NVME_SAMPLER_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	s->shm = shm;
+	s->shm_size = size;
+	return 0;
+
+unlink:
+	err = errno;
+	close(fd);
+	shm_unlink(name);
+	errno = err;
+	return -1;
+}
+
+static size_t nvme_sampler_shm_size(const struct nvme_sampler_shm *shm)
+{
+	return sizeof(*shm) + (size_t)shm->nr_entries * shm->entry_size;
+}
+
+/*
+ * The object is mapped behind a private page which holds the length of
+ * the mapping, so that unmapping doesn't depend on the shared header.
+ */
+static size_t *nvme_sampler_shm_len(const struct nvme_sampler_shm *shm)
+{
+	return (size_t *)((char *)shm - getpagesize());
+}
+
+const struct nvme_sampler_shm *nvme_sampler_shm_map(const char *name)
+{
+	size_t page = getpagesize();
+	struct nvme_sampler_shm *shm;
+	struct stat st;
+	void *base;
+	int fd, err;
+
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0)
+		goto close;
+	if (st.st_size < sizeof(*shm)) {
+		errno = EPROTO;
+		goto close;
+	}
+
+	base = mmap(NULL, page + st.st_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		goto close;
+	shm = mmap((char *)base + page, st.st_size, PROT_READ,
+		   MAP_SHARED | MAP_FIXED, fd, 0);
+	if (shm == MAP_FAILED) {
+		err = errno;
+		munmap(base, page + st.st_size);
+		errno = err;
+		goto close;
+	}
+	close(fd);
+	*nvme_sampler_shm_len(shm) = page + st.st_size;
+
+	if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+	    NVME_SAMPLER_SHM_MAGIC ||
+	    shm->version != NVME_SAMPLER_SHM_VERSION ||
+	    shm->entry_size != sizeof(shm->entries[0]) ||
+	    shm->nr_values != NVME_SAMPLER_NR_VALUES ||
+	    nvme_sampler_shm_size(shm) > st.st_size) {
+		munmap(base, page + st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+	return shm;
+
+close:
+	err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+void nvme_sampler_shm_unmap(const struct nvme_sampler_shm *shm)
+{
+	size_t *len;
+
+	if (!shm)
+		return;
+	len = nvme_sampler_shm_len(shm);
+	munmap(len, *len);
+}
+
+int nvme_sampler_shm_read(const struct nvme_sampler_shm *shm,
+			  unsigned int idx,
+			  struct nvme_sampler_shm_entry *entry)
+{
+	__u64 seq;
+
+	if (idx >= shm->nr_entries) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	do {
+		while ((seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(entry, &shm->entries[idx], sizeof(*entry));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq);
+
+	return 0;
+}
@@ -0,0 +1,277 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_SAMPLER_H
+#define _LIBNVME_SAMPLER_H
+
+#include <stdbool.h>
+
+#include "tree.h"
+
+/**
+ * DOC: sampler.h
+ *
+ * Periodic health sampling
+ *
+ * A sampler reads the SMART / Health Information log page of every
+ * controller in a tree, and the Endurance Group Information log page of
+ * each of their endurance groups, at a fixed period. The commands of one
+ * round are all in flight at the same time where io_uring passthrough is
+ * available. The 128-bit counters are converted to host order 64-bit
+ * values, saturating at UINT64_MAX.
+ *
+ * For each log the sampler keeps a history of the samples, delta encoded
+ * into a fixed size ring, so that only a few bytes are needed per sample
+ * for counters which change slowly. The latest sample of each log can
+ * also be exported into a POSIX shared memory object, which any number of
+ * processes can map read-only and read without sending commands of their
+ * own.
+ *
+ * A sampler is driven by calling nvme_sampler_process(), either in a loop
+ * on a thread of its own or whenever the descriptor returned by
+ * nvme_sampler_get_fd() becomes readable. A sampler must only be used
+ * from one thread at a time, and the tree must not be modified while the
+ * sampler exists.
+ */
+
+/**
+ * typedef nvme_sampler_t - Periodic health sampler
+ */
+typedef struct nvme_sampler * nvme_sampler_t;
+
+/**
+ * enum nvme_sampler_value - Values of a sample
+ * @NVME_SAMPLER_CRITICAL_WARNING:	Critical Warning
+ * @NVME_SAMPLER_TEMPERATURE:		Composite Temperature in Kelvin, SMART
+ *					only
+ * @NVME_SAMPLER_AVAIL_SPARE:		Available Spare
+ * @NVME_SAMPLER_SPARE_THRESH:		Available Spare Threshold
+ * @NVME_SAMPLER_PERCENT_USED:		Percentage Used
+ * @NVME_SAMPLER_DATA_UNITS_READ:	Data Units Read
+ * @NVME_SAMPLER_DATA_UNITS_WRITTEN:	Data Units Written
+ * @NVME_SAMPLER_MEDIA_UNITS_WRITTEN:	Media Units Written, endurance
+ *					groups only
+ * @NVME_SAMPLER_HOST_READS:		Host Read Commands
+ * @NVME_SAMPLER_HOST_WRITES:		Host Write Commands
+ * @NVME_SAMPLER_CTRL_BUSY_TIME:	Controller Busy Time, SMART only
+ * @NVME_SAMPLER_POWER_CYCLES:		Power Cycles, SMART only
+ * @NVME_SAMPLER_POWER_ON_HOURS:	Power On Hours, SMART only
+ * @NVME_SAMPLER_UNSAFE_SHUTDOWNS:	Unsafe Shutdowns, SMART only
+ * @NVME_SAMPLER_MEDIA_ERRORS:		Media and Data Integrity Errors
+ * @NVME_SAMPLER_ERR_LOG_ENTRIES:	Number of Error Information Log Entries
+ * @NVME_SAMPLER_WARNING_TEMP_TIME:	Warning Composite Temperature Time,
+ *					SMART only
+ * @NVME_SAMPLER_CRITICAL_TEMP_TIME:	Critical Composite Temperature Time,
+ *					SMART only
+ * @NVME_SAMPLER_NR_VALUES:		Number of values in a sample
+ */
+enum nvme_sampler_value {
+	NVME_SAMPLER_CRITICAL_WARNING,
+	NVME_SAMPLER_TEMPERATURE,
+	NVME_SAMPLER_AVAIL_SPARE,
+	NVME_SAMPLER_SPARE_THRESH,
+	NVME_SAMPLER_PERCENT_USED,
+	NVME_SAMPLER_DATA_UNITS_READ,
+	NVME_SAMPLER_DATA_UNITS_WRITTEN,
+	NVME_SAMPLER_MEDIA_UNITS_WRITTEN,
+	NVME_SAMPLER_HOST_READS,
+	NVME_SAMPLER_HOST_WRITES,
+	NVME_SAMPLER_CTRL_BUSY_TIME,
+	NVME_SAMPLER_POWER_CYCLES,
+	NVME_SAMPLER_POWER_ON_HOURS,
+	NVME_SAMPLER_UNSAFE_SHUTDOWNS,
+	NVME_SAMPLER_MEDIA_ERRORS,
+	NVME_SAMPLER_ERR_LOG_ENTRIES,
+	NVME_SAMPLER_WARNING_TEMP_TIME,
+	NVME_SAMPLER_CRITICAL_TEMP_TIME,
+	NVME_SAMPLER_NR_VALUES,
+};
+
+/**
+ * struct nvme_sampler_sample - One sample of a log page
+ * @timestamp_ms:	Time of the sample, in milliseconds since the Epoch
+ * @status:		0 if the log page was read, the nvme command status
+ *			if a response was received (see
+ *			&enum nvme_status_field) or a negative errno value
+ *			otherwise. The values of a failed sample are those
+ *			of the previous one.
+ * @rsvd12:		Reserved
+ * @values:		Sampled values, indexed by &enum nvme_sampler_value.
+ *			Values which are not part of the log page are 0.
+ */
+struct nvme_sampler_sample {
+	__u64 timestamp_ms;
+	__s32 status;
+	__u32 rsvd12;
+	__u64 values[NVME_SAMPLER_NR_VALUES];
+};
+
+/**
+ * nvme_sampler_create() - Create a health sampler for a tree
+ * @r:		&nvme_root_t object with the controllers to sample, must
+ *		outlive the sampler
+ * @period_ms:	Sampling period in milliseconds
+ * @history:	Size of the history of each log page in bytes, 0 to keep
+ *		no history
+ *
+ * Opens every controller in @r and reads its Identify Controller data to
+ * find its endurance groups. Controllers which cannot be opened are not
+ * sampled. The first round of samples is taken by the first call to
+ * nvme_sampler_process().
+ *
+ * Return: New sampler, or NULL with errno set on failure.
+ */
+nvme_sampler_t nvme_sampler_create(nvme_root_t r, unsigned int period_ms,
+				   size_t history);
+
+/**
+ * nvme_sampler_free() - Free a health sampler
+ * @s:		Sampler to free
+ *
+ * Also removes the shared memory object of nvme_sampler_export().
+ */
+void nvme_sampler_free(nvme_sampler_t s);
+
+/**
+ * nvme_sampler_get_fd() - Pollable file descriptor of a sampler
+ * @s:		Sampler
+ *
+ * The descriptor becomes readable when the next round of samples is due,
+ * and can be added to the caller's own poll or epoll set. Call
+ * nvme_sampler_process() with a timeout of 0 once it is readable.
+ *
+ * Return: File descriptor owned by @s.
+ */
+int nvme_sampler_get_fd(nvme_sampler_t s);
+
+/**
+ * nvme_sampler_process() - Wait for and take the next round of samples
+ * @s:		Sampler
+ * @timeout:	Time to wait for the round to become due in milliseconds, 0
+ *		to not wait at all or -1 to wait until it is due
+ *
+ * Return: Number of log pages sampled, which is 0 when the timeout
+ * expired, or -1 with errno set on failure.
+ */
+int nvme_sampler_process(nvme_sampler_t s, int timeout);
+
+/**
+ * nvme_sampler_get_latest() - Latest sample of a log page
+ * @s:		Sampler
+ * @c:		Controller
+ * @endgid:	Endurance group, or 0 for the SMART / Health Information log
+ * @sample:	Sample to fill in
+ *
+ * Return: 0 on success, or -1 with errno set to ENOENT if the log page
+ * is not sampled or has not been sampled yet.
+ */
+int nvme_sampler_get_latest(nvme_sampler_t s, nvme_ctrl_t c, __u16 endgid,
+			    struct nvme_sampler_sample *sample);
+
+/**
+ * nvme_sampler_get_history() - Sample history of a log page
+ * @s:		Sampler
+ * @c:		Controller
+ * @endgid:	Endurance group, or 0 for the SMART / Health Information log
+ * @samples:	Array of @nr samples to fill in, oldest first
+ * @nr:		Maximum number of samples to return
+ *
+ * Returns the @nr most recent samples kept in the history.
+ *
+ * Return: Number of samples returned, or -1 with errno set to ENOENT if
+ * the log page is not sampled.
+ */
+int nvme_sampler_get_history(nvme_sampler_t s, nvme_ctrl_t c, __u16 endgid,
+			     struct nvme_sampler_sample *samples, int nr);
+
+/**
+ * nvme_sampler_export() - Publish the latest samples in shared memory
+ * @s:		Sampler
+ * @name:	Name of the POSIX shared memory object, see shm_open(3)
+ *
+ * Creates the shared memory object and updates it after every round of
+ * samples. Readers map it with nvme_sampler_shm_map().
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_sampler_export(nvme_sampler_t s, const char *name);
+
+#define NVME_SAMPLER_SHM_MAGIC		0x4c504d53454d564eULL	/* NVMESMPL */
+#define NVME_SAMPLER_SHM_VERSION	1
+
+/**
+ * struct nvme_sampler_shm_entry - Exported latest sample of a log page
+ * @name:	Kernel name of the controller, e.g. 'nvme0'
+ * @sn:		Serial number of the controller, not NUL terminated
+ * @endgid:	Endurance group, or 0 for the SMART / Health Information log
+ * @rsvd54:	Reserved
+ * @sample:	Latest sample, with a @timestamp_ms of 0 until the log page
+ *		was first sampled
+ */
+struct nvme_sampler_shm_entry {
+	char				name[32];
+	char				sn[20];
+	__u16				endgid;
+	__u8				rsvd54[2];
+	struct nvme_sampler_sample	sample;
+};
+
+/**
+ * struct nvme_sampler_shm - Layout of an exported shared memory object
+ * @magic:	%NVME_SAMPLER_SHM_MAGIC
+ * @version:	%NVME_SAMPLER_SHM_VERSION
+ * @nr_entries:	Number of entries in @entries
+ * @entry_size:	Size of an entry in bytes
+ * @nr_values:	Number of values of a sample
+ * @period_ms:	Sampling period in milliseconds
+ * @rsvd20:	Reserved
+ * @seq:	Sequence count, odd while the entries are being updated
+ * @entries:	Latest sample of each log page
+ *
+ * Use nvme_sampler_shm_read() to read consistent entries.
+ */
+struct nvme_sampler_shm {
+	__u64				magic;
+	__u32				version;
+	__u32				nr_entries;
+	__u32				entry_size;
+	__u32				nr_values;
+	__u32				period_ms;
+	__u32				rsvd20;
+	__u64				seq;
+	struct nvme_sampler_shm_entry	entries[];
+};
+
+/**
+ * nvme_sampler_shm_map() - Map an exported shared memory object
+ * @name:	Name passed to nvme_sampler_export()
+ *
+ * Return: Read-only mapping of the object, or NULL with errno set on
+ * failure. errno is set to EPROTO if the object has an unknown layout.
+ */
+const struct nvme_sampler_shm *nvme_sampler_shm_map(const char *name);
+
+/**
+ * nvme_sampler_shm_unmap() - Unmap an exported shared memory object
+ * @shm:	Mapping returned by nvme_sampler_shm_map()
+ */
+void nvme_sampler_shm_unmap(const struct nvme_sampler_shm *shm);
+
+/**
+ * nvme_sampler_shm_read() - Read an entry of an exported object
+ * @shm:	Mapping returned by nvme_sampler_shm_map()
+ * @idx:	Index of the entry
+ * @entry:	Entry to fill in
+ *
+ * Retries until it read the entry without the sampler updating it at
+ * the same time.
+ *
+ * Return: 0 on success, or -1 with errno set to EINVAL if @idx is out of
+ * range.
+ */
+int nvme_sampler_shm_read(const struct nvme_sampler_shm *shm,
+			  unsigned int idx,
+			  struct nvme_sampler_shm_entry *entry);
+
+#endif /* _LIBNVME_SAMPLER_H */
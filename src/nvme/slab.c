@@ -0,0 +1,144 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "private.h"
+
+/* precedes every object, padded to the strictest alignment */
+union nvme_slab_obj {
+	struct {
+		struct nvme_slab *slab;
+		union nvme_slab_obj *next;
+	} h;
+	long double align;
+};
+
+struct nvme_slab_chunk {
+	struct nvme_slab_chunk *next;
+	union nvme_slab_obj objs[];
+};
+
+struct nvme_slab {
+	size_t obj_size;
+	unsigned int per_chunk;
+	struct nvme_slab_chunk *chunks;
+	union nvme_slab_obj *free;
+	unsigned long nr_live;
+	bool orphaned;
+};
+
+struct nvme_slab *nvme_slab_create(size_t size, unsigned int per_chunk)
+{
+	struct nvme_slab *slab;
+
+	slab = calloc(1, sizeof(*slab));
+	if (!slab) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* header plus object, rounded up to a multiple of the header */
+	slab->obj_size = sizeof(union nvme_slab_obj) +
+		(size + sizeof(union nvme_slab_obj) - 1) /
+		sizeof(union nvme_slab_obj) * sizeof(union nvme_slab_obj);
+	slab->per_chunk = per_chunk ? per_chunk : 1;
+	return slab;
+}
+
+static void nvme_slab_release(struct nvme_slab *slab)
+{
+	struct nvme_slab_chunk *chunk, *next;
+
+	for (chunk = slab->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	free(slab);
+}
+
+void nvme_slab_destroy(struct nvme_slab *slab)
+{
+	if (!slab)
+		return;
+
+	/* objects which outlive their owner keep the memory around */
+	if (slab->nr_live) {
+		slab->orphaned = true;
+		return;
+	}
+	nvme_slab_release(slab);
+}
+
+static int nvme_slab_grow(struct nvme_slab *slab)
+{
+	struct nvme_slab_chunk *chunk;
+	union nvme_slab_obj *obj;
+	unsigned int i;
+
+	chunk = malloc(sizeof(*chunk) + slab->obj_size * slab->per_chunk);
+	if (!chunk) {
+		errno = ENOMEM;
+		return -1;
+	}
+	chunk->next = slab->chunks;
+	slab->chunks = chunk;
+
+	for (i = 0; i < slab->per_chunk; i++) {
+		obj = (void *)((uint8_t *)chunk->objs + i * slab->obj_size);
+		obj->h.slab = slab;
+		obj->h.next = slab->free;
+		slab->free = obj;
+	}
+	return 0;
+}
+
+void *nvme_slab_zalloc(struct nvme_slab *slab, size_t size)
+{
+	union nvme_slab_obj *obj;
+
+	if (!slab || size > slab->obj_size - sizeof(*obj)) {
+		obj = calloc(1, sizeof(*obj) + size);
+		if (!obj) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		obj->h.slab = NULL;
+		return obj + 1;
+	}
+
+	if (!slab->free && nvme_slab_grow(slab) < 0)
+		return NULL;
+
+	obj = slab->free;
+	slab->free = obj->h.next;
+	slab->nr_live++;
+	memset(obj + 1, 0, slab->obj_size - sizeof(*obj));
+	return obj + 1;
+}
+
+void nvme_slab_free(void *ptr)
+{
+	union nvme_slab_obj *obj;
+	struct nvme_slab *slab;
+
+	if (!ptr)
+		return;
+
+	obj = (union nvme_slab_obj *)ptr - 1;
+	slab = obj->h.slab;
+	if (!slab) {
+		free(obj);
+		return;
+	}
+
+	obj->h.next = slab->free;
+	slab->free = obj;
+	if (!--slab->nr_live && slab->orphaned)
+		nvme_slab_release(slab);
+}
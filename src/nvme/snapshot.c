@@ -0,0 +1,938 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <ccan/list/list.h>
+
+#include "tree.h"
+#include "log.h"
+#include "pi.h"
+#include "private.h"
+
+#define NVME_SNAPSHOT_MAGIC	"LIBNVMES"
+#define NVME_SNAPSHOT_VERSION	1
+
+/* strings are offsets into the string table plus one, 0 is NULL */
+enum {
+	NVME_SNAP_HOST,
+	NVME_SNAP_SUBSYS,
+	NVME_SNAP_CTRL,
+	NVME_SNAP_NS,
+	NVME_SNAP_PATH,
+	NVME_SNAP_NR,
+};
+
+struct nvme_snap_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 hdr_size;
+	__u64 generation;
+	__u64 csum;
+	__u32 size;
+	__u32 str_off;
+	__u32 str_len;
+	__u32 nr[NVME_SNAP_NR];
+	__u32 rec_size[NVME_SNAP_NR];
+	__u32 off[NVME_SNAP_NR];
+};
+
+#define NVME_SNAP_HOST_STRS	3
+struct nvme_snap_host {
+	__u32 str[NVME_SNAP_HOST_STRS];
+};
+
+#define NVME_SNAP_SUBSYS_STRS	7
+struct nvme_snap_subsys {
+	__u32 host;
+	__u32 str[NVME_SNAP_SUBSYS_STRS];
+};
+
+#define NVME_SNAP_CTRL_STRS	18
+struct nvme_snap_ctrl {
+	__u32 subsys;
+	__u32 str[NVME_SNAP_CTRL_STRS];
+	__s32 cfg[9];
+	__u8 cfg_flags;
+	__u8 flags;
+	__u8 mdts;
+	__u8 mpsmin;
+	__u32 max_xfer_len;
+};
+
+#define NVME_SNAP_CTRL_DISCOVERY	(1 << 0)
+#define NVME_SNAP_CTRL_DISCOVERED	(1 << 1)
+#define NVME_SNAP_CTRL_PERSISTENT	(1 << 2)
+#define NVME_SNAP_CTRL_XFER_VALID	(1 << 3)
+
+#define NVME_SNAP_NS_STRS	3
+struct nvme_snap_ns {
+	__u32 subsys;		/* owner if ctrl is ~0 */
+	__u32 ctrl;
+	__u32 str[NVME_SNAP_NS_STRS];
+	__u32 nsid;
+	__s32 lba_shift;
+	__s32 lba_size;
+	__s32 meta_size;
+	__u32 csi;
+	__u64 lba_count;
+	__u64 lba_util;
+	__u8 eui64[8];
+	__u8 nguid[16];
+	__u8 uuid[16];
+	__u8 pi_type;
+	__u8 pif;
+	__u8 sts;
+	__u8 flags;
+	__u8 rsvd[4];
+};
+
+#define NVME_SNAP_NS_IDENTIFIED	(1 << 0)
+#define NVME_SNAP_NS_PI_FIRST	(1 << 1)
+#define NVME_SNAP_NS_META_EXT	(1 << 2)
+
+#define NVME_SNAP_PATH_STRS	3
+struct nvme_snap_path {
+	__u32 ctrl;
+	__u32 ns;		/* ~0 without a namespace */
+	__u32 str[NVME_SNAP_PATH_STRS];
+	__s32 grpid;
+};
+
+static const size_t nvme_snap_rec_size[NVME_SNAP_NR] = {
+	sizeof(struct nvme_snap_host),
+	sizeof(struct nvme_snap_subsys),
+	sizeof(struct nvme_snap_ctrl),
+	sizeof(struct nvme_snap_ns),
+	sizeof(struct nvme_snap_path),
+};
+
+/*
+ * The string fields of each object, in record order. Authentication
+ * keys are left out so the snapshot can be readable by everyone.
+ */
+#define NVME_SNAP_HOST_FIELDS(h) { &(h)->hostnqn, &(h)->hostid, \
+	&(h)->hostsymname }
+#define NVME_SNAP_SUBSYS_FIELDS(s) { &(s)->name, &(s)->sysfs_dir, \
+	&(s)->subsysnqn, &(s)->model, &(s)->serial, &(s)->firmware, \
+	&(s)->subsystype }
+#define NVME_SNAP_CTRL_FIELDS(c) { &(c)->name, &(c)->sysfs_dir, \
+	&(c)->address, &(c)->firmware, &(c)->model, &(c)->state, \
+	&(c)->numa_node, &(c)->queue_count, &(c)->serial, &(c)->sqsize, \
+	&(c)->transport, &(c)->subsysnqn, &(c)->traddr, &(c)->trsvcid, \
+	&(c)->cntrltype, &(c)->dctype, &(c)->cfg.host_traddr, \
+	&(c)->cfg.host_iface }
+#define NVME_SNAP_NS_FIELDS(n) { &(n)->name, &(n)->generic_name, \
+	&(n)->sysfs_dir }
+#define NVME_SNAP_PATH_FIELDS(p) { &(p)->name, &(p)->sysfs_dir, \
+	&(p)->ana_state }
+
+struct nvme_snap_buf {
+	char *strs;
+	size_t str_len;
+	size_t str_alloc;
+};
+
+struct nvme_snap_ptr {
+	const void *ptr;
+	__u32 idx;
+};
+
+static int nvme_snap_ptr_cmp(const void *a, const void *b)
+{
+	const struct nvme_snap_ptr *x = a, *y = b;
+
+	if (x->ptr != y->ptr)
+		return x->ptr < y->ptr ? -1 : 1;
+	return 0;
+}
+
+static __u32 nvme_snap_ptr_find(struct nvme_snap_ptr *map, size_t nr,
+				const void *ptr)
+{
+	struct nvme_snap_ptr key = { .ptr = ptr }, *found;
+
+	found = bsearch(&key, map, nr, sizeof(*map), nvme_snap_ptr_cmp);
+	return found ? found->idx : ~0U;
+}
+
+static int nvme_snap_str(struct nvme_snap_buf *b, const char *str,
+			 __u32 *off)
+{
+	size_t len;
+	char *tmp;
+
+	if (!str) {
+		*off = 0;
+		return 0;
+	}
+
+	len = strlen(str) + 1;
+	if (b->str_len + len > b->str_alloc) {
+		size_t n = b->str_alloc ? b->str_alloc * 2 : 4096;
+
+		while (n < b->str_len + len)
+			n *= 2;
+		tmp = realloc(b->strs, n);
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		b->strs = tmp;
+		b->str_alloc = n;
+	}
+	if (b->str_len + len > UINT32_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	memcpy(b->strs + b->str_len, str, len);
+	*off = b->str_len + 1;
+	b->str_len += len;
+	return 0;
+}
+
+static int nvme_snap_strs(struct nvme_snap_buf *b, char **fields[],
+			  unsigned int nr, __u32 *out)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (nvme_snap_str(b, *fields[i], &out[i]))
+			return -1;
+	}
+	return 0;
+}
+
+static void nvme_snap_hash_dir(__u64 *crc, const char *dir,
+			       const char *prefix, bool recurse)
+{
+	struct dirent *d;
+	char path[PATH_MAX];
+	DIR *dp;
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+
+	while ((d = readdir(dp))) {
+		if (d->d_name[0] == '.' ||
+		    (prefix && strncmp(d->d_name, prefix, strlen(prefix))))
+			continue;
+		*crc = nvme_crc64_nvme(*crc, d->d_name, strlen(d->d_name) + 1);
+		*crc = nvme_crc64_nvme(*crc, &d->d_ino, sizeof(d->d_ino));
+		if (recurse && snprintf(path, sizeof(path), "%s/%s", dir,
+					d->d_name) < (int)sizeof(path))
+			nvme_snap_hash_dir(crc, path, "nvme", false);
+	}
+	closedir(dp);
+}
+
+/*
+ * sysfs hands out a new inode number for every directory it creates, so
+ * the names and inode numbers of the NVMe devices change with every
+ * controller, namespace or path which comes or goes, even if the name is
+ * reused. The boot ID takes care of inode numbers reused after a reboot.
+ */
+__u64 nvme_snapshot_generation(void)
+{
+	char boot_id[64] = { };
+	__u64 crc = 0;
+	ssize_t len;
+	int fd;
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		len = read(fd, boot_id, sizeof(boot_id));
+		if (len > 0)
+			crc = nvme_crc64_nvme(crc, boot_id, len);
+		close(fd);
+	}
+
+	nvme_snap_hash_dir(&crc, nvme_ctrl_sysfs_dir, NULL, true);
+	nvme_snap_hash_dir(&crc, nvme_subsys_sysfs_dir, NULL, false);
+	nvme_snap_hash_dir(&crc, nvme_ns_sysfs_dir, "nvme", false);
+	return crc;
+}
+
+static void nvme_snap_fill_ctrl(struct nvme_snap_ctrl *rec, nvme_ctrl_t c)
+{
+	const struct nvme_fabrics_config *cfg = &c->cfg;
+
+	rec->cfg[0] = cfg->queue_size;
+	rec->cfg[1] = cfg->nr_io_queues;
+	rec->cfg[2] = cfg->reconnect_delay;
+	rec->cfg[3] = cfg->ctrl_loss_tmo;
+	rec->cfg[4] = cfg->fast_io_fail_tmo;
+	rec->cfg[5] = cfg->keep_alive_tmo;
+	rec->cfg[6] = cfg->nr_write_queues;
+	rec->cfg[7] = cfg->nr_poll_queues;
+	rec->cfg[8] = cfg->tos;
+	rec->cfg_flags = cfg->duplicate_connect << 0 |
+		cfg->disable_sqflow << 1 | cfg->hdr_digest << 2 |
+		cfg->data_digest << 3 | cfg->tls << 4;
+
+	rec->flags = (c->discovery_ctrl ? NVME_SNAP_CTRL_DISCOVERY : 0) |
+		(c->discovered ? NVME_SNAP_CTRL_DISCOVERED : 0) |
+		(c->persistent ? NVME_SNAP_CTRL_PERSISTENT : 0) |
+		(c->xfer_valid ? NVME_SNAP_CTRL_XFER_VALID : 0);
+	rec->mdts = c->mdts;
+	rec->mpsmin = c->mpsmin;
+	rec->max_xfer_len = c->max_xfer_len;
+}
+
+static void nvme_snap_fill_ns(struct nvme_snap_ns *rec, nvme_ns_t n)
+{
+	rec->nsid = n->nsid;
+	rec->lba_shift = n->lba_shift;
+	rec->lba_size = n->lba_size;
+	rec->meta_size = n->meta_size;
+	rec->csi = n->csi;
+	rec->lba_count = n->lba_count;
+	rec->lba_util = n->lba_util;
+	memcpy(rec->eui64, n->eui64, sizeof(rec->eui64));
+	memcpy(rec->nguid, n->nguid, sizeof(rec->nguid));
+	memcpy(rec->uuid, n->uuid, sizeof(rec->uuid));
+	rec->pi_type = n->pi_type;
+	rec->pif = n->pif;
+	rec->sts = n->sts;
+	rec->flags = (n->identified ? NVME_SNAP_NS_IDENTIFIED : 0) |
+		(n->pi_first ? NVME_SNAP_NS_PI_FIRST : 0) |
+		(n->meta_ext ? NVME_SNAP_NS_META_EXT : 0);
+}
+
+/* lays out the records of @r, the string table is appended later */
+static void *nvme_snap_build(nvme_root_t r, struct nvme_snap_buf *b,
+			     struct nvme_snap_hdr *hdr)
+{
+	struct nvme_snap_ptr *ns_map = NULL;
+	size_t nr[NVME_SNAP_NR] = { }, i, off, idx[NVME_SNAP_NR] = { };
+	nvme_host_t h;
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	nvme_ns_t n;
+	nvme_path_t p;
+	void *recs = NULL;
+	struct nvme_snap_host *hr;
+	struct nvme_snap_subsys *sr;
+	struct nvme_snap_ctrl *cr;
+	struct nvme_snap_ns *nr_;
+	struct nvme_snap_path *pr;
+
+	nvme_for_each_host(r, h) {
+		nr[NVME_SNAP_HOST]++;
+		nvme_for_each_subsystem(h, s) {
+			nr[NVME_SNAP_SUBSYS]++;
+			nvme_subsystem_for_each_ns(s, n)
+				nr[NVME_SNAP_NS]++;
+			nvme_subsystem_for_each_ctrl(s, c) {
+				nr[NVME_SNAP_CTRL]++;
+				nvme_ctrl_for_each_ns(c, n)
+					nr[NVME_SNAP_NS]++;
+				nvme_ctrl_for_each_path(c, p)
+					nr[NVME_SNAP_PATH]++;
+			}
+		}
+	}
+
+	off = sizeof(*hdr);
+	for (i = 0; i < NVME_SNAP_NR; i++) {
+		hdr->nr[i] = nr[i];
+		hdr->rec_size[i] = nvme_snap_rec_size[i];
+		hdr->off[i] = off;
+		off += nr[i] * nvme_snap_rec_size[i];
+	}
+	hdr->str_off = off;
+
+	recs = calloc(1, off);
+	ns_map = calloc(nr[NVME_SNAP_NS] + 1, sizeof(*ns_map));
+	if (!recs || !ns_map) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+#define NVME_SNAP_REC(type) \
+	((void *)((char *)recs + hdr->off[type] + \
+		  idx[type] * nvme_snap_rec_size[type]))
+
+	/* namespaces first, paths refer to them */
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ns(s, n) {
+				ns_map[idx[NVME_SNAP_NS]].ptr = n;
+				ns_map[idx[NVME_SNAP_NS]].idx = idx[NVME_SNAP_NS];
+				idx[NVME_SNAP_NS]++;
+			}
+			nvme_subsystem_for_each_ctrl(s, c) {
+				nvme_ctrl_for_each_ns(c, n) {
+					ns_map[idx[NVME_SNAP_NS]].ptr = n;
+					ns_map[idx[NVME_SNAP_NS]].idx =
+						idx[NVME_SNAP_NS];
+					idx[NVME_SNAP_NS]++;
+				}
+			}
+		}
+	}
+	qsort(ns_map, nr[NVME_SNAP_NS], sizeof(*ns_map), nvme_snap_ptr_cmp);
+	idx[NVME_SNAP_NS] = 0;
+
+	nvme_for_each_host(r, h) {
+		char **hf[] = NVME_SNAP_HOST_FIELDS(h);
+
+		hr = NVME_SNAP_REC(NVME_SNAP_HOST);
+		if (nvme_snap_strs(b, hf, NVME_SNAP_HOST_STRS, hr->str))
+			goto fail;
+
+		nvme_for_each_subsystem(h, s) {
+			char **sf[] = NVME_SNAP_SUBSYS_FIELDS(s);
+
+			sr = NVME_SNAP_REC(NVME_SNAP_SUBSYS);
+			sr->host = idx[NVME_SNAP_HOST];
+			if (nvme_snap_strs(b, sf, NVME_SNAP_SUBSYS_STRS,
+					   sr->str))
+				goto fail;
+
+			nvme_subsystem_for_each_ns(s, n) {
+				char **nf[] = NVME_SNAP_NS_FIELDS(n);
+
+				nr_ = NVME_SNAP_REC(NVME_SNAP_NS);
+				nr_->subsys = idx[NVME_SNAP_SUBSYS];
+				nr_->ctrl = ~0U;
+				nvme_snap_fill_ns(nr_, n);
+				if (nvme_snap_strs(b, nf, NVME_SNAP_NS_STRS,
+						   nr_->str))
+					goto fail;
+				idx[NVME_SNAP_NS]++;
+			}
+
+			nvme_subsystem_for_each_ctrl(s, c) {
+				char **cf[] = NVME_SNAP_CTRL_FIELDS(c);
+
+				cr = NVME_SNAP_REC(NVME_SNAP_CTRL);
+				cr->subsys = idx[NVME_SNAP_SUBSYS];
+				nvme_snap_fill_ctrl(cr, c);
+				if (nvme_snap_strs(b, cf, NVME_SNAP_CTRL_STRS,
+						   cr->str))
+					goto fail;
+
+				nvme_ctrl_for_each_ns(c, n) {
+					char **nf[] = NVME_SNAP_NS_FIELDS(n);
+
+					nr_ = NVME_SNAP_REC(NVME_SNAP_NS);
+					nr_->subsys = idx[NVME_SNAP_SUBSYS];
+					nr_->ctrl = idx[NVME_SNAP_CTRL];
+					nvme_snap_fill_ns(nr_, n);
+					if (nvme_snap_strs(b, nf,
+							   NVME_SNAP_NS_STRS,
+							   nr_->str))
+						goto fail;
+					idx[NVME_SNAP_NS]++;
+				}
+
+				nvme_ctrl_for_each_path(c, p) {
+					char **pf[] = NVME_SNAP_PATH_FIELDS(p);
+
+					pr = NVME_SNAP_REC(NVME_SNAP_PATH);
+					pr->ctrl = idx[NVME_SNAP_CTRL];
+					pr->ns = p->n ? nvme_snap_ptr_find(ns_map,
+						nr[NVME_SNAP_NS], p->n) : ~0U;
+					pr->grpid = p->grpid;
+					if (nvme_snap_strs(b, pf,
+							   NVME_SNAP_PATH_STRS,
+							   pr->str))
+						goto fail;
+					idx[NVME_SNAP_PATH]++;
+				}
+				idx[NVME_SNAP_CTRL]++;
+			}
+			idx[NVME_SNAP_SUBSYS]++;
+		}
+		idx[NVME_SNAP_HOST]++;
+	}
+#undef NVME_SNAP_REC
+
+	free(ns_map);
+	return recs;
+
+fail:
+	free(ns_map);
+	free(recs);
+	return NULL;
+}
+
+int nvme_snapshot_save(nvme_root_t r, const char *path)
+{
+	struct nvme_snap_hdr hdr = { .version = NVME_SNAPSHOT_VERSION };
+	struct nvme_snap_buf b = { };
+	char *tmp = NULL;
+	void *recs;
+	size_t len;
+	int fd, err;
+
+	memcpy(hdr.magic, NVME_SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.hdr_size = sizeof(hdr);
+	hdr.generation = nvme_snapshot_generation();
+
+	recs = nvme_snap_build(r, &b, &hdr);
+	if (!recs)
+		goto fail;
+
+	len = hdr.str_off + b.str_len;
+	if (len > UINT32_MAX) {
+		errno = EFBIG;
+		goto fail;
+	}
+	hdr.size = len;
+	hdr.str_len = b.str_len;
+	hdr.csum = nvme_crc64_nvme(0, (char *)recs + sizeof(hdr),
+				   hdr.str_off - sizeof(hdr));
+	hdr.csum = nvme_crc64_nvme(hdr.csum, b.strs, b.str_len);
+	memcpy(recs, &hdr, sizeof(hdr));
+
+	/* readers see either the old or the new snapshot, never a mix */
+	if (asprintf(&tmp, "%s.XXXXXX", path) < 0) {
+		tmp = NULL;
+		errno = ENOMEM;
+		goto fail;
+	}
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto fail;
+	if (fchmod(fd, 0644) ||
+	    write(fd, recs, hdr.str_off) != (ssize_t)hdr.str_off ||
+	    (b.str_len && write(fd, b.strs, b.str_len) != (ssize_t)b.str_len) ||
+	    rename(tmp, path)) {
+		err = errno ? errno : EIO;
+		close(fd);
+		unlink(tmp);
+		errno = err;
+		goto fail;
+	}
+	close(fd);
+
+	free(tmp);
+	free(b.strs);
+	free(recs);
+	return 0;
+
+fail:
+	err = errno;
+	free(tmp);
+	free(b.strs);
+	free(recs);
+	errno = err;
+	return -1;
+}
+
+struct nvme_snap_map {
+	const char *base;
+	const struct nvme_snap_hdr *hdr;
+	const char *strs;
+};
+
+static const void *nvme_snap_rec(const struct nvme_snap_map *m, int type,
+				 __u32 i)
+{
+	return m->base + m->hdr->off[type] + (size_t)i * m->hdr->rec_size[type];
+}
+
+static int nvme_snap_load_strs(const struct nvme_snap_map *m, char **fields[],
+			       unsigned int nr, const __u32 *str)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!str[i])
+			continue;
+		*fields[i] = strdup(m->strs + str[i] - 1);
+		if (!*fields[i]) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int nvme_snap_check(const struct nvme_snap_map *m, size_t size)
+{
+	const struct nvme_snap_hdr *hdr = m->hdr;
+	const __u32 *str;
+	unsigned int nr_str[NVME_SNAP_NR] = {
+		NVME_SNAP_HOST_STRS, NVME_SNAP_SUBSYS_STRS,
+		NVME_SNAP_CTRL_STRS, NVME_SNAP_NS_STRS, NVME_SNAP_PATH_STRS,
+	};
+	size_t str_pos[NVME_SNAP_NR] = {
+		offsetof(struct nvme_snap_host, str),
+		offsetof(struct nvme_snap_subsys, str),
+		offsetof(struct nvme_snap_ctrl, str),
+		offsetof(struct nvme_snap_ns, str),
+		offsetof(struct nvme_snap_path, str),
+	};
+	__u64 csum;
+	__u32 i, j;
+	int t;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, NVME_SNAPSHOT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != NVME_SNAPSHOT_VERSION ||
+	    hdr->hdr_size != sizeof(*hdr) || hdr->size != size ||
+	    hdr->str_off > size || hdr->str_len != size - hdr->str_off ||
+	    (hdr->str_len && m->strs[hdr->str_len - 1]))
+		return -1;
+
+	for (t = 0; t < NVME_SNAP_NR; t++) {
+		if (hdr->rec_size[t] != nvme_snap_rec_size[t] ||
+		    hdr->off[t] < sizeof(*hdr) ||
+		    hdr->off[t] > hdr->str_off ||
+		    (hdr->str_off - hdr->off[t]) / hdr->rec_size[t] <
+		    hdr->nr[t])
+			return -1;
+	}
+
+	csum = nvme_crc64_nvme(0, m->base + sizeof(*hdr), size - sizeof(*hdr));
+	if (csum != hdr->csum)
+		return -1;
+
+	/* after the checksum, so only against bugs, not against corruption */
+	for (t = 0; t < NVME_SNAP_NR; t++) {
+		for (i = 0; i < hdr->nr[t]; i++) {
+			str = (const __u32 *)((const char *)nvme_snap_rec(m, t, i) +
+					      str_pos[t]);
+			for (j = 0; j < nr_str[t]; j++) {
+				if (str[j] > hdr->str_len)
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static struct nvme_ctrl *nvme_snap_load_ctrl(nvme_root_t r,
+					     const struct nvme_snap_ctrl *rec)
+{
+	struct nvme_fabrics_config *cfg;
+	struct nvme_ctrl *c;
+
+	c = nvme_slab_zalloc(r->ctrl_slab, sizeof(*c));
+	if (!c) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	c->fd = -1;
+	c->state_fd = -1;
+	list_head_init(&c->namespaces);
+	list_head_init(&c->paths);
+	list_node_init(&c->entry);
+
+	cfg = &c->cfg;
+	cfg->queue_size = rec->cfg[0];
+	cfg->nr_io_queues = rec->cfg[1];
+	cfg->reconnect_delay = rec->cfg[2];
+	cfg->ctrl_loss_tmo = rec->cfg[3];
+	cfg->fast_io_fail_tmo = rec->cfg[4];
+	cfg->keep_alive_tmo = rec->cfg[5];
+	cfg->nr_write_queues = rec->cfg[6];
+	cfg->nr_poll_queues = rec->cfg[7];
+	cfg->tos = rec->cfg[8];
+	cfg->duplicate_connect = rec->cfg_flags & (1 << 0);
+	cfg->disable_sqflow = rec->cfg_flags & (1 << 1);
+	cfg->hdr_digest = rec->cfg_flags & (1 << 2);
+	cfg->data_digest = rec->cfg_flags & (1 << 3);
+	cfg->tls = rec->cfg_flags & (1 << 4);
+
+	c->discovery_ctrl = rec->flags & NVME_SNAP_CTRL_DISCOVERY;
+	c->discovered = rec->flags & NVME_SNAP_CTRL_DISCOVERED;
+	c->persistent = rec->flags & NVME_SNAP_CTRL_PERSISTENT;
+	c->xfer_valid = rec->flags & NVME_SNAP_CTRL_XFER_VALID;
+	c->mdts = rec->mdts;
+	c->mpsmin = rec->mpsmin;
+	c->max_xfer_len = rec->max_xfer_len;
+	return c;
+}
+
+static struct nvme_ns *nvme_snap_load_ns(nvme_root_t r,
+					 const struct nvme_snap_ns *rec)
+{
+	struct nvme_ns *n;
+
+	n = nvme_slab_zalloc(r->ns_slab, sizeof(*n));
+	if (!n) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	n->fd = -1;
+	n->generic_fd = -1;
+	list_head_init(&n->paths);
+	list_node_init(&n->entry);
+
+	n->nsid = rec->nsid;
+	n->lba_shift = rec->lba_shift;
+	n->lba_size = rec->lba_size;
+	n->meta_size = rec->meta_size;
+	n->csi = rec->csi;
+	n->lba_count = rec->lba_count;
+	n->lba_util = rec->lba_util;
+	memcpy(n->eui64, rec->eui64, sizeof(n->eui64));
+	memcpy(n->nguid, rec->nguid, sizeof(n->nguid));
+	memcpy(n->uuid, rec->uuid, sizeof(n->uuid));
+	n->pi_type = rec->pi_type;
+	n->pif = rec->pif;
+	n->sts = rec->sts;
+	n->identified = rec->flags & NVME_SNAP_NS_IDENTIFIED;
+	n->pi_first = rec->flags & NVME_SNAP_NS_PI_FIRST;
+	n->meta_ext = rec->flags & NVME_SNAP_NS_META_EXT;
+	return n;
+}
+
+/*
+ * The objects are added to the head of their lists, so walking the
+ * records backwards restores the order they were saved in.
+ */
+static int nvme_snap_load(nvme_root_t r, const struct nvme_snap_map *m)
+{
+	const struct nvme_snap_hdr *hdr = m->hdr;
+	struct nvme_subsystem **subsys = NULL;
+	struct nvme_host **hosts = NULL;
+	struct nvme_ctrl **ctrls = NULL;
+	struct nvme_ns **ns = NULL;
+	__u32 i;
+	int ret = -1;
+
+	hosts = calloc(hdr->nr[NVME_SNAP_HOST] + 1, sizeof(*hosts));
+	subsys = calloc(hdr->nr[NVME_SNAP_SUBSYS] + 1, sizeof(*subsys));
+	ctrls = calloc(hdr->nr[NVME_SNAP_CTRL] + 1, sizeof(*ctrls));
+	ns = calloc(hdr->nr[NVME_SNAP_NS] + 1, sizeof(*ns));
+	if (!hosts || !subsys || !ctrls || !ns) {
+		errno = ENOMEM;
+		goto free;
+	}
+
+	for (i = hdr->nr[NVME_SNAP_HOST]; i--; ) {
+		const struct nvme_snap_host *rec =
+			nvme_snap_rec(m, NVME_SNAP_HOST, i);
+		struct nvme_host *h;
+
+		h = nvme_slab_zalloc(r->host_slab, sizeof(*h));
+		if (!h) {
+			errno = ENOMEM;
+			goto free;
+		}
+		list_head_init(&h->subsystems);
+		list_node_init(&h->entry);
+		h->r = r;
+		list_add(&r->hosts, &h->entry);
+		hosts[i] = h;
+
+		char **hf[] = NVME_SNAP_HOST_FIELDS(h);
+		if (nvme_snap_load_strs(m, hf, NVME_SNAP_HOST_STRS, rec->str))
+			goto free;
+		if (!h->hostnqn) {
+			errno = EINVAL;
+			goto free;
+		}
+		nvme_index_host(r, h);
+	}
+
+	for (i = hdr->nr[NVME_SNAP_SUBSYS]; i--; ) {
+		const struct nvme_snap_subsys *rec =
+			nvme_snap_rec(m, NVME_SNAP_SUBSYS, i);
+		struct nvme_subsystem *s;
+
+		if (rec->host >= hdr->nr[NVME_SNAP_HOST]) {
+			errno = EINVAL;
+			goto free;
+		}
+		s = nvme_slab_zalloc(r->subsys_slab, sizeof(*s));
+		if (!s) {
+			errno = ENOMEM;
+			goto free;
+		}
+		s->h = hosts[rec->host];
+		list_head_init(&s->ctrls);
+		list_head_init(&s->namespaces);
+		list_node_init(&s->entry);
+		list_add(&s->h->subsystems, &s->entry);
+		subsys[i] = s;
+
+		char **sf[] = NVME_SNAP_SUBSYS_FIELDS(s);
+		if (nvme_snap_load_strs(m, sf, NVME_SNAP_SUBSYS_STRS,
+					rec->str))
+			goto free;
+		nvme_index_subsystem(r, s);
+	}
+
+	for (i = hdr->nr[NVME_SNAP_CTRL]; i--; ) {
+		const struct nvme_snap_ctrl *rec =
+			nvme_snap_rec(m, NVME_SNAP_CTRL, i);
+		struct nvme_ctrl *c;
+
+		if (rec->subsys >= hdr->nr[NVME_SNAP_SUBSYS]) {
+			errno = EINVAL;
+			goto free;
+		}
+		c = nvme_snap_load_ctrl(r, rec);
+		if (!c)
+			goto free;
+
+		char **cf[] = NVME_SNAP_CTRL_FIELDS(c);
+		if (nvme_snap_load_strs(m, cf, NVME_SNAP_CTRL_STRS,
+					rec->str) || !c->transport) {
+			nvme_free_ctrl(c);
+			if (!errno)
+				errno = EINVAL;
+			goto free;
+		}
+		nvme_link_ctrl(subsys[rec->subsys], c);
+		ctrls[i] = c;
+	}
+
+	for (i = hdr->nr[NVME_SNAP_NS]; i--; ) {
+		const struct nvme_snap_ns *rec =
+			nvme_snap_rec(m, NVME_SNAP_NS, i);
+		struct nvme_ns *n;
+
+		if (rec->subsys >= hdr->nr[NVME_SNAP_SUBSYS] ||
+		    (rec->ctrl != ~0U && rec->ctrl >= hdr->nr[NVME_SNAP_CTRL])) {
+			errno = EINVAL;
+			goto free;
+		}
+		n = nvme_snap_load_ns(r, rec);
+		if (!n)
+			goto free;
+		n->s = subsys[rec->subsys];
+		if (rec->ctrl != ~0U) {
+			n->c = ctrls[rec->ctrl];
+			list_add(&n->c->namespaces, &n->entry);
+		} else {
+			list_add(&n->s->namespaces, &n->entry);
+			n->hnode.seq = ++r->index_seq;
+			nvme_index_ns(r, n);
+		}
+		ns[i] = n;
+
+		char **nf[] = NVME_SNAP_NS_FIELDS(n);
+		if (nvme_snap_load_strs(m, nf, NVME_SNAP_NS_STRS, rec->str))
+			goto free;
+		if (!n->name) {
+			errno = EINVAL;
+			goto free;
+		}
+	}
+
+	for (i = hdr->nr[NVME_SNAP_PATH]; i--; ) {
+		const struct nvme_snap_path *rec =
+			nvme_snap_rec(m, NVME_SNAP_PATH, i);
+		struct nvme_path *p;
+
+		if (rec->ctrl >= hdr->nr[NVME_SNAP_CTRL] ||
+		    (rec->ns != ~0U && rec->ns >= hdr->nr[NVME_SNAP_NS])) {
+			errno = EINVAL;
+			goto free;
+		}
+		p = nvme_slab_zalloc(r->path_slab, sizeof(*p));
+		if (!p) {
+			errno = ENOMEM;
+			goto free;
+		}
+		p->c = ctrls[rec->ctrl];
+		p->ana_state_fd = -1;
+		p->grpid = rec->grpid;
+		list_node_init(&p->nentry);
+		list_node_init(&p->entry);
+		list_add(&p->c->paths, &p->entry);
+		if (rec->ns != ~0U) {
+			p->n = ns[rec->ns];
+			list_add(&p->n->paths, &p->nentry);
+		}
+
+		char **pf[] = NVME_SNAP_PATH_FIELDS(p);
+		if (nvme_snap_load_strs(m, pf, NVME_SNAP_PATH_STRS, rec->str))
+			goto free;
+		if (!p->name) {
+			errno = EINVAL;
+			goto free;
+		}
+	}
+	ret = 0;
+
+free:
+	free(ns);
+	free(ctrls);
+	free(subsys);
+	free(hosts);
+	return ret;
+}
+
+nvme_root_t nvme_snapshot_load(const char *path)
+{
+	struct nvme_snap_map m;
+	nvme_root_t r = NULL;
+	struct stat st;
+	void *base;
+	int fd, err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	if (st.st_size < (off_t)sizeof(struct nvme_snap_hdr) ||
+	    st.st_size > UINT32_MAX) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	err = errno;
+	close(fd);
+	if (base == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+
+	m.base = base;
+	m.hdr = base;
+	m.strs = m.base + m.hdr->str_off;
+	if (m.hdr->str_off > st.st_size || nvme_snap_check(&m, st.st_size)) {
+		errno = EINVAL;
+		goto unmap;
+	}
+	if (m.hdr->generation != nvme_snapshot_generation()) {
+		errno = ESTALE;
+		goto unmap;
+	}
+
+	r = nvme_create_root(NULL, DEFAULT_LOGLEVEL);
+	if (!r) {
+		errno = ENOMEM;
+		goto unmap;
+	}
+	if (nvme_snap_load(r, &m)) {
+		err = errno;
+		nvme_free_tree(r);
+		r = NULL;
+		errno = err;
+	}
+
+unmap:
+	err = errno;
+	munmap(base, st.st_size);
+	errno = err;
+	return r;
+}
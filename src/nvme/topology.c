@@ -0,0 +1,168 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tree.h"
+#include "private.h"
+
+/*
+ * Readers announce themselves in the counter of the current epoch while
+ * they load the current tree and take a reference on it. After publishing
+ * a new tree, the writer flips the epoch and waits for the counter of the
+ * old one to drain: from then on no reader can still be about to take a
+ * reference on the old tree, so the reference held by the topology can be
+ * dropped. Readers only ever stay in an epoch for a few instructions.
+ */
+struct nvme_topology {
+	pthread_mutex_t lock;
+	nvme_root_t current;
+	unsigned int epoch;
+	unsigned int active[2];
+	__u64 generation;
+
+	FILE *fp;
+	int log_level;
+	char *config_file;
+	nvme_scan_filter_t f;
+	void *f_args;
+};
+
+static nvme_root_t nvme_topology_scan(nvme_topology_t t)
+{
+	nvme_root_t r;
+
+	r = nvme_create_root(t->fp, t->log_level);
+	if (!r)
+		return NULL;
+
+	/* like nvme_scan(), a missing sysfs class is an empty topology */
+	nvme_scan_topology(r, t->f, t->f_args);
+	if (t->config_file)
+		nvme_read_config(r, t->config_file);
+	nvme_prepare_published(r);
+
+	r->published = true;
+	r->refs = 1;
+	return r;
+}
+
+nvme_topology_t nvme_topology_create(FILE *fp, int log_level,
+				     const char *config_file,
+				     nvme_scan_filter_t f, void *f_args)
+{
+	struct nvme_topology *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_init(&t->lock, NULL);
+	t->fp = fp;
+	t->log_level = log_level;
+	t->f = f;
+	t->f_args = f_args;
+	if (config_file) {
+		t->config_file = strdup(config_file);
+		if (!t->config_file) {
+			errno = ENOMEM;
+			goto free;
+		}
+	}
+
+	t->current = nvme_topology_scan(t);
+	if (!t->current)
+		goto free;
+	t->generation = 1;
+	return t;
+
+free:
+	free(t->config_file);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+	return NULL;
+}
+
+void nvme_topology_put(nvme_root_t r)
+{
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+	nvme_free_tree(r);
+}
+
+nvme_root_t nvme_topology_get(nvme_topology_t t)
+{
+	unsigned int e;
+	nvme_root_t r;
+
+	for (;;) {
+		e = __atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&t->active[e], 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&t->epoch, __ATOMIC_SEQ_CST) == e)
+			break;
+		__atomic_sub_fetch(&t->active[e], 1, __ATOMIC_SEQ_CST);
+	}
+
+	r = __atomic_load_n(&t->current, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&r->refs, 1, __ATOMIC_ACQ_REL);
+
+	__atomic_sub_fetch(&t->active[e], 1, __ATOMIC_SEQ_CST);
+	return r;
+}
+
+/* called with t->lock held */
+static void nvme_topology_publish(nvme_topology_t t, nvme_root_t r)
+{
+	nvme_root_t old = t->current;
+	unsigned int e = t->epoch;
+
+	__atomic_store_n(&t->current, r, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&t->epoch, !e, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&t->active[e], __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	if (old)
+		nvme_topology_put(old);
+}
+
+int nvme_topology_refresh(nvme_topology_t t)
+{
+	nvme_root_t r;
+
+	pthread_mutex_lock(&t->lock);
+	r = nvme_topology_scan(t);
+	if (!r) {
+		pthread_mutex_unlock(&t->lock);
+		return -1;
+	}
+	nvme_topology_publish(t, r);
+	__atomic_add_fetch(&t->generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&t->lock);
+	return 0;
+}
+
+__u64 nvme_topology_get_generation(nvme_topology_t t)
+{
+	return __atomic_load_n(&t->generation, __ATOMIC_ACQUIRE);
+}
+
+void nvme_topology_free(nvme_topology_t t)
+{
+	if (!t)
+		return;
+
+	pthread_mutex_lock(&t->lock);
+	nvme_topology_publish(t, NULL);
+	pthread_mutex_unlock(&t->lock);
+
+	pthread_mutex_destroy(&t->lock);
+	free(t->config_file);
+	free(t);
+}
@@ -13,14 +13,18 @@
 #include <stdio.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <libgen.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 
+#include <ccan/array_size/array_size.h>
 #include <ccan/endian/endian.h>
 #include <ccan/list/list.h>
 
@@ -32,8 +36,22 @@
 #include "util.h"
 #include "fabrics.h"
 #include "log.h"
+#include "uring.h"
+#include "pi.h"
 #include "private.h"
 
+/* queue depth of the per-namespace io_uring ring */
+#define NVME_NS_URING_DEPTH	32
+
+/* buffer segments per command when the kernel doesn't report a limit */
+#define NVME_NS_RWV_MAX_SEGS	128
+
+/* tree nodes are carved from chunks of this many objects */
+#define NVME_SLAB_CHUNK_OBJS	64
+
+/* upper bound of the automatic transfer size, the kernel's NVME_MAX_KB_SZ */
+#define NVME_CTRL_XFER_MAX	(4096 * 1024)
+
 static struct nvme_host *default_host;
 
 static void __nvme_free_host(nvme_host_t h);
@@ -47,6 +65,131 @@ static int nvme_scan_subsystem(nvme_root_t r, const char *name,
 static int nvme_ctrl_scan_namespace(nvme_root_t r, struct nvme_ctrl *c,
 				    char *name);
 static int nvme_ctrl_scan_path(nvme_root_t r, struct nvme_ctrl *c, char *name);
+static void nvme_scan_pending_ns(nvme_root_t r, nvme_scan_filter_t f,
+				 void *f_args);
+static void nvme_ns_drop_pending(struct nvme_ns *n);
+
+struct nvme_ctrl_key {
+	const char *transport;
+	const char *traddr;
+	const char *host_traddr;
+	const char *host_iface;
+	const char *trsvcid;
+};
+
+struct nvme_subsystem_key {
+	const char *name;
+	const char *subsysnqn;
+};
+
+struct nvme_ns_key {
+	struct nvme_subsystem *s;
+	__u32 nsid;
+};
+
+struct nvme_host_key {
+	const char *hostnqn;
+	const char *hostid;
+};
+
+/*
+ * Returns the matching entry with the highest sequence number below
+ * @below, or @best if that one is still better.
+ */
+static struct nvme_hnode *nvme_index_find(struct nvme_htable *t,
+		unsigned int hash, unsigned long below,
+		bool (*match)(struct nvme_hnode *node, const void *key),
+		const void *key, struct nvme_hnode *best)
+{
+	struct nvme_hnode *node;
+
+	for (node = nvme_htable_first(t, hash); node; node = node->next) {
+		if (node->hash != hash || node->seq >= below)
+			continue;
+		if (best && best->seq >= node->seq)
+			continue;
+		if (match(node, key))
+			best = node;
+	}
+	return best;
+}
+
+static unsigned int nvme_host_hash(nvme_root_t r, const char *hostnqn)
+{
+	return nvme_hash_str(nvme_hash_ptr(r), hostnqn, false);
+}
+
+/* entries without a subsystem NQN match any, and are hashed as "" */
+static unsigned int nvme_subsystem_hash(nvme_host_t h, const char *subsysnqn)
+{
+	return nvme_hash_str(nvme_hash_ptr(h), subsysnqn ? subsysnqn : "",
+			     false);
+}
+
+/* entries without a transport address match any, and are hashed as "" */
+static unsigned int nvme_ctrl_hash(nvme_subsystem_t s, const char *transport,
+				   const char *traddr)
+{
+	unsigned int hash = nvme_hash_str(nvme_hash_ptr(s), transport, false);
+
+	return nvme_hash_str(hash, traddr ? traddr : "", true);
+}
+
+static unsigned int nvme_ns_hash(nvme_subsystem_t s, __u32 nsid)
+{
+	return nvme_hash_ptr(s) ^ nsid;
+}
+
+void nvme_index_host(nvme_root_t r, struct nvme_host *h)
+{
+	h->hnode.seq = ++r->index_seq;
+	nvme_htable_add(&r->host_index, &h->hnode,
+			nvme_host_hash(r, h->hostnqn));
+}
+
+void nvme_index_subsystem(nvme_root_t r, struct nvme_subsystem *s)
+{
+	s->hnode.seq = ++r->index_seq;
+	nvme_htable_add(&r->subsys_index, &s->hnode,
+			nvme_subsystem_hash(s->h, s->subsysnqn));
+}
+
+void nvme_link_ctrl(struct nvme_subsystem *s, struct nvme_ctrl *c)
+{
+	nvme_root_t r = s->h ? s->h->r : NULL;
+
+	c->s = s;
+	list_add(&s->ctrls, &c->entry);
+	if (!r)
+		return;
+	c->hnode.seq = ++r->index_seq;
+	nvme_htable_add(&r->ctrl_index, &c->hnode,
+			nvme_ctrl_hash(s, c->transport, c->traddr));
+}
+
+void nvme_ctrl_reindex(nvme_ctrl_t c)
+{
+	nvme_root_t r;
+
+	if (!c->hnode.pprev)
+		return;
+	r = c->s->h->r;
+	nvme_htable_del(&r->ctrl_index, &c->hnode);
+	nvme_htable_add(&r->ctrl_index, &c->hnode,
+			nvme_ctrl_hash(c->s, c->transport, c->traddr));
+}
+
+/* the sequence number is taken on list insertion, see nvme_scan_pending_ns */
+void nvme_index_ns(nvme_root_t r, struct nvme_ns *n)
+{
+	nvme_htable_add(&r->ns_index, &n->hnode, nvme_ns_hash(n->s, n->nsid));
+}
+
+static void nvme_unindex_ns(struct nvme_ns *n)
+{
+	if (n->hnode.pprev)
+		nvme_htable_del(&n->s->h->r->ns_index, &n->hnode);
+}
 
 static inline void nvme_free_dirents(struct dirent **d, int i)
 {
@@ -91,6 +234,8 @@ int nvme_scan_topology(struct nvme_root *r, nvme_scan_filter_t f, void *f_args)
 		return num_ctrls;
 	}
 
+	r->scanning = true;
+
 	for (i = 0; i < num_ctrls; i++) {
 		nvme_ctrl_t c = nvme_scan_ctrl(r, ctrls[i]->d_name);
 		if (!c) {
@@ -111,6 +256,8 @@ int nvme_scan_topology(struct nvme_root *r, nvme_scan_filter_t f, void *f_args)
 	if (num_subsys < 0) {
 		nvme_msg(r, LOG_DEBUG, "failed to scan subsystems: %s\n",
 			 strerror(errno));
+		r->scanning = false;
+		nvme_scan_pending_ns(r, f, f_args);
 		return num_subsys;
 	}
 
@@ -125,6 +272,9 @@ int nvme_scan_topology(struct nvme_root *r, nvme_scan_filter_t f, void *f_args)
 
 	nvme_free_dirents(subsys, i);
 
+	r->scanning = false;
+	nvme_scan_pending_ns(r, f, f_args);
+
 	return 0;
 }
 
@@ -142,6 +292,19 @@ nvme_root_t nvme_create_root(FILE *fp, int log_level)
 		r->fp = fp;
 	list_head_init(&r->hosts);
 	list_head_init(&r->endpoints);
+	r->resolver_ttl = NVME_RESOLVER_DEFAULT_TTL;
+
+	/* on failure nodes are just allocated individually */
+	r->host_slab = nvme_slab_create(sizeof(struct nvme_host),
+					NVME_SLAB_CHUNK_OBJS);
+	r->subsys_slab = nvme_slab_create(sizeof(struct nvme_subsystem),
+					  NVME_SLAB_CHUNK_OBJS);
+	r->ctrl_slab = nvme_slab_create(sizeof(struct nvme_ctrl),
+					NVME_SLAB_CHUNK_OBJS);
+	r->ns_slab = nvme_slab_create(sizeof(struct nvme_ns),
+				      NVME_SLAB_CHUNK_OBJS);
+	r->path_slab = nvme_slab_create(sizeof(struct nvme_path),
+					NVME_SLAB_CHUNK_OBJS);
 	return r;
 }
 
@@ -170,6 +333,52 @@ int nvme_read_config(nvme_root_t r, const char *config_file)
 	return err;
 }
 
+void nvme_root_set_scan_threads(nvme_root_t r, unsigned int nr_threads)
+{
+	r->scan_threads = nr_threads;
+}
+
+void nvme_root_set_lazy_ns_identify(nvme_root_t r, bool lazy)
+{
+	r->lazy_ns_identify = lazy;
+}
+
+void nvme_root_set_resolver_ttl(nvme_root_t r, unsigned int ttl)
+{
+	r->resolver_ttl = ttl;
+	nvme_resolver_cache_free(r->resolver_cache);
+	r->resolver_cache = NULL;
+}
+
+void nvme_root_set_cache_attr_fds(nvme_root_t r, bool cache)
+{
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	nvme_host_t h;
+	nvme_path_t p;
+
+	r->cache_attr_fds = cache;
+	if (cache)
+		return;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ctrl(s, c) {
+				if (c->state_fd >= 0) {
+					close(c->state_fd);
+					c->state_fd = -1;
+				}
+				nvme_ctrl_for_each_path(c, p) {
+					if (p->ana_state_fd < 0)
+						continue;
+					close(p->ana_state_fd);
+					p->ana_state_fd = -1;
+				}
+			}
+		}
+	}
+}
+
 nvme_root_t nvme_scan(const char *config_file)
 {
 	nvme_root_t r = nvme_create_root(NULL, DEFAULT_LOGLEVEL);
@@ -279,6 +488,17 @@ void nvme_free_tree(nvme_root_t r)
 		__nvme_free_host(h);
 	if (r->config_file)
 		free(r->config_file);
+	nvme_slab_destroy(r->host_slab);
+	nvme_slab_destroy(r->subsys_slab);
+	nvme_slab_destroy(r->ctrl_slab);
+	nvme_slab_destroy(r->ns_slab);
+	nvme_slab_destroy(r->path_slab);
+	nvme_htable_free(&r->host_index);
+	nvme_htable_free(&r->subsys_index);
+	nvme_htable_free(&r->ctrl_index);
+	nvme_htable_free(&r->ns_index);
+	nvme_dhchap_cache_free(r->dhchap_cache);
+	nvme_resolver_cache_free(r->resolver_cache);
 	free(r);
 }
 
@@ -340,11 +560,19 @@ nvme_path_t nvme_namespace_next_path(nvme_ns_t ns, nvme_path_t p)
 static void __nvme_free_ns(struct nvme_ns *n)
 {
 	list_del_init(&n->entry);
-	close(n->fd);
+	nvme_unindex_ns(n);
+	if (n->pending)
+		nvme_ns_drop_pending(n);
+	nvme_buf_pool_free(n->pool);
+	nvme_uring_free(n->ring);
+	if (n->fd >= 0)
+		close(n->fd);
+	if (n->generic_fd >= 0)
+		close(n->generic_fd);
 	free(n->generic_name);
 	free(n->name);
 	free(n->sysfs_dir);
-	free(n);
+	nvme_slab_free(n);
 }
 
 /* Stub for SWIG */
@@ -358,6 +586,7 @@ static void __nvme_free_subsystem(struct nvme_subsystem *s)
 	struct nvme_ns *n, *_n;
 
 	list_del_init(&s->entry);
+	nvme_htable_del(&s->h->r->subsys_index, &s->hnode);
 	nvme_subsystem_for_each_ctrl_safe(s, c, _c)
 		__nvme_free_ctrl(c);
 
@@ -376,7 +605,7 @@ static void __nvme_free_subsystem(struct nvme_subsystem *s)
 		free(s->firmware);
 	if (s->subsystype)
 		free(s->subsystype);
-	free(s);
+	nvme_slab_free(s);
 }
 
 /*
@@ -392,7 +621,7 @@ struct nvme_subsystem *nvme_alloc_subsystem(struct nvme_host *h,
 {
 	struct nvme_subsystem *s;
 
-	s = calloc(1, sizeof(*s));
+	s = nvme_slab_zalloc(h->r->subsys_slab, sizeof(*s));
 	if (!s)
 		return NULL;
 
@@ -404,25 +633,59 @@ struct nvme_subsystem *nvme_alloc_subsystem(struct nvme_host *h,
 	list_head_init(&s->namespaces);
 	list_node_init(&s->entry);
 	list_add(&h->subsystems, &s->entry);
+	nvme_index_subsystem(h->r, s);
 	h->r->modified = true;
 	return s;
 }
 
+static bool nvme_subsystem_matches(struct nvme_subsystem *s,
+				   const char *name, const char *subsysnqn)
+{
+	if (subsysnqn && s->subsysnqn &&
+	    strcmp(s->subsysnqn, subsysnqn))
+		return false;
+	if (name && s->name &&
+	    strcmp(s->name, name))
+		return false;
+	return true;
+}
+
+static bool nvme_subsystem_match_node(struct nvme_hnode *node,
+				      const void *key)
+{
+	const struct nvme_subsystem_key *k = key;
+	struct nvme_subsystem *s =
+		container_of(node, struct nvme_subsystem, hnode);
+
+	return nvme_subsystem_matches(s, k->name, k->subsysnqn);
+}
+
 struct nvme_subsystem *nvme_lookup_subsystem(struct nvme_host *h,
 					     const char *name,
 					     const char *subsysnqn)
 {
+	struct nvme_subsystem_key key = {
+		.name = name,
+		.subsysnqn = subsysnqn,
+	};
+	struct nvme_htable *t = &h->r->subsys_index;
 	struct nvme_subsystem *s;
+	struct nvme_hnode *node;
 
-	nvme_for_each_subsystem(h, s) {
-		if (subsysnqn && s->subsysnqn &&
-		    strcmp(s->subsysnqn, subsysnqn))
-			continue;
-		if (name && s->name &&
-		    strcmp(s->name, name))
-			continue;
-		return s;
+	if (!subsysnqn || t->failed) {
+		nvme_for_each_subsystem(h, s) {
+			if (nvme_subsystem_matches(s, name, subsysnqn))
+				return s;
+		}
+		return nvme_alloc_subsystem(h, name, subsysnqn);
 	}
+
+	node = nvme_index_find(t, nvme_subsystem_hash(h, subsysnqn), ULONG_MAX,
+			       nvme_subsystem_match_node, &key, NULL);
+	node = nvme_index_find(t, nvme_subsystem_hash(h, NULL), ULONG_MAX,
+			       nvme_subsystem_match_node, &key, node);
+	if (node)
+		return container_of(node, struct nvme_subsystem, hnode);
 	return nvme_alloc_subsystem(h, name, subsysnqn);
 }
 
@@ -431,6 +694,7 @@ static void __nvme_free_host(struct nvme_host *h)
 	struct nvme_subsystem *s, *_s;
 
 	list_del_init(&h->entry);
+	nvme_htable_del(&h->r->host_index, &h->hnode);
 	nvme_for_each_subsystem_safe(h, s, _s)
 		__nvme_free_subsystem(s);
 	free(h->hostnqn);
@@ -440,7 +704,7 @@ static void __nvme_free_host(struct nvme_host *h)
 		free(h->dhchap_key);
 	nvme_host_set_hostsymname(h, NULL);
 	h->r->modified = true;
-	free(h);
+	nvme_slab_free(h);
 }
 
 /* Stub for SWIG */
@@ -448,22 +712,50 @@ void nvme_free_host(struct nvme_host *h)
 {
 }
 
+static bool nvme_host_matches(struct nvme_host *h, const char *hostnqn,
+			      const char *hostid)
+{
+	if (strcmp(h->hostnqn, hostnqn))
+		return false;
+	if (hostid && (!h->hostid ||
+	    strcmp(h->hostid, hostid)))
+		return false;
+	return true;
+}
+
+static bool nvme_host_match_node(struct nvme_hnode *node, const void *key)
+{
+	const struct nvme_host_key *k = key;
+
+	return nvme_host_matches(container_of(node, struct nvme_host, hnode),
+				 k->hostnqn, k->hostid);
+}
+
 struct nvme_host *nvme_lookup_host(nvme_root_t r, const char *hostnqn,
 				   const char *hostid)
 {
+	struct nvme_host_key key = {
+		.hostnqn = hostnqn,
+		.hostid = hostid,
+	};
+	struct nvme_hnode *node;
 	struct nvme_host *h;
 
 	if (!hostnqn)
 		return NULL;
-	nvme_for_each_host(r, h) {
-		if (strcmp(h->hostnqn, hostnqn))
-			continue;
-		if (hostid && (!h->hostid ||
-		    strcmp(h->hostid, hostid)))
-			continue;
-		return h;
+	if (r->host_index.failed) {
+		nvme_for_each_host(r, h) {
+			if (nvme_host_matches(h, hostnqn, hostid))
+				return h;
+		}
+	} else {
+		node = nvme_index_find(&r->host_index,
+				       nvme_host_hash(r, hostnqn), ULONG_MAX,
+				       nvme_host_match_node, &key, NULL);
+		if (node)
+			return container_of(node, struct nvme_host, hnode);
 	}
-	h = calloc(1,sizeof(*h));
+	h = nvme_slab_zalloc(r->host_slab, sizeof(*h));
 	if (!h)
 		return NULL;
 	h->hostnqn = strdup(hostnqn);
@@ -473,6 +765,7 @@ struct nvme_host *nvme_lookup_host(nvme_root_t r, const char *hostnqn,
 	list_node_init(&h->entry);
 	h->r = r;
 	list_add(&r->hosts, &h->entry);
+	nvme_index_host(r, h);
 	r->modified = true;
 
 	return h;
@@ -507,17 +800,22 @@ static int nvme_subsystem_scan_namespaces(nvme_root_t r, nvme_subsystem_t s,
 
 static int nvme_init_subsystem(nvme_subsystem_t s, const char *name)
 {
+	static const char * const attrs[] = {
+		"model", "serial", "firmware_rev", "subsystype",
+	};
+	char *values[ARRAY_SIZE(attrs)];
 	char *path;
 
 	if (asprintf(&path, "%s/%s", nvme_subsys_sysfs_dir, name) < 0)
 		return -1;
 
-	s->model = nvme_get_attr(path, "model");
+	nvme_get_attrs(path, attrs, ARRAY_SIZE(attrs), values);
+	s->model = values[0];
 	if (!s->model)
 		s->model = strdup("undefined");
-	s->serial = nvme_get_attr(path, "serial");
-	s->firmware = nvme_get_attr(path, "firmware_rev");
-	s->subsystype = nvme_get_attr(path, "subsystype");
+	s->serial = values[1];
+	s->firmware = values[2];
+	s->subsystype = values[3];
 	if (!s->subsystype) {
 		if (!strcmp(s->subsysnqn, NVME_DISC_SUBSYS_NAME))
 			s->subsystype = strdup("discovery");
@@ -624,14 +922,226 @@ const char *nvme_path_get_ana_state(nvme_path_t p)
 	return p->ana_state;
 }
 
+int nvme_path_get_numa_node_id(nvme_path_t p)
+{
+	return nvme_ctrl_get_numa_node_id(p->c);
+}
+
+static int nvme_ana_group_cmp(const void *a, const void *b)
+{
+	const struct nvme_ana_group_state *x = a, *y = b;
+
+	if (x->grpid != y->grpid)
+		return x->grpid < y->grpid ? -1 : 1;
+	return 0;
+}
+
+int nvme_ctrl_refresh_ana(nvme_ctrl_t c)
+{
+	struct nvme_ana_group_state *groups = NULL;
+	struct nvme_ana_group_desc *desc;
+	struct nvme_ana_log *log;
+	size_t len, off;
+	unsigned int i, nr;
+	int fd, ret;
+
+	fd = nvme_ctrl_get_fd(c);
+	if (fd < 0)
+		return -1;
+
+	ret = nvme_get_ana_log_len(fd, &len);
+	if (ret)
+		return ret;
+
+	log = malloc(len);
+	if (!log) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* the kernel handles the event itself, leave it pending for it */
+	ret = nvme_get_log_ana_groups(fd, true, len, (void *)log);
+	if (ret)
+		goto free;
+
+	nr = le16_to_cpu(log->ngrps);
+	if (nr) {
+		groups = calloc(nr, sizeof(*groups));
+		if (!groups) {
+			errno = ENOMEM;
+			ret = -1;
+			goto free;
+		}
+	}
+
+	off = sizeof(*log);
+	for (i = 0; i < nr; i++) {
+		if (off + sizeof(*desc) > len)
+			break;
+		desc = (void *)log + off;
+		groups[i].grpid = le32_to_cpu(desc->grpid);
+		groups[i].state = desc->state & 0x0f;
+		off += sizeof(*desc) + le32_to_cpu(desc->nnsids) *
+			sizeof(desc->nsids[0]);
+	}
+	qsort(groups, i, sizeof(*groups), nvme_ana_group_cmp);
+
+	free(c->ana_groups);
+	c->ana_groups = groups;
+	c->nr_ana_groups = i;
+	c->ana_chgcnt = le64_to_cpu(log->chgcnt);
+	c->ana_valid = true;
+
+free:
+	free(log);
+	return ret;
+}
+
+static enum nvme_ana_state nvme_ana_state_from_str(const char *state)
+{
+	if (!state || !strcmp(state, "optimized"))
+		return NVME_ANA_STATE_OPTIMIZED;
+	if (!strcmp(state, "non-optimized"))
+		return NVME_ANA_STATE_NONOPTIMIZED;
+	if (!strcmp(state, "inaccessible"))
+		return NVME_ANA_STATE_INACCESSIBLE;
+	if (!strcmp(state, "persistent-loss"))
+		return NVME_ANA_STATE_PERSISTENT_LOSS;
+	return NVME_ANA_STATE_CHANGE;
+}
+
+/*
+ * Published trees are read concurrently: their caches are filled by
+ * nvme_prepare_published() before they are published, and the getters
+ * must not fill them later.
+ */
+static bool nvme_ctrl_is_published(nvme_ctrl_t c)
+{
+	nvme_root_t r = c->s && c->s->h ? c->s->h->r : NULL;
+
+	return r && r->published;
+}
+
+static bool nvme_ns_is_published(nvme_ns_t n)
+{
+	nvme_subsystem_t s = n->s ? n->s : n->c ? n->c->s : NULL;
+
+	return s && s->h && s->h->r && s->h->r->published;
+}
+
+/* controllers without ANA support are only read once */
+static void nvme_ctrl_read_ana(nvme_ctrl_t c)
+{
+	if (!c->ana_valid && !nvme_ctrl_is_published(c) &&
+	    nvme_ctrl_refresh_ana(c))
+		c->ana_valid = true;
+}
+
+enum nvme_ana_state nvme_path_get_ana_group_state(nvme_path_t p)
+{
+	nvme_ctrl_t c = p->c;
+	unsigned int lo = 0, hi, mid;
+
+	nvme_ctrl_read_ana(c);
+
+	for (hi = c->nr_ana_groups; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		if (c->ana_groups[mid].grpid == (__u32)p->grpid)
+			return c->ana_groups[mid].state;
+		if (c->ana_groups[mid].grpid < (__u32)p->grpid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return nvme_ana_state_from_str(p->ana_state);
+}
+
+/*
+ * Lower is better: optimized before non-optimized, and within each,
+ * paths on @node before remote ones. A controller or caller without a
+ * known node counts as local.
+ */
+static int nvme_path_rank(nvme_path_t p, int node)
+{
+	enum nvme_ana_state state = nvme_path_get_ana_group_state(p);
+	int rank, pnode;
+
+	if (state == NVME_ANA_STATE_OPTIMIZED)
+		rank = 0;
+	else if (state == NVME_ANA_STATE_NONOPTIMIZED)
+		rank = 2;
+	else
+		return -1;
+
+	pnode = nvme_path_get_numa_node_id(p);
+	if (node >= 0 && pnode >= 0 && pnode != node)
+		rank++;
+	return rank;
+}
+
+/* round robin over the paths with the best rank */
+static nvme_path_t nvme_namespace_pick_path(nvme_ns_t n, int node)
+{
+	unsigned int nr = 0, pick;
+	int rank, best = -1;
+	nvme_path_t p;
+
+	nvme_namespace_for_each_path(n, p) {
+		rank = nvme_path_rank(p, node);
+		if (rank < 0)
+			continue;
+		if (best < 0 || rank < best) {
+			best = rank;
+			nr = 0;
+		}
+		if (rank == best)
+			nr++;
+	}
+
+	if (!nr) {
+		errno = ENODEV;
+		return NULL;
+	}
+
+	/* concurrent readers of a published tree share the counter */
+	pick = __atomic_fetch_add(&n->path_rr, 1, __ATOMIC_RELAXED) % nr;
+	nvme_namespace_for_each_path(n, p) {
+		if (nvme_path_rank(p, node) == best && !pick--)
+			return p;
+	}
+	return NULL;
+}
+
+nvme_path_t nvme_namespace_get_best_path(nvme_ns_t n)
+{
+	return nvme_namespace_pick_path(n, -1);
+}
+
+static int nvme_current_numa_node(void)
+{
+	unsigned int cpu, node;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL))
+		return -1;
+	return node;
+}
+
+nvme_path_t nvme_namespace_get_nearest_path(nvme_ns_t n)
+{
+	return nvme_namespace_pick_path(n, nvme_current_numa_node());
+}
+
 void nvme_free_path(struct nvme_path *p)
 {
 	list_del_init(&p->entry);
 	list_del_init(&p->nentry);
+	if (p->ana_state_fd >= 0)
+		close(p->ana_state_fd);
 	free(p->name);
 	free(p->sysfs_dir);
 	free(p->ana_state);
-	free(p);
+	nvme_slab_free(p);
 }
 
 static void nvme_subsystem_set_path_ns(nvme_subsystem_t s, nvme_path_t p)
@@ -671,7 +1181,7 @@ static int nvme_ctrl_scan_path(nvme_root_t r, struct nvme_ctrl *c, char *name)
 		return -1;
 	}
 
-	p = calloc(1, sizeof(*p));
+	p = nvme_slab_zalloc(r ? r->path_slab : NULL, sizeof(*p));
 	if (!p) {
 		errno = ENOMEM;
 		goto free_path;
@@ -680,7 +1190,14 @@ static int nvme_ctrl_scan_path(nvme_root_t r, struct nvme_ctrl *c, char *name)
 	p->c = c;
 	p->name = strdup(name);
 	p->sysfs_dir = path;
-	p->ana_state = nvme_get_path_attr(p, "ana_state");
+	p->ana_state_fd = -1;
+	/* kept open for nvme_update_topology() if asked to */
+	if (r && r->cache_attr_fds)
+		p->ana_state_fd = nvme_open_attr(path, "ana_state");
+	if (p->ana_state_fd >= 0)
+		p->ana_state = nvme_reread_attr(p->ana_state_fd);
+	else
+		p->ana_state = nvme_get_path_attr(p, "ana_state");
 	if (!p->ana_state)
 		p->ana_state = strdup("optimized");
 
@@ -701,18 +1218,38 @@ free_path:
 	return -1;
 }
 
+/*
+ * Device files are opened on first use. Several readers of a published
+ * tree may race to open the same one, the first to store its fd wins.
+ */
+static int nvme_open_once(int *fdp, const char *name)
+{
+	int fd = __atomic_load_n(fdp, __ATOMIC_ACQUIRE), old = -1;
+
+	if (fd >= 0)
+		return fd;
+
+	fd = nvme_open(name);
+	if (fd < 0)
+		return fd;
+	if (!__atomic_compare_exchange_n(fdp, &old, fd, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		close(fd);
+		return old;
+	}
+	return fd;
+}
+
 int nvme_ctrl_get_fd(nvme_ctrl_t c)
 {
 	nvme_root_t r = c->s && c->s->h ? c->s->h->r : NULL;
+	int fd;
 
-	if (c->fd < 0) {
-		c->fd = nvme_open(c->name);
-		if (c->fd < 0)
-			nvme_msg(r, LOG_ERR,
-				 "Failed to open ctrl %s, errno %d\n",
-				 c->name, errno);
-	}
-	return c->fd;
+	fd = nvme_open_once(&c->fd, c->name);
+	if (fd < 0)
+		nvme_msg(r, LOG_ERR, "Failed to open ctrl %s, errno %d\n",
+			 c->name, errno);
+	return fd;
 }
 
 nvme_subsystem_t nvme_ctrl_get_subsystem(nvme_ctrl_t c)
@@ -752,9 +1289,20 @@ const char *nvme_ctrl_get_model(nvme_ctrl_t c)
 
 const char *nvme_ctrl_get_state(nvme_ctrl_t c)
 {
+	nvme_root_t r = c->s && c->s->h ? c->s->h->r : NULL;
 	char *state = c->state;
 
-	c->state = nvme_get_ctrl_attr(c, "state");
+	/* published trees are read concurrently, keep the scanned state */
+	if (r && r->published)
+		return state;
+
+	/* kept open if asked to, as the state may be polled frequently */
+	if (c->state_fd < 0 && c->sysfs_dir && r && r->cache_attr_fds)
+		c->state_fd = nvme_open_attr(c->sysfs_dir, "state");
+	if (c->state_fd >= 0)
+		c->state = nvme_reread_attr(c->state_fd);
+	else
+		c->state = nvme_get_ctrl_attr(c, "state");
 	if (state)
 		free(state);
 	return c->state;
@@ -765,6 +1313,84 @@ const char *nvme_ctrl_get_numa_node(nvme_ctrl_t c)
 	return c->numa_node;
 }
 
+int nvme_ctrl_get_numa_node_id(nvme_ctrl_t c)
+{
+	char *end;
+	long node;
+
+	if (!c->numa_node)
+		return -1;
+	node = strtol(c->numa_node, &end, 10);
+	if (end == c->numa_node || node < 0 || node > INT_MAX)
+		return -1;
+	return node;
+}
+
+/* "0-3,8,10-11" as written by the kernel's cpumap_print_to_pagebuf() */
+static int nvme_parse_cpulist(const char *list, void *mask, size_t size)
+{
+	const size_t bits = 8 * sizeof(unsigned long);
+	unsigned long *words = mask, first, last;
+	const char *p = list;
+	char *end;
+
+	memset(mask, 0, size);
+	while (*p && *p != '\n') {
+		first = strtoul(p, &end, 10);
+		if (end == p)
+			goto inval;
+		last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtoul(p + 1, &end, 10);
+			if (end == p + 1 || last < first)
+				goto inval;
+			p = end;
+		}
+		for (; first <= last && first < size * 8; first++)
+			words[first / bits] |= 1UL << (first % bits);
+		if (*p == ',')
+			p++;
+	}
+	return 0;
+
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+int nvme_ctrl_get_local_cpus(nvme_ctrl_t c, void *mask, size_t size)
+{
+	char path[64], *list;
+	int node, ret;
+
+	if (!size || size % sizeof(unsigned long)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* PCIe controllers, fabrics ones only have the node if any */
+	list = nvme_get_attr(c->sysfs_dir, "device/local_cpulist");
+	if (!list) {
+		node = nvme_ctrl_get_numa_node_id(c);
+		if (node < 0) {
+			errno = ENODATA;
+			return -1;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d",
+			 node);
+		list = nvme_get_attr(path, "cpulist");
+		if (!list) {
+			errno = ENODATA;
+			return -1;
+		}
+	}
+
+	ret = nvme_parse_cpulist(list, mask, size);
+	free(list);
+	return ret;
+}
+
 const char *nvme_ctrl_get_queue_count(nvme_ctrl_t c)
 {
 	return c->queue_count;
@@ -785,29 +1411,149 @@ const char *nvme_ctrl_get_transport(nvme_ctrl_t c)
 	return c->transport;
 }
 
-const char *nvme_ctrl_get_traddr(nvme_ctrl_t c)
+static int nvme_ctrl_read_cap(nvme_ctrl_t c, __u64 *cap)
 {
-	return c->traddr;
-}
+	volatile __u32 *bar;
+	char *path;
+	int fd;
 
-const char *nvme_ctrl_get_trsvcid(nvme_ctrl_t c)
-{
-	return c->trsvcid;
-}
+	if (!c->transport)
+		return -1;
 
-const char *nvme_ctrl_get_host_traddr(nvme_ctrl_t c)
-{
-	return c->cfg.host_traddr;
-}
+	if (strcmp(c->transport, "pcie")) {
+		struct nvme_get_property_args args = {
+			.args_size = sizeof(args),
+			.fd = nvme_ctrl_get_fd(c),
+			.offset = NVME_REG_CAP,
+			.value = cap,
+			.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		};
 
-const char *nvme_ctrl_get_host_iface(nvme_ctrl_t c)
-{
-	return c->cfg.host_iface;
-}
+		return nvme_get_property(&args);
+	}
 
-struct nvme_fabrics_config *nvme_ctrl_get_config(nvme_ctrl_t c)
-{
-	return &c->cfg;
+	/* PCIe controllers only expose their registers through the BAR */
+	if (asprintf(&path, "%s/device/resource0", c->sysfs_dir) < 0)
+		return -1;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return -1;
+
+	bar = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (bar == MAP_FAILED)
+		return -1;
+
+	/* not every platform does 64-bit MMIO reads */
+	*cap = le32_to_cpu(bar[0]) | (__u64)le32_to_cpu(bar[1]) << 32;
+	return munmap((void *)bar, getpagesize());
+}
+
+/*
+ * The kernel limit on a single transfer is only published on the
+ * namespace block devices.
+ */
+static __u32 nvme_ctrl_get_kernel_max_xfer(nvme_ctrl_t c)
+{
+	__u32 max = NVME_CTRL_XFER_MAX;
+	nvme_path_t p;
+	nvme_ns_t n;
+	char *kb;
+
+	n = nvme_ctrl_first_ns(c);
+	p = nvme_ctrl_first_path(c);
+	if (n)
+		kb = nvme_get_attr(n->sysfs_dir, "queue/max_hw_sectors_kb");
+	else if (p)
+		kb = nvme_get_attr(p->sysfs_dir, "queue/max_hw_sectors_kb");
+	else
+		return max;
+
+	if (kb) {
+		unsigned long val = strtoul(kb, NULL, 10);
+
+		if (val && val < max / 1024)
+			max = val * 1024;
+		free(kb);
+	}
+	return max;
+}
+
+static void nvme_ctrl_read_xfer_limits(nvme_ctrl_t c)
+{
+	struct nvme_id_ctrl id;
+	__u64 cap;
+	int fd;
+
+	if (c->xfer_valid || nvme_ctrl_is_published(c))
+		return;
+
+	fd = nvme_ctrl_get_fd(c);
+	if (fd < 0 || nvme_identify_ctrl(fd, &id))
+		return;
+
+	c->mdts = id.mdts;
+	/* FWUG 0: no information, 0xff: no restriction */
+	c->fw_gran = id.fwug && id.fwug != 0xff ? id.fwug * 4096 : 4096;
+	c->mpsmin = 0;
+	if (!nvme_ctrl_read_cap(c, &cap))
+		c->mpsmin = NVME_CAP_MPSMIN(cap);
+	c->max_xfer_len = nvme_xfer_len_from_mdts(c->mdts, c->mpsmin,
+					nvme_ctrl_get_kernel_max_xfer(c));
+	c->xfer_valid = true;
+}
+
+__u8 nvme_ctrl_get_mdts(nvme_ctrl_t c)
+{
+	nvme_ctrl_read_xfer_limits(c);
+	return c->mdts;
+}
+
+__u8 nvme_ctrl_get_mpsmin(nvme_ctrl_t c)
+{
+	nvme_ctrl_read_xfer_limits(c);
+	return c->mpsmin;
+}
+
+__u32 nvme_ctrl_get_max_xfer_len(nvme_ctrl_t c)
+{
+	nvme_ctrl_read_xfer_limits(c);
+	return c->xfer_valid ? c->max_xfer_len : 4096;
+}
+
+__u32 nvme_ctrl_get_fw_xfer_len(nvme_ctrl_t c)
+{
+	__u32 xfer = nvme_ctrl_get_max_xfer_len(c);
+	__u32 gran = c->xfer_valid ? c->fw_gran : 4096;
+
+	/* as nvme_fw_download_seq() does, never more than MDTS */
+	return xfer > gran ? xfer - xfer % gran : xfer;
+}
+
+const char *nvme_ctrl_get_traddr(nvme_ctrl_t c)
+{
+	return c->traddr;
+}
+
+const char *nvme_ctrl_get_trsvcid(nvme_ctrl_t c)
+{
+	return c->trsvcid;
+}
+
+const char *nvme_ctrl_get_host_traddr(nvme_ctrl_t c)
+{
+	return c->cfg.host_traddr;
+}
+
+const char *nvme_ctrl_get_host_iface(nvme_ctrl_t c)
+{
+	return c->cfg.host_iface;
+}
+
+struct nvme_fabrics_config *nvme_ctrl_get_config(nvme_ctrl_t c)
+{
+	return &c->cfg;
 }
 
 const char *nvme_ctrl_get_dhchap_key(nvme_ctrl_t c)
@@ -888,6 +1634,10 @@ void nvme_deconfigure_ctrl(nvme_ctrl_t c)
 		close(c->fd);
 		c->fd = -1;
 	}
+	if (c->state_fd >= 0) {
+		close(c->state_fd);
+		c->state_fd = -1;
+	}
 	FREE_CTRL_ATTR(c->name);
 	FREE_CTRL_ATTR(c->sysfs_dir);
 	FREE_CTRL_ATTR(c->firmware);
@@ -901,6 +1651,12 @@ void nvme_deconfigure_ctrl(nvme_ctrl_t c)
 	FREE_CTRL_ATTR(c->address);
 	FREE_CTRL_ATTR(c->dctype);
 	FREE_CTRL_ATTR(c->cntrltype);
+	FREE_CTRL_ATTR(c->disc_log);
+	c->xfer_valid = false;
+	free(c->ana_groups);
+	c->ana_groups = NULL;
+	c->nr_ana_groups = 0;
+	c->ana_valid = false;
 }
 
 int nvme_disconnect_ctrl(nvme_ctrl_t c)
@@ -923,6 +1679,8 @@ int nvme_disconnect_ctrl(nvme_ctrl_t c)
 void nvme_unlink_ctrl(nvme_ctrl_t c)
 {
 	list_del_init(&c->entry);
+	if (c->hnode.pprev)
+		nvme_htable_del(&c->s->h->r->ctrl_index, &c->hnode);
 	c->s = NULL;
 }
 
@@ -947,7 +1705,7 @@ static void __nvme_free_ctrl(nvme_ctrl_t c)
 	FREE_CTRL_ATTR(c->cfg.host_traddr);
 	FREE_CTRL_ATTR(c->cfg.host_iface);
 	FREE_CTRL_ATTR(c->trsvcid);
-	free(c);
+	nvme_slab_free(c);
 }
 
 void nvme_free_ctrl(nvme_ctrl_t c)
@@ -996,12 +1754,13 @@ struct nvme_ctrl *nvme_create_ctrl(nvme_root_t r,
 		errno = EINVAL;
 		return NULL;
 	}
-	c = calloc(1, sizeof(*c));
+	c = nvme_slab_zalloc(r ? r->ctrl_slab : NULL, sizeof(*c));
 	if (!c) {
 		errno = ENOMEM;
 		return NULL;
 	}
 	c->fd = -1;
+	c->state_fd = -1;
 	nvmf_default_config(&c->cfg);
 	list_head_init(&c->namespaces);
 	list_head_init(&c->paths);
@@ -1024,31 +1783,71 @@ struct nvme_ctrl *nvme_create_ctrl(nvme_root_t r,
 	return c;
 }
 
+static bool nvme_ctrl_matches(struct nvme_ctrl *c,
+			      const struct nvme_ctrl_key *k)
+{
+	if (strcmp(c->transport, k->transport))
+		return false;
+	if (k->traddr && c->traddr &&
+	    strcasecmp(c->traddr, k->traddr))
+		return false;
+	if (k->host_traddr && c->cfg.host_traddr &&
+	    strcmp(c->cfg.host_traddr, k->host_traddr))
+		return false;
+	if (k->host_iface && c->cfg.host_iface &&
+	    strcmp(c->cfg.host_iface, k->host_iface))
+		return false;
+	if (k->trsvcid && c->trsvcid &&
+	    strcmp(c->trsvcid, k->trsvcid))
+		return false;
+	return true;
+}
+
+static bool nvme_ctrl_match_node(struct nvme_hnode *node, const void *key)
+{
+	return nvme_ctrl_matches(container_of(node, struct nvme_ctrl, hnode),
+				 key);
+}
+
 nvme_ctrl_t __nvme_lookup_ctrl(nvme_subsystem_t s, const char *transport,
 			       const char *traddr, const char *host_traddr,
 			       const char *host_iface, const char *trsvcid,
 			       nvme_ctrl_t p)
 
 {
+	struct nvme_ctrl_key key = {
+		.transport = transport,
+		.traddr = traddr,
+		.host_traddr = host_traddr,
+		.host_iface = host_iface,
+		.trsvcid = trsvcid,
+	};
+	nvme_root_t r = s->h ? s->h->r : NULL;
+	struct nvme_hnode *node;
+	unsigned long below = ULONG_MAX;
 	struct nvme_ctrl *c;
 
+	/*
+	 * An index lookup needs the transport address as key, and @p to be
+	 * indexed so that its successors in list order can be told apart.
+	 */
+	if (r && !r->ctrl_index.failed && traddr &&
+	    (!p || p->hnode.pprev)) {
+		if (p)
+			below = p->hnode.seq;
+		node = nvme_index_find(&r->ctrl_index,
+				       nvme_ctrl_hash(s, transport, traddr),
+				       below, nvme_ctrl_match_node, &key, NULL);
+		node = nvme_index_find(&r->ctrl_index,
+				       nvme_ctrl_hash(s, transport, NULL),
+				       below, nvme_ctrl_match_node, &key, node);
+		return node ? container_of(node, struct nvme_ctrl, hnode) : NULL;
+	}
+
 	c = p ? nvme_subsystem_next_ctrl(s, p) : nvme_subsystem_first_ctrl(s);
 	for (; c != NULL; c = nvme_subsystem_next_ctrl(s, c)) {
-		if (strcmp(c->transport, transport))
-			continue;
-		if (traddr && c->traddr &&
-		    strcasecmp(c->traddr, traddr))
-			continue;
-		if (host_traddr && c->cfg.host_traddr &&
-		    strcmp(c->cfg.host_traddr, host_traddr))
-			continue;
-		if (host_iface && c->cfg.host_iface &&
-		    strcmp(c->cfg.host_iface, host_iface))
-			continue;
-		if (trsvcid && c->trsvcid &&
-		    strcmp(c->trsvcid, trsvcid))
-			continue;
-		return c;
+		if (nvme_ctrl_matches(c, &key))
+			return c;
 	}
 
 	return NULL;
@@ -1074,8 +1873,7 @@ nvme_ctrl_t nvme_lookup_ctrl(nvme_subsystem_t s, const char *transport,
 	c = nvme_create_ctrl(r, s->subsysnqn, transport, traddr,
 			     host_traddr, host_iface, trsvcid);
 	if (c) {
-		c->s = s;
-		list_add(&s->ctrls, &c->entry);
+		nvme_link_ctrl(s, c);
 		s->h->r->modified = true;
 	}
 	return c;
@@ -1145,36 +1943,40 @@ static char *nvme_ctrl_lookup_subsystem_name(nvme_root_t r,
 static int nvme_configure_ctrl(nvme_root_t r, nvme_ctrl_t c, const char *path,
 			       const char *name)
 {
-	DIR *d;
+	static const char * const attrs[] = {
+		"firmware_rev", "model", "state", "numa_node", "queue_count",
+		"serial", "sqsize", "dhchap_ctrl_secret", "cntrltype",
+		"dctype",
+	};
+	char *values[ARRAY_SIZE(attrs)];
 
-	d = opendir(path);
-	if (!d) {
+	if (nvme_get_attrs(path, attrs, ARRAY_SIZE(attrs), values) < 0) {
 		nvme_msg(r, LOG_ERR, "Failed to open ctrl dir %s, error %d\n",
 			 path, errno);
 		errno = ENODEV;
 		return -1;
 	}
-	closedir(d);
 
 	c->fd = -1;
+	c->state_fd = -1;
 	c->name = strdup(name);
 	c->sysfs_dir = (char *)path;
-	c->firmware = nvme_get_ctrl_attr(c, "firmware_rev");
-	c->model = nvme_get_ctrl_attr(c, "model");
-	c->state = nvme_get_ctrl_attr(c, "state");
-	c->numa_node = nvme_get_ctrl_attr(c, "numa_node");
-	c->queue_count = nvme_get_ctrl_attr(c, "queue_count");
-	c->serial = nvme_get_ctrl_attr(c, "serial");
-	c->sqsize = nvme_get_ctrl_attr(c, "sqsize");
-	c->dhchap_key = nvme_get_ctrl_attr(c, "dhchap_ctrl_secret");
+	c->firmware = values[0];
+	c->model = values[1];
+	c->state = values[2];
+	c->numa_node = values[3];
+	c->queue_count = values[4];
+	c->serial = values[5];
+	c->sqsize = values[6];
+	c->dhchap_key = values[7];
 	if (c->dhchap_key && !strcmp(c->dhchap_key, "none")) {
 		free(c->dhchap_key);
 		c->dhchap_key = NULL;
 	}
-	c->cntrltype = nvme_get_ctrl_attr(c, "cntrltype");
-	c->dctype = nvme_get_ctrl_attr(c, "dctype");
+	c->cntrltype = values[8];
+	c->dctype = values[9];
 
-	errno = 0; /* cleanup after nvme_get_ctrl_attr() */
+	errno = 0; /* cleanup after nvme_get_attrs() */
 	return 0;
 }
 
@@ -1226,8 +2028,7 @@ int nvme_init_ctrl(nvme_host_t h, nvme_ctrl_t c, int instance)
 	}
 	if (s->subsystype && !strcmp(s->subsystype, "discovery"))
 		c->discovery_ctrl = true;
-	c->s = s;
-	list_add(&s->ctrls, &c->entry);
+	nvme_link_ctrl(s, c);
 out_free_subsys:
 	free(subsys_name);
  out_free_name:
@@ -1338,11 +2139,15 @@ skip_address:
 
 nvme_ctrl_t nvme_scan_ctrl(nvme_root_t r, const char *name)
 {
+	static const char * const attrs[] = {
+		"hostnqn", "hostid", "dhchap_secret", "subsysnqn",
+	};
+	char *values[ARRAY_SIZE(attrs)];
 	nvme_host_t h;
 	nvme_subsystem_t s;
 	nvme_ctrl_t c;
 	char *path;
-	char *hostnqn, *hostid, *subsysnqn, *subsysname;
+	char *hostnqn, *hostid, *dhchap_key, *subsysnqn, *subsysname;
 	int ret;
 
 	nvme_msg(r, LOG_DEBUG, "scan controller %s\n", name);
@@ -1352,8 +2157,11 @@ nvme_ctrl_t nvme_scan_ctrl(nvme_root_t r, const char *name)
 		return NULL;
 	}
 
-	hostnqn = nvme_get_attr(path, "hostnqn");
-	hostid = nvme_get_attr(path, "hostid");
+	nvme_get_attrs(path, attrs, ARRAY_SIZE(attrs), values);
+	hostnqn = values[0];
+	hostid = values[1];
+	dhchap_key = values[2];
+	subsysnqn = values[3];
 	h = nvme_lookup_host(r, hostnqn, hostid);
 	if (hostnqn)
 		free(hostnqn);
@@ -1362,22 +2170,24 @@ nvme_ctrl_t nvme_scan_ctrl(nvme_root_t r, const char *name)
 	if (h) {
 		if (h->dhchap_key)
 			free(h->dhchap_key);
-		h->dhchap_key = nvme_get_attr(path, "dhchap_secret");
+		h->dhchap_key = dhchap_key;
 		if (h->dhchap_key && !strcmp(h->dhchap_key, "none")) {
 			free(h->dhchap_key);
 			h->dhchap_key = NULL;
 		}
+	} else {
+		free(dhchap_key);
 	}
 	if (!h) {
 		h = nvme_default_host(r);
 		if (!h) {
+			free(subsysnqn);
 			free(path);
 			errno = ENOMEM;
 			return NULL;
 		}
 	}
 
-	subsysnqn = nvme_get_attr(path, "subsysnqn");
 	if (!subsysnqn) {
 		free(path);
 		errno = ENXIO;
@@ -1424,6 +2234,14 @@ void nvme_rescan_ctrl(struct nvme_ctrl *c)
 	nvme_subsystem_scan_namespaces(r, c->s, NULL, NULL);
 }
 
+static int nvme_ns_init(struct nvme_ns *n);
+
+static void nvme_ns_identify_lazy(struct nvme_ns *n)
+{
+	if (!n->identified && nvme_ns_get_fd(n) >= 0)
+		nvme_ns_init(n);
+}
+
 static int nvme_bytes_to_lba(nvme_ns_t n, off_t offset, size_t count,
 			    __u64 *lba, __u16 *nlb)
 {
@@ -1442,7 +2260,17 @@ static int nvme_bytes_to_lba(nvme_ns_t n, off_t offset, size_t count,
 
 int nvme_ns_get_fd(nvme_ns_t n)
 {
-	return n->fd;
+	/* namespaces loaded from a snapshot are opened on first use */
+	return nvme_open_once(&n->fd, n->name);
+}
+
+int nvme_ns_get_generic_fd(nvme_ns_t n)
+{
+	if (!n->generic_name) {
+		errno = ENODEV;
+		return -1;
+	}
+	return nvme_open_once(&n->generic_fd, n->generic_name);
 }
 
 nvme_subsystem_t nvme_ns_get_subsystem(nvme_ns_t n)
@@ -1492,44 +2320,71 @@ const char *nvme_ns_get_firmware(nvme_ns_t n)
 
 int nvme_ns_get_lba_size(nvme_ns_t n)
 {
+	nvme_ns_identify_lazy(n);
 	return n->lba_size;
 }
 
 int nvme_ns_get_meta_size(nvme_ns_t n)
 {
+	nvme_ns_identify_lazy(n);
 	return n->meta_size;
 }
 
 uint64_t nvme_ns_get_lba_count(nvme_ns_t n)
 {
+	nvme_ns_identify_lazy(n);
 	return n->lba_count;
 }
 
 uint64_t nvme_ns_get_lba_util(nvme_ns_t n)
 {
+	nvme_ns_identify_lazy(n);
 	return n->lba_util;
 }
 
 enum nvme_csi nvme_ns_get_csi(nvme_ns_t n)
 {
+	nvme_ns_identify_lazy(n);
 	return n->csi;
 }
 
 const uint8_t *nvme_ns_get_eui64(nvme_ns_t n)
 {
+	nvme_ns_identify_lazy(n);
 	return n->eui64;
 }
 
 const uint8_t *nvme_ns_get_nguid(nvme_ns_t n)
 {
+	nvme_ns_identify_lazy(n);
 	return n->nguid;
 }
 
 void nvme_ns_get_uuid(nvme_ns_t n, uuid_t out)
 {
+	nvme_ns_identify_lazy(n);
 	uuid_copy(out, n->uuid);
 }
 
+int nvme_ns_get_pi_format(nvme_ns_t n, struct nvme_pi_format *fmt)
+{
+	nvme_ns_identify_lazy(n);
+	if (!n->lba_size) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	memset(fmt, 0, sizeof(*fmt));
+	fmt->lba_size = n->lba_size;
+	fmt->ms = n->meta_size;
+	fmt->pi_type = n->pi_type;
+	fmt->pif = n->pif;
+	fmt->sts = n->sts;
+	fmt->pi_first = n->pi_first;
+	fmt->extended = n->meta_ext;
+	return 0;
+}
+
 int nvme_ns_identify(nvme_ns_t n, struct nvme_id_ns *ns)
 {
 	return nvme_identify_ns(nvme_ns_get_fd(n), nvme_ns_get_nsid(n), ns);
@@ -1621,6 +2476,133 @@ int nvme_ns_write_zeros(nvme_ns_t n, off_t offset, size_t count)
 	return nvme_write_zeros(&args);
 }
 
+static nvme_uring_t nvme_ns_get_ring(nvme_ns_t n)
+{
+	if (n->ring)
+		return n->ring;
+
+	if (nvme_ns_get_generic_fd(n) < 0)
+		return NULL;
+
+	n->ring = nvme_uring_create(NVME_NS_URING_DEPTH,
+				    n->polled ? NVME_URING_IOPOLL : 0);
+	if (n->ring && n->pool)
+		nvme_buf_pool_set_ring(n->pool, n->ring);
+	return n->ring;
+}
+
+/* multipath namespaces use the node of the path the caller would pick */
+static int nvme_ns_get_numa_node_id(nvme_ns_t n)
+{
+	nvme_path_t p;
+
+	if (n->c)
+		return nvme_ctrl_get_numa_node_id(n->c);
+
+	p = nvme_namespace_get_nearest_path(n);
+	return p ? nvme_path_get_numa_node_id(p) : -1;
+}
+
+int nvme_ns_buf_pool_init(nvme_ns_t n, size_t buf_size, unsigned int nr_bufs,
+			  unsigned int flags)
+{
+	if (n->pool) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/*
+	 * The fixed buffers need a ring on the generic chardev, go
+	 * without them if either isn't available.
+	 */
+	n->pool = nvme_buf_pool_create_on_node(nvme_ns_get_ring(n), buf_size,
+					       nr_bufs, flags,
+					       nvme_ns_get_numa_node_id(n));
+	if (!n->pool)
+		return -1;
+	return 0;
+}
+
+int nvme_ns_set_polled(nvme_ns_t n, bool polled)
+{
+	nvme_uring_t ring;
+
+	if (n->polled == polled)
+		return 0;
+
+	/* the IOPOLL setting is fixed for the lifetime of a ring */
+	if (n->ring) {
+		ring = nvme_uring_create(NVME_NS_URING_DEPTH,
+					 polled ? NVME_URING_IOPOLL : 0);
+		if (!ring)
+			return -1;
+		if (n->pool)
+			nvme_buf_pool_set_ring(n->pool, ring);
+		nvme_uring_free(n->ring);
+		n->ring = ring;
+	}
+
+	n->polled = polled;
+	if (polled && !nvme_ns_get_ring(n)) {
+		n->polled = false;
+		return -1;
+	}
+	return 0;
+}
+
+bool nvme_ns_is_polled(nvme_ns_t n)
+{
+	return n->polled;
+}
+
+void *nvme_ns_get_buf(nvme_ns_t n)
+{
+	if (!n->pool) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return nvme_buf_pool_get(n->pool);
+}
+
+void nvme_ns_put_buf(nvme_ns_t n, void *buf)
+{
+	if (n->pool)
+		nvme_buf_pool_put(n->pool, buf);
+}
+
+static int nvme_ns_uring_io(nvme_ns_t n, struct nvme_io_args *args,
+			    __u8 opcode)
+{
+	struct nvme_uring_completion c;
+
+	args->fd = n->generic_fd;
+	if (nvme_uring_queue_io(n->ring, args, opcode, NULL))
+		return -1;
+	if (nvme_uring_submit(n->ring) < 0 ||
+	    nvme_uring_reap(n->ring, &c, 1, 1) != 1)
+		return -1;
+
+	if (c.status < 0) {
+		errno = -c.status;
+		return -1;
+	}
+	if (args->result)
+		*args->result = c.result;
+	return c.status;
+}
+
+/*
+ * Buffers from the namespace pool are registered with the namespace ring,
+ * send them that way to avoid the per-command page pinning. Polled
+ * completions are only available through the ring as well.
+ */
+static bool nvme_ns_use_uring(nvme_ns_t n, void *buf, size_t count)
+{
+	if (!n->ring || !nvme_uring_passthru_enabled())
+		return false;
+	return n->polled || nvme_buf_pool_owns(n->pool, buf, count);
+}
+
 int nvme_ns_write(nvme_ns_t n, void *buf, off_t offset, size_t count)
 {
 	struct nvme_io_args args = {
@@ -1645,6 +2627,9 @@ int nvme_ns_write(nvme_ns_t n, void *buf, off_t offset, size_t count)
 	if (nvme_bytes_to_lba(n, offset, count, &args.slba, &args.nlb))
 		return -1;
 
+	if (nvme_ns_use_uring(n, buf, count))
+		return nvme_ns_uring_io(n, &args, nvme_cmd_write);
+
 	return nvme_write(&args);
 }
 
@@ -1672,64 +2657,413 @@ int nvme_ns_read(nvme_ns_t n, void *buf, off_t offset, size_t count)
 	if (nvme_bytes_to_lba(n, offset, count, &args.slba, &args.nlb))
 		return -1;
 
+	if (nvme_ns_use_uring(n, buf, count))
+		return nvme_ns_uring_io(n, &args, nvme_cmd_read);
+
 	return nvme_read(&args);
 }
 
-int nvme_ns_compare(nvme_ns_t n, void *buf, off_t offset, size_t count)
+/*
+ * A command of a vectored read or write, made of the parts of the
+ * buffers from @seg on which it covers. Commands which exceed the segment
+ * limit go through a bounce buffer instead.
+ */
+struct nvme_ns_rwv_cmd {
+	int seg;
+	int nr_segs;
+	__u64 slba;
+	__u32 len;
+	bool bounce;
+};
+
+/*
+ * The transfer size limit of the controller, and the boundary the kernel
+ * reports from NOIOB (or the zone size) which commands should not cross.
+ */
+static void nvme_ns_read_rw_limits(nvme_ns_t n)
+{
+	unsigned long val;
+	char *attr;
+
+	if (n->rw_limits_valid || nvme_ns_is_published(n))
+		return;
+
+	if (n->c) {
+		n->max_xfer_len = nvme_ctrl_get_max_xfer_len(n->c);
+	} else {
+		n->max_xfer_len = 4096;
+		attr = nvme_get_attr(n->sysfs_dir, "queue/max_hw_sectors_kb");
+		if (attr) {
+			val = strtoul(attr, NULL, 10);
+			if (val && val < UINT32_MAX / 1024)
+				n->max_xfer_len = val * 1024;
+			free(attr);
+		}
+	}
+
+	n->max_segments = NVME_NS_RWV_MAX_SEGS;
+	attr = nvme_get_attr(n->sysfs_dir, "queue/max_segments");
+	if (attr) {
+		val = strtoul(attr, NULL, 10);
+		if (val)
+			n->max_segments = val < IOV_MAX ? val : IOV_MAX;
+		free(attr);
+	}
+
+	n->io_boundary = 0;
+	attr = nvme_get_attr(n->sysfs_dir, "queue/chunk_sectors");
+	if (attr) {
+		n->io_boundary = (__u64)strtoul(attr, NULL, 10) << 9;
+		free(attr);
+	}
+	n->rw_limits_valid = true;
+}
+
+void nvme_prepare_published(nvme_root_t r)
+{
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	nvme_host_t h;
+	nvme_ns_t n;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ctrl(s, c) {
+				nvme_ctrl_read_xfer_limits(c);
+				if (nvme_ctrl_first_path(c))
+					nvme_ctrl_read_ana(c);
+				nvme_ctrl_for_each_ns(c, n)
+					nvme_ns_read_rw_limits(n);
+			}
+			nvme_subsystem_for_each_ns(s, n)
+				nvme_ns_read_rw_limits(n);
+		}
+	}
+}
+
+/* for kernels without vectored passthrough, and for too many segments */
+static int nvme_ns_rwv_bounce(nvme_ns_t n, const struct iovec *segs,
+			      struct nvme_ns_rwv_cmd *c, bool write)
 {
 	struct nvme_io_args args = {
 		.args_size = sizeof(args),
 		.fd = nvme_ns_get_fd(n),
 		.nsid = nvme_ns_get_nsid(n),
-		.control = 0,
-		.dsm = 0,
-		.dspec = 0,
-		.reftag = 0,
-		.apptag = 0,
-		.appmask = 0,
-		.storage_tag = 0,
-		.data_len = count,
-		.data = buf,
-		.metadata_len = 0,
-		.metadata = NULL,
+		.slba = c->slba,
+		.nlb = (c->len >> n->lba_shift) - 1,
+		.data_len = c->len,
+		.data = segs[0].iov_base,
 		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
-		.result = NULL,
 	};
+	char *buf = NULL, *p;
+	int i, ret;
 
-	if (nvme_bytes_to_lba(n, offset, count, &args.slba, &args.nlb))
-		return -1;
+	if (c->nr_segs > 1) {
+		if (posix_memalign((void **)&buf, getpagesize(), c->len)) {
+			errno = ENOMEM;
+			return -1;
+		}
+		args.data = buf;
+	}
+	if (write)
+		for (i = 0, p = buf; buf && i < c->nr_segs; i++) {
+			memcpy(p, segs[i].iov_base, segs[i].iov_len);
+			p += segs[i].iov_len;
+		}
 
-	return nvme_compare(&args);
+	ret = write ? nvme_write(&args) : nvme_read(&args);
+
+	if (!write && !ret)
+		for (i = 0, p = buf; buf && i < c->nr_segs; i++) {
+			memcpy(segs[i].iov_base, p, segs[i].iov_len);
+			p += segs[i].iov_len;
+		}
+	free(buf);
+	return ret;
 }
 
-int nvme_ns_flush(nvme_ns_t n)
+static int nvme_ns_rwv_grow(void **array, int *alloc, int nr, size_t size)
 {
-	return nvme_flush(nvme_ns_get_fd(n), nvme_ns_get_nsid(n));
+	void *tmp;
+
+	if (nr < *alloc)
+		return 0;
+	tmp = realloc(*array, (*alloc ? *alloc * 2 : 16) * size);
+	if (!tmp) {
+		errno = ENOMEM;
+		return -1;
+	}
+	*alloc = *alloc ? *alloc * 2 : 16;
+	*array = tmp;
+	return 0;
 }
 
-static void nvme_ns_parse_descriptors(struct nvme_ns *n,
-				      struct nvme_ns_id_desc *descs)
+/* gives the last @len bytes of @c back to the buffers */
+static void nvme_ns_rwv_rewind(const struct iovec *iov, int *i, size_t *ioff,
+			       struct iovec *segs, int *nr_segs,
+			       struct nvme_ns_rwv_cmd *c, size_t len)
 {
-	void *d = descs;
-	int i, len;
+	size_t back;
 
-	for (i = 0; i < NVME_IDENTIFY_DATA_SIZE; i += len) {
-		struct nvme_ns_id_desc *desc = d + i;
+	while (len) {
+		back = segs[*nr_segs - 1].iov_len;
+		if (back > len)
+			back = len;
+		segs[*nr_segs - 1].iov_len -= back;
+		if (!segs[*nr_segs - 1].iov_len) {
+			(*nr_segs)--;
+			c->nr_segs--;
+		}
+		len -= back;
 
-		if (!desc->nidl)
-			break;
-		len = desc->nidl + sizeof(*desc);
+		while (back > *ioff) {
+			back -= *ioff;
+			*ioff = iov[--*i].iov_len;
+		}
+		*ioff -= back;
+	}
+}
 
-		switch (desc->nidt) {
-		case NVME_NIDT_EUI64:
-			memcpy(n->eui64, desc->nid, sizeof(n->eui64));
-			break;
-		case NVME_NIDT_NGUID:
-			memcpy(n->nguid, desc->nid, sizeof(n->nguid));
-			break;
-		case NVME_NIDT_UUID:
-			memcpy(n->uuid, desc->nid, sizeof(n->uuid));
-			break;
+/*
+ * Merges the buffers into commands of up to the transfer size limit which
+ * do not cross the I/O boundary. Every command transfers straight from or
+ * into the parts of the buffers it covers with a vectored passthrough
+ * command, so only the total length has to be a multiple of the logical
+ * block size, and all commands are submitted as one batch.
+ */
+static int nvme_ns_rwv(nvme_ns_t n, const struct iovec *iov, int iovcnt,
+		       off_t offset, bool write)
+{
+	struct nvme_passthru_cmd64 *pt = NULL;
+	struct nvme_ns_rwv_cmd *cmds = NULL, *c;
+	int nr_cmds = 0, max_cmds = 0, nr_segs = 0, max_segs = 0;
+	int nr_pt = 0, fd, bs, i, k, ret = 0, err = 0;
+	struct iovec *segs = NULL;
+	__u64 max, pos, start, end, total = 0;
+	size_t ioff = 0, take;
+	int *status = NULL;
+
+	bs = nvme_ns_get_lba_size(n);
+	if (bs <= 0 || iovcnt <= 0 || offset < 0 || offset % bs) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+	if (!total || total % bs) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	nvme_ns_read_rw_limits(n);
+	max = n->max_xfer_len / bs * bs;
+	if (!max)
+		max = bs;
+	/* NLB is a 16 bit field */
+	if (max > (__u64)bs << 16)
+		max = (__u64)bs << 16;
+
+	i = 0;
+	for (pos = offset; pos < offset + total; ) {
+		start = pos;
+		end = start + max < offset + total ? start + max :
+			offset + total;
+		if (n->io_boundary &&
+		    end > (start / n->io_boundary + 1) * n->io_boundary)
+			end = (start / n->io_boundary + 1) * n->io_boundary;
+
+		if (nvme_ns_rwv_grow((void **)&cmds, &max_cmds, nr_cmds,
+				     sizeof(*cmds)))
+			goto free;
+		c = &cmds[nr_cmds++];
+		c->seg = nr_segs;
+		c->nr_segs = 0;
+		c->slba = start >> n->lba_shift;
+		c->bounce = false;
+
+		while (pos < end) {
+			while (ioff == iov[i].iov_len) {
+				i++;
+				ioff = 0;
+			}
+			take = iov[i].iov_len - ioff;
+			if (take > end - pos)
+				take = end - pos;
+
+			/*
+			 * End the command on a block within the segment
+			 * limit, giving back the tail of the segments taken
+			 * so far if needed.
+			 */
+			if (!c->bounce && take < end - pos &&
+			    c->nr_segs == (int)n->max_segments - 1) {
+				__u64 cut = (pos + take - start) / bs * bs;
+
+				if (cut > pos - start) {
+					end = start + cut;
+					take = end - pos;
+				} else if (cut) {
+					nvme_ns_rwv_rewind(iov, &i, &ioff, segs,
+							   &nr_segs, c,
+							   pos - start - cut);
+					pos = end = start + cut;
+					break;
+				} else {
+					c->bounce = true;
+				}
+			}
+
+			if (nvme_ns_rwv_grow((void **)&segs, &max_segs, nr_segs,
+					     sizeof(*segs)))
+				goto free;
+			segs[nr_segs].iov_base = (char *)iov[i].iov_base + ioff;
+			segs[nr_segs].iov_len = take;
+			nr_segs++;
+			c->nr_segs++;
+			ioff += take;
+			pos += take;
+		}
+		c->len = end - start;
+	}
+
+	/* a single command keeps the ring and fixed buffer paths */
+	if (nr_cmds == 1 && nr_segs == 1) {
+		ret = write ? nvme_ns_write(n, segs[0].iov_base, offset, total) :
+			nvme_ns_read(n, segs[0].iov_base, offset, total);
+		goto out;
+	}
+
+	pt = calloc(nr_cmds, sizeof(*pt));
+	status = calloc(nr_cmds, sizeof(*status));
+	if (!pt || !status) {
+		errno = ENOMEM;
+		goto free;
+	}
+
+	for (k = 0; k < nr_cmds; k++) {
+		c = &cmds[k];
+		if (c->bounce)
+			continue;
+		pt[nr_pt].opcode = write ? nvme_cmd_write : nvme_cmd_read;
+		pt[nr_pt].nsid = nvme_ns_get_nsid(n);
+		pt[nr_pt].addr = (__u64)(uintptr_t)&segs[c->seg];
+		pt[nr_pt].data_len = c->nr_segs;
+		pt[nr_pt].cdw10 = c->slba & 0xffffffff;
+		pt[nr_pt].cdw11 = c->slba >> 32;
+		pt[nr_pt].cdw12 = (c->len >> n->lba_shift) - 1;
+		pt[nr_pt].timeout_ms = NVME_DEFAULT_IOCTL_TIMEOUT;
+		nr_pt++;
+	}
+
+	/* io_uring passthrough is only available on the generic chardev */
+	fd = nvme_ns_get_generic_fd(n);
+	if (fd < 0)
+		fd = nvme_ns_get_fd(n);
+	if (nr_pt && nvme_submit_io_passthru_vec_batch(fd, pt, nr_pt, status))
+		goto free;
+
+	for (k = 0, nr_pt = 0; k < nr_cmds; k++) {
+		int st = 0;
+
+		c = &cmds[k];
+		if (!c->bounce)
+			st = status[nr_pt++];
+		if (c->bounce || st == -ENOTTY) {
+			st = nvme_ns_rwv_bounce(n, &segs[c->seg], c, write);
+			if (st < 0)
+				st = -errno;
+		}
+		if (st && !ret && !err) {
+			if (st < 0)
+				err = -st;
+			else
+				ret = st;
+		}
+	}
+	if (err) {
+		errno = err;
+		ret = -1;
+	}
+
+out:
+	free(status);
+	free(pt);
+	free(segs);
+	free(cmds);
+	return ret;
+
+free:
+	ret = -1;
+	goto out;
+}
+
+int nvme_ns_readv(nvme_ns_t n, const struct iovec *iov, int iovcnt,
+		  off_t offset)
+{
+	return nvme_ns_rwv(n, iov, iovcnt, offset, false);
+}
+
+int nvme_ns_writev(nvme_ns_t n, const struct iovec *iov, int iovcnt,
+		   off_t offset)
+{
+	return nvme_ns_rwv(n, iov, iovcnt, offset, true);
+}
+
+int nvme_ns_compare(nvme_ns_t n, void *buf, off_t offset, size_t count)
+{
+	struct nvme_io_args args = {
+		.args_size = sizeof(args),
+		.fd = nvme_ns_get_fd(n),
+		.nsid = nvme_ns_get_nsid(n),
+		.control = 0,
+		.dsm = 0,
+		.dspec = 0,
+		.reftag = 0,
+		.apptag = 0,
+		.appmask = 0,
+		.storage_tag = 0,
+		.data_len = count,
+		.data = buf,
+		.metadata_len = 0,
+		.metadata = NULL,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+		.result = NULL,
+	};
+
+	if (nvme_bytes_to_lba(n, offset, count, &args.slba, &args.nlb))
+		return -1;
+
+	return nvme_compare(&args);
+}
+
+int nvme_ns_flush(nvme_ns_t n)
+{
+	return nvme_flush(nvme_ns_get_fd(n), nvme_ns_get_nsid(n));
+}
+
+static void nvme_ns_parse_descriptors(struct nvme_ns *n,
+				      struct nvme_ns_id_desc *descs)
+{
+	void *d = descs;
+	int i, len;
+
+	for (i = 0; i < NVME_IDENTIFY_DATA_SIZE; i += len) {
+		struct nvme_ns_id_desc *desc = d + i;
+
+		if (!desc->nidl)
+			break;
+		len = desc->nidl + sizeof(*desc);
+
+		switch (desc->nidt) {
+		case NVME_NIDT_EUI64:
+			memcpy(n->eui64, desc->nid, sizeof(n->eui64));
+			break;
+		case NVME_NIDT_NGUID:
+			memcpy(n->nguid, desc->nid, sizeof(n->nguid));
+			break;
+		case NVME_NIDT_UUID:
+			memcpy(n->uuid, desc->nid, sizeof(n->uuid));
+			break;
 		case NVME_NIDT_CSI:
 			memcpy(&n->csi, desc->nid, sizeof(n->csi));
 			break;
@@ -1745,6 +3079,9 @@ static int nvme_ns_init(struct nvme_ns *n)
 	uint8_t flbas;
 	int ret;
 
+	/* not retried on failure, the getters then just return zeroes */
+	n->identified = true;
+
 	ret = nvme_ns_identify(n, &ns);
 	if (ret)
 		return ret;
@@ -1755,10 +3092,26 @@ static int nvme_ns_init(struct nvme_ns *n)
 	n->lba_count = le64_to_cpu(ns.nsze);
 	n->lba_util = le64_to_cpu(ns.nuse);
 	n->meta_size = le16_to_cpu(ns.lbaf[flbas].ms);
+	n->meta_ext = ns.flbas & NVME_NS_FLBAS_META_EXT;
+	n->pi_type = ns.dps & NVME_NS_DPS_PI_MASK;
+	n->pi_first = ns.dps & NVME_NS_DPS_PI_FIRST;
 
 	if (!nvme_ns_identify_descs(n, descs))
 		nvme_ns_parse_descriptors(n, descs);
 
+	/* without the extended LBA formats the guard is 16 bits */
+	if (n->pi_type != NVME_NS_DPS_PI_NONE && n->csi == NVME_CSI_NVM) {
+		struct nvme_nvm_id_ns nvm;
+		__u32 elbaf;
+
+		if (!nvme_identify_ns_csi(nvme_ns_get_fd(n), n->nsid,
+					  NVME_UUID_NONE, NVME_CSI_NVM, &nvm)) {
+			elbaf = le32_to_cpu(nvm.elbaf[flbas]);
+			n->sts = elbaf & NVME_NVM_ELBAF_STS_MASK;
+			n->pif = (elbaf & NVME_NVM_ELBAF_PIF_MASK) >> 7;
+		}
+	}
+
 	return 0;
 }
 
@@ -1776,43 +3129,106 @@ static void nvme_ns_set_generic_name(struct nvme_ns *n, const char *name)
 	n->generic_name = strdup(generic_name);
 }
 
-static nvme_ns_t nvme_ns_open(const char *name)
+static int nvme_ns_open_dev(struct nvme_ns *n, bool identify)
+{
+	int err;
+
+	n->fd = nvme_open(n->name);
+	if (n->fd < 0)
+		return -1;
+
+	if (nvme_get_nsid(n->fd, &n->nsid) < 0)
+		goto close_fd;
+
+	if (identify && nvme_ns_init(n) != 0)
+		goto close_fd;
+
+	return 0;
+
+close_fd:
+	err = errno;
+	close(n->fd);
+	n->fd = -1;
+	errno = err;
+	return -1;
+}
+
+static struct nvme_ns *nvme_ns_alloc(nvme_root_t r, const char *name)
 {
 	struct nvme_ns *n;
 
-	n = calloc(1, sizeof(*n));
+	n = nvme_slab_zalloc(r ? r->ns_slab : NULL, sizeof(*n));
 	if (!n) {
 		errno = ENOMEM;
 		return NULL;
 	}
 
 	n->name = strdup(name);
-	n->fd = nvme_open(n->name);
-	if (n->fd < 0)
-		goto free_ns;
-
+	n->fd = -1;
+	n->generic_fd = -1;
 	nvme_ns_set_generic_name(n, name);
 
-	if (nvme_get_nsid(n->fd, &n->nsid) < 0)
-		goto close_fd;
-
-	if (nvme_ns_init(n) != 0)
-		goto close_fd;
-
 	list_head_init(&n->paths);
 	list_node_init(&n->entry);
 
 	return n;
+}
 
-close_fd:
-	close(n->fd);
-free_ns:
-	free(n->name);
-	free(n);
-	return NULL;
+static nvme_ns_t nvme_ns_open(nvme_root_t r, const char *name, bool identify)
+{
+	struct nvme_ns *n;
+
+	n = nvme_ns_alloc(r, name);
+	if (!n)
+		return NULL;
+
+	if (nvme_ns_open_dev(n, identify) < 0) {
+		free(n->generic_name);
+		free(n->name);
+		nvme_slab_free(n);
+		return NULL;
+	}
+
+	return n;
 }
 
-static struct nvme_ns *__nvme_scan_namespace(const char *sysfs_dir, const char *name)
+static int nvme_root_add_pending_ns(nvme_root_t r, struct nvme_ns *n)
+{
+	if (r->nr_pending_ns == r->max_pending_ns) {
+		int max = r->max_pending_ns ? r->max_pending_ns * 2 : 64;
+		struct nvme_ns **tmp;
+
+		tmp = realloc(r->pending_ns, max * sizeof(*tmp));
+		if (!tmp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		r->pending_ns = tmp;
+		r->max_pending_ns = max;
+	}
+	r->pending_ns[r->nr_pending_ns++] = n;
+	n->pending = true;
+	return 0;
+}
+
+static void nvme_ns_drop_pending(struct nvme_ns *n)
+{
+	nvme_root_t r;
+	int i;
+
+	if (!n->s || !n->s->h)
+		return;
+
+	r = n->s->h->r;
+	for (i = 0; i < r->nr_pending_ns; i++) {
+		if (r->pending_ns[i] == n)
+			r->pending_ns[i] = NULL;
+	}
+}
+
+static struct nvme_ns *__nvme_scan_namespace(nvme_root_t r,
+					     const char *sysfs_dir,
+					     const char *name)
 {
 	struct nvme_ns *n;
 	char *path;
@@ -1824,7 +3240,21 @@ static struct nvme_ns *__nvme_scan_namespace(const char *sysfs_dir, const char *
 		return NULL;
 	}
 
-	n = nvme_ns_open(name);
+	/*
+	 * During a parallel scan only the tree node is created here, the
+	 * device is opened and identified by nvme_scan_pending_ns().
+	 */
+	if (r && r->scan_threads > 1 && r->scanning) {
+		n = nvme_ns_alloc(r, name);
+		if (n && nvme_root_add_pending_ns(r, n) < 0) {
+			free(n->generic_name);
+			free(n->name);
+			nvme_slab_free(n);
+			n = NULL;
+		}
+	} else {
+		n = nvme_ns_open(r, name, !r || !r->lazy_ns_identify);
+	}
 	if (!n)
 		goto free_path;
 
@@ -1838,7 +3268,134 @@ free_path:
 
 nvme_ns_t nvme_scan_namespace(const char *name)
 {
-	return __nvme_scan_namespace(nvme_ns_sysfs_dir, name);
+	return __nvme_scan_namespace(NULL, nvme_ns_sysfs_dir, name);
+}
+
+struct nvme_identify_work {
+	struct nvme_ns **ns;
+	int *err;
+};
+
+static void nvme_ns_identify_one(unsigned int i, void *arg)
+{
+	struct nvme_identify_work *w = arg;
+
+	if (nvme_ns_init(w->ns[i]))
+		w->err[i] = errno ? errno : EIO;
+}
+
+int nvme_identify_namespaces(nvme_root_t r)
+{
+	struct nvme_identify_work w = { };
+	unsigned int nr = 0, max = 0, i;
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	nvme_host_t h;
+	nvme_ns_t n;
+	int err = 0;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ns(s, n)
+				max++;
+			nvme_subsystem_for_each_ctrl(s, c)
+				nvme_ctrl_for_each_ns(c, n)
+					max++;
+		}
+	}
+	if (!max)
+		return 0;
+
+	w.ns = calloc(max, sizeof(*w.ns));
+	w.err = calloc(max, sizeof(*w.err));
+	if (!w.ns || !w.err) {
+		free(w.ns);
+		free(w.err);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ns(s, n)
+				if (!n->identified && n->fd >= 0)
+					w.ns[nr++] = n;
+			nvme_subsystem_for_each_ctrl(s, c)
+				nvme_ctrl_for_each_ns(c, n)
+					if (!n->identified && n->fd >= 0)
+						w.ns[nr++] = n;
+		}
+	}
+
+	nvme_run_parallel(r->scan_threads, nr, nvme_ns_identify_one, &w);
+
+	for (i = 0; i < nr; i++) {
+		if (!w.err[i])
+			continue;
+		nvme_msg(r, LOG_DEBUG, "failed to identify namespace %s: %s\n",
+			 w.ns[i]->name, strerror(w.err[i]));
+		err = w.err[i];
+	}
+
+	free(w.ns);
+	free(w.err);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static void nvme_ns_open_pending(unsigned int i, void *arg)
+{
+	nvme_root_t r = arg;
+	struct nvme_ns *n = r->pending_ns[i];
+
+	if (n && nvme_ns_open_dev(n, !r->lazy_ns_identify) < 0)
+		n->scan_errno = errno ? errno : ENODEV;
+}
+
+static void nvme_scan_pending_ns(nvme_root_t r, nvme_scan_filter_t f,
+				 void *f_args)
+{
+	struct nvme_path *p, *_p;
+	struct nvme_ns *n;
+	int i;
+
+	nvme_run_parallel(r->scan_threads, r->nr_pending_ns,
+			  nvme_ns_open_pending, r);
+
+	/* drop failed and filtered namespaces in scan order */
+	for (i = 0; i < r->nr_pending_ns; i++) {
+		n = r->pending_ns[i];
+		if (!n)
+			continue;
+		n->pending = false;
+
+		if (n->scan_errno) {
+			nvme_msg(r, LOG_DEBUG, "failed to scan namespace %s: %s\n",
+				 n->name, strerror(n->scan_errno));
+		} else if (!n->c && f && !f(NULL, NULL, n, f_args)) {
+			nvme_msg(r, LOG_DEBUG, "filter out namespace %s\n",
+				 n->name);
+		} else {
+			if (!n->c && n->s)
+				nvme_index_ns(r, n);
+			continue;
+		}
+
+		nvme_namespace_for_each_path_safe(n, p, _p) {
+			list_del_init(&p->nentry);
+			p->n = NULL;
+		}
+		list_head_init(&n->paths);
+		__nvme_free_ns(n);
+	}
+
+	free(r->pending_ns);
+	r->pending_ns = NULL;
+	r->nr_pending_ns = 0;
+	r->max_pending_ns = 0;
 }
 
 static int nvme_ctrl_scan_namespace(nvme_root_t r, struct nvme_ctrl *c,
@@ -1853,7 +3410,7 @@ static int nvme_ctrl_scan_namespace(nvme_root_t r, struct nvme_ctrl *c,
 		errno = EINVAL;
 		return -1;
 	}
-	n = __nvme_scan_namespace(c->sysfs_dir, name);
+	n = __nvme_scan_namespace(r, c->sysfs_dir, name);
 	if (!n) {
 		nvme_msg(r, LOG_DEBUG, "failed to scan namespace %s\n", name);
 		return -1;
@@ -1902,12 +3459,13 @@ static int nvme_subsystem_scan_namespace(nvme_root_t r, nvme_subsystem_t s,
 
 	nvme_msg(r, LOG_DEBUG, "scan subsystem %s namespace %s\n",
 		 s->name, name);
-	n = __nvme_scan_namespace(s->sysfs_dir, name);
+	n = __nvme_scan_namespace(r, s->sysfs_dir, name);
 	if (!n) {
 		nvme_msg(r, LOG_DEBUG, "failed to scan namespace %s\n", name);
 		return -1;
 	}
-	if (f && !f(NULL, NULL, n, f_args)) {
+	/* pending namespaces are filtered once they are identified */
+	if (f && !n->pending && !f(NULL, NULL, n, f_args)) {
 		nvme_msg(r, LOG_DEBUG, "filter out namespace %s\n", name);
 		__nvme_free_ns(n);
 		return 0;
@@ -1927,18 +3485,315 @@ static int nvme_subsystem_scan_namespace(nvme_root_t r, nvme_subsystem_t s,
 	}
 	n->s = s;
 	list_add(&s->namespaces, &n->entry);
+	if (r) {
+		/* pending namespaces have no nsid yet */
+		n->hnode.seq = ++r->index_seq;
+		if (!n->pending)
+			nvme_index_ns(r, n);
+	}
 	nvme_subsystem_set_ns_path(s, n);
 	return 0;
 }
 
+static bool nvme_ns_match_node(struct nvme_hnode *node, const void *key)
+{
+	struct nvme_ns *n = container_of(node, struct nvme_ns, hnode);
+	const struct nvme_ns_key *k = key;
+
+	return n->s == k->s && !n->c && n->nsid == k->nsid;
+}
+
 struct nvme_ns *nvme_subsystem_lookup_namespace(struct nvme_subsystem *s,
 						__u32 nsid)
 {
+	struct nvme_ns_key key = {
+		.s = s,
+		.nsid = nsid,
+	};
+	nvme_root_t r = s->h ? s->h->r : NULL;
+	struct nvme_hnode *node;
 	struct nvme_ns *n;
 
+	/* namespaces pending during a scan are not indexed yet */
+	if (r && !r->ns_index.failed && !r->scanning) {
+		node = nvme_index_find(&r->ns_index, nvme_ns_hash(s, nsid),
+				       ULONG_MAX, nvme_ns_match_node, &key,
+				       NULL);
+		return node ? container_of(node, struct nvme_ns, hnode) : NULL;
+	}
+
 	nvme_subsystem_for_each_ns(s, n) {
 		if (nvme_ns_get_nsid(n) == nsid)
 			return n;
 	}
 	return NULL;
 }
+
+static bool nvme_dirents_contain(struct dirent **d, int nr, const char *name)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (!strcmp(d[i]->d_name, name))
+			return true;
+	}
+	return false;
+}
+
+static void nvme_ns_detach_paths(struct nvme_ns *n)
+{
+	struct nvme_path *p, *_p;
+
+	nvme_namespace_for_each_path_safe(n, p, _p) {
+		list_del_init(&p->nentry);
+		p->n = NULL;
+	}
+	list_head_init(&n->paths);
+}
+
+static void nvme_ctrl_update_namespaces(nvme_root_t r, struct nvme_ctrl *c)
+{
+	struct dirent **namespaces;
+	struct nvme_ns *n, *_n;
+	int i, num_ns;
+
+	num_ns = nvme_scan_ctrl_namespaces(c, &namespaces);
+	if (num_ns < 0)
+		return;
+
+	nvme_ctrl_for_each_ns_safe(c, n, _n) {
+		if (nvme_dirents_contain(namespaces, num_ns, n->name))
+			continue;
+		nvme_msg(r, LOG_DEBUG, "remove controller %s namespace %s\n",
+			 c->name, n->name);
+		__nvme_free_ns(n);
+	}
+
+	for (i = 0; i < num_ns; i++) {
+		bool found = false;
+
+		nvme_ctrl_for_each_ns(c, n) {
+			if (!strcmp(n->name, namespaces[i]->d_name)) {
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			nvme_ctrl_scan_namespace(r, c, namespaces[i]->d_name);
+	}
+
+	nvme_free_dirents(namespaces, num_ns);
+}
+
+static void nvme_ctrl_update_paths(nvme_root_t r, struct nvme_ctrl *c)
+{
+	struct nvme_path *p, *_p;
+	struct dirent **paths;
+	int i, num_paths;
+
+	num_paths = nvme_scan_ctrl_namespace_paths(c, &paths);
+	if (num_paths < 0)
+		return;
+
+	nvme_ctrl_for_each_path_safe(c, p, _p) {
+		char *ana_state;
+
+		if (!nvme_dirents_contain(paths, num_paths, p->name)) {
+			nvme_msg(r, LOG_DEBUG,
+				 "remove controller %s path %s\n",
+				 c->name, p->name);
+			nvme_free_path(p);
+			continue;
+		}
+
+		/* the ANA state is what changes most often */
+		if (p->ana_state_fd >= 0)
+			ana_state = nvme_reread_attr(p->ana_state_fd);
+		else
+			ana_state = nvme_get_path_attr(p, "ana_state");
+		if (ana_state) {
+			free(p->ana_state);
+			p->ana_state = ana_state;
+		}
+	}
+
+	for (i = 0; i < num_paths; i++) {
+		bool found = false;
+
+		nvme_ctrl_for_each_path(c, p) {
+			if (!strcmp(p->name, paths[i]->d_name)) {
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			nvme_ctrl_scan_path(r, c, paths[i]->d_name);
+	}
+
+	nvme_free_dirents(paths, num_paths);
+}
+
+static void nvme_subsystem_update_namespaces(nvme_root_t r,
+					     struct nvme_subsystem *s,
+					     nvme_scan_filter_t f,
+					     void *f_args)
+{
+	struct dirent **namespaces;
+	struct nvme_ns *n, *_n;
+	int i, num_ns;
+
+	num_ns = nvme_scan_subsystem_namespaces(s, &namespaces);
+	if (num_ns < 0)
+		return;
+
+	nvme_subsystem_for_each_ns_safe(s, n, _n) {
+		if (nvme_dirents_contain(namespaces, num_ns, n->name))
+			continue;
+		nvme_msg(r, LOG_DEBUG, "remove subsystem %s namespace %s\n",
+			 s->name, n->name);
+		nvme_ns_detach_paths(n);
+		__nvme_free_ns(n);
+	}
+
+	for (i = 0; i < num_ns; i++) {
+		bool found = false;
+
+		nvme_subsystem_for_each_ns(s, n) {
+			if (!strcmp(n->name, namespaces[i]->d_name)) {
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			nvme_subsystem_scan_namespace(r, s,
+					namespaces[i]->d_name, f, f_args);
+	}
+
+	nvme_free_dirents(namespaces, num_ns);
+}
+
+static struct nvme_ctrl *nvme_lookup_ctrl_by_name(nvme_root_t r,
+						  const char *name)
+{
+	struct nvme_subsystem *s;
+	struct nvme_host *h;
+	struct nvme_ctrl *c;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ctrl(s, c) {
+				if (c->name && !strcmp(c->name, name))
+					return c;
+			}
+		}
+	}
+	return NULL;
+}
+
+static struct nvme_subsystem *nvme_lookup_subsystem_by_name(nvme_root_t r,
+							    const char *name)
+{
+	struct nvme_subsystem *s;
+	struct nvme_host *h;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			if (s->name && !strcmp(s->name, name))
+				return s;
+		}
+	}
+	return NULL;
+}
+
+int nvme_update_topology(nvme_root_t r, nvme_scan_filter_t f, void *f_args)
+{
+	struct nvme_subsystem *s, *_s;
+	struct dirent **subsys, **ctrls;
+	int i, num_subsys, num_ctrls;
+	struct nvme_ctrl *c, *_c;
+	struct nvme_host *h;
+
+	num_ctrls = nvme_scan_ctrls(&ctrls);
+	if (num_ctrls < 0) {
+		nvme_msg(r, LOG_DEBUG, "failed to scan ctrls: %s\n",
+			 strerror(errno));
+		return num_ctrls;
+	}
+	num_subsys = nvme_scan_subsystems(&subsys);
+	if (num_subsys < 0) {
+		nvme_msg(r, LOG_DEBUG, "failed to scan subsystems: %s\n",
+			 strerror(errno));
+		nvme_free_dirents(ctrls, num_ctrls);
+		return num_subsys;
+	}
+
+	/*
+	 * Controllers created from a configuration but never connected
+	 * have no name and are left alone.
+	 */
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ctrl_safe(s, c, _c) {
+				if (!c->name || nvme_dirents_contain(ctrls,
+						num_ctrls, c->name))
+					continue;
+				nvme_msg(r, LOG_DEBUG,
+					 "remove controller %s\n", c->name);
+				__nvme_free_ctrl(c);
+			}
+		}
+	}
+
+	r->scanning = true;
+
+	for (i = 0; i < num_ctrls; i++) {
+		c = nvme_lookup_ctrl_by_name(r, ctrls[i]->d_name);
+		if (c) {
+			nvme_ctrl_update_namespaces(r, c);
+			nvme_ctrl_update_paths(r, c);
+			continue;
+		}
+
+		c = nvme_scan_ctrl(r, ctrls[i]->d_name);
+		if (!c) {
+			nvme_msg(r, LOG_DEBUG, "failed to scan ctrl %s: %s\n",
+				 ctrls[i]->d_name, strerror(errno));
+			continue;
+		}
+		if (f && !f(NULL, c, NULL, f_args)) {
+			nvme_msg(r, LOG_DEBUG, "filter out controller %s\n",
+				 ctrls[i]->d_name);
+			nvme_free_ctrl(c);
+		}
+	}
+
+	for (i = 0; i < num_subsys; i++) {
+		s = nvme_lookup_subsystem_by_name(r, subsys[i]->d_name);
+		if (s)
+			nvme_subsystem_update_namespaces(r, s, f, f_args);
+		else if (nvme_scan_subsystem(r, subsys[i]->d_name,
+					     f, f_args) < 0)
+			nvme_msg(r, LOG_DEBUG,
+				 "failed to scan subsystem %s: %s\n",
+				 subsys[i]->d_name, strerror(errno));
+	}
+
+	/* subsystems which are gone from sysfs and have no controllers */
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem_safe(h, s, _s) {
+			if (!s->name || !list_empty(&s->ctrls) ||
+			    nvme_dirents_contain(subsys, num_subsys, s->name))
+				continue;
+			nvme_msg(r, LOG_DEBUG, "remove subsystem %s\n",
+				 s->name);
+			__nvme_free_subsystem(s);
+		}
+	}
+
+	r->scanning = false;
+	nvme_scan_pending_ns(r, f, f_args);
+
+	nvme_free_dirents(subsys, num_subsys);
+	nvme_free_dirents(ctrls, num_ctrls);
+	return 0;
+}
@@ -15,6 +15,7 @@
 #include <stddef.h>
 
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <uuid.h>
 
 #include "ioctl.h"
@@ -547,6 +548,19 @@ const char *nvme_ns_get_name(nvme_ns_t n);
  */
 const char *nvme_ns_get_generic_name(nvme_ns_t n);
 
+/**
+ * nvme_ns_get_generic_fd() - Get associated generic chardev file descriptor
+ * @n:	Namespace instance
+ *
+ * The generic namespace character device (/dev/ngXnY) is opened on first
+ * use and closed when the namespace is freed. It is the device to use for
+ * io_uring passthrough, see nvme_uring_create().
+ *
+ * Return: File descriptor associated with the generic namespace chardev,
+ * or -1 with errno set otherwise.
+ */
+int nvme_ns_get_generic_fd(nvme_ns_t n);
+
 /**
  * nvme_ns_get_firmware() - Firmware string of a namespace
  * @n:	Namespace instance
@@ -595,6 +609,70 @@ nvme_ctrl_t nvme_ns_get_ctrl(nvme_ns_t n);
  */
 void nvme_free_ns(struct nvme_ns *n);
 
+/**
+ * nvme_ns_buf_pool_init() - Set up an I/O buffer pool for a namespace
+ * @n:		Namespace instance
+ * @buf_size:	Size of each buffer, rounded up to the page size
+ * @nr_bufs:	Number of buffers in the pool
+ * @flags:	Creation flags, see &enum nvme_buf_pool_flags
+ *
+ * Creates a pool of page aligned buffers which is registered once as an
+ * io_uring fixed buffer on the generic namespace chardev. nvme_ns_read()
+ * and nvme_ns_write() send commands on these buffers through io_uring,
+ * so the kernel does not have to pin and map them for every command.
+ * Without io_uring support the buffers still work through the regular
+ * ioctl path. The pool is freed together with @n and, like @n, must not
+ * be used by several threads at once.
+ *
+ * The memory is placed on the NUMA node of the controller of @n, for a
+ * multipath namespace on that of nvme_namespace_get_nearest_path().
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_ns_buf_pool_init(nvme_ns_t n, size_t buf_size, unsigned int nr_bufs,
+			  unsigned int flags);
+
+/**
+ * nvme_ns_get_buf() - Take a buffer from the namespace buffer pool
+ * @n:		Namespace instance
+ *
+ * Return: A buffer set up by nvme_ns_buf_pool_init(), or NULL with errno
+ * set otherwise.
+ */
+void *nvme_ns_get_buf(nvme_ns_t n);
+
+/**
+ * nvme_ns_put_buf() - Return a buffer to the namespace buffer pool
+ * @n:		Namespace instance
+ * @buf:	Buffer obtained from nvme_ns_get_buf()
+ */
+void nvme_ns_put_buf(nvme_ns_t n, void *buf);
+
+/**
+ * nvme_ns_set_polled() - Use polled completions for namespace I/O
+ * @n:		Namespace instance
+ * @polled:	Enable or disable polling
+ *
+ * With polling enabled, nvme_ns_read() and nvme_ns_write() are sent through
+ * an io_uring ring on the generic namespace chardev which is set up with
+ * %NVME_URING_IOPOLL. Completions are then busy-polled from the device
+ * instead of being signalled by an interrupt, which lowers the latency of
+ * single outstanding commands. The nvme driver needs poll queues for this
+ * to take effect.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise, in which case the
+ * previous setting is kept.
+ */
+int nvme_ns_set_polled(nvme_ns_t n, bool polled);
+
+/**
+ * nvme_ns_is_polled() - Check whether namespace I/O uses polling
+ * @n:		Namespace instance
+ *
+ * Return: true if polled completions were enabled with nvme_ns_set_polled().
+ */
+bool nvme_ns_is_polled(nvme_ns_t n);
+
 /**
  * nvme_ns_read() - Read from a namespace
  * @n:		Namespace instance
@@ -617,6 +695,49 @@ int nvme_ns_read(nvme_ns_t n, void *buf, off_t offset, size_t count);
  */
 int nvme_ns_write(nvme_ns_t n, void *buf, off_t offset, size_t count);
 
+/**
+ * nvme_ns_readv() - Read from a namespace into several buffers
+ * @n:		Namespace instance
+ * @iov:	Buffers into which the data will be transferred, of any
+ *		length as long as their total is a multiple of the logical
+ *		block size
+ * @iovcnt:	Number of buffers in @iov
+ * @offset:	Byte offset into @n, a multiple of the logical block size
+ *
+ * Merges the buffers into commands no larger than the maximum transfer
+ * size of the controller which do not cross the I/O boundary the
+ * namespace reports. Every command transfers directly into the parts of
+ * the buffers it covers with a vectored passthrough command, through a
+ * bounce buffer on kernels without them. The commands are submitted as
+ * one batch, see nvme_submit_io_passthru_batch(), and kept in flight
+ * together on the generic character device of @n when it is available.
+ *
+ * Return: 0 if all commands succeeded, otherwise the nvme command status of
+ * the first failed command if a response was received (see &enum
+ * nvme_status_field) or -1 with errno set.
+ */
+int nvme_ns_readv(nvme_ns_t n, const struct iovec *iov, int iovcnt,
+		  off_t offset);
+
+/**
+ * nvme_ns_writev() - Write to a namespace from several buffers
+ * @n:		Namespace instance
+ * @iov:	Buffers with data to be written, of any length as long as
+ *		their total is a multiple of the logical block size
+ * @iovcnt:	Number of buffers in @iov
+ * @offset:	Byte offset into @n, a multiple of the logical block size
+ *
+ * Splits the write like nvme_ns_readv(). The commands complete in no
+ * particular order, so on failure any part of the range may have been
+ * written.
+ *
+ * Return: 0 if all commands succeeded, otherwise the nvme command status of
+ * the first failed command if a response was received (see &enum
+ * nvme_status_field) or -1 with errno set.
+ */
+int nvme_ns_writev(nvme_ns_t n, const struct iovec *iov, int iovcnt,
+		   off_t offset);
+
 /**
  * nvme_ns_verify() - Verify data on a namespace
  * @n:		Namespace instance
@@ -714,6 +835,77 @@ const char *nvme_path_get_sysfs_dir(nvme_path_t p);
  */
 const char *nvme_path_get_ana_state(nvme_path_t p);
 
+/**
+ * nvme_path_get_ana_group_state() - Cached ANA state of the group of a path
+ * @p:	&nvme_path_t object
+ *
+ * Looks the ANA group of @p up in the group states of its controller,
+ * which are read with the ANA log page on first use and then only by
+ * nvme_ctrl_refresh_ana(). Paths of controllers which do not report the
+ * log, or of groups missing from it, get the state from the sysfs
+ * attribute read during the scan, see nvme_path_get_ana_state().
+ *
+ * Return: ANA state of @p, see &enum nvme_ana_state.
+ */
+enum nvme_ana_state nvme_path_get_ana_group_state(nvme_path_t p);
+
+/**
+ * nvme_path_get_numa_node_id() - NUMA node of a path
+ * @p:	&nvme_path_t object
+ *
+ * Return: NUMA node of the controller of @p, or -1 if it has no affinity
+ * to a node.
+ */
+int nvme_path_get_numa_node_id(nvme_path_t p);
+
+/**
+ * nvme_ctrl_refresh_ana() - Reread the ANA group states of a controller
+ * @c:	Controller instance
+ *
+ * Reads the ANA log page, without the namespace lists, into the state
+ * cache of @c which nvme_path_get_ana_group_state() and
+ * nvme_namespace_get_best_path() use. An event monitor calls this itself
+ * for an ANA change notice (&NVME_MONITOR_EVENT_AEN with an &aen_lid of
+ * %NVME_LOG_LID_ANA) of a controller in its tree, unless the tree is
+ * published, before the callbacks are run. Call it for other trees
+ * instead of rescanning. The asynchronous event is left pending for the
+ * kernel, which handles it as well.
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise, in which case
+ * the cache of @c is unchanged.
+ */
+int nvme_ctrl_refresh_ana(nvme_ctrl_t c);
+
+/**
+ * nvme_namespace_get_best_path() - Pick a path to send I/O to a namespace
+ * @n:	Namespace instance of a multipath namespace
+ *
+ * Uses the cached ANA group states only, so no command or sysfs access is
+ * needed once they have been read. Successive calls rotate through the
+ * paths in the best state, optimized before non-optimized.
+ *
+ * Return: Path of @n, or NULL with errno set to ENODEV if no path is
+ * usable.
+ */
+nvme_path_t nvme_namespace_get_best_path(nvme_ns_t n);
+
+/**
+ * nvme_namespace_get_nearest_path() - Pick the path closest to the caller
+ * @n:	Namespace instance of a multipath namespace
+ *
+ * Like nvme_namespace_get_best_path(), but within each ANA state paths
+ * whose controller is on the NUMA node of the CPU the calling thread runs
+ * on come first. An optimized remote path is still preferred over a
+ * non-optimized local one. Pin the thread, e.g. to
+ * nvme_ctrl_get_local_cpus() of the chosen path, for the choice to stay
+ * valid.
+ *
+ * Return: Path of @n, or NULL with errno set to ENODEV if no path is
+ * usable.
+ */
+nvme_path_t nvme_namespace_get_nearest_path(nvme_ns_t n);
+
 /**
  * nvme_path_get_ctrl() - Parent controller of an nvme_path_t object
  * @p:	&nvme_path_t object
@@ -795,6 +987,31 @@ const char *nvme_ctrl_get_state(nvme_ctrl_t c);
  */
 const char *nvme_ctrl_get_numa_node(nvme_ctrl_t c);
 
+/**
+ * nvme_ctrl_get_numa_node_id() - NUMA node of a controller as a number
+ * @c:	Controller instance
+ *
+ * Return: NUMA node of @c, or -1 if it has no affinity to a node, as is
+ * usual for fabrics controllers.
+ */
+int nvme_ctrl_get_numa_node_id(nvme_ctrl_t c);
+
+/**
+ * nvme_ctrl_get_local_cpus() - CPUs close to a controller
+ * @c:		Controller instance
+ * @mask:	CPU mask to fill, a cpu_set_t or a set allocated with
+ *		CPU_ALLOC()
+ * @size:	Size of @mask in bytes, e.g. sizeof(cpu_set_t) or CPU_ALLOC_SIZE()
+ *
+ * Fills @mask with the CPUs local to the PCIe device of @c, or with
+ * those of its NUMA node, ready to be passed to sched_setaffinity() or
+ * pthread_setaffinity_np().
+ *
+ * Return: 0 on success, or -1 with errno set otherwise. errno is set to
+ * ENODATA if @c has no affinity to any CPUs.
+ */
+int nvme_ctrl_get_local_cpus(nvme_ctrl_t c, void *mask, size_t size);
+
 /**
  * nvme_ctrl_get_queue_count() - Queue count of a controller
  * @c:	Controller instance
@@ -811,6 +1028,55 @@ const char *nvme_ctrl_get_queue_count(nvme_ctrl_t c);
  */
 const char *nvme_ctrl_get_serial(nvme_ctrl_t c);
 
+/**
+ * nvme_ctrl_get_mdts() - Maximum Data Transfer Size of a controller
+ * @c:	Controller instance
+ *
+ * The transfer limits of a controller are read with an Identify Controller
+ * command and the CAP register on first use and cached afterwards.
+ *
+ * Return: MDTS field of the Identify Controller data, 0 if there is no
+ * limit or it couldn't be read
+ */
+__u8 nvme_ctrl_get_mdts(nvme_ctrl_t c);
+
+/**
+ * nvme_ctrl_get_mpsmin() - Memory Page Size Minimum of a controller
+ * @c:	Controller instance
+ *
+ * Return: CAP.MPSMIN of @c, 0 (4k) if the register couldn't be read
+ */
+__u8 nvme_ctrl_get_mpsmin(nvme_ctrl_t c);
+
+/**
+ * nvme_ctrl_get_max_xfer_len() - Largest data transfer of a controller
+ * @c:	Controller instance
+ *
+ * Combines MDTS, CAP.MPSMIN and the limit the kernel sets for the
+ * controller's queues into the largest legal transfer size of a single
+ * command. The limits are read once and cached in @c. Pass this as
+ * transfer size to the chunked helpers like nvme_get_log_page() and
+ * nvme_stream_ctrl_telemetry(), which otherwise issue an Identify
+ * Controller command on every call and can't take CAP.MPSMIN or the
+ * kernel limit into account.
+ *
+ * Return: Transfer size in bytes, 4096 if the limits couldn't be read
+ */
+__u32 nvme_ctrl_get_max_xfer_len(nvme_ctrl_t c);
+
+/**
+ * nvme_ctrl_get_fw_xfer_len() - Firmware download chunk size of a controller
+ * @c:	Controller instance
+ *
+ * Like nvme_ctrl_get_max_xfer_len(), rounded down to a multiple of the
+ * firmware update granularity of @c, for nvme_fw_download_seq() and
+ * nvme_fw_download_file(). If the granularity is larger than the maximum
+ * transfer size, the maximum transfer size is used as is.
+ *
+ * Return: Transfer size in bytes
+ */
+__u32 nvme_ctrl_get_fw_xfer_len(nvme_ctrl_t c);
+
 /**
  * nvme_ctrl_get_sqsize() - SQ size of a controller
  * @c:	Controller instance
@@ -1062,6 +1328,48 @@ const char *nvme_subsystem_get_type(nvme_subsystem_t s);
  */
 int nvme_scan_topology(nvme_root_t r, nvme_scan_filter_t f, void *f_args);
 
+/**
+ * nvme_snapshot_save() - Save the topology to a snapshot file
+ * @r:		&nvme_root_t object
+ * @path:	Snapshot file name
+ *
+ * Writes hosts, subsystems, controllers, namespaces and paths of @r with
+ * their attributes and the identify data kept for namespaces to a compact
+ * binary file, which nvme_snapshot_load() maps and turns back into a tree
+ * without accessing sysfs or sending any commands. The file is replaced
+ * atomically. Authentication keys are not saved, so the file is readable
+ * by everyone.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_snapshot_save(nvme_root_t r, const char *path);
+
+/**
+ * nvme_snapshot_load() - Create a tree from a snapshot file
+ * @path:	Snapshot file name written by nvme_snapshot_save()
+ *
+ * The snapshot is only used if the topology has not changed since it was
+ * saved, see nvme_snapshot_generation(). Namespace devices of the new tree
+ * are opened on first use.
+ *
+ * Return: New &nvme_root_t object, or NULL with errno set otherwise. errno
+ * is set to ESTALE if the topology changed and to EINVAL if the file is
+ * not a valid snapshot.
+ */
+nvme_root_t nvme_snapshot_load(const char *path);
+
+/**
+ * nvme_snapshot_generation() - Generation of the NVMe topology
+ *
+ * Computed from the boot ID and the names and inode numbers of the NVMe
+ * devices in sysfs, which only takes a few directory reads. It changes
+ * whenever a controller, subsystem, namespace or path is added or
+ * removed, even if a name is reused.
+ *
+ * Return: Generation of the current topology.
+ */
+__u64 nvme_snapshot_generation(void);
+
 /**
  * nvme_host_get_hostnqn() - Host NQN of an nvme_host_t object
  * @h:	nvme_host_t object
@@ -1084,6 +1392,72 @@ const char *nvme_host_get_hostid(nvme_host_t h);
  */
 void nvme_free_host(nvme_host_t h);
 
+/**
+ * nvme_root_set_scan_threads() - Set the number of threads used for scans
+ * @r:		&nvme_root_t object
+ * @nr_threads:	Maximum number of threads, 0 or 1 to scan serially
+ *
+ * With more than one thread, nvme_scan_topology() first builds the tree
+ * from sysfs and then opens and identifies all namespaces concurrently.
+ * The resulting tree and the order of its elements are the same as with
+ * a serial scan, and namespace filters are applied once a namespace has
+ * been identified.
+ */
+void nvme_root_set_scan_threads(nvme_root_t r, unsigned int nr_threads);
+
+/**
+ * nvme_root_set_lazy_ns_identify() - Defer namespace identification
+ * @r:		&nvme_root_t object
+ * @lazy:	Whether to identify namespaces on demand
+ *
+ * By default scanning sends Identify Namespace and Namespace
+ * Identification Descriptor commands to every namespace. When @lazy is
+ * set, later scans skip these; the LBA format, size, utilization, CSI
+ * and identifiers are read by the first call to one of the matching
+ * getters, or for all namespaces at once by nvme_identify_namespaces().
+ * Namespaces which fail identification then stay in the tree.
+ */
+void nvme_root_set_lazy_ns_identify(nvme_root_t r, bool lazy);
+
+/**
+ * nvme_root_set_resolver_ttl() - Set how long resolved hostnames are cached
+ * @r:		&nvme_root_t object
+ * @ttl:	Time in seconds, 0 to resolve hostnames every time
+ *
+ * Transport addresses given as a hostname are resolved when a controller
+ * is created or connected, and the address is remembered for @ttl
+ * seconds, 60 by default. Hostnames which failed to resolve are retried
+ * after 5 seconds at most. Setting the time forgets all cached addresses.
+ * See also nvmf_resolve_hostnames().
+ */
+void nvme_root_set_resolver_ttl(nvme_root_t r, unsigned int ttl);
+
+/**
+ * nvme_root_set_cache_attr_fds() - Keep volatile sysfs attributes open
+ * @r:		&nvme_root_t object
+ * @cache:	Whether to keep the attribute files open
+ *
+ * By default the controller state and the ANA state of the paths are
+ * read by opening their sysfs attribute each time. When @cache is set,
+ * the attributes are kept open once read, so nvme_ctrl_get_state() and
+ * nvme_update_topology() only need a pread() for them, at the cost of
+ * one file descriptor per controller and per path. Clearing it closes
+ * the attributes which are open.
+ */
+void nvme_root_set_cache_attr_fds(nvme_root_t r, bool cache);
+
+/**
+ * nvme_identify_namespaces() - Identify all namespaces not identified yet
+ * @r:		&nvme_root_t object
+ *
+ * Identifies the namespaces of a tree scanned with
+ * nvme_root_set_lazy_ns_identify(), using up to the number of threads
+ * set with nvme_root_set_scan_threads().
+ *
+ * Return: 0 on success, or -1 with errno set if any namespace failed.
+ */
+int nvme_identify_namespaces(nvme_root_t r);
+
 /**
  * nvme_scan() - Scan NVMe topology
  * @config_file:	Configuration file
@@ -1112,6 +1486,111 @@ int nvme_read_config(nvme_root_t r, const char *config_file);
  */
 void nvme_refresh_topology(nvme_root_t r);
 
+/**
+ * nvme_update_topology() - Apply topology changes to the tree
+ * @r:	    nvme_root_t object
+ * @f:	    filter to apply to new elements
+ * @f_args: user-specified argument to @f
+ *
+ * Compares the tree with sysfs and only adds the controllers,
+ * subsystems, namespaces and paths which appeared, and removes those
+ * which disappeared. All other objects, and the handles pointing to them,
+ * stay valid; the ANA state of existing paths is reread. This is meant
+ * to be called on &NVME_MONITOR_EVENT_ADD, &NVME_MONITOR_EVENT_REMOVE and
+ * ANA change events instead of nvme_refresh_topology().
+ *
+ * Return: 0 on success, -1 with errno set otherwise.
+ */
+int nvme_update_topology(nvme_root_t r, nvme_scan_filter_t f, void *f_args);
+
+/*
+ * Published generations of the topology
+ *
+ * An &nvme_root_t tree is not thread safe. A topology keeps the current
+ * tree as an immutable generation instead, which any number of threads
+ * can iterate and read concurrently while nvme_topology_refresh() scans
+ * the next generation into a new tree and publishes it. Readers pin a
+ * generation with nvme_topology_get() and release it with
+ * nvme_topology_put(); a generation which has been replaced is freed
+ * once its last reader released it.
+ *
+ * Taking and releasing a generation never blocks on a refresh, and
+ * readers do not contend with each other beyond the atomic updates of
+ * the reference count.
+ *
+ * A published tree must only be read: use the nvme_for_each_*()
+ * iterators and the getters, and send commands on the file descriptors
+ * of its nodes, but do not add, remove or update nodes. The attributes
+ * reread from sysfs by the getters, such as nvme_ctrl_get_state(), return
+ * the value read by the scan of the generation. The values other trees
+ * read from the device on first use, such as the transfer limits and the
+ * ANA group states, are read by the scan before the tree is published;
+ * call nvme_ctrl_refresh_ana() only on trees which are not published.
+ */
+typedef struct nvme_topology *nvme_topology_t;
+
+/**
+ * nvme_topology_create() - Scan the topology into its first generation
+ * @fp:		File descriptor for logging messages
+ * @log_level:	Logging level to use
+ * @config_file: JSON configuration file merged into every generation,
+ *		may be NULL
+ * @f:		Filter applied by every scan, may be NULL
+ * @f_args:	User-specified argument to @f
+ *
+ * Return: New topology, or NULL with errno set otherwise.
+ */
+nvme_topology_t nvme_topology_create(FILE *fp, int log_level,
+				     const char *config_file,
+				     nvme_scan_filter_t f, void *f_args);
+
+/**
+ * nvme_topology_free() - Free a topology
+ * @t:		Topology
+ *
+ * The current generation is freed once it has been released by all its
+ * readers.
+ */
+void nvme_topology_free(nvme_topology_t t);
+
+/**
+ * nvme_topology_refresh() - Scan and publish a new generation
+ * @t:		Topology
+ *
+ * Scans the topology into a new tree on the calling thread and makes it
+ * the current generation. Concurrent refreshes are serialized. Readers
+ * which took the previous generation keep seeing it until they release
+ * it.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise, in which case
+ * the current generation is kept.
+ */
+int nvme_topology_refresh(nvme_topology_t t);
+
+/**
+ * nvme_topology_get() - Take the current generation
+ * @t:		Topology
+ *
+ * Return: Tree of the current generation, which stays valid and
+ * unchanged until it is passed to nvme_topology_put().
+ */
+nvme_root_t nvme_topology_get(nvme_topology_t t);
+
+/**
+ * nvme_topology_put() - Release a generation
+ * @r:		Tree returned by nvme_topology_get()
+ */
+void nvme_topology_put(nvme_root_t r);
+
+/**
+ * nvme_topology_get_generation() - Number of the current generation
+ * @t:		Topology
+ *
+ * Return: Number of generations published by @t so far, starting with
+ * 1 for the scan done by nvme_topology_create().
+ */
+__u64 nvme_topology_get_generation(nvme_topology_t t);
+
 /**
  * nvme_update_config() - Update JSON configuration
  * @r:	nvme_root_t object
@@ -1154,6 +1633,23 @@ int nvme_dump_tree(nvme_root_t r);
  */
 char *nvme_get_attr(const char *d, const char *attr);
 
+/**
+ * nvme_get_attrs() - Read several sysfs attributes of one directory
+ * @d:		sysfs directory
+ * @attrs:	Array of @nr sysfs attribute names
+ * @nr:		Number of attributes to read
+ * @values:	Array of @nr strings, set to the contents of each attribute
+ *		as returned by nvme_get_attr(), to be freed by the caller
+ *
+ * Opens @d once and reads all attributes relative to it, which is
+ * considerably cheaper than calling nvme_get_attr() for each of them.
+ * Attributes which do not exist are set to %NULL.
+ *
+ * Return: 0 on success, -1 with errno set if @d could not be opened.
+ */
+int nvme_get_attrs(const char *d, const char * const *attrs, int nr,
+		   char **values);
+
 /**
  * nvme_get_subsys_attr() - Read subsystem sysfs attribute
  * @s:		nvme_subsystem_t object
@@ -0,0 +1,858 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "private.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/mempolicy.h>
+
+/* fixed buffers are limited to 1GiB each by the kernel */
+#define NVME_BUF_POOL_MAX_SIZE		(1UL << 30)
+#define NVME_BUF_POOL_HUGEPAGE_SIZE	(2UL << 20)
+
+struct nvme_buf_pool {
+	struct nvme_uring *ring;
+	void *base;
+	size_t len;
+	size_t buf_size;
+	unsigned int nr_bufs;
+	unsigned int nr_free;
+	unsigned int *free;
+	bool *in_use;
+};
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+/*
+ * NVMe passthrough needs the big SQEs to carry the 80 bytes of
+ * struct nvme_uring_cmd, and the big CQEs to return the 64 bit result.
+ */
+#define NVME_URING_SETUP_FLAGS	(IORING_SETUP_SQE128 | IORING_SETUP_CQE32)
+
+struct nvme_uring_req {
+	nvme_uring_cb_t cb;
+	void *user_data;
+};
+
+struct nvme_uring {
+	int fd;
+	int event_fd;
+	unsigned int flags;
+	unsigned int depth;
+	unsigned int queued;	/* prepared, not handed to the kernel yet */
+	unsigned int submitted;	/* owned by the kernel, not reaped yet */
+	unsigned long completed;	/* reaped since creation */
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_local_tail;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+
+	void *cq_ring;
+	size_t cq_ring_sz;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct nvme_buf_pool *pool;	/* registered as fixed buffer 0 */
+
+	/* one slot per command in flight, SQE user_data is the index */
+	struct nvme_uring_req *reqs;
+	unsigned int *free_reqs;
+	unsigned int nr_free_reqs;
+};
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit,
+			  unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg,
+			     unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void nvme_uring_unmap(struct nvme_uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED &&
+	    ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_sz);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_sz);
+}
+
+static int nvme_uring_map(struct nvme_uring *ring, struct io_uring_params *p)
+{
+	unsigned int i;
+
+	ring->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(__u32);
+	/* CQE32: every completion entry takes two struct io_uring_cqe */
+	ring->cq_ring_sz = p->cq_off.cqes +
+		p->cq_entries * 2 * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_sz > ring->sq_ring_sz)
+			ring->sq_ring_sz = ring->cq_ring_sz;
+		ring->cq_ring_sz = ring->sq_ring_sz;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return -1;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_sz,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED)
+			return -1;
+	}
+
+	/* SQE128: every submission entry takes two struct io_uring_sqe */
+	ring->sqes_sz = p->sq_entries * 2 * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		return -1;
+
+	ring->sq_head = ring->sq_ring + p->sq_off.head;
+	ring->sq_tail = ring->sq_ring + p->sq_off.tail;
+	ring->sq_array = ring->sq_ring + p->sq_off.array;
+	ring->sq_mask = *(unsigned int *)(ring->sq_ring + p->sq_off.ring_mask);
+	ring->sq_local_tail = *ring->sq_tail;
+
+	ring->cq_head = ring->cq_ring + p->cq_off.head;
+	ring->cq_tail = ring->cq_ring + p->cq_off.tail;
+	ring->cq_mask = *(unsigned int *)(ring->cq_ring + p->cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + p->cq_off.cqes;
+
+	/* SQE slots are used in ring order, map them 1:1 once */
+	for (i = 0; i < p->sq_entries; i++)
+		ring->sq_array[i] = i;
+
+	return 0;
+}
+
+nvme_uring_t nvme_uring_create(unsigned int depth, unsigned int flags)
+{
+	struct io_uring_params p;
+	struct nvme_uring *ring;
+	int err;
+
+	if (!depth || (flags & ~NVME_URING_IOPOLL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ring = calloc(1, sizeof(*ring));
+	if (!ring) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.flags = NVME_URING_SETUP_FLAGS | IORING_SETUP_CLAMP;
+	if (flags & NVME_URING_IOPOLL)
+		p.flags |= IORING_SETUP_IOPOLL;
+	ring->fd = io_uring_setup(depth, &p);
+	if (ring->fd < 0) {
+		/* ENOSYS: no io_uring, EINVAL: no SQE128/CQE32 support */
+		if (errno == ENOSYS || errno == EINVAL)
+			errno = EOPNOTSUPP;
+		free(ring);
+		return NULL;
+	}
+
+	if (nvme_uring_map(ring, &p)) {
+		err = errno;
+		nvme_uring_unmap(ring);
+		close(ring->fd);
+		free(ring);
+		errno = err;
+		return NULL;
+	}
+
+	ring->flags = flags;
+	ring->event_fd = -1;
+	ring->depth = depth < p.sq_entries ? depth : p.sq_entries;
+
+	ring->reqs = calloc(ring->depth, sizeof(*ring->reqs));
+	ring->free_reqs = calloc(ring->depth, sizeof(*ring->free_reqs));
+	if (!ring->reqs || !ring->free_reqs) {
+		free(ring->reqs);
+		free(ring->free_reqs);
+		nvme_uring_unmap(ring);
+		close(ring->fd);
+		free(ring);
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (ring->nr_free_reqs = 0; ring->nr_free_reqs < ring->depth;
+	     ring->nr_free_reqs++)
+		ring->free_reqs[ring->nr_free_reqs] = ring->nr_free_reqs;
+
+	return ring;
+}
+
+static int __nvme_uring_reap(struct nvme_uring *ring,
+			     struct nvme_uring_completion *c,
+			     unsigned int nr, unsigned int wait_nr,
+			     bool dispatch);
+
+void nvme_uring_free(nvme_uring_t ring)
+{
+	struct nvme_uring_completion c[16];
+
+	if (!ring)
+		return;
+
+	/*
+	 * The kernel still references the data buffers of submitted
+	 * commands, don't return to the caller before they are done.
+	 */
+	while (ring->submitted) {
+		if (__nvme_uring_reap(ring, c, 16, 1, false) < 0 &&
+		    errno != EINTR)
+			break;
+	}
+
+	if (ring->pool)
+		ring->pool->ring = NULL;
+	if (ring->event_fd >= 0)
+		close(ring->event_fd);
+	nvme_uring_unmap(ring);
+	close(ring->fd);
+	free(ring->reqs);
+	free(ring->free_reqs);
+	free(ring);
+}
+
+static struct io_uring_sqe *nvme_uring_get_sqe(struct nvme_uring *ring,
+					       nvme_uring_cb_t cb,
+					       void *user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx, req;
+
+	if (ring->queued + ring->submitted >= ring->depth ||
+	    !ring->nr_free_reqs) {
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	req = ring->free_reqs[--ring->nr_free_reqs];
+	ring->reqs[req].cb = cb;
+	ring->reqs[req].user_data = user_data;
+
+	idx = ring->sq_local_tail & ring->sq_mask;
+	sqe = &ring->sqes[idx << 1];
+	memset(sqe, 0, 2 * sizeof(*sqe));
+	sqe->user_data = req;
+	ring->sq_local_tail++;
+	ring->queued++;
+
+	return sqe;
+}
+
+static int nvme_uring_queue_cmd(struct nvme_uring *ring, int fd, __u32 op,
+				struct nvme_passthru_cmd64 *cmd,
+				nvme_uring_cb_t cb, void *user_data)
+{
+	struct nvme_uring_cmd *ucmd;
+	struct io_uring_sqe *sqe;
+
+	sqe = nvme_uring_get_sqe(ring, cb, user_data);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_URING_CMD;
+	sqe->fd = fd;
+	sqe->cmd_op = op;
+
+#if HAVE_IORING_URING_CMD_FIXED
+	/* the fixed buffers are not used for vectored commands */
+	if (op != NVME_URING_CMD_IO_VEC && ring->pool &&
+	    nvme_buf_pool_owns(ring->pool,
+			(void *)(uintptr_t)cmd->addr, cmd->data_len)) {
+		sqe->uring_cmd_flags = IORING_URING_CMD_FIXED;
+		sqe->buf_index = 0;
+	}
+#endif
+
+	ucmd = (struct nvme_uring_cmd *)sqe->cmd;
+	ucmd->opcode = cmd->opcode;
+	ucmd->flags = cmd->flags;
+	ucmd->nsid = cmd->nsid;
+	ucmd->cdw2 = cmd->cdw2;
+	ucmd->cdw3 = cmd->cdw3;
+	ucmd->metadata = cmd->metadata;
+	ucmd->addr = cmd->addr;
+	ucmd->metadata_len = cmd->metadata_len;
+	ucmd->data_len = cmd->data_len;
+	ucmd->cdw10 = cmd->cdw10;
+	ucmd->cdw11 = cmd->cdw11;
+	ucmd->cdw12 = cmd->cdw12;
+	ucmd->cdw13 = cmd->cdw13;
+	ucmd->cdw14 = cmd->cdw14;
+	ucmd->cdw15 = cmd->cdw15;
+	ucmd->timeout_ms = cmd->timeout_ms;
+
+	return 0;
+}
+
+int nvme_uring_queue_io_passthru64(nvme_uring_t ring, int fd,
+				   struct nvme_passthru_cmd64 *cmd,
+				   void *user_data)
+{
+	return nvme_uring_queue_cmd(ring, fd, NVME_URING_CMD_IO, cmd,
+				    NULL, user_data);
+}
+
+int nvme_uring_queue_io_passthru64_vec(struct nvme_uring *ring, int fd,
+				       struct nvme_passthru_cmd64 *cmd,
+				       void *user_data)
+{
+	return nvme_uring_queue_cmd(ring, fd, NVME_URING_CMD_IO_VEC, cmd,
+				    NULL, user_data);
+}
+
+int nvme_uring_queue_admin_passthru64(nvme_uring_t ring, int fd,
+				      struct nvme_passthru_cmd64 *cmd,
+				      void *user_data)
+{
+	return nvme_uring_queue_cmd(ring, fd, NVME_URING_CMD_ADMIN, cmd,
+				    NULL, user_data);
+}
+
+static int __nvme_uring_queue_io(struct nvme_uring *ring,
+				 struct nvme_io_args *args, __u8 opcode,
+				 nvme_uring_cb_t cb, void *user_data)
+{
+	struct nvme_passthru_cmd cmd;
+	struct nvme_passthru_cmd64 cmd64;
+
+	if (nvme_io_init_cmd(args, opcode, &cmd))
+		return -1;
+	nvme_passthru_cmd_to_64(&cmd, &cmd64);
+
+	return nvme_uring_queue_cmd(ring, args->fd, NVME_URING_CMD_IO, &cmd64,
+				    cb, user_data);
+}
+
+int nvme_uring_queue_io(nvme_uring_t ring, struct nvme_io_args *args,
+			__u8 opcode, void *user_data)
+{
+	return __nvme_uring_queue_io(ring, args, opcode, NULL, user_data);
+}
+
+int nvme_io_async(nvme_uring_t ring, struct nvme_io_args *args, __u8 opcode,
+		  nvme_uring_cb_t cb, void *user_data)
+{
+	if (!cb) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (__nvme_uring_queue_io(ring, args, opcode, cb, user_data))
+		return -1;
+
+	/* a failed submit leaves the command queued for the next one */
+	if (nvme_uring_submit(ring) < 0 && errno != EAGAIN &&
+	    errno != EBUSY)
+		return -1;
+	return 0;
+}
+
+int nvme_uring_submit(nvme_uring_t ring)
+{
+	int ret;
+
+	if (!ring->queued)
+		return 0;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+	do {
+		ret = io_uring_enter(ring->fd, ring->queued, 0, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+
+	ring->queued -= ret;
+	ring->submitted += ret;
+	return ret;
+}
+
+/*
+ * Completions of commands with a callback are handed to the callback
+ * (unless the ring is being torn down) and don't take a slot in @c,
+ * the others are dropped if @c is NULL. Both kinds count towards
+ * @wait_nr.
+ */
+static int __nvme_uring_reap(struct nvme_uring *ring,
+			     struct nvme_uring_completion *c,
+			     unsigned int nr, unsigned int wait_nr,
+			     bool dispatch)
+{
+	unsigned int head, tail, min_complete, n = 0, done = 0;
+	struct nvme_uring_completion comp;
+	struct nvme_uring_req *req;
+	struct io_uring_cqe *cqe;
+	bool polled = false;
+	int ret;
+
+	if (wait_nr > ring->submitted)
+		wait_nr = ring->submitted;
+
+	for (;;) {
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		while (head != tail && (!c || n < nr)) {
+			cqe = &ring->cqes[(head & ring->cq_mask) << 1];
+			req = &ring->reqs[cqe->user_data];
+
+			comp.user_data = req->user_data;
+			comp.status = cqe->res;
+			comp.result = cqe->big_cqe[0];
+			head++;
+			__atomic_store_n(ring->cq_head, head,
+					 __ATOMIC_RELEASE);
+
+			ring->free_reqs[ring->nr_free_reqs++] = cqe->user_data;
+			ring->submitted--;
+			ring->completed++;
+			done++;
+
+			if (!req->cb) {
+				if (c)
+					c[n++] = comp;
+			} else if (dispatch) {
+				req->cb(&comp);
+			}
+
+			/* the callback may have queued and reaped more */
+			tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+			head = *ring->cq_head;
+		}
+
+		/*
+		 * Polled rings don't post completions by themselves, they
+		 * have to be reaped from the device once even when the
+		 * caller doesn't want to wait.
+		 */
+		if (done >= wait_nr || (c && n >= nr)) {
+			if (done || polled || !ring->submitted ||
+			    !(ring->flags & NVME_URING_IOPOLL))
+				break;
+		}
+
+		min_complete = done < wait_nr ? wait_nr - done : 0;
+		polled = true;
+		ret = io_uring_enter(ring->fd, 0, min_complete,
+				     IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR) {
+			if (done)
+				break;
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+int nvme_uring_reap(nvme_uring_t ring, struct nvme_uring_completion *c,
+		    unsigned int nr, unsigned int wait_nr)
+{
+	return __nvme_uring_reap(ring, c, nr, wait_nr, true);
+}
+
+int nvme_uring_process_completions(nvme_uring_t ring, unsigned int wait_nr)
+{
+	unsigned long before = ring->completed;
+	eventfd_t cnt;
+
+	/* rearm the event fd before looking at the completion queue */
+	if (ring->event_fd >= 0)
+		eventfd_read(ring->event_fd, &cnt);
+
+	if (__nvme_uring_reap(ring, NULL, 0, wait_nr, true) < 0)
+		return -1;
+
+	return ring->completed - before;
+}
+
+int nvme_uring_get_event_fd(nvme_uring_t ring)
+{
+	int fd;
+
+	if (ring->event_fd >= 0)
+		return ring->event_fd;
+
+	fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (fd < 0)
+		return -1;
+
+	if (io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &fd, 1)) {
+		close(fd);
+		return -1;
+	}
+
+	ring->event_fd = fd;
+	return fd;
+}
+
+unsigned int nvme_uring_inflight(nvme_uring_t ring)
+{
+	return ring->queued + ring->submitted;
+}
+
+static int nvme_uring_register_pool(struct nvme_uring *ring,
+				    struct nvme_buf_pool *pool)
+{
+	struct iovec iov = {
+		.iov_base = pool->base,
+		.iov_len = pool->len,
+	};
+
+	if (ring->pool) {
+		errno = EBUSY;
+		return -1;
+	}
+	/* without fixed buffer commands the registration is of no use */
+	if (!HAVE_IORING_URING_CMD_FIXED) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1))
+		return -1;
+
+	ring->pool = pool;
+	return 0;
+}
+
+static void nvme_uring_unregister_pool(struct nvme_uring *ring)
+{
+	io_uring_register(ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+	ring->pool = NULL;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+nvme_uring_t nvme_uring_create(unsigned int depth, unsigned int flags)
+{
+	errno = EOPNOTSUPP;
+	return NULL;
+}
+
+void nvme_uring_free(nvme_uring_t ring)
+{
+}
+
+int nvme_uring_queue_io(nvme_uring_t ring, struct nvme_io_args *args,
+			__u8 opcode, void *user_data)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_uring_queue_io_passthru64(nvme_uring_t ring, int fd,
+				   struct nvme_passthru_cmd64 *cmd,
+				   void *user_data)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_uring_queue_io_passthru64_vec(struct nvme_uring *ring, int fd,
+				       struct nvme_passthru_cmd64 *cmd,
+				       void *user_data)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_uring_queue_admin_passthru64(nvme_uring_t ring, int fd,
+				      struct nvme_passthru_cmd64 *cmd,
+				      void *user_data)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_uring_submit(nvme_uring_t ring)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_uring_reap(nvme_uring_t ring, struct nvme_uring_completion *c,
+		    unsigned int nr, unsigned int wait_nr)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+unsigned int nvme_uring_inflight(nvme_uring_t ring)
+{
+	return 0;
+}
+
+int nvme_io_async(nvme_uring_t ring, struct nvme_io_args *args, __u8 opcode,
+		  nvme_uring_cb_t cb, void *user_data)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_uring_process_completions(nvme_uring_t ring, unsigned int wait_nr)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+int nvme_uring_get_event_fd(nvme_uring_t ring)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static int nvme_uring_register_pool(struct nvme_uring *ring,
+				    struct nvme_buf_pool *pool)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+static void nvme_uring_unregister_pool(struct nvme_uring *ring)
+{
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+/* a preference only, so failures such as a kernel without NUMA are fine */
+static void nvme_buf_pool_bind(void *p, size_t len, int node)
+{
+	const size_t bits = 8 * sizeof(unsigned long);
+	unsigned long *nodes;
+	size_t nr = node / bits + 1;
+
+	nodes = calloc(nr, sizeof(*nodes));
+	if (!nodes)
+		return;
+	nodes[node / bits] = 1UL << (node % bits);
+	/* the kernel ignores the last bit of maxnode */
+	syscall(SYS_mbind, p, len, MPOL_PREFERRED, nodes, nr * bits + 1, 0);
+	free(nodes);
+}
+
+static void *nvme_buf_pool_map(size_t len, bool hugepage, int node)
+{
+	void *p;
+
+	/* the pages are only allocated on first touch, after the binding */
+	if (hugepage) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			if (node >= 0)
+				nvme_buf_pool_bind(p, len, node);
+			return p;
+		}
+	}
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	/* no huge pages reserved, ask for transparent ones instead */
+	if (hugepage)
+		madvise(p, len, MADV_HUGEPAGE);
+	if (node >= 0)
+		nvme_buf_pool_bind(p, len, node);
+	return p;
+}
+
+nvme_buf_pool_t nvme_buf_pool_create(nvme_uring_t ring, size_t buf_size,
+				     unsigned int nr_bufs, unsigned int flags)
+{
+	return nvme_buf_pool_create_on_node(ring, buf_size, nr_bufs, flags, -1);
+}
+
+nvme_buf_pool_t nvme_buf_pool_create_on_node(nvme_uring_t ring,
+					     size_t buf_size,
+					     unsigned int nr_bufs,
+					     unsigned int flags, int node)
+{
+	size_t align = sysconf(_SC_PAGESIZE);
+	bool hugepage = flags & NVME_BUF_POOL_HUGEPAGE;
+	struct nvme_buf_pool *pool;
+	unsigned int i;
+
+	if (!buf_size || !nr_bufs || (flags & ~NVME_BUF_POOL_HUGEPAGE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pool->buf_size = (buf_size + align - 1) & ~(align - 1);
+	pool->nr_bufs = nr_bufs;
+	pool->len = pool->buf_size * nr_bufs;
+	if (hugepage)
+		pool->len = (pool->len + NVME_BUF_POOL_HUGEPAGE_SIZE - 1) &
+			~(size_t)(NVME_BUF_POOL_HUGEPAGE_SIZE - 1);
+	if (pool->len > NVME_BUF_POOL_MAX_SIZE) {
+		free(pool);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	pool->free = calloc(nr_bufs, sizeof(*pool->free));
+	if (!pool->free)
+		goto free_pool;
+	pool->in_use = calloc(nr_bufs, sizeof(*pool->in_use));
+	if (!pool->in_use)
+		goto free_list;
+
+	pool->base = nvme_buf_pool_map(pool->len, hugepage, node);
+	if (!pool->base)
+		goto free_list;
+
+	for (i = 0; i < nr_bufs; i++)
+		pool->free[i] = nr_bufs - i - 1;
+	pool->nr_free = nr_bufs;
+
+	/*
+	 * Without registration the buffers still work, commands just take
+	 * the regular pin-and-map path in the kernel.
+	 */
+	nvme_buf_pool_set_ring(pool, ring);
+
+	return pool;
+
+free_list:
+	free(pool->in_use);
+	free(pool->free);
+free_pool:
+	free(pool);
+	errno = ENOMEM;
+	return NULL;
+}
+
+int nvme_buf_pool_set_ring(struct nvme_buf_pool *pool, struct nvme_uring *ring)
+{
+	if (pool->ring)
+		nvme_uring_unregister_pool(pool->ring);
+	pool->ring = NULL;
+
+	if (!ring)
+		return 0;
+	if (nvme_uring_register_pool(ring, pool))
+		return -1;
+
+	pool->ring = ring;
+	return 0;
+}
+
+void nvme_buf_pool_free(nvme_buf_pool_t pool)
+{
+	if (!pool)
+		return;
+
+	if (pool->ring)
+		nvme_uring_unregister_pool(pool->ring);
+	munmap(pool->base, pool->len);
+	free(pool->in_use);
+	free(pool->free);
+	free(pool);
+}
+
+void *nvme_buf_pool_get(nvme_buf_pool_t pool)
+{
+	unsigned int i;
+
+	if (!pool->nr_free) {
+		errno = ENOBUFS;
+		return NULL;
+	}
+
+	i = pool->free[--pool->nr_free];
+	pool->in_use[i] = true;
+	return pool->base + i * pool->buf_size;
+}
+
+int nvme_buf_pool_put(nvme_buf_pool_t pool, void *buf)
+{
+	size_t off;
+	unsigned int i;
+
+	if (!buf || !nvme_buf_pool_owns(pool, buf, 0)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* a double put would hand the buffer out twice */
+	off = buf - pool->base;
+	i = off / pool->buf_size;
+	if (off % pool->buf_size || i >= pool->nr_bufs || !pool->in_use[i]) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pool->in_use[i] = false;
+	pool->free[pool->nr_free++] = i;
+	return 0;
+}
+
+bool nvme_buf_pool_owns(nvme_buf_pool_t pool, void *buf, size_t len)
+{
+	if (!pool || buf < pool->base || buf >= pool->base + pool->len)
+		return false;
+
+	return len <= pool->len - (size_t)(buf - pool->base);
+}
+
+size_t nvme_buf_pool_get_buf_size(nvme_buf_pool_t pool)
+{
+	return pool->buf_size;
+}
@@ -0,0 +1,363 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_URING_H
+#define _LIBNVME_URING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ioctl.h"
+
+/**
+ * DOC: uring.h
+ *
+ * io_uring passthrough submission
+ *
+ * The ioctl based submission helpers in ioctl.h block the calling thread
+ * until the command completes, so a thread can never have more than one
+ * command outstanding. The functions here send the same commands through
+ * IORING_OP_URING_CMD instead, which allows many commands to be in flight
+ * at once on a single thread.
+ *
+ * Commands have to be issued against a character device: the generic
+ * namespace devices (/dev/ngXnY, see nvme_ns_get_generic_fd()) for I/O
+ * commands, and the controller devices (/dev/nvmeX) for admin commands.
+ * Block devices are rejected by the kernel.
+ *
+ * A ring is not thread safe; use one ring per submitting thread.
+ */
+
+/**
+ * typedef nvme_uring_t - io_uring submission context
+ */
+typedef struct nvme_uring * nvme_uring_t;
+
+/**
+ * struct nvme_uring_completion - Completion of a queued command
+ * @user_data:	The @user_data value given when the command was queued
+ * @result:	Command specific result (completion queue entry dword 0/1)
+ * @status:	0 on success, the nvme command status if a response was
+ *		received (see &enum nvme_status_field) or a negative errno
+ *		value if the command could not be issued
+ */
+struct nvme_uring_completion {
+	void *user_data;
+	__u64 result;
+	int status;
+};
+
+/**
+ * typedef nvme_uring_cb_t - Completion callback of an asynchronous command
+ * @c:		Completion of the command, only valid during the call
+ *
+ * Callbacks run from within nvme_uring_reap() or
+ * nvme_uring_process_completions(). They may queue new commands on the
+ * ring but must not reap completions themselves.
+ */
+typedef void (*nvme_uring_cb_t)(struct nvme_uring_completion *c);
+
+/**
+ * enum nvme_uring_flags - io_uring submission context flags
+ * @NVME_URING_IOPOLL:	Poll for completions instead of waiting for an
+ *			interrupt (IORING_SETUP_IOPOLL). This saves the
+ *			interrupt and context switch per command at the cost
+ *			of spinning in nvme_uring_reap(). The driver needs
+ *			poll queues (the nvme poll_queues module parameter)
+ *			to benefit from it.
+ */
+enum nvme_uring_flags {
+	NVME_URING_IOPOLL	= 1 << 0,
+};
+
+/**
+ * nvme_uring_create() - Create an io_uring submission context
+ * @depth:	Maximum number of commands in flight at once
+ * @flags:	Context flags, see &enum nvme_uring_flags
+ *
+ * Return: The new context, or NULL with errno set otherwise. errno is set
+ * to EOPNOTSUPP when the library or the running kernel lack support for
+ * NVMe io_uring passthrough.
+ */
+nvme_uring_t nvme_uring_create(unsigned int depth, unsigned int flags);
+
+/**
+ * nvme_uring_free() - Free an io_uring submission context
+ * @ring:	Context to free
+ *
+ * Commands which are still in flight are waited for before the ring
+ * is torn down, their completions are discarded.
+ */
+void nvme_uring_free(nvme_uring_t ring);
+
+/**
+ * nvme_uring_queue_io() - Queue an nvme user I/O command
+ * @ring:	Submission context
+ * @args:	&struct nvme_io_args argument structure; @args->fd has to be
+ *		a generic namespace character device
+ * @opcode:	Opcode to execute
+ * @user_data:	Value reported back in &struct nvme_uring_completion
+ *
+ * The command is only prepared; it is handed to the kernel by the next
+ * nvme_uring_submit(). @args itself may be reused once this returns, but
+ * the data and metadata buffers have to stay valid until the command
+ * completes. @args->result is not written, the result is reported in
+ * &struct nvme_uring_completion instead.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise. errno is set to
+ * EAGAIN if @ring already holds its maximum number of commands.
+ */
+int nvme_uring_queue_io(nvme_uring_t ring, struct nvme_io_args *args,
+			__u8 opcode, void *user_data);
+
+/**
+ * nvme_uring_queue_io_passthru64() - Queue an nvme I/O passthrough command
+ * @ring:	Submission context
+ * @fd:		File descriptor of a generic namespace character device
+ * @cmd:	The nvme I/O command to send
+ * @user_data:	Value reported back in &struct nvme_uring_completion
+ *
+ * See nvme_uring_queue_io() for the buffer lifetime rules. The result
+ * field of @cmd is not written.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_uring_queue_io_passthru64(nvme_uring_t ring, int fd,
+				   struct nvme_passthru_cmd64 *cmd,
+				   void *user_data);
+
+/**
+ * nvme_uring_queue_admin_passthru64() - Queue an nvme admin passthrough command
+ * @ring:	Submission context
+ * @fd:		File descriptor of a controller character device
+ * @cmd:	The nvme admin command to send
+ * @user_data:	Value reported back in &struct nvme_uring_completion
+ *
+ * See nvme_uring_queue_io() for the buffer lifetime rules. The result
+ * field of @cmd is not written.
+ *
+ * Return: 0 on success, or -1 with errno set otherwise.
+ */
+int nvme_uring_queue_admin_passthru64(nvme_uring_t ring, int fd,
+				      struct nvme_passthru_cmd64 *cmd,
+				      void *user_data);
+
+/**
+ * nvme_uring_submit() - Hand all queued commands to the kernel
+ * @ring:	Submission context
+ *
+ * Return: The number of commands submitted, or -1 with errno set
+ * otherwise.
+ */
+int nvme_uring_submit(nvme_uring_t ring);
+
+/**
+ * nvme_uring_reap() - Collect completed commands
+ * @ring:	Submission context
+ * @c:		Array to store the completions in
+ * @nr:		Number of entries in @c
+ * @wait_nr:	Minimum number of completions to wait for
+ *
+ * Reaps up to @nr completions, blocking until at least @wait_nr of them
+ * are available. With @wait_nr set to 0 this never blocks. On a ring
+ * created with %NVME_URING_IOPOLL, waiting busy-polls the device.
+ *
+ * Completions of commands sent with nvme_io_async() are passed to their
+ * callback instead of being stored in @c, they do count towards @wait_nr.
+ *
+ * Return: The number of completions stored in @c, or -1 with errno set
+ * otherwise.
+ */
+int nvme_uring_reap(nvme_uring_t ring, struct nvme_uring_completion *c,
+		    unsigned int nr, unsigned int wait_nr);
+
+/**
+ * nvme_uring_inflight() - Number of commands not yet reaped
+ * @ring:	Submission context
+ *
+ * Return: The number of commands which have been queued or submitted and
+ * whose completion has not been reaped yet.
+ */
+unsigned int nvme_uring_inflight(nvme_uring_t ring);
+
+/**
+ * nvme_io_async() - Send an nvme user I/O command without waiting for it
+ * @ring:	Submission context
+ * @args:	&struct nvme_io_args argument structure; @args->fd has to be
+ *		a generic namespace character device
+ * @opcode:	Opcode to execute
+ * @cb:		Callback invoked with the completion of the command
+ * @user_data:	Value passed to @cb in &struct nvme_uring_completion
+ *
+ * Non-blocking counterpart of nvme_io(): queues the command and submits it
+ * right away. @cb is called from nvme_uring_process_completions() once the
+ * command has completed. The buffer lifetime rules of nvme_uring_queue_io()
+ * apply.
+ *
+ * Return: 0 if the command was queued, or -1 with errno set otherwise, in
+ * which case @cb is never called.
+ */
+int nvme_io_async(nvme_uring_t ring, struct nvme_io_args *args, __u8 opcode,
+		  nvme_uring_cb_t cb, void *user_data);
+
+/**
+ * nvme_read_async() - Send an nvme user read command without waiting for it
+ * @ring:	Submission context
+ * @args:	&struct nvme_io_args argument structure
+ * @cb:		Callback invoked with the completion of the command
+ * @user_data:	Value passed to @cb in &struct nvme_uring_completion
+ *
+ * Return: 0 if the command was queued, or -1 with errno set otherwise.
+ */
+static inline int nvme_read_async(nvme_uring_t ring, struct nvme_io_args *args,
+				  nvme_uring_cb_t cb, void *user_data)
+{
+	return nvme_io_async(ring, args, nvme_cmd_read, cb, user_data);
+}
+
+/**
+ * nvme_write_async() - Send an nvme user write command without waiting for it
+ * @ring:	Submission context
+ * @args:	&struct nvme_io_args argument structure
+ * @cb:		Callback invoked with the completion of the command
+ * @user_data:	Value passed to @cb in &struct nvme_uring_completion
+ *
+ * Return: 0 if the command was queued, or -1 with errno set otherwise.
+ */
+static inline int nvme_write_async(nvme_uring_t ring, struct nvme_io_args *args,
+				   nvme_uring_cb_t cb, void *user_data)
+{
+	return nvme_io_async(ring, args, nvme_cmd_write, cb, user_data);
+}
+
+/**
+ * nvme_uring_get_event_fd() - Pollable file descriptor for completions
+ * @ring:	Submission context
+ *
+ * Returns an eventfd which becomes readable whenever commands on @ring
+ * complete, for use with poll(), epoll or an event loop. Call
+ * nvme_uring_process_completions() when it is readable. The fd is owned
+ * by @ring and closed by nvme_uring_free().
+ *
+ * Return: The event file descriptor, or -1 with errno set otherwise.
+ */
+int nvme_uring_get_event_fd(nvme_uring_t ring);
+
+/**
+ * nvme_uring_process_completions() - Run callbacks of completed commands
+ * @ring:	Submission context
+ * @wait_nr:	Minimum number of completions to wait for, 0 to not block
+ *
+ * Reaps all available completions and invokes their callbacks. Completions
+ * of commands queued without a callback are discarded, so rings driven
+ * this way should only be used with nvme_io_async().
+ *
+ * Return: The number of completions processed, or -1 with errno set
+ * otherwise.
+ */
+int nvme_uring_process_completions(nvme_uring_t ring, unsigned int wait_nr);
+
+/**
+ * typedef nvme_buf_pool_t - Pool of page aligned I/O buffers
+ */
+typedef struct nvme_buf_pool * nvme_buf_pool_t;
+
+/**
+ * enum nvme_buf_pool_flags - Buffer pool creation flags
+ * @NVME_BUF_POOL_HUGEPAGE:	Back the pool with huge pages. Reserved huge
+ *				pages are used if available, transparent huge
+ *				pages are requested otherwise.
+ */
+enum nvme_buf_pool_flags {
+	NVME_BUF_POOL_HUGEPAGE	= 1 << 0,
+};
+
+/**
+ * nvme_buf_pool_create() - Create a pool of I/O buffers
+ * @ring:	Submission context to register the pool with, or NULL
+ * @buf_size:	Size of each buffer, rounded up to the page size
+ * @nr_bufs:	Number of buffers in the pool
+ * @flags:	Creation flags, see &enum nvme_buf_pool_flags
+ *
+ * The buffers are carved out of a single memory region which is registered
+ * with @ring as a fixed buffer. Commands queued on @ring whose data buffer
+ * lies within the pool then skip the per-command page pinning and mapping
+ * in the kernel. A ring holds at most one pool. If registration fails the
+ * pool is still usable, just without that fast path.
+ *
+ * The pool has to be freed before, or together with, its ring; the
+ * total pool size is limited to 1GiB.
+ *
+ * Return: The new pool, or NULL with errno set otherwise.
+ */
+nvme_buf_pool_t nvme_buf_pool_create(nvme_uring_t ring, size_t buf_size,
+				     unsigned int nr_bufs, unsigned int flags);
+
+/**
+ * nvme_buf_pool_create_on_node() - Create a pool of I/O buffers on a NUMA node
+ * @ring:	Submission context to register the pool with, or NULL
+ * @buf_size:	Size of each buffer, rounded up to the page size
+ * @nr_bufs:	Number of buffers in the pool
+ * @flags:	Creation flags, see &enum nvme_buf_pool_flags
+ * @node:	NUMA node to allocate the memory on, or -1 for the default
+ *		policy of the calling thread
+ *
+ * Like nvme_buf_pool_create(), with the memory preferably placed on
+ * @node, such as that of nvme_ctrl_get_numa_node_id(), so the controller
+ * does not DMA across sockets. Pages come from other nodes if @node runs
+ * out of memory.
+ *
+ * Return: The new pool, or NULL with errno set otherwise.
+ */
+nvme_buf_pool_t nvme_buf_pool_create_on_node(nvme_uring_t ring,
+					     size_t buf_size,
+					     unsigned int nr_bufs,
+					     unsigned int flags, int node);
+
+/**
+ * nvme_buf_pool_free() - Free a buffer pool
+ * @pool:	Pool to free
+ *
+ * No command using one of the pool's buffers may be in flight.
+ */
+void nvme_buf_pool_free(nvme_buf_pool_t pool);
+
+/**
+ * nvme_buf_pool_get() - Take a buffer from a pool
+ * @pool:	Buffer pool
+ *
+ * Return: A page aligned buffer of nvme_buf_pool_get_buf_size() bytes, or
+ * NULL with errno set to ENOBUFS if all buffers are in use.
+ */
+void *nvme_buf_pool_get(nvme_buf_pool_t pool);
+
+/**
+ * nvme_buf_pool_put() - Return a buffer to its pool
+ * @pool:	Buffer pool
+ * @buf:	Buffer obtained from nvme_buf_pool_get()
+ *
+ * Return: 0 on success, or -1 with errno set to EINVAL if @buf is not a
+ * buffer of @pool or has already been returned.
+ */
+int nvme_buf_pool_put(nvme_buf_pool_t pool, void *buf);
+
+/**
+ * nvme_buf_pool_owns() - Check whether memory belongs to a pool
+ * @pool:	Buffer pool, may be NULL
+ * @buf:	Start of the memory range
+ * @len:	Length of the memory range
+ *
+ * Return: true if the whole range lies within the pool's memory region.
+ */
+bool nvme_buf_pool_owns(nvme_buf_pool_t pool, void *buf, size_t len);
+
+/**
+ * nvme_buf_pool_get_buf_size() - Size of the buffers in a pool
+ * @pool:	Buffer pool
+ *
+ * Return: The size in bytes of each buffer handed out by @pool.
+ */
+size_t nvme_buf_pool_get_buf_size(nvme_buf_pool_t pool);
+
+#endif /* _LIBNVME_URING_H */
@@ -8,8 +8,13 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <strings.h>
+#include <time.h>
 
 #include <sys/param.h>
 #include <sys/types.h>
@@ -555,20 +560,149 @@ const char *nvme_errno_to_string(int status)
 	return s;
 }
 
-char *hostname2traddr(struct nvme_root *r, const char *traddr)
+/* failures are retried sooner, they may be caused by a network outage */
+#define NVME_RESOLVER_FAILED_TTL	5
+/* the least recently resolved hostnames are dropped beyond this many */
+#define NVME_RESOLVER_CACHE_MAX		1024
+#define NVME_RESOLVER_DEFAULT_PARALLEL	16
+
+struct nvme_resolved_host {
+	struct list_node entry;
+	struct nvme_hnode hnode;
+	time_t expires;
+	char *traddr;
+	char hostname[];
+};
+
+struct nvme_resolver_cache {
+	struct list_head hosts;
+	struct nvme_htable index;
+	unsigned int nr_hosts;
+};
+
+static time_t nvme_resolver_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+static void nvme_resolved_host_free(struct nvme_resolver_cache *cache,
+				    struct nvme_resolved_host *rh)
+{
+	list_del(&rh->entry);
+	nvme_htable_del(&cache->index, &rh->hnode);
+	cache->nr_hosts--;
+	free(rh->traddr);
+	free(rh);
+}
+
+void nvme_resolver_cache_free(struct nvme_resolver_cache *cache)
+{
+	struct nvme_resolved_host *rh, *_rh;
+
+	if (!cache)
+		return;
+	list_for_each_safe(&cache->hosts, rh, _rh, entry) {
+		list_del(&rh->entry);
+		free(rh->traddr);
+		free(rh);
+	}
+	nvme_htable_free(&cache->index);
+	free(cache);
+}
+
+static struct nvme_resolved_host *nvme_resolver_lookup(struct nvme_root *r,
+						       const char *hostname)
+{
+	struct nvme_resolver_cache *cache = r ? r->resolver_cache : NULL;
+	unsigned int hash = nvme_hash_str(0, hostname, true);
+	struct nvme_resolved_host *rh;
+	struct nvme_hnode *node;
+
+	if (!cache)
+		return NULL;
+
+	for (node = nvme_htable_first(&cache->index, hash); node;
+	     node = node->next) {
+		if (node->hash != hash)
+			continue;
+		rh = container_of(node, struct nvme_resolved_host, hnode);
+		if (strcasecmp(rh->hostname, hostname))
+			continue;
+		if (rh->expires > nvme_resolver_now())
+			return rh;
+		nvme_resolved_host_free(cache, rh);
+		return NULL;
+	}
+	return NULL;
+}
+
+/* takes ownership of @traddr, which is NULL if @hostname failed to resolve */
+static void nvme_resolver_add(struct nvme_root *r, const char *hostname,
+			      char *traddr)
+{
+	struct nvme_resolver_cache *cache;
+	struct nvme_resolved_host *rh;
+	size_t len = strlen(hostname) + 1;
+	unsigned int ttl;
+
+	if (!r || !r->resolver_ttl)
+		goto free;
+
+	cache = r->resolver_cache;
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (!cache)
+			goto free;
+		list_head_init(&cache->hosts);
+		r->resolver_cache = cache;
+	}
+
+	rh = nvme_resolver_lookup(r, hostname);
+	if (rh)
+		nvme_resolved_host_free(cache, rh);
+	if (cache->nr_hosts >= NVME_RESOLVER_CACHE_MAX)
+		nvme_resolved_host_free(cache,
+			list_tail(&cache->hosts, struct nvme_resolved_host,
+				  entry));
+
+	/* a failed allocation only means the hostname is resolved again */
+	rh = calloc(1, sizeof(*rh) + len);
+	if (!rh)
+		goto free;
+	ttl = r->resolver_ttl;
+	if (!traddr && ttl > NVME_RESOLVER_FAILED_TTL)
+		ttl = NVME_RESOLVER_FAILED_TTL;
+	rh->expires = nvme_resolver_now() + ttl;
+	rh->traddr = traddr;
+	memcpy(rh->hostname, hostname, len);
+	list_add(&cache->hosts, &rh->entry);
+	nvme_htable_add(&cache->index, &rh->hnode,
+			nvme_hash_str(0, hostname, true));
+	cache->nr_hosts++;
+	return;
+free:
+	free(traddr);
+}
+
+/*
+ * Resolves @hostname to the string form of its first address. Safe to
+ * call concurrently, as it neither logs nor touches the cache; returns
+ * NULL with *@err set to the getaddrinfo() error, or to EAI_FAMILY or
+ * EAI_SYSTEM if the address could not be converted.
+ */
+static char *nvme_resolve_hostname(const char *hostname, int *err)
 {
 	struct addrinfo *host_info, hints = {.ai_family = AF_UNSPEC};
 	char addrstr[NVMF_TRADDR_SIZE];
 	const char *p;
 	char *ret_traddr = NULL;
-	int ret;
 
-	ret = getaddrinfo(traddr, NULL, &hints, &host_info);
-	if (ret) {
-		nvme_msg(r, LOG_ERR, "failed to resolve host %s info\n",
-			 traddr);
+	*err = getaddrinfo(hostname, NULL, &hints, &host_info);
+	if (*err)
 		return NULL;
-	}
 
 	switch (host_info->ai_family) {
 	case AF_INET:
@@ -582,23 +716,138 @@ char *hostname2traddr(struct nvme_root *r, const char *traddr)
 			addrstr, NVMF_TRADDR_SIZE);
 		break;
 	default:
-		nvme_msg(r, LOG_ERR, "unrecognized address family (%d) %s\n",
-			 host_info->ai_family, traddr);
+		*err = EAI_FAMILY;
 		goto free_addrinfo;
 	}
 
 	if (!p) {
-		nvme_msg(r, LOG_ERR, "failed to get traddr for %s\n",
-			 traddr);
+		*err = EAI_SYSTEM;
 		goto free_addrinfo;
 	}
 	ret_traddr = strdup(addrstr);
+	if (!ret_traddr)
+		*err = EAI_MEMORY;
 
 free_addrinfo:
 	freeaddrinfo(host_info);
 	return ret_traddr;
 }
 
+static void nvme_resolve_msg(struct nvme_root *r, const char *hostname,
+			     int err)
+{
+	switch (err) {
+	case EAI_FAMILY:
+		nvme_msg(r, LOG_ERR, "unrecognized address family %s\n",
+			 hostname);
+		break;
+	case EAI_SYSTEM:
+		nvme_msg(r, LOG_ERR, "failed to get traddr for %s\n",
+			 hostname);
+		break;
+	default:
+		nvme_msg(r, LOG_ERR, "failed to resolve host %s info\n",
+			 hostname);
+		break;
+	}
+}
+
+char *hostname2traddr(struct nvme_root *r, const char *traddr)
+{
+	struct nvme_resolved_host *rh;
+	char *ret_traddr;
+	int err;
+
+	rh = nvme_resolver_lookup(r, traddr);
+	if (rh) {
+		if (!rh->traddr) {
+			nvme_msg(r, LOG_ERR, "failed to resolve host %s info\n",
+				 traddr);
+			return NULL;
+		}
+		return strdup(rh->traddr);
+	}
+
+	ret_traddr = nvme_resolve_hostname(traddr, &err);
+	if (ret_traddr) {
+		char *cached = strdup(ret_traddr);
+
+		if (cached)
+			nvme_resolver_add(r, traddr, cached);
+	} else {
+		nvme_resolve_msg(r, traddr, err);
+		if (err != EAI_MEMORY)
+			nvme_resolver_add(r, traddr, NULL);
+	}
+	return ret_traddr;
+}
+
+struct nvme_resolve_work {
+	const char **hostnames;
+	char **traddrs;
+	int *errs;
+};
+
+static void nvme_resolve_one(unsigned int idx, void *arg)
+{
+	struct nvme_resolve_work *w = arg;
+
+	w->traddrs[idx] = nvme_resolve_hostname(w->hostnames[idx],
+						&w->errs[idx]);
+}
+
+int nvme_resolve_hostnames(nvme_root_t r, const char * const *hostnames,
+			   unsigned int nr, unsigned int max_parallel)
+{
+	struct nvme_resolve_work w = { };
+	unsigned int i, j, n = 0;
+	int resolved = 0;
+
+	if (!r->resolver_ttl || !nr)
+		return 0;
+
+	w.hostnames = calloc(nr, sizeof(*w.hostnames));
+	w.traddrs = calloc(nr, sizeof(*w.traddrs));
+	w.errs = calloc(nr, sizeof(*w.errs));
+	if (!w.hostnames || !w.traddrs || !w.errs) {
+		errno = ENOMEM;
+		resolved = -1;
+		goto out;
+	}
+
+	/* each hostname is only looked up once, and not at all if cached */
+	for (i = 0; i < nr; i++) {
+		if (!hostnames[i] || nvme_resolver_lookup(r, hostnames[i]))
+			continue;
+		for (j = 0; j < n; j++)
+			if (!strcasecmp(w.hostnames[j], hostnames[i]))
+				break;
+		if (j == n)
+			w.hostnames[n++] = hostnames[i];
+	}
+
+	nvme_run_parallel(max_parallel ? max_parallel :
+			  NVME_RESOLVER_DEFAULT_PARALLEL,
+			  n, nvme_resolve_one, &w);
+
+	for (i = 0; i < n; i++) {
+		if (w.traddrs[i]) {
+			resolved++;
+		} else {
+			nvme_resolve_msg(r, w.hostnames[i], w.errs[i]);
+			if (w.errs[i] == EAI_MEMORY)
+				continue;
+		}
+		nvme_resolver_add(r, w.hostnames[i], w.traddrs[i]);
+	}
+
+out:
+	free(w.hostnames);
+	free(w.traddrs);
+	free(w.errs);
+	return resolved;
+}
+
 char *startswith(const char *s, const char *prefix)
 {
 	size_t l;
@@ -817,3 +1066,161 @@ const char *nvme_get_version(enum nvme_version type)
 		return "n/a";
 	}
 }
+
+struct nvme_parallel_work {
+	void (*fn)(unsigned int idx, void *arg);
+	void *arg;
+	unsigned int nr_items;
+	unsigned int next;
+};
+
+static void *nvme_parallel_worker(void *data)
+{
+	struct nvme_parallel_work *w = data;
+	unsigned int idx;
+
+	while ((idx = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) <
+	       w->nr_items)
+		w->fn(idx, w->arg);
+
+	return NULL;
+}
+
+void nvme_run_parallel(unsigned int nr_threads, unsigned int nr_items,
+		       void (*fn)(unsigned int idx, void *arg), void *arg)
+{
+	struct nvme_parallel_work w = {
+		.fn = fn,
+		.arg = arg,
+		.nr_items = nr_items,
+	};
+	pthread_t *threads = NULL;
+	unsigned int i, nr = 0;
+
+	if (nr_threads > nr_items)
+		nr_threads = nr_items;
+	if (nr_threads > 1)
+		threads = calloc(nr_threads - 1, sizeof(*threads));
+
+	/* the caller works too, so failing to start threads is harmless */
+	for (i = 0; threads && i < nr_threads - 1; i++) {
+		if (pthread_create(&threads[nr], NULL, nvme_parallel_worker, &w))
+			break;
+		nr++;
+	}
+
+	nvme_parallel_worker(&w);
+
+	for (i = 0; i < nr; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+#define NVME_HTABLE_MIN_SIZE	64
+
+/* FNV-1a */
+#define NVME_HASH_OFFSET	2166136261U
+#define NVME_HASH_PRIME		16777619U
+
+unsigned int nvme_hash_ptr(const void *ptr)
+{
+	uintptr_t v = (uintptr_t)ptr;
+	unsigned int hash = NVME_HASH_OFFSET;
+	int i;
+
+	for (i = 0; i < sizeof(v); i++) {
+		hash = (hash ^ (v & 0xff)) * NVME_HASH_PRIME;
+		v >>= 8;
+	}
+	return hash;
+}
+
+unsigned int nvme_hash_str(unsigned int hash, const char *str, bool icase)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)str; *p; p++)
+		hash = (hash ^ (icase ? tolower(*p) : *p)) * NVME_HASH_PRIME;
+	/* separates consecutive strings */
+	return (hash ^ 0xff) * NVME_HASH_PRIME;
+}
+
+unsigned int nvme_hash_mem(unsigned int hash, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * NVME_HASH_PRIME;
+	return hash;
+}
+
+static void nvme_htable_link(struct nvme_htable *t, struct nvme_hnode *node)
+{
+	struct nvme_hnode **head = &t->buckets[node->hash & (t->size - 1)];
+
+	node->next = *head;
+	if (node->next)
+		node->next->pprev = &node->next;
+	node->pprev = head;
+	*head = node;
+}
+
+static void nvme_htable_grow(struct nvme_htable *t)
+{
+	unsigned int size = t->size ? t->size * 2 : NVME_HTABLE_MIN_SIZE;
+	struct nvme_hnode **old = t->buckets, *node, *next;
+	unsigned int old_size = t->size, i;
+
+	t->buckets = calloc(size, sizeof(*t->buckets));
+	if (!t->buckets) {
+		/* a full table still works, just slower */
+		t->buckets = old;
+		if (!old)
+			t->failed = true;
+		return;
+	}
+	t->size = size;
+
+	for (i = 0; i < old_size; i++) {
+		for (node = old[i]; node; node = next) {
+			next = node->next;
+			nvme_htable_link(t, node);
+		}
+	}
+	free(old);
+}
+
+void nvme_htable_add(struct nvme_htable *t, struct nvme_hnode *node,
+		     unsigned int hash)
+{
+	if (t->failed)
+		return;
+	if (t->nr >= t->size)
+		nvme_htable_grow(t);
+	if (t->failed)
+		return;
+
+	node->hash = hash;
+	nvme_htable_link(t, node);
+	t->nr++;
+}
+
+void nvme_htable_del(struct nvme_htable *t, struct nvme_hnode *node)
+{
+	if (!node->pprev)
+		return;
+
+	*node->pprev = node->next;
+	if (node->next)
+		node->next->pprev = node->pprev;
+	node->next = NULL;
+	node->pprev = NULL;
+	t->nr--;
+}
+
+void nvme_htable_free(struct nvme_htable *t)
+{
+	free(t->buckets);
+	memset(t, 0, sizeof(*t));
+}
@@ -0,0 +1,626 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ccan/endian/endian.h>
+#include <ccan/list/list.h>
+
+#include "zns.h"
+#include "util.h"
+#include "private.h"
+
+/*
+ * Zones per Report Zones command. Keeps the transfer at 32k, which any
+ * controller accepts without splitting.
+ */
+#define NVME_ZONE_REPORT_ZONES		511
+#define NVME_ZONE_REPORT_LEN(nr)	(sizeof(struct nvme_zone_report) + \
+					 (nr) * sizeof(struct nvme_zns_desc))
+
+#define NVME_ZONE_DEFAULT_PARALLEL	8
+
+/* every changed zone if the log page overflowed */
+#define NVME_ZNS_CHANGED_ZONES_ALL	0xffff
+
+struct nvme_zone_table {
+	int fd;
+	__u32 nsid;
+	unsigned int max_parallel;
+	__u64 nr_zones;
+	__u64 zone_size;
+	__u8 lba_shift;
+	struct nvme_zns_id_ns *zns_ns;
+
+	/* one array per descriptor field, indexed by zone number */
+	__u64 *wp;
+	__u64 *cap;
+	__u8 *state;
+	__u8 *attrs;
+};
+
+static void nvme_zone_table_store(nvme_zone_table_t t,
+				  struct nvme_zns_desc *desc)
+{
+	__u64 zone = le64_to_cpu(desc->zslba) / t->zone_size;
+
+	if (zone >= t->nr_zones)
+		return;
+
+	t->wp[zone] = le64_to_cpu(desc->wp);
+	t->cap[zone] = le64_to_cpu(desc->zcap);
+	t->state[zone] = desc->zs >> 4;
+	t->attrs[zone] = desc->za;
+}
+
+/* reads zones [first, first + nr) with reports of up to max zones each */
+static int nvme_zone_table_report(nvme_zone_table_t t, __u64 first, __u64 nr,
+				  struct nvme_zone_report *report,
+				  unsigned int max)
+{
+	__u64 i, n;
+	int ret;
+
+	while (nr) {
+		n = nr < max ? nr : max;
+		ret = nvme_zns_report_zones(t->fd, t->nsid,
+					    first * t->zone_size,
+					    NVME_ZNS_ZRAS_REPORT_ALL, false,
+					    true, NVME_ZONE_REPORT_LEN(n),
+					    report, NVME_DEFAULT_IOCTL_TIMEOUT,
+					    NULL);
+		if (ret)
+			return ret;
+
+		/* partial report: the number of descriptors returned */
+		if (le64_to_cpu(report->nr_zones) < n)
+			n = le64_to_cpu(report->nr_zones);
+		if (!n) {
+			errno = EIO;
+			return -1;
+		}
+
+		for (i = 0; i < n; i++)
+			nvme_zone_table_store(t, &report->entries[i]);
+		first += n;
+		nr -= n;
+	}
+
+	return 0;
+}
+
+struct nvme_zone_refresh_work {
+	nvme_zone_table_t t;
+	int *ret;
+	int *err;
+};
+
+static void nvme_zone_table_refresh_one(unsigned int i, void *arg)
+{
+	struct nvme_zone_refresh_work *w = arg;
+	nvme_zone_table_t t = w->t;
+	struct nvme_zone_report *report;
+	__u64 first = (__u64)i * NVME_ZONE_REPORT_ZONES;
+	__u64 nr = t->nr_zones - first;
+
+	if (nr > NVME_ZONE_REPORT_ZONES)
+		nr = NVME_ZONE_REPORT_ZONES;
+
+	report = malloc(NVME_ZONE_REPORT_LEN(NVME_ZONE_REPORT_ZONES));
+	if (!report) {
+		w->ret[i] = -1;
+		w->err[i] = ENOMEM;
+		return;
+	}
+
+	w->ret[i] = nvme_zone_table_report(t, first, nr, report,
+					   NVME_ZONE_REPORT_ZONES);
+	if (w->ret[i] < 0)
+		w->err[i] = errno;
+	free(report);
+}
+
+int nvme_zone_table_refresh(nvme_zone_table_t t)
+{
+	struct nvme_zone_refresh_work w = { .t = t };
+	unsigned int i, nr;
+	int ret = 0;
+
+	nr = (t->nr_zones + NVME_ZONE_REPORT_ZONES - 1) /
+		NVME_ZONE_REPORT_ZONES;
+
+	w.ret = calloc(nr, sizeof(*w.ret));
+	w.err = calloc(nr, sizeof(*w.err));
+	if (!w.ret || !w.err) {
+		free(w.ret);
+		free(w.err);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	nvme_run_parallel(t->max_parallel, nr, nvme_zone_table_refresh_one,
+			  &w);
+
+	for (i = 0; i < nr; i++) {
+		if (w.ret[i]) {
+			ret = w.ret[i];
+			errno = w.err[i];
+			break;
+		}
+	}
+
+	free(w.ret);
+	free(w.err);
+	return ret;
+}
+
+int nvme_zone_table_refresh_zone(nvme_zone_table_t t, __u64 zone)
+{
+	union {
+		struct nvme_zone_report report;
+		__u8 buf[NVME_ZONE_REPORT_LEN(1)];
+	} r;
+
+	if (zone >= t->nr_zones) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return nvme_zone_table_report(t, zone, 1, &r.report, 1);
+}
+
+int nvme_zone_table_refresh_changed(nvme_zone_table_t t)
+{
+	struct nvme_zns_changed_zone_log *log;
+	unsigned int i, nr;
+	int ret;
+
+	log = malloc(sizeof(*log));
+	if (!log) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ret = nvme_get_log_zns_changed_zones(t->fd, t->nsid, false, log);
+	if (ret)
+		goto free;
+
+	nr = le16_to_cpu(log->nrzid);
+	if (nr == NVME_ZNS_CHANGED_ZONES_ALL ||
+	    nr > NVME_ZNS_CHANGED_ZONES_MAX) {
+		ret = nvme_zone_table_refresh(t);
+		goto free;
+	}
+
+	/* zone identifiers are the zones' start LBAs */
+	for (i = 0; i < nr && !ret; i++)
+		ret = nvme_zone_table_refresh_zone(t,
+			le64_to_cpu(log->zid[i]) / t->zone_size);
+
+free:
+	free(log);
+	return ret;
+}
+
+nvme_zone_table_t nvme_zone_table_create(int fd, __u32 nsid,
+					 unsigned int max_parallel)
+{
+	struct nvme_zns_id_ns *zns_ns;
+	struct nvme_zone_table *t;
+	struct nvme_id_ns *ns;
+	int ret, err;
+	__u8 lbaf;
+
+	t = calloc(1, sizeof(*t));
+	ns = malloc(sizeof(*ns));
+	zns_ns = malloc(sizeof(*zns_ns));
+	if (!t || !ns || !zns_ns) {
+		errno = ENOMEM;
+		goto free;
+	}
+	t->fd = fd;
+	t->nsid = nsid;
+	t->max_parallel = max_parallel ? max_parallel :
+		NVME_ZONE_DEFAULT_PARALLEL;
+
+	ret = nvme_identify_ns(fd, nsid, ns);
+	if (!ret)
+		ret = nvme_zns_identify_ns(fd, nsid, zns_ns);
+	if (ret) {
+		/* a status means this is no zoned namespace */
+		if (ret > 0)
+			errno = ENODEV;
+		goto free;
+	}
+
+	nvme_id_ns_flbas_to_lbaf_inuse(ns->flbas, &lbaf);
+	t->lba_shift = ns->lbaf[lbaf].ds;
+	t->zone_size = le64_to_cpu(zns_ns->lbafe[lbaf].zsze);
+	if (!t->zone_size) {
+		errno = ENODEV;
+		goto free;
+	}
+	t->nr_zones = le64_to_cpu(ns->nsze) / t->zone_size;
+
+	t->wp = calloc(t->nr_zones, sizeof(*t->wp));
+	t->cap = calloc(t->nr_zones, sizeof(*t->cap));
+	t->state = calloc(t->nr_zones, sizeof(*t->state));
+	t->attrs = calloc(t->nr_zones, sizeof(*t->attrs));
+	if (t->nr_zones && (!t->wp || !t->cap || !t->state || !t->attrs)) {
+		errno = ENOMEM;
+		goto free;
+	}
+
+	ret = nvme_zone_table_refresh(t);
+	if (ret) {
+		if (ret > 0)
+			errno = EIO;
+		goto free;
+	}
+
+	t->zns_ns = zns_ns;
+	free(ns);
+	return t;
+
+free:
+	err = errno;
+	free(zns_ns);
+	free(ns);
+	nvme_zone_table_free(t);
+	errno = err;
+	return NULL;
+}
+
+void nvme_zone_table_free(nvme_zone_table_t t)
+{
+	if (!t)
+		return;
+
+	free(t->wp);
+	free(t->cap);
+	free(t->state);
+	free(t->attrs);
+	free(t->zns_ns);
+	free(t);
+}
+
+__u64 nvme_zone_table_get_nr_zones(nvme_zone_table_t t)
+{
+	return t->nr_zones;
+}
+
+__u64 nvme_zone_table_get_zone_size(nvme_zone_table_t t)
+{
+	return t->zone_size;
+}
+
+__u64 nvme_zone_table_zone_of(nvme_zone_table_t t, __u64 lba)
+{
+	return lba / t->zone_size;
+}
+
+const __u64 *nvme_zone_table_get_wps(nvme_zone_table_t t)
+{
+	return t->wp;
+}
+
+const __u64 *nvme_zone_table_get_caps(nvme_zone_table_t t)
+{
+	return t->cap;
+}
+
+const __u8 *nvme_zone_table_get_states(nvme_zone_table_t t)
+{
+	return t->state;
+}
+
+const __u8 *nvme_zone_table_get_attrs(nvme_zone_table_t t)
+{
+	return t->attrs;
+}
+
+#define NVME_ZNS_NO_LIMIT	0xffffffff
+
+struct nvme_zns_append_req {
+	struct list_node entry;
+	__u64 lba;
+	__u32 nlb;
+	int status;
+	bool done;
+	nvme_zns_append_cb_t cb;
+	void *user_data;
+	nvme_zns_writer_t w;
+	__u64 zone;
+};
+
+struct nvme_zns_zone_io {
+	/* appends in submission order, completed ones wait for earlier ones */
+	struct list_head reqs;
+	__u64 next;
+	unsigned int inflight;
+	bool finish;
+};
+
+struct nvme_zns_writer {
+	nvme_zone_table_t t;
+	nvme_uring_t ring;
+	int fd;
+	unsigned int flags;
+	__u32 max_open;
+	__u32 max_active;
+	unsigned int inflight;
+	struct nvme_zns_zone_io *zones;
+};
+
+static bool nvme_zns_zs_open(__u8 zs)
+{
+	return zs == NVME_ZNS_ZS_IMPL_OPEN || zs == NVME_ZNS_ZS_EXPL_OPEN;
+}
+
+static bool nvme_zns_zs_active(__u8 zs)
+{
+	return nvme_zns_zs_open(zs) || zs == NVME_ZNS_ZS_CLOSED;
+}
+
+static int nvme_zns_writer_send(nvme_zns_writer_t w, __u64 zone,
+				enum nvme_zns_send_action zsa)
+{
+	struct nvme_zns_mgmt_send_args args = {
+		.args_size = sizeof(args),
+		.fd = w->t->fd,
+		.nsid = w->t->nsid,
+		.slba = zone * w->t->zone_size,
+		.zsa = zsa,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+	};
+
+	return nvme_zns_mgmt_send(&args);
+}
+
+static int nvme_zns_writer_finish(nvme_zns_writer_t w, __u64 zone)
+{
+	int ret;
+
+	ret = nvme_zns_writer_send(w, zone, NVME_ZNS_ZSA_FINISH);
+	if (!ret) {
+		w->t->state[zone] = NVME_ZNS_ZS_FULL;
+		w->t->wp[zone] = zone * w->t->zone_size + w->t->cap[zone];
+	}
+	w->zones[zone].finish = false;
+	return ret;
+}
+
+/* an open zone without appends in flight gives its open resource back */
+static int nvme_zns_writer_close_idle(nvme_zns_writer_t w)
+{
+	__u64 zone;
+	int ret;
+
+	for (zone = 0; zone < w->t->nr_zones; zone++) {
+		if (!nvme_zns_zs_open(w->t->state[zone]) ||
+		    w->zones[zone].inflight)
+			continue;
+
+		ret = nvme_zns_writer_send(w, zone, NVME_ZNS_ZSA_CLOSE);
+		if (!ret)
+			w->t->state[zone] = NVME_ZNS_ZS_CLOSED;
+		return ret;
+	}
+
+	errno = EBUSY;
+	return -1;
+}
+
+/*
+ * The resources in use are counted from the table each time, so zones
+ * changed by others are taken into account once the table is refreshed.
+ */
+static int nvme_zns_writer_open(nvme_zns_writer_t w, __u64 zone)
+{
+	__u32 nr_open = 0, nr_active = 0;
+	__u8 zs = w->t->state[zone];
+	__u64 i;
+	int ret;
+
+	if (nvme_zns_zs_open(zs))
+		return 0;
+
+	if (zs != NVME_ZNS_ZS_EMPTY && zs != NVME_ZNS_ZS_CLOSED) {
+		errno = zs == NVME_ZNS_ZS_FULL ? ENOSPC : EROFS;
+		return -1;
+	}
+
+	for (i = 0; i < w->t->nr_zones; i++) {
+		nr_open += nvme_zns_zs_open(w->t->state[i]);
+		nr_active += nvme_zns_zs_active(w->t->state[i]);
+	}
+
+	/* only finishing a zone ends its activity, that is up to the caller */
+	if (zs == NVME_ZNS_ZS_EMPTY && nr_active >= w->max_active) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (nr_open >= w->max_open) {
+		ret = nvme_zns_writer_close_idle(w);
+		if (ret)
+			return ret;
+	}
+
+	ret = nvme_zns_writer_send(w, zone, NVME_ZNS_ZSA_OPEN);
+	if (ret)
+		return ret;
+
+	w->t->state[zone] = NVME_ZNS_ZS_EXPL_OPEN;
+	return 0;
+}
+
+static void nvme_zns_writer_complete(struct nvme_uring_completion *c)
+{
+	struct nvme_zns_append_req *req = c->user_data, *r, *_r;
+	nvme_zns_writer_t w = req->w;
+	nvme_zone_table_t t = w->t;
+	struct nvme_zns_zone_io *zio = &w->zones[req->zone];
+	__u64 zone = req->zone, end;
+
+	req->done = true;
+	req->status = c->status;
+	req->lba = c->result;
+	w->inflight--;
+	zio->inflight--;
+
+	end = zone * t->zone_size + t->cap[zone];
+	if (!req->status) {
+		if (req->lba + req->nlb > t->wp[zone])
+			t->wp[zone] = req->lba + req->nlb;
+		if (t->wp[zone] >= end)
+			t->state[zone] = NVME_ZNS_ZS_FULL;
+	}
+
+	/* space reserved by failed appends is only known once all are done */
+	if (!zio->inflight) {
+		zio->next = t->wp[zone];
+		if (zio->finish && t->state[zone] != NVME_ZNS_ZS_FULL)
+			nvme_zns_writer_finish(w, zone);
+		zio->finish = false;
+	}
+
+	list_for_each_safe(&zio->reqs, r, _r, entry) {
+		if (!r->done)
+			break;
+		list_del(&r->entry);
+		r->cb(w, zone, r->lba, r->status, r->user_data);
+		free(r);
+	}
+}
+
+int nvme_zns_writer_append(nvme_zns_writer_t w, __u64 zone, void *data,
+			   __u32 nlb, nvme_zns_append_cb_t cb, void *user_data)
+{
+	nvme_zone_table_t t = w->t;
+	struct nvme_zns_append_req *req;
+	struct nvme_zns_zone_io *zio;
+	struct nvme_io_args args = {
+		.args_size = sizeof(args),
+		.fd = w->fd,
+		.nsid = t->nsid,
+		.data = data,
+		.timeout = NVME_DEFAULT_IOCTL_TIMEOUT,
+	};
+	__u64 next, end;
+	int ret;
+
+	if (!cb || zone >= t->nr_zones || !nlb || nlb > 0x10000 ||
+	    (__u64)nlb << t->lba_shift > UINT32_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	zio = &w->zones[zone];
+
+	next = zio->next > t->wp[zone] ? zio->next : t->wp[zone];
+	end = zone * t->zone_size + t->cap[zone];
+	if (zio->finish || next + nlb > end) {
+		if (w->flags & NVME_ZNS_WRITER_AUTO_FINISH &&
+		    t->state[zone] != NVME_ZNS_ZS_FULL) {
+			if (zio->inflight)
+				zio->finish = true;
+			else
+				nvme_zns_writer_finish(w, zone);
+		}
+		errno = ENOSPC;
+		return -1;
+	}
+
+	ret = nvme_zns_writer_open(w, zone);
+	if (ret)
+		return ret;
+
+	req = calloc(1, sizeof(*req));
+	if (!req) {
+		errno = ENOMEM;
+		return -1;
+	}
+	req->w = w;
+	req->zone = zone;
+	req->nlb = nlb;
+	req->cb = cb;
+	req->user_data = user_data;
+
+	args.slba = zone * t->zone_size;
+	args.nlb = nlb - 1;
+	args.data_len = nlb << t->lba_shift;
+	if (nvme_io_async(w->ring, &args, nvme_zns_cmd_append,
+			  nvme_zns_writer_complete, req)) {
+		free(req);
+		return -1;
+	}
+
+	list_add_tail(&zio->reqs, &req->entry);
+	zio->next = next + nlb;
+	zio->inflight++;
+	w->inflight++;
+	return 0;
+}
+
+unsigned int nvme_zns_writer_inflight(nvme_zns_writer_t w)
+{
+	return w->inflight;
+}
+
+nvme_zns_writer_t nvme_zns_writer_create(nvme_zone_table_t t,
+					 nvme_uring_t ring, int fd,
+					 unsigned int flags)
+{
+	struct nvme_zns_writer *w;
+	__u64 zone;
+
+	if (!t || !ring || flags & ~NVME_ZNS_WRITER_AUTO_FINISH) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (!w) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	w->zones = calloc(t->nr_zones, sizeof(*w->zones));
+	if (t->nr_zones && !w->zones) {
+		free(w);
+		errno = ENOMEM;
+		return NULL;
+	}
+	w->t = t;
+	w->ring = ring;
+	w->fd = fd;
+	w->flags = flags;
+
+	/* both are 0's based, all ones means no limit */
+	w->max_open = le32_to_cpu(t->zns_ns->mor);
+	if (w->max_open != NVME_ZNS_NO_LIMIT)
+		w->max_open++;
+	w->max_active = le32_to_cpu(t->zns_ns->mar);
+	if (w->max_active != NVME_ZNS_NO_LIMIT)
+		w->max_active++;
+
+	for (zone = 0; zone < t->nr_zones; zone++) {
+		list_head_init(&w->zones[zone].reqs);
+		w->zones[zone].next = t->wp[zone];
+	}
+
+	return w;
+}
+
+void nvme_zns_writer_free(nvme_zns_writer_t w)
+{
+	if (!w)
+		return;
+
+	free(w->zones);
+	free(w);
+}
@@ -0,0 +1,254 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ */
+#ifndef _LIBNVME_ZNS_H
+#define _LIBNVME_ZNS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ioctl.h"
+#include "uring.h"
+
+/**
+ * DOC: zns.h
+ *
+ * Zoned namespace state tracking
+ *
+ * nvme_zns_report_zones() returns the state of a range of zones as an
+ * array of 64 byte descriptors, which has to be parsed again for every
+ * lookup. A zone table keeps the write pointer, capacity, state and
+ * attributes of all zones of a namespace in separate arrays indexed by
+ * zone number instead, so looking up a zone or scanning for zones in a
+ * given state only touches the data needed.
+ *
+ * The table is filled with Report Zones commands issued concurrently
+ * from several threads. Afterwards it is kept up to date by refreshing
+ * single zones, or the zones listed in the Changed Zone List log page
+ * when the controller reports a Zone Descriptor Changed event.
+ *
+ * A table is not thread safe.
+ *
+ * A zone writer keeps many Zone Append commands in flight per zone on an
+ * io_uring submission context, see uring.h, and updates the write
+ * pointers and states in the zone table as they complete. It opens zones
+ * explicitly before the first append, within the open and active zone
+ * limits of the namespace.
+ */
+
+/**
+ * typedef nvme_zone_table_t - Zone state of a zoned namespace
+ */
+typedef struct nvme_zone_table * nvme_zone_table_t;
+
+/**
+ * nvme_zone_table_create() - Read the zone state of a namespace
+ * @fd:		File descriptor of the namespace or its controller
+ * @nsid:	Namespace ID
+ * @max_parallel: Maximum number of Report Zones commands in flight, or 0 for
+ *		a default of 8
+ *
+ * Identifies the namespace to size the table and fills it with
+ * nvme_zone_table_refresh(). @fd must remain open for the lifetime of the
+ * table.
+ *
+ * Return: New zone table, or NULL with errno set on failure.
+ */
+nvme_zone_table_t nvme_zone_table_create(int fd, __u32 nsid,
+					 unsigned int max_parallel);
+
+/**
+ * nvme_zone_table_free() - Free a zone table
+ * @t:		Zone table
+ */
+void nvme_zone_table_free(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_refresh() - Reread the state of all zones
+ * @t:		Zone table
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_table_refresh(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_refresh_zone() - Reread the state of a single zone
+ * @t:		Zone table
+ * @zone:	Zone number
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_table_refresh_zone(nvme_zone_table_t t, __u64 zone);
+
+/**
+ * nvme_zone_table_refresh_changed() - Reread the zones which changed state
+ * @t:		Zone table
+ *
+ * Reads the Changed Zone List log page of the namespace, which clears it
+ * and rearms the Zone Descriptor Changed event, and rereads the zones
+ * listed. All zones are reread if the log reports more changes than it
+ * can hold. Call this when an asynchronous event for
+ * %NVME_LOG_LID_ZNS_CHANGED_ZONES is received, see nvme_monitor_create().
+ *
+ * Return: The nvme command status if a response was received (see
+ * &enum nvme_status_field) or -1 with errno set otherwise.
+ */
+int nvme_zone_table_refresh_changed(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_get_nr_zones() - Number of zones of a namespace
+ * @t:		Zone table
+ *
+ * Return: Number of zones, the size of the arrays returned by the
+ * nvme_zone_table_get_*s() functions.
+ */
+__u64 nvme_zone_table_get_nr_zones(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_get_zone_size() - Size of the zones of a namespace
+ * @t:		Zone table
+ *
+ * Return: Zone size in logical blocks.
+ */
+__u64 nvme_zone_table_get_zone_size(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_zone_of() - Zone containing a logical block
+ * @t:		Zone table
+ * @lba:	Logical block address
+ *
+ * Return: Zone number, which is not a valid zone if @lba is beyond the
+ * end of the namespace.
+ */
+__u64 nvme_zone_table_zone_of(nvme_zone_table_t t, __u64 lba);
+
+/**
+ * nvme_zone_table_get_wps() - Write pointers of all zones
+ * @t:		Zone table
+ *
+ * Return: Array of write pointers as logical block address, indexed by
+ * zone number. Updated in place by the refresh functions.
+ */
+const __u64 *nvme_zone_table_get_wps(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_get_caps() - Capacities of all zones
+ * @t:		Zone table
+ *
+ * Return: Array of zone capacities in logical blocks, indexed by zone
+ * number. Updated in place by the refresh functions.
+ */
+const __u64 *nvme_zone_table_get_caps(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_get_states() - States of all zones
+ * @t:		Zone table
+ *
+ * Return: Array of zone states, see &enum nvme_zns_zs, indexed by zone
+ * number. Updated in place by the refresh functions.
+ */
+const __u8 *nvme_zone_table_get_states(nvme_zone_table_t t);
+
+/**
+ * nvme_zone_table_get_attrs() - Attributes of all zones
+ * @t:		Zone table
+ *
+ * Return: Array of zone attributes, see &enum nvme_zns_za, indexed by zone
+ * number. Updated in place by the refresh functions.
+ */
+const __u8 *nvme_zone_table_get_attrs(nvme_zone_table_t t);
+
+/**
+ * typedef nvme_zns_writer_t - Zone Append submission queue
+ */
+typedef struct nvme_zns_writer * nvme_zns_writer_t;
+
+/**
+ * enum nvme_zns_writer_flags - Zone writer flags
+ * @NVME_ZNS_WRITER_AUTO_FINISH: Finish a zone once an append does not fit
+ *			into its remaining capacity and the appends in
+ *			flight have completed, which releases its open and
+ *			active resources
+ */
+enum nvme_zns_writer_flags {
+	NVME_ZNS_WRITER_AUTO_FINISH	= 1 << 0,
+};
+
+/**
+ * typedef nvme_zns_append_cb_t - Zone Append completion callback
+ * @w:		Zone writer
+ * @zone:	Zone number the data was appended to
+ * @lba:	Logical block address the data was written to, only valid if
+ *		@status is 0
+ * @status:	0 on success, the nvme command status if a response was
+ *		received (see &enum nvme_status_field) or a negative errno
+ *		value if the command could not be issued
+ * @user_data:	Pointer passed to nvme_zns_writer_append()
+ *
+ * Runs from nvme_uring_process_completions() or nvme_uring_reap(). For
+ * each zone, callbacks are invoked in the order the appends were issued,
+ * regardless of the order in which the controller completed them.
+ */
+typedef void (*nvme_zns_append_cb_t)(nvme_zns_writer_t w, __u64 zone,
+				     __u64 lba, int status, void *user_data);
+
+/**
+ * nvme_zns_writer_create() - Create a zone writer
+ * @t:		Zone table of the namespace, must outlive the writer
+ * @ring:	Submission context the appends are sent on
+ * @fd:		Generic namespace character device of the namespace, see
+ *		nvme_ns_get_generic_fd()
+ * @flags:	Writer flags, see &enum nvme_zns_writer_flags
+ *
+ * The open and active zone limits are taken from the Identify Namespace
+ * data of @t. The zones using them are counted from the states in @t, so
+ * zones opened or closed by other means are only noticed once @t is
+ * refreshed.
+ *
+ * Return: New zone writer, or NULL with errno set on failure.
+ */
+nvme_zns_writer_t nvme_zns_writer_create(nvme_zone_table_t t,
+					 nvme_uring_t ring, int fd,
+					 unsigned int flags);
+
+/**
+ * nvme_zns_writer_free() - Free a zone writer
+ * @w:		Zone writer without appends in flight
+ */
+void nvme_zns_writer_free(nvme_zns_writer_t w);
+
+/**
+ * nvme_zns_writer_append() - Append data to a zone without waiting for it
+ * @w:		Zone writer
+ * @zone:	Zone number
+ * @data:	Data to write, which has to stay valid until @cb is called
+ * @nlb:	Number of logical blocks to write, 1 to 65536
+ * @cb:		Callback invoked with the completion of the append
+ * @user_data:	Passed to @cb
+ *
+ * Reserves @nlb blocks of the remaining capacity of @zone and sends a
+ * Zone Append command for them. If the zone is not open yet it is opened
+ * first; when the namespace is at its open zone limit, an open zone
+ * without appends in flight is closed to make room.
+ *
+ * Return: 0 if the append was queued, or -1 with errno set otherwise, in
+ * which case @cb is never called. errno is set to ENOSPC if the data does
+ * not fit into the zone, and to EBUSY if the zone can not be opened within
+ * the open and active zone limits.
+ */
+int nvme_zns_writer_append(nvme_zns_writer_t w, __u64 zone, void *data,
+			   __u32 nlb, nvme_zns_append_cb_t cb,
+			   void *user_data);
+
+/**
+ * nvme_zns_writer_inflight() - Number of appends in flight
+ * @w:		Zone writer
+ *
+ * Return: Number of appends which have been queued and not completed yet.
+ */
+unsigned int nvme_zns_writer_inflight(nvme_zns_writer_t w);
+
+#endif /* _LIBNVME_ZNS_H */
@@ -0,0 +1,211 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Benchmarks for the MI paths: MIC calculation, and request/response
+ * round trips through the MCTP transport with the socket layer replaced by
+ * an in-process peer which answers every request immediately. The round
+ * trips therefore measure the library overhead only, not any bus latency.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/endian/endian.h>
+
+#include "libnvme-mi.h"
+#include "nvme/private.h"
+#include "bench-utils.h"
+
+/* 4096 byte max MCTP message, plus space for header data */
+#define MAX_BUFSIZ 8192
+
+extern __u32 nvme_mi_crc32_update(__u32 crc, void *data, size_t len);
+
+/*
+ * Our fake MCTP peer: keeps the message type byte and header of the last
+ * request, and answers it with a successful response of resp_len bytes
+ * (excluding the MIC), for which it calculates a MIC like a device would.
+ */
+static struct bench_peer {
+	unsigned char	buf[MAX_BUFSIZ];
+	size_t		resp_len;
+	int		sd;
+} peer;
+
+static int bench_socket(int family, int type, int protocol)
+{
+	/* we do an open here to give the mi-mctp code something to close() */
+	peer.sd = open("/dev/null", 0);
+	return peer.sd;
+}
+
+static ssize_t bench_sendmsg(int sd, const struct msghdr *hdr, int flags)
+{
+	size_t i, len = 0;
+
+	/* only the message header is needed to build the response */
+	if (hdr->msg_iovlen)
+		memcpy(peer.buf + 1, hdr->msg_iov[0].iov_base,
+		       hdr->msg_iov[0].iov_len < 4 ? hdr->msg_iov[0].iov_len : 4);
+
+	for (i = 0; i < hdr->msg_iovlen; i++)
+		len += hdr->msg_iov[i].iov_len;
+	return len;
+}
+
+static ssize_t bench_recvmsg(int sd, struct msghdr *hdr, int flags)
+{
+	size_t i, pos, len;
+	__u32 crc;
+
+	peer.buf[0] = NVME_MI_MSGTYPE_NVME;
+	peer.buf[1] |= NVME_MI_ROR_RSP << 7;
+	memset(peer.buf + 4, 0, peer.resp_len - 4);
+	crc = ~nvme_mi_crc32_update(0xffffffff, peer.buf, peer.resp_len);
+	*(uint32_t *)(peer.buf + peer.resp_len) = cpu_to_le32(crc);
+	len = peer.resp_len + sizeof(crc);
+
+	/* scatter buf into iovec, skipping the message type byte */
+	for (i = 0, pos = 1; i < hdr->msg_iovlen && pos < len; i++) {
+		struct iovec *iov = &hdr->msg_iov[i];
+		size_t n = iov->iov_len;
+
+		if (n > len - pos)
+			n = len - pos;
+		memcpy(iov->iov_base, peer.buf + pos, n);
+		pos += n;
+	}
+
+	return pos - 1;
+}
+
+static int bench_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	return 1;
+}
+
+struct mctp_ioc_tag_ctl;
+
+static int bench_ioctl_tag(int sd, unsigned long req,
+			   struct mctp_ioc_tag_ctl *ctl)
+{
+	return 0;
+}
+
+static struct __mi_mctp_socket_ops ops = {
+	bench_socket,
+	bench_sendmsg,
+	bench_recvmsg,
+	bench_poll,
+	bench_ioctl_tag,
+};
+
+struct crc_arg {
+	void *buf;
+	size_t len;
+};
+
+/* keeps the compiler from dropping the calculation */
+static volatile __u32 crc_sink;
+
+static int bench_crc32(void *arg)
+{
+	struct crc_arg *a = arg;
+
+	crc_sink = nvme_mi_crc32_update(0xffffffff, a->buf, a->len);
+	return 0;
+}
+
+static int bench_mi_read_subsys(void *arg)
+{
+	struct nvme_mi_read_nvm_ss_info ss_info;
+
+	return nvme_mi_mi_read_mi_data_subsys(arg, &ss_info);
+}
+
+static int bench_admin_identify(void *arg)
+{
+	struct nvme_id_ctrl id;
+
+	return nvme_mi_admin_identify_ctrl(arg, &id);
+}
+
+static int bench_admin_smart_log(void *arg)
+{
+	struct nvme_smart_log log;
+	struct nvme_get_log_args args = {
+		.log = &log,
+		.args_size = sizeof(args),
+		.lid = NVME_LOG_LID_SMART,
+		.len = sizeof(log),
+		.nsid = NVME_NSID_ALL,
+		.csi = NVME_CSI_NVM,
+	};
+
+	return nvme_mi_admin_get_log(arg, &args);
+}
+
+int main(void)
+{
+	static const size_t crc_sizes[] = { 64, 512, 4096, 65536 };
+	nvme_mi_ctrl_t ctrl;
+	nvme_root_t root;
+	nvme_mi_ep_t ep;
+	char name[64];
+	unsigned int i;
+	void *buf;
+	int rc = 0;
+
+	buf = malloc(crc_sizes[ARRAY_SIZE(crc_sizes) - 1]);
+	assert(buf);
+	memset(buf, 0x5a, crc_sizes[ARRAY_SIZE(crc_sizes) - 1]);
+
+	for (i = 0; i < ARRAY_SIZE(crc_sizes); i++) {
+		struct crc_arg a = { buf, crc_sizes[i] };
+
+		snprintf(name, sizeof(name), "crc32 %zu bytes", crc_sizes[i]);
+		rc |= bench_run(name, bench_crc32, &a, crc_sizes[i]);
+	}
+	free(buf);
+
+	__nvme_mi_mctp_set_ops(&ops);
+
+	root = nvme_mi_create_root(NULL, LOG_WARNING);
+	assert(root);
+
+	ep = nvme_mi_open_mctp(root, 0, 0);
+	assert(ep);
+
+	ctrl = nvme_mi_init_ctrl(ep, 1);
+	assert(ctrl);
+
+	peer.resp_len = sizeof(struct nvme_mi_mi_resp_hdr) +
+		sizeof(struct nvme_mi_read_nvm_ss_info);
+	rc |= bench_run("mi read subsystem info", bench_mi_read_subsys,
+			ep, 0);
+
+	peer.resp_len = sizeof(struct nvme_mi_admin_resp_hdr) +
+		sizeof(struct nvme_smart_log);
+	rc |= bench_run("mi admin smart log", bench_admin_smart_log, ctrl,
+			sizeof(struct nvme_smart_log));
+
+	peer.resp_len = sizeof(struct nvme_mi_admin_resp_hdr) +
+		sizeof(struct nvme_id_ctrl);
+	rc |= bench_run("mi admin identify controller", bench_admin_identify,
+			ctrl, sizeof(struct nvme_id_ctrl));
+
+	nvme_mi_close_ctrl(ctrl);
+	nvme_mi_close(ep);
+	nvme_mi_free_root(root);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
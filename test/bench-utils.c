@@ -0,0 +1,77 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ *
+ * Common benchmark utilities.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench-utils.h"
+
+/* minimum run time of each benchmark, override with BENCH_TIME_MS */
+#define BENCH_DEFAULT_TIME_MS	500
+
+static uint64_t bench_time_ns(void)
+{
+	const char *s = getenv("BENCH_TIME_MS");
+	unsigned long ms = BENCH_DEFAULT_TIME_MS;
+
+	if (s && *s)
+		ms = strtoul(s, NULL, 0);
+
+	return ms * 1000000ULL;
+}
+
+uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_report(const char *name, uint64_t ops, uint64_t ns, size_t bytes)
+{
+	double secs = ns / 1e9;
+
+	if (!ops || !ns) {
+		printf("%-36s no samples\n", name);
+		return;
+	}
+
+	printf("%-36s %12.0f ops/s %10.2f us/op", name, ops / secs,
+	       ns / 1e3 / ops);
+	if (bytes)
+		printf(" %10.1f MiB/s", (double)ops * bytes / secs / (1 << 20));
+	printf("\n");
+	fflush(stdout);
+}
+
+int bench_run(const char *name, bench_fn fn, void *arg, size_t bytes)
+{
+	uint64_t start, last, now, end, ops = 0, batch = 1, i;
+
+	start = last = bench_now_ns();
+	end = start + bench_time_ns();
+
+	/* check the clock less often as the operation turns out to be fast */
+	do {
+		for (i = 0; i < batch; i++) {
+			if (fn(arg)) {
+				printf("%-36s failed\n", name);
+				return -1;
+			}
+		}
+		ops += batch;
+		now = bench_now_ns();
+		if (now - last < 1000000 && batch < 4096)
+			batch *= 2;
+		last = now;
+	} while (now < end);
+
+	bench_report(name, ops, now - start, bytes);
+	return 0;
+}
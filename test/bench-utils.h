@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * This file is part of libnvme.
+ *
+ * Common benchmark utilities. A benchmark repeats an operation until a
+ * minimum run time has passed and prints its rate, so that numbers from
+ * different runs and machines can be compared by eye or by script.
+ */
+
+#ifndef _TEST_BENCH_UTILS_H
+#define _TEST_BENCH_UTILS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* returns 0 on success, anything else aborts the benchmark */
+typedef int (*bench_fn)(void *arg);
+
+uint64_t bench_now_ns(void);
+void bench_report(const char *name, uint64_t ops, uint64_t ns, size_t bytes);
+int bench_run(const char *name, bench_fn fn, void *arg, size_t bytes);
+
+#endif /* _TEST_BENCH_UTILS_H */
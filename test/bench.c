@@ -0,0 +1,480 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Benchmarks for the topology scan and the ioctl command paths.
+ *
+ *   bench scan [subsystems [controllers [paths]]]
+ *	Scans a synthetic sysfs tree with the given number of subsystems,
+ *	controllers per subsystem and namespace paths per controller.
+ *	Namespaces are not created, as they need a block device to open.
+ *
+ *   bench io <device> [queue depth...]
+ *	Random 4k reads; queue depth 1 through nvme_read(), larger queue
+ *	depths through io_uring, which needs a generic namespace character
+ *	device (/dev/ngXnY).
+ *
+ *   bench log <device> [lid [length]]
+ *	Reads a log page (the Error Information log by default) split into
+ *	chunks of increasing size.
+ *
+ * The scan benchmark does not need any hardware and runs as part of the
+ * 'benchmark' target, the others are for developer use on a real device.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <ccan/array_size/array_size.h>
+#include <ccan/endian/endian.h>
+
+#include <libnvme.h>
+#include "nvme/private.h"
+#include "bench-utils.h"
+
+#define BENCH_IO_SIZE	4096
+
+/* set on all controllers, so they don't depend on the host configuration */
+#define BENCH_HOSTID	"2b3e8c52-47a3-4f3c-9a0b-6f67d1d0b2e1"
+#define BENCH_HOSTNQN	"nqn.2014-08.org.nvmexpress:uuid:" BENCH_HOSTID
+
+static int write_attr(const char *dir, const char *attr, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static int write_attr(const char *dir, const char *attr, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	fputc('\n', f);
+	return fclose(f);
+}
+
+static int make_dir(char *path, size_t len, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static int make_dir(char *path, size_t len, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(path, len, fmt, ap);
+	va_end(ap);
+	return mkdir(path, 0755);
+}
+
+/*
+ * Lay out subsystems, controllers and paths the way the kernel does:
+ * controller directories in class/nvme with a path directory per
+ * namespace, and subsystem directories in class/nvme-subsystem with a
+ * link to each of their controllers.
+ */
+static int make_sysfs(const char *root, int nr_subsys, int nr_ctrls,
+		      int nr_paths)
+{
+	char dir[PATH_MAX], sub[PATH_MAX], path[PATH_MAX], link[PATH_MAX + 16];
+	int s, c, n, ctrl = 0;
+
+	if (make_dir(dir, sizeof(dir), "%s/nvme", root) ||
+	    make_dir(dir, sizeof(dir), "%s/nvme-subsystem", root) ||
+	    make_dir(dir, sizeof(dir), "%s/block", root))
+		return -1;
+
+	for (s = 0; s < nr_subsys; s++) {
+		char nqn[64];
+
+		snprintf(nqn, sizeof(nqn), "nqn.2014-08.org.nvmexpress:bench:%d",
+			 s);
+		if (make_dir(sub, sizeof(sub), "%s/nvme-subsystem/nvme-subsys%d",
+			     root, s) ||
+		    write_attr(sub, "subsysnqn", "%s", nqn) ||
+		    write_attr(sub, "model", "libnvme bench") ||
+		    write_attr(sub, "serial", "BENCH%04d", s) ||
+		    write_attr(sub, "firmware_rev", "1.0") ||
+		    write_attr(sub, "subsystype", "nvm"))
+			return -1;
+
+		for (c = 0; c < nr_ctrls; c++, ctrl++) {
+			if (make_dir(dir, sizeof(dir), "%s/nvme/nvme%d", root,
+				     ctrl) ||
+			    write_attr(dir, "subsysnqn", "%s", nqn) ||
+			    write_attr(dir, "hostnqn", BENCH_HOSTNQN) ||
+			    write_attr(dir, "hostid", BENCH_HOSTID) ||
+			    write_attr(dir, "transport", "tcp") ||
+			    write_attr(dir, "address",
+				       "traddr=10.%d.%d.%d,trsvcid=4420",
+				       s / 256, s % 256, c) ||
+			    write_attr(dir, "model", "libnvme bench") ||
+			    write_attr(dir, "serial", "BENCH%04d", s) ||
+			    write_attr(dir, "firmware_rev", "1.0") ||
+			    write_attr(dir, "state", "live") ||
+			    write_attr(dir, "numa_node", "-1") ||
+			    write_attr(dir, "queue_count", "9") ||
+			    write_attr(dir, "sqsize", "127") ||
+			    write_attr(dir, "cntrltype", "io"))
+				return -1;
+
+			snprintf(link, sizeof(link), "%s/nvme%d", sub, ctrl);
+			if (symlink(dir, link))
+				return -1;
+
+			for (n = 1; n <= nr_paths; n++) {
+				if (make_dir(path, sizeof(path),
+					     "%s/nvme%dc%dn%d", dir, s, ctrl,
+					     n) ||
+				    write_attr(path, "ana_state", "optimized") ||
+				    write_attr(path, "ana_grpid", "%d", n))
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void remove_sysfs(const char *root)
+{
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", root);
+	if (system(cmd))
+		fprintf(stderr, "failed to remove %s\n", root);
+}
+
+static int bench_scan_one(void *arg)
+{
+	nvme_root_t r;
+	int err;
+
+	r = nvme_create_root(NULL, LOG_WARNING);
+	if (!r)
+		return -1;
+	err = nvme_scan_topology(r, NULL, NULL);
+	nvme_free_tree(r);
+	return err;
+}
+
+static int bench_refresh(void *arg)
+{
+	nvme_refresh_topology(arg);
+	return 0;
+}
+
+static int bench_update(void *arg)
+{
+	return nvme_update_topology(arg, NULL, NULL) < 0 ? -1 : 0;
+}
+
+static int bench_scan(int argc, char **argv)
+{
+	int nr_subsys = argc > 0 ? atoi(argv[0]) : 16;
+	int nr_ctrls = argc > 1 ? atoi(argv[1]) : 2;
+	int nr_paths = argc > 2 ? atoi(argv[2]) : 4;
+	char root[] = "/tmp/libnvme-bench-XXXXXX";
+	char ctrl_dir[PATH_MAX], subsys_dir[PATH_MAX], ns_dir[PATH_MAX];
+	char name[64];
+	nvme_root_t r;
+	int rc = 0;
+
+	if (!mkdtemp(root)) {
+		perror("mkdtemp");
+		return -1;
+	}
+	if (make_sysfs(root, nr_subsys, nr_ctrls, nr_paths)) {
+		perror("failed to create sysfs tree");
+		remove_sysfs(root);
+		return -1;
+	}
+
+	snprintf(ctrl_dir, sizeof(ctrl_dir), "%s/nvme", root);
+	snprintf(subsys_dir, sizeof(subsys_dir), "%s/nvme-subsystem", root);
+	snprintf(ns_dir, sizeof(ns_dir), "%s/block", root);
+	nvme_ctrl_sysfs_dir = ctrl_dir;
+	nvme_subsys_sysfs_dir = subsys_dir;
+	nvme_ns_sysfs_dir = ns_dir;
+
+	snprintf(name, sizeof(name), "scan %dx%dx%d", nr_subsys, nr_ctrls,
+		 nr_paths);
+	rc |= bench_run(name, bench_scan_one, NULL, 0);
+
+	r = nvme_create_root(NULL, LOG_WARNING);
+	if (!r) {
+		rc = -1;
+		goto out;
+	}
+	/* updates reread the ANA state of each path */
+	nvme_root_set_cache_attr_fds(r, true);
+	if (nvme_scan_topology(r, NULL, NULL)) {
+		rc = -1;
+		goto free;
+	}
+	snprintf(name, sizeof(name), "refresh %dx%dx%d", nr_subsys, nr_ctrls,
+		 nr_paths);
+	rc |= bench_run(name, bench_refresh, r, 0);
+	snprintf(name, sizeof(name), "update %dx%dx%d", nr_subsys, nr_ctrls,
+		 nr_paths);
+	rc |= bench_run(name, bench_update, r, 0);
+
+free:
+	nvme_free_tree(r);
+out:
+	remove_sysfs(root);
+	return rc;
+}
+
+struct bench_dev {
+	int fd;
+	__u32 nsid;
+	__u64 nr_blocks;
+	unsigned int lba_shift;
+	void *buf;
+};
+
+static int bench_open_ns(const char *dev, struct bench_dev *d, size_t buf_len)
+{
+	struct nvme_id_ns ns;
+	__u8 flbas;
+
+	d->fd = open(dev, O_RDONLY);
+	if (d->fd < 0) {
+		perror(dev);
+		return -1;
+	}
+	if (nvme_get_nsid(d->fd, &d->nsid) ||
+	    nvme_identify_ns(d->fd, d->nsid, &ns)) {
+		fprintf(stderr, "%s: failed to identify namespace\n", dev);
+		goto close;
+	}
+
+	nvme_id_ns_flbas_to_lbaf_inuse(ns.flbas, &flbas);
+	d->lba_shift = ns.lbaf[flbas].ds;
+	d->nr_blocks = le64_to_cpu(ns.nsze);
+	if (d->lba_shift < 9 || d->lba_shift > 12 ||
+	    d->nr_blocks < (BENCH_IO_SIZE >> d->lba_shift)) {
+		fprintf(stderr, "%s: unsupported LBA format\n", dev);
+		goto close;
+	}
+
+	if (posix_memalign(&d->buf, getpagesize(), buf_len))
+		goto close;
+	return 0;
+
+close:
+	close(d->fd);
+	return -1;
+}
+
+static void bench_io_args(struct bench_dev *d, struct nvme_io_args *args,
+			  void *buf)
+{
+	__u64 blocks = BENCH_IO_SIZE >> d->lba_shift;
+
+	memset(args, 0, sizeof(*args));
+	args->args_size = sizeof(*args);
+	args->fd = d->fd;
+	args->nsid = d->nsid;
+	args->timeout = NVME_DEFAULT_IOCTL_TIMEOUT;
+	args->slba = (random() % (d->nr_blocks / blocks)) * blocks;
+	args->nlb = blocks - 1;
+	args->data = buf;
+	args->data_len = BENCH_IO_SIZE;
+}
+
+static int bench_read_qd1(void *arg)
+{
+	struct bench_dev *d = arg;
+	struct nvme_io_args args;
+
+	bench_io_args(d, &args, d->buf);
+	return nvme_read(&args);
+}
+
+static int bench_read_qdn(struct bench_dev *d, unsigned int qd)
+{
+	struct nvme_uring_completion c[64];
+	struct nvme_io_args args;
+	uint64_t start, end, now, ops = 0;
+	nvme_uring_t ring;
+	char name[64];
+	unsigned int i;
+	int n;
+
+	ring = nvme_uring_create(qd, 0);
+	if (!ring) {
+		printf("io uring unavailable: %s\n", strerror(errno));
+		return 0;
+	}
+
+	start = bench_now_ns();
+	end = start + 500000000ULL;
+	for (i = 0; i < qd; i++) {
+		bench_io_args(d, &args, d->buf + i * BENCH_IO_SIZE);
+		if (nvme_uring_queue_io(ring, &args, nvme_cmd_read,
+					(void *)(uintptr_t)i))
+			goto fail;
+	}
+
+	do {
+		if (nvme_uring_submit(ring) < 0)
+			goto fail;
+		n = nvme_uring_reap(ring, c, ARRAY_SIZE(c), 1);
+		if (n < 0)
+			goto fail;
+		for (i = 0; i < (unsigned int)n; i++) {
+			uintptr_t slot = (uintptr_t)c[i].user_data;
+
+			if (c[i].status)
+				goto fail;
+			ops++;
+			bench_io_args(d, &args, d->buf + slot * BENCH_IO_SIZE);
+			if (nvme_uring_queue_io(ring, &args, nvme_cmd_read,
+						(void *)slot))
+				goto fail;
+		}
+		now = bench_now_ns();
+	} while (now < end);
+
+	nvme_uring_free(ring);
+	snprintf(name, sizeof(name), "read 4k qd%u", qd);
+	bench_report(name, ops, now - start, BENCH_IO_SIZE);
+	return 0;
+
+fail:
+	printf("read 4k qd%u failed\n", qd);
+	nvme_uring_free(ring);
+	return -1;
+}
+
+static int bench_io(int argc, char **argv)
+{
+	unsigned int qd, max_qd = 1;
+	struct bench_dev d;
+	int i, rc = 0;
+
+	if (argc < 1) {
+		fprintf(stderr, "usage: bench io <device> [queue depth...]\n");
+		return -1;
+	}
+	for (i = 1; i < argc; i++) {
+		qd = atoi(argv[i]);
+		if (qd > max_qd)
+			max_qd = qd;
+	}
+	if (max_qd > 64) {
+		fprintf(stderr, "queue depth is limited to 64\n");
+		return -1;
+	}
+	if (bench_open_ns(argv[0], &d, max_qd * BENCH_IO_SIZE))
+		return -1;
+
+	rc |= bench_run("read 4k qd1", bench_read_qd1, &d, BENCH_IO_SIZE);
+	for (i = 1; i < argc; i++) {
+		qd = atoi(argv[i]);
+		if (qd > 1)
+			rc |= bench_read_qdn(&d, qd);
+	}
+
+	free(d.buf);
+	close(d.fd);
+	return rc;
+}
+
+struct bench_log {
+	int fd;
+	__u32 chunk;
+	struct nvme_get_log_args args;
+};
+
+static int bench_log_one(void *arg)
+{
+	struct bench_log *l = arg;
+
+	return nvme_get_log_page(l->fd, l->chunk, &l->args);
+}
+
+static int bench_log(int argc, char **argv)
+{
+	struct bench_log l = { 0 };
+	struct nvme_id_ctrl id;
+	char name[64];
+	__u32 len, chunk;
+	void *buf;
+	int rc = 0;
+
+	if (argc < 1) {
+		fprintf(stderr, "usage: bench log <device> [lid [length]]\n");
+		return -1;
+	}
+
+	l.fd = open(argv[0], O_RDONLY);
+	if (l.fd < 0) {
+		perror(argv[0]);
+		return -1;
+	}
+	if (nvme_identify_ctrl(l.fd, &id)) {
+		fprintf(stderr, "%s: failed to identify controller\n", argv[0]);
+		close(l.fd);
+		return -1;
+	}
+
+	l.args.lid = argc > 1 ? strtoul(argv[1], NULL, 0) : NVME_LOG_LID_ERROR;
+	len = argc > 2 ? strtoul(argv[2], NULL, 0) :
+		(id.elpe + 1) * sizeof(struct nvme_error_log_page);
+	if (posix_memalign(&buf, getpagesize(), len)) {
+		close(l.fd);
+		return -1;
+	}
+
+	l.args.args_size = sizeof(l.args);
+	l.args.fd = l.fd;
+	l.args.timeout = NVME_DEFAULT_IOCTL_TIMEOUT;
+	l.args.nsid = NVME_NSID_ALL;
+	l.args.csi = NVME_CSI_NVM;
+	l.args.log = buf;
+	l.args.len = len;
+
+	for (chunk = 4096; ; chunk *= 2) {
+		if (chunk > len)
+			chunk = len;
+		l.chunk = chunk;
+		snprintf(name, sizeof(name), "log 0x%02x %u bytes by %u",
+			 l.args.lid, len, chunk);
+		rc |= bench_run(name, bench_log_one, &l, len);
+		if (chunk == len)
+			break;
+	}
+
+	free(buf);
+	close(l.fd);
+	return rc;
+}
+
+int main(int argc, char **argv)
+{
+	int rc = -1;
+
+	if (argc < 2 || !strcmp(argv[1], "scan"))
+		rc = bench_scan(argc > 2 ? argc - 2 : 0, argv + 2);
+	else if (!strcmp(argv[1], "io"))
+		rc = bench_io(argc - 2, argv + 2);
+	else if (!strcmp(argv[1], "log"))
+		rc = bench_log(argc - 2, argv + 2);
+	else
+		fprintf(stderr, "usage: %s scan|io|log [args...]\n", argv[0]);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,73 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * The same as cpp.cc, using the C++ layer of libnvme.hpp.
+ */
+
+#include <iostream>
+#include <vector>
+#include <libnvme.hpp>
+
+int main()
+{
+	libnvme::root r = libnvme::root::scan();
+
+	if (!r)
+		return -1;
+
+	for (nvme_host_t h : r.hosts()) {
+		for (nvme_subsystem_t s : libnvme::subsystems(h)) {
+			std::cout <<  nvme_subsystem_get_name(s)
+				  << " - NQN=" << nvme_subsystem_get_nqn(s)
+				  << "\n";
+			for (nvme_ctrl_t c : libnvme::ctrls(s)) {
+				struct nvme_smart_log smart;
+				int fd = nvme_ctrl_get_fd(c);
+
+				std::cout << " `- " << nvme_ctrl_get_name(c)
+					  << " " << nvme_ctrl_get_transport(c)
+					  << " " << nvme_ctrl_get_address(c)
+					  << " " << nvme_ctrl_get_state(c);
+				if (fd >= 0 &&
+				    !libnvme::get_log<NVME_LOG_LID_SMART>(fd, smart))
+					std::cout << " temperature:"
+						  << (smart.temperature[0] |
+						      smart.temperature[1] << 8);
+				std::cout << "\n";
+				for (nvme_ns_t n : libnvme::namespaces(c)) {
+					std::vector<unsigned char> lba(
+						nvme_ns_get_lba_size(n));
+
+					std::cout << "   `- "
+						  << nvme_ns_get_name(n)
+						  << "lba size:"
+						  << nvme_ns_get_lba_size(n)
+						  << " lba max:"
+						  << nvme_ns_get_lba_count(n);
+					if (!libnvme::read(n, libnvme::span<unsigned char>(lba), 0))
+						std::cout << " first byte:"
+							  << unsigned(lba[0]);
+					std::cout << "\n";
+				}
+				for (nvme_path_t p : libnvme::paths(c)) {
+					std::cout << "   `- "
+						  << nvme_path_get_name(p)
+						  << " "
+						  << nvme_path_get_ana_state(p)
+						  << "\n";
+				}
+			}
+			for (nvme_ns_t n : libnvme::namespaces(s)) {
+				std::cout << "   `- " << nvme_ns_get_name(n)
+					  << "lba size:"
+					  << nvme_ns_get_lba_size(n)
+					  << " lba max:"
+					  << nvme_ns_get_lba_count(n) << "\n";
+			}
+		}
+	}
+	std::cout << "\n";
+
+	return 0;
+}
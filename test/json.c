@@ -0,0 +1,423 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Reading and writing of the JSON config file: round trips, string
+ * escapes, syntax errors and the port options known to the reader.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libnvme.h>
+#include "nvme/private.h"
+
+/* as written by json_update_config(), in the order of the file */
+static const char test_config[] =
+	"[\n"
+	"  {\n"
+	"    \"hostnqn\":\"nqn.2014-08.org.nvmexpress:uuid:test-host-1\",\n"
+	"    \"hostid\":\"test-host-1\",\n"
+	"    \"dhchap_key\":\"DHHC-1:00:aG9zdC1rZXk=:\",\n"
+	"    \"hostsymname\":\"host one\",\n"
+	"    \"subsystems\":[\n"
+	"      {\n"
+	"        \"nqn\":\"nqn.2014-08.org.nvmexpress:test-b\",\n"
+	"        \"ports\":[\n"
+	"          {\n"
+	"            \"transport\":\"tcp\",\n"
+	"            \"traddr\":\"192.168.1.2\",\n"
+	"            \"host_traddr\":\"192.168.1.100\",\n"
+	"            \"trsvcid\":\"4420\",\n"
+	"            \"dhchap_ctrl_key\":\"DHHC-1:00:Y3RybC1rZXk=:\",\n"
+	"            \"nr_io_queues\":4,\n"
+	"            \"keep_alive_tmo\":15,\n"
+	"            \"ctrl_loss_tmo\":30,\n"
+	"            \"tos\":3,\n"
+	"            \"hdr_digest\":true,\n"
+	"            \"tls\":true,\n"
+	"            \"persistent\":true\n"
+	"          },\n"
+	"          {\n"
+	"            \"transport\":\"tcp\",\n"
+	"            \"traddr\":\"192.168.1.1\",\n"
+	"            \"trsvcid\":\"4420\"\n"
+	"          }\n"
+	"        ]\n"
+	"      },\n"
+	"      {\n"
+	"        \"nqn\":\"nqn.2014-08.org.nvmexpress:test-a\",\n"
+	"        \"ports\":[\n"
+	"          {\n"
+	"            \"transport\":\"rdma\",\n"
+	"            \"traddr\":\"10.0.0.1\",\n"
+	"            \"trsvcid\":\"4420\",\n"
+	"            \"discovery\":true\n"
+	"          }\n"
+	"        ]\n"
+	"      }\n"
+	"    ]\n"
+	"  },\n"
+	"  {\n"
+	"    \"hostnqn\":\"nqn.2014-08.org.nvmexpress:uuid:test-host-0\",\n"
+	"    \"subsystems\":[\n"
+	"      {\n"
+	"        \"nqn\":\"nqn.2014-08.org.nvmexpress:test-c\"\n"
+	"      }\n"
+	"    ]\n"
+	"  }\n"
+	"]";
+
+static char test_dir[] = "/tmp/libnvme-json-XXXXXX";
+
+static void test_path(char *path, const char *name)
+{
+	snprintf(path, PATH_MAX, "%s/%s", test_dir, name);
+}
+
+static void write_file(const char *path, const char *buf, size_t len)
+{
+	FILE *f = fopen(path, "w");
+
+	assert(f);
+	assert(fwrite(buf, 1, len, f) == len);
+	assert(!fclose(f));
+}
+
+static char *read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "r");
+	char *buf;
+	long size;
+
+	assert(f);
+	assert(!fseek(f, 0, SEEK_END));
+	size = ftell(f);
+	assert(size >= 0);
+	rewind(f);
+	buf = malloc(size + 1);
+	assert(buf);
+	assert(fread(buf, 1, size, f) == (size_t)size);
+	buf[size] = '\0';
+	fclose(f);
+	*len = size;
+	return buf;
+}
+
+static nvme_root_t read_config(const char *buf, int *ret)
+{
+	char path[PATH_MAX];
+	nvme_root_t r;
+
+	test_path(path, "in.json");
+	write_file(path, buf, strlen(buf));
+	r = nvme_create_root(NULL, LOG_CRIT);
+	assert(r);
+	*ret = json_read_config(r, path);
+	return r;
+}
+
+static nvme_ctrl_t find_ctrl(nvme_root_t r, const char *traddr)
+{
+	nvme_subsystem_t s;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+
+	nvme_for_each_host(r, h)
+		nvme_for_each_subsystem(h, s)
+			nvme_subsystem_for_each_ctrl(s, c)
+				if (!strcmp(nvme_ctrl_get_traddr(c), traddr))
+					return c;
+	return NULL;
+}
+
+static void test_round_trip(void)
+{
+	char path[PATH_MAX];
+	struct stat st1, st2;
+	nvme_root_t r;
+	size_t len;
+	char *buf;
+	int ret;
+
+	r = read_config(test_config, &ret);
+	assert(!ret);
+	test_path(path, "out.json");
+	assert(!json_update_config(r, path));
+	buf = read_file(path, &len);
+	assert(len == strlen(test_config) && !strcmp(buf, test_config));
+	free(buf);
+
+	/* the same config again is not written */
+	assert(!stat(path, &st1));
+	assert(!json_update_config(r, path));
+	assert(!stat(path, &st2));
+	assert(st1.st_ino == st2.st_ino);
+	nvme_free_tree(r);
+
+	/* and reading what was written gives the same file */
+	buf = read_file(path, &len);
+	r = read_config(buf, &ret);
+	free(buf);
+	assert(!ret);
+	assert(!json_update_config(r, path));
+	buf = read_file(path, &len);
+	assert(!strcmp(buf, test_config));
+	free(buf);
+	nvme_free_tree(r);
+
+	printf("round trip OK\n");
+}
+
+static void test_options(void)
+{
+	struct nvme_fabrics_config *cfg;
+	nvme_root_t r;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	int ret;
+
+	r = read_config(test_config, &ret);
+	assert(!ret);
+
+	h = nvme_first_host(r);
+	assert(!strcmp(nvme_host_get_hostnqn(h),
+		       "nqn.2014-08.org.nvmexpress:uuid:test-host-1"));
+	assert(!strcmp(nvme_host_get_hostsymname(h), "host one"));
+	assert(!strcmp(nvme_host_get_dhchap_key(h), "DHHC-1:00:aG9zdC1rZXk=:"));
+
+	c = find_ctrl(r, "192.168.1.2");
+	assert(c);
+	cfg = nvme_ctrl_get_config(c);
+	assert(cfg->nr_io_queues == 4);
+	assert(cfg->keep_alive_tmo == 15);
+	assert(cfg->ctrl_loss_tmo == 30);
+	assert(cfg->tos == 3);
+	assert(cfg->hdr_digest && !cfg->data_digest);
+	assert(cfg->tls);
+	assert(nvme_ctrl_is_persistent(c));
+	assert(!nvme_ctrl_is_discovery_ctrl(c));
+	assert(!strcmp(nvme_ctrl_get_host_traddr(c), "192.168.1.100"));
+	assert(!strcmp(nvme_ctrl_get_dhchap_key(c), "DHHC-1:00:Y3RybC1rZXk=:"));
+
+	c = find_ctrl(r, "192.168.1.1");
+	assert(c);
+	cfg = nvme_ctrl_get_config(c);
+	assert(cfg->ctrl_loss_tmo == NVMF_DEF_CTRL_LOSS_TMO);
+	assert(cfg->tos == -1);
+	assert(!cfg->tls);
+	assert(!nvme_ctrl_is_persistent(c));
+
+	c = find_ctrl(r, "10.0.0.1");
+	assert(c && nvme_ctrl_is_discovery_ctrl(c));
+	nvme_free_tree(r);
+
+	/* numbers and booleans may be given as strings */
+	r = read_config("[{\"hostnqn\":\"nqn.h\",\"subsystems\":[{\"nqn\":"
+			"\"nqn.s\",\"ports\":[{\"transport\":\"tcp\","
+			"\"traddr\":\"1.2.3.4\",\"queue_size\":\"64\","
+			"\"ctrl_loss_tmo\":\"-1\",\"data_digest\":\"yes\","
+			"\"persistent\":false}]}]}]", &ret);
+	assert(!ret);
+	c = find_ctrl(r, "1.2.3.4");
+	assert(c);
+	cfg = nvme_ctrl_get_config(c);
+	assert(cfg->queue_size == 64);
+	assert(cfg->ctrl_loss_tmo == -1);
+	assert(cfg->data_digest);
+	assert(!nvme_ctrl_is_persistent(c));
+	nvme_free_tree(r);
+
+	printf("options OK\n");
+}
+
+static void test_escapes(void)
+{
+	static const char decoded[] =
+		"\"q\"\\/\b\f\n\r\tA\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80";
+	static const char *const invalid[] = {
+		"\"\\x\"", "\"\\u12g4\"", "\"\\u12\"", "\"a\tb\"", "\"open",
+		"\"\\",
+	};
+	char path[PATH_MAX], buf[256];
+	nvme_root_t r;
+	size_t len, i;
+	char *out;
+	int ret;
+
+	r = read_config("[{\"hostnqn\":\"nqn.h\",\"hostsymname\":"
+			"\"\\\"q\\\"\\\\\\/\\b\\f\\n\\r\\t\\u0041\\u00e9"
+			"\\u20AC\\ud83d\\ude00\"}]", &ret);
+	assert(!ret);
+	assert(!strcmp(nvme_host_get_hostsymname(nvme_first_host(r)),
+		       decoded));
+
+	/* written escaped again, and read back to the same string */
+	test_path(path, "escaped.json");
+	assert(!json_update_config(r, path));
+	nvme_free_tree(r);
+	out = read_file(path, &len);
+	r = read_config(out, &ret);
+	free(out);
+	assert(!ret);
+	assert(!strcmp(nvme_host_get_hostsymname(nvme_first_host(r)),
+		       decoded));
+	nvme_free_tree(r);
+
+	for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		snprintf(buf, sizeof(buf), "[{\"hostnqn\":\"nqn.h\","
+			 "\"hostsymname\":%s}]", invalid[i]);
+		r = read_config(buf, &ret);
+		assert(ret == -1 && errno == EPROTO);
+		assert(!nvme_first_host(r));
+		nvme_free_tree(r);
+	}
+
+	printf("escapes OK\n");
+}
+
+static void test_depth(void)
+{
+	char buf[256], *p;
+	nvme_root_t r;
+	int depth, ret;
+
+	/* JSON_MAX_DEPTH containers may be nested, one more is an error */
+	for (depth = 31; depth <= 33; depth++) {
+		p = buf;
+		p += sprintf(p, "[{\"hostnqn\":\"nqn.h\",\"x\":");
+		memset(p, '[', depth - 2);
+		p += depth - 2;
+		memset(p, ']', depth - 2);
+		p += depth - 2;
+		strcpy(p, "}]");
+
+		r = read_config(buf, &ret);
+		if (depth <= 32) {
+			assert(!ret);
+			assert(nvme_first_host(r));
+		} else {
+			assert(ret == -1 && errno == EPROTO);
+			assert(!nvme_first_host(r));
+		}
+		nvme_free_tree(r);
+	}
+
+	printf("depth OK\n");
+}
+
+static void test_syntax_error(void)
+{
+	/* the error is at the unquoted key, after a complete host */
+	static const char bad[] =
+		"[{\"hostnqn\":\"nqn.h1\",\"subsystems\":[{\"nqn\":\"nqn.s\","
+		"\"ports\":[{\"transport\":\"tcp\",\"traddr\":\"1.2.3.4\"}]}]},"
+		"{\"hostnqn\":\"nqn.h2\", oops}]";
+	char path[PATH_MAX], expect[64], log[512];
+	nvme_root_t r;
+	int ret;
+	size_t n;
+	FILE *fp;
+
+	test_path(path, "bad.json");
+	write_file(path, bad, strlen(bad));
+	fp = tmpfile();
+	assert(fp);
+	r = nvme_create_root(fp, LOG_DEBUG);
+	assert(r);
+
+	errno = 0;
+	assert(json_read_config(r, path) == -1 && errno == EPROTO);
+	/* nothing of the valid part in front of the error was applied */
+	assert(!nvme_first_host(r));
+
+	fflush(fp);
+	rewind(fp);
+	n = fread(log, 1, sizeof(log) - 1, fp);
+	log[n] = '\0';
+	snprintf(expect, sizeof(expect), "syntax error at offset %zu",
+		 (size_t)(strstr(bad, "oops") - bad));
+	assert(strstr(log, expect));
+
+	nvme_free_tree(r);
+	fclose(fp);
+
+	/* trailing data */
+	r = read_config("[] []", &ret);
+	assert(ret == -1 && errno == EPROTO);
+	nvme_free_tree(r);
+
+	printf("syntax error OK\n");
+}
+
+static void test_unknown_keys(void)
+{
+	char path[PATH_MAX];
+	nvme_subsystem_t s;
+	nvme_root_t r;
+	nvme_host_t h;
+	nvme_ctrl_t c;
+	size_t len;
+	char *out;
+	int ret;
+
+	r = read_config("[{\"unknown\":{\"hostnqn\":\"nqn.x\",\"a\":[1,2.5,"
+			"null,{\"b\":[]}]},\"hostnqn\":\"nqn.h\",\"subsystems\":"
+			"[{\"nqn\":\"nqn.s\",\"extra\":[{\"nqn\":\"nqn.y\"}],"
+			"\"ports\":[{\"transport\":\"tcp\",\"traddr\":\"1.2.3.4\","
+			"\"bogus_option\":7,\"nested\":{\"traddr\":\"5.6.7.8\"}}]},"
+			"42,\"str\"]},\"stray\",[]]", &ret);
+	assert(!ret);
+
+	h = nvme_first_host(r);
+	assert(h && !nvme_next_host(r, h));
+	assert(!strcmp(nvme_host_get_hostnqn(h), "nqn.h"));
+	s = nvme_first_subsystem(h);
+	assert(s && !nvme_next_subsystem(h, s));
+	assert(!strcmp(nvme_subsystem_get_nqn(s), "nqn.s"));
+	c = nvme_subsystem_first_ctrl(s);
+	assert(c && !nvme_subsystem_next_ctrl(s, c));
+	assert(!strcmp(nvme_ctrl_get_traddr(c), "1.2.3.4"));
+
+	/* and they are not written back */
+	test_path(path, "unknown.json");
+	assert(!json_update_config(r, path));
+	out = read_file(path, &len);
+	assert(!strstr(out, "unknown") && !strstr(out, "bogus") &&
+	       !strstr(out, "nested") && !strstr(out, "extra"));
+	free(out);
+	nvme_free_tree(r);
+
+	/* a top-level object is not a list of hosts */
+	r = read_config("{\"hostnqn\":\"nqn.h\"}", &ret);
+	assert(!ret && !nvme_first_host(r));
+	nvme_free_tree(r);
+
+	printf("unknown keys OK\n");
+}
+
+int main(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	assert(mkdtemp(test_dir));
+
+	test_round_trip();
+	test_options();
+	test_escapes();
+	test_depth();
+	test_syntax_error();
+	test_unknown_keys();
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", test_dir);
+	if (system(cmd))
+		fprintf(stderr, "failed to remove %s\n", test_dir);
+	return EXIT_SUCCESS;
+}
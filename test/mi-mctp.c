@@ -8,12 +8,16 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 
+#if HAVE_LINUX_MCTP_H
+#include <linux/mctp.h>
+#endif
 
 #include <ccan/array_size/array_size.h>
 #include <ccan/endian/endian.h>
@@ -53,6 +57,8 @@ static struct test_peer {
 	size_t		tx_buf_len;
 	ssize_t		tx_rc; /* if zero, return the recvmsg len */
 	int		tx_errno;
+	/* tx_buf was peeked at, and stays queued for the next recvmsg */
+	bool		tx_peeked;
 
 	/* Optional, called before TX, may set tx_buf according to request.
 	 * Return value stored in tx_res, may be used by test */
@@ -63,6 +69,11 @@ static struct test_peer {
 	poll_test_fn	poll_fn;
 	void		*poll_data;
 
+	/* tag ioctls issued by libnvme */
+	int		nr_tag_allocs;
+	int		nr_tag_drops;
+	int		tag_alloc_errno;
+
 	/* store sd from socket() setup */
 	int		sd;
 } test_peer;
@@ -128,7 +139,9 @@ ssize_t __wrap_recvmsg(int sd, struct msghdr *hdr, int flags)
 
 	assert(sd == test_peer.sd);
 
-	if (test_peer.tx_fn) {
+	if (test_peer.tx_peeked) {
+		/* the message is already set up */
+	} else if (test_peer.tx_fn) {
 		test_peer.tx_fn_res = test_peer.tx_fn(&test_peer,
 						   test_peer.rx_buf,
 						   test_peer.rx_buf_len);
@@ -152,6 +165,7 @@ ssize_t __wrap_recvmsg(int sd, struct msghdr *hdr, int flags)
 		memcpy(iov->iov_base, test_peer.tx_buf + pos, len);
 		pos += len;
 	}
+	test_peer.tx_peeked = flags & MSG_PEEK;
 
 	errno = test_peer.tx_errno;
 
@@ -175,10 +189,16 @@ int test_ioctl_tag(int sd, unsigned long req, struct mctp_ioc_tag_ctl *ctl)
 
 	switch (req) {
 	case SIOCMCTPALLOCTAG:
+		test_peer.nr_tag_allocs++;
+		if (test_peer.tag_alloc_errno) {
+			errno = test_peer.tag_alloc_errno;
+			return -1;
+		}
 		ctl->tag = 1 | MCTP_TAG_PREALLOC | MCTP_TAG_OWNER;
 		break;
 	case SIOCMCTPDROPTAG:
-		assert(tag == 1 | MCTP_TAG_PREALLOC | MCTP_TAG_OWNER);
+		assert(ctl->tag == (1 | MCTP_TAG_PREALLOC | MCTP_TAG_OWNER));
+		test_peer.nr_tag_drops++;
 		break;
 	};
 
@@ -404,6 +424,121 @@ static void test_poll_timeout(nvme_mi_ep_t ep, struct test_peer *peer)
 	assert(errno == ETIMEDOUT);
 }
 
+#ifdef SIOCMCTPALLOCTAG
+/* test: tags are kept across requests, but dropped after a timeout */
+static void test_tag_reuse(nvme_mi_ep_t ep, struct test_peer *peer)
+{
+	struct nvme_mi_read_nvm_ss_info ss_info;
+	int rc, i;
+
+	peer->tx_buf_len = 8 + 32;
+
+	/* once a tag is allocated, it is used for all further requests */
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	peer->nr_tag_allocs = 0;
+	for (i = 0; i < 3; i++) {
+		rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+		assert(rc == 0);
+	}
+	assert(peer->nr_tag_allocs == 0);
+	assert(peer->nr_tag_drops == 0);
+
+	peer->poll_fn = poll_fn_timeout;
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc != 0);
+	assert(errno == ETIMEDOUT);
+	assert(peer->nr_tag_drops == 1);
+
+	peer->poll_fn = NULL;
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	assert(peer->nr_tag_allocs == 1);
+}
+
+/* test: a transient allocation failure doesn't disable tag allocation */
+static void test_tag_alloc_busy(nvme_mi_ep_t ep, struct test_peer *peer)
+{
+	struct nvme_mi_read_nvm_ss_info ss_info;
+	int rc;
+
+	peer->tx_buf_len = 8 + 32;
+
+	/* drop the tag kept from earlier requests */
+	peer->poll_fn = poll_fn_timeout;
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc != 0);
+	peer->poll_fn = NULL;
+
+	peer->nr_tag_allocs = 0;
+	peer->tag_alloc_errno = EBUSY;
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	assert(peer->nr_tag_allocs == 1);
+
+	peer->tag_alloc_errno = 0;
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	assert(peer->nr_tag_allocs == 2);
+}
+#endif
+
+/* test: adaptive timeouts follow the latency history */
+static int poll_fn_adaptive(struct test_peer *peer, struct pollfd *fds,
+			    nfds_t nfds, int timeout)
+{
+	int *expected = peer->poll_data;
+
+	assert(timeout == *expected);
+	return 1;
+}
+
+static void test_adaptive_timeout(nvme_mi_ep_t ep, struct test_peer *peer)
+{
+	struct nvme_mi_read_nvm_ss_info ss_info;
+	struct nvme_mi_latency_stats stats;
+	int rc, i, expected;
+
+	peer->tx_buf_len = 8 + 32;
+	peer->poll_fn = poll_fn_adaptive;
+	peer->poll_data = &expected;
+
+	nvme_mi_ep_reset_latency_stats(ep);
+	nvme_mi_ep_set_timeout(ep, 5000);
+	assert(nvme_mi_ep_set_adaptive_timeout(ep, 101, 4) == -1);
+	rc = nvme_mi_ep_set_adaptive_timeout(ep, 99, 4);
+	assert(rc == 0);
+
+	rc = nvme_mi_ep_get_latency_stats(ep, NVME_MI_MT_MI,
+					  nvme_mi_mi_opcode_mi_data_read,
+					  &stats);
+	assert(rc == -1 && errno == ENOENT);
+
+	/* the configured timeout applies until there is enough history */
+	expected = 5000;
+	for (i = 0; i < 8; i++) {
+		rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+		assert(rc == 0);
+	}
+
+	rc = nvme_mi_ep_get_latency_stats(ep, NVME_MI_MT_MI,
+					  nvme_mi_mi_opcode_mi_data_read,
+					  &stats);
+	assert(rc == 0);
+	assert(stats.count == 8 && stats.timeouts == 0);
+	assert(stats.min_us <= stats.p50_us && stats.p99_us <= stats.max_us);
+
+	/* the mocked peer responds instantly, so we're at the floor */
+	expected = 100;
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+
+	nvme_mi_ep_set_adaptive_timeout(ep, 0, 0);
+	expected = 5000;
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+}
+
 /* test: send a More Processing Required response, then the actual response */
 struct mpr_tx_info {
 	int msg_no;
@@ -590,6 +725,47 @@ static void test_mpr_timeout_clamp(nvme_mi_ep_t ep, struct test_peer *peer)
 	assert(rc == 0);
 }
 
+/* test: adaptive timeouts don't shorten the wait the MPR response asks for */
+static void test_mpr_adaptive(nvme_mi_ep_t ep, struct test_peer *peer)
+{
+	struct nvme_mi_read_nvm_ss_info ss_info;
+	struct mpr_poll_info poll_info;
+	struct mpr_tx_info tx_info;
+	int rc, i;
+
+	nvme_mi_ep_reset_latency_stats(ep);
+	nvme_mi_ep_set_timeout(ep, 3141);
+	nvme_mi_ep_set_mprt_max(ep, 123400);
+	rc = nvme_mi_ep_set_adaptive_timeout(ep, 99, 4);
+	assert(rc == 0);
+
+	/* the mocked peer responds instantly, this puts us at the floor */
+	peer->tx_buf_len = 8 + 32;
+	for (i = 0; i < 8; i++) {
+		rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+		assert(rc == 0);
+	}
+
+	tx_info.msg_no = 1;
+	tx_info.final_len = sizeof(struct nvme_mi_mi_resp_hdr) + sizeof(ss_info);
+
+	poll_info.poll_no = 1;
+	poll_info.mprt = 1234;
+	poll_info.timeouts[0] = 100;
+	poll_info.timeouts[1] = 1234 * 100;
+
+	peer->tx_fn = tx_fn_mpr_poll;
+	peer->tx_data = &tx_info;
+
+	peer->poll_fn = poll_fn_mpr_poll;
+	peer->poll_data = &poll_info;
+
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+
+	nvme_mi_ep_set_adaptive_timeout(ep, 0, 0);
+}
+
 /* test: MPR value of zero doesn't result in poll with zero timeout */
 static void test_mpr_mprt_zero(nvme_mi_ep_t ep, struct test_peer *peer)
 {
@@ -619,6 +795,149 @@ static void test_mpr_mprt_zero(nvme_mi_ep_t ep, struct test_peer *peer)
 	assert(rc == 0);
 }
 
+/*
+ * The asynchronous receive path, as used with both command slots in
+ * flight: the peer sends the queued responses, one per message, in the
+ * order given. The first data byte identifies the response.
+ */
+struct async_resp {
+	int slot;
+	__u8 id;
+};
+
+struct async_tx_info {
+	struct async_resp resps[4];
+	int nr_resps;
+	int next;
+};
+
+struct async_xfer {
+	struct nvme_mi_mi_req_hdr req_hdr;
+	struct nvme_mi_mi_resp_hdr resp_hdr;
+	struct nvme_mi_req req;
+	struct nvme_mi_resp resp;
+	__u8 data[4];
+	struct nvme_mi_xfer xfer;
+};
+
+static int tx_fn_async(struct test_peer *peer, void *buf, size_t len)
+{
+	struct async_tx_info *info = peer->tx_data;
+	struct async_resp *resp;
+
+	assert(info->next < info->nr_resps);
+	resp = &info->resps[info->next++];
+
+	memset(peer->tx_buf, 0, 12);
+	peer->tx_buf[0] = NVME_MI_MSGTYPE_NVME;
+	peer->tx_buf[1] = (NVME_MI_ROR_RSP << 7) | (NVME_MI_MT_MI << 3) |
+		resp->slot;
+	peer->tx_buf[8] = resp->id;
+	peer->tx_buf_len = 12;
+	test_set_tx_mic(peer);
+
+	return 0;
+}
+
+static void async_start(nvme_mi_ep_t ep, struct async_xfer *x, int slot)
+{
+	int rc;
+
+	memset(x, 0, sizeof(*x));
+	x->req_hdr.hdr.type = NVME_MI_MSGTYPE_NVME;
+	x->req_hdr.hdr.nmp = (NVME_MI_ROR_REQ << 7) | (NVME_MI_MT_MI << 3) |
+		slot;
+	x->req_hdr.opcode = nvme_mi_mi_opcode_mi_data_read;
+	x->req.hdr = &x->req_hdr.hdr;
+	x->req.hdr_len = sizeof(x->req_hdr);
+	x->resp.hdr = &x->resp_hdr.hdr;
+	x->resp.hdr_len = sizeof(x->resp_hdr);
+	x->resp.data = x->data;
+	x->resp.data_len = sizeof(x->data);
+	x->xfer.req = &x->req;
+	x->xfer.resp = &x->resp;
+
+	rc = nvme_mi_submit_start(ep, &x->xfer);
+	assert(rc == 0);
+}
+
+/* test: responses in the opposite order complete the matching slots */
+static void test_async_out_of_order(nvme_mi_ep_t ep, struct test_peer *peer)
+{
+	struct async_tx_info tx_info = {
+		.resps = { { 1, 0xb1 }, { 0, 0xa0 } },
+		.nr_resps = 2,
+	};
+	struct nvme_mi_xfer *xfers[2];
+	struct async_xfer x[2];
+	int rc;
+
+	peer->tx_fn = tx_fn_async;
+	peer->tx_data = &tx_info;
+
+	async_start(ep, &x[0], 0);
+	async_start(ep, &x[1], 1);
+	xfers[0] = &x[0].xfer;
+	xfers[1] = &x[1].xfer;
+
+	rc = nvme_mi_submit_wait(ep, xfers, 2, false);
+	assert(rc == 0);
+	assert(!x[0].xfer.done);
+	assert(x[1].xfer.done && x[1].xfer.rc == 0);
+	assert(x[1].data[0] == 0xb1);
+
+	rc = nvme_mi_submit_wait(ep, xfers, 2, false);
+	assert(rc == 0);
+	assert(x[0].xfer.done && x[0].xfer.rc == 0);
+	assert(x[0].data[0] == 0xa0);
+	assert(tx_info.next == 2);
+}
+
+/* test: a response for a slot without a request is dropped */
+static void test_async_idle_slot(nvme_mi_ep_t ep, struct test_peer *peer)
+{
+	struct async_tx_info tx_info = {
+		.resps = { { 1, 0xee }, { 0, 0xa0 } },
+		.nr_resps = 2,
+	};
+	struct nvme_mi_xfer *xfers[1];
+	struct async_xfer x;
+	int rc;
+
+	peer->tx_fn = tx_fn_async;
+	peer->tx_data = &tx_info;
+
+	async_start(ep, &x, 0);
+	xfers[0] = &x.xfer;
+
+	rc = nvme_mi_submit_wait(ep, xfers, 1, false);
+	assert(rc == 0);
+	assert(x.xfer.done && x.xfer.rc == 0);
+	assert(x.data[0] == 0xa0);
+	assert(tx_info.next == 2);
+}
+
+/* test: a receive error completes all requests in flight */
+static void test_async_recv_err(nvme_mi_ep_t ep, struct test_peer *peer)
+{
+	struct nvme_mi_xfer *xfers[2];
+	struct async_xfer x[2];
+	int rc;
+
+	async_start(ep, &x[0], 0);
+	async_start(ep, &x[1], 1);
+	xfers[0] = &x[0].xfer;
+	xfers[1] = &x[1].xfer;
+
+	peer->tx_rc = -1;
+	peer->tx_errno = EIO;
+
+	rc = nvme_mi_submit_wait(ep, xfers, 2, false);
+	assert(rc == -1 && errno == EIO);
+	assert(x[0].xfer.done && x[0].xfer.rc == -1 && x[0].xfer.err == EIO);
+	assert(x[1].xfer.done && x[1].xfer.rc == -1 && x[1].xfer.err == EIO);
+}
+
 #define DEFINE_TEST(name) { #name, test_ ## name }
 struct test {
 	const char *name;
@@ -636,11 +955,20 @@ struct test {
 	DEFINE_TEST(admin_resp_sizes_unaligned),
 	DEFINE_TEST(poll_timeout_value),
 	DEFINE_TEST(poll_timeout),
+	DEFINE_TEST(adaptive_timeout),
+#ifdef SIOCMCTPALLOCTAG
+	DEFINE_TEST(tag_reuse),
+	DEFINE_TEST(tag_alloc_busy),
+#endif
 	DEFINE_TEST(mpr_mi),
 	DEFINE_TEST(mpr_admin),
 	DEFINE_TEST(mpr_timeouts),
 	DEFINE_TEST(mpr_timeout_clamp),
+	DEFINE_TEST(mpr_adaptive),
 	DEFINE_TEST(mpr_mprt_zero),
+	DEFINE_TEST(async_out_of_order),
+	DEFINE_TEST(async_idle_slot),
+	DEFINE_TEST(async_recv_err),
 };
 
 static void run_test(struct test *test, FILE *logfd, nvme_mi_ep_t ep,
@@ -6,11 +6,14 @@
 
 #undef NDEBUG
 #include <assert.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <ccan/array_size/array_size.h>
+#include <ccan/endian/endian.h>
 
 /* we define a custom transport, so need the internal headers */
 #include "nvme/private.h"
@@ -43,7 +46,15 @@ static int test_transport_submit(struct nvme_mi_ep *ep,
 
 	/* start from a minimal response: zeroed data, nmp to match request */
 	memset(resp->hdr, 0, resp->hdr_len);
-	memset(resp->data, 0, resp->data_len);
+	if (resp->data_iov) {
+		int i;
+
+		for (i = 0; i < resp->data_iovcnt; i++)
+			memset(resp->data_iov[i].iov_base, 0,
+			       resp->data_iov[i].iov_len);
+	} else {
+		memset(resp->data, 0, resp->data_len);
+	}
 	resp->hdr->type = NVME_MI_MSGTYPE_NVME;
 	resp->hdr->nmp = req->hdr->nmp | (NVME_MI_ROR_RSP << 7);
 
@@ -82,7 +93,16 @@ static void test_transport_resp_calc_mic(struct nvme_mi_resp *resp)
 	__u32 crc = 0xffffffff;
 
 	crc = nvme_mi_crc32_update(crc, resp->hdr, resp->hdr_len);
-	crc = nvme_mi_crc32_update(crc, resp->data, resp->data_len);
+	if (resp->data_iov) {
+		int i;
+
+		for (i = 0; i < resp->data_iovcnt; i++)
+			crc = nvme_mi_crc32_update(crc,
+						   resp->data_iov[i].iov_base,
+						   resp->data_iov[i].iov_len);
+	} else {
+		crc = nvme_mi_crc32_update(crc, resp->data, resp->data_len);
+	}
 
 	resp->mic = ~crc;
 }
@@ -747,6 +767,563 @@ static void test_mi_config_set_freq_invalid(nvme_mi_ep_t ep)
 	assert(rc == 4);
 }
 
+/* test: log pages larger than a single transfer are split by offset */
+static int test_admin_get_log_split_cb(struct nvme_mi_ep *ep,
+				       struct nvme_mi_req *req,
+				       struct nvme_mi_resp *resp,
+				       void *data)
+{
+	__u32 doff, dlen, lpo, *nr_reqs = data;
+	__u8 *hdr;
+	size_t i;
+
+	hdr = (__u8 *)req->hdr;
+	assert(hdr[4] == nvme_admin_get_log_page);
+
+	doff = hdr[31] << 24 | hdr[30] << 16 | hdr[29] << 8 | hdr[28];
+	dlen = hdr[35] << 24 | hdr[34] << 16 | hdr[33] << 8 | hdr[32];
+	lpo = hdr[55] << 24 | hdr[54] << 16 | hdr[53] << 8 | hdr[52];
+
+	/* each chunk is a separate log page read, at its own offset */
+	assert(doff == 0);
+	assert(dlen <= nvme_mi_ep_get_xfer_size(ep));
+	assert(lpo == *nr_reqs * nvme_mi_ep_get_xfer_size(ep));
+	assert(resp->data_len == dlen);
+
+	for (i = 0; i < dlen; i++)
+		((__u8 *)resp->data)[i] = (lpo + i) & 0xff;
+
+	(*nr_reqs)++;
+	test_transport_resp_calc_mic(resp);
+
+	return 0;
+}
+
+static void test_admin_get_log_split(nvme_mi_ep_t ep)
+{
+	__u8 buf[10000];
+	struct nvme_get_log_args args = {
+		.args_size = sizeof(args),
+		.lid = NVME_LOG_LID_TELEMETRY_CTRL,
+		.log = buf,
+		.len = sizeof(buf),
+	};
+	nvme_mi_ctrl_t ctrl;
+	__u32 nr_reqs;
+	size_t i;
+	int rc;
+
+	test_set_transport_callback(ep, test_admin_get_log_split_cb, &nr_reqs);
+
+	ctrl = nvme_mi_init_ctrl(ep, 5);
+	assert(ctrl);
+
+	nr_reqs = 0;
+	rc = nvme_mi_admin_get_log(ctrl, &args);
+	assert(rc == 0);
+	assert(nr_reqs == 3);
+	for (i = 0; i < sizeof(buf); i++)
+		assert(buf[i] == (i & 0xff));
+
+	assert(nvme_mi_ep_set_xfer_size(ep, 4098) == -1);
+	rc = nvme_mi_ep_set_xfer_size(ep, 8192);
+	assert(rc == 0);
+
+	nr_reqs = 0;
+	memset(buf, 0, sizeof(buf));
+	rc = nvme_mi_admin_get_log(ctrl, &args);
+	assert(rc == 0);
+	assert(nr_reqs == 2);
+	for (i = 0; i < sizeof(buf); i++)
+		assert(buf[i] == (i & 0xff));
+
+	nvme_mi_ep_set_xfer_size(ep, 4096);
+}
+
+/* test: firmware image split into chunks of the endpoint transfer size */
+struct test_fw_download_info {
+	__u8 image[10000];
+	__u32 next;
+	__u32 progress[4];
+	int nr_reqs;
+	int nr_progress;
+	int fail_at;
+};
+
+static int test_admin_fw_download_cb(struct nvme_mi_ep *ep,
+				     struct nvme_mi_req *req,
+				     struct nvme_mi_resp *resp,
+				     void *data)
+{
+	struct test_fw_download_info *info = data;
+	struct nvme_mi_admin_req_hdr *admin_req;
+	struct nvme_mi_admin_resp_hdr *admin_resp;
+	__u32 ndw, ofst;
+
+	assert(req->hdr->type == NVME_MI_MSGTYPE_NVME);
+	assert(req->hdr_len == sizeof(*admin_req));
+	admin_req = (struct nvme_mi_admin_req_hdr *)req->hdr;
+	assert(admin_req->opcode == nvme_admin_fw_download);
+
+	ndw = le32_to_cpu(admin_req->cdw10) + 1;
+	ofst = le32_to_cpu(admin_req->cdw11);
+	assert(req->data_len == ndw << 2);
+	assert(le32_to_cpu(admin_req->dlen) == req->data_len);
+	assert(req->data_len <= 4096);
+
+	/* in-order, contiguous and with the image contents */
+	assert(ofst << 2 == info->next);
+	assert(!memcmp(req->data, info->image + info->next, req->data_len));
+	info->next += req->data_len;
+
+	admin_resp = (struct nvme_mi_admin_resp_hdr *)resp->hdr;
+	if (info->nr_reqs++ == info->fail_at)
+		admin_resp->status = NVME_SC_INVALID_FIELD;
+	resp->data_len = 0;
+
+	test_transport_resp_calc_mic(resp);
+	return 0;
+}
+
+static void test_admin_fw_progress(nvme_mi_ctrl_t ctrl, __u32 done,
+				   __u32 total, void *data)
+{
+	struct test_fw_download_info *info = data;
+
+	assert(total == sizeof(info->image));
+	assert(info->nr_progress < ARRAY_SIZE(info->progress));
+	info->progress[info->nr_progress++] = done;
+}
+
+static void test_admin_fw_download_seq(nvme_mi_ep_t ep)
+{
+	struct test_fw_download_info info = { .fail_at = -1 };
+	nvme_mi_ctrl_t ctrl;
+	size_t i;
+	int rc;
+
+	for (i = 0; i < sizeof(info.image); i++)
+		info.image[i] = i * 3;
+
+	test_set_transport_callback(ep, test_admin_fw_download_cb, &info);
+
+	ctrl = nvme_mi_init_ctrl(ep, 1);
+	assert(ctrl);
+
+	rc = nvme_mi_admin_fw_download_seq(ctrl, info.image,
+					   sizeof(info.image), 0, 0,
+					   test_admin_fw_progress, &info);
+	assert(rc == 0);
+	assert(info.nr_reqs == 3);
+	assert(info.nr_progress == 3);
+	assert(info.progress[0] == 4096);
+	assert(info.progress[1] == 8192);
+	assert(info.progress[2] == sizeof(info.image));
+
+	/* explicit chunk size, stopping at the first failed chunk */
+	memset(info.progress, 0, sizeof(info.progress));
+	info.next = info.nr_reqs = info.nr_progress = 0;
+	info.fail_at = 1;
+	rc = nvme_mi_admin_fw_download_seq(ctrl, info.image,
+					   sizeof(info.image), 3000, 0,
+					   test_admin_fw_progress, &info);
+	assert(rc == NVME_SC_INVALID_FIELD);
+	assert(info.nr_reqs == 2);
+	assert(info.nr_progress == 1 && info.progress[0] == 3000);
+
+	/* unaligned chunks can't be expressed in dwords */
+	rc = nvme_mi_admin_fw_download_seq(ctrl, info.image, 1002, 0, 0,
+					   NULL, NULL);
+	assert(rc == -1 && errno == EINVAL);
+
+	nvme_mi_close_ctrl(ctrl);
+}
+
+/* test: health status of all endpoints, with one completing
+ * asynchronously through a pipe */
+struct test_async_transport_data {
+	struct test_transport_data tpd;
+	int fds[2];
+	struct nvme_mi_xfer *xfer;
+};
+
+static int test_async_transport_send(struct nvme_mi_ep *ep,
+				     struct nvme_mi_xfer *xfer)
+{
+	struct test_async_transport_data *tad = ep->transport_data;
+	char c = 0;
+
+	assert(!tad->xfer);
+	tad->xfer = xfer;
+	assert(write(tad->fds[1], &c, 1) == 1);
+	return 0;
+}
+
+static int test_async_transport_recv(struct nvme_mi_ep *ep,
+				     struct nvme_mi_xfer **xfers, int nr,
+				     bool nowait)
+{
+	struct test_async_transport_data *tad = ep->transport_data;
+	struct nvme_mi_xfer *xfer = tad->xfer;
+	char c;
+
+	assert(nr == 1 && xfers[0] == xfer);
+	assert(read(tad->fds[0], &c, 1) == 1);
+
+	xfer->rc = test_transport_submit(ep, xfer->req, xfer->resp);
+	xfer->done = true;
+	tad->xfer = NULL;
+	return 0;
+}
+
+static int test_async_transport_get_fd(struct nvme_mi_ep *ep)
+{
+	struct test_async_transport_data *tad = ep->transport_data;
+
+	return tad->fds[0];
+}
+
+static void test_async_transport_close(struct nvme_mi_ep *ep)
+{
+	struct test_async_transport_data *tad = ep->transport_data;
+
+	close(tad->fds[0]);
+	close(tad->fds[1]);
+	free(tad);
+}
+
+static const struct nvme_mi_transport test_async_transport = {
+	.name = "test-mi-async",
+	.mic_enabled = true,
+	.submit = test_transport_submit,
+	.send = test_async_transport_send,
+	.recv = test_async_transport_recv,
+	.get_fd = test_async_transport_get_fd,
+	.close = test_async_transport_close,
+	.desc_ep = test_transport_desc_ep,
+};
+
+static int test_health_poll_cb(struct nvme_mi_ep *ep,
+			       struct nvme_mi_req *req,
+			       struct nvme_mi_resp *resp,
+			       void *data)
+{
+	struct nvme_mi_nvm_ss_health_status *sshs = resp->data;
+	__u8 *hdr = (__u8 *)req->hdr;
+
+	assert(hdr[4] == nvme_mi_mi_opcode_subsys_health_status_poll);
+	assert(resp->data_len == sizeof(*sshs));
+	sshs->ctemp = (uintptr_t)data;
+
+	test_transport_resp_calc_mic(resp);
+	return 0;
+}
+
+struct test_health_poll_results {
+	nvme_mi_ep_t eps[2];
+	int nr[2];
+};
+
+static void test_health_status_cb(nvme_mi_ep_t ep, int rc,
+				  struct nvme_mi_nvm_ss_health_status *sshs,
+				  void *data)
+{
+	struct test_health_poll_results *res = data;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (res->eps[i] != ep)
+			continue;
+		assert(rc == 0);
+		assert(sshs->ctemp == 40 + i);
+		res->nr[i]++;
+		return;
+	}
+	assert(0);
+}
+
+static void test_health_status_poll_all(nvme_mi_ep_t ep)
+{
+	struct test_health_poll_results res = { 0 };
+	struct test_async_transport_data *tad;
+	nvme_mi_ep_t ep2;
+	int rc;
+
+	ep2 = nvme_mi_init_ep(ep->root);
+	assert(ep2);
+	tad = calloc(1, sizeof(*tad));
+	assert(tad);
+	tad->tpd.magic = test_transport_magic;
+	assert(!pipe(tad->fds));
+	ep2->transport = &test_async_transport;
+	ep2->transport_data = tad;
+
+	test_set_transport_callback(ep, test_health_poll_cb, (void *)40);
+	test_set_transport_callback(ep2, test_health_poll_cb, (void *)41);
+	res.eps[0] = ep;
+	res.eps[1] = ep2;
+
+	rc = nvme_mi_mi_subsystem_health_status_poll_all(ep->root, false,
+							 test_health_status_cb,
+							 &res);
+	assert(rc == 0);
+	assert(res.nr[0] == 1 && res.nr[1] == 1);
+
+	nvme_mi_close(ep2);
+}
+
+/* test: cached MI data, revalidated by health status change flags */
+struct test_data_cache_info {
+	int nr_reqs;
+	__u16 ccs;
+	bool new_list;
+};
+
+static int test_data_cache_cb(struct nvme_mi_ep *ep,
+			      struct nvme_mi_req *req,
+			      struct nvme_mi_resp *resp,
+			      void *data)
+{
+	struct test_data_cache_info *info = data;
+	__u8 *hdr, *buf;
+
+	hdr = (__u8 *)req->hdr;
+	buf = (__u8 *)resp->data;
+	memset(buf, 0, resp->data_len);
+
+	if (hdr[4] == nvme_mi_mi_opcode_subsys_health_status_poll) {
+		struct nvme_mi_nvm_ss_health_status *sshs = resp->data;
+
+		sshs->ccs = cpu_to_le16(info->ccs);
+	} else {
+		assert(hdr[4] == nvme_mi_mi_opcode_mi_data_read);
+		info->nr_reqs++;
+
+		if (hdr[11] == nvme_mi_dtyp_ctrl_list) {
+			if (info->new_list) {
+				buf[0] = 2; /* num controllers */
+				buf[2] = 4; /* id 4 */
+				buf[4] = 6; /* id 6 */
+			} else {
+				buf[0] = 3;
+				buf[2] = 1;
+				buf[4] = 4;
+				buf[6] = 5;
+			}
+		} else {
+			buf[0] = 1; /* NUMP */
+			buf[1] = 1; /* MJR */
+		}
+	}
+
+	test_transport_resp_calc_mic(resp);
+	return 0;
+}
+
+static void test_data_cache(nvme_mi_ep_t ep)
+{
+	struct nvme_mi_nvm_ss_health_status sshs;
+	struct test_data_cache_info info = { 0 };
+	struct nvme_mi_read_nvm_ss_info ss_info;
+	struct nvme_mi_ctrl *ctrl, *tmp, *ctrl4;
+	int rc;
+
+	nvme_mi_for_each_ctrl_safe(ep, ctrl, tmp)
+		nvme_mi_close_ctrl(ctrl);
+	ep->controllers_scanned = false;
+
+	test_set_transport_callback(ep, test_data_cache_cb, &info);
+	nvme_mi_ep_set_data_cache(ep, true);
+
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	assert(ss_info.nump == 1);
+	assert(info.nr_reqs == 1);
+
+	rc = nvme_mi_scan_ep(ep, false);
+	assert(rc == 0);
+	assert(info.nr_reqs == 2);
+	ctrl4 = nvme_mi_next_ctrl(ep, nvme_mi_first_ctrl(ep));
+	assert(ctrl4 && ctrl4->id == 4);
+
+	/* unrelated changes keep the cache */
+	info.ccs = NVME_MI_CCS_CTEMP;
+	rc = nvme_mi_mi_subsystem_health_status_poll(ep, false, &sshs);
+	assert(rc == 0);
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	rc = nvme_mi_scan_ep(ep, false);
+	assert(rc == 0);
+	assert(info.nr_reqs == 2);
+
+	/* a subsystem reset drops it; surviving controllers are kept */
+	info.ccs = NVME_MI_CCS_NSSRO;
+	info.new_list = true;
+	rc = nvme_mi_mi_subsystem_health_status_poll(ep, false, &sshs);
+	assert(rc == 0);
+	rc = nvme_mi_mi_read_mi_data_subsys(ep, &ss_info);
+	assert(rc == 0);
+	assert(info.nr_reqs == 3);
+	rc = nvme_mi_scan_ep(ep, false);
+	assert(rc == 0);
+	assert(info.nr_reqs == 4);
+
+	ctrl = nvme_mi_first_ctrl(ep);
+	assert(ctrl == ctrl4);
+	ctrl = nvme_mi_next_ctrl(ep, ctrl);
+	assert(ctrl && ctrl->id == 6);
+	assert(!nvme_mi_next_ctrl(ep, ctrl));
+
+	nvme_mi_ep_set_data_cache(ep, false);
+	nvme_mi_for_each_ctrl_safe(ep, ctrl, tmp)
+		nvme_mi_close_ctrl(ctrl);
+}
+
+/* bitwise reference for the optimised CRC implementations */
+/* test: vectored admin payloads are passed through, and covered by the MIC */
+static int test_admin_xfer_iov_cb(struct nvme_mi_ep *ep,
+				  struct nvme_mi_req *req,
+				  struct nvme_mi_resp *resp,
+				  void *data)
+{
+	extern __u32 nvme_mi_crc32_update(__u32 crc, void *data, size_t len);
+	__u8 buf[32];
+	__u32 crc;
+	int i, j;
+
+	if (req->data_len) {
+		assert(req->data_iov && req->data_iovcnt == 3);
+		assert(req->data_len == 12);
+
+		nvme_mi_data_read(req->data, req->data_iov, req->data_iovcnt,
+				  0, buf, req->data_len);
+		for (i = 0; i < 12; i++)
+			assert(buf[i] == i);
+
+		crc = nvme_mi_crc32_update(0xffffffff, req->hdr, req->hdr_len);
+		crc = nvme_mi_crc32_update(crc, buf, req->data_len);
+		assert(req->mic == ~crc);
+		resp->data_len = 0;
+	} else {
+		/* only the requested part of the vectors is exposed */
+		assert(resp->data_iov && resp->data_iovcnt == 2);
+		assert(resp->data_len == 12);
+		for (i = 0, j = 0; i < resp->data_iovcnt; i++) {
+			__u8 *p = resp->data_iov[i].iov_base;
+			size_t k;
+
+			for (k = 0; k < resp->data_iov[i].iov_len; k++)
+				p[k] = 0xa0 + j++;
+		}
+		assert(j == 12);
+	}
+
+	test_transport_resp_calc_mic(resp);
+	return 0;
+}
+
+static void test_admin_xfer_iov(nvme_mi_ep_t ep)
+{
+	struct nvme_mi_admin_resp_hdr resp;
+	struct nvme_mi_admin_req_hdr req;
+	__u8 a[4], b[2], c[6], d[16];
+	struct iovec iov[3];
+	nvme_mi_ctrl_t ctrl;
+	size_t len;
+	int i, rc;
+
+	test_set_transport_callback(ep, test_admin_xfer_iov_cb, NULL);
+
+	ctrl = nvme_mi_init_ctrl(ep, 1);
+	assert(ctrl);
+
+	for (i = 0; i < 12; i++) {
+		__u8 *p = i < 4 ? &a[i] : i < 6 ? &b[i - 4] : &c[i - 6];
+		*p = i;
+	}
+	iov[0] = (struct iovec){ .iov_base = a, .iov_len = sizeof(a) };
+	iov[1] = (struct iovec){ .iov_base = b, .iov_len = sizeof(b) };
+	iov[2] = (struct iovec){ .iov_base = c, .iov_len = sizeof(c) };
+
+	memset(&req, 0, sizeof(req));
+	len = 0;
+	rc = nvme_mi_admin_xfer_iov(ctrl, &req, iov, 3, &resp, 0, NULL, 0,
+				    &len);
+	assert(rc == 0);
+
+	/* response of 12 bytes spread over a 4-byte and a 16-byte segment */
+	memset(a, 0, sizeof(a));
+	memset(d, 0, sizeof(d));
+	iov[0] = (struct iovec){ .iov_base = a, .iov_len = sizeof(a) };
+	iov[1] = (struct iovec){ .iov_base = d, .iov_len = sizeof(d) };
+	iov[2] = (struct iovec){ .iov_base = c, .iov_len = sizeof(c) };
+
+	memset(&req, 0, sizeof(req));
+	len = 12;
+	rc = nvme_mi_admin_xfer_iov(ctrl, &req, NULL, 0, &resp, 0, iov, 3,
+				    &len);
+	assert(rc == 0);
+	assert(len == 12);
+	for (i = 0; i < 4; i++)
+		assert(a[i] == 0xa0 + i);
+	for (i = 0; i < 8; i++)
+		assert(d[i] == 0xa4 + i);
+	assert(d[8] == 0);
+
+	/* more than the vectors can hold */
+	len = 32;
+	rc = nvme_mi_admin_xfer_iov(ctrl, &req, NULL, 0, &resp, 0, iov, 2,
+				    &len);
+	assert(rc != 0);
+
+	nvme_mi_close_ctrl(ctrl);
+}
+
+static __u32 test_crc32c_ref(__u32 crc, const __u8 *data, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+	}
+	return crc;
+}
+
+static void test_crc32c(nvme_mi_ep_t ep)
+{
+	extern __u32 nvme_mi_crc32_update(__u32 crc, void *data, size_t len);
+	char check[] = "123456789";
+	__u8 buf[4096 + 16];
+	size_t off, len;
+	__u32 crc;
+
+	/* standard check value of CRC-32C */
+	crc = ~nvme_mi_crc32_update(0xffffffff, check, strlen(check));
+	assert(crc == 0xe3069283);
+
+	for (len = 0; len < sizeof(buf); len++)
+		buf[len] = len * 7 + (len >> 8);
+
+	/* every short length at every alignment, then some long ones */
+	for (off = 0; off < 16; off++) {
+		for (len = 0; len < 64; len++)
+			assert(nvme_mi_crc32_update(0x12345678, buf + off, len) ==
+			       test_crc32c_ref(0x12345678, buf + off, len));
+		for (len = 1000; len <= 4096; len += 1031)
+			assert(nvme_mi_crc32_update(0xffffffff, buf + off, len) ==
+			       test_crc32c_ref(0xffffffff, buf + off, len));
+	}
+
+	/* split updates equal a single one */
+	crc = nvme_mi_crc32_update(0xffffffff, buf, 13);
+	crc = nvme_mi_crc32_update(crc, buf + 13, 3000);
+	assert(crc == test_crc32c_ref(0xffffffff, buf, 3013));
+}
+
 #define DEFINE_TEST(name) { #name, test_ ## name }
 struct test {
 	const char *name;
@@ -769,6 +1346,12 @@ struct test {
 	DEFINE_TEST(mi_config_get_mtu),
 	DEFINE_TEST(mi_config_set_freq),
 	DEFINE_TEST(mi_config_set_freq_invalid),
+	DEFINE_TEST(admin_get_log_split),
+	DEFINE_TEST(admin_fw_download_seq),
+	DEFINE_TEST(health_status_poll_all),
+	DEFINE_TEST(data_cache),
+	DEFINE_TEST(admin_xfer_iov),
+	DEFINE_TEST(crc32c),
 };
 
 static void run_test(struct test *test, FILE *logfd, nvme_mi_ep_t ep)
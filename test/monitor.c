@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Decoding of uevents by the event monitor and resolving them to the
+ * devices of a tree, without hardware: the events are handed to the
+ * monitor as if the kernel had sent them.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libnvme.h>
+#include "nvme/private.h"
+
+#define TEST_HOSTNQN	"nqn.2014-08.org.nvmexpress:uuid:test-monitor-host"
+#define TEST_SUBSYSNQN	"nqn.2014-08.org.nvmexpress:test-monitor"
+
+struct test_events {
+	int nr;
+	struct nvme_monitor_event last;
+};
+
+static void test_cb(nvme_monitor_t m, struct nvme_monitor_event *ev,
+		    void *user_data)
+{
+	struct test_events *te = user_data;
+
+	te->nr++;
+	te->last = *ev;
+}
+
+/* builds "<action>@<devpath>" followed by the KEY=value pairs */
+static size_t test_uevent(char *buf, size_t size, const char *action,
+			  const char *devpath, const char *subsystem,
+			  const char *extra)
+{
+	size_t len;
+
+	len = snprintf(buf, size, "%s@%s", action, devpath) + 1;
+	len += snprintf(buf + len, size - len, "ACTION=%s", action) + 1;
+	len += snprintf(buf + len, size - len, "DEVPATH=%s", devpath) + 1;
+	len += snprintf(buf + len, size - len, "SUBSYSTEM=%s", subsystem) + 1;
+	if (extra)
+		len += snprintf(buf + len, size - len, "%s", extra) + 1;
+	assert(len < size);
+	return len;
+}
+
+static void test_unnamed_ctrl(nvme_monitor_t m, struct test_events *te,
+			      nvme_ctrl_t c)
+{
+	char buf[512];
+	size_t len;
+
+	/* an unnamed controller, as created for a config file entry */
+	assert(!nvme_ctrl_get_name(c));
+
+	len = test_uevent(buf, sizeof(buf), "change",
+			  "/devices/virtual/nvme-fabrics/ctl/nvme7", "nvme",
+			  "NVME_AEN=0x000c0302");
+	assert(nvme_monitor_inject(m, buf, len) == 1);
+	assert(te->nr == 1);
+	assert(te->last.type == NVME_MONITOR_EVENT_AEN);
+	assert(te->last.aen == 0x000c0302);
+	assert(te->last.aen_type == NVME_AER_NOTICE);
+	assert(te->last.aen_lid == NVME_LOG_LID_ANA);
+	assert(!te->last.c && !te->last.n);
+
+	len = test_uevent(buf, sizeof(buf), "add",
+			  "/devices/virtual/nvme-subsystem/nvme-subsys7/nvme7n1",
+			  "block", NULL);
+	assert(nvme_monitor_inject(m, buf, len) == 1);
+	assert(te->nr == 2);
+	assert(te->last.type == NVME_MONITOR_EVENT_ADD);
+	assert(!strcmp(te->last.name, "nvme7n1"));
+	assert(!te->last.c && !te->last.n);
+
+	/* not an nvme device */
+	len = test_uevent(buf, sizeof(buf), "add", "/devices/virtual/block/loop0",
+			  "block", NULL);
+	assert(nvme_monitor_inject(m, buf, len) == 0);
+	assert(te->nr == 2);
+
+	printf("unnamed ctrl OK\n");
+}
+
+int main(void)
+{
+	struct test_events te = { 0 };
+	nvme_subsystem_t s;
+	nvme_monitor_t m;
+	nvme_root_t r;
+	nvme_ctrl_t c;
+	nvme_host_t h;
+
+	r = nvme_create_root(NULL, LOG_CRIT);
+	assert(r);
+	h = nvme_lookup_host(r, TEST_HOSTNQN, NULL);
+	assert(h);
+	s = nvme_lookup_subsystem(h, NULL, TEST_SUBSYSNQN);
+	assert(s);
+	c = nvme_lookup_ctrl(s, "tcp", "192.168.1.1", NULL, NULL, "4420",
+			     NULL);
+	assert(c);
+
+	m = nvme_monitor_create(r);
+	if (!m) {
+		/* no uevent socket, e.g. in a network namespace */
+		fprintf(stderr, "monitor: %s, skipped\n", strerror(errno));
+		nvme_free_tree(r);
+		return 77;
+	}
+	assert(!nvme_monitor_add_callback(m, NVME_MONITOR_EVENT_ALL, test_cb,
+					  &te));
+
+	test_unnamed_ctrl(m, &te, c);
+
+	nvme_monitor_free(m);
+	nvme_free_tree(r);
+	return EXIT_SUCCESS;
+}
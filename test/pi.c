@@ -0,0 +1,263 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Protection information CRCs, with the carry-less multiplication and the
+ * table code, against bitwise references, and generation and verification
+ * of protection information for the supported layouts.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libnvme.h>
+#include "nvme/private.h"
+
+#define TEST_NLB	8
+
+static __u16 test_crc16_ref(__u16 crc, const __u8 *data, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *data++ << 8;
+		for (i = 0; i < 8; i++)
+			crc = (crc << 1) ^ ((crc & 0x8000) ? 0x8bb7 : 0);
+	}
+	return crc;
+}
+
+static __u64 test_crc64_ref(__u64 crc, const __u8 *data, size_t len)
+{
+	int i;
+
+	crc = ~crc;
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^
+				((crc & 1) ? 0x9a6c9329ac4bc9b5ULL : 0);
+	}
+	return ~crc;
+}
+
+static void test_crc(const char *impl)
+{
+	char check[] = "123456789";
+	__u8 buf[4096 + 16];
+	size_t off, len;
+	__u16 crc16;
+	__u64 crc64;
+
+	/* standard check values */
+	assert(nvme_crc16_t10dif(0, check, strlen(check)) == 0xd0db);
+	assert(nvme_crc64_nvme(0, check, strlen(check)) ==
+	       0xae8b14860a799888ULL);
+
+	for (len = 0; len < sizeof(buf); len++)
+		buf[len] = len * 7 + (len >> 8);
+
+	/*
+	 * every short length at every alignment, across the 16 and 64 byte
+	 * folding steps, then some long ones
+	 */
+	for (off = 0; off < 16; off++) {
+		for (len = 0; len < 160; len++) {
+			assert(nvme_crc16_t10dif(0x1234, buf + off, len) ==
+			       test_crc16_ref(0x1234, buf + off, len));
+			assert(nvme_crc64_nvme(0x123456789abcdefULL, buf + off,
+					       len) ==
+			       test_crc64_ref(0x123456789abcdefULL, buf + off,
+					      len));
+		}
+		for (len = 1000; len <= 4096; len += 1031) {
+			assert(nvme_crc16_t10dif(0, buf + off, len) ==
+			       test_crc16_ref(0, buf + off, len));
+			assert(nvme_crc64_nvme(0, buf + off, len) ==
+			       test_crc64_ref(0, buf + off, len));
+		}
+	}
+
+	/* split updates equal a single one */
+	crc16 = nvme_crc16_t10dif(0, buf, 13);
+	crc16 = nvme_crc16_t10dif(crc16, buf + 13, 3000);
+	assert(crc16 == test_crc16_ref(0, buf, 3013));
+	crc64 = nvme_crc64_nvme(0, buf, 13);
+	crc64 = nvme_crc64_nvme(crc64, buf + 13, 3000);
+	assert(crc64 == test_crc64_ref(0, buf, 3013));
+
+	printf("crc %s OK\n", impl);
+}
+
+/* offset of the protection information of block @i in @data or @meta */
+static __u8 *test_pi(const struct nvme_pi_format *fmt, __u8 *data,
+		     __u8 *meta, unsigned int i, unsigned int pi_size)
+{
+	unsigned int off = fmt->pi_first ? 0 : fmt->ms - pi_size;
+
+	if (fmt->extended)
+		return data + i * (fmt->lba_size + fmt->ms) +
+			fmt->lba_size + off;
+	return meta + i * fmt->ms + off;
+}
+
+static __u64 test_get_be(const __u8 *p, unsigned int len)
+{
+	__u64 v = 0;
+
+	while (len--)
+		v = (v << 8) | *p++;
+	return v;
+}
+
+/* the guard covers the data and the metadata in front of the PI */
+static void test_guard(const struct nvme_pi_format *fmt, __u8 *data,
+		       __u8 *meta, unsigned int i, unsigned int pi_size)
+{
+	unsigned int off = fmt->pi_first ? 0 : fmt->ms - pi_size;
+	__u8 *pi = test_pi(fmt, data, meta, i, pi_size);
+	__u8 *md = pi - off;
+	__u8 *lba = fmt->extended ? md - fmt->lba_size :
+		data + i * fmt->lba_size;
+
+	if (fmt->pif == NVME_PI_GUARD_16)
+		assert(test_get_be(pi, 2) ==
+		       test_crc16_ref(test_crc16_ref(0, lba, fmt->lba_size),
+				      md, off));
+	else
+		assert(test_get_be(pi, 8) ==
+		       test_crc64_ref(test_crc64_ref(0, lba, fmt->lba_size),
+				      md, off));
+}
+
+static int test_verify(const struct nvme_pi_format *fmt, __u8 *data,
+		       __u8 *meta, __u64 reftag, __u32 *block)
+{
+	return nvme_pi_verify(fmt, data, meta, TEST_NLB, reftag, 0x5a5a,
+			      0xffff, 0x2b, NVME_IO_PRINFO_PRCHK_GUARD |
+			      NVME_IO_PRINFO_PRCHK_APP |
+			      NVME_IO_PRINFO_PRCHK_REF, block);
+}
+
+static void test_pi_format(const struct nvme_pi_format *fmt)
+{
+	unsigned int pi_size = fmt->pif == NVME_PI_GUARD_16 ? 8 : 16;
+	unsigned int glen = pi_size == 8 ? 2 : 8;
+	unsigned int tag_bits = pi_size == 8 ? 32 : 48;
+	size_t stride = fmt->lba_size + (fmt->extended ? fmt->ms : 0);
+	size_t data_len = TEST_NLB * stride, meta_len = TEST_NLB * fmt->ms;
+	__u8 *data, *meta, *pi;
+	__u64 reftag = 0xfffffffe;
+	__u32 block;
+	size_t i;
+
+	data = malloc(data_len);
+	meta = malloc(meta_len);
+	assert(data && meta);
+	for (i = 0; i < data_len; i++)
+		data[i] = i * 13 + (i >> 9);
+	for (i = 0; i < meta_len; i++)
+		meta[i] = i * 3;
+
+	assert(!nvme_pi_generate(fmt, data, meta, TEST_NLB, reftag, 0x5a5a,
+				 0x2b));
+	assert(!test_verify(fmt, data, meta, reftag, NULL));
+
+	/* the guard of the last block, in front of its metadata or not */
+	test_guard(fmt, data, meta, TEST_NLB - 1, pi_size);
+
+	/* a corrupted byte of data */
+	data[3 * stride + 7] ^= 0x10;
+	errno = 0;
+	block = ~0;
+	assert(test_verify(fmt, data, meta, reftag, &block) == -1);
+	assert(errno == EILSEQ && block == 3);
+	data[3 * stride + 7] ^= 0x10;
+
+	/* reference tags count up, except for Type 3 */
+	if (fmt->pi_type == NVME_NS_DPS_PI_TYPE3)
+		assert(!test_verify(fmt, data, meta, reftag + 1, NULL));
+	else {
+		assert(test_verify(fmt, data, meta, reftag + 1, &block) == -1);
+		assert(errno == EILSEQ && block == 0);
+	}
+
+	/* a wrong application tag */
+	pi = test_pi(fmt, data, meta, 2, pi_size);
+	pi[glen + 1] ^= 1;
+	assert(test_verify(fmt, data, meta, reftag, &block) == -1);
+	assert(errno == EILSEQ && block == 2);
+	pi[glen + 1] ^= 1;
+
+	/*
+	 * An application tag of all ones disables checking the block, for
+	 * Type 3 only together with a reference tag of all ones.
+	 */
+	memset(pi + glen, 0xff, 2);
+	pi[0] ^= 0xff;
+	if (fmt->pi_type == NVME_NS_DPS_PI_TYPE3) {
+		assert(test_verify(fmt, data, meta, reftag, &block) == -1);
+		assert(errno == EILSEQ && block == 2);
+		memset(pi + glen + 2, 0xff, tag_bits / 8);
+	}
+	assert(!test_verify(fmt, data, meta, reftag, NULL));
+
+	/* regenerating restores intact protection information */
+	assert(!nvme_pi_generate(fmt, data, meta, TEST_NLB, reftag, 0x5a5a,
+				 0x2b));
+	assert(!test_verify(fmt, data, meta, reftag, NULL));
+
+	free(meta);
+	free(data);
+}
+
+static void test_pi_formats(void)
+{
+	static const __u8 types[] = {
+		NVME_NS_DPS_PI_TYPE1, NVME_NS_DPS_PI_TYPE3,
+	};
+	static const __u8 pifs[] = { NVME_PI_GUARD_16, NVME_PI_GUARD_64 };
+	struct nvme_pi_format fmt = { .lba_size = 512 };
+	int t, g, e, f;
+
+	for (t = 0; t < 2; t++)
+		for (g = 0; g < 2; g++)
+			for (e = 0; e < 2; e++)
+				for (f = 0; f < 2; f++) {
+					fmt.pi_type = types[t];
+					fmt.pif = pifs[g];
+					fmt.ms = pifs[g] == NVME_PI_GUARD_16 ?
+						 16 : 24;
+					fmt.sts = pifs[g] == NVME_PI_GUARD_16 ?
+						 0 : 8;
+					fmt.extended = e;
+					fmt.pi_first = f;
+					test_pi_format(&fmt);
+				}
+
+	fmt.pif = NVME_PI_GUARD_32;
+	errno = 0;
+	assert(nvme_pi_generate(&fmt, (void *)&fmt, (void *)&fmt, 1, 0, 0,
+				0) == -1 && errno == EOPNOTSUPP);
+
+	printf("pi OK\n");
+}
+
+int main(void)
+{
+	if (nvme_pi_crc_use_hw(true))
+		test_crc("clmul");
+	assert(!nvme_pi_crc_use_hw(false));
+	test_crc("table");
+
+	test_pi_formats();
+	nvme_pi_crc_use_hw(true);
+	test_pi_formats();
+
+	return EXIT_SUCCESS;
+}
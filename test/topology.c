@@ -0,0 +1,245 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/**
+ * This file is part of libnvme.
+ *
+ * Readers of published topology generations running concurrently with
+ * nvme_topology_refresh(), on a synthetic sysfs tree. Between refreshes
+ * the ANA state of all paths is flipped, so every generation a reader
+ * takes has to report the same state on all of its paths.
+ */
+
+#undef NDEBUG
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <libnvme.h>
+#include "nvme/private.h"
+
+#define TEST_SUBSYS	4
+#define TEST_CTRLS	2
+#define TEST_PATHS	4
+#define TEST_READERS	8
+#define TEST_REFRESHES	200
+
+/* far from the controllers of the host, whose devices would be opened */
+#define TEST_FIRST_CTRL	900
+
+#define TEST_HOSTID	"2b3e8c52-47a3-4f3c-9a0b-6f67d1d0b2e1"
+#define TEST_HOSTNQN	"nqn.2014-08.org.nvmexpress:uuid:" TEST_HOSTID
+
+static char sysfs_root[] = "/tmp/libnvme-topology-XXXXXX";
+
+static void write_attr(const char *dir, const char *attr, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void write_attr(const char *dir, const char *attr, const char *fmt, ...)
+{
+	char path[PATH_MAX];
+	va_list ap;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	f = fopen(path, "w");
+	assert(f);
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	fputc('\n', f);
+	assert(!fclose(f));
+}
+
+static void make_dir(char *path, size_t len, const char *fmt, ...)
+	__attribute__((format(printf, 3, 4)));
+
+static void make_dir(char *path, size_t len, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(path, len, fmt, ap);
+	va_end(ap);
+	assert(!mkdir(path, 0755));
+}
+
+static void path_dir(char *path, size_t len, int s, int ctrl, int n)
+{
+	snprintf(path, len, "%s/nvme/nvme%d/nvme%dc%dn%d", sysfs_root, ctrl,
+		 s, ctrl, n);
+}
+
+static void make_sysfs(void)
+{
+	char dir[PATH_MAX], sub[PATH_MAX], path[PATH_MAX], link[PATH_MAX + 16];
+	int s, c, n, ctrl = TEST_FIRST_CTRL;
+
+	make_dir(dir, sizeof(dir), "%s/nvme", sysfs_root);
+	make_dir(dir, sizeof(dir), "%s/nvme-subsystem", sysfs_root);
+	make_dir(dir, sizeof(dir), "%s/block", sysfs_root);
+
+	for (s = 0; s < TEST_SUBSYS; s++) {
+		char nqn[64];
+
+		snprintf(nqn, sizeof(nqn), "nqn.2014-08.org.nvmexpress:test:%d",
+			 s);
+		make_dir(sub, sizeof(sub), "%s/nvme-subsystem/nvme-subsys%d",
+			 sysfs_root, s);
+		write_attr(sub, "subsysnqn", "%s", nqn);
+		write_attr(sub, "model", "libnvme test");
+		write_attr(sub, "serial", "TEST%04d", s);
+		write_attr(sub, "firmware_rev", "1.0");
+		write_attr(sub, "subsystype", "nvm");
+
+		for (c = 0; c < TEST_CTRLS; c++, ctrl++) {
+			make_dir(dir, sizeof(dir), "%s/nvme/nvme%d", sysfs_root,
+				 ctrl);
+			write_attr(dir, "subsysnqn", "%s", nqn);
+			write_attr(dir, "hostnqn", TEST_HOSTNQN);
+			write_attr(dir, "hostid", TEST_HOSTID);
+			write_attr(dir, "transport", "tcp");
+			write_attr(dir, "address",
+				   "traddr=10.0.%d.%d,trsvcid=4420", s, c);
+			write_attr(dir, "state", "live");
+			write_attr(dir, "numa_node", "-1");
+			write_attr(dir, "cntrltype", "io");
+
+			snprintf(link, sizeof(link), "%s/nvme%d", sub, ctrl);
+			assert(!symlink(dir, link));
+
+			for (n = 1; n <= TEST_PATHS; n++) {
+				path_dir(path, sizeof(path), s, ctrl, n);
+				assert(!mkdir(path, 0755));
+				write_attr(path, "ana_state", "optimized");
+				write_attr(path, "ana_grpid", "%d", n);
+			}
+		}
+	}
+}
+
+static void set_ana_state(const char *state)
+{
+	char path[PATH_MAX];
+	int s, c, n, ctrl = TEST_FIRST_CTRL;
+
+	for (s = 0; s < TEST_SUBSYS; s++)
+		for (c = 0; c < TEST_CTRLS; c++, ctrl++)
+			for (n = 1; n <= TEST_PATHS; n++) {
+				path_dir(path, sizeof(path), s, ctrl, n);
+				write_attr(path, "ana_state", "%s", state);
+			}
+}
+
+struct reader {
+	pthread_t thread;
+	nvme_topology_t t;
+	bool *stop;
+	unsigned long generations;
+};
+
+/* walks a generation, returns the number of paths */
+static int read_generation(nvme_root_t r)
+{
+	enum nvme_ana_state state, first = NVME_ANA_STATE_CHANGE;
+	int nr_ctrls = 0, nr_paths = 0;
+	nvme_subsystem_t s;
+	nvme_ctrl_t c;
+	nvme_host_t h;
+	nvme_path_t p;
+
+	nvme_for_each_host(r, h) {
+		nvme_for_each_subsystem(h, s) {
+			nvme_subsystem_for_each_ctrl(s, c) {
+				nr_ctrls++;
+				assert(!strcmp(nvme_ctrl_get_state(c), "live"));
+				assert(nvme_ctrl_get_max_xfer_len(c) > 0);
+				nvme_ctrl_for_each_path(c, p) {
+					state = nvme_path_get_ana_group_state(p);
+					if (!nr_paths++)
+						first = state;
+					assert(state == first);
+				}
+			}
+		}
+	}
+	assert(nr_ctrls == TEST_SUBSYS * TEST_CTRLS);
+	assert(first == NVME_ANA_STATE_OPTIMIZED ||
+	       first == NVME_ANA_STATE_NONOPTIMIZED);
+	return nr_paths;
+}
+
+static void *reader_fn(void *arg)
+{
+	struct reader *rd = arg;
+	nvme_root_t r;
+
+	while (!__atomic_load_n(rd->stop, __ATOMIC_ACQUIRE)) {
+		r = nvme_topology_get(rd->t);
+		assert(read_generation(r) ==
+		       TEST_SUBSYS * TEST_CTRLS * TEST_PATHS);
+		nvme_topology_put(r);
+		rd->generations++;
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	char ctrl_dir[PATH_MAX], subsys_dir[PATH_MAX], ns_dir[PATH_MAX];
+	char cmd[PATH_MAX + 16];
+	struct reader readers[TEST_READERS];
+	unsigned long generations = 0;
+	bool stop = false;
+	nvme_topology_t t;
+	int i;
+
+	assert(mkdtemp(sysfs_root));
+	make_sysfs();
+
+	snprintf(ctrl_dir, sizeof(ctrl_dir), "%s/nvme", sysfs_root);
+	snprintf(subsys_dir, sizeof(subsys_dir), "%s/nvme-subsystem",
+		 sysfs_root);
+	snprintf(ns_dir, sizeof(ns_dir), "%s/block", sysfs_root);
+	nvme_ctrl_sysfs_dir = ctrl_dir;
+	nvme_subsys_sysfs_dir = subsys_dir;
+	nvme_ns_sysfs_dir = ns_dir;
+
+	t = nvme_topology_create(NULL, LOG_CRIT, NULL, NULL, NULL);
+	assert(t);
+
+	for (i = 0; i < TEST_READERS; i++) {
+		readers[i].t = t;
+		readers[i].stop = &stop;
+		readers[i].generations = 0;
+		assert(!pthread_create(&readers[i].thread, NULL, reader_fn,
+				       &readers[i]));
+	}
+
+	for (i = 0; i < TEST_REFRESHES; i++) {
+		set_ana_state(i % 2 ? "optimized" : "non-optimized");
+		assert(!nvme_topology_refresh(t));
+	}
+	assert(nvme_topology_get_generation(t) == TEST_REFRESHES + 1);
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELEASE);
+	for (i = 0; i < TEST_READERS; i++) {
+		assert(!pthread_join(readers[i].thread, NULL));
+		generations += readers[i].generations;
+	}
+	nvme_topology_free(t);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", sysfs_root);
+	if (system(cmd))
+		fprintf(stderr, "failed to remove %s\n", sysfs_root);
+
+	printf("%d refreshes, %lu generations read by %d readers\n",
+	       TEST_REFRESHES, generations, TEST_READERS);
+	return EXIT_SUCCESS;
+}
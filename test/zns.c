@@ -60,6 +60,29 @@ static void show_zns_properties(nvme_ns_t n)
 	free(zr);
 }
 
+static void show_zone_states(nvme_ns_t n)
+{
+	nvme_zone_table_t t;
+	const __u8 *states;
+	uint64_t i, nr_open = 0;
+
+	t = nvme_zone_table_create(nvme_ns_get_fd(n), nvme_ns_get_nsid(n), 0);
+	if (!t) {
+		fprintf(stderr, "failed to read zone table\n");
+		return;
+	}
+
+	states = nvme_zone_table_get_states(t);
+	for (i = 0; i < nvme_zone_table_get_nr_zones(t); i++)
+		if (states[i] == NVME_ZNS_ZS_IMPL_OPEN ||
+		    states[i] == NVME_ZNS_ZS_EXPL_OPEN)
+			nr_open++;
+
+	printf("zone_size:%"PRIu64" open_zones:%"PRIu64"\n",
+	       (uint64_t)nvme_zone_table_get_zone_size(t), nr_open);
+	nvme_zone_table_free(t);
+}
+
 int main()
 {
 	nvme_subsystem_t s;
@@ -76,8 +99,10 @@ int main()
 		nvme_for_each_subsystem(h, s) {
 			nvme_subsystem_for_each_ctrl(s, c) {
 				nvme_ctrl_for_each_ns(c, n) {
-					if (nvme_ns_get_csi(n) == NVME_CSI_ZNS)
+					if (nvme_ns_get_csi(n) == NVME_CSI_ZNS) {
 						show_zns_properties(n);
+						show_zone_states(n);
+					}
 				}
 			}
 			nvme_subsystem_for_each_ns(s, n) {